@@ -4,6 +4,9 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include "core/common.h"
+#include "utils/regex_set.h"
+#include "utils/ip_tree.h"
+#include "utils/str_match.h"
 #ifdef USE_PCRE
 #include <pcre.h>
 #endif
@@ -33,6 +36,8 @@ struct stream;
 #define ACL_SET_PATH           0x0400
 #define ACL_SET_QUERY          0x0800
 
+#define ACL_PAT_F_IPV6         0x0001      /* val.ipv6 rather than val.ipv4 */
+
 typedef enum {
     ACL_MATCH_FOUND,
     ACL_MATCH_BOOL,
@@ -66,6 +71,7 @@ typedef struct acl_pattern {
             int len;
         } str;
         struct {
+            regex_set_t *set;       /* NULL when only PCRE takes the pattern */
 #ifdef USE_PCRE
             pcre *regex;
             pcre_extra *extra;
@@ -104,6 +110,14 @@ typedef struct acl_expr {
     struct eb_root pattern_tree;
     acl_match_t match_type;
     int flags;
+    /* Every regex_set backed pattern of a regex keyword, in list order,
+     * for acl_expr_match to test them all in one scan */
+    regex_set_t *reg_set;
+    /* The patterns of address and string keywords compiled together, for
+     * a lookup that does not grow with their number; NULL when compiling
+     * failed and the list is walked instead */
+    ip_tree_t *ip_tree;
+    str_match_t *str_match;
     struct acl_expr *next;
 } acl_expr_t;
 
@@ -202,6 +216,9 @@ acl_t* acl_find(struct list *head, const char *name);
 acl_expr_t* acl_expr_parse(const char **args, char **err);
 acl_cond_t* acl_cond_parse(const char **args, struct list *known_acl, char **err);
 
+/* Whether any of the expression's patterns matches the sample */
+int acl_expr_match(acl_expr_t *expr, struct sample *smp);
+
 int acl_exec_cond(acl_cond_t *cond, struct proxy *px, struct session *sess,
                   struct stream *strm, unsigned int opt);
 
@@ -7,6 +7,7 @@
 #include <pthread.h>
 #include <zlib.h>
 #include "core/common.h"
+#include "cache/cache_disk.h"
 
 struct stream;
 struct channel;
@@ -23,10 +24,36 @@ struct http_txn;
 #define CACHE_F_S_MAXAGE      0x00000100
 #define CACHE_F_COMPRESSED    0x00000200
 #define CACHE_F_BROTLI        0x00000400
+#define CACHE_F_ON_DISK       0x00000800  /* promoted from the disk tier */
+#define CACHE_F_VARY_MARKER   0x00001000  /* base key entry naming the Vary headers */
+
+/* Encoded copies kept per entry, indexed by COMP_TYPE_*; identity is data */
+#define CACHE_ENC_MAX         (COMP_TYPE_BROTLI + 1)
+#define CACHE_COMP_MIN_SIZE   256   /* smaller bodies are always sent as is */
+
+/*
+ * A key is an opaque byte span with its hash computed once. Request keys
+ * are built as length-prefixed fields in a cache_key_buf_t on the caller's
+ * stack, so neither building nor looking one up allocates; comparisons
+ * check the hash and length before touching the bytes.
+ */
+#define CACHE_KEY_MAX         4096
+
+typedef struct cache_key {
+    const char *ptr;
+    uint32_t len;
+    uint64_t hash;
+} cache_key_t;
+
+typedef struct cache_key_buf {
+    uint32_t len;
+    char data[CACHE_KEY_MAX];
+} cache_key_buf_t;
 
 typedef struct cache_entry {
-    char *key;
-    uint32_t key_hash;
+    char *key;                /* copy of the key bytes, NUL-terminated */
+    uint32_t key_len;
+    uint64_t key_hash;
 
     struct {
         char *ptr;
@@ -43,50 +70,140 @@ typedef struct cache_entry {
     uint32_t flags;
     time_t created;
     time_t expires;
-    time_t last_access;
-    uint32_t access_count;
     uint32_t size;
+    _Atomic bool referenced;  /* CLOCK bit, set by every hit */
+    _Atomic uint32_t refs;    /* the cache's own while stored, plus one per holder */
+
+    /* RFC 5861: seconds past expires the entry may still be served,
+     * while it is refreshed or while the origin fails */
+    uint32_t stale_while_revalidate;
+    uint32_t stale_if_error;
+    _Atomic bool refreshing;    /* queued or in flight on the refresh thread */
+    _Atomic bool origin_error;  /* the last refresh failed */
 
     char *etag;
     time_t last_modified;
     char *vary;
 
+    /* Encoded copies of data, made once at store time or on first demand.
+     * The encoder that claims a type publishes it by setting its ready bit;
+     * a copy that would not shrink data is published with ptr NULL. */
+    struct {
+        char *ptr;
+        size_t len;
+    } variants[CACHE_ENC_MAX];
+    _Atomic uint32_t variants_claimed;
+    _Atomic uint32_t variants_ready;
+
     pthread_rwlock_t lock;
 
     struct cache_entry *hash_next;
-    struct cache_entry *lru_prev;
-    struct cache_entry *lru_next;
+    struct cache_entry *clock_prev;
+    struct cache_entry *clock_next;
 } cache_entry_t;
 
+/*
+ * The store is split into independent shards picked by the top bits of the
+ * key hash. A hit takes only its bucket lock and sets the entry's reference
+ * bit; inserts and evictions take the shard lock, which guards the CLOCK
+ * ring and the shard's share of max_size.
+ */
+#define CACHE_SHARD_BITS     4
+#define CACHE_SHARDS         (1u << CACHE_SHARD_BITS)
+#define CACHE_SHARD_BUCKETS  1024  /* power of two */
+
+/*
+ * Collapsed forwarding: the first miss on a key leaves a fill in its bucket
+ * and goes to the origin, later misses queue a waiter on it. The response
+ * arriving through cache_insert (or cache_fill_abort) wakes them all.
+ */
+struct cache_waiter;
+typedef void (*cache_wake_fn)(struct cache_waiter *w, cache_entry_t *entry);
+
+typedef struct cache_waiter {
+    cache_wake_fn wake;       /* entry NULL: not in RAM, fetch it yourself;
+                               * otherwise a reference to put */
+    void *arg;
+    struct cache_waiter *next;
+} cache_waiter_t;
+
+typedef struct cache_fill {
+    char *key;
+    uint32_t key_len;
+    uint64_t key_hash;
+    uint64_t started_ms;      /* a fill older than fill_timeout_ms is taken over */
+    cache_waiter_t *waiters;
+    struct cache_fill *next;
+} cache_fill_t;
+
+typedef struct cache_bucket {
+    cache_entry_t *head;
+    cache_fill_t *fills;
+    pthread_spinlock_t lock;
+} cache_bucket_t;
+
+typedef struct cache_shard {
+    pthread_spinlock_t lock;
+    cache_entry_t *hand;      /* next eviction candidate, NULL when empty */
+    uint32_t max_size;
+    uint32_t current_size;
+    uint32_t entry_count;
+
+    _Atomic uint64_t hits;
+    _Atomic uint64_t misses;
+    _Atomic uint64_t bytes_out;
+
+    cache_bucket_t buckets[CACHE_SHARD_BUCKETS];
+} __attribute__((aligned(64))) cache_shard_t;
+
+/*
+ * Background refresh: fetch a key from the origin, sending the extra
+ * request headers in cond (If-None-Match / If-Modified-Since). Returns
+ * the origin's status: 304 keeps the stored entry, 2xx hands a new one
+ * in *fresh (owned by the cache from then on), anything else is an error.
+ * Runs on the cache's refresh thread, so it may block.
+ */
+typedef int (*cache_fetch_fn)(void *arg, const cache_key_t *key, const char *cond, size_t cond_len,
+                              cache_entry_t **fresh);
+
+#define CACHE_REFRESH_QUEUE  1024  /* pending refreshes; more are dropped until a slot frees */
+
 typedef struct cache {
     char *name;
     uint32_t max_size;
-    uint32_t current_size;
     uint32_t max_object_size;
     uint32_t max_age;
-    uint32_t entry_count;
-    uint32_t max_entries;
+    uint32_t fill_timeout_ms;
 
-    struct {
-        cache_entry_t **table;
-        uint32_t size;
-        uint32_t mask;
-        pthread_spinlock_t *locks;
-    } hash;
+    uint32_t precompress;     /* 1 << COMP_TYPE_* encoded at store time, others lazily */
+    int gzip_level;
+    int brotli_quality;
+
+    cache_shard_t *shards;
+    cache_disk_t *disk;       /* optional second tier, NULL when RAM only */
 
     struct {
-        cache_entry_t *head;
-        cache_entry_t *tail;
-        pthread_spinlock_t lock;
-    } lru;
+        cache_fetch_fn fetch;     /* NULL: stale entries are plain misses */
+        void *arg;
+        pthread_t thread;
+        bool running;
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        cache_key_t queue[CACHE_REFRESH_QUEUE];  /* ptr owned by the queue */
+        uint32_t head;
+        uint32_t tail;
+    } refresh;
 
+    /* Hit path counters live in the shards, see cache_read_stats */
     struct {
-        _Atomic uint64_t hits;
-        _Atomic uint64_t misses;
         _Atomic uint64_t inserts;
         _Atomic uint64_t evictions;
         _Atomic uint64_t bytes_in;
-        _Atomic uint64_t bytes_out;
+        _Atomic uint64_t collapsed;   /* misses that waited on a fill */
+        _Atomic uint64_t stale_hits;
+        _Atomic uint64_t refreshes;   /* 304 or new body from the refresh thread */
+        _Atomic uint64_t refresh_errors;
+        _Atomic uint64_t refresh_dropped;
     } stats;
 
     uint32_t flags;
@@ -111,10 +228,49 @@ typedef struct compression_ctx {
 cache_t* cache_create(const char *name, uint32_t max_size, uint32_t max_object_size);
 void cache_destroy(cache_t *cache);
 
+/*
+ * The _key calls take a prepared key; the others are shorthand for a plain
+ * string key and hash it on every call. An entry a lookup returns holds a
+ * reference, so a replacement or eviction meanwhile cannot free it under
+ * the caller; give it back with cache_entry_put once done serving it.
+ */
+cache_entry_t* cache_lookup_key(cache_t *cache, const cache_key_t *key);
 cache_entry_t* cache_lookup(cache_t *cache, const char *key);
+/* An expired entry still inside its stale-if-error window, for a caller
+ * whose own origin fetch just failed */
+cache_entry_t* cache_lookup_stale_key(cache_t *cache, const cache_key_t *key);
+cache_entry_t* cache_lookup_stale(cache_t *cache, const char *key);
+/* Serve stale-while-revalidate hits and refresh them through fetch */
+int cache_start_refresh(cache_t *cache, cache_fetch_fn fetch, void *arg);
+
+#define CACHE_HIT         0
+#define CACHE_MISS_FETCH  1   /* go to the origin, then cache_insert or cache_fill_abort */
+#define CACHE_MISS_WAIT   2   /* w queued; wake runs once unless cancelled first */
+
+int cache_lookup_collapsed_key(cache_t *cache, const cache_key_t *key, cache_waiter_t *w,
+                               cache_entry_t **entry);
+int cache_lookup_collapsed(cache_t *cache, const char *key, cache_waiter_t *w, cache_entry_t **entry);
+/* The fetch for key produced nothing cacheable; waiters go to the origin */
+void cache_fill_abort_key(cache_t *cache, const cache_key_t *key);
+void cache_fill_abort(cache_t *cache, const char *key);
+/* Give up waiting (the caller's timeout). False when wake already ran or
+ * is about to, from the completing thread. */
+bool cache_waiter_cancel_key(cache_t *cache, const cache_key_t *key, cache_waiter_t *w);
+bool cache_waiter_cancel(cache_t *cache, const char *key, cache_waiter_t *w);
+/* On success the cache owns entry; the caller keeps no reference to it */
+int cache_insert_key(cache_t *cache, const cache_key_t *key, cache_entry_t *entry);
 int cache_insert(cache_t *cache, const char *key, cache_entry_t *entry);
+void cache_entry_put(cache_entry_t *entry);
+void cache_delete_key(cache_t *cache, const cache_key_t *key);
 void cache_delete(cache_t *cache, const char *key);
 void cache_purge(cache_t *cache);
+/* Evicted entries are demoted to the disk tier, larger objects go there
+ * directly, and RAM misses that hit it are promoted */
+int cache_attach_disk(cache_t *cache, const char *path, uint64_t size, uint32_t max_object_size);
+/* Disk hits too large for RAM, to be sent with cache_disk_sendfile */
+int cache_lookup_disk_key(cache_t *cache, const cache_key_t *key, cache_disk_obj_t *obj);
+int cache_lookup_disk(cache_t *cache, const char *key, cache_disk_obj_t *obj);
+void cache_read_stats(const cache_t *cache, uint64_t *hits, uint64_t *misses, uint64_t *bytes_out);
 
 int cache_check_request(struct stream *s, struct channel *req, struct channel *res);
 int cache_check_response(struct stream *s, struct channel *res);
@@ -124,12 +280,19 @@ bool cache_entry_is_valid(cache_entry_t *entry);
 bool cache_entry_is_fresh(cache_entry_t *entry, time_t now);
 int cache_entry_needs_revalidation(cache_entry_t *entry);
 
-uint32_t cache_hash_key(const char *key);
-char* cache_build_key(struct http_txn *txn);
-char* cache_build_vary_key(struct http_txn *txn, const char *vary);
+/* 64-bit wyhash of len bytes */
+uint64_t cache_hash_key(const void *data, size_t len);
+/* Point key at len bytes owned by the caller and hash them */
+void cache_key_init(cache_key_t *key, const char *ptr, size_t len);
+/* Append one [u16 length][bytes] field; -1 when buf is full */
+int cache_key_append(cache_key_buf_t *buf, const char *field, size_t len);
+/* Build into buf and point key at it; -1 when it does not fit */
+int cache_build_key(struct http_txn *txn, cache_key_buf_t *buf, cache_key_t *key);
+int cache_build_vary_key(struct http_txn *txn, const char *vary, cache_key_buf_t *buf, cache_key_t *key);
 
-void cache_update_lru(cache_t *cache, cache_entry_t *entry);
-void cache_evict_lru(cache_t *cache);
+/* Body in the encoding the client negotiated, or identity when that one
+ * cannot be had (yet). Returns the encoding of *ptr. */
+int cache_entry_variant(cache_t *cache, cache_entry_t *entry, int enc, const char **ptr, size_t *len);
 
 int compression_init(compression_ctx_t *ctx, int type, int level);
 int compression_process(compression_ctx_t *ctx, struct buffer *in, struct buffer *out, int flags);
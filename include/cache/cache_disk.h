@@ -0,0 +1,133 @@
+#ifndef CACHE_CACHE_DISK_H
+#define CACHE_CACHE_DISK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+struct cache_entry;
+
+/*
+ * Second cache tier: a memory-mapped slab file used as a ring. Objects are
+ * appended at the write head and the oldest are overwritten when it comes
+ * round again. Each record carries a self-describing header, so the
+ * in-memory index is rebuilt at startup by hopping from one header to
+ * the next, and a restart comes up warm.
+ *
+ * Records and index entries are named by a logical position. The physical
+ * offset is pos % size, and a record is intact while head <= pos + size.
+ * Entries within the guard span ahead of the head are dropped from the
+ * index, which leaves readers time to copy or sendfile them.
+ */
+#define CACHE_DISK_MAGIC     0x55424331u  /* "UBC1" */
+#define CACHE_DISK_VERSION   1
+#define CACHE_DISK_SUPER     4096         /* superblock, before the ring */
+#define CACHE_DISK_ALIGN     512          /* records start on this boundary */
+
+#define CACHE_DISK_F_TOMBSTONE  0x0001    /* cache_delete, survives restarts */
+
+typedef struct cache_disk_rec {
+    uint32_t magic;
+    uint32_t crc;           /* header only, computed with crc = 0 */
+    uint64_t pos;
+    uint64_t data_len;
+    int64_t created;
+    int64_t expires;
+    int64_t last_modified;
+    uint32_t key_hash;
+    uint32_t flags;         /* CACHE_F_* of the entry */
+    uint16_t rec_flags;     /* CACHE_DISK_F_* */
+    uint16_t status;
+    uint16_t key_len;
+    uint16_t etag_len;
+    uint16_t vary_len;
+    uint16_t pad[3];
+    /* key, etag, vary and then the body follow */
+} cache_disk_rec_t;
+
+typedef struct cache_disk_super {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;          /* ring bytes after the superblock */
+    uint32_t max_record;    /* bounds the resync scan at startup */
+    uint32_t pad;
+    uint64_t purge_pos;     /* records before it were purged */
+} cache_disk_super_t;
+
+typedef struct cache_disk_idx {
+    uint64_t pos;
+    uint32_t key_hash;
+    uint32_t rec_len;
+    time_t expires;
+    struct cache_disk_idx *hash_next;
+    struct cache_disk_idx *fifo_next;   /* position order, oldest first */
+} cache_disk_idx_t;
+
+typedef struct cache_disk {
+    char *path;
+    int fd;
+    char *map;              /* whole file, superblock included */
+    char *ring;
+    uint64_t size;
+    uint64_t guard;
+    uint32_t max_record;    /* header, strings and body, aligned */
+
+    _Atomic uint64_t head;  /* logical position of the next record */
+
+    /* Index of live records; oldest first on the FIFO so that advancing the
+     * head drops entries from its front */
+    pthread_mutex_t lock;
+    cache_disk_idx_t **table;
+    uint32_t mask;
+    cache_disk_idx_t *fifo_head;
+    cache_disk_idx_t *fifo_tail;
+    uint64_t count;
+
+    pthread_mutex_t write_lock;  /* one writer copies into the ring at a time */
+
+    struct {
+        _Atomic uint64_t hits;
+        _Atomic uint64_t misses;
+        _Atomic uint64_t stores;
+        _Atomic uint64_t overwritten;   /* lost to the head while in use */
+        _Atomic uint64_t bytes_in;
+        _Atomic uint64_t bytes_out;
+    } stats;
+} cache_disk_t;
+
+/* A hit: valid until the head passes it, check with cache_disk_intact */
+typedef struct cache_disk_obj {
+    uint64_t pos;
+    const cache_disk_rec_t *rec;
+    const char *body;
+    off_t body_off;         /* in the file, for sendfile */
+    uint64_t len;
+} cache_disk_obj_t;
+
+/* Open or create the slab file; one that does not match size and
+ * max_object_size is reformatted */
+cache_disk_t* cache_disk_open(const char *path, uint64_t size, uint32_t max_object_size);
+void cache_disk_close(cache_disk_t *disk);
+
+int cache_disk_store(cache_disk_t *disk, const struct cache_entry *entry);
+int cache_disk_delete(cache_disk_t *disk, const char *key, size_t key_len, uint32_t hash);
+void cache_disk_purge(cache_disk_t *disk);
+
+/* 0 and obj filled on a fresh hit, -1 otherwise. Keys are byte spans,
+ * hash the low half of the cache's 64-bit key hash. */
+int cache_disk_lookup(cache_disk_t *disk, const char *key, size_t key_len, uint32_t hash,
+                      cache_disk_obj_t *obj);
+bool cache_disk_contains(cache_disk_t *disk, const char *key, size_t key_len, uint32_t hash);
+bool cache_disk_intact(cache_disk_t *disk, const cache_disk_obj_t *obj);
+/* Heap copy of a hit for the RAM tier; NULL if it was overwritten meanwhile */
+struct cache_entry* cache_disk_load(cache_disk_t *disk, const cache_disk_obj_t *obj);
+/*
+ * Send the body from *sent onwards to a plain socket. Returns 1 once all
+ * of it went out, 0 when out_fd would block, -1 on error or when the
+ * record was overwritten during the send (the connection must be closed).
+ */
+int cache_disk_sendfile(cache_disk_t *disk, const cache_disk_obj_t *obj, int out_fd, uint64_t *sent);
+
+#endif
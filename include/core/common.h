@@ -92,6 +92,8 @@ struct global {
         uint32_t ssl_lifetime;
     } tune;
     char *ssl_default_bind_ciphers;
+    char *ssl_engine;
+    int ssl_mode_async;
 };
 
 extern struct global global;
@@ -111,6 +113,7 @@ static inline unsigned int tick_add(unsigned int t, unsigned int d) {
 #define CO_FL_ERROR         0x00000008
 #define CO_FL_SOCK_RD_SH    0x00000010
 #define CO_FL_SOCK_WR_SH    0x00000020
+#define CO_FL_WAIT_ASYNC    0x00000040  // TLS op parked on an async crypto job
 
 // Session flags
 #define SF_ERR_SRVTO        0x00000001
@@ -141,6 +144,7 @@ static inline unsigned int tick_add(unsigned int t, unsigned int d) {
 
 // Listener options
 #define LI_O_SSL            0x00000001
+#define LI_O_KTLS           0x00000002
 
 // Server states
 #define SRV_RUNNING         0x0001
@@ -2,50 +2,103 @@
 #define CORE_CONNECTION_POOL_HPP
 
 #include <vector>
-#include <queue>
 #include <memory>
 #include <atomic>
 #include <mutex>
 #include <condition_variable>
+#include <thread>
 #include <chrono>
 #include <functional>
 #include <unordered_map>
 
 #include "core/common.h"
 #include "core/proxy.h"
+#include "core/liveness.hpp"
 
 namespace ultrabalancer {
 
+class ConnectionPool;
+struct IdleList;
+
 class Connection {
 public:
-    Connection(int fd, const sockaddr_storage& addr);
+    Connection(int fd, const sockaddr_storage& addr, LivenessWatcher* watcher = nullptr);
     ~Connection();
 
+    Connection(const Connection&) = delete;
+    Connection& operator=(const Connection&) = delete;
+
     bool is_alive() const;
     void reset();
     int get_fd() const { return fd_; }
     std::chrono::steady_clock::time_point last_used() const { return last_used_; }
 
 private:
+    friend class ConnectionPool;
+
     int fd_;
     sockaddr_storage addr_;
     mutable std::atomic<bool> alive_;
     std::chrono::steady_clock::time_point last_used_;
+
+    LivenessWatcher* watcher_;
+    uint32_t watch_slot_;
+
+    // Pool bookkeeping: the server it was dialled for, its shared idle
+    // list, and the links of whichever idle list holds it
+    const server_t* server_ = nullptr;
+    IdleList* home_ = nullptr;
+    Connection* idle_prev_ = nullptr;
+    Connection* idle_next_ = nullptr;
 };
 
+struct IdleList {
+    Connection* head = nullptr;
+    Connection* tail = nullptr;
+    size_t count = 0;
+};
+
+/*
+ * Idle connections sit on intrusive lists, so pooling one allocates
+ * nothing. A thread first keeps the connections it releases in a small
+ * LIFO of its own, behind a lock only the sweeps ever contend for; the
+ * rest go to a list per server under mutex_.
+ *
+ * Liveness comes from a LivenessWatcher rather than from probing: a socket
+ * the backend closes is flagged by the watcher thread, which then unlinks
+ * it from wherever it idles.
+ *
+ * With a min_idle, a maintainer thread keeps that many connections on the
+ * shared list of each server passed to warm() while it is UP. It opens at
+ * most kWarmBatch per server an interval, so a server coming back is not
+ * met by a burst of connects, and drops a server's idle connections when
+ * it goes down.
+ */
 class ConnectionPool {
 public:
-    ConnectionPool(size_t max_size, size_t max_idle);
+    static constexpr size_t kThreadCaches = 64;     // threads beyond share the lists only
+    static constexpr uint32_t kThreadCacheSize = 8;
+    static constexpr uint32_t kWarmBatch = 4;
+    static constexpr auto kMaintainInterval = std::chrono::milliseconds(100);
+
+    ConnectionPool(size_t max_size, size_t max_idle, size_t min_idle = 0);
     ~ConnectionPool();
 
-    std::shared_ptr<Connection> acquire(const server_t* server);
-    void release(std::shared_ptr<Connection> conn);
+    std::unique_ptr<Connection> acquire(const server_t* server);
+    void release(std::unique_ptr<Connection> conn);
+
+    // For callers that only hold the fd; -1 when no connection is available
+    int acquire_fd(const server_t* server);
+    void release_fd(int fd);
+
+    // Starts keeping min_idle connections open to server
+    void warm(const server_t* server);
 
     void set_health_check(std::function<bool(Connection*)> checker);
     void cleanup_idle(std::chrono::seconds idle_timeout);
 
     size_t active_connections() const { return active_; }
-    size_t idle_connections() const { return idle_queue_.size(); }
+    size_t idle_connections() const { return idle_count_.load(std::memory_order_relaxed); }
 
 private:
     struct ServerKey {
@@ -64,17 +117,54 @@ private:
         }
     };
 
+    struct alignas(64) ThreadCache {
+        std::mutex lock;
+        Connection* head = nullptr;
+        uint32_t count = 0;
+    };
+
+    ThreadCache* thread_cache();
+    Connection* pop_cached(ThreadCache* cache, const server_t* server);
+    Connection* pop_shared(const server_t* server);
+    void push_shared(IdleList* list, Connection* conn);
+    void unlink(IdleList* list, Connection* conn);
+    template<typename Pred> Connection* unlink_if(Pred pred);
+    static void delete_chain(Connection* chain);
+    void sweep_dead();
+    void maintain_server(const server_t* server, IdleList* list, bool& up);
+    void maintain();
+
     size_t max_size_;
     size_t max_idle_;
+    size_t min_idle_;
     std::atomic<size_t> active_;
+    std::atomic<size_t> idle_count_{0};
 
     mutable std::mutex mutex_;
     std::condition_variable cv_;
 
-    std::unordered_map<ServerKey, std::queue<std::shared_ptr<Connection>>, ServerKeyHash> idle_queue_;
+    // Node based, so a connection's home_ stays valid as servers are added
+    std::unordered_map<ServerKey, IdleList, ServerKeyHash> idle_lists_;
+    std::unordered_map<int, Connection*> lent_;      // acquire_fd
+    std::unique_ptr<ThreadCache[]> thread_caches_;
     std::function<bool(Connection*)> health_checker_;
 
-    std::shared_ptr<Connection> create_connection(const server_t* server);
+    struct Warmed {
+        const server_t* server;
+        IdleList* list;
+        bool up;                // as the maintainer last saw it
+    };
+    std::vector<Warmed> warmed_;                    // under mutex_
+
+    std::thread maintainer_;                        // started by the first warm()
+    std::mutex maintain_mutex_;
+    std::condition_variable maintain_cv_;
+    bool stopping_ = false;
+
+    std::unique_ptr<Connection> create_connection(const server_t* server);
+
+    // Declared last so it goes first: its thread calls sweep_dead
+    LivenessWatcher watcher_;
 };
 
 class ConnectionManager {
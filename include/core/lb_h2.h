@@ -0,0 +1,125 @@
+#ifndef LB_H2_H
+#define LB_H2_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "lb_types.h"
+#include "lb_hpack.h"
+
+// HTTP/2 frontend (RFC 9113, prior knowledge only). The protocol side does
+// no I/O: client bytes go in through lb_h2_feed, frames come out through
+// ops->send, and every stream is translated to one HTTP/1.1 exchange that
+// the relay carries over its own backend connection.
+#define LB_H2_MAX_STREAMS  128    // SETTINGS_MAX_CONCURRENT_STREAMS
+#define LB_H2_FRAME_MAX    16384  // SETTINGS_MAX_FRAME_SIZE, left at its default
+#define LB_H2_WINDOW       65535  // initial flow-control window, both ways
+#define LB_H2_PREFACE_LEN  24
+#define LB_H2_RESET_IDS    LB_H2_MAX_STREAMS  // reset streams remembered for late HEADERS
+
+typedef struct lb_h2_stream {
+    uint32_t id;          // 0 while the slot is free
+    bool end_remote;      // client sent END_STREAM
+    bool end_local;
+    bool head_req;        // HEAD: the response has no body
+    bool req_chunked;     // request body re-framed as chunked
+    bool released;        // ops->release already called
+    bool rsp_started;     // HEADERS sent to the client
+    bool rsp_done;        // whole response parsed, END_STREAM may follow
+    bool rsp_keepalive;
+    int32_t send_window;
+    uint32_t recv_unacked;  // DATA bytes not yet given back to the client
+    bool window_held;       // relay asked to hold them until lb_h2_drained
+
+    // Upstream response: head bytes until it is complete, then how the
+    // body is delimited; body bytes the windows did not admit wait in stash
+    uint8_t rsp_state;
+    uint64_t rsp_remaining;
+    char* rsp_head;
+    size_t rsp_head_len;
+    uint8_t* stash;
+    size_t stash_len;
+    size_t stash_cap;
+
+    // Backend side, owned by the relay (lb_net.c)
+    int fd;
+    backend_t* backend;
+    epoll_data_wrapper_t wrapper;
+    uint32_t events;
+    lb_wqueue_t to_backend;
+} lb_h2_stream_t;
+
+typedef struct lb_h2_ops {
+    // HTTP/1.1 request head for a new stream; -1 answers it with a 503
+    int (*request)(void* ctx, lb_h2_stream_t* st, const char* head, size_t len);
+    // Request body bytes, already framed for HTTP/1.1. Returning 1 holds
+    // the stream's window until lb_h2_drained; -1 fails the stream.
+    int (*request_body)(void* ctx, lb_h2_stream_t* st, const uint8_t* data, size_t len);
+    int (*send)(void* ctx, const uint8_t* data, size_t len);
+    // The stream no longer needs its backend connection
+    void (*release)(void* ctx, lb_h2_stream_t* st, bool reusable);
+} lb_h2_ops_t;
+
+typedef struct lb_h2 {
+    const lb_h2_ops_t* ops;
+    void* ctx;
+    uint8_t state;
+    uint32_t last_stream_id;
+    uint32_t active;
+    int32_t send_window;
+    int32_t peer_initial_window;
+    uint32_t peer_max_frame;
+    uint32_t recv_unacked;
+
+    // Header block spread over HEADERS and CONTINUATION frames
+    uint32_t cont_stream;
+    bool cont_end_stream;
+    size_t hblock_len;
+    uint8_t hblock[HTTP_HEADER_MAX];
+
+    // Streams this side reset or refused, newest last; the client may
+    // have sent HEADERS on them before it saw the RST_STREAM
+    uint32_t reset_ids[LB_H2_RESET_IDS];
+    uint32_t reset_next;
+
+    // Frame split across reads
+    size_t in_len;
+    uint8_t in[9 + LB_H2_FRAME_MAX];
+
+    // Frames built during one call, handed to ops->send at its end
+    uint8_t* out;
+    size_t out_len;
+    size_t out_cap;
+
+    lb_hpack_t hpack;
+    lb_h2_stream_t streams[LB_H2_MAX_STREAMS];
+} lb_h2_t;
+
+lb_h2_t* lb_h2_create(const lb_h2_ops_t* ops, void* ctx);
+// Frees protocol state only; the relay closes stream backends first
+void lb_h2_destroy(lb_h2_t* h2);
+// True while data could still turn out to be the client connection preface
+bool lb_h2_preface_prefix(const uint8_t* data, size_t len);
+// Queue the server SETTINGS; the preface itself arrives through lb_h2_feed
+int lb_h2_start(lb_h2_t* h2);
+
+// All of these return -1 once the connection has to be closed (a GOAWAY
+// has then been sent where it still could be)
+int lb_h2_feed(lb_h2_t* h2, const uint8_t* data, size_t len);
+// Bytes read from st's backend, and the end of that stream (EOF or error)
+int lb_h2_response(lb_h2_t* h2, lb_h2_stream_t* st, const uint8_t* data, size_t len);
+int lb_h2_response_end(lb_h2_t* h2, lb_h2_stream_t* st, bool error);
+// st's request bytes were delivered: give the client its window back
+int lb_h2_drained(lb_h2_t* h2, lb_h2_stream_t* st);
+
+// The relay may read st's backend: nothing is waiting for window
+static inline bool lb_h2_stream_readable(const lb_h2_stream_t* st) {
+    return st->id != 0 && !st->rsp_done && st->stash_len == 0;
+}
+
+static inline bool lb_h2_idle(const lb_h2_t* h2) {
+    return h2->active == 0;
+}
+
+#endif
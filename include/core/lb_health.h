@@ -3,6 +3,13 @@
 
 #include "lb_types.h"
 
+// The checker runs every backend's probe from one event loop
+#define LB_HEALTH_MAX_INFLIGHT  512   // probes with a socket open at once
+#define LB_HEALTH_TIMEOUT_MS    2000  // connect to verdict, capped by the interval
+#define LB_HEALTH_BUSY_MS       10    // retry delay while at the inflight cap
+#define LB_HEALTH_BUF_SIZE      1024  // request, and response bytes judged
+#define LB_HEALTH_EVENTS        256
+
 void* health_check_thread(void* arg);
 void* stats_thread(void* arg);
 void check_backend_health(loadbalancer_t* lb, backend_t* backend);
@@ -0,0 +1,47 @@
+#ifndef LB_HPACK_H
+#define LB_HPACK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// HPACK header compression (RFC 7541) for the HTTP/2 frontend. The decoder
+// mirrors the client's dynamic table; the encoder only emits literals that
+// are never indexed, so responses need no encoder state at all.
+#define LB_HPACK_TABLE_SIZE  4096  // SETTINGS_HEADER_TABLE_SIZE, left at its default
+#define LB_HPACK_STRING_MAX  8192  // longest decoded name or value
+
+typedef struct lb_hpack_entry {
+    uint16_t off;        // into data, name followed by value
+    uint16_t name_len;
+    uint16_t value_len;
+} lb_hpack_entry_t;
+
+// Entries are kept oldest first; evicting compacts data, which is cheap
+// at this table size
+typedef struct lb_hpack {
+    uint32_t max_size;   // set by the last dynamic table size update
+    uint32_t size;       // RFC size: name + value + 32 per entry
+    uint32_t count;
+    uint32_t used;       // bytes of data in use
+    lb_hpack_entry_t ent[LB_HPACK_TABLE_SIZE / 32];
+    char data[LB_HPACK_TABLE_SIZE];
+} lb_hpack_t;
+
+typedef int (*lb_hpack_emit_fn)(void* arg, const char* name, size_t name_len,
+                                const char* value, size_t value_len);
+
+void lb_hpack_init(lb_hpack_t* hp);
+// Decode one complete header block, calling emit for every field in order.
+// Returns -1 on a compression error (the connection must then be closed)
+// or whatever non-zero value emit returned.
+int lb_hpack_decode(lb_hpack_t* hp, const uint8_t* in, size_t len, lb_hpack_emit_fn emit, void* arg);
+
+// Append one field as a literal never added to the peer's table. Return the
+// bytes written, or -1 when out has less than room.
+ssize_t lb_hpack_encode(uint8_t* out, size_t room, const char* name, size_t name_len,
+                        const char* value, size_t value_len);
+ssize_t lb_hpack_encode_status(uint8_t* out, size_t room, int status);
+
+#endif
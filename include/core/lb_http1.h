@@ -0,0 +1,36 @@
+#ifndef LB_HTTP1_H
+#define LB_HTTP1_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Streaming HTTP/1.x message framer. It never copies or modifies the
+// relayed bytes; it only tracks where each request or response ends so the
+// relay knows when an upstream connection sits between messages.
+typedef struct lb_http1 {
+    uint8_t state;
+    uint8_t header;     // recognised header on the current line
+    uint8_t len;        // bytes held in line
+    bool response;
+    bool chunked;       // chunked is the final transfer coding
+    bool has_te;
+    bool has_length;
+    bool keepalive;     // last message allows the connection to be reused
+    bool noreuse;       // sticky: framing lost or connection changes protocol
+    uint16_t status;
+    uint64_t remaining; // body or chunk bytes still to come
+    uint32_t messages;  // complete messages seen
+    char line[64];      // start line or header name/value prefix
+} lb_http1_t;
+
+void lb_http1_init(lb_http1_t* h, bool response);
+// Returns -1 once the stream can no longer be framed (noreuse is then set)
+int lb_http1_feed(lb_http1_t* h, const uint8_t* data, size_t len);
+// Like lb_http1_feed but stops after the first message that completes;
+// returns the bytes consumed, -1 once the stream can no longer be framed
+ssize_t lb_http1_feed_message(lb_http1_t* h, const uint8_t* data, size_t len);
+bool lb_http1_idle(const lb_http1_t* h);
+
+#endif
@@ -3,41 +3,162 @@
 
 #include "lb_types.h"
 #include <stddef.h>
+#include <time.h>
+
+// Pool allocations are rounded up to a size class: 16 byte steps to 128,
+// then four classes per power of two up to MEMORY_CLASS_MAX. Each thread
+// keeps a magazine of free blocks per class and pool, refilled from and
+// returned to the pool's depot a batch at a time, so the lock is taken
+// once per batch. Larger blocks are reused only at their exact size. Up to
+// MEMORY_POOL_THREADS threads at a time get magazines, emptied back into
+// the depots when the thread exits; others go through the depot block by
+// block.
+#define MEMORY_CLASS_COUNT   44
+#define MEMORY_CLASS_MAX     65536
+#define MEMORY_POOL_THREADS  256
 
 typedef struct memory_chunk {
     size_t size;
     struct memory_chunk* next;
 } memory_chunk_t;
 
+typedef struct memory_magazine {
+    struct memory_block* head;
+    uint32_t count;
+} memory_magazine_t;
+
+typedef struct memory_tcache {
+    memory_magazine_t mag[MEMORY_CLASS_COUNT];
+} memory_tcache_t;
+
+typedef struct memory_depot {
+    struct memory_block* batches;  // full batches, as magazines return them
+    struct memory_block* loose;    // single blocks, from threads without one
+} memory_depot_t;
+
 typedef struct memory_pool {
     void* base;
     size_t size;
     size_t used;
     pthread_spinlock_t lock;
-    struct memory_chunk* free_list;
+    struct memory_chunk* free_list;  // beyond MEMORY_CLASS_MAX
+    size_t map_size;  // of base, when memory_pool_create() mapped it
+    memory_depot_t depot[MEMORY_CLASS_COUNT];
+    // Written only by the thread each slot belongs to
+    memory_tcache_t* tcache[MEMORY_POOL_THREADS];
+    struct memory_pool* next;  // among live pools, for thread exit
 } memory_pool_t;
 
+// A pool over a mapping of its own, reserved and not committed: pages are
+// faulted in, huge when transparent huge pages allow, as allocations first
+// touch them. With node >= 0 they come from that NUMA node. The base is
+// huge page aligned, so allocations in multiples of CACHE_LINE_SIZE stay
+// cache line aligned.
+#define LB_ARENA_ALIGN  (2 * 1024 * 1024)
+
 memory_pool_t* memory_pool_create(size_t size);
+memory_pool_t* memory_pool_create_node(size_t size, int node);
 void memory_pool_destroy(memory_pool_t* pool);
 void* memory_pool_alloc(memory_pool_t* pool, size_t size);
 void memory_pool_free(memory_pool_t* pool, void* ptr, size_t size);
+// Over memory the caller owns; memory_pool_destroy() then releases only
+// what the pool itself allocated
+void memory_pool_init(memory_pool_t* pool, void* base, size_t size);
+bool memory_pool_owns(const memory_pool_t* pool, const void* ptr);
+
+// Process-wide pool for objects allocated and freed per request outside a
+// worker arena; the heap serves what it cannot. Free with the size given
+// at allocation.
+void* lb_alloc(size_t size);
+void lb_free(void* ptr, size_t size);
+
+// Fixed-size object cache owned by one thread. Other threads hand objects
+// back through slab_free_remote(); the owner reclaims them on its next
+// slab_alloc() once its local free list runs dry. Chunks come from pool
+// when one is set, the heap once it is full.
+typedef struct slab_obj {
+    struct slab_obj* next;
+} slab_obj_t;
+
+typedef struct slab_cache {
+    size_t obj_size;
+    uint32_t objs_per_chunk;
+    slab_obj_t* free_list;
+    _Atomic(slab_obj_t*) remote_free;
+    void** chunks;
+    uint32_t chunk_count;
+    uint32_t chunk_capacity;
+    memory_pool_t* pool;
+} slab_cache_t;
 
-typedef struct hash_node {
-    uint64_t hash;
-    backend_t* backend;
-    struct hash_node* next;
-} hash_node_t;
+slab_cache_t* slab_cache_create(size_t obj_size, uint32_t objs_per_chunk);
+void slab_cache_destroy(slab_cache_t* slab);
+void* slab_alloc(slab_cache_t* slab);
+void slab_free(slab_cache_t* slab, void* obj);
+void slab_free_remote(slab_cache_t* slab, void* obj);
+
+// Maglev consistent hashing. Each backend walks its own permutation of the
+// slots and takes turns claiming the next free one, so every backend ends
+// up owning a near-equal share (scaled by weight) and losing one backend
+// only moves the keys it owned. Tables are immutable once published:
+// writers build a new one under the lock and swap the pointer, lookups
+// are one hash and one load. A replaced table is kept for
+// CONSISTENT_HASH_GRACE seconds before it is freed, which bounds how long
+// a reader may hold on to it.
+#define CONSISTENT_HASH_SIZE   65537   // default slot count, must be prime
+#define CONSISTENT_HASH_GRACE  2
+
+// The fill itself, shared with the proxy's server tables. Members are
+// sorted with maglev_member_cmp first; slot[] receives member indices.
+typedef struct maglev_member {
+    uint64_t name_hash;
+    uint32_t weight;
+    void* member;
+} maglev_member_t;
+
+uint32_t maglev_prime(uint32_t size);
+int maglev_member_cmp(const void* a, const void* b);
+int maglev_fill(uint32_t* slot, uint32_t size, const maglev_member_t* members, uint32_t n);
+
+static inline uint32_t maglev_slot(uint64_t hash, uint32_t size) {
+    return (uint32_t)(((hash >> 32) * size) >> 32);
+}
+
+typedef struct hash_table {
+    uint32_t size;
+    uint32_t backend_count;
+    time_t retired_at;
+    struct hash_table* retired_next;
+    backend_t* slot[];
+} hash_table_t;
 
 typedef struct consistent_hash {
-    hash_node_t** table;
+    _Atomic(hash_table_t*) lookup;
     uint32_t size;
-    uint32_t virtual_nodes;
-    pthread_spinlock_t lock;
+
+    // Writers only, under lock
+    pthread_mutex_t lock;
+    backend_t** backends;
+    uint32_t backend_count;
+    uint32_t backend_capacity;
+    hash_table_t* retired;
 } consistent_hash_t;
 
-consistent_hash_t* consistent_hash_create(uint32_t size, uint32_t virtual_nodes);
-void consistent_hash_add(consistent_hash_t* ch, backend_t* backend);
+// size is rounded up to a prime, 0 picks CONSISTENT_HASH_SIZE
+consistent_hash_t* consistent_hash_create(uint32_t size);
+int consistent_hash_add(consistent_hash_t* ch, backend_t* backend);
+int consistent_hash_remove(consistent_hash_t* ch, backend_t* backend);
+// Rebuild from the member backends that are UP with a non-zero weight;
+// call it whenever a state or weight changes
+int consistent_hash_rebuild(consistent_hash_t* ch);
 backend_t* consistent_hash_get(consistent_hash_t* ch, const char* key);
+backend_t* consistent_hash_get_hash(consistent_hash_t* ch, uint64_t hash);
+// Bounded loads: a backend takes the key only while its active_conns is
+// below ceil(factor% of the average, counting this request); otherwise the
+// key moves on to the owners of the following slots. total_load is the
+// caller's in-flight count across the table; factor 0 is unbounded.
+backend_t* consistent_hash_get_bounded(consistent_hash_t* ch, uint64_t hash,
+                                       uint64_t total_load, uint32_t factor);
 void consistent_hash_destroy(consistent_hash_t* ch);
 
 #endif
\ No newline at end of file
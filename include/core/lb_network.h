@@ -7,6 +7,13 @@ int create_listen_socket(uint16_t port, bool reuseport);
 int connect_to_backend(backend_t* backend);
 int set_nonblocking(int fd);
 
+// Backend address cache (src/network/lb_resolver.c). Host names are
+// resolved at registration and then refreshed in the background; workers
+// only ever read the cached records.
+int lb_resolver_add_backend(loadbalancer_t* lb, backend_t* backend);
+int lb_net_resolve_backend(backend_t* backend, lb_sockaddr_t* addr, socklen_t* len);
+void* lb_resolver_thread(void* arg);
+
 lb_connection_t* conn_create(loadbalancer_t* lb);
 void conn_destroy(loadbalancer_t* lb, lb_connection_t* conn);
 
@@ -15,5 +22,12 @@ int handle_backend_data(loadbalancer_t* lb, lb_connection_t* conn);
 
 void* worker_thread(void* arg);
 void* worker_thread_v2(void* arg);
+void lb_net_worker_reclaim_all(loadbalancer_t* lb, lb_worker_t* worker);
+void lb_net_worker_close_idle(lb_worker_t* worker);
+
+// io_uring event engine (src/network/lb_uring.c); falls back to the epoll
+// loop when the running kernel lacks the required features
+bool lb_uring_available(void);
+void* worker_thread_uring(void* arg);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,26 @@
+#ifndef LB_NUMA_H
+#define LB_NUMA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CPU and memory topology, read from sysfs; no libnuma. On a machine
+// without NUMA every CPU reports node 0 and the memory calls do nothing.
+#define LB_NUMA_MAX_CPUS   1024
+#define LB_NUMA_MAX_NODES  64
+
+typedef struct lb_cpu_slot {
+    uint16_t cpu;
+    uint16_t node;
+} lb_cpu_slot_t;
+
+// The CPUs this process may run on, in the order workers take them: node
+// by node, and within a node the first hyperthread of every core before
+// the second ones. Returns the count, at least 1.
+uint32_t lb_numa_cpus(lb_cpu_slot_t* slots, uint32_t max);
+
+// Pages of [addr, addr + len) not yet faulted in come from node when it
+// has memory left; returns -1 when the kernel refuses
+int lb_numa_prefer(void* addr, size_t len, int node);
+
+#endif
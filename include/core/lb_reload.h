@@ -0,0 +1,48 @@
+#ifndef LB_RELOAD_H
+#define LB_RELOAD_H
+
+#include "lb_types.h"
+
+// Configuration reload. The backends file lists HOST:PORT[@WEIGHT][/MAXCONN]
+// per line, as -b takes them, '#' starting a comment. Reading it again, on
+// SIGHUP, adds the backends new to it, changes weights and connection
+// limits, and drains the ones no longer listed (backends are never freed
+// while running) or brings back those listed again. Selection sees the
+// result only through the snapshot lb_backends_changed() swaps in, so
+// connections in flight carry on with the backend they have. Parsing
+// happens on the caller's thread; a file that fails to parse changes
+// nothing.
+int lb_reload_backends(loadbalancer_t* lb, const char* path);
+
+// Binary upgrade. A process started with a handover path serves its
+// listening sockets on a unix socket there. The next one, started with the
+// same path, first asks for them and gets them over SCM_RIGHTS instead of
+// binding its own, so the accept queues carry over. Once its workers run
+// it acknowledges, and the old process stops accepting and exits when its
+// last connection closes or LB_HANDOVER_GRACE_MS has passed. No ack, the
+// old process keeps serving as if nothing happened.
+#define LB_HANDOVER_MAX_FDS     64
+#define LB_HANDOVER_ACK_MS      30000   // for the new process to come up
+#define LB_HANDOVER_GRACE_MS    30000
+
+// Number of sockets taken into fds, 0 when no process serves path, -1 on
+// error; on success *conn is what lb_handover_ack() answers on
+int lb_handover_take(const char* path, int* fds, uint32_t max, int* conn);
+int lb_handover_ack(int conn);
+
+// Whether fd listens on the wildcard address at port, with SO_REUSEPORT
+// as given, as create_listen_socket() would bind it. The old process keeps
+// its copies in the reuseport group until it exits, so a taken socket
+// left unused would have connections hashed to it that nobody accepts:
+// the new process takes over only when every socket it needs is among
+// those the old one hands over, and those are all it needs.
+bool lb_handover_match(int fd, uint16_t port, bool reuseport);
+
+// Starts the thread serving path for the next process
+int lb_handover_serve(loadbalancer_t* lb, const char* path);
+
+// Takes the listeners out of every worker's event loop and clears
+// lb->accepting
+void lb_stop_accepting(loadbalancer_t* lb);
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef LB_TIMER_H
+#define LB_TIMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Hierarchical timing wheel with 1ms ticks: four levels of 64 slots cover
+// ~4.6 hours, longer timeouts are clamped. Insert and cancel are O(1);
+// timers on the outer levels cascade inwards as the wheel turns.
+#define LB_TIMER_LEVELS     4
+#define LB_TIMER_SLOT_BITS  6
+#define LB_TIMER_SLOTS      (1u << LB_TIMER_SLOT_BITS)
+
+typedef struct lb_timer {
+    struct lb_timer* next;
+    struct lb_timer** pprev;  // NULL while not scheduled
+    uint64_t expires;         // ms
+} lb_timer_t;
+
+typedef struct lb_timer_wheel {
+    uint64_t now;  // next tick to run; every timer before it has fired
+    uint32_t count;
+    lb_timer_t* slots[LB_TIMER_LEVELS][LB_TIMER_SLOTS];
+} lb_timer_wheel_t;
+
+typedef void (*lb_timer_fn)(lb_timer_t* timer, void* arg);
+
+void lb_timer_wheel_init(lb_timer_wheel_t* wheel, uint64_t now_ms);
+void lb_timer_add(lb_timer_wheel_t* wheel, lb_timer_t* timer, uint64_t expires_ms);
+void lb_timer_cancel(lb_timer_wheel_t* wheel, lb_timer_t* timer);
+// Run every timer due at or before now_ms; fn may re-add the timer
+void lb_timer_advance(lb_timer_wheel_t* wheel, uint64_t now_ms, lb_timer_fn fn, void* arg);
+// Milliseconds until the wheel next needs to turn, at most max_ms
+int lb_timer_next_timeout(const lb_timer_wheel_t* wheel, int max_ms);
+
+static inline bool lb_timer_pending(const lb_timer_t* timer) {
+    return timer->pprev != NULL;
+}
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef LB_TRACE_H
+#define LB_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+// Where the time of a connection goes. For one in every N connections
+// (--phase-sample N) each phase is timed with the cycle counter and fed to
+// the MetricsAggregator timer "lb.phase.<name>", so its percentiles say
+// which phase a latency regression lives in.
+typedef enum {
+    LB_PHASE_ACCEPT,        // listener reported ready to accept4() returning
+    LB_PHASE_REQUEST,       // accepted to the first client bytes read
+    LB_PHASE_SELECT,        // lb_select_backend()
+    LB_PHASE_CONNECT,       // backend chosen to its connect completing; pooled sockets skip it
+    LB_PHASE_FIRST_BYTE,    // request sent to the first response byte
+    LB_PHASE_CLIENT_STALL,  // time responses sat queued on a full client socket
+    LB_PHASE_TOTAL,         // accepted to closed
+    LB_PHASE_COUNT
+} lb_phase_t;
+
+// Tick stamps of one connection, all 0 when it is not sampled
+typedef struct lb_conn_phases {
+    uint64_t accepted;
+    uint64_t connecting;   // backend chosen, connect under way
+    uint64_t stall_since;  // client socket full since
+    uint64_t stall_ticks;
+    bool requested;        // LB_PHASE_REQUEST taken
+} lb_conn_phases_t;
+
+extern uint32_t lb_trace_every;
+
+// Sample one connection in every, 0 for none; calibrates the ticks and
+// registers the timers. Call before the workers start.
+void lb_trace_init(uint32_t every);
+
+// Whether the connection being accepted on this thread is sampled
+bool lb_trace_pick(void);
+
+void lb_trace_phase(lb_phase_t phase, uint64_t ticks);
+void lb_trace_phase_ns(lb_phase_t phase, uint64_t ns);
+uint64_t lb_ticks_ns(uint64_t ticks);
+
+static inline bool lb_trace_on(void) {
+    return lb_trace_every != 0;
+}
+
+// Invariant TSC or the generic timer where there is one; otherwise, and
+// when lb_trace_init found the TSC unfit, CLOCK_MONOTONIC ns
+extern bool lb_ticks_clock;
+
+static inline uint64_t lb_ticks(void) {
+#if defined(__x86_64__)
+    if (!lb_ticks_clock) return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t v;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+#endif
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+#endif
@@ -12,6 +12,9 @@
 #include <pthread.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include "lb_http1.h"
+#include "lb_timer.h"
+#include "lb_trace.h"
 
 #define CACHE_LINE_SIZE 64
 #define MAX_BACKENDS 4096
@@ -19,7 +22,12 @@
 #define BUFFER_SIZE 65536
 #define MAX_CONNECTIONS 1000000
 #define HTTP_HEADER_MAX 8192
-#define CLEANUP_QUEUE_SIZE 1024
+#define WRITE_HIGH_WATER (256 * 1024)
+#define BACKEND_MAX_ADDRS 8
+#define DNS_TTL_MS 30000
+#define UPSTREAM_IDLE_MAX 64
+#define UPSTREAM_IDLE_TIMEOUT_MS 4000
+#define WORKER_ARENA_SIZE (64UL * 1024 * 1024)  // reserved per worker, committed on use
 
 #ifdef __cplusplus
 extern "C" {
@@ -36,7 +44,8 @@ typedef enum {
     LB_ALGO_HDR,
     LB_ALGO_RDP_COOKIE,
     LB_ALGO_RANDOM,
-    LB_ALGO_STICKY
+    LB_ALGO_STICKY,
+    LB_ALGO_P2C
 } lb_algorithm_t;
 
 typedef enum {
@@ -72,10 +81,30 @@ typedef struct __attribute__((aligned(CACHE_LINE_SIZE))) {
 #endif
 } stats_t;
 
+typedef union lb_sockaddr {
+    struct sockaddr sa;
+    struct sockaddr_in in;
+    struct sockaddr_in6 in6;
+} lb_sockaddr_t;
+
 typedef struct backend {
     char host[256];
     uint16_t port;
     int sockfd;
+    uint32_t id;  // index in lb->backends, also keys the per-worker counters
+
+    // A/AAAA records for host, refreshed by the resolver thread and read by
+    // workers under addr_seq (odd while an update is being written)
+    lb_sockaddr_t addrs[BACKEND_MAX_ADDRS];
+    uint32_t addr_count;
+    uint64_t addr_expires_ns;  // resolver thread only; UINT64_MAX for IP literals
+#ifdef __cplusplus
+    std::atomic<uint32_t> addr_seq;
+    std::atomic<uint32_t> addr_rr;
+#else
+    _Atomic uint32_t addr_seq;
+    _Atomic uint32_t addr_rr;
+#endif
 
 #ifdef __cplusplus
     std::atomic<backend_state_t> state;
@@ -85,6 +114,19 @@ typedef struct backend {
     std::atomic<uint32_t> weight;
     std::atomic<uint64_t> last_check_ns;
     std::atomic<uint64_t> response_time_ns;
+    std::atomic<uint64_t> ewma_ns;
+    std::atomic<uint64_t> ewma_stamp_ns;
+    std::atomic<uint64_t> latency_avg_ns;
+    std::atomic<uint32_t> consecutive_failures;
+    std::atomic<bool> ejected;
+    std::atomic<uint32_t> ejections;
+    std::atomic<uint64_t> ejected_until_ns;
+    std::atomic<uint64_t> up_since_ns;
+    std::atomic<uint32_t> ramp;
+    std::atomic<uint64_t> drain_since_ns;
+    std::atomic<bool> drained;
+    std::atomic<uint32_t> drain_reasons;
+    std::atomic<uint32_t> max_conns;
 #else
     _Atomic backend_state_t state;
     _Atomic uint32_t active_conns;
@@ -93,6 +135,31 @@ typedef struct backend {
     _Atomic uint32_t weight;
     _Atomic uint64_t last_check_ns;
     _Atomic uint64_t response_time_ns;
+    // Request latency (first response byte) for LB_ALGO_P2C, decayed over
+    // LB_EWMA_DECAY_NS; see lb_backend_observe()
+    _Atomic uint64_t ewma_ns;
+    _Atomic uint64_t ewma_stamp_ns;
+    // Plain moving average of the same samples for outlier detection, which
+    // must not react to a single slow response
+    _Atomic uint64_t latency_avg_ns;
+    // Passive outlier detection (lb_backend_report): live-traffic failures
+    // in a row, whether the backend is out of the snapshot, ejections so
+    // far for the backoff, and when the current or last one ends
+    _Atomic uint32_t consecutive_failures;
+    _Atomic bool ejected;
+    _Atomic uint32_t ejections;
+    _Atomic uint64_t ejected_until_ns;
+    // Slow start: when the backend came (back) into rotation, 0 once its
+    // ramp is over, and the share of LB_RAMP_FULL the snapshot last gave it
+    _Atomic uint64_t up_since_ns;
+    _Atomic uint32_t ramp;
+    // Drain (lb_backend_drain): when it started, whether the last active
+    // connection has been reported gone, and the LB_DRAIN_* holding it
+    _Atomic uint64_t drain_since_ns;
+    _Atomic bool drained;
+    _Atomic uint32_t drain_reasons;
+    // Connections it takes at once, 0 for config.server_maxconn
+    _Atomic uint32_t max_conns;
 #endif
 
     stats_t stats;
@@ -104,10 +171,16 @@ typedef struct backend {
     uint8_t __padding[CACHE_LINE_SIZE - (sizeof(void*) % CACHE_LINE_SIZE)];
 } backend_t;
 
+typedef enum {
+    IO_ENGINE_EPOLL,
+    IO_ENGINE_URING
+} io_engine_t;
+
 typedef enum {
     SOCKET_TYPE_CLIENT,
     SOCKET_TYPE_BACKEND,
-    SOCKET_TYPE_LISTEN
+    SOCKET_TYPE_LISTEN,
+    SOCKET_TYPE_H2_STREAM  // backend of one HTTP/2 stream (core/lb_h2.h)
 } socket_type_t;
 
 typedef struct epoll_data_wrapper {
@@ -116,6 +189,25 @@ typedef struct epoll_data_wrapper {
     int fd;
 } epoll_data_wrapper_t;
 
+struct lb_worker;
+struct lb_h2;
+
+// Bytes waiting for a slow peer: a chain of pool-backed segments flushed
+// with one sendmsg() per batch. Each segment's header sits at the start of
+// its buffer, data runs from start to end.
+typedef struct lb_wseg {
+    struct lb_wseg* next;
+    uint32_t start;
+    uint32_t end;
+    uint8_t data[];
+} lb_wseg_t;
+
+typedef struct lb_wqueue {
+    lb_wseg_t* head;
+    lb_wseg_t* tail;
+    size_t bytes;
+} lb_wqueue_t;
+
 typedef struct lb_connection {
     int client_fd;
     int backend_fd;
@@ -130,17 +222,56 @@ typedef struct lb_connection {
     size_t read_size;
     size_t write_size;
 
-    uint8_t* to_backend_buffer;
-    size_t to_backend_size;
-    size_t to_backend_capacity;
-
-    uint8_t* to_client_buffer;
-    size_t to_client_size;
-    size_t to_client_capacity;
+    lb_wqueue_t to_backend;
+    lb_wqueue_t to_client;
+
+    // splice() relay: one pipe per direction, bytes parked in each pipe
+    bool use_splice;
+    int c2b_pipe[2];
+    int b2c_pipe[2];
+    size_t c2b_pending;
+    size_t b2c_pending;
+    // Peer finished sending; close once its queued bytes are delivered
+    bool client_eof;
+    bool backend_eof;
+
+    // HTTP framing of both streams. With http_keepalive the backend fd can
+    // be pooled when the client leaves between messages; with per_request
+    // each request picks its own backend, and bytes of a pipelined request
+    // wait in held until the previous response is complete.
+    bool http_framed;
+    bool http_keepalive;
+    bool per_request;
+    lb_http1_t req_framer;
+    lb_http1_t rsp_framer;
+    lb_wqueue_t held;
+
+    // HTTP/2 client: the first read decides when h2_sniff is set; each
+    // stream of h2 then has a backend connection of its own
+    bool h2_sniff;
+    struct lb_h2* h2;
+
+    // Idle/stall timeout in the owning worker's wheel, re-armed lazily:
+    // events only bump last_active_ms and the expiry re-checks the deadline
+    lb_timer_t timer;
+    struct lb_connection* next_expired;
+    uint64_t last_active_ms;
+    bool backend_connecting;
 
     uint64_t start_time_ns;
+    // Request sent, first response byte not yet seen: feeds the backend's
+    // latency EWMA. Unframed streams are sampled once (UINT64_MAX after).
+    uint64_t rsp_wait_ns;
+    // Phase stamps when this connection is sampled (--phase-sample)
+    lb_conn_phases_t phases;
     struct sockaddr_in client_addr;
 
+    // Waiting in its owner's admission queue for a backend slot, since
+    // queued_ms (0 when not queued)
+    struct lb_connection* queue_prev;
+    struct lb_connection* queue_next;
+    uint64_t queued_ms;
+
     struct connection* next;
     struct connection* prev;
 
@@ -150,6 +281,26 @@ typedef struct lb_connection {
 
     epoll_data_wrapper_t* client_wrapper;
     epoll_data_wrapper_t* backend_wrapper;
+    // Storage behind the two wrapper pointers, allocated with the connection
+    epoll_data_wrapper_t wrappers[2];
+    // Interest set each fd was last armed with
+    uint32_t client_events;
+    uint32_t backend_events;
+
+    // Worker whose epoll instance owns both fds of this connection
+    struct lb_worker* worker;
+
+    // Deferred reclamation: closed connections wait on their worker's
+    // retire list until the grace period tagged in retire_epoch has passed
+    struct lb_connection* next_retired;
+    uint64_t retire_epoch;
+
+    // Held by the worker handling an event; only taken in shared-epoll mode
+#ifdef __cplusplus
+    std::atomic<bool> busy;
+#else
+    _Atomic bool busy;
+#endif
 } lb_connection_t;
 
 typedef struct {
@@ -164,20 +315,111 @@ typedef struct {
     bool so_reuseport;
     bool defer_accept;
     bool health_check_enabled;
+    // Probe protocol, a check_type_t (health/health.h): TCP, HTTP, MySQL
+    // or Redis
+    uint32_t health_check_type;
+    // Passive outlier ejection: failures in a row from live traffic that
+    // eject a backend (0 disables), the first ejection's length, doubled on
+    // every repeat, and the share of backends that may be out at once
+    uint32_t outlier_consecutive_failures;
+    uint32_t outlier_base_eject_ms;
+    uint32_t outlier_max_eject_percent;
+    // Slow start: window over which a backend returning to rotation ramps
+    // up to its full weight (0 disables), linearly or geometrically
+    uint32_t slow_start_ms;
+    bool slow_start_exponential;
+    // Backends listed in this file (host:port per line) are drained, and
+    // undrained once they leave it; NULL when unset
+    const char* drain_file;
+    // Each worker gets its own epoll fd and SO_REUSEPORT listen socket
+    bool reuseport_listeners;
+    // Relay L4 traffic through splice() pipes instead of user buffers
+    bool splice_relay;
+    // Event engine driving the worker loops
+    io_engine_t io_engine;
+    // Bytes queued towards one peer before the other side stops being read
+    uint32_t write_high_water;
+    uint32_t dns_ttl_ms;
+    // Pool idle HTTP/1.1 backend connections per worker
+    bool upstream_keepalive;
+    uint32_t upstream_idle_timeout_ms;
+    // Balance every HTTP/1.1 request instead of every client connection
+    bool per_request_balance;
+    // Accept HTTP/2 with prior knowledge next to HTTP/1.x
+    bool http2;
+    // Backend connect options: TCP Fast Open, sockets opened ahead per
+    // backend and worker, and a local address to connect from (AF_UNSPEC
+    // when unset)
+    bool backend_fastopen;
+    uint32_t backend_preconnect;
+    lb_sockaddr_t backend_source;
+    // Time the phases of one connection in this many (lb_trace.h); 0 for none
+    uint32_t phase_sample;
+    // Admission: connections a backend takes at once unless it sets its
+    // own max_conns, and the pool as a whole (0 for no limit). Past them
+    // clients wait in FIFO queues, at most queue_max in all, for up to
+    // queue_timeout_ms before they get a 503.
+    uint32_t server_maxconn;
+    uint32_t group_maxconn;
+    uint32_t queue_max;
+    uint32_t queue_timeout_ms;
 } config_t;
 
-typedef struct cleanup_queue {
-    lb_connection_t* queue[CLEANUP_QUEUE_SIZE];
+// Backend connection parked between HTTP messages
+typedef struct lb_idle_conn {
+    int fd;
+    backend_t* backend;
+    uint64_t since_ns;
+    bool fresh;  // opened ahead by preconnect, has never carried a request
+} lb_idle_conn_t;
+
+// Per-worker event loop context. In shared mode every worker points at
+// lb->epfd/lb->listen_fd; with reuseport_listeners each owns its own pair.
+typedef struct __attribute__((aligned(CACHE_LINE_SIZE))) lb_worker {
+    uint32_t id;
+    int epfd;
+    int listen_fd;
+    bool owns_fds;
+    epoll_data_wrapper_t listen_wrapper;
+    // Where it runs (core/lb_numa.h), and the memory it allocates from
+    // there: connection slabs and relay segments, NULL to use the heap
+    // and lb->memory_pool
+    int cpu;
+    int node;
+    struct memory_pool* arena;
+    // Connection objects accepted by this worker
+    struct slab_cache* conn_slab;
+    struct loadbalancer* lb;
+    // Traffic counters written only by this worker (stats/lb_stats.h)
+    struct lb_worker_stats* stats;
+
+    // Connections closed during the current batch, then those waiting for
+    // every other worker to pass a quiescent point (oldest first)
+    struct lb_connection* retired;
+    struct lb_connection* limbo_head;
+    struct lb_connection* limbo_tail;
+    // Reusable backend connections, only touched by the owning thread
+    lb_idle_conn_t idle[UPSTREAM_IDLE_MAX];
+    uint32_t idle_count;
+    // Connection timeouts; other workers touch the wheel only in shared mode,
+    // under timer_lock
+    lb_timer_wheel_t timers;
+    pthread_spinlock_t timer_lock;
+    uint64_t now_ms;  // clock sampled after each epoll_wait
+    uint64_t preconnect_next_ms;
+    // Connections waiting for a backend slot, oldest first; other workers
+    // unlink theirs in shared mode, under queue_lock
+    struct lb_connection* queue_head;
+    struct lb_connection* queue_tail;
+    pthread_spinlock_t queue_lock;
+    // Last reclaim epoch observed between two event batches; written only
+    // by the owning worker, kept on its own line for the readers
 #ifdef __cplusplus
-    std::atomic<uint32_t> head;
-    std::atomic<uint32_t> tail;
-    std::mutex lock;
+    alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> quiescent_epoch;
 #else
-    _Atomic uint32_t head;
-    _Atomic uint32_t tail;
-    pthread_mutex_t lock;
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t quiescent_epoch;
 #endif
-} cleanup_queue_t;
+} lb_worker_t;
 
 typedef struct loadbalancer {
     int epfd;
@@ -203,14 +445,50 @@ typedef struct loadbalancer {
 
     uint32_t worker_threads;
     pthread_t* workers;
+    lb_worker_t* worker_ctx;
+    // Bumped once per worker batch that closed connections (see lb_net.c)
+#ifdef __cplusplus
+    std::atomic<uint64_t> reclaim_epoch;
+#else
+    _Atomic uint64_t reclaim_epoch;
+#endif
 
     void* memory_pool;
     void* consistent_hash;
 
+    // Eligible backends for selection, rebuilt by lb_backends_changed();
+    // a replaced one is freed after LB_SNAPSHOT_GRACE
+#ifdef __cplusplus
+    std::atomic<struct lb_snapshot*> snapshot;
+#else
+    _Atomic(struct lb_snapshot*) snapshot;
+#endif
+    struct lb_snapshot* snapshot_retired;
+    // Backends currently ejected by outlier detection
+#ifdef __cplusplus
+    std::atomic<uint32_t> ejected_count;
+#else
+    _Atomic uint32_t ejected_count;
+#endif
+    // Backend slots taken across the pool (lb_backend_acquire), and
+    // connections in the workers' admission queues
+#ifdef __cplusplus
+    std::atomic<uint32_t> active_conns;
+    std::atomic<uint32_t> queued;
+#else
+    _Atomic uint32_t active_conns;
+    _Atomic uint32_t queued;
+#endif
+    // Cleared once the listeners went to a new process (core/lb_reload.h)
+#ifdef __cplusplus
+    std::atomic<bool> accepting;
+#else
+    _Atomic bool accepting;
+#endif
+
     config_t config;
 
     epoll_data_wrapper_t* listen_wrapper;
-    cleanup_queue_t* cleanup_queue;
 } loadbalancer_t;
 
 #ifdef __cplusplus
@@ -0,0 +1,84 @@
+#ifndef CORE_LIVENESS_HPP
+#define CORE_LIVENESS_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace ultrabalancer {
+
+/*
+ * Tracks whether pooled sockets are still connected without probing them.
+ * Each socket is registered once with the watcher's epoll set for
+ * EPOLLRDHUP (HUP and ERR are implied), edge triggered and without EPOLLIN,
+ * so traffic on a connection that is in use never wakes the watcher; only
+ * the peer closing or resetting it does. The watcher thread then clears the
+ * socket's flag and calls on_dead, for the pool to evict it.
+ *
+ * The flags live in slots the watcher owns, tagged with a generation that
+ * unwatch bumps. An event fetched for a socket that has since been closed
+ * carries the old generation and is ignored, so owners close and free
+ * their sockets whenever they like, and a reused slot is never marked by
+ * its previous socket's hangup.
+ */
+class LivenessWatcher {
+public:
+    static constexpr uint32_t kNoSlot = UINT32_MAX;
+
+    explicit LivenessWatcher(std::function<void()> on_dead = nullptr);
+    ~LivenessWatcher();
+
+    LivenessWatcher(const LivenessWatcher&) = delete;
+    LivenessWatcher& operator=(const LivenessWatcher&) = delete;
+
+    // kNoSlot when the socket could not be registered; probe it instead
+    [[nodiscard]] uint32_t watch(int fd) noexcept;
+    // Before the socket is closed
+    void unwatch(uint32_t slot) noexcept;
+
+    [[nodiscard]] bool alive(uint32_t slot) const noexcept {
+        return slot_at(slot).state.load(std::memory_order_acquire) & 1;
+    }
+
+    // Joins the thread; on_dead is not called afterwards
+    void stop() noexcept;
+
+    [[nodiscard]] uint64_t hangups() const noexcept {
+        return hangups_.load(std::memory_order_relaxed);
+    }
+
+private:
+    // generation << 1 | alive
+    struct Slot {
+        std::atomic<uint64_t> state{0};
+        uint32_t next_free = kNoSlot;
+    };
+
+    static constexpr uint32_t kChunkBits = 10;
+    static constexpr uint32_t kChunkSize = 1u << kChunkBits;
+    static constexpr uint32_t kMaxChunks = 1024;
+
+    [[nodiscard]] Slot& slot_at(uint32_t slot) const noexcept {
+        return chunks_[slot >> kChunkBits].load(std::memory_order_acquire)[slot & (kChunkSize - 1)];
+    }
+    void run() noexcept;
+
+    // Chunks are never moved or freed, so readers need no lock
+    std::atomic<Slot*> chunks_[kMaxChunks] = {};
+
+    std::mutex mutex_;                  // slot allocation
+    uint32_t free_head_ = kNoSlot;
+    uint32_t allocated_ = 0;
+
+    int epfd_ = -1;
+    int wake_fd_ = -1;
+    std::function<void()> on_dead_;
+    std::thread thread_;
+    std::atomic<uint64_t> hangups_{0};
+};
+
+}
+
+#endif
@@ -16,4 +16,114 @@ void lb_stop(loadbalancer_t* lb);
 
 backend_t* lb_select_backend(loadbalancer_t* lb, struct sockaddr_in* client_addr);
 
+// Latency feed for LB_ALGO_P2C, called by the data path with the time from
+// sending a request to the first byte of its response
+#define LB_EWMA_DECAY_NS    10000000000ULL  // 10s time constant
+#define LB_EWMA_INITIAL_NS  1000000ULL      // assumed until a backend has samples
+void lb_backend_observe(backend_t* backend, uint64_t latency_ns);
+
+// Passive outlier detection. The data path reports how each exchange with
+// a backend ended; outlier_consecutive_failures failures in a row take the
+// backend out of the snapshot for outlier_base_eject_ms, doubled for every
+// ejection since it last stayed in for LB_OUTLIER_MAX_EJECT_MS, as long as
+// no more than outlier_max_eject_percent of the backends (and never the
+// last one) are out. lb_outlier_sweep() lets them back in and also ejects
+// backends whose average latency is LB_OUTLIER_LATENCY_FACTOR times the
+// median of at least LB_OUTLIER_MIN_HOSTS peers.
+#define LB_OUTLIER_FAILURES         5
+#define LB_OUTLIER_BASE_EJECT_MS    1000
+#define LB_OUTLIER_MAX_EJECT_MS     60000
+#define LB_OUTLIER_MAX_EJECT_PCT    50
+#define LB_OUTLIER_SWEEP_MS         100
+#define LB_OUTLIER_LATENCY_FACTOR   3
+#define LB_OUTLIER_LATENCY_MIN_NS   10000000ULL  // 10ms: below it nothing is an outlier
+#define LB_OUTLIER_MIN_HOSTS        3
+
+typedef enum {
+    LB_OUTCOME_OK,
+    LB_OUTCOME_CONNECT_FAIL,
+    LB_OUTCOME_RESET,
+    LB_OUTCOME_5XX
+} lb_outcome_t;
+
+void lb_backend_report(loadbalancer_t* lb, backend_t* backend, lb_outcome_t outcome);
+void lb_outlier_sweep(loadbalancer_t* lb);
+
+// Slow start. A backend that turns UP or returns from an ejection gets
+// ramp/LB_RAMP_FULL of its share, growing from LB_SLOW_START_MIN_RAMP to
+// LB_RAMP_FULL over slow_start_ms. Weighted algorithms see the scaled
+// weight in the snapshot; the others scale their cost by it or turn away
+// the picks the backend is not ready for. lb_slow_start_sweep() rebuilds
+// the snapshot whenever a ramp has grown by LB_SLOW_START_STEP_PCT.
+#define LB_RAMP_FULL            1024
+#define LB_SLOW_START_MIN_RAMP  64
+#define LB_SLOW_START_STEP_PCT  12
+
+void lb_backend_slow_start(loadbalancer_t* lb, backend_t* backend);
+void lb_slow_start_sweep(loadbalancer_t* lb);
+
+// Drain. A draining backend takes no new selections while its in-flight
+// requests finish; workers close its pooled idle connections and hand
+// keep-alive clients elsewhere between two messages. lb_drain_sweep()
+// reports it drained once active_conns reaches zero, and picks up changes
+// to config.drain_file. lb_backend_drain fails for a backend in MAINT.
+// Each caller drains for its own reason, and lb_backend_undrain only puts
+// the backend back once no reason is left; it returns -1 while one is.
+#define LB_DRAIN_REMOVED  0x1   // lb_remove_backend
+#define LB_DRAIN_RELOAD   0x2   // left out of the backends file
+#define LB_DRAIN_FILE     0x4   // listed in config.drain_file
+
+backend_t* lb_find_backend(loadbalancer_t* lb, const char* host, uint16_t port);
+int lb_backend_drain(loadbalancer_t* lb, backend_t* backend, uint32_t reason);
+int lb_backend_undrain(loadbalancer_t* lb, backend_t* backend, uint32_t reason);
+void lb_drain_sweep(loadbalancer_t* lb);
+
+// Admission. Every backend connection holds a slot: lb_backend_acquire
+// takes one unless the backend is at its max_conns (config.server_maxconn
+// when unset) or the pool at config.group_maxconn, and lb_backend_release
+// gives it back. lb_backend_admit takes the slot on the backend
+// lb_select_backend picks, or on any other one with a slot free when that
+// one is full; NULL with *full set once every backend is, for the caller to
+// queue the connection. Workers hand freed slots to their queues oldest
+// first (lb_net.c) and answer those that waited queue_timeout_ms with 503.
+#define LB_QUEUE_MAX         1024
+#define LB_QUEUE_TIMEOUT_MS  1000
+
+bool lb_backend_acquire(loadbalancer_t* lb, backend_t* backend);
+void lb_backend_release(loadbalancer_t* lb, backend_t* backend);
+backend_t* lb_backend_admit(loadbalancer_t* lb, struct sockaddr_in* client_addr, bool* full);
+
+// What selection works from: the backends that are UP with a weight and
+// not ejected,
+// rebuilt by lb_backends_changed() and published by pointer swap, so a
+// pick reads this compact array instead of walking every backend_t and
+// its state. A replaced snapshot stays readable for LB_SNAPSHOT_GRACE.
+//
+// wrr is one precomputed smooth weighted round-robin cycle (nginx order:
+// every pick adds each weight to its backend's credit and the richest one
+// pays the total), scaled down to fit LB_WRR_MAX_SLOTS.
+#define LB_WRR_MAX_SLOTS   16384
+#define LB_SNAPSHOT_GRACE  2       // seconds
+
+typedef struct lb_snapshot {
+    uint32_t count;
+    uint32_t wrr_len;
+    uint32_t ramping;              // entries with ramp below LB_RAMP_FULL
+    uint64_t total_weight;
+    time_t retired_at;
+    struct lb_snapshot* retired_next;
+    backend_t** backends;          // count entries
+    uint64_t* cum_weight;          // running weight sums, for weighted random
+    backend_t** wrr;               // wrr_len entries
+    uint32_t* ramp;                // count entries, slow-start share
+} lb_snapshot_t;
+
+// Call after a backend is added or changes state or weight
+void lb_backends_changed(loadbalancer_t* lb);
+// Free the replaced snapshots whose grace has passed; the health thread
+// calls it on every sweep, so a last change does not leave its snapshot
+// behind until the next one
+void lb_snapshot_reclaim(loadbalancer_t* lb);
+void lb_snapshot_free(loadbalancer_t* lb);
+
 #endif
\ No newline at end of file
@@ -11,6 +11,7 @@
 #endif
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <time.h>
 
 #include "core/common.h"
 #include "core/lb_types.h"
@@ -58,6 +59,7 @@ typedef struct server {
 
     struct server *next;
     struct server *track;
+    struct proxy *proxy;        /* owning backend, set when it is added */
 
 #ifdef __cplusplus
     std::atomic<uint64_t> counters[64];
@@ -197,6 +199,25 @@ int server_parse_addr(server_t *srv, const char *addr);
 void server_set_state(server_t *srv, int state);
 int server_is_usable(server_t *srv);
 
+/*
+ * Consistent hash for balance uri/hdr/url_param: CONSISTENT_HASH_SIZE
+ * Maglev slots over the running servers, published by pointer swap so a
+ * lookup takes no lock. Rebuild with proxy_servers_changed() whenever a
+ * server of px changes state or weight; a replaced table is freed after
+ * CONSISTENT_HASH_GRACE seconds.
+ */
+typedef struct server_chash {
+    uint32_t size;
+    uint32_t count;
+    time_t retired_at;
+    struct server_chash *retired_next;
+    server_t **servers;         /* the count members, for the load bound */
+    server_t *slot[];
+} server_chash_t;
+
+void proxy_servers_changed(proxy_t *px);
+server_t* proxy_select_server(proxy_t *px, session_t *sess);
+
 listener_t* listener_new(const char *name, const char *addr, int port);
 void listener_free(listener_t *l);
 int listener_bind(listener_t *l);
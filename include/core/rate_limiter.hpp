@@ -0,0 +1,89 @@
+#ifndef CORE_RATE_LIMITER_HPP
+#define CORE_RATE_LIMITER_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+struct stick_table;
+
+namespace ultrabalancer {
+
+/*
+ * Token bucket of rate tokens a second holding up to burst, without locks.
+ * The bucket is kept as GCRA: one atomic holds the theoretical arrival
+ * time, and taking n tokens moves it n emission intervals on, refused when
+ * that would put it more than burst intervals past now.
+ *
+ * Requests do not touch it one by one. Each thread draws from one of
+ * kShards shards, which holds a lease of up to kMaxLease tokens taken
+ * from the bucket in a single step, about a millisecond of the rate, so
+ * the common path is one compare-and-swap on a cache line few threads
+ * share. Tokens leased but not yet spent stay in their shard, so the
+ * bucket may run ahead of actual use by at most a lease per shard.
+ *
+ * Shared, the rate is a budget for the whole cluster. Once a second the
+ * thread that refills a lease publishes what this node took in the last
+ * second through a stick table replicated by the peers (see
+ * stktable_share_count), and the node's own rate becomes what the others
+ * left, yet never under an equal share: nodes that all start at the full
+ * rate settle on splitting it instead of swinging between all and none.
+ */
+class RateLimiter {
+public:
+    static constexpr uint32_t kShards = 16;
+    static constexpr uint32_t kMaxLease = 64;
+
+    // A burst of 0 is one second of the rate
+    explicit RateLimiter(uint32_t rate, uint32_t burst = 0);
+
+    RateLimiter(const RateLimiter&) = delete;
+    RateLimiter& operator=(const RateLimiter&) = delete;
+
+    [[nodiscard]] bool try_acquire() noexcept;
+
+    // Before the limiter is used; table is a string table attached to the
+    // peers, name is the same on every node and node tells this one apart
+    void share(struct stick_table* table, std::string name, std::string node);
+
+    uint32_t rate() const noexcept { return rate_; }
+    // This node's part of it, lower while shared
+    uint32_t local_rate() const noexcept { return local_rate_.load(std::memory_order_relaxed); }
+
+    uint64_t allowed() const noexcept { return allowed_.load(std::memory_order_relaxed); }
+    uint64_t refused() const noexcept { return refused_.load(std::memory_order_relaxed); }
+
+private:
+    struct alignas(64) Shard {
+        std::atomic<int64_t> tokens{0};
+    };
+
+    bool refill(Shard& shard) noexcept;
+    void sync(int64_t now) noexcept;
+    void set_local_rate(uint32_t rate) noexcept;
+
+    const uint32_t rate_;
+    const uint32_t burst_;
+    const int64_t span_;                                // burst_ at the full rate, ns
+
+    alignas(64) std::atomic<int64_t> tat_{0};           // ns, steady clock
+    std::atomic<int64_t> interval_;                     // ns per token, 0 to refuse all
+    std::atomic<int64_t> lease_;
+    std::atomic<uint32_t> local_rate_;
+
+    std::atomic<uint64_t> allowed_{0};                  // tokens leased
+    std::atomic<uint64_t> refused_{0};
+
+    Shard shards_[kShards];
+
+    struct stick_table* table_ = nullptr;
+    std::string name_;
+    std::string node_;
+    std::atomic<int64_t> next_sync_{0};
+    std::atomic<int64_t> last_sync_{0};
+    std::atomic<uint64_t> synced_allowed_{0};           // allowed_ at the last sync
+};
+
+}
+
+#endif
@@ -2,14 +2,19 @@
 #define CORE_REQUEST_ROUTER_HPP
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <memory>
 #include <regex>
 #include <functional>
 #include <unordered_map>
 #include <shared_mutex>
+#include <atomic>
+#include <chrono>
 
 #include "core/proxy.h"
+#include "core/rate_limiter.hpp"
+#include "utils/regex_set.h"
 
 namespace ultrabalancer {
 
@@ -27,15 +32,29 @@ public:
     RouteRule(MatchType type, const std::string& pattern);
     ~RouteRule() = default;
 
+    // METHOD rules compare against headers["method"] here
     bool matches(const std::string& path, const std::unordered_map<std::string, std::string>& headers) const;
+    bool matches(std::string_view method, const std::string& path,
+                 const std::unordered_map<std::string, std::string>& headers) const;
 
     void set_weight(int weight) { weight_ = weight; }
     int get_weight() const { return weight_; }
 
+    MatchType get_type() const { return type_; }
+    const std::string& get_pattern() const { return pattern_; }
+    // HEADER rules, "name:value"; both empty without a ':'
+    const std::string& header_name() const { return header_name_; }
+    const std::string& header_value() const { return header_value_; }
+
 private:
     MatchType type_;
     std::string pattern_;
+    // REGEX rules run as a one pattern set; std::regex only takes the
+    // patterns it refuses
+    std::unique_ptr<regex_set_t, void (*)(regex_set_t*)> regex_set_{nullptr, regex_set_destroy};
     std::regex regex_;
+    std::string header_name_;
+    std::string header_value_;
     int weight_{100};
 };
 
@@ -46,6 +65,10 @@ public:
     const std::string& get_backend() const { return backend_name_; }
     int get_weight() const { return weight_; }
 
+    void count_selection() const { selections_.fetch_add(1, std::memory_order_relaxed); }
+    uint64_t get_selections() const { return selections_.load(std::memory_order_relaxed); }
+    void reset_selections() const { selections_.store(0, std::memory_order_relaxed); }
+
     void set_retry_policy(int max_retries, std::chrono::milliseconds timeout);
     bool should_retry(int attempt) const;
 
@@ -54,6 +77,7 @@ private:
     int weight_;
     int max_retries_{3};
     std::chrono::milliseconds retry_timeout_{1000};
+    mutable std::atomic<uint64_t> selections_{0};
 };
 
 class Route {
@@ -64,8 +88,17 @@ public:
     void add_target(std::shared_ptr<RouteTarget> target);
 
     bool matches(const std::string& path, const std::unordered_map<std::string, std::string>& headers) const;
+    bool matches(std::string_view method, const std::string& path,
+                 const std::unordered_map<std::string, std::string>& headers) const;
     std::shared_ptr<RouteTarget> select_target() const;
 
+    const std::vector<std::shared_ptr<RouteRule>>& get_rules() const { return rules_; }
+    const std::vector<std::shared_ptr<RouteTarget>>& get_targets() const { return targets_; }
+
+    void count_hit() const { hits_.fetch_add(1, std::memory_order_relaxed); }
+    uint64_t get_hits() const { return hits_.load(std::memory_order_relaxed); }
+    void reset_hits() const { hits_.store(0, std::memory_order_relaxed); }
+
     void set_priority(int priority) { priority_ = priority; }
     int get_priority() const { return priority_; }
 
@@ -92,8 +125,32 @@ private:
     mutable std::shared_mutex circuit_mutex_;
 
     mutable std::atomic<size_t> round_robin_index_{0};
+    mutable std::atomic<uint64_t> hits_{0};
 };
 
+/*
+ * route_request does not walk the route list. The routes are compiled
+ * into an immutable CompiledRoutes that indexes each route by one of its
+ * rules:
+ *   - EXACT and PREFIX paths in a radix trie, walked once along the path
+ *   - METHOD values and HEADER name:value pairs in perfect hash tables,
+ *     one probe per request method and per indexed header name
+ *   - REGEX patterns in one regex_set, scanned once over the path for
+ *     every route whose pattern matches it
+ *   - QUERY_PARAM routes, regexes the set refuses, and routes without
+ *     rules, in a list that is always tried
+ * The candidates found are then checked in priority order against all
+ * their rules, the first with a target winning, as with the linear walk.
+ *
+ * Changing the routes bumps version_; the next request compiles a new
+ * table under routes_mutex_ and publishes it. Each thread keeps the
+ * table it last used and reloads only when the version moved, so the
+ * common path takes no lock and touches no shared reference count.
+ *
+ * Rules added to a route after it was added to the router only narrow
+ * it: they are checked, but not indexed until the next change.
+ */
+
 class RequestRouter {
 public:
     RequestRouter();
@@ -109,9 +166,13 @@ public:
 
     void set_default_backend(const std::string& backend);
 
-    void enable_rate_limiting(const std::string& route_name, int requests_per_second);
+    // With a stick table, the rate is shared with the peers of node, see
+    // RateLimiter::share
+    void enable_rate_limiting(const std::string& route_name, int requests_per_second,
+                              struct stick_table* shared = nullptr, const std::string& node = {});
     bool check_rate_limit(const std::string& route_name);
 
+    // With the stats, from the routes' and targets' own counters
     struct RoutingStats {
         std::unordered_map<std::string, uint64_t> route_hits;
         std::unordered_map<std::string, uint64_t> backend_selections;
@@ -124,34 +185,29 @@ public:
     void reset_stats();
 
 private:
+    struct CompiledRoutes;
+
     std::vector<std::shared_ptr<Route>> routes_;
     std::string default_backend_;
     mutable std::shared_mutex routes_mutex_;
 
-    // Cache default backend target to avoid repeated allocations
-    std::atomic<RouteTarget*> default_backend_target_;
+    const uint64_t id_;                 // tells routers apart in the thread caches
+    std::atomic<uint64_t> version_{1};
+    std::atomic<std::shared_ptr<const CompiledRoutes>> compiled_;
 
-    struct RateLimiter {
-        int tokens;
-        int max_tokens;
-        std::chrono::steady_clock::time_point last_refill;
-        std::mutex mutex;
-    };
+    const CompiledRoutes* snapshot();
+    std::shared_ptr<const CompiledRoutes> compile();
 
-    std::unordered_map<std::string, std::unique_ptr<RateLimiter>> rate_limiters_;
-    mutable std::mutex rate_limiters_mutex_;
+    // Under routes_mutex_, and copied into each compiled table
+    std::unordered_map<std::string, std::shared_ptr<RateLimiter>> rate_limiters_;
 
     // Internal stats use atomics for lock-free updates
     struct InternalStats {
         std::atomic<uint64_t> total_requests{0};
         std::atomic<uint64_t> routed_requests{0};
         std::atomic<uint64_t> default_route_hits{0};
-        std::unordered_map<std::string, uint64_t> backend_selections;
     };
     mutable InternalStats stats_;
-    mutable std::mutex stats_mutex_;
-
-    void refill_tokens(RateLimiter* limiter, int tokens_per_second);
 };
 
 class RouterManager {
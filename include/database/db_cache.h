@@ -0,0 +1,89 @@
+#ifndef DB_CACHE_H
+#define DB_CACHE_H
+
+#include "db_protocol.h"
+#include "cache/cache.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/*
+ * Result cache for SQL reads, on top of the sharded cache store. An entry
+ * holds the backend's raw response bytes, so a hit is written to the client
+ * as is.
+ *
+ * Caching is opt in per table: a rule names a table, or a prefix of names
+ * ending in '*', and the TTL of results that read it. A read is cached
+ * only when every table it names matches a rule, and it lives for the
+ * shortest TTL among them.
+ *
+ * Each rule has a generation, folded into the keys of the reads that use
+ * it. A completed write to a matching table bumps the generation, so older
+ * results are never found again and age out of the store. Writes that name
+ * no table, or that the classifier cannot place, bump every rule.
+ *
+ * Results of volatile functions (now(), random()) are cached like any
+ * other; send such reads with a ub:primary hint to keep them out.
+ */
+#define DB_CACHE_MAX_RULES      64      /* one bit each in a pending write mask */
+#define DB_CACHE_MAX_TABLES     16      /* per statement; more are not cached */
+#define DB_CACHE_NAME_MAX       64
+
+#define DB_CACHE_HIT            0
+#define DB_CACHE_MISS           1       /* route it, then db_cache_store the response */
+#define DB_CACHE_BYPASS         2       /* not cacheable, route it */
+
+typedef struct {
+    char schema[DB_CACHE_NAME_MAX];     /* empty matches any schema */
+    char table[DB_CACHE_NAME_MAX];
+    uint32_t ttl;                       /* seconds, 0 for the store's max_age */
+    _Atomic uint64_t generation;
+} db_cache_rule_t;
+
+typedef struct db_cache {
+    cache_t* store;
+    db_cache_rule_t rules[DB_CACHE_MAX_RULES];
+    _Atomic uint32_t rule_count;
+    pthread_mutex_t lock;               /* rule additions */
+
+    struct {
+        _Atomic uint64_t hits;
+        _Atomic uint64_t misses;
+        _Atomic uint64_t bypassed;
+        _Atomic uint64_t stores;
+        _Atomic uint64_t invalidations;
+    } stats;
+} db_cache_t;
+
+/* Built by the lookup on the caller's stack, stored under on a miss */
+typedef struct {
+    cache_key_buf_t buf;
+    cache_key_t key;
+    uint32_t ttl;
+} db_cache_key_t;
+
+db_cache_t* db_cache_create(const char* name, uint32_t max_size, uint32_t max_object_size);
+void db_cache_destroy(db_cache_t* cache);
+
+/* "table", "schema.table" or "prefix*" */
+int db_cache_add_rule(db_cache_t* cache, const char* table, uint32_t ttl);
+
+/*
+ * params are the statement's bound values as the protocol carried them,
+ * without connection-local ids such as a MySQL statement id. On a hit
+ * *entry holds the response in entry->data, referenced until the caller
+ * gives it back with cache_entry_put.
+ */
+int db_cache_lookup(db_cache_t* cache, const db_query_info_t* info,
+                    const void* params, size_t params_length,
+                    db_cache_key_t* key, cache_entry_t** entry);
+int db_cache_store(db_cache_t* cache, const db_cache_key_t* key,
+                   const void* response, size_t length);
+
+/* The rules a write touches, as a mask for db_cache_invalidate */
+uint64_t db_cache_written_rules(db_cache_t* cache, const db_query_info_t* info);
+void db_cache_invalidate(db_cache_t* cache, uint64_t rules);
+
+#endif
@@ -12,6 +12,60 @@
 extern "C" {
 #endif
 
+/*
+ * One checker thread keeps a monitoring connection open to every backend
+ * and probes them all at once each interval: the queries go out together
+ * and one poll loop collects the replies, so a round costs the slowest
+ * backend's round trip rather than the sum of them. Each reply is
+ * published to the pool as soon as it is read.
+ *
+ * PostgreSQL replicas report their replay lag and LSN, MySQL replicas
+ * Seconds_Behind_Source (SHOW REPLICA STATUS, or SHOW SLAVE STATUS on
+ * servers from before MySQL 8.0.22 and MariaDB 10.5.1, picked from the
+ * handshake's version and on a syntax error); primaries and Redis are only
+ * checked for an answer. The monitor user must be able to log in without a password
+ * (trust, or an empty password on MySQL), and on MySQL needs the
+ * REPLICATION CLIENT privilege.
+ */
+#define DB_HEALTH_INTERVAL_MS   250     /* when created with 0 */
+#define DB_HEALTH_TIMEOUT_MS    1000
+#define DB_HEALTH_BUF_SIZE      16384   /* per connection, replies are small */
+#define DB_HEALTH_USER          "monitor"
+#define DB_HEALTH_DATABASE      "postgres"
+
+typedef enum {
+    DB_MONITOR_DOWN = 0,        /* dialled again at the next round */
+    DB_MONITOR_CONNECTING,
+    DB_MONITOR_STARTUP,         /* handshake and authentication */
+    DB_MONITOR_READY,           /* between probes */
+    DB_MONITOR_PROBING
+} db_monitor_state_t;
+
+typedef struct {
+    uint64_t backend_id;
+    char host[256];
+    uint16_t port;
+    db_backend_role_t role;
+    db_protocol_type_t protocol;
+
+    int fd;
+    db_monitor_state_t state;
+    uint64_t deadline_ms;
+
+    uint8_t* in;
+    size_t in_len;
+    uint8_t step;               /* progress inside the state */
+
+    /* MySQL result set being read */
+    uint32_t columns;
+    uint32_t column;            /* column definitions seen */
+    int lag_column;             /* Seconds_Behind_Source, -1 if absent */
+    bool mysql_slave_status;    /* the server predates SHOW REPLICA STATUS */
+
+    uint64_t lag_ms;            /* of the last probe, UINT64_MAX if unknown */
+    uint64_t position;
+} db_health_monitor_t;
+
 typedef struct {
     db_pool_t* pool;
     atomic_bool running;
@@ -19,6 +73,19 @@ typedef struct {
     uint32_t timeout_ms;
     uint32_t max_lag_ms;
     pthread_t thread;
+
+    char user[64];
+    char database[64];
+
+    db_health_monitor_t* monitors;  /* by backend id - 1 */
+    uint32_t monitor_count;
+
+    struct {
+        _Atomic uint64_t rounds;
+        _Atomic uint64_t probes;
+        _Atomic uint64_t failures;
+        _Atomic uint64_t reconnects;
+    } stats;
 } db_health_checker_t;
 
 db_health_checker_t* db_health_checker_create(db_pool_t* pool,
@@ -28,9 +95,15 @@ db_health_checker_t* db_health_checker_create(db_pool_t* pool,
 
 void db_health_checker_destroy(db_health_checker_t* checker);
 
+/* Login for the monitoring connections, before start; DB_HEALTH_USER and
+ * DB_HEALTH_DATABASE by default (MySQL connects without a database) */
+void db_health_checker_set_login(db_health_checker_t* checker, const char* user,
+                                 const char* database);
+
 int db_health_checker_start(db_health_checker_t* checker);
 void db_health_checker_stop(db_health_checker_t* checker);
 
+/* One-off blocking checks on a fresh connection, outside the checker */
 int db_health_check_backend(db_backend_t* backend);
 uint64_t db_health_check_replication_lag(db_backend_t* backend);
 
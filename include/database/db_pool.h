@@ -28,6 +28,7 @@ typedef struct db_connection_t {
     time_t last_used;
     uint32_t query_count;
     uint64_t backend_id;
+    void* handle;           /* the pool's connection, owned until db_pool_release */
     struct db_connection_t* next;
 } db_connection_t;
 
@@ -46,6 +47,43 @@ typedef struct db_backend_t {
     struct db_backend_t* next;
 } db_backend_t;
 
+/*
+ * Replica weight against replication lag: full up to the soft threshold,
+ * falling linearly to DB_REPLICA_WEIGHT_MIN at the hard one. A lagging
+ * replica keeps a trickle of reads rather than being cut off.
+ */
+#define DB_REPLICA_WEIGHT_FULL   1024
+#define DB_REPLICA_WEIGHT_MIN    64
+#define DB_REPLICA_LAG_SOFT_MS   1000
+#define DB_REPLICA_LAG_HARD_MS   5000
+
+/*
+ * With min_idle set, the pool's maintainer keeps that many connections open
+ * to every healthy backend. It fills them in at startup and each time a
+ * backend comes back up, opening at most DB_POOL_WARM_BATCH per backend an
+ * interval so that a recovering backend is not met by a burst of connects,
+ * and it replaces connections in the last DB_POOL_REFRESH_PERCENT of their
+ * max_lifetime before acquire would have to drop them. A pass starts the
+ * connects to every backend at once and waits on them together, so one
+ * backend that does not answer holds the others back by at most
+ * DB_POOL_CONNECT_TIMEOUT_MS, once.
+ */
+#define DB_POOL_MAINTAIN_INTERVAL_MS    100
+#define DB_POOL_WARM_BATCH              4
+#define DB_POOL_REFRESH_PERCENT         10
+#define DB_POOL_CONNECT_TIMEOUT_MS      5000
+
+/*
+ * What a read has to see: the session's last write. A replica qualifies
+ * when its replay position has reached position, or, without a position,
+ * when it has replayed everything committed up to written_ms
+ * (CLOCK_MONOTONIC milliseconds, derived from its measured lag).
+ */
+typedef struct {
+    uint64_t position;      /* LSN or GTID sequence, 0 if unknown */
+    uint64_t written_ms;
+} db_causal_t;
+
 typedef struct {
     db_connection_t* idle_connections;
     db_connection_t* active_connections;
@@ -70,10 +108,28 @@ int db_pool_add_backend(db_pool_t* pool, const char* host, uint16_t port,
 db_connection_t* db_pool_acquire(db_pool_t* pool, db_query_type_t query_type,
                                   bool in_transaction, uint64_t session_backend_id);
 
+/* Restricts reads to replicas that have caught up with causal, if given */
+db_connection_t* db_pool_acquire_causal(db_pool_t* pool, db_query_type_t query_type,
+                                        bool in_transaction, uint64_t session_backend_id,
+                                        const db_causal_t* causal);
+
 void db_pool_release(db_pool_t* pool, db_connection_t* conn);
+/* Close instead of pooling, for a connection whose state cannot be reused */
+void db_pool_discard(db_pool_t* pool, db_connection_t* conn);
 
 db_backend_t* db_pool_select_backend(db_pool_t* pool, db_query_type_t query_type);
 
+/* Backend ids run from 1 to db_pool_backend_count */
+uint32_t db_pool_backend_count(db_pool_t* pool);
+/* Copy of one backend's settings and current state */
+int db_pool_get_backend(db_pool_t* pool, uint64_t backend_id, db_backend_t* out);
+int db_pool_set_backend_health(db_pool_t* pool, uint64_t backend_id, bool healthy);
+
+/* From replica probes: lag in ms (UINT64_MAX if unknown) and, if known,
+ * the replayed LSN or GTID sequence */
+int db_pool_set_replica_state(db_pool_t* pool, uint64_t backend_id,
+                              uint64_t lag_ms, uint64_t position);
+
 int db_pool_validate_connection(db_connection_t* conn);
 
 void db_pool_cleanup_idle(db_pool_t* pool);
@@ -6,12 +6,15 @@
 #include <vector>
 #include <unordered_map>
 #include <mutex>
-#include <shared_mutex>
+#include <condition_variable>
+#include <thread>
 #include <atomic>
 #include <chrono>
 #include <optional>
 #include <variant>
 #include "db_protocol.h"
+#include "db_pool.h"
+#include "core/liveness.hpp"
 
 template<typename E>
 class unexpected {
@@ -85,7 +88,9 @@ struct ConnectionStats {
 
 class Connection {
 public:
-    Connection(int fd, db_protocol_type_t protocol, uint64_t backend_id);
+    // With a watcher, validate() reads its flag instead of the socket
+    Connection(int fd, db_protocol_type_t protocol, uint64_t backend_id,
+               LivenessWatcher* watcher = nullptr);
     ~Connection();
 
     Connection(const Connection&) = delete;
@@ -113,6 +118,8 @@ private:
     std::chrono::steady_clock::time_point created_at_;
     std::chrono::steady_clock::time_point last_used_;
     ConnectionState state_;
+    LivenessWatcher* watcher_;
+    uint32_t watch_slot_;
 };
 
 class Backend {
@@ -127,15 +134,22 @@ public:
     [[nodiscard]] db_protocol_type_t protocol() const noexcept { return protocol_; }
     [[nodiscard]] bool is_healthy() const noexcept { return is_healthy_.load(); }
     [[nodiscard]] uint64_t replication_lag_ms() const noexcept { return replication_lag_ms_.load(); }
+    [[nodiscard]] uint64_t replay_position() const noexcept { return replay_position_.load(); }
+    [[nodiscard]] uint64_t replayed_until_ms() const noexcept { return replayed_until_ms_.load(); }
+    [[nodiscard]] bool caught_up(const db_causal_t& causal) const noexcept;
     [[nodiscard]] uint32_t active_connections() const noexcept { return active_connections_.load(); }
 
     void set_healthy(bool healthy) noexcept { is_healthy_.store(healthy); }
-    void set_replication_lag(uint64_t lag_ms) noexcept { replication_lag_ms_.store(lag_ms); }
+    void set_replication_lag(uint64_t lag_ms) noexcept;
+    void set_replay_position(uint64_t position) noexcept { replay_position_.store(position); }
     void increment_connections() noexcept { active_connections_.fetch_add(1); }
     void decrement_connections() noexcept { active_connections_.fetch_sub(1); }
     void set_role(BackendRole role) noexcept { role_ = role; }
 
     [[nodiscard]] expected<int, std::string> create_connection();
+    // The nonblocking connect under way; the socket turns writable once it
+    // is done, SO_ERROR telling how it went
+    [[nodiscard]] expected<int, std::string> start_connection();
 
 private:
     uint64_t id_;
@@ -145,9 +159,51 @@ private:
     db_protocol_type_t protocol_;
     std::atomic<bool> is_healthy_{true};
     std::atomic<uint64_t> replication_lag_ms_{0};
+    std::atomic<uint64_t> replay_position_{0};
+    std::atomic<uint64_t> replayed_until_ms_{0};   // commits before this are visible
     std::atomic<uint32_t> active_connections_{0};
 };
 
+// Bounded MPMC queue of idle connections, capacity rounded up to a power
+// of two, at least 2. Each cell carries a sequence number (after D. Vyukov): producers
+// and consumers only contend on their own index and the cell they claim.
+// push fails when full and pop returns nullptr when empty, neither waits.
+class IdleRing {
+public:
+    explicit IdleRing(uint32_t capacity);
+
+    [[nodiscard]] bool push(Connection* conn) noexcept;
+    [[nodiscard]] Connection* pop() noexcept;
+
+private:
+    struct Cell {
+        std::atomic<uint64_t> seq;
+        Connection* conn;
+    };
+
+    std::unique_ptr<Cell[]> cells_;
+    uint64_t mask_;
+    alignas(64) std::atomic<uint64_t> head_{0};
+    alignas(64) std::atomic<uint64_t> tail_{0};
+};
+
+/*
+ * acquire and release take no pool-wide lock. The backends are published
+ * as an immutable BackendSet that readers load with one acquire; add_backend
+ * builds a new set under config_mutex_ and swaps it in. Backends are never
+ * removed, so a replaced set is kept until the pool is destroyed.
+ *
+ * Each backend has its own IdleRing, so threads working on different
+ * backends never touch the same cache lines and threads on one backend only
+ * contend on the ring indices.
+ *
+ * maintainer_ keeps min_idle_ connections warm per backend, see
+ * DB_POOL_WARM_BATCH.
+ *
+ * Connections are watched for hangups by watcher_, so acquire and release
+ * check a flag rather than the socket, and a connection the backend drops
+ * while idle is closed by the watcher's sweep instead of at its next use.
+ */
 class DatabasePool {
 public:
     DatabasePool(uint32_t max_connections, uint32_t min_idle, uint32_t max_idle,
@@ -162,11 +218,16 @@ public:
 
     [[nodiscard]] expected<std::unique_ptr<Connection>, std::string>
     acquire(db_query_type_t query_type, bool in_transaction = false,
-            std::optional<uint64_t> session_backend_id = std::nullopt);
+            std::optional<uint64_t> session_backend_id = std::nullopt,
+            const db_causal_t* causal = nullptr);
 
     void release(std::unique_ptr<Connection> conn);
+    void discard(std::unique_ptr<Connection> conn);
 
-    [[nodiscard]] std::optional<Backend*> select_backend(db_query_type_t query_type);
+    [[nodiscard]] std::optional<Backend*> select_backend(db_query_type_t query_type,
+                                                         const db_causal_t* causal = nullptr);
+
+    void set_lag_thresholds(uint64_t soft_ms, uint64_t hard_ms) noexcept;
 
     void cleanup_idle_connections();
 
@@ -175,14 +236,57 @@ public:
     [[nodiscard]] std::string get_stats_json() const;
 
     [[nodiscard]] Backend* get_backend_by_id(uint64_t id) const noexcept;
+    // Ids run from 1 to backend_count()
+    [[nodiscard]] uint64_t backend_count() const noexcept { return backend_set()->shards.size(); }
 
 private:
+    struct Shard {
+        Shard(std::unique_ptr<Backend> b, uint32_t max_idle)
+            : backend(std::move(b)), idle(max_idle) {}
+
+        std::unique_ptr<Backend> backend;
+        IdleRing idle;
+        // Reserved before a push and released after a pop, so it never
+        // undercounts the ring and caps it at max_idle_
+        alignas(64) std::atomic<uint32_t> idle_count{0};
+    };
+
+    // Indexed by backend id - 1
+    struct BackendSet {
+        std::vector<Shard*> shards;
+    };
+
+    [[nodiscard]] const BackendSet* backend_set() const noexcept {
+        return backend_set_.load(std::memory_order_acquire);
+    }
+    [[nodiscard]] Shard* get_shard(const BackendSet* set, uint64_t id) const noexcept;
+    [[nodiscard]] Connection* pop_idle(Shard* shard) noexcept;
+    [[nodiscard]] bool push_idle(Shard* shard, Connection* conn) noexcept;
+    void close_connection(std::unique_ptr<Connection> conn) noexcept;
+    // A warm-up connect in flight, its slot in total_connections_ taken
+    struct PendingConnect {
+        Shard* shard;
+        int fd;
+    };
+
+    void drain_idle(Shard* shard) noexcept;
+    void maintain_shard(Shard* shard, bool refresh, std::vector<PendingConnect>& pending);
+    void finish_connects(std::vector<PendingConnect>& pending);
+    void maintain();
+
     [[nodiscard]] std::unique_ptr<Connection> create_new_connection(Backend* backend);
-    [[nodiscard]] Backend* select_primary();
-    [[nodiscard]] Backend* select_replica();
+    [[nodiscard]] Backend* select_backend(const BackendSet* set, db_query_type_t query_type,
+                                          const db_causal_t* causal);
+    [[nodiscard]] Backend* select_primary(const BackendSet* set);
+    [[nodiscard]] Backend* select_replica(const BackendSet* set, const db_causal_t* causal);
+    [[nodiscard]] uint32_t replica_weight(uint64_t lag_ms) const noexcept;
+
+    std::atomic<const BackendSet*> backend_set_{nullptr};
 
-    std::vector<std::unique_ptr<Backend>> backends_;
-    std::unordered_map<uint64_t, std::vector<std::unique_ptr<Connection>>> idle_connections_;
+    // Writers only: owns the shards and every set published so far
+    std::mutex config_mutex_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+    std::vector<std::unique_ptr<BackendSet>> sets_;
 
     uint32_t max_connections_;
     uint32_t min_idle_;
@@ -190,11 +294,19 @@ private:
     std::chrono::seconds max_lifetime_;
     std::chrono::seconds idle_timeout_;
 
-    std::atomic<uint64_t> next_backend_id_{1};
     std::atomic<uint32_t> total_connections_{0};
+    std::atomic<uint64_t> lag_soft_ms_{DB_REPLICA_LAG_SOFT_MS};
+    std::atomic<uint64_t> lag_hard_ms_{DB_REPLICA_LAG_HARD_MS};
 
     ConnectionStats stats_;
-    mutable std::shared_mutex mutex_;
+
+    std::thread maintainer_;
+    std::mutex maintain_mutex_;
+    std::condition_variable maintain_cv_;
+    bool stopping_ = false;
+
+    // Declared last so it goes first: its thread sweeps the rings
+    LivenessWatcher watcher_{[this] { cleanup_idle_connections(); }};
 };
 
 }
@@ -21,9 +21,20 @@ typedef enum {
     DB_QUERY_SESSION_VAR
 } db_query_type_t;
 
+/* From a "ub:replica" or "ub:primary" comment in the statement */
+typedef enum {
+    DB_HINT_NONE = 0,
+    DB_HINT_PRIMARY,
+    DB_HINT_REPLICA
+} db_route_hint_t;
+
+#define DB_CLASSIFY_CACHE_SIZE  1024    /* verdicts cached per thread, power of two */
+#define DB_CLASSIFY_CACHE_MIN   64      /* shorter statements are cheaper to classify again */
+
 typedef struct {
     db_protocol_type_t protocol;
     db_query_type_t query_type;
+    db_route_hint_t hint;
     const char* query_text;
     size_t query_length;
     bool is_transaction;
@@ -45,6 +56,28 @@ int db_protocol_parse_mysql(const uint8_t* data, size_t length, db_query_info_t*
 int db_protocol_parse_redis(const uint8_t* data, size_t length, db_query_info_t* info);
 
 db_query_type_t db_protocol_classify_query(const char* query, size_t length);
+db_query_type_t db_protocol_classify_query_hint(const char* query, size_t length,
+                                                db_route_hint_t* hint);
+
+/* A table named by a statement, pointing into its text, quotes stripped */
+typedef struct {
+    const char* schema;         /* NULL when not qualified */
+    size_t schema_length;
+    const char* name;
+    size_t name_length;
+} db_table_ref_t;
+
+/* The tables a statement reads or writes; -1 when there are more than max
+ * or the statement nests them where they cannot all be told apart */
+int db_protocol_query_tables(const char* query, size_t length, db_table_ref_t* tables, int max);
+
+/*
+ * The statement with comments dropped and whitespace squeezed, so the same
+ * query sent with different formatting gives the same text. Quoted text is
+ * kept byte for byte. Returns the length, or (size_t)-1 when cap is short.
+ */
+size_t db_protocol_normalize_query(db_protocol_type_t protocol, const char* query, size_t length,
+                                   char* out, size_t cap);
 
 bool db_protocol_is_handshake(const uint8_t* data, size_t length, db_protocol_type_t protocol);
 
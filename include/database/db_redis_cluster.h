@@ -0,0 +1,88 @@
+#ifndef DB_REDIS_CLUSTER_H
+#define DB_REDIS_CLUSTER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Redis Cluster routing. A key belongs to one of 16384 slots, the CRC16 of
+ * the key or of its {hash tag}. The slot map is loaded from CLUSTER SLOTS
+ * and corrected by MOVED replies. Each entry is an atomic node index, so
+ * workers route without a lock while a refresh rewrites the map; a stale
+ * entry only costs a redirect.
+ *
+ * A client's pipelined batch is split per shard, each part goes to its node
+ * as one pipeline, all shards in parallel, and the replies are put back in
+ * command order. MOVED and ASK are followed by the proxy. Commands that
+ * need a connection of their own (MULTI, blocking pops, SUBSCRIBE, ...) or
+ * every node (KEYS, SCAN, FLUSHALL) are refused with an error reply.
+ */
+#define DB_REDIS_SLOTS          16384
+#define DB_REDIS_MAX_NODES      256
+#define DB_REDIS_MAX_BATCH      1024    /* commands routed per call */
+#define DB_REDIS_MAX_REDIRECTS  5
+#define DB_REDIS_IO_TIMEOUT_MS  1000
+#define DB_REDIS_NO_NODE        0xffff
+
+typedef struct {
+    char host[64];
+    uint16_t port;
+} db_redis_node_t;
+
+typedef struct {
+    db_redis_node_t nodes[DB_REDIS_MAX_NODES];  /* append only */
+    _Atomic uint32_t node_count;
+    _Atomic uint16_t slots[DB_REDIS_SLOTS];
+    atomic_bool stale;              /* refresh the slot map before the next batch */
+    pthread_mutex_t lock;           /* node additions */
+
+    struct {
+        _Atomic uint64_t commands;
+        _Atomic uint64_t batches;
+        _Atomic uint64_t moved;
+        _Atomic uint64_t asked;
+        _Atomic uint64_t refreshes;
+    } stats;
+} db_redis_cluster_t;
+
+typedef struct {
+    uint8_t* data;
+    size_t len;
+    size_t cap;
+} db_redis_buf_t;
+
+/* Connections to the nodes, one per thread; calls on it are synchronous */
+typedef struct db_redis_client db_redis_client_t;
+
+db_redis_cluster_t* db_redis_cluster_create(const char* seed_host, uint16_t seed_port);
+void db_redis_cluster_destroy(db_redis_cluster_t* cluster);
+
+db_redis_client_t* db_redis_client_create(db_redis_cluster_t* cluster);
+void db_redis_client_destroy(db_redis_client_t* client);
+
+uint16_t db_redis_key_slot(const uint8_t* key, size_t len);
+
+/* Reload the slot map through one of the known nodes */
+int db_redis_cluster_refresh(db_redis_client_t* client);
+
+/*
+ * Route the complete commands at the start of in and append their replies,
+ * in order, to out. Returns the bytes of in consumed, 0 when no command is
+ * complete yet, -1 on a protocol error.
+ */
+ssize_t db_redis_execute(db_redis_client_t* client, const uint8_t* in, size_t len,
+                         db_redis_buf_t* out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -3,15 +3,50 @@
 
 #include "db_protocol.h"
 #include "db_pool.h"
+#include "db_cache.h"
 #include <stdint.h>
 #include <stdbool.h>
 #include <time.h>
 
-typedef struct {
+/*
+ * In DB_POOL_SESSION mode a client session keeps talking to the backend it
+ * was routed to, and the caller holds the connection it is given.
+ *
+ * In DB_POOL_TRANSACTION mode server connections are lent per transaction:
+ * from DB_QUERY_TRANSACTION_BEGIN until db_router_query_done is called for
+ * the DB_QUERY_TRANSACTION_END, or for one autocommit statement. A session
+ * that changes its state (DB_QUERY_SESSION_VAR) is pinned to its connection
+ * until it ends, and that connection is closed rather than pooled so the
+ * state never leaks to another client.
+ */
+typedef enum {
+    DB_POOL_SESSION = 0,
+    DB_POOL_TRANSACTION
+} db_pool_mode_t;
+
+/*
+ * Sessions live in a fixed array of max_sessions slots, indexed by a
+ * chained hash on session_id. Idle sessions are also on an LRU list, most
+ * recent first; a busy one (open transaction or a lent connection) is
+ * taken off it, so the tail is always the session to evict.
+ */
+typedef struct db_session {
     uint64_t session_id;
     uint64_t backend_id;
     bool in_transaction;
+    bool pinned;
+    bool used;
+    bool in_lru;
+    bool write_pending;         /* a write has not completed yet */
+    db_connection_t* server;    /* transaction mode: lent to this session */
     time_t last_activity;
+    uint64_t write_position;    /* of the last write, 0 if not reported */
+    uint64_t written_ms;        /* CLOCK_MONOTONIC, when it completed */
+    uint64_t causal_until_ms;
+    uint64_t cache_rules;       /* result cache rules its pending writes touch */
+    struct db_session* hash_next;   /* or the next free slot */
+    struct db_session* lru_prev;
+    struct db_session* lru_next;
 } db_session_t;
 
 typedef struct db_router_t {
@@ -19,6 +54,15 @@ typedef struct db_router_t {
     db_session_t* sessions;
     uint32_t session_count;
     uint32_t max_sessions;
+    db_session_t** buckets;
+    uint32_t bucket_mask;
+    db_session_t* free_list;
+    db_session_t* lru_head;
+    db_session_t* lru_tail;
+    db_pool_mode_t mode;
+    uint32_t lent_count;        /* server connections held by sessions */
+    uint32_t causal_window_ms;  /* read-your-writes, 0 when off */
+    db_cache_t* cache;          /* read results, NULL when off */
     void* mutex;
 } db_router_t;
 
@@ -30,6 +74,39 @@ db_connection_t* db_router_route_query(db_router_t* router,
                                         size_t query_length,
                                         uint64_t client_session_id);
 
+void db_router_set_mode(db_router_t* router, db_pool_mode_t mode);
+
+/*
+ * Read-your-writes: for window_ms after a session's write completes, its
+ * reads only go to replicas that have caught up with it, else the primary.
+ * db_router_set_write_position records the LSN or GTID sequence the write
+ * committed at, where the protocol reports one; otherwise replicas are
+ * judged by their measured lag.
+ */
+void db_router_set_causal_window(db_router_t* router, uint32_t window_ms);
+void db_router_set_write_position(db_router_t* router, uint64_t client_session_id,
+                                  uint64_t position);
+
+/*
+ * Result cache: db_router_cache_lookup before routing a statement answers
+ * the cacheable reads it can, and leaves the key to db_cache_store the
+ * response under on a miss. Reads in a transaction, in a pinned session or
+ * behind the session's own unfinished write always go to a backend. A
+ * write invalidates the tables it names once db_router_query_done reports
+ * it complete (for a transaction, its end), so a result read while it ran
+ * is not kept.
+ */
+void db_router_set_cache(db_router_t* router, db_cache_t* cache);
+int db_router_cache_lookup(db_router_t* router, const uint8_t* query_data, size_t query_length,
+                           const void* params, size_t params_length,
+                           uint64_t client_session_id, db_cache_key_t* key,
+                           cache_entry_t** entry);
+
+/* The response to a routed query is complete: returns conn to the pool
+ * unless the session still holds it */
+void db_router_query_done(db_router_t* router, uint64_t client_session_id,
+                          db_connection_t* conn);
+
 void db_router_end_session(db_router_t* router, uint64_t client_session_id);
 
 int db_router_get_stats(db_router_t* router, char* buffer, size_t buffer_size);
@@ -181,6 +181,20 @@ int check_ldap(check_t *check);
 int check_ssl(check_t *check);
 int check_external(check_t *check);
 
+/*
+ * Probe steps without any I/O, shared by the blocking check_* functions and
+ * the event-driven checker in health.c. check_probe_request writes what is
+ * sent once connected: -1 if it does not fit, 0 bytes when the server
+ * speaks first. check_probe_response judges what has been read so far and
+ * returns 1 once the verdict is in and the status set, 0 while it needs
+ * more data; with eof set it always decides.
+ */
+int check_probe_request(const check_t *check, char *buf, size_t size);
+int check_probe_response(check_t *check, const char *data, size_t len, bool eof);
+bool check_passed(const check_t *check);
+/* inter while up, downinter while down, fastinter while either is wavering */
+uint32_t check_next_interval(const check_t *check, bool up);
+
 int process_check_result(check_t *check);
 void set_server_check_status(check_t *check, check_status_t status, const char *desc);
 void set_server_up(check_t *check);
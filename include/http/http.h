@@ -33,6 +33,50 @@ struct channel;
 #define HTTP_METH_CONNECT     0x0080
 #define HTTP_METH_PATCH       0x0100
 
+// Well-known headers, resolved once while parsing
+enum {
+    HTTP_HDR_OTHER = 0,
+    HTTP_HDR_HOST,
+    HTTP_HDR_CONTENT_LENGTH,
+    HTTP_HDR_TRANSFER_ENCODING,
+    HTTP_HDR_CONNECTION,
+    HTTP_HDR_UPGRADE,
+    HTTP_HDR_KEEP_ALIVE,
+    HTTP_HDR_EXPECT,
+    HTTP_HDR_CACHE_CONTROL,
+    HTTP_HDR_COOKIE,
+    HTTP_HDR_ETAG,
+    HTTP_HDR_LAST_MODIFIED,
+    HTTP_HDR_VARY,
+    HTTP_HDR_IF_NONE_MATCH,
+    HTTP_HDR_IF_MODIFIED_SINCE,
+    HTTP_HDR_ACCEPT_ENCODING,
+    HTTP_HDR_CONTENT_ENCODING,
+    HTTP_HDR_CONTENT_TYPE,
+    HTTP_HDR_USER_AGENT,
+    HTTP_HDR_AUTHORIZATION,
+    HTTP_HDR_X_FORWARDED_FOR,
+    HTTP_HDR_KNOWN
+};
+
+// Headers per message; more is rejected like an oversized header block
+#define HTTP_MAX_HDRS         101
+
+// Name and value point into the message buffer; nothing is copied
+typedef struct http_hdr {
+    struct {
+        char *ptr;
+        size_t len;
+    } n;
+
+    struct {
+        char *ptr;
+        size_t len;
+    } v;
+
+    uint8_t id;
+} http_hdr_t;
+
 typedef struct http_msg {
     uint32_t msg_state;
     uint32_t flags;
@@ -63,6 +107,10 @@ typedef struct http_msg {
     uint32_t meth;
     char *uri;
     size_t uri_len;
+
+    uint16_t hdr_count;
+    uint8_t hdr_idx[HTTP_HDR_KNOWN];  // 1 + first index per known id, 0 if absent
+    http_hdr_t hdrs[HTTP_MAX_HDRS];
 } http_msg_t;
 
 typedef struct http_txn {
@@ -91,20 +139,6 @@ typedef struct http_txn {
     struct http_req_rule *rules;
 } http_txn_t;
 
-typedef struct http_hdr {
-    struct {
-        char *ptr;
-        size_t len;
-    } n;
-
-    struct {
-        char *ptr;
-        size_t len;
-    } v;
-
-    struct http_hdr *next;
-} http_hdr_t;
-
 typedef struct h1_conn {
     uint32_t flags;
     struct buffer ibuf;
@@ -171,6 +205,8 @@ void http_txn_reset_req(http_txn_t *txn);
 void http_txn_reset_res(http_txn_t *txn);
 
 int http_header_add_tail(http_msg_t *msg, http_hdr_t *hdr);
+int http_header_id(const char *name, size_t len);
+http_hdr_t* http_header_find(http_msg_t *msg, int id);
 int http_header_add(http_msg_t *msg, const char *name, const char *value);
 int http_header_del(http_msg_t *msg, const char *name);
 char* http_header_get(http_msg_t *msg, const char *name);
@@ -0,0 +1,95 @@
+#ifndef PEERS_H
+#define PEERS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include "stick_tables.h"
+
+/*
+ * Stick table replication between load balancer nodes. Every node dials
+ * each configured peer and streams its own updates over that connection;
+ * what peers send over the connections they dialled in is applied to the
+ * local tables. A new outgoing connection starts with a full dump of every
+ * attached table, so a node that (re)joins catches up from each peer.
+ *
+ * Updates only mark the entry dirty (stktable_mark_dirty). Every
+ * PEERS_FLUSH_MS the peers thread encodes the current value of each
+ * counter that changed, so all updates to one entry between two flushes
+ * cost a single record. Values are absolute and the last writer wins.
+ */
+#define PEERS_VERSION       1
+#define PEERS_MAX_TABLES    16
+#define PEERS_FLUSH_MS      100
+#define PEERS_RETRY_MS      1000          /* reconnect backoff */
+#define PEERS_BUF_SIZE      (256 * 1024)  /* per connection, each way */
+
+/*
+ * Messages are [u8 type][u16 length, big endian][payload]. Integers in
+ * UPDATE are LEB128 varints; counters follow in STKTABLE_DATA_* bit order.
+ */
+#define PEERS_MSG_HELLO     1   /* u8 version, node name */
+#define PEERS_MSG_TABLE     2   /* u8 key type, table id: the table of the updates after it */
+#define PEERS_MSG_UPDATE    3   /* key, expire in seconds, data mask, counters */
+
+typedef struct peer {
+    char *name;
+    struct sockaddr_in addr;
+    int fd;                   /* outgoing, -1 while down */
+    bool connected;
+    uint64_t retry_ms;
+
+    /* Full dump still owed: next table and slot to send */
+    bool resync;
+    uint32_t resync_table;
+    uint32_t resync_pos;
+
+    char *out;
+    size_t out_len;
+
+    struct peer *next;
+} peer_t;
+
+typedef struct peer_conn {
+    int fd;
+    stick_table_t *table;     /* selected by the last TABLE message */
+    char *in;
+    size_t in_len;
+    struct peer_conn *next;
+} peer_conn_t;
+
+typedef struct peers {
+    char *local;
+    struct sockaddr_in bind;
+    int listen_fd;
+
+    peer_t *peers;
+    peer_conn_t *inbound;
+
+    stick_table_t *tables[PEERS_MAX_TABLES];
+    uint32_t ntables;
+
+    char *batch;              /* scratch for one flush, shared by every peer */
+    pthread_t thread;
+    _Atomic bool running;
+
+    struct {
+        _Atomic uint64_t updates_out;   /* records encoded, once for all peers */
+        _Atomic uint64_t updates_in;
+        _Atomic uint64_t resyncs;       /* full dumps started */
+        _Atomic uint64_t overflows;     /* slow peer, fell back to a dump */
+    } stats;
+} peers_t;
+
+peers_t* peers_new(const char *local, const char *bind_addr, uint16_t port);
+void peers_free(peers_t *p);
+
+/* Configuration, before peers_start */
+int peers_add(peers_t *p, const char *name, const char *addr, uint16_t port);
+int peers_attach(peers_t *p, stick_table_t *t);
+
+int peers_start(peers_t *p);
+
+#endif
@@ -8,6 +8,7 @@
 #include <openssl/dh.h>
 #include <openssl/engine.h>
 #include <openssl/ocsp.h>
+#include <openssl/async.h>
 #include "core/common.h"
 
 struct server;
@@ -19,6 +20,10 @@ struct server;
 
 #define SSL_SOCK_FL_SSL_STARTED      0x00000001
 #define SSL_SOCK_FL_HANDSHAKE_DONE   0x00000002
+#define SSL_SOCK_FL_KTLS_TX          0x00000004
+#define SSL_SOCK_FL_KTLS_RX          0x00000008
+
+#define SSL_TKT_ROTATE_SECS          43200
 
 typedef struct ssl_bind_conf {
     SSL_CTX *ctx;
@@ -35,6 +40,7 @@ typedef struct ssl_bind_conf {
 
     int verify;
     int verify_depth;
+    int ktls;
 
     struct {
         char *cert;
@@ -50,8 +56,12 @@ typedef struct ssl_bind_conf {
     struct {
         unsigned int lifetime;
         unsigned int size;
+        char *shm_name;     // shared-memory segment kept across restarts
     } session_cache;
 
+    char *tls_ticket_keys;  // key file shared by a fleet, else generated keys
+    unsigned int tls_ticket_rotate;
+
     struct ssl_bind_conf *next;
 } ssl_bind_conf_t;
 
@@ -110,6 +120,16 @@ int ssl_sock_recv(struct connection *conn, void *buf, size_t len, int flags);
 int ssl_sock_send(struct connection *conn, const void *buf, size_t len, int flags);
 int ssl_sock_close(struct connection *conn);
 
+// Kernel TLS: once the handshake installed the session keys in the kernel,
+// conn->fd takes plain send()/splice()/sendfile() and the kernel encrypts
+int ssl_sock_ktls_tx(struct connection *conn);
+ssize_t ssl_sock_sendfile(struct connection *conn, int fd, off_t offset, size_t len);
+// Wait fds of the async job a CO_FL_WAIT_ASYNC connection is parked on that
+// appeared (add) or went away (del) since the last call; the caller polls
+// them for readability and then repeats the interrupted call unchanged
+int ssl_sock_async_fds(struct connection *conn, OSSL_ASYNC_FD *add, size_t *nadd,
+                       OSSL_ASYNC_FD *del, size_t *ndel);
+
 int ssl_sock_get_alpn(struct connection *conn, const char **str, int *len);
 const char* ssl_sock_get_sni(struct connection *conn);
 int ssl_sock_get_cert_used(struct connection *conn);
@@ -119,6 +139,14 @@ int ssl_sock_set_alpn(SSL *ssl, const unsigned char *alpn, unsigned int len);
 int ssl_sock_set_servername(SSL *ssl, const char *hostname);
 
 int ssl_sock_switchctx_cbk(SSL *ssl, int *al, void *priv);
+
+// Session resumption (src/ssl/ssl_sess.c): a session cache shared by all
+// workers and rotating ticket keys
+int ssl_sess_cache_init(unsigned int size, const char *shm_name);
+void ssl_sess_cache_deinit();
+void ssl_ctx_set_sess_cache(SSL_CTX *ctx);
+int ssl_ticket_keys_init(const char *file, unsigned int rotate_secs);
+void ssl_ctx_set_ticket_keys(SSL_CTX *ctx);
 int ssl_sock_sess_new_cbk(SSL *ssl, SSL_SESSION *sess);
 SSL_SESSION* ssl_sock_sess_get_cbk(SSL *ssl, const unsigned char *id, int len, int *copy);
 void ssl_sock_sess_remove_cbk(SSL_CTX *ctx, SSL_SESSION *sess);
@@ -0,0 +1,113 @@
+#ifndef STATS_HISTOGRAM_HPP
+#define STATS_HISTOGRAM_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace ultrabalancer {
+
+class Histogram;
+
+// Small dense number of the calling thread, for picking per-thread slots;
+// fixed for the thread's life and never reused
+uint32_t thread_slot() noexcept;
+
+// One window of a Histogram, merged over every thread that recorded in it
+class HistogramSnapshot {
+public:
+    uint64_t count() const noexcept { return total_; }
+
+    // The highest value that falls in the same bucket as the sample at that
+    // rank, so never under the true percentile and over it by less than the
+    // histogram's precision; 0 when empty
+    uint64_t value_at(double percentile) const noexcept;
+
+    uint64_t min() const noexcept;
+    uint64_t max() const noexcept;
+
+private:
+    friend class Histogram;
+
+    uint32_t bits_ = 0;
+    uint64_t total_ = 0;
+    std::vector<uint64_t> counts_;
+};
+
+/*
+ * Log-linear histogram of non negative integer samples, ns latencies for
+ * the most part. Values under 2^bits get a bucket each; above, every power
+ * of two range is cut into 2^(bits-1) equal buckets, so a bucket is never
+ * wider than 2^(1-bits) of the values in it: 7 bits keep percentiles within
+ * 1.6%, each bit halves that and doubles the buckets. Samples over highest
+ * count in the last bucket.
+ *
+ * Recording is one relaxed add to a counter of the calling thread's own
+ * shard, allocated on its first sample, so threads never share a cache
+ * line or take a lock. Past kMaxThreads, threads share shards, which the
+ * atomic add keeps exact.
+ *
+ * Counts go to one of two windows. rotate() closes the open one, switching
+ * recorders to the other, then merges and clears what the closed one holds:
+ * the windows tumble at whatever pace rotate is called. A sample recorded
+ * while rotate runs may be counted in the window after the next.
+ */
+class Histogram {
+public:
+    static constexpr uint32_t kMaxThreads = 256;
+
+    explicit Histogram(uint64_t highest = 60ull * 1000000000, uint32_t bits = 7);
+    ~Histogram();
+
+    Histogram(const Histogram&) = delete;
+    Histogram& operator=(const Histogram&) = delete;
+
+    void record(uint64_t value) noexcept {
+        uint32_t index = thread_slot() % kMaxThreads;
+        std::atomic<uint64_t>* counts = shards_[index].load(std::memory_order_acquire);
+        if (__builtin_expect(counts == nullptr, 0)) {
+            counts = add_shard(index);
+            if (!counts) return;
+        }
+
+        size_t offset = (window_.load(std::memory_order_relaxed) & 1) * buckets_;
+        counts[offset + bucket(value < highest_ ? value : highest_)]
+            .fetch_add(1, std::memory_order_relaxed);
+    }
+
+    HistogramSnapshot rotate();
+
+    // The open window so far, left as it is
+    HistogramSnapshot current() const;
+
+    uint32_t bits() const noexcept { return bits_; }
+    uint64_t highest() const noexcept { return highest_; }
+
+    // Bucket of a value, and the range of values a bucket holds
+    size_t bucket(uint64_t value) const noexcept {
+        int shift = 63 - __builtin_clzll(value | 1) - (int)bits_ + 1;
+        if (shift < 0) shift = 0;
+        return ((size_t)shift << (bits_ - 1)) + (size_t)(value >> shift);
+    }
+    static uint64_t lowest_value(uint32_t bits, size_t bucket) noexcept;
+    static uint64_t highest_value(uint32_t bits, size_t bucket) noexcept;
+
+private:
+    std::atomic<uint64_t>* add_shard(uint32_t index) noexcept;
+    HistogramSnapshot gather(uint64_t window, bool clear) const;
+
+    const uint32_t bits_;
+    const uint64_t highest_;
+    const size_t buckets_;
+
+    alignas(64) std::atomic<uint64_t> window_{0};
+    mutable std::mutex rotate_mutex_;
+
+    // Two windows of buckets_ counters each, per shard
+    std::atomic<std::atomic<uint64_t>*> shards_[kMaxThreads] = {};
+};
+
+}
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef LB_STATS_H
+#define LB_STATS_H
+
+#include "core/lb_types.h"
+
+// Per-worker traffic counters. Each block is written only by the worker
+// thread that owns it, with a relaxed load/store pair instead of a locked
+// read-modify-write, so the data path never shares a counter cache line.
+// Readers sum every worker's block; totals are exact but not a snapshot.
+typedef struct lb_backend_counters {
+    _Atomic uint64_t bytes_in;
+    _Atomic uint64_t bytes_out;
+} lb_backend_counters_t;
+
+typedef struct __attribute__((aligned(CACHE_LINE_SIZE))) lb_worker_stats {
+    _Atomic uint64_t total_requests;
+    _Atomic uint64_t failed_requests;
+    _Atomic uint64_t bytes_in;
+    _Atomic uint64_t bytes_out;
+    // A connection can be closed by another worker than the one that
+    // accepted it, so only opened - closed over all workers is meaningful
+    _Atomic uint64_t conns_opened;
+    _Atomic uint64_t conns_closed;
+    lb_backend_counters_t backends[MAX_BACKENDS];  // indexed by backend->id
+} lb_worker_stats_t;
+
+typedef struct lb_stats_totals {
+    uint64_t total_requests;
+    uint64_t failed_requests;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t active_connections;
+} lb_stats_totals_t;
+
+static inline void lb_stat_add(_Atomic uint64_t* counter, uint64_t n) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+lb_worker_stats_t* lb_stats_worker_create(void);
+void lb_stats_worker_destroy(lb_worker_stats_t* stats);
+
+// Sum the worker blocks (and lb->global_stats, still fed by the legacy
+// paths) for reporting
+void lb_stats_collect(const loadbalancer_t* lb, lb_stats_totals_t* totals);
+void lb_stats_backend_bytes(const loadbalancer_t* lb, const backend_t* backend,
+                            uint64_t* bytes_in, uint64_t* bytes_out);
+
+// MetricsAggregator timers from C: resolve a name once, then record to it
+// without a lookup (stats/metrics_aggregator.cpp)
+void* metrics_timer_handle(const char* name);
+void metrics_timer_record_ns(void* timer, uint64_t nanoseconds);
+
+#endif
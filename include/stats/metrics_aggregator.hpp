@@ -10,62 +10,19 @@
 #include <mutex>
 #include <memory>
 #include <algorithm>
+#include "stats/histogram.hpp"
 
 namespace ultrabalancer {
 
-template<typename T>
-class RingBuffer {
-public:
-    explicit RingBuffer(size_t size)
-        : size_(size), buffer_(size), head_(0), tail_(0), full_(false) {}
-
-    void push(const T& item) {
-        std::lock_guard<std::mutex> lock(mutex_);
-        buffer_[head_] = item;
-
-        if (full_) {
-            tail_ = (tail_ + 1) % size_;
-        }
-
-        head_ = (head_ + 1) % size_;
-        full_ = head_ == tail_;
-    }
-
-    std::vector<T> get_all() const {
-        std::lock_guard<std::mutex> lock(mutex_);
-        std::vector<T> result;
-
-        if (full_) {
-            result.reserve(size_);
-            for (size_t i = tail_; i != head_; i = (i + 1) % size_) {
-                result.push_back(buffer_[i]);
-            }
-        } else {
-            result.reserve(head_);
-            for (size_t i = 0; i < head_; ++i) {
-                result.push_back(buffer_[i]);
-            }
-        }
-
-        return result;
-    }
-
-private:
-    size_t size_;
-    std::vector<T> buffer_;
-    size_t head_;
-    size_t tail_;
-    bool full_;
-    mutable std::mutex mutex_;
-};
-
-struct TimeSeries {
-    std::chrono::steady_clock::time_point timestamp;
-    double value;
-};
-
+/*
+ * Counts and sums are kept in kSlots cache line sized slots, each thread
+ * adding to the one its thread_slot picks and readers adding them all up,
+ * so updating a metric from many threads writes no shared line.
+ */
 class Metric {
 public:
+    static constexpr uint32_t kSlots = 16;
+
     enum Type {
         COUNTER,
         GAUGE,
@@ -73,12 +30,22 @@ public:
         TIMER
     };
 
-    Metric(const std::string& name, Type type)
-        : name_(name), type_(type), count_(0), sum_(0), min_(0), max_(0) {}
+    // Timers and histograms keep their samples in a Histogram whose windows
+    // close the first time percentiles are read once window has passed, so
+    // a scraper polling at that pace sees back to back windows of its period
+    Metric(const std::string& name, Type type,
+           std::chrono::nanoseconds window = std::chrono::seconds(10))
+        : name_(name), type_(type), min_(0), max_(0),
+          window_(window), window_start_(std::chrono::steady_clock::now()) {
+        if (type == TIMER || type == HISTOGRAM) {
+            histogram_ = std::make_unique<Histogram>();
+        }
+    }
 
     void increment(double value = 1.0) {
-        count_.fetch_add(1, std::memory_order_relaxed);
-        sum_.fetch_add(static_cast<uint64_t>(value * 1000000), std::memory_order_relaxed);
+        Slot& slot = slots_[thread_slot() % kSlots];
+        slot.count.fetch_add(1, std::memory_order_relaxed);
+        slot.sum.fetch_add(static_cast<uint64_t>(value * 1000000), std::memory_order_relaxed);
         update_min_max(value);
     }
 
@@ -87,52 +54,84 @@ public:
     }
 
     void record_time(std::chrono::nanoseconds duration) {
-        double ms = duration.count() / 1000000.0;
-        increment(ms);
-        time_series_.push({std::chrono::steady_clock::now(), ms});
+        increment(duration.count() / 1000000.0);
+        if (histogram_) histogram_->record(duration.count() > 0 ? duration.count() : 0);
     }
 
     double get_mean() const {
-        uint64_t c = count_.load(std::memory_order_relaxed);
+        uint64_t c = 0, sum = 0;
+        for (const Slot& slot : slots_) {
+            c += slot.count.load(std::memory_order_relaxed);
+            sum += slot.sum.load(std::memory_order_relaxed);
+        }
         if (c == 0) return 0.0;
-        return (sum_.load(std::memory_order_relaxed) / 1000000.0) / c;
+        return (sum / 1000000.0) / c;
     }
 
     uint64_t get_count() const {
-        return count_.load(std::memory_order_relaxed);
+        uint64_t c = 0;
+        for (const Slot& slot : slots_) c += slot.count.load(std::memory_order_relaxed);
+        return c;
     }
 
     double get_gauge() const {
         return gauge_value_.load(std::memory_order_relaxed);
     }
 
-    std::vector<TimeSeries> get_time_series() const {
-        return time_series_.get_all();
-    }
-
+    // In ms, over the last closed window, or the open one while none has
+    // closed with samples in it
     std::vector<double> get_percentiles(const std::vector<double>& percentiles) const {
-        auto series = time_series_.get_all();
-        if (series.empty()) return std::vector<double>(percentiles.size(), 0.0);
-
-        std::vector<double> values;
-        values.reserve(series.size());
-        for (const auto& ts : series) {
-            values.push_back(ts.value);
+        std::vector<double> result(percentiles.size(), 0.0);
+        if (!histogram_) return result;
+
+        std::lock_guard<std::mutex> lock(window_mutex_);
+        auto now = std::chrono::steady_clock::now();
+        if (now - window_start_ >= window_) {
+            last_window_ = histogram_->rotate();
+            window_start_ = now;
         }
 
-        std::sort(values.begin(), values.end());
-
-        std::vector<double> result;
-        for (double p : percentiles) {
-            size_t idx = static_cast<size_t>(values.size() * p / 100.0);
-            if (idx >= values.size()) idx = values.size() - 1;
-            result.push_back(values[idx]);
+        HistogramSnapshot open;
+        const HistogramSnapshot* window = &last_window_;
+        if (window->count() == 0) {
+            open = histogram_->current();
+            window = &open;
         }
 
+        for (size_t i = 0; i < percentiles.size(); ++i) {
+            result[i] = window->value_at(percentiles[i]) / 1000000.0;
+        }
         return result;
     }
 
+    Type type() const { return type_; }
+    const std::string& name() const { return name_; }
+
+    // Back to zero in place, so handles to it stay good
+    void reset() {
+        for (Slot& slot : slots_) {
+            slot.count.store(0, std::memory_order_relaxed);
+            slot.sum.store(0, std::memory_order_relaxed);
+        }
+        min_.store(0, std::memory_order_relaxed);
+        max_.store(0, std::memory_order_relaxed);
+        gauge_value_.store(0, std::memory_order_relaxed);
+
+        if (histogram_) {
+            std::lock_guard<std::mutex> lock(window_mutex_);
+            histogram_->rotate();
+            histogram_->rotate();
+            last_window_ = HistogramSnapshot();
+            window_start_ = std::chrono::steady_clock::now();
+        }
+    }
+
 private:
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> count{0};
+        std::atomic<uint64_t> sum{0};                   // value * 10^6
+    };
+
     void update_min_max(double value) {
         double current_min = min_.load(std::memory_order_relaxed);
         while (current_min > value &&
@@ -145,12 +144,66 @@ private:
 
     std::string name_;
     Type type_;
-    std::atomic<uint64_t> count_;
-    std::atomic<uint64_t> sum_;
     std::atomic<double> min_;
     std::atomic<double> max_;
-    std::atomic<double> gauge_value_;
-    RingBuffer<TimeSeries> time_series_{10000};
+    std::atomic<double> gauge_value_{0};
+
+    std::unique_ptr<Histogram> histogram_;              // ns
+    const std::chrono::nanoseconds window_;
+    mutable std::mutex window_mutex_;
+    mutable std::chrono::steady_clock::time_point window_start_;
+    mutable HistogramSnapshot last_window_;
+
+    Slot slots_[kSlots];
+};
+
+/*
+ * Handles to a registered metric, for code that updates it often: the name
+ * is looked up once, by MetricsAggregator::counter() and its siblings, and
+ * an update afterwards costs what updating the Metric does. Metrics are
+ * never removed, so a handle stays good for the life of the process; a
+ * default constructed one ignores updates.
+ */
+class Counter {
+public:
+    Counter() = default;
+    explicit Counter(Metric* metric) : metric_(metric) {}
+
+    void increment(double value = 1.0) const {
+        if (metric_) metric_->increment(value);
+    }
+    explicit operator bool() const { return metric_ != nullptr; }
+
+private:
+    Metric* metric_ = nullptr;
+};
+
+class Gauge {
+public:
+    Gauge() = default;
+    explicit Gauge(Metric* metric) : metric_(metric) {}
+
+    void set(double value) const {
+        if (metric_) metric_->set(value);
+    }
+    explicit operator bool() const { return metric_ != nullptr; }
+
+private:
+    Metric* metric_ = nullptr;
+};
+
+class Timer {
+public:
+    Timer() = default;
+    explicit Timer(Metric* metric) : metric_(metric) {}
+
+    void record(std::chrono::nanoseconds duration) const {
+        if (metric_) metric_->record_time(duration);
+    }
+    explicit operator bool() const { return metric_ != nullptr; }
+
+private:
+    Metric* metric_ = nullptr;
 };
 
 class MetricsAggregator {
@@ -161,6 +214,11 @@ public:
     void set_gauge(const std::string& name, double value);
     void record_timer(const std::string& name, std::chrono::nanoseconds duration);
 
+    // Registered on first use, then the same metric for every caller
+    Counter counter(const std::string& name);
+    Gauge gauge(const std::string& name);
+    Timer timer(const std::string& name);
+
     std::shared_ptr<Metric> get_metric(const std::string& name);
     std::unordered_map<std::string, std::shared_ptr<Metric>> get_all_metrics();
 
@@ -172,12 +230,14 @@ public:
         double p50_response_time_ms;
         double p95_response_time_ms;
         double p99_response_time_ms;
+        double p999_response_time_ms;
         uint64_t active_connections;
         uint64_t total_bytes_in;
         uint64_t total_bytes_out;
     };
 
     Stats get_stats();
+    // Zeroes every metric, keeping them registered
     void reset_stats();
 
 private:
@@ -195,18 +255,20 @@ private:
 
 class ScopedTimer {
 public:
-    ScopedTimer(const std::string& metric_name)
-        : metric_name_(metric_name),
+    explicit ScopedTimer(Timer timer)
+        : timer_(timer),
           start_time_(std::chrono::steady_clock::now()) {}
 
+    explicit ScopedTimer(const std::string& metric_name)
+        : ScopedTimer(MetricsAggregator::instance().timer(metric_name)) {}
+
     ~ScopedTimer() {
         auto duration = std::chrono::steady_clock::now() - start_time_;
-        MetricsAggregator::instance().record_timer(metric_name_,
-            std::chrono::duration_cast<std::chrono::nanoseconds>(duration));
+        timer_.record(std::chrono::duration_cast<std::chrono::nanoseconds>(duration));
     }
 
 private:
-    std::string metric_name_;
+    Timer timer_;
     std::chrono::steady_clock::time_point start_time_;
 };
 
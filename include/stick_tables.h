@@ -6,6 +6,12 @@
 #include <time.h>
 #include <pthread.h>
 #include <netinet/in.h>
+#include "core/common.h"
+#include "core/lb_timer.h"
+
+struct session;
+struct proxy;
+struct server;
 
 #define STKTABLE_TYPE_IP        0x01
 #define STKTABLE_TYPE_IPV6      0x02
@@ -71,18 +77,54 @@ typedef struct stick_counter {
 
 typedef struct stick_entry {
     stick_key_t key;
+    uint64_t hash;
     stick_counter_t counters;
 
-    time_t expire;
-    time_t last_access;
-    uint32_t ref_cnt;
+    _Atomic time_t expire;      /* pushed out by stktable_touch */
+    _Atomic time_t last_access;
+    _Atomic uint32_t ref_cnt;   /* tracking sessions; never expired while set */
 
-    struct eb32_node node;
-    struct list list;
+    lb_timer_t timer;           /* expiry, on the table's wheel */
+    struct stick_entry *retire_next;
+    time_t retired;
+
+    /* STKTABLE_DATA_* changed since the peers last sent the entry; it is
+     * on the table's dirty list while non-zero, and not freed meanwhile */
+    _Atomic uint32_t dirty;
+    struct stick_entry *dirty_next;
 
     pthread_rwlock_t lock;
 } stick_entry_t;
 
+/*
+ * Open-addressing index with linear probing. A slot is half a cache line:
+ * the high half of the key hash as a tag and, for IP and integer tables,
+ * the key itself, so probing past other keys never touches their entries.
+ * Readers take no lock; writers serialise on the table's write lock and
+ * bump the slot's sequence around every change so a reader that raced one
+ * retries. Removed entries and replaced slot arrays are freed only after
+ * STKTABLE_RETIRE_GRACE seconds, for the readers still holding them.
+ */
+#define STKTABLE_SLOT_EMPTY     0
+#define STKTABLE_SLOT_TOMB      1
+#define STKTABLE_RETIRE_GRACE   2
+#define STKTABLE_EVICT_SAMPLE   8   /* slots looked at for a victim when full */
+
+typedef struct stick_slot {
+    _Atomic uint32_t seq;       /* odd while a writer changes the slot */
+    uint32_t tag;               /* STKTABLE_SLOT_* or the hash's high half */
+    uint8_t key[16];            /* zero-padded IP or integer key */
+    stick_entry_t *entry;
+} stick_slot_t;
+
+typedef struct stick_slots {
+    uint32_t mask;
+    uint32_t used;              /* live and tombstone slots */
+    stick_slot_t *slot;
+    struct stick_slots *retire_next;
+    time_t retired;
+} stick_slots_t;
+
 typedef struct stick_table {
     char *id;
     int type;
@@ -91,14 +133,16 @@ typedef struct stick_table {
     uint32_t expire;
     uint32_t data_types;
 
-    struct eb_root keys;
-    struct list lru;
+    _Atomic(stick_slots_t*) slots;
 
-    struct {
-        uint32_t size;
-        stick_entry_t **entries;
-        pthread_spinlock_t *locks;
-    } hash;
+    /* Inserts, removals and the expiry wheel */
+    pthread_spinlock_t write_lock;
+    lb_timer_wheel_t wheel;
+    stick_entry_t *retired;
+    stick_slots_t *retired_slots;
+
+    bool replicated;                    /* attached to peers, see peers.h */
+    _Atomic(stick_entry_t*) dirty;
 
     struct {
         _Atomic uint64_t lookups;
@@ -107,9 +151,9 @@ typedef struct stick_table {
         _Atomic uint64_t inserts;
         _Atomic uint64_t updates;
         _Atomic uint64_t expires;
+        _Atomic uint64_t evictions;
     } stats;
 
-    pthread_rwlock_t lock;
     struct stick_table *next;
 } stick_table_t;
 
@@ -151,6 +195,8 @@ stick_entry_t* stktable_get(stick_table_t *t, stick_key_t *key);
 stick_entry_t* stktable_set(stick_table_t *t, stick_entry_t *entry);
 
 void stktable_touch(stick_table_t *t, stick_entry_t *entry);
+/* Run the expiry wheel; inserts do so as well. Call at least once per
+ * STKTABLE_RETIRE_GRACE so removed entries get freed. */
 void stktable_expire(stick_table_t *t);
 void stktable_purge(stick_table_t *t);
 
@@ -160,6 +206,26 @@ int stktable_dec_counter(stick_table_t *t, stick_key_t *key, int counter);
 
 void stktable_data_cast(void *data, int type, int value);
 
+/* Queue entry for the peers; a no-op unless the table is replicated */
+void stktable_mark_dirty(stick_table_t *t, stick_entry_t *entry, uint32_t data_types);
+/* Detach the dirty list, linked through dirty_next */
+stick_entry_t* stktable_take_dirty(stick_table_t *t);
+/* Lock-free walk: the next live entry at or after slot *pos, which is
+ * advanced past it; NULL at the end. Entries moved by a concurrent
+ * rebuild may be skipped or seen twice. */
+stick_entry_t* stktable_next(stick_table_t *t, uint32_t *pos);
+
+/*
+ * A count shared between nodes through a replicated string table: each
+ * node stores its own count for name in http_req_cnt of the entry
+ * "<name>@<node>", and reads back the sum over the other nodes' entries
+ * that have not expired, and how many there are. The table's expire
+ * should be a few times the interval between calls, so that a node that
+ * left stops counting soon after.
+ */
+int stktable_share_count(stick_table_t *t, const char *name, const char *node,
+                         uint32_t local, uint64_t *remote, uint32_t *nodes);
+
 int stksess_track(struct session *sess, stick_table_t *t, stick_key_t *key);
 void stksess_untrack(struct session *sess, stick_table_t *t);
 struct server* stksess_get_server(struct session *sess, stick_table_t *t);
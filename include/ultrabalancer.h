@@ -88,6 +88,18 @@ typedef struct proxy {
     lb_algorithm_t lb_algo;
     int (*lb_algo_func)(struct proxy *);
 
+    // Hashing algorithms: the header or url_param to hash, the Maglev
+    // table of running servers (see proxy_servers_changed) and the load
+    // bound in percent of the average (hash-balance-factor, 0 = unbounded)
+    char *lb_arg;
+    uint32_t hash_balance_factor;
+#ifdef __cplusplus
+    std::atomic<struct server_chash*> chash;
+#else
+    _Atomic(struct server_chash*) chash;
+#endif
+    struct server_chash *chash_retired;
+
     struct proxy *next;
 
 #ifdef __cplusplus
@@ -0,0 +1,21 @@
+#ifndef UTILS_HASH_H
+#define UTILS_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* 64-bit wyhash of len bytes; not keyed, so not for attacker-chosen
+ * tables that must resist flooding */
+uint64_t hash64(const void *data, size_t len);
+
+/* Mix one 64-bit word, for integer and address keys */
+static inline uint64_t hash64_u64(uint64_t v) {
+    v ^= v >> 33;
+    v *= 0xff51afd7ed558ccdull;
+    v ^= v >> 33;
+    v *= 0xc4ceb9fe1a85ec53ull;
+    v ^= v >> 33;
+    return v;
+}
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef UTILS_IP_TREE_H
+#define UTILS_IP_TREE_H
+
+#include <stdbool.h>
+#include <netinet/in.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Sets of IPv4 and IPv6 prefixes, for telling whether an address falls in
+ * any of them. ip_tree_compile drops the prefixes a shorter one already
+ * covers and lays the rest out as a poptrie: a 64-way trie whose nodes are
+ * two bitmaps, one for slots wholly inside a prefix and one for slots with
+ * a child, the children of a node stored next to each other and found by
+ * counting the bits under a slot. A lookup reads one node per 6 bits of the
+ * address, at most 6 for IPv4 and 22 for IPv6, whatever the size of the
+ * set. A compiled tree is read only and may be looked up from any number
+ * of threads.
+ */
+typedef struct ip_tree ip_tree_t;
+
+ip_tree_t *ip_tree_create(void);
+void ip_tree_destroy(ip_tree_t *tree);
+
+/* Bits of addr past len are ignored; return -1 on a bad length or
+ * allocation failure */
+int ip_tree_add4(ip_tree_t *tree, struct in_addr addr, int len);
+int ip_tree_add6(ip_tree_t *tree, const struct in6_addr *addr, int len);
+
+/* After the last add; returns -1 on allocation failure */
+int ip_tree_compile(ip_tree_t *tree);
+
+bool ip_tree_lookup4(const ip_tree_t *tree, struct in_addr addr);
+bool ip_tree_lookup6(const ip_tree_t *tree, const struct in6_addr *addr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
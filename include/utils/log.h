@@ -2,6 +2,8 @@
 #define UTILS_LOG_H
 
 #include <syslog.h>
+#include <stdint.h>
+#include <stdatomic.h>
 
 #define LOG_EMERG   0
 #define LOG_ALERT   1
@@ -12,10 +14,64 @@
 #define LOG_INFO    6
 #define LOG_DEBUG   7
 
+// Messages above this level are compiled out entirely; override with
+// -DLOG_COMPILE_LEVEL=N (make LOG_LEVEL=N)
+#ifndef LOG_COMPILE_LEVEL
+#ifdef DEBUG
+#define LOG_COMPILE_LEVEL LOG_DEBUG
+#else
+#define LOG_COMPILE_LEVEL LOG_INFO
+#endif
+#endif
+
+#define LOG_LINE_MAX   256
+#define LOG_RING_SLOTS 256  // per thread, power of two
+
+typedef struct log_ratelimit {
+    _Atomic uint64_t window_start_ms;
+    _Atomic uint32_t emitted;
+    _Atomic uint32_t suppressed;
+} log_ratelimit_t;
+
 void log_init(const char *ident, int level);
 void log_error(const char *fmt, ...);
 void log_warning(const char *fmt, ...);
 void log_info(const char *fmt, ...);
 void log_debug(const char *fmt, ...);
 
-#endif
\ No newline at end of file
+// Start/stop the background drain thread. Until log_start() runs, and after
+// log_stop(), messages are written synchronously.
+int log_start(void);
+void log_stop(void);
+
+void log_emit(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+int log_enabled(int level);
+uint32_t log_ratelimit_check(log_ratelimit_t *rl, uint32_t burst, uint32_t interval_ms);
+
+#define LB_LOG(level, fmt, ...)                                       \
+    do {                                                              \
+        if ((level) <= LOG_COMPILE_LEVEL && log_enabled(level))       \
+            log_emit((level), fmt, ##__VA_ARGS__);                    \
+    } while (0)
+
+#define LB_ERROR(fmt, ...) LB_LOG(LOG_ERR, fmt, ##__VA_ARGS__)
+#define LB_WARN(fmt, ...)  LB_LOG(LOG_WARNING, fmt, ##__VA_ARGS__)
+#define LB_INFO(fmt, ...)  LB_LOG(LOG_INFO, fmt, ##__VA_ARGS__)
+#define LB_DEBUG(fmt, ...) LB_LOG(LOG_DEBUG, fmt, ##__VA_ARGS__)
+
+// At most `burst` messages per `interval_ms` from this call site; the count
+// of dropped ones is reported with the next message that gets through
+#define LB_ERROR_RATELIMIT(burst, interval_ms, fmt, ...)                          \
+    do {                                                                          \
+        static log_ratelimit_t _lb_rl;                                            \
+        if (LOG_ERR <= LOG_COMPILE_LEVEL && log_enabled(LOG_ERR)) {               \
+            uint32_t _lb_dropped = log_ratelimit_check(&_lb_rl, (burst), (interval_ms)); \
+            if (_lb_dropped != UINT32_MAX) {                                      \
+                if (_lb_dropped)                                                  \
+                    log_emit(LOG_ERR, "%u similar messages suppressed", _lb_dropped); \
+                log_emit(LOG_ERR, fmt, ##__VA_ARGS__);                            \
+            }                                                                     \
+        }                                                                         \
+    } while (0)
+
+#endif
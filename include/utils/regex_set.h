@@ -0,0 +1,65 @@
+#ifndef UTILS_REGEX_SET_H
+#define UTILS_REGEX_SET_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Many regular expressions matched in one pass over the input. The
+ * patterns are parsed into one Thompson NFA, which regex_set_compile turns
+ * into a DFA by subset construction over byte classes, so a scan costs one
+ * table load per input byte however many patterns there are, and reports
+ * every pattern that matched.
+ *
+ * Supported: literals, ., [] classes with ranges and negation, \d \w \s
+ * and their negations, \xHH, groups ((?:...) and named groups alike),
+ * alternation, * + ? {n} {n,} {n,m} (lazy forms too, they match the same
+ * inputs), ^ at the start and $ at the end of a top-level alternative.
+ * Backreferences, lookaround, \b, possessive quantifiers and POSIX classes
+ * are refused by regex_set_add, for the caller to match another way.
+ *
+ * A DFA that grows past REGEX_SET_MAX_STATES is not kept: the set is split
+ * and the parts scanned one after the other, and a single pattern that is
+ * still too large is run as an NFA. A compiled set is read only and may be
+ * scanned from any number of threads.
+ */
+#define REGEX_SET_MAX_STATES    4096        /* per DFA */
+#define REGEX_SET_MAX_NODES     (1 << 20)   /* NFA nodes over the whole set */
+#define REGEX_SET_MAX_REPEAT    1000        /* bound in {n,m} */
+
+#define REGEX_SET_CASELESS      0x01
+#define REGEX_SET_ANCHORED      0x02        /* over the whole input, as std::regex_match */
+
+typedef struct regex_set regex_set_t;
+
+regex_set_t *regex_set_create(void);
+void regex_set_destroy(regex_set_t *set);
+
+/* The pattern's id, counting from 0 in the order added; -1 when it is
+ * invalid or uses syntax the set does not support */
+int regex_set_add(regex_set_t *set, const char *pattern, size_t len, int flags);
+
+/* After the last add; returns -1 on allocation failure */
+int regex_set_compile(regex_set_t *set);
+
+uint32_t regex_set_count(const regex_set_t *set);
+
+/* Words needed for the matched bitset of regex_set_match */
+static inline size_t regex_set_words(const regex_set_t *set) {
+    return ((size_t)regex_set_count(set) + 63) / 64;
+}
+
+/* Sets bit id of matched for each pattern that matches data, clearing the
+ * others; matched may be NULL. Returns whether any pattern matched. */
+bool regex_set_match(const regex_set_t *set, const char *data, size_t len, uint64_t *matched);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
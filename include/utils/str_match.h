@@ -0,0 +1,45 @@
+#ifndef UTILS_STR_MATCH_H
+#define UTILS_STR_MATCH_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A list of strings compiled for testing whether an input equals, begins
+ * with, ends with or contains any of them, in time that depends on the
+ * input and not on the length of the list. Exact strings go in a hash set.
+ * The others build a trie over byte classes, walked either way from one
+ * end of the input for STR_MATCH_BEG and STR_MATCH_END, and turned into an
+ * Aho-Corasick automaton for STR_MATCH_SUB, so every input byte costs one
+ * table load. Matching is case sensitive. A compiled set is read only and
+ * may be used from any number of threads.
+ */
+typedef enum {
+    STR_MATCH_EXACT,
+    STR_MATCH_BEG,
+    STR_MATCH_END,
+    STR_MATCH_SUB
+} str_match_kind_t;
+
+typedef struct str_match str_match_t;
+
+str_match_t *str_match_create(str_match_kind_t kind);
+void str_match_destroy(str_match_t *set);
+
+/* The string is copied; returns -1 on allocation failure */
+int str_match_add(str_match_t *set, const char *str, size_t len);
+
+/* After the last add; returns -1 on allocation failure */
+int str_match_compile(str_match_t *set);
+
+bool str_match_exec(const str_match_t *set, const char *data, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
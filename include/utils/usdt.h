@@ -0,0 +1,63 @@
+#ifndef UTILS_USDT_H
+#define UTILS_USDT_H
+
+#include <stdint.h>
+
+/*
+ * USDT probe points, in the SystemTap SDT note format that bpftrace, bcc,
+ * perf and systemtap read (usdt:bin/ultrabalancer:ultrabalancer:name). A
+ * probe is a single nop plus an ELF note naming it and where its arguments
+ * live; a tracer attaching swaps the nop for a breakpoint, so a probe
+ * nobody traces costs the nop. <sys/sdt.h> is not needed: this writes the
+ * same note. Arguments are passed as uint64_t; keep them to values already
+ * at hand, as they are materialised whether traced or not.
+ *
+ * Build with -DLB_NO_USDT (make NO_USDT=1) to compile them out.
+ */
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__)) && !defined(LB_NO_USDT)
+
+#define LB_USDT_NOTE(provider, name, args)                                        \
+    "990: nop\n"                                                                  \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n"                                 \
+    ".balign 4\n"                                                                 \
+    ".4byte 992f-991f, 994f-993f, 3\n"                                            \
+    "991: .asciz \"stapsdt\"\n"                                                   \
+    "992: .balign 4\n"                                                            \
+    "993: .8byte 990b\n"                                                          \
+    ".8byte _.stapsdt.base\n"                                                     \
+    ".8byte 0\n"                                                                  \
+    ".asciz \"" #provider "\"\n"                                                  \
+    ".asciz \"" #name "\"\n"                                                      \
+    ".asciz \"" args "\"\n"                                                       \
+    "994: .balign 4\n"                                                            \
+    ".popsection\n"                                                               \
+    ".ifndef _.stapsdt.base\n"                                                    \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"       \
+    ".weak _.stapsdt.base\n"                                                      \
+    ".hidden _.stapsdt.base\n"                                                    \
+    "_.stapsdt.base: .space 1\n"                                                  \
+    ".size _.stapsdt.base, 1\n"                                                   \
+    ".popsection\n"                                                               \
+    ".endif\n"
+
+#define LB_USDT0(provider, name) \
+    __asm__ __volatile__(LB_USDT_NOTE(provider, name, ""))
+#define LB_USDT1(provider, name, a1) \
+    __asm__ __volatile__(LB_USDT_NOTE(provider, name, "8@%0") :: "nor"((uint64_t)(a1)))
+#define LB_USDT2(provider, name, a1, a2) \
+    __asm__ __volatile__(LB_USDT_NOTE(provider, name, "8@%0 8@%1") \
+                         :: "nor"((uint64_t)(a1)), "nor"((uint64_t)(a2)))
+#define LB_USDT3(provider, name, a1, a2, a3) \
+    __asm__ __volatile__(LB_USDT_NOTE(provider, name, "8@%0 8@%1 8@%2") \
+                         :: "nor"((uint64_t)(a1)), "nor"((uint64_t)(a2)), "nor"((uint64_t)(a3)))
+
+#else
+
+#define LB_USDT0(provider, name) do {} while (0)
+#define LB_USDT1(provider, name, a1) do { (void)(a1); } while (0)
+#define LB_USDT2(provider, name, a1, a2) do { (void)(a1); (void)(a2); } while (0)
+#define LB_USDT3(provider, name, a1, a2, a3) do { (void)(a1); (void)(a2); (void)(a3); } while (0)
+
+#endif
+
+#endif
@@ -152,7 +152,14 @@ int acl_match_sub(struct sample *smp, acl_pattern_t *pattern) {
 }
 
 int acl_match_reg(struct sample *smp, acl_pattern_t *pattern) {
-    if (smp->data.type != SMP_T_STR || !pattern->val.reg.regex)
+    if (smp->data.type != SMP_T_STR)
+        return 0;
+
+    if (pattern->val.reg.set)
+        return regex_set_match(pattern->val.reg.set, smp->data.u.str.ptr,
+                               smp->data.u.str.len, NULL);
+
+    if (!pattern->val.reg.regex)
         return 0;
 
 #ifdef USE_PCRE
@@ -169,6 +176,18 @@ int acl_match_reg(struct sample *smp, acl_pattern_t *pattern) {
 }
 
 int acl_match_ip(struct sample *smp, acl_pattern_t *pattern) {
+    if (pattern->flags & ACL_PAT_F_IPV6) {
+        if (smp->data.type != SMP_T_IPV6)
+            return 0;
+
+        for (int i = 0; i < 16; i++) {
+            uint8_t mask = pattern->val.ipv6.mask.s6_addr[i];
+            if ((smp->data.u.ipv6.s6_addr[i] & mask) != (pattern->val.ipv6.addr.s6_addr[i] & mask))
+                return 0;
+        }
+        return 1;
+    }
+
     if (smp->data.type != SMP_T_IPV4)
         return 0;
 
@@ -225,6 +244,27 @@ int pattern_parse_ip(const char **text, acl_pattern_t *pattern, int *opaque) {
     memcpy(addr_str, start, end - start);
     addr_str[end - start] = '\0';
 
+    if (strchr(addr_str, ':')) {
+        if (inet_pton(AF_INET6, addr_str, &pattern->val.ipv6.addr) != 1)
+            return 0;
+
+        int cidr = 128;
+        if (*end == '/') {
+            end++;
+            cidr = strtol(end, (char **)&end, 10);
+            if (cidr < 0 || cidr > 128)
+                return 0;
+        }
+
+        memset(&pattern->val.ipv6.mask, 0, sizeof(pattern->val.ipv6.mask));
+        for (int i = 0; i < cidr; i++)
+            pattern->val.ipv6.mask.s6_addr[i / 8] |= 0x80 >> (i % 8);
+        pattern->flags |= ACL_PAT_F_IPV6;
+
+        *text = end;
+        return 1;
+    }
+
     if (inet_pton(AF_INET, addr_str, &pattern->val.ipv4.addr) != 1)
         return 0;
 
@@ -234,7 +274,7 @@ int pattern_parse_ip(const char **text, acl_pattern_t *pattern, int *opaque) {
         if (cidr < 0 || cidr > 32)
             return 0;
 
-        pattern->val.ipv4.mask.s_addr = htonl(~((1U << (32 - cidr)) - 1));
+        pattern->val.ipv4.mask.s_addr = cidr ? htonl(~((1U << (32 - cidr)) - 1)) : 0;
     } else {
         pattern->val.ipv4.mask.s_addr = 0xFFFFFFFF;
     }
@@ -244,16 +284,26 @@ int pattern_parse_ip(const char **text, acl_pattern_t *pattern, int *opaque) {
 }
 
 int pattern_parse_reg(const char **text, acl_pattern_t *pattern, int *opaque) {
-#ifdef USE_PCRE
-    const char *error;
-    int erroffset;
-
     const char *start = *text;
     const char *end = start;
 
     while (*end && !isspace(*end))
         end++;
 
+    // Searched for anywhere in the sample and caseless, as with PCRE
+    regex_set_t *set = regex_set_create();
+    if (set && regex_set_add(set, start, end - start, REGEX_SET_CASELESS) == 0 &&
+        regex_set_compile(set) == 0) {
+        pattern->val.reg.set = set;
+        *text = end;
+        return 1;
+    }
+    regex_set_destroy(set);
+
+#ifdef USE_PCRE
+    const char *error;
+    int erroffset;
+
     char *regex_str = strndup(start, end - start);
 
     pattern->val.reg.regex = pcre_compile(regex_str, PCRE_CASELESS,
@@ -271,7 +321,7 @@ int pattern_parse_reg(const char **text, acl_pattern_t *pattern, int *opaque) {
     *text = end;
     return 1;
 #else
-    log_error("PCRE regex parsing not available (library not compiled)");
+    log_error("Regex '%.*s' is not supported without PCRE", (int)(end - start), start);
     return 0;
 #endif
 }
@@ -297,6 +347,71 @@ acl_t* acl_find(struct list *head, const char *name) {
     return NULL;
 }
 
+/* Builds expr->ip_tree or expr->str_match from the patterns, when the
+ * keyword matches in a way they can stand for */
+static void acl_expr_compile(acl_expr_t *expr) {
+    int (*match)(struct sample *, acl_pattern_t *) = expr->keyword->match;
+    struct list *l;
+
+    if (match == acl_match_ip) {
+        expr->ip_tree = ip_tree_create();
+        if (!expr->ip_tree)
+            return;
+
+        for (l = expr->patterns.n; l != &expr->patterns; l = l->n) {
+            acl_pattern_t *pattern = LIST_ELEM(l, acl_pattern_t, list);
+            int ret;
+
+            if (pattern->flags & ACL_PAT_F_IPV6) {
+                int len = 0;
+                for (int i = 0; i < 16; i++)
+                    len += __builtin_popcount(pattern->val.ipv6.mask.s6_addr[i]);
+                ret = ip_tree_add6(expr->ip_tree, &pattern->val.ipv6.addr, len);
+            } else {
+                int len = __builtin_popcount(pattern->val.ipv4.mask.s_addr);
+                ret = ip_tree_add4(expr->ip_tree, pattern->val.ipv4.addr, len);
+            }
+            if (ret < 0)
+                goto fail;
+        }
+        if (ip_tree_compile(expr->ip_tree) < 0)
+            goto fail;
+        return;
+    }
+
+    str_match_kind_t kind;
+    if (match == acl_match_str)
+        kind = STR_MATCH_EXACT;
+    else if (match == acl_match_beg)
+        kind = STR_MATCH_BEG;
+    else if (match == acl_match_end)
+        kind = STR_MATCH_END;
+    else if (match == acl_match_sub)
+        kind = STR_MATCH_SUB;
+    else
+        return;
+
+    expr->str_match = str_match_create(kind);
+    if (!expr->str_match)
+        return;
+
+    for (l = expr->patterns.n; l != &expr->patterns; l = l->n) {
+        acl_pattern_t *pattern = LIST_ELEM(l, acl_pattern_t, list);
+        if (str_match_add(expr->str_match, pattern->val.str.str, pattern->val.str.len) < 0)
+            goto fail;
+    }
+    if (str_match_compile(expr->str_match) < 0)
+        goto fail;
+    return;
+
+fail:
+    log_warning("ACL '%s': patterns not compiled, matching them one by one", expr->kw);
+    ip_tree_destroy(expr->ip_tree);
+    str_match_destroy(expr->str_match);
+    expr->ip_tree = NULL;
+    expr->str_match = NULL;
+}
+
 acl_expr_t* acl_expr_parse(const char **args, char **err) {
     acl_expr_t *expr = calloc(1, sizeof(*expr));
     if (!expr)
@@ -323,22 +438,77 @@ acl_expr_t* acl_expr_parse(const char **args, char **err) {
 
     args++;
 
-    while (*args) {
+    bool reg = expr->keyword->parse == pattern_parse_reg;
+    if (reg)
+        expr->reg_set = regex_set_create();
+
+    for (; *args; args++) {
         acl_pattern_t *pattern = calloc(1, sizeof(*pattern));
         if (!pattern)
             break;
 
-        if (!expr->keyword->parse(args, pattern, NULL)) {
+        const char *text = *args;
+        if (!expr->keyword->parse(&text, pattern, NULL)) {
             free(pattern);
             break;
         }
 
+        // Same text and flags as the pattern's own set, so this cannot fail
+        if (reg && pattern->val.reg.set && expr->reg_set)
+            regex_set_add(expr->reg_set, *args, text - *args, REGEX_SET_CASELESS);
+
         LIST_ADDQ(&expr->patterns, &pattern->list);
     }
 
+    if (expr->reg_set && (regex_set_count(expr->reg_set) == 0 ||
+                          regex_set_compile(expr->reg_set) < 0)) {
+        regex_set_destroy(expr->reg_set);
+        expr->reg_set = NULL;
+    }
+
+    acl_expr_compile(expr);
     return expr;
 }
 
+int acl_expr_match(acl_expr_t *expr, struct sample *smp) {
+    struct list *l;
+
+    if (expr->ip_tree) {
+        if (smp->data.type == SMP_T_IPV4)
+            return ip_tree_lookup4(expr->ip_tree, smp->data.u.ipv4);
+        if (smp->data.type == SMP_T_IPV6)
+            return ip_tree_lookup6(expr->ip_tree, &smp->data.u.ipv6);
+        return 0;
+    }
+
+    if (expr->str_match) {
+        if (smp->data.type != SMP_T_STR)
+            return 0;
+        return str_match_exec(expr->str_match, smp->data.u.str.ptr, smp->data.u.str.len);
+    }
+
+    if (expr->reg_set) {
+        if (smp->data.type != SMP_T_STR)
+            return 0;
+        if (regex_set_match(expr->reg_set, smp->data.u.str.ptr, smp->data.u.str.len, NULL))
+            return 1;
+
+        // Only the patterns the set refused are left
+        for (l = expr->patterns.n; l != &expr->patterns; l = l->n) {
+            acl_pattern_t *pattern = LIST_ELEM(l, acl_pattern_t, list);
+            if (!pattern->val.reg.set && acl_match_reg(smp, pattern))
+                return 1;
+        }
+        return 0;
+    }
+
+    for (l = expr->patterns.n; l != &expr->patterns; l = l->n) {
+        if (expr->keyword->match(smp, LIST_ELEM(l, acl_pattern_t, list)))
+            return 1;
+    }
+    return 0;
+}
+
 acl_cond_t* acl_cond_parse(const char **args, struct list *known_acl, char **err) {
     acl_cond_t *cond = calloc(1, sizeof(*cond));
     if (!cond)
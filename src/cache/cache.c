@@ -1,8 +1,10 @@
 #include "cache/cache.h"
+#include "cache/cache_disk.h"
 #include "core/proxy.h"
 #include "http/http.h"
 #include "utils/log.h"
 #include "utils/buffer.h"
+#include "utils/hash.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -25,32 +27,38 @@ cache_t* cache_create(const char *name, uint32_t max_size, uint32_t max_object_s
     cache->max_size = max_size;
     cache->max_object_size = max_object_size;
     cache->max_age = 3600;  /* Default 1 hour */
-    cache->max_entries = max_size / 1024;  /* Rough estimate */
+    cache->fill_timeout_ms = 5000;
+    /* Encoding happens once per object, so the slow top levels are affordable */
+    cache->gzip_level = 9;
+    cache->brotli_quality = BROTLI_MAX_QUALITY;
 
-    /* Initialize hash table - use prime number for better distribution */
-    cache->hash.size = 16381;  /* Prime number */
-    cache->hash.mask = cache->hash.size - 1;
-    cache->hash.table = calloc(cache->hash.size, sizeof(cache_entry_t*));
-    cache->hash.locks = calloc(cache->hash.size, sizeof(pthread_spinlock_t));
-
-    if (!cache->hash.table || !cache->hash.locks) {
-        free(cache->hash.table);
-        free((void*)cache->hash.locks);
+    cache->shards = aligned_alloc(64, CACHE_SHARDS * sizeof(cache_shard_t));
+    if (!cache->shards) {
         free(cache->name);
         free(cache);
         return NULL;
     }
-
-    /* Initialize per-bucket locks for fine-grained concurrency */
-    for (uint32_t i = 0; i < cache->hash.size; i++) {
-        pthread_spin_init(&cache->hash.locks[i], PTHREAD_PROCESS_PRIVATE);
+    memset(cache->shards, 0, CACHE_SHARDS * sizeof(cache_shard_t));
+
+    /* Each shard evicts on its own, against an equal share of max_size */
+    for (uint32_t i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard_t *shard = &cache->shards[i];
+        pthread_spin_init(&shard->lock, PTHREAD_PROCESS_PRIVATE);
+        shard->max_size = max_size / CACHE_SHARDS;
+        for (uint32_t b = 0; b < CACHE_SHARD_BUCKETS; b++) {
+            pthread_spin_init(&shard->buckets[b].lock, PTHREAD_PROCESS_PRIVATE);
+        }
     }
 
-    /* Initialize LRU list */
-    cache->lru.head = cache->lru.tail = NULL;
-    pthread_spin_init(&cache->lru.lock, PTHREAD_PROCESS_PRIVATE);
+    if (cache->max_object_size > max_size / CACHE_SHARDS) {
+        log_warning("Cache '%s': max_object=%uKB exceeds the %uKB shard size, clamped",
+                    name, max_object_size / 1024, max_size / CACHE_SHARDS / 1024);
+        cache->max_object_size = max_size / CACHE_SHARDS;
+    }
 
     pthread_rwlock_init(&cache->lock, NULL);
+    pthread_mutex_init(&cache->refresh.lock, NULL);
+    pthread_cond_init(&cache->refresh.cond, NULL);
 
     /* Add to global list */
     pthread_rwlock_wrlock(&caches_lock);
@@ -58,226 +66,1080 @@ cache_t* cache_create(const char *name, uint32_t max_size, uint32_t max_object_s
     caches = cache;
     pthread_rwlock_unlock(&caches_lock);
 
-    log_info("Cache '%s' created: max_size=%uMB, max_object=%uKB",
-             name, max_size / (1024*1024), max_object_size / 1024);
+    log_info("Cache '%s' created: max_size=%uMB, max_object=%uKB, %u shards",
+             name, max_size / (1024*1024), cache->max_object_size / 1024, CACHE_SHARDS);
 
     return cache;
 }
 
-/* Jenkins hash function for cache keys */
-uint32_t cache_hash_key(const char *key) {
-    uint32_t hash = 0;
+uint64_t cache_hash_key(const void *data, size_t len) {
+    return hash64(data, len);
+}
+
+void cache_key_init(cache_key_t *key, const char *ptr, size_t len) {
+    key->ptr = ptr;
+    key->len = (uint32_t)len;
+    key->hash = cache_hash_key(ptr, len);
+}
+
+int cache_key_append(cache_key_buf_t *buf, const char *field, size_t len) {
+    if (len > UINT16_MAX || len + 2 > sizeof(buf->data) - buf->len) {
+        return -1;
+    }
+
+    uint16_t n = (uint16_t)len;
+    memcpy(buf->data + buf->len, &n, 2);
+    memcpy(buf->data + buf->len + 2, field, len);
+    buf->len += 2 + (uint32_t)len;
+    return 0;
+}
+
+/* Method, host and URI; no hash yet */
+static int cache_build_base(struct http_txn *txn, cache_key_buf_t *buf) {
+    buf->len = 0;
+    if (!txn || !txn->uri) return -1;
+
+    /* An absent Host keys like an empty one */
+    char *host = http_header_get(&txn->req, "Host");
+    uint32_t meth = txn->meth;
+    if (cache_key_append(buf, (const char*)&meth, sizeof(meth)) < 0 ||
+        cache_key_append(buf, host ? host : "", host ? strlen(host) : 0) < 0 ||
+        cache_key_append(buf, txn->uri, strlen(txn->uri)) < 0) {
+        return -1;
+    }
+
+    /* Vary header values are added by cache_build_vary_key, once a stored
+     * response has said which ones matter */
+    return 0;
+}
+
+int cache_build_key(struct http_txn *txn, cache_key_buf_t *buf, cache_key_t *key) {
+    if (cache_build_base(txn, buf) < 0) {
+        return -1;
+    }
+    cache_key_init(key, buf->data, buf->len);
+    return 0;
+}
+
+/*
+ * Key of one variant of a response that carried Vary: the base key with
+ * a name and a value field for each listed header. Accept-Encoding is left
+ * out because the cache negotiates encodings itself (cache_entry_variant).
+ */
+int cache_build_vary_key(struct http_txn *txn, const char *vary, cache_key_buf_t *buf, cache_key_t *key) {
+    if (cache_build_base(txn, buf) < 0) {
+        return -1;
+    }
 
-    while (*key) {
-        hash += *key++;
-        hash += (hash << 10);
-        hash ^= (hash >> 6);
+    const char *p = vary ? vary : "";
+    while (*p) {
+        while (*p == ',' || *p == ' ' || *p == '\t') p++;
+        const char *end = p;
+        while (*end && *end != ',' && *end != ' ' && *end != '\t') end++;
+
+        size_t name_len = (size_t)(end - p);
+        if (name_len > 0 && name_len < 64 && !(name_len == 15 && strncasecmp(p, "Accept-Encoding", 15) == 0)) {
+            char name[64];
+            memcpy(name, p, name_len);
+            name[name_len] = '\0';
+
+            const char *value = http_header_get(&txn->req, name);
+            if (cache_key_append(buf, name, name_len) < 0 ||
+                cache_key_append(buf, value ? value : "", value ? strlen(value) : 0) < 0) {
+                return -1;  /* Too long to key reliably; don't cache */
+            }
+        }
+        p = end;
     }
 
-    hash += (hash << 3);
-    hash ^= (hash >> 11);
-    hash += (hash << 15);
+    cache_key_init(key, buf->data, buf->len);
+    return 0;
+}
 
-    return hash;
+static inline cache_shard_t* cache_shard(cache_t *cache, uint64_t hash) {
+    return &cache->shards[hash >> (64 - CACHE_SHARD_BITS)];
 }
 
-char* cache_build_key(struct http_txn *txn) {
-    if (!txn || !txn->uri) return NULL;
+static inline cache_bucket_t* cache_bucket(cache_shard_t *shard, uint64_t hash) {
+    return &shard->buckets[hash & (CACHE_SHARD_BUCKETS - 1)];
+}
 
-    /* Build cache key from method + host + uri + vary headers */
-    char key[2048];
-    int len = 0;
+static uint64_t cache_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    /* Add method */
-    len += snprintf(key + len, sizeof(key) - len, "%u:", txn->meth);
+static inline bool cache_key_eq(const char *ptr, uint32_t len, uint64_t hash, const cache_key_t *key) {
+    return hash == key->hash && len == key->len && memcmp(ptr, key->ptr, len) == 0;
+}
 
-    /* Add host header if present */
-    char *host = http_header_get(&txn->req, "Host");
-    if (host) {
-        len += snprintf(key + len, sizeof(key) - len, "%s:", host);
+/* Copy of key's bytes, NUL-terminated for logging */
+static char* cache_key_dup(const cache_key_t *key) {
+    char *copy = malloc(key->len + 1);
+    if (copy) {
+        memcpy(copy, key->ptr, key->len);
+        copy[key->len] = '\0';
     }
+    return copy;
+}
 
-    /* Add URI */
-    len += snprintf(key + len, sizeof(key) - len, "%s", txn->uri);
+/* Detach key's fill from its bucket. Caller holds the bucket lock. */
+static cache_fill_t* cache_fill_take(cache_bucket_t *bucket, const cache_key_t *key) {
+    for (cache_fill_t **p = &bucket->fills; *p; p = &(*p)->next) {
+        cache_fill_t *fill = *p;
+        if (cache_key_eq(fill->key, fill->key_len, fill->key_hash, key)) {
+            *p = fill->next;
+            return fill;
+        }
+    }
+    return NULL;
+}
 
-    /* TODO: Add vary header values */
+/* Wake every waiter of a detached fill, with no lock held */
+static void cache_fill_finish(cache_fill_t *fill, cache_entry_t *entry) {
+    cache_waiter_t *w = fill->waiters;
+    while (w) {
+        cache_waiter_t *next = w->next;
+        w->next = NULL;
+        w->wake(w, entry);
+        w = next;
+    }
+    free(fill->key);
+    free(fill);
+}
 
-    return strdup(key);
+static void cache_entry_free_data(cache_entry_t *entry) {
+    free(entry->key);
+    free(entry->data.ptr);
+    free(entry->etag);
+    free(entry->vary);
+    for (int i = 0; i < CACHE_ENC_MAX; i++) {
+        free(entry->variants[i].ptr);
+    }
 }
 
-cache_entry_t* cache_lookup(cache_t *cache, const char *key) {
-    uint32_t hash = cache_hash_key(key);
-    uint32_t idx = hash & cache->hash.mask;
+static void cache_entry_free(cache_entry_t *entry) {
+    cache_entry_free_data(entry);
+    pthread_rwlock_destroy(&entry->lock);
+    free(entry);
+}
 
-    /* Per-bucket locking for better concurrency */
-    pthread_spin_lock(&cache->hash.locks[idx]);
+/* Take a reference to an entry still linked, under its bucket lock */
+static inline cache_entry_t* cache_entry_get(cache_entry_t *entry) {
+    atomic_fetch_add_explicit(&entry->refs, 1, memory_order_relaxed);
+    return entry;
+}
+
+/* Drop a lookup's reference, or the cache's own once unlinked; the last
+ * one frees the entry */
+void cache_entry_put(cache_entry_t *entry) {
+    if (atomic_fetch_sub_explicit(&entry->refs, 1, memory_order_acq_rel) == 1) {
+        cache_entry_free(entry);
+    }
+}
+
+static cache_entry_t* cache_promote(cache_t *cache, const cache_key_t *key);
+static void cache_refresh_schedule(cache_t *cache, const cache_key_t *key);
 
-    cache_entry_t *entry = cache->hash.table[idx];
+/* Caller holds the bucket lock, or the shard lock that all writers take */
+static cache_entry_t* cache_find(cache_bucket_t *bucket, const cache_key_t *key) {
+    cache_entry_t *entry = bucket->head;
     while (entry) {
-        if (entry->key_hash == hash && strcmp(entry->key, key) == 0) {
-            /* Check if entry is still valid */
-            time_t now = time(NULL);
-            if (entry->expires > now) {
-                entry->last_access = now;
-                entry->access_count++;
+        if (cache_key_eq(entry->key, entry->key_len, entry->key_hash, key)) {
+            break;
+        }
+        entry = entry->hash_next;
+    }
+    return entry;
+}
+
+/*
+ * Whether an expired entry may still be served: inside its
+ * stale-while-revalidate window, or its stale-if-error one once a refresh
+ * failed. Only with a refresh path, which *refresh then asks to be used.
+ */
+static bool cache_serve_stale(cache_t *cache, cache_entry_t *entry, time_t now, bool *refresh) {
+    time_t age = now - entry->expires;
+
+    if (!cache->refresh.fetch ||
+        !(age < (time_t)entry->stale_while_revalidate ||
+          (atomic_load_explicit(&entry->origin_error, memory_order_relaxed) &&
+           age < (time_t)entry->stale_if_error))) {
+        return false;
+    }
 
-                atomic_fetch_add(&cache->stats.hits, 1);
-                pthread_spin_unlock(&cache->hash.locks[idx]);
+    *refresh = !atomic_exchange_explicit(&entry->refreshing, true, memory_order_relaxed);
+    return true;
+}
 
-                /* Update LRU position */
-                cache_update_lru(cache, entry);
+cache_entry_t* cache_lookup_key(cache_t *cache, const cache_key_t *key) {
+    cache_shard_t *shard = cache_shard(cache, key->hash);
+    cache_bucket_t *bucket = cache_bucket(shard, key->hash);
+    time_t now = time(NULL);
+    bool refresh = false;
 
-                return entry;
-            } else {
-                /* Entry expired */
-                atomic_fetch_add(&cache->stats.misses, 1);
-                pthread_spin_unlock(&cache->hash.locks[idx]);
-                return NULL;
-            }
+    pthread_spin_lock(&bucket->lock);
+
+    cache_entry_t *entry = cache_find(bucket, key);
+
+    if (entry && entry->expires <= now && !cache_serve_stale(cache, entry, now, &refresh)) {
+        entry = NULL;
+    }
+
+    if (!entry) {
+        pthread_spin_unlock(&bucket->lock);
+        atomic_fetch_add_explicit(&shard->misses, 1, memory_order_relaxed);
+        return cache->disk ? cache_promote(cache, key) : NULL;
+    }
+
+    /* CLOCK: the hit only marks the entry, the ring is left alone. Skip the
+     * store when the bit is already set so hot entries stay shared. */
+    if (!atomic_load_explicit(&entry->referenced, memory_order_relaxed)) {
+        atomic_store_explicit(&entry->referenced, true, memory_order_relaxed);
+    }
+    cache_entry_get(entry);
+
+    pthread_spin_unlock(&bucket->lock);
+    atomic_fetch_add_explicit(&shard->hits, 1, memory_order_relaxed);
+
+    if (entry->expires <= now) {
+        atomic_fetch_add_explicit(&cache->stats.stale_hits, 1, memory_order_relaxed);
+        if (refresh) {
+            cache_refresh_schedule(cache, key);
         }
-        entry = entry->hash_next;
     }
+    return entry;
+}
 
-    atomic_fetch_add(&cache->stats.misses, 1);
-    pthread_spin_unlock(&cache->hash.locks[idx]);
-    return NULL;
+cache_entry_t* cache_lookup(cache_t *cache, const char *key) {
+    cache_key_t k;
+    cache_key_init(&k, key, strlen(key));
+    return cache_lookup_key(cache, &k);
 }
 
-// ok 
+cache_entry_t* cache_lookup_stale_key(cache_t *cache, const cache_key_t *key) {
+    cache_bucket_t *bucket = cache_bucket(cache_shard(cache, key->hash), key->hash);
+    time_t now = time(NULL);
 
-int cache_insert(cache_t *cache, const char *key, cache_entry_t *entry) {
-    /* Check size limits */
-    if (entry->size > cache->max_object_size) {
-        log_debug("Object too large for cache: %u > %u", entry->size, cache->max_object_size);
-        return -1;
+    pthread_spin_lock(&bucket->lock);
+    cache_entry_t *entry = cache_find(bucket, key);
+    if (entry && entry->expires <= now && now - entry->expires >= (time_t)entry->stale_if_error) {
+        entry = NULL;
+    }
+    if (entry) {
+        cache_entry_get(entry);
+    }
+    pthread_spin_unlock(&bucket->lock);
+
+    if (entry) {
+        atomic_fetch_add_explicit(&cache->stats.stale_hits, 1, memory_order_relaxed);
+    }
+    return entry;
+}
+
+cache_entry_t* cache_lookup_stale(cache_t *cache, const char *key) {
+    cache_key_t k;
+    cache_key_init(&k, key, strlen(key));
+    return cache_lookup_stale_key(cache, &k);
+}
+
+/* Unlink entry from its bucket and the ring. Caller holds the shard lock. */
+static void cache_unlink(cache_shard_t *shard, cache_entry_t *entry) {
+    cache_bucket_t *bucket = cache_bucket(shard, entry->key_hash);
+
+    pthread_spin_lock(&bucket->lock);
+    cache_entry_t **p = &bucket->head;
+    while (*p) {
+        if (*p == entry) {
+            *p = entry->hash_next;
+            break;
+        }
+        p = &(*p)->hash_next;
     }
+    pthread_spin_unlock(&bucket->lock);
 
-    /* Evict entries if cache is full */
-    while (cache->current_size + entry->size > cache->max_size) {
-        cache_evict_lru(cache);
+    if (entry->clock_next == entry) {
+        shard->hand = NULL;
+    } else {
+        entry->clock_prev->clock_next = entry->clock_next;
+        entry->clock_next->clock_prev = entry->clock_prev;
+        if (shard->hand == entry) {
+            shard->hand = entry->clock_next;
+        }
+    }
+
+    entry->clock_next = entry->clock_prev = NULL;
+
+    shard->current_size -= entry->size;
+    shard->entry_count--;
+}
+
+/*
+ * Advance the hand, clearing reference bits, until it finds an entry that
+ * was not hit since the last pass. Hits racing with the sweep can set bits
+ * again behind the hand, so it gives up after one full turn. Caller holds
+ * the shard lock and disposes of the unlinked victim; NULL when the shard
+ * is empty.
+ */
+static cache_entry_t* cache_clock_evict(cache_t *cache, cache_shard_t *shard) {
+    cache_entry_t *victim = shard->hand;
+    if (!victim) {
+        return NULL;
     }
 
-    uint32_t hash = cache_hash_key(key);
-    uint32_t idx = hash & cache->hash.mask;
+    for (uint32_t n = 0; n < shard->entry_count &&
+         atomic_exchange_explicit(&victim->referenced, false, memory_order_relaxed); n++) {
+        victim = victim->clock_next;
+    }
+    shard->hand = victim;
+
+    cache_unlink(shard, victim);
+    atomic_fetch_add_explicit(&cache->stats.evictions, 1, memory_order_relaxed);
+
+    log_debug("Evicted cache entry: hash=%016llx, size=%u",
+              (unsigned long long)victim->key_hash, victim->size);
 
-    entry->key = strdup(key);
-    entry->key_hash = hash;
-    entry->created = time(NULL);
-    entry->last_access = entry->created;
+    return victim;
+}
+
+/* Hand an evicted entry to the disk tier, unless it already has a copy */
+static void cache_demote(cache_t *cache, cache_entry_t *entry) {
+    if (cache->disk && entry->expires > time(NULL) &&
+        !((entry->flags & CACHE_F_ON_DISK) && cache_disk_contains(cache->disk, entry->key, entry->key_len, (uint32_t)entry->key_hash))) {
+        cache_disk_store(cache->disk, entry);
+    }
+    cache_entry_put(entry);
+}
+
+/* Fill a new entry's key and lifetime; one promoted from disk keeps its own */
+static int cache_entry_prepare(cache_t *cache, const cache_key_t *key, cache_entry_t *entry) {
+    entry->key = cache_key_dup(key);
+    if (!entry->key) return -1;
+    entry->key_len = key->len;
+    entry->key_hash = key->hash;
+    if (!(entry->flags & CACHE_F_ON_DISK)) {
+        entry->created = time(NULL);
+    }
+    atomic_init(&entry->referenced, false);
 
     /* Set expiration based on Cache-Control headers */
-    if (entry->flags & CACHE_F_MAX_AGE) {
+    if (entry->flags & (CACHE_F_MAX_AGE | CACHE_F_ON_DISK)) {
         /* Use max-age from response */
     } else {
         entry->expires = entry->created + cache->max_age;
     }
+    return 0;
+}
+
+/* Objects too large for RAM live on disk only; the entry is consumed */
+static int cache_insert_disk(cache_t *cache, const cache_key_t *key, cache_entry_t *entry) {
+    if (cache_entry_prepare(cache, key, entry) < 0) {
+        return -1;
+    }
+    if (cache_disk_store(cache->disk, entry) < 0) {
+        free(entry->key);
+        entry->key = NULL;
+        return -1;
+    }
+
+    /* Waiters find it with cache_lookup_disk */
+    cache_bucket_t *bucket = cache_bucket(cache_shard(cache, key->hash), key->hash);
+    pthread_spin_lock(&bucket->lock);
+    cache_fill_t *fill = cache_fill_take(bucket, key);
+    pthread_spin_unlock(&bucket->lock);
+    if (fill) {
+        cache_fill_finish(fill, NULL);
+    }
+
+    atomic_fetch_add_explicit(&cache->stats.inserts, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&cache->stats.bytes_in, entry->size, memory_order_relaxed);
+
+    cache_entry_free_data(entry);
+    free(entry);
+    return 0;
+}
+
+int cache_insert_key(cache_t *cache, const cache_key_t *key, cache_entry_t *entry) {
+    /* Check size limits */
+    if (entry->size > cache->max_object_size) {
+        if (cache->disk) {
+            return cache_insert_disk(cache, key, entry);
+        }
+        log_debug("Object too large for cache: %u > %u", entry->size, cache->max_object_size);
+        return -1;
+    }
+
+    cache_shard_t *shard = cache_shard(cache, key->hash);
+    cache_bucket_t *bucket = cache_bucket(shard, key->hash);
+
+    if (cache_entry_prepare(cache, key, entry) < 0) {
+        return -1;
+    }
+
+    /* Encodings made before the insert count against the shard as well */
+    for (int i = 0; i < CACHE_ENC_MAX; i++) {
+        entry->size += entry->variants[i].len;
+    }
+
+    /* A newer response must not fall back to an older disk copy later */
+    if (cache->disk && !(entry->flags & CACHE_F_ON_DISK)) {
+        cache_disk_delete(cache->disk, key->ptr, key->len, (uint32_t)key->hash);
+    }
 
     pthread_rwlock_init(&entry->lock, NULL);
 
-    /* Insert into hash table */
-    pthread_spin_lock(&cache->hash.locks[idx]);
-    entry->hash_next = cache->hash.table[idx];
-    cache->hash.table[idx] = entry;
-    pthread_spin_unlock(&cache->hash.locks[idx]);
+    pthread_spin_lock(&shard->lock);
 
-    /* Add to LRU list head (most recently used) */
-    pthread_spin_lock(&cache->lru.lock);
-    entry->lru_next = cache->lru.head;
-    entry->lru_prev = NULL;
-    if (cache->lru.head) {
-        cache->lru.head->lru_prev = entry;
+    /* A newer response replaces the stored one */
+    cache_entry_t *old = cache_find(bucket, key);
+    if (old) {
+        cache_unlink(shard, old);
     }
-    cache->lru.head = entry;
-    if (!cache->lru.tail) {
-        cache->lru.tail = entry;
+
+    /* Evict entries if the shard is full; victims are demoted once the
+     * shard lock is dropped */
+    cache_entry_t *victims = NULL;
+    while (shard->current_size + entry->size > shard->max_size) {
+        cache_entry_t *victim = cache_clock_evict(cache, shard);
+        if (!victim) break;
+        victim->hash_next = victims;
+        victims = victim;
+    }
+
+    /* Once linked the entry may be replaced or evicted at any time, so
+     * what is logged below is read now */
+    uint32_t size = entry->size;
+    time_t expires = entry->expires;
+
+    /* Insert into hash table, completing the fill that waited for it; the
+     * cache holds one reference and each waiter woken gets its own */
+    pthread_spin_lock(&bucket->lock);
+    entry->hash_next = bucket->head;
+    bucket->head = entry;
+    cache_fill_t *fill = cache_fill_take(bucket, key);
+    uint32_t refs = 1;
+    for (cache_waiter_t *w = fill ? fill->waiters : NULL; w; w = w->next) {
+        refs++;
+    }
+    atomic_fetch_add_explicit(&entry->refs, refs, memory_order_relaxed);
+    pthread_spin_unlock(&bucket->lock);
+
+    /* Join the ring just behind the hand, so it is looked at last */
+    if (shard->hand) {
+        entry->clock_next = shard->hand;
+        entry->clock_prev = shard->hand->clock_prev;
+        entry->clock_prev->clock_next = entry;
+        shard->hand->clock_prev = entry;
+    } else {
+        entry->clock_next = entry->clock_prev = entry;
+        shard->hand = entry;
+    }
+
+    shard->current_size += entry->size;
+    shard->entry_count++;
+
+    pthread_spin_unlock(&shard->lock);
+
+    if (fill) {
+        cache_fill_finish(fill, entry);
+    }
+
+    /* Holders of the replaced entry keep serving it until they put it */
+    if (old) {
+        cache_entry_put(old);
+    }
+
+    while (victims) {
+        cache_entry_t *next = victims->hash_next;
+        cache_demote(cache, victims);
+        victims = next;
     }
-    pthread_spin_unlock(&cache->lru.lock);
 
     /* Update stats */
-    cache->current_size += entry->size;
-    cache->entry_count++;
-    atomic_fetch_add(&cache->stats.inserts, 1);
-    atomic_fetch_add(&cache->stats.bytes_in, entry->size);
+    atomic_fetch_add_explicit(&cache->stats.inserts, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&cache->stats.bytes_in, size, memory_order_relaxed);
 
-    log_debug("Cached object: key=%s, size=%u, expires=%ld",
-              key, entry->size, entry->expires);
+    log_debug("Cached object: hash=%016llx, size=%u, expires=%ld",
+              (unsigned long long)key->hash, size, expires);
 
     return 0;
 }
 
-void cache_update_lru(cache_t *cache, cache_entry_t *entry) {
-    pthread_spin_lock(&cache->lru.lock);
+int cache_insert(cache_t *cache, const char *key, cache_entry_t *entry) {
+    cache_key_t k;
+    cache_key_init(&k, key, strlen(key));
+    return cache_insert_key(cache, &k, entry);
+}
+
+void cache_delete_key(cache_t *cache, const cache_key_t *key) {
+    cache_shard_t *shard = cache_shard(cache, key->hash);
+    cache_bucket_t *bucket = cache_bucket(shard, key->hash);
+
+    pthread_spin_lock(&shard->lock);
+
+    cache_entry_t *entry = cache_find(bucket, key);
+    if (entry) {
+        cache_unlink(shard, entry);
+    }
+
+    pthread_spin_unlock(&shard->lock);
+
+    if (entry) {
+        cache_entry_put(entry);
+    }
+    if (cache->disk) {
+        cache_disk_delete(cache->disk, key->ptr, key->len, (uint32_t)key->hash);
+    }
+}
+
+void cache_delete(cache_t *cache, const char *key) {
+    cache_key_t k;
+    cache_key_init(&k, key, strlen(key));
+    cache_delete_key(cache, &k);
+}
 
-    /* Move entry to head of LRU list (most recently used) */
-    if (entry != cache->lru.head) {
-        /* Remove from current position */
-        if (entry->lru_prev) {
-            entry->lru_prev->lru_next = entry->lru_next;
+static void cache_purge_ram(cache_t *cache, bool demote) {
+    for (uint32_t i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard_t *shard = &cache->shards[i];
+
+        pthread_spin_lock(&shard->lock);
+        while (shard->hand) {
+            cache_entry_t *entry = shard->hand;
+            cache_unlink(shard, entry);
+            if (demote) {
+                cache_demote(cache, entry);
+            } else {
+                cache_entry_put(entry);
+            }
         }
-        if (entry->lru_next) {
-            entry->lru_next->lru_prev = entry->lru_prev;
-        } else {
-            /* Entry was tail */
-            cache->lru.tail = entry->lru_prev;
+        pthread_spin_unlock(&shard->lock);
+    }
+}
+
+void cache_purge(cache_t *cache) {
+    cache_purge_ram(cache, false);
+    if (cache->disk) {
+        cache_disk_purge(cache->disk);
+    }
+}
+
+void cache_destroy(cache_t *cache) {
+    if (!cache) return;
+
+    pthread_rwlock_wrlock(&caches_lock);
+    for (cache_t **p = &caches; *p; p = &(*p)->next) {
+        if (*p == cache) {
+            *p = cache->next;
+            break;
         }
+    }
+    pthread_rwlock_unlock(&caches_lock);
 
-        /* Insert at head */
-        entry->lru_prev = NULL;
-        entry->lru_next = cache->lru.head;
-        cache->lru.head->lru_prev = entry;
-        cache->lru.head = entry;
+    if (cache->refresh.running) {
+        pthread_mutex_lock(&cache->refresh.lock);
+        cache->refresh.running = false;
+        pthread_cond_signal(&cache->refresh.cond);
+        pthread_mutex_unlock(&cache->refresh.lock);
+        pthread_join(cache->refresh.thread, NULL);
+    }
+    while (cache->refresh.head != cache->refresh.tail) {
+        free((char*)cache->refresh.queue[cache->refresh.head++ % CACHE_REFRESH_QUEUE].ptr);
+    }
+    pthread_mutex_destroy(&cache->refresh.lock);
+    pthread_cond_destroy(&cache->refresh.cond);
+
+    /* What RAM holds goes to disk too, so the next start is warm */
+    cache_purge_ram(cache, true);
+    cache_disk_close(cache->disk);
+    cache->disk = NULL;
+
+    for (uint32_t i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard_t *shard = &cache->shards[i];
+        pthread_spin_destroy(&shard->lock);
+        for (uint32_t b = 0; b < CACHE_SHARD_BUCKETS; b++) {
+            cache_bucket_t *bucket = &shard->buckets[b];
+            while (bucket->fills) {
+                cache_fill_t *fill = bucket->fills;
+                bucket->fills = fill->next;
+                cache_fill_finish(fill, NULL);
+            }
+            pthread_spin_destroy(&bucket->lock);
+        }
     }
 
-    pthread_spin_unlock(&cache->lru.lock);
+    pthread_rwlock_destroy(&cache->lock);
+    free(cache->shards);
+    free(cache->name);
+    free(cache);
 }
 
-void cache_evict_lru(cache_t *cache) {
-    pthread_spin_lock(&cache->lru.lock);
+int cache_lookup_collapsed_key(cache_t *cache, const cache_key_t *key, cache_waiter_t *w,
+                               cache_entry_t **entry) {
+    *entry = cache_lookup_key(cache, key);
+    if (*entry) {
+        return CACHE_HIT;
+    }
 
-    cache_entry_t *victim = cache->lru.tail;
-    if (!victim) {
-        pthread_spin_unlock(&cache->lru.lock);
-        return;
+    cache_bucket_t *bucket = cache_bucket(cache_shard(cache, key->hash), key->hash);
+    uint64_t now = cache_now_ms();
+
+    pthread_spin_lock(&bucket->lock);
+
+    /* The fetch may have landed since the miss above */
+    cache_entry_t *e = cache_find(bucket, key);
+    if (e && e->expires > time(NULL)) {
+        atomic_store_explicit(&e->referenced, true, memory_order_relaxed);
+        *entry = cache_entry_get(e);
+        pthread_spin_unlock(&bucket->lock);
+        return CACHE_HIT;
+    }
+
+    cache_fill_t *fill = bucket->fills;
+    while (fill && !cache_key_eq(fill->key, fill->key_len, fill->key_hash, key)) {
+        fill = fill->next;
     }
 
-    /* Remove from LRU list */
-    cache->lru.tail = victim->lru_prev;
-    if (cache->lru.tail) {
-        cache->lru.tail->lru_next = NULL;
+    if (fill && now - fill->started_ms < cache->fill_timeout_ms) {
+        w->next = fill->waiters;
+        fill->waiters = w;
+        pthread_spin_unlock(&bucket->lock);
+        atomic_fetch_add_explicit(&cache->stats.collapsed, 1, memory_order_relaxed);
+        return CACHE_MISS_WAIT;
+    }
+
+    if (fill) {
+        /* The leader is stuck; this request fetches for its waiters */
+        fill->started_ms = now;
     } else {
-        cache->lru.head = NULL;
+        fill = calloc(1, sizeof(*fill));
+        if (fill) {
+            fill->key = cache_key_dup(key);
+            if (!fill->key) {
+                free(fill);
+                fill = NULL;
+            }
+        }
+        if (fill) {
+            fill->key_len = key->len;
+            fill->key_hash = key->hash;
+            fill->started_ms = now;
+            fill->next = bucket->fills;
+            bucket->fills = fill;
+        }
+    }
+
+    pthread_spin_unlock(&bucket->lock);
+    return CACHE_MISS_FETCH;
+}
+
+int cache_lookup_collapsed(cache_t *cache, const char *key, cache_waiter_t *w, cache_entry_t **entry) {
+    cache_key_t k;
+    cache_key_init(&k, key, strlen(key));
+    return cache_lookup_collapsed_key(cache, &k, w, entry);
+}
+
+void cache_fill_abort_key(cache_t *cache, const cache_key_t *key) {
+    cache_bucket_t *bucket = cache_bucket(cache_shard(cache, key->hash), key->hash);
+
+    pthread_spin_lock(&bucket->lock);
+    cache_fill_t *fill = cache_fill_take(bucket, key);
+    pthread_spin_unlock(&bucket->lock);
+
+    if (fill) {
+        cache_fill_finish(fill, NULL);
+    }
+}
+
+void cache_fill_abort(cache_t *cache, const char *key) {
+    cache_key_t k;
+    cache_key_init(&k, key, strlen(key));
+    cache_fill_abort_key(cache, &k);
+}
+
+bool cache_waiter_cancel_key(cache_t *cache, const cache_key_t *key, cache_waiter_t *w) {
+    cache_bucket_t *bucket = cache_bucket(cache_shard(cache, key->hash), key->hash);
+    bool found = false;
+
+    pthread_spin_lock(&bucket->lock);
+    for (cache_fill_t *fill = bucket->fills; fill && !found; fill = fill->next) {
+        if (!cache_key_eq(fill->key, fill->key_len, fill->key_hash, key)) {
+            continue;
+        }
+        for (cache_waiter_t **p = &fill->waiters; *p; p = &(*p)->next) {
+            if (*p == w) {
+                *p = w->next;
+                w->next = NULL;
+                found = true;
+                break;
+            }
+        }
+    }
+    pthread_spin_unlock(&bucket->lock);
+
+    return found;
+}
+
+bool cache_waiter_cancel(cache_t *cache, const char *key, cache_waiter_t *w) {
+    cache_key_t k;
+    cache_key_init(&k, key, strlen(key));
+    return cache_waiter_cancel_key(cache, &k, w);
+}
+
+/* Queue a refresh; the entry's refreshing flag was claimed for it */
+static void cache_refresh_schedule(cache_t *cache, const cache_key_t *key) {
+    char *copy = cache_key_dup(key);
+    bool queued = false;
+
+    pthread_mutex_lock(&cache->refresh.lock);
+    if (copy && cache->refresh.tail - cache->refresh.head < CACHE_REFRESH_QUEUE) {
+        cache->refresh.queue[cache->refresh.tail++ % CACHE_REFRESH_QUEUE] =
+            (cache_key_t){ .ptr = copy, .len = key->len, .hash = key->hash };
+        pthread_cond_signal(&cache->refresh.cond);
+        queued = true;
+    }
+    pthread_mutex_unlock(&cache->refresh.lock);
+
+    if (!queued) {
+        /* Full: let a later hit try again */
+        free(copy);
+        cache_bucket_t *bucket = cache_bucket(cache_shard(cache, key->hash), key->hash);
+        pthread_spin_lock(&bucket->lock);
+        cache_entry_t *entry = cache_find(bucket, key);
+        if (entry) {
+            atomic_store_explicit(&entry->refreshing, false, memory_order_relaxed);
+        }
+        pthread_spin_unlock(&bucket->lock);
+        atomic_fetch_add_explicit(&cache->stats.refresh_dropped, 1, memory_order_relaxed);
+    }
+}
+
+/* Revalidate one key with a conditional request to the origin */
+static void cache_refresh_one(cache_t *cache, const cache_key_t *key) {
+    cache_bucket_t *bucket = cache_bucket(cache_shard(cache, key->hash), key->hash);
+    char cond[1024];
+    size_t cond_len = 0;
+
+    pthread_spin_lock(&bucket->lock);
+    cache_entry_t *entry = cache_find(bucket, key);
+    if (entry && entry->etag && strlen(entry->etag) < sizeof(cond) - 64) {
+        cond_len += (size_t)snprintf(cond, sizeof(cond), "If-None-Match: %s\r\n", entry->etag);
+    }
+    if (entry && entry->last_modified) {
+        struct tm tm;
+        cond_len += strftime(cond + cond_len, sizeof(cond) - cond_len,
+                             "If-Modified-Since: %a, %d %b %Y %H:%M:%S GMT\r\n",
+                             gmtime_r(&entry->last_modified, &tm));
+    }
+    pthread_spin_unlock(&bucket->lock);
+    cond[cond_len] = '\0';
+
+    if (!entry) return;
+
+    cache_entry_t *fresh = NULL;
+    int status = cache->refresh.fetch(cache->refresh.arg, key, cond, cond_len, &fresh);
+
+    /* A new body replaces the entry, which takes its flags along */
+    if (status >= 200 && status < 300 && fresh) {
+        if (cache_insert_key(cache, key, fresh) == 0) {
+            atomic_fetch_add_explicit(&cache->stats.refreshes, 1, memory_order_relaxed);
+            return;
+        }
+        status = -1;
+    }
+    if (fresh) {
+        cache_entry_free_data(fresh);
+        free(fresh);
+    }
+
+    time_t now = time(NULL);
+    pthread_spin_lock(&bucket->lock);
+    entry = cache_find(bucket, key);
+    if (entry) {
+        if (status == 304) {
+            /* Still valid: fresh again for as long as it was the first time */
+            time_t ttl = entry->expires - entry->created;
+            entry->created = now;
+            entry->expires = now + (ttl > 0 ? ttl : (time_t)cache->max_age);
+            atomic_store_explicit(&entry->origin_error, false, memory_order_relaxed);
+        } else {
+            atomic_store_explicit(&entry->origin_error, true, memory_order_relaxed);
+        }
+        atomic_store_explicit(&entry->refreshing, false, memory_order_relaxed);
+    }
+    pthread_spin_unlock(&bucket->lock);
+
+    atomic_fetch_add_explicit(status == 304 ? &cache->stats.refreshes : &cache->stats.refresh_errors,
+                              1, memory_order_relaxed);
+}
+
+static void* cache_refresh_thread(void *arg) {
+    cache_t *cache = arg;
+
+    pthread_mutex_lock(&cache->refresh.lock);
+    while (cache->refresh.running) {
+        if (cache->refresh.head == cache->refresh.tail) {
+            pthread_cond_wait(&cache->refresh.cond, &cache->refresh.lock);
+            continue;
+        }
+
+        cache_key_t key = cache->refresh.queue[cache->refresh.head++ % CACHE_REFRESH_QUEUE];
+        pthread_mutex_unlock(&cache->refresh.lock);
+
+        cache_refresh_one(cache, &key);
+        free((char*)key.ptr);
+
+        pthread_mutex_lock(&cache->refresh.lock);
+    }
+    pthread_mutex_unlock(&cache->refresh.lock);
+
+    return NULL;
+}
+
+int cache_start_refresh(cache_t *cache, cache_fetch_fn fetch, void *arg) {
+    if (cache->refresh.running || !fetch) return -1;
+
+    cache->refresh.fetch = fetch;
+    cache->refresh.arg = arg;
+    cache->refresh.running = true;
+    if (pthread_create(&cache->refresh.thread, NULL, cache_refresh_thread, cache) != 0) {
+        cache->refresh.running = false;
+        cache->refresh.fetch = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+int cache_attach_disk(cache_t *cache, const char *path, uint64_t size, uint32_t max_object_size) {
+    if (cache->disk) return -1;
+
+    cache->disk = cache_disk_open(path, size, max_object_size);
+    return cache->disk ? 0 : -1;
+}
+
+/* A RAM miss found on disk comes back into RAM if it fits there */
+static cache_entry_t* cache_promote(cache_t *cache, const cache_key_t *key) {
+    cache_disk_obj_t obj;
+
+    if (cache_disk_lookup(cache->disk, key->ptr, key->len, (uint32_t)key->hash, &obj) < 0 || obj.len > cache->max_object_size) {
+        return NULL;
+    }
+
+    cache_entry_t *entry = cache_disk_load(cache->disk, &obj);
+    if (!entry) return NULL;
+
+    /* The caller's reference, on top of the one the insert adds */
+    entry->flags |= CACHE_F_ON_DISK;
+    atomic_init(&entry->refs, 1);
+    if (cache_insert_key(cache, key, entry) < 0) {
+        cache_entry_free_data(entry);
+        free(entry);
+        return NULL;
+    }
+
+    return entry;
+}
+
+int cache_lookup_disk_key(cache_t *cache, const cache_key_t *key, cache_disk_obj_t *obj) {
+    if (!cache->disk) return -1;
+    return cache_disk_lookup(cache->disk, key->ptr, key->len, (uint32_t)key->hash, obj);
+}
+
+int cache_lookup_disk(cache_t *cache, const char *key, cache_disk_obj_t *obj) {
+    cache_key_t k;
+    cache_key_init(&k, key, strlen(key));
+    return cache_lookup_disk_key(cache, &k, obj);
+}
+
+/* Sum the per-shard hit path counters; any argument may be NULL */
+void cache_read_stats(const cache_t *cache, uint64_t *hits, uint64_t *misses, uint64_t *bytes_out) {
+    uint64_t h = 0, m = 0, b = 0;
+
+    for (uint32_t i = 0; i < CACHE_SHARDS; i++) {
+        h += atomic_load_explicit(&cache->shards[i].hits, memory_order_relaxed);
+        m += atomic_load_explicit(&cache->shards[i].misses, memory_order_relaxed);
+        b += atomic_load_explicit(&cache->shards[i].bytes_out, memory_order_relaxed);
+    }
+
+    if (hits) *hits = h;
+    if (misses) *misses = m;
+    if (bytes_out) *bytes_out = b;
+}
+
+/* One-shot encode of a whole body into a fresh buffer */
+static int cache_compress(int enc, int level, const char *in, size_t len, char **out, size_t *out_len) {
+    *out = NULL;
+
+    switch (enc) {
+        case COMP_TYPE_GZIP:
+        case COMP_TYPE_DEFLATE: {
+            z_stream zs;
+            memset(&zs, 0, sizeof(zs));
+
+            int wbits = (enc == COMP_TYPE_GZIP) ? 15 + 16 : 15;
+            if (len > UINT32_MAX ||
+                deflateInit2(&zs, level, Z_DEFLATED, wbits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                return -1;
+            }
+
+            size_t cap = deflateBound(&zs, (uLong)len);
+            *out = malloc(cap);
+            if (!*out) {
+                deflateEnd(&zs);
+                return -1;
+            }
+
+            zs.next_in = (Bytef*)in;
+            zs.avail_in = (uInt)len;
+            zs.next_out = (Bytef*)*out;
+            zs.avail_out = (uInt)cap;
+            int ret = deflate(&zs, Z_FINISH);
+            *out_len = zs.total_out;
+            deflateEnd(&zs);
+            return ret == Z_STREAM_END ? 0 : -1;
+        }
+
+        case COMP_TYPE_BROTLI: {
+            size_t cap = BrotliEncoderMaxCompressedSize(len);
+            if (!cap || !(*out = malloc(cap))) {
+                return -1;
+            }
+
+            *out_len = cap;
+            if (!BrotliEncoderCompress(level, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_GENERIC,
+                                       len, (const uint8_t*)in, out_len, (uint8_t*)*out)) {
+                return -1;
+            }
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* Make and publish one encoded copy. Caller claimed the type. */
+static void cache_entry_encode(cache_t *cache, cache_entry_t *entry, int enc) {
+    int level = (enc == COMP_TYPE_BROTLI) ? cache->brotli_quality : cache->gzip_level;
+    char *out;
+    size_t out_len = 0;
+
+    if (cache_compress(enc, level, entry->data.ptr, entry->data.len, &out, &out_len) < 0 ||
+        out_len >= entry->data.len) {
+        free(out);
+        out = NULL;
+        out_len = 0;
+    }
+
+    entry->variants[enc].ptr = out;
+    entry->variants[enc].len = out_len;
+
+    /* A stored entry carries the copy in its shard's size, unless eviction
+     * unlinked it meanwhile; one not inserted yet is counted by cache_insert */
+    if (out && entry->key) {
+        cache_shard_t *shard = cache_shard(cache, entry->key_hash);
+        pthread_spin_lock(&shard->lock);
+        if (entry->clock_next) {
+            entry->size += (uint32_t)out_len;
+            shard->current_size += (uint32_t)out_len;
+        }
+        pthread_spin_unlock(&shard->lock);
+    }
+
+    atomic_fetch_or_explicit(&entry->variants_ready, 1u << enc, memory_order_release);
+}
+
+int cache_entry_variant(cache_t *cache, cache_entry_t *entry, int enc, const char **ptr, size_t *len) {
+    *ptr = entry->data.ptr;
+    *len = entry->data.len;
+
+    if (enc <= COMP_TYPE_NONE || enc >= CACHE_ENC_MAX || entry->data.len < CACHE_COMP_MIN_SIZE ||
+        (entry->flags & (CACHE_F_NO_TRANSFORM | CACHE_F_VARY_MARKER))) {
+        return COMP_TYPE_NONE;
+    }
+
+    uint32_t bit = 1u << enc;
+    if (!(atomic_load_explicit(&entry->variants_ready, memory_order_acquire) & bit)) {
+        /* The first client asking encodes, the others get identity meanwhile */
+        if (atomic_fetch_or_explicit(&entry->variants_claimed, bit, memory_order_relaxed) & bit) {
+            return COMP_TYPE_NONE;
+        }
+        cache_entry_encode(cache, entry, enc);
+    }
+
+    if (!entry->variants[enc].ptr) {
+        return COMP_TYPE_NONE;
+    }
+
+    *ptr = entry->variants[enc].ptr;
+    *len = entry->variants[enc].len;
+    return enc;
+}
+
+const char* get_encoding_name(int type) {
+    switch (type) {
+        case COMP_TYPE_GZIP:    return "gzip";
+        case COMP_TYPE_DEFLATE: return "deflate";
+        case COMP_TYPE_BROTLI:  return "br";
+        default:                return "identity";
     }
+}
 
-    pthread_spin_unlock(&cache->lru.lock);
+/*
+ * Best encoding an Accept-Encoding value allows: the highest q-value among
+ * br, gzip and deflate, preferring them in that order on a tie; "*" covers
+ * whichever are not named.
+ */
+int parse_accept_encoding(const char *value) {
+    double q[CACHE_ENC_MAX] = { -1, -1, -1, -1 };
+    double q_any = -1;
 
-    /* Remove from hash table */
-    uint32_t idx = victim->key_hash & cache->hash.mask;
+    if (!value) return COMP_TYPE_NONE;
 
-    pthread_spin_lock(&cache->hash.locks[idx]);
-    cache_entry_t **p = &cache->hash.table[idx];
+    const char *p = value;
     while (*p) {
-        if (*p == victim) {
-            *p = victim->hash_next;
-            break;
+        while (*p == ',' || *p == ' ' || *p == '\t') p++;
+        const char *name = p;
+        while (*p && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+        size_t name_len = (size_t)(p - name);
+
+        double weight = 1.0;
+        while (*p && *p != ',') {
+            if (*p == ';') {
+                p++;
+                while (*p == ' ' || *p == '\t') p++;
+                if ((p[0] == 'q' || p[0] == 'Q') && p[1] == '=') {
+                    weight = strtod(p + 2, NULL);
+                }
+            } else {
+                p++;
+            }
+        }
+
+        if (name_len == 4 && strncasecmp(name, "gzip", 4) == 0) {
+            q[COMP_TYPE_GZIP] = weight;
+        } else if (name_len == 7 && strncasecmp(name, "deflate", 7) == 0) {
+            q[COMP_TYPE_DEFLATE] = weight;
+        } else if (name_len == 2 && strncasecmp(name, "br", 2) == 0) {
+            q[COMP_TYPE_BROTLI] = weight;
+        } else if (name_len == 1 && name[0] == '*') {
+            q_any = weight;
         }
-        p = &(*p)->hash_next;
     }
-    pthread_spin_unlock(&cache->hash.locks[idx]);
 
-    /* Update stats */
-    cache->current_size -= victim->size;
-    cache->entry_count--;
-    atomic_fetch_add(&cache->stats.evictions, 1);
+    static const int order[] = { COMP_TYPE_BROTLI, COMP_TYPE_GZIP, COMP_TYPE_DEFLATE };
+    int best = COMP_TYPE_NONE;
+    double best_q = 0;
 
-    log_debug("Evicted cache entry: key=%s, size=%u", victim->key, victim->size);
+    for (size_t i = 0; i < sizeof(order) / sizeof(order[0]); i++) {
+        double w = q[order[i]] >= 0 ? q[order[i]] : q_any;
+        if (w > best_q) {
+            best = order[i];
+            best_q = w;
+        }
+    }
 
-    /* Free entry */
-    free(victim->key);
-    free(victim->data.ptr);
-    free(victim->etag);
-    free(victim->vary);
-    pthread_rwlock_destroy(&victim->lock);
-    free(victim);
+    return best;
 }
 
 /* Check if request can be served from cache */
@@ -298,21 +1160,40 @@ int cache_check_request(struct stream *s, struct channel *req, struct channel *r
         }
     }
 
-    /* Build cache key and lookup */
-    char *key = cache_build_key(txn);
-    if (!key) return 0;
-
     cache_t *cache = px->cache;
-    if (!cache) {
-        free(key);
-        return 0;
-    }
+    if (!cache) return 0;
 
-    cache_entry_t *entry = cache_lookup(cache, key);
-    free(key);
+    /* Build cache key and lookup */
+    cache_key_buf_t buf;
+    cache_key_t key;
+    if (cache_build_key(txn, &buf, &key) < 0) return 0;
+
+    cache_entry_t *entry = cache_lookup_key(cache, &key);
+
+    /* A response with Vary left a marker under the base key naming the
+     * headers its variants are keyed on */
+    if (entry && (entry->flags & CACHE_F_VARY_MARKER)) {
+        int built = cache_build_vary_key(txn, entry->vary, &buf, &key);
+        cache_entry_put(entry);
+        if (built < 0) return 0;
+        entry = cache_lookup_key(cache, &key);
+    }
 
     if (!entry) {
-        return 0;  /* Cache miss - proceed to backend */
+        /* Too large for RAM but maybe on disk; discard the copy if the ring
+         * overwrote it meanwhile */
+        cache_disk_obj_t obj;
+        int served = 0;
+        if (cache_lookup_disk_key(cache, &key, &obj) == 0) {
+            size_t before = res->buf.data;
+            if (buffer_put(&res->buf, obj.body, obj.len) >= 0) {
+                served = cache_disk_intact(cache->disk, &obj);
+                if (!served) {
+                    res->buf.data = before;
+                }
+            }
+        }
+        return served;  /* Cache miss - proceed to backend */
     }
 
     /* Check if entry needs revalidation */
@@ -329,20 +1210,54 @@ int cache_check_request(struct stream *s, struct channel *req, struct channel *r
         }
     }
 
-    /* Serve from cache */
+    /* Serve from cache, in the encoding the client takes */
     pthread_rwlock_rdlock(&entry->lock);
 
+    const char *body;
+    size_t body_len;
+    int enc = parse_accept_encoding(http_header_get(&txn->req, "Accept-Encoding"));
+    enc = cache_entry_variant(cache, entry, enc, &body, &body_len);
+
     /* Copy cached response to channel buffer */
-    buffer_put(&res->buf, entry->data.ptr, entry->data.len);
+    buffer_put(&res->buf, body, body_len);
+
+    if (enc != COMP_TYPE_NONE) {
+        http_header_add(&txn->rsp, "Content-Encoding", get_encoding_name(enc));
+    }
+    if (entry->data.len >= CACHE_COMP_MIN_SIZE) {
+        http_header_add(&txn->rsp, "Vary", "Accept-Encoding");
+    }
 
     /* Update stats */
-    atomic_fetch_add(&cache->stats.bytes_out, entry->data.len);
+    atomic_fetch_add_explicit(&cache_shard(cache, entry->key_hash)->bytes_out,
+                              body_len, memory_order_relaxed);
 
     pthread_rwlock_unlock(&entry->lock);
+    cache_entry_put(entry);
 
     return 1;  /* Request served from cache */
 }
 
+static void cache_insert_vary_marker(cache_t *cache, const cache_key_t *key, const char *vary,
+                                     uint32_t flags, time_t expires) {
+    cache_entry_t *marker = calloc(1, sizeof(*marker));
+    if (!marker) return;
+
+    marker->vary = strdup(vary);
+    if (!marker->vary) {
+        free(marker);
+        return;
+    }
+    marker->flags = CACHE_F_VARY_MARKER | (flags & CACHE_F_MAX_AGE);
+    marker->expires = expires;
+    marker->size = (uint32_t)(sizeof(*marker) + strlen(vary));
+
+    if (cache_insert_key(cache, key, marker) < 0) {
+        cache_entry_free_data(marker);
+        free(marker);
+    }
+}
+
 /* Store response in cache if cacheable */
 int cache_store_response(struct stream *s, struct channel *res) {
     struct http_txn *txn = s->txn;
@@ -351,29 +1266,36 @@ int cache_store_response(struct stream *s, struct channel *res) {
 
     if (!cache) return 0;
 
-    /* Check if response is cacheable */
-    if (txn->status < 200 || txn->status >= 300) {
-        return 0;  /* Only cache 2xx responses */
-    }
+    /* Build cache key */
+    cache_key_buf_t buf;
+    cache_key_t key;
+    if (cache_build_key(txn, &buf, &key) < 0) return 0;
 
-    /* Check Cache-Control headers */
+    /* Check if response is cacheable; requests collapsed onto this one
+     * have to go to the origin themselves when it is not */
     char *cache_control = http_header_get(&txn->rsp, "Cache-Control");
-    if (cache_control) {
-        if (strstr(cache_control, "no-cache") ||
-            strstr(cache_control, "no-store") ||
-            strstr(cache_control, "private")) {
-            return 0;  /* Not cacheable */
-        }
+    if (txn->status < 200 || txn->status >= 300 ||  /* Only cache 2xx responses */
+        (cache_control && (strstr(cache_control, "no-cache") ||
+                           strstr(cache_control, "no-store") ||
+                           strstr(cache_control, "private")))) {
+        cache_fill_abort_key(cache, &key);
+        return 0;
     }
 
-    /* Build cache key */
-    char *key = cache_build_key(txn);
-    if (!key) return 0;
+    /* Encodings are produced here, so a body the origin already encoded
+     * is not kept; Vary: * can never match a later request */
+    char *content_encoding = http_header_get(&txn->rsp, "Content-Encoding");
+    char *vary = http_header_get(&txn->rsp, "Vary");
+    if ((content_encoding && strcasecmp(content_encoding, "identity") != 0) ||
+        (vary && strchr(vary, '*'))) {
+        cache_fill_abort_key(cache, &key);
+        return 0;
+    }
 
     /* Create cache entry */
     cache_entry_t *entry = calloc(1, sizeof(*entry));
     if (!entry) {
-        free(key);
+        cache_fill_abort_key(cache, &key);
         return 0;
     }
 
@@ -383,7 +1305,7 @@ int cache_store_response(struct stream *s, struct channel *res) {
     entry->data.ptr = malloc(entry->data.len);
     if (!entry->data.ptr) {
         free(entry);
-        free(key);
+        cache_fill_abort_key(cache, &key);
         return 0;
     }
 
@@ -407,7 +1329,6 @@ int cache_store_response(struct stream *s, struct channel *res) {
         }
     }
 
-    char *vary = http_header_get(&txn->rsp, "Vary");
     if (vary) {
         entry->vary = strdup(vary);
     }
@@ -417,6 +1338,19 @@ int cache_store_response(struct stream *s, struct channel *res) {
         if (strstr(cache_control, "must-revalidate")) {
             entry->flags |= CACHE_F_MUST_REVALIDATE;
         }
+        if (strstr(cache_control, "no-transform")) {
+            entry->flags |= CACHE_F_NO_TRANSFORM;
+        }
+
+        /* RFC 5861 extensions */
+        char *swr = strstr(cache_control, "stale-while-revalidate=");
+        if (swr) {
+            entry->stale_while_revalidate = (uint32_t)strtoul(swr + 23, NULL, 10);
+        }
+        char *sie = strstr(cache_control, "stale-if-error=");
+        if (sie) {
+            entry->stale_if_error = (uint32_t)strtoul(sie + 15, NULL, 10);
+        }
 
         char *max_age = strstr(cache_control, "max-age=");
         if (max_age) {
@@ -426,15 +1360,47 @@ int cache_store_response(struct stream *s, struct channel *res) {
         }
     }
 
-    /* Insert into cache */
-    int ret = cache_insert(cache, key, entry);
-    free(key);
+    /* Encode up front what is configured that way; the rest waits for
+     * the first client asking for it */
+    for (int enc = COMP_TYPE_NONE + 1; enc < CACHE_ENC_MAX; enc++) {
+        if (cache->precompress & (1u << enc)) {
+            const char *body;
+            size_t body_len;
+            cache_entry_variant(cache, entry, enc, &body, &body_len);
+        }
+    }
+
+    /* Insert into cache; a response with Vary goes under its variant key,
+     * with a marker under the base key telling lookups how to get there */
+    int ret;
+    if (!vary) {
+        ret = cache_insert_key(cache, &key, entry);
+    } else {
+        /* A Vary naming only Accept-Encoding adds no fields to the base key */
+        cache_key_buf_t vary_buf;
+        cache_key_t vary_key;
+        if (cache_build_vary_key(txn, vary, &vary_buf, &vary_key) < 0) {
+            ret = -1;
+        } else if (vary_key.len != key.len) {
+            /* The insert may hand the entry to the disk tier and free it */
+            uint32_t flags = entry->flags;
+            time_t expires = entry->expires;
+            ret = cache_insert_key(cache, &vary_key, entry);
+            if (ret == 0) {
+                cache_insert_vary_marker(cache, &key, vary, flags, expires);
+            }
+        } else {
+            ret = cache_insert_key(cache, &key, entry);
+        }
+    }
+
+    if (ret < 0) {
+        cache_fill_abort_key(cache, &key);
+    }
 
     if (ret < 0) {
         /* Failed to cache - cleanup */
-        free(entry->data.ptr);
-        free(entry->etag);
-        free(entry->vary);
+        cache_entry_free_data(entry);
         free(entry);
         return 0;
     }
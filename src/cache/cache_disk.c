@@ -0,0 +1,591 @@
+#include "cache/cache_disk.h"
+#include "cache/cache.h"
+#include "utils/log.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <zlib.h>
+
+#define DISK_ALIGN_UP(x)  (((uint64_t)(x) + CACHE_DISK_ALIGN - 1) & ~(uint64_t)(CACHE_DISK_ALIGN - 1))
+
+/* Average object size assumed when sizing the index */
+#define CACHE_DISK_AVG_OBJECT  (64 * 1024)
+
+static uint32_t cache_disk_rec_crc(const cache_disk_rec_t *rec) {
+    cache_disk_rec_t tmp = *rec;
+    tmp.crc = 0;
+    return (uint32_t)crc32(0, (const Bytef*)&tmp, sizeof(tmp));
+}
+
+static inline uint64_t cache_disk_rec_len(const cache_disk_rec_t *rec) {
+    return DISK_ALIGN_UP(sizeof(*rec) + rec->key_len + rec->etag_len +
+                         rec->vary_len + rec->data_len);
+}
+
+static inline const char* cache_disk_rec_key(const cache_disk_rec_t *rec) {
+    return (const char*)(rec + 1);
+}
+
+static inline const char* cache_disk_rec_body(const cache_disk_rec_t *rec) {
+    return cache_disk_rec_key(rec) + rec->key_len + rec->etag_len + rec->vary_len;
+}
+
+static inline cache_disk_rec_t* cache_disk_rec_at(cache_disk_t *disk, uint64_t pos) {
+    return (cache_disk_rec_t*)(disk->ring + pos % disk->size);
+}
+
+static bool cache_disk_rec_valid(cache_disk_t *disk, const cache_disk_rec_t *rec, uint64_t off) {
+    if (rec->magic != CACHE_DISK_MAGIC || rec->pos % disk->size != off) {
+        return false;
+    }
+    if (rec->crc != cache_disk_rec_crc(rec)) {
+        return false;
+    }
+
+    uint64_t len = cache_disk_rec_len(rec);
+    return len <= disk->max_record && off + len <= disk->size;
+}
+
+/* A record is intact until the head has gone round to it again */
+static inline bool cache_disk_pos_live(const cache_disk_t *disk, uint64_t pos, uint64_t head) {
+    return pos + disk->size >= head + disk->guard;
+}
+
+bool cache_disk_intact(cache_disk_t *disk, const cache_disk_obj_t *obj) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load(&disk->head) <= obj->pos + disk->size;
+}
+
+/* Index, all under disk->lock. Dropped entries stay on the FIFO with
+ * rec_len 0 until the head passes them. */
+
+static cache_disk_idx_t** cache_disk_idx_find(cache_disk_t *disk, const char *key, size_t key_len,
+                                              uint32_t hash) {
+    cache_disk_idx_t **p = &disk->table[hash & disk->mask];
+
+    while (*p) {
+        cache_disk_idx_t *idx = *p;
+        if (idx->key_hash == hash) {
+            const cache_disk_rec_t *rec = cache_disk_rec_at(disk, idx->pos);
+            if (rec->key_len == key_len && memcmp(cache_disk_rec_key(rec), key, key_len) == 0) {
+                return p;
+            }
+        }
+        p = &idx->hash_next;
+    }
+
+    return NULL;
+}
+
+static void cache_disk_idx_drop(cache_disk_t *disk, cache_disk_idx_t **p) {
+    cache_disk_idx_t *idx = *p;
+    *p = idx->hash_next;
+    idx->hash_next = NULL;
+    idx->rec_len = 0;
+    disk->count--;
+}
+
+static void cache_disk_idx_unhash(cache_disk_t *disk, cache_disk_idx_t *idx) {
+    for (cache_disk_idx_t **p = &disk->table[idx->key_hash & disk->mask]; *p; p = &(*p)->hash_next) {
+        if (*p == idx) {
+            cache_disk_idx_drop(disk, p);
+            return;
+        }
+    }
+}
+
+static int cache_disk_idx_publish(cache_disk_t *disk, const cache_disk_rec_t *rec) {
+    cache_disk_idx_t **old = cache_disk_idx_find(disk, cache_disk_rec_key(rec), rec->key_len,
+                                                 rec->key_hash);
+    if (old) {
+        cache_disk_idx_drop(disk, old);
+    }
+    if (rec->rec_flags & CACHE_DISK_F_TOMBSTONE) {
+        return 0;
+    }
+
+    cache_disk_idx_t *idx = calloc(1, sizeof(*idx));
+    if (!idx) return -1;
+
+    idx->pos = rec->pos;
+    idx->key_hash = rec->key_hash;
+    idx->rec_len = (uint32_t)cache_disk_rec_len(rec);
+    idx->expires = (time_t)rec->expires;
+
+    cache_disk_idx_t **bucket = &disk->table[idx->key_hash & disk->mask];
+    idx->hash_next = *bucket;
+    *bucket = idx;
+
+    if (disk->fifo_tail) {
+        disk->fifo_tail->fifo_next = idx;
+    } else {
+        disk->fifo_head = idx;
+    }
+    disk->fifo_tail = idx;
+    disk->count++;
+    return 0;
+}
+
+/* Forget what the head is about to overwrite */
+static void cache_disk_idx_prune(cache_disk_t *disk, uint64_t head) {
+    while (disk->fifo_head && !cache_disk_pos_live(disk, disk->fifo_head->pos, head)) {
+        cache_disk_idx_t *idx = disk->fifo_head;
+        disk->fifo_head = idx->fifo_next;
+        if (!disk->fifo_head) {
+            disk->fifo_tail = NULL;
+        }
+        if (idx->rec_len) {
+            cache_disk_idx_unhash(disk, idx);
+        }
+        free(idx);
+    }
+}
+
+static void cache_disk_format(cache_disk_t *disk) {
+    cache_disk_super_t *super = (cache_disk_super_t*)disk->map;
+
+    memset(super, 0, sizeof(*super));
+    super->magic = CACHE_DISK_MAGIC;
+    super->version = CACHE_DISK_VERSION;
+    super->size = disk->size;
+    super->max_record = disk->max_record;
+    msync(disk->map, CACHE_DISK_SUPER, MS_SYNC);
+}
+
+typedef struct cache_disk_scan {
+    uint64_t pos;
+    uint64_t off;
+} cache_disk_scan_t;
+
+static int cache_disk_scan_cmp(const void *a, const void *b) {
+    uint64_t pa = ((const cache_disk_scan_t*)a)->pos;
+    uint64_t pb = ((const cache_disk_scan_t*)b)->pos;
+    return (pa > pb) - (pa < pb);
+}
+
+/*
+ * Rebuild the index from the record headers. Records hop from one to the
+ * next; where a header is missing (a tail left by the last lap, the gap
+ * before the wrap) the scan resyncs on the alignment, and a stretch longer
+ * than one record means nothing was ever written past it.
+ */
+static int cache_disk_rebuild(cache_disk_t *disk) {
+    const cache_disk_super_t *super = (const cache_disk_super_t*)disk->map;
+    size_t n = 0, cap = 1024;
+    cache_disk_scan_t *found = malloc(cap * sizeof(*found));
+    if (!found) return -1;
+
+    uint64_t head = super->purge_pos;
+    uint64_t off = 0, gap = 0;
+
+    while (off + sizeof(cache_disk_rec_t) <= disk->size && gap <= disk->max_record) {
+        const cache_disk_rec_t *rec = (const cache_disk_rec_t*)(disk->ring + off);
+
+        if (!cache_disk_rec_valid(disk, rec, off)) {
+            off += CACHE_DISK_ALIGN;
+            gap += CACHE_DISK_ALIGN;
+            continue;
+        }
+
+        if (n == cap) {
+            cache_disk_scan_t *grown = realloc(found, 2 * cap * sizeof(*found));
+            if (!grown) {
+                free(found);
+                return -1;
+            }
+            found = grown;
+            cap *= 2;
+        }
+        found[n].pos = rec->pos;
+        found[n].off = off;
+        n++;
+
+        uint64_t len = cache_disk_rec_len(rec);
+        if (rec->pos + len > head) {
+            head = rec->pos + len;
+        }
+        off += len;
+        gap = 0;
+    }
+
+    qsort(found, n, sizeof(*found), cache_disk_scan_cmp);
+
+    time_t now = time(NULL);
+    for (size_t i = 0; i < n; i++) {
+        const cache_disk_rec_t *rec = (const cache_disk_rec_t*)(disk->ring + found[i].off);
+
+        if (rec->pos < super->purge_pos || !cache_disk_pos_live(disk, rec->pos, head)) {
+            continue;
+        }
+        if (!(rec->rec_flags & CACHE_DISK_F_TOMBSTONE) && rec->expires <= now) {
+            /* Expired, but it still shadows anything older under its key */
+            cache_disk_idx_t **old = cache_disk_idx_find(disk, cache_disk_rec_key(rec), rec->key_len,
+                                                         rec->key_hash);
+            if (old) {
+                cache_disk_idx_drop(disk, old);
+            }
+            continue;
+        }
+        if (cache_disk_idx_publish(disk, rec) < 0) {
+            free(found);
+            return -1;
+        }
+    }
+
+    free(found);
+    atomic_store(&disk->head, head);
+
+    log_info("Cache disk '%s': %lu records scanned, %lu objects indexed",
+             disk->path, (unsigned long)n, (unsigned long)disk->count);
+    return 0;
+}
+
+cache_disk_t* cache_disk_open(const char *path, uint64_t size, uint32_t max_object_size) {
+    uint64_t max_record = DISK_ALIGN_UP(sizeof(cache_disk_rec_t) + 3 * (uint64_t)UINT16_MAX +
+                                        max_object_size);
+
+    size &= ~(uint64_t)(CACHE_DISK_ALIGN - 1);
+    if (size < 16 * max_record || max_record > UINT32_MAX) {
+        log_error("Cache disk '%s': %lu bytes cannot hold objects of %u bytes",
+                  path, (unsigned long)size, max_object_size);
+        return NULL;
+    }
+
+    cache_disk_t *disk = calloc(1, sizeof(*disk));
+    if (!disk) return NULL;
+
+    disk->path = strdup(path);
+    disk->size = size;
+    disk->guard = size / 16;
+    disk->max_record = (uint32_t)max_record;
+    disk->fd = -1;
+    pthread_mutex_init(&disk->lock, NULL);
+    pthread_mutex_init(&disk->write_lock, NULL);
+
+    uint64_t buckets = 1024;
+    while (buckets < size / CACHE_DISK_AVG_OBJECT) {
+        buckets <<= 1;
+    }
+    disk->mask = (uint32_t)(buckets - 1);
+    disk->table = calloc(buckets, sizeof(*disk->table));
+    if (!disk->path || !disk->table) {
+        cache_disk_close(disk);
+        return NULL;
+    }
+
+    disk->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (disk->fd < 0) {
+        log_error("Cache disk '%s': open failed: %s", path, strerror(errno));
+        cache_disk_close(disk);
+        return NULL;
+    }
+
+    struct stat st;
+    uint64_t total = CACHE_DISK_SUPER + size;
+    bool fresh = fstat(disk->fd, &st) < 0 || (uint64_t)st.st_size != total;
+    if (fresh && (ftruncate(disk->fd, 0) < 0 || ftruncate(disk->fd, (off_t)total) < 0)) {
+        log_error("Cache disk '%s': cannot size to %lu bytes: %s",
+                  path, (unsigned long)total, strerror(errno));
+        cache_disk_close(disk);
+        return NULL;
+    }
+
+    disk->map = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, disk->fd, 0);
+    if (disk->map == MAP_FAILED) {
+        disk->map = NULL;
+        log_error("Cache disk '%s': mmap failed: %s", path, strerror(errno));
+        cache_disk_close(disk);
+        return NULL;
+    }
+    disk->ring = disk->map + CACHE_DISK_SUPER;
+    /* Lookups jump around the file; don't read ahead of them */
+    madvise(disk->ring, size, MADV_RANDOM);
+
+    const cache_disk_super_t *super = (const cache_disk_super_t*)disk->map;
+    if (fresh || super->magic != CACHE_DISK_MAGIC || super->version != CACHE_DISK_VERSION ||
+        super->size != size || super->max_record != disk->max_record) {
+        if (!fresh) {
+            log_warning("Cache disk '%s': layout changed, reformatting", path);
+            ftruncate(disk->fd, 0);
+            ftruncate(disk->fd, (off_t)total);
+        }
+        cache_disk_format(disk);
+    } else if (cache_disk_rebuild(disk) < 0) {
+        cache_disk_close(disk);
+        return NULL;
+    }
+
+    log_info("Cache disk '%s' opened: size=%luMB, max_object=%uKB",
+             path, (unsigned long)(size >> 20), max_object_size / 1024);
+
+    return disk;
+}
+
+void cache_disk_close(cache_disk_t *disk) {
+    if (!disk) return;
+
+    cache_disk_idx_t *idx = disk->fifo_head;
+    while (idx) {
+        cache_disk_idx_t *next = idx->fifo_next;
+        free(idx);
+        idx = next;
+    }
+
+    if (disk->map) {
+        munmap(disk->map, CACHE_DISK_SUPER + disk->size);
+    }
+    if (disk->fd >= 0) {
+        close(disk->fd);
+    }
+
+    pthread_mutex_destroy(&disk->lock);
+    pthread_mutex_destroy(&disk->write_lock);
+    free(disk->table);
+    free(disk->path);
+    free(disk);
+}
+
+/*
+ * Claim len bytes at the head, skipping the tail of the ring when the
+ * record would not fit before its end. The head moves before any byte is
+ * written, so readers already holding a record see it go. Caller holds
+ * write_lock.
+ */
+static uint64_t cache_disk_reserve(cache_disk_t *disk, uint64_t len) {
+    uint64_t pos = atomic_load(&disk->head);
+    uint64_t off = pos % disk->size;
+
+    if (off + len > disk->size) {
+        pos += disk->size - off;
+    }
+
+    pthread_mutex_lock(&disk->lock);
+    atomic_store(&disk->head, pos + len);
+    cache_disk_idx_prune(disk, pos + len);
+    pthread_mutex_unlock(&disk->lock);
+
+    return pos;
+}
+
+static int cache_disk_write(cache_disk_t *disk, const cache_disk_rec_t *hdr,
+                            const char *key, const char *etag, const char *vary,
+                            const char *body) {
+    uint64_t len = cache_disk_rec_len(hdr);
+    if (len > disk->max_record) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&disk->write_lock);
+
+    cache_disk_rec_t rec = *hdr;
+    rec.magic = CACHE_DISK_MAGIC;
+    rec.pos = cache_disk_reserve(disk, len);
+    rec.crc = cache_disk_rec_crc(&rec);
+
+    cache_disk_rec_t *dst = cache_disk_rec_at(disk, rec.pos);
+    char *p = (char*)(dst + 1);
+    memcpy(p, key, rec.key_len);
+    p += rec.key_len;
+    if (rec.etag_len) memcpy(p, etag, rec.etag_len);
+    p += rec.etag_len;
+    if (rec.vary_len) memcpy(p, vary, rec.vary_len);
+    p += rec.vary_len;
+    if (rec.data_len) memcpy(p, body, rec.data_len);
+
+    /* Header last: a record is only found once all of it is in place */
+    atomic_thread_fence(memory_order_release);
+    memcpy(dst, &rec, sizeof(rec));
+
+    pthread_mutex_lock(&disk->lock);
+    int ret = cache_disk_idx_publish(disk, dst);
+    pthread_mutex_unlock(&disk->lock);
+
+    pthread_mutex_unlock(&disk->write_lock);
+
+    atomic_fetch_add_explicit(&disk->stats.bytes_in, len, memory_order_relaxed);
+    return ret;
+}
+
+int cache_disk_store(cache_disk_t *disk, const cache_entry_t *entry) {
+    size_t key_len = entry->key_len;
+    size_t etag_len = entry->etag ? strlen(entry->etag) : 0;
+    size_t vary_len = entry->vary ? strlen(entry->vary) : 0;
+
+    if (key_len > UINT16_MAX || etag_len > UINT16_MAX || vary_len > UINT16_MAX) {
+        return -1;
+    }
+
+    cache_disk_rec_t rec = {
+        .data_len = entry->data.len,
+        .created = entry->created,
+        .expires = entry->expires,
+        .last_modified = entry->last_modified,
+        .key_hash = (uint32_t)entry->key_hash,
+        .flags = entry->flags & ~CACHE_F_ON_DISK,
+        .status = entry->response.status,
+        .key_len = (uint16_t)key_len,
+        .etag_len = (uint16_t)etag_len,
+        .vary_len = (uint16_t)vary_len,
+    };
+
+    if (cache_disk_write(disk, &rec, entry->key, entry->etag, entry->vary, entry->data.ptr) < 0) {
+        return -1;
+    }
+
+    atomic_fetch_add_explicit(&disk->stats.stores, 1, memory_order_relaxed);
+    return 0;
+}
+
+int cache_disk_delete(cache_disk_t *disk, const char *key, size_t key_len, uint32_t hash) {
+    if (key_len > UINT16_MAX) return -1;
+
+    pthread_mutex_lock(&disk->lock);
+    cache_disk_idx_t **p = cache_disk_idx_find(disk, key, key_len, hash);
+    if (p) {
+        cache_disk_idx_drop(disk, p);
+    }
+    pthread_mutex_unlock(&disk->lock);
+
+    if (!p) return 0;
+
+    /* The tombstone keeps the old record from coming back on restart */
+    cache_disk_rec_t rec = {
+        .key_hash = hash,
+        .rec_flags = CACHE_DISK_F_TOMBSTONE,
+        .key_len = (uint16_t)key_len,
+    };
+    return cache_disk_write(disk, &rec, key, NULL, NULL, NULL);
+}
+
+void cache_disk_purge(cache_disk_t *disk) {
+    cache_disk_super_t *super = (cache_disk_super_t*)disk->map;
+
+    pthread_mutex_lock(&disk->write_lock);
+    pthread_mutex_lock(&disk->lock);
+
+    for (uint32_t i = 0; i <= disk->mask; i++) {
+        while (disk->table[i]) {
+            cache_disk_idx_drop(disk, &disk->table[i]);
+        }
+    }
+
+    super->purge_pos = atomic_load(&disk->head);
+    msync(disk->map, CACHE_DISK_SUPER, MS_SYNC);
+
+    pthread_mutex_unlock(&disk->lock);
+    pthread_mutex_unlock(&disk->write_lock);
+}
+
+int cache_disk_lookup(cache_disk_t *disk, const char *key, size_t key_len, uint32_t hash,
+                      cache_disk_obj_t *obj) {
+    pthread_mutex_lock(&disk->lock);
+
+    cache_disk_idx_t **p = cache_disk_idx_find(disk, key, key_len, hash);
+    cache_disk_idx_t *idx = p ? *p : NULL;
+
+    if (idx && (idx->expires <= time(NULL) ||
+                !cache_disk_pos_live(disk, idx->pos, atomic_load(&disk->head)))) {
+        cache_disk_idx_drop(disk, p);
+        idx = NULL;
+    }
+
+    if (!idx) {
+        pthread_mutex_unlock(&disk->lock);
+        atomic_fetch_add_explicit(&disk->stats.misses, 1, memory_order_relaxed);
+        return -1;
+    }
+
+    const cache_disk_rec_t *rec = cache_disk_rec_at(disk, idx->pos);
+    obj->pos = idx->pos;
+    obj->rec = rec;
+    obj->body = cache_disk_rec_body(rec);
+    obj->body_off = (off_t)(CACHE_DISK_SUPER + (obj->body - disk->ring));
+    obj->len = rec->data_len;
+
+    pthread_mutex_unlock(&disk->lock);
+    atomic_fetch_add_explicit(&disk->stats.hits, 1, memory_order_relaxed);
+    return 0;
+}
+
+/* Lookup without touching the stats, for demotion */
+bool cache_disk_contains(cache_disk_t *disk, const char *key, size_t key_len, uint32_t hash) {
+    pthread_mutex_lock(&disk->lock);
+    bool found = cache_disk_idx_find(disk, key, key_len, hash) != NULL;
+    pthread_mutex_unlock(&disk->lock);
+    return found;
+}
+
+cache_entry_t* cache_disk_load(cache_disk_t *disk, const cache_disk_obj_t *obj) {
+    const cache_disk_rec_t *rec = obj->rec;
+    const char *etag = cache_disk_rec_key(rec) + rec->key_len;
+    const char *vary = etag + rec->etag_len;
+
+    cache_entry_t *entry = calloc(1, sizeof(*entry));
+    if (!entry) return NULL;
+
+    entry->data.ptr = malloc(obj->len ? obj->len : 1);
+    entry->etag = rec->etag_len ? strndup(etag, rec->etag_len) : NULL;
+    entry->vary = rec->vary_len ? strndup(vary, rec->vary_len) : NULL;
+    if (entry->data.ptr) {
+        memcpy(entry->data.ptr, obj->body, obj->len);
+    }
+
+    entry->data.len = entry->data.alloc = obj->len;
+    entry->size = (uint32_t)obj->len;
+    entry->created = (time_t)rec->created;
+    entry->expires = (time_t)rec->expires;
+    entry->last_modified = (time_t)rec->last_modified;
+    entry->flags = rec->flags;
+    entry->response.status = rec->status;
+
+    if (!entry->data.ptr || (rec->etag_len && !entry->etag) || (rec->vary_len && !entry->vary) ||
+        !cache_disk_intact(disk, obj)) {
+        if (entry->data.ptr && !cache_disk_intact(disk, obj)) {
+            atomic_fetch_add_explicit(&disk->stats.overwritten, 1, memory_order_relaxed);
+        }
+        free(entry->data.ptr);
+        free(entry->etag);
+        free(entry->vary);
+        free(entry);
+        return NULL;
+    }
+
+    atomic_fetch_add_explicit(&disk->stats.bytes_out, obj->len, memory_order_relaxed);
+    return entry;
+}
+
+int cache_disk_sendfile(cache_disk_t *disk, const cache_disk_obj_t *obj, int out_fd, uint64_t *sent) {
+    while (*sent < obj->len) {
+        off_t off = obj->body_off + (off_t)*sent;
+        ssize_t n = sendfile(out_fd, disk->fd, &off, obj->len - *sent);
+
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            return -1;
+        }
+
+        *sent += (uint64_t)n;
+        atomic_fetch_add_explicit(&disk->stats.bytes_out, (uint64_t)n, memory_order_relaxed);
+    }
+
+    /* Whatever went out must not have been overwritten under us */
+    if (!cache_disk_intact(disk, obj)) {
+        atomic_fetch_add_explicit(&disk->stats.overwritten, 1, memory_order_relaxed);
+        return -1;
+    }
+
+    return *sent == obj->len ? 1 : 0;
+}
@@ -3,6 +3,7 @@
 #include "health/health.h"
 #include "acl/acl.h"
 #include "http/http.h"
+#include "ssl/ssl.h"
 #include "utils/log.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -48,6 +49,14 @@ static int parse_global(const char **args, int line) {
         global.tune.maxrewrite = atoi(args[1]);
     } else if (strcmp(args[0], "ssl-default-bind-ciphers") == 0) {
         global.ssl_default_bind_ciphers = strdup(args[1]);
+    } else if (strcmp(args[0], "ssl-engine") == 0) {
+        global.ssl_engine = strdup(args[1]);
+        if (ssl_init_single_engine(args[1]) < 0) {
+            log_error("Cannot load SSL engine '%s' at line %d", args[1], line);
+            return -1;
+        }
+    } else if (strcmp(args[0], "ssl-mode-async") == 0) {
+        global.ssl_mode_async = 1;
     } else {
         log_warning("Unknown global directive '%s' at line %d", args[0], line);
     }
@@ -147,6 +156,8 @@ static int parse_frontend(const char **args, int line) {
                 l->ssl_cert = strdup(args[++i]);
             } else if (strcmp(args[i], "alpn") == 0) {
                 l->alpn_str = strdup(args[++i]);
+            } else if (strcmp(args[i], "ktls") == 0) {
+                l->options |= LI_O_KTLS;
             }
         }
 
@@ -197,11 +208,21 @@ static int parse_backend(const char **args, int line) {
             current_proxy->lb_algo = LB_ALGO_URI;
         } else if (strcmp(args[1], "url_param") == 0) {
             current_proxy->lb_algo = LB_ALGO_URL_PARAM;
-        } else if (strcmp(args[1], "hdr") == 0) {
+        } else if (strncmp(args[1], "hdr(", 4) == 0) {
             current_proxy->lb_algo = LB_ALGO_HDR;
+            current_proxy->lb_arg = strndup(args[1] + 4, strcspn(args[1] + 4, ")"));
         } else if (strcmp(args[1], "random") == 0) {
             current_proxy->lb_algo = LB_ALGO_RANDOM;
         }
+        if (current_proxy->lb_algo == LB_ALGO_URL_PARAM && args[2]) {
+            current_proxy->lb_arg = strdup(args[2]);
+        }
+    } else if (strcmp(args[0], "hash-balance-factor") == 0) {
+        current_proxy->hash_balance_factor = args[1] ? atoi(args[1]) : 0;
+        if (current_proxy->hash_balance_factor && current_proxy->hash_balance_factor < 100) {
+            log_warning("hash-balance-factor below 100 at line %d, using 100", line);
+            current_proxy->hash_balance_factor = 100;
+        }
     } else if (strcmp(args[0], "server") == 0) {
         server_t *srv = server_new(args[1]);
         if (!srv) {
@@ -252,6 +273,7 @@ static int parse_backend(const char **args, int line) {
             }
         }
 
+        srv->proxy = current_proxy;
         srv->next = current_proxy->servers;
         current_proxy->servers = srv;
 
@@ -627,11 +649,19 @@ static int parse_yaml_backend(yaml_document_t *doc, yaml_node_t *node, const cha
                 (*px)->lb_algo = LB_ALGO_URI;
             } else if (strcmp(algo, "url_param") == 0) {
                 (*px)->lb_algo = LB_ALGO_URL_PARAM;
-            } else if (strcmp(algo, "hdr") == 0) {
+            } else if (strncmp(algo, "hdr(", 4) == 0) {
                 (*px)->lb_algo = LB_ALGO_HDR;
+                (*px)->lb_arg = strndup(algo + 4, strcspn(algo + 4, ")"));
             } else if (strcmp(algo, "random") == 0) {
                 (*px)->lb_algo = LB_ALGO_RANDOM;
             }
+        } else if (strcmp(key_str, "balance_param") == 0) {
+            (*px)->lb_arg = strdup((const char *)value->data.scalar.value);
+        } else if (strcmp(key_str, "hash_balance_factor") == 0) {
+            (*px)->hash_balance_factor = atoi((const char *)value->data.scalar.value);
+            if ((*px)->hash_balance_factor && (*px)->hash_balance_factor < 100) {
+                (*px)->hash_balance_factor = 100;
+            }
         } else if (strcmp(key_str, "servers") == 0 && value->type == YAML_SEQUENCE_NODE) {
             for (yaml_node_item_t *item = value->data.sequence.items.start;
                  item < value->data.sequence.items.top; item++) {
@@ -684,6 +714,7 @@ static int parse_yaml_backend(yaml_document_t *doc, yaml_node_t *node, const cha
                             srv->check->server = srv;
                         }
 
+                        srv->proxy = *px;
                         srv->next = (*px)->servers;
                         (*px)->servers = srv;
 
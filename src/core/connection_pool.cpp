@@ -8,14 +8,21 @@
 
 namespace ultrabalancer {
 
-Connection::Connection(int fd, const sockaddr_storage& addr)
-    : fd_(fd), addr_(addr), alive_(true), last_used_(std::chrono::steady_clock::now()) {
+// Assigned on first use and never reused; ConnectionPool::kThreadCaches caps them
+static std::atomic<size_t> next_thread_index{0};
+static thread_local size_t thread_index = next_thread_index.fetch_add(1, std::memory_order_relaxed);
+
+Connection::Connection(int fd, const sockaddr_storage& addr, LivenessWatcher* watcher)
+    : fd_(fd), addr_(addr), alive_(true), last_used_(std::chrono::steady_clock::now()),
+      watcher_(watcher), watch_slot_(LivenessWatcher::kNoSlot) {
     int flag = 1;
     setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
     setsockopt(fd_, SOL_SOCKET, SO_KEEPALIVE, &flag, sizeof(flag));
+    if (watcher_) watch_slot_ = watcher_->watch(fd_);
 }
 
 Connection::~Connection() {
+    if (watch_slot_ != LivenessWatcher::kNoSlot) watcher_->unwatch(watch_slot_);
     if (fd_ >= 0) {
         close(fd_);
     }
@@ -24,6 +31,7 @@ Connection::~Connection() {
 bool Connection::is_alive() const {
     // check atomic flag first before syscall
     if (!alive_.load(std::memory_order_acquire)) return false;
+    if (watch_slot_ != LivenessWatcher::kNoSlot) return watcher_->alive(watch_slot_);
 
     char buf;
     int ret = recv(fd_, &buf, 1, MSG_PEEK | MSG_DONTWAIT);
@@ -41,41 +49,107 @@ void Connection::reset() {
     alive_.store(true, std::memory_order_release);
 }
 
-ConnectionPool::ConnectionPool(size_t max_size, size_t max_idle)
-    : max_size_(max_size), max_idle_(max_idle), active_(0) {}
+ConnectionPool::ConnectionPool(size_t max_size, size_t max_idle, size_t min_idle)
+    : max_size_(max_size), max_idle_(max_idle), min_idle_(std::min(min_idle, max_idle)), active_(0),
+      thread_caches_(std::make_unique<ThreadCache[]>(kThreadCaches)),
+      watcher_([this] { sweep_dead(); }) {}
 
 ConnectionPool::~ConnectionPool() {
+    {
+        std::lock_guard<std::mutex> lock(maintain_mutex_);
+        stopping_ = true;
+    }
+    maintain_cv_.notify_all();
+    if (maintainer_.joinable()) maintainer_.join();
+    watcher_.stop();
     cleanup_idle(std::chrono::seconds(0)); // idle connection cleanup 
+
+    for (auto& [fd, conn] : lent_) {
+        delete conn;
+    }
+}
+
+ConnectionPool::ThreadCache* ConnectionPool::thread_cache() {
+    return thread_index < kThreadCaches ? &thread_caches_[thread_index] : nullptr;
+}
+
+Connection* ConnectionPool::pop_cached(ThreadCache* cache, const server_t* server) {
+    std::lock_guard<std::mutex> lock(cache->lock);
+    Connection** link = &cache->head;
+
+    while (Connection* conn = *link) {
+        if (conn->server_ != server) {
+            link = &conn->idle_next_;
+            continue;
+        }
+
+        *link = conn->idle_next_;
+        conn->idle_next_ = nullptr;
+        cache->count--;
+        idle_count_.fetch_sub(1, std::memory_order_relaxed);
+        if (conn->is_alive()) return conn;
+
+        // Flagged after the last sweep; rare enough to close here
+        delete conn;
+    }
+    return nullptr;
+}
+
+// With mutex_ held
+Connection* ConnectionPool::pop_shared(const server_t* server) {
+    auto it = idle_lists_.find(ServerKey{server->hostname ? server->hostname : "", server->port});
+    if (it == idle_lists_.end()) return nullptr;
+
+    // Newest first: the most likely to be warm, and the watcher has flagged
+    // any the backend has closed
+    while (Connection* conn = it->second.head) {
+        unlink(&it->second, conn);
+        if (conn->is_alive()) return conn;
+        delete conn;
+    }
+    return nullptr;
+}
+
+// With mutex_ held; newest at the head
+void ConnectionPool::push_shared(IdleList* list, Connection* conn) {
+    conn->idle_prev_ = nullptr;
+    conn->idle_next_ = list->head;
+    if (list->head) list->head->idle_prev_ = conn;
+    else list->tail = conn;
+    list->head = conn;
+    list->count++;
+    idle_count_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void ConnectionPool::unlink(IdleList* list, Connection* conn) {
+    if (conn->idle_prev_) conn->idle_prev_->idle_next_ = conn->idle_next_;
+    else list->head = conn->idle_next_;
+    if (conn->idle_next_) conn->idle_next_->idle_prev_ = conn->idle_prev_;
+    else list->tail = conn->idle_prev_;
+
+    conn->idle_prev_ = conn->idle_next_ = nullptr;
+    list->count--;
+    idle_count_.fetch_sub(1, std::memory_order_relaxed);
 }
 
-std::shared_ptr<Connection> ConnectionPool::acquire(const server_t* server) {
-    ServerKey key{server->hostname ? server->hostname : "", server->port};
+std::unique_ptr<Connection> ConnectionPool::acquire(const server_t* server) {
+    // Own cache first: no lock and no syscall
+    if (ThreadCache* cache = thread_cache()) {
+        if (Connection* conn = pop_cached(cache, server)) {
+            active_.fetch_add(1, std::memory_order_relaxed);
+            conn->reset();
+            return std::unique_ptr<Connection>(conn);
+        }
+    }
 
-    // Try to acquire from idle queue with minimal lock time
+    IdleList* home;
     {
         std::unique_lock<std::mutex> lock(mutex_);
 
-        auto it = idle_queue_.find(key);
-        if (it != idle_queue_.end()) {
-            auto& queue = it->second;
-
-            // Search for a live connection in the queue
-            while (!queue.empty()) {
-                auto conn = queue.front();
-                queue.pop();
-
-                // Check liveness without holding the lock for syscall
-                lock.unlock();
-                bool alive = conn->is_alive();
-                lock.lock();
-
-                if (alive) {
-                    active_.fetch_add(1, std::memory_order_relaxed);
-                    conn->reset();
-                    return conn;
-                }
-                // Dead connection - let it be destroyed
-            }
+        if (Connection* conn = pop_shared(server)) {
+            active_.fetch_add(1, std::memory_order_relaxed);
+            conn->reset();
+            return std::unique_ptr<Connection>(conn);
         }
 
         // No idle connection available - check if we can create new one
@@ -88,6 +162,7 @@ std::shared_ptr<Connection> ConnectionPool::acquire(const server_t* server) {
         }
 
         active_.fetch_add(1, std::memory_order_relaxed);
+        home = &idle_lists_[ServerKey{server->hostname ? server->hostname : "", server->port}];
     }
 
     // Create connection outside of lock to avoid blocking other threads
@@ -96,72 +171,212 @@ std::shared_ptr<Connection> ConnectionPool::acquire(const server_t* server) {
         // Failed to create - decrement active counter
         active_.fetch_sub(1, std::memory_order_relaxed);
         cv_.notify_one();
+        return nullptr;
     }
+    conn->server_ = server;
+    conn->home_ = home;
     return conn;
 }
 
-void ConnectionPool::release(std::shared_ptr<Connection> conn) {
+void ConnectionPool::release(std::unique_ptr<Connection> conn) {
     if (!conn) return;
 
     // Decrement active counter immediately using atomic operation
     active_.fetch_sub(1, std::memory_order_relaxed);
 
-    // Check if connection is still alive before returning to pool
-    if (!conn->is_alive()) {
+    // The flag the watcher keeps, not a syscall
+    if (!conn->is_alive() || !conn->home_) {
         cv_.notify_one();
         return;
     }
 
     conn->reset();
 
-    // Determine the server key for this connection
-    // We need to find which queue this connection belongs to
-    std::lock_guard<std::mutex> lock(mutex_);
-
-    // Simple heuristic: add to first queue that has space
-    // In production, we'd want to track the original server key
-    for (auto& [key, queue] : idle_queue_) {
-        if (queue.size() < max_idle_) {
-            queue.push(conn);
+    if (ThreadCache* cache = thread_cache()) {
+        std::unique_lock<std::mutex> lock(cache->lock);
+        if (cache->count < kThreadCacheSize) {
+            conn->idle_next_ = cache->head;
+            cache->head = conn.release();
+            cache->count++;
+            idle_count_.fetch_add(1, std::memory_order_relaxed);
+            lock.unlock();
             cv_.notify_one();
             return;
         }
     }
 
-    // If all queues are full, connection is dropped (destructor handles cleanup)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        IdleList* list = conn->home_;
+        if (list->count < max_idle_) {
+            push_shared(list, conn.release());
+        }
+    }
+
+    // If the server's list is full, the connection is dropped here
     cv_.notify_one();
 }
 
-void ConnectionPool::set_health_check(std::function<bool(Connection*)> checker) {
-    health_checker_ = checker;
+int ConnectionPool::acquire_fd(const server_t* server) {
+    auto conn = acquire(server);
+    if (!conn) return -1;
+
+    int fd = conn->get_fd();
+    std::lock_guard<std::mutex> lock(mutex_);
+    lent_[fd] = conn.release();
+    return fd;
 }
 
-void ConnectionPool::cleanup_idle(std::chrono::seconds idle_timeout) {
+void ConnectionPool::release_fd(int fd) {
+    std::unique_ptr<Connection> conn;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = lent_.find(fd);
+        if (it == lent_.end()) return;
+        conn.reset(it->second);
+        lent_.erase(it);
+    }
+    release(std::move(conn));
+}
+
+void ConnectionPool::warm(const server_t* server) {
+    if (min_idle_ == 0) return;
+
     std::lock_guard<std::mutex> lock(mutex_);
-    auto now = std::chrono::steady_clock::now();
+    for (const Warmed& w : warmed_) {
+        if (w.server == server) return;
+    }
+
+    IdleList* list = &idle_lists_[ServerKey{server->hostname ? server->hostname : "", server->port}];
+    warmed_.push_back(Warmed{server, list, false});
+    if (!maintainer_.joinable()) {
+        maintainer_ = std::thread([this] { maintain(); });
+    }
+}
+
+void ConnectionPool::maintain_server(const server_t* server, IdleList* list, bool& up) {
+    bool running = server->cur_state == SRV_RUNNING;
+
+    // Whatever was open to a server that went down is not trusted after
+    if (up && !running) {
+        delete_chain(unlink_if([list](const Connection* conn) { return conn->home_ == list; }));
+    }
+    up = running;
+    if (!up) return;
+
+    for (uint32_t i = 0; i < kWarmBatch; i++) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (list->count >= min_idle_) return;
+        }
+
+        // Tried again next interval if the server does not take it
+        auto conn = create_connection(server);
+        if (!conn) return;
+        conn->server_ = server;
+        conn->home_ = list;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (list->count >= max_idle_) return;
+        push_shared(list, conn.release());
+    }
+}
+
+void ConnectionPool::maintain() {
+    std::vector<Warmed> servers;
+
+    std::unique_lock<std::mutex> lock(maintain_mutex_);
+    while (!stopping_) {
+        lock.unlock();
+
+        {
+            std::lock_guard<std::mutex> guard(mutex_);
+            servers = warmed_;
+        }
+        for (Warmed& w : servers) {
+            maintain_server(w.server, w.list, w.up);
+        }
+        {
+            // Only this thread writes up, and warm() only appends
+            std::lock_guard<std::mutex> guard(mutex_);
+            for (size_t i = 0; i < servers.size(); i++) warmed_[i].up = servers[i].up;
+        }
 
-    for (auto& [key, queue] : idle_queue_) {
-        std::queue<std::shared_ptr<Connection>> new_queue;
+        lock.lock();
+        maintain_cv_.wait_for(lock, kMaintainInterval, [this] { return stopping_; });
+    }
+}
 
-        while (!queue.empty()) {
-            auto conn = queue.front();
-            queue.pop();
+void ConnectionPool::set_health_check(std::function<bool(Connection*)> checker) {
+    health_checker_ = checker;
+}
 
-            auto idle_time = std::chrono::duration_cast<std::chrono::seconds>(
-                now - conn->last_used());
+// Detaches every idle connection pred picks, as a chain through idle_next_
+template<typename Pred>
+Connection* ConnectionPool::unlink_if(Pred pred) {
+    Connection* chain = nullptr;
+
+    for (size_t i = 0; i < kThreadCaches; i++) {
+        ThreadCache& cache = thread_caches_[i];
+        std::lock_guard<std::mutex> lock(cache.lock);
+
+        Connection** link = &cache.head;
+        while (Connection* conn = *link) {
+            if (pred(conn)) {
+                *link = conn->idle_next_;
+                cache.count--;
+                idle_count_.fetch_sub(1, std::memory_order_relaxed);
+                conn->idle_next_ = chain;
+                chain = conn;
+            } else {
+                link = &conn->idle_next_;
+            }
+        }
+    }
 
-            if (idle_time < idle_timeout && conn->is_alive()) {
-                new_queue.push(conn);
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& [key, list] : idle_lists_) {
+        Connection* conn = list.head;
+        while (conn) {
+            Connection* next = conn->idle_next_;
+            if (pred(conn)) {
+                unlink(&list, conn);
+                conn->idle_next_ = chain;
+                chain = conn;
             }
+            conn = next;
         }
+    }
+    return chain;
+}
 
-        queue = std::move(new_queue);
+void ConnectionPool::delete_chain(Connection* chain) {
+    while (chain) {
+        Connection* next = chain->idle_next_;
+        delete chain;
+        chain = next;
     }
+}
+
+// Called by the watcher thread after it flags a hangup
+void ConnectionPool::sweep_dead() {
+    // Closed outside the locks
+    delete_chain(unlink_if([](const Connection* conn) { return !conn->is_alive(); }));
+}
+
+void ConnectionPool::cleanup_idle(std::chrono::seconds idle_timeout) {
+    auto now = std::chrono::steady_clock::now();
+    delete_chain(unlink_if([&](const Connection* conn) {
+        auto idle_time = std::chrono::duration_cast<std::chrono::seconds>(
+            now - conn->last_used());
+        return idle_time >= idle_timeout || !conn->is_alive();
+    }));
 
     cv_.notify_all();
 }
 
-std::shared_ptr<Connection> ConnectionPool::create_connection(const server_t* server) {
+std::unique_ptr<Connection> ConnectionPool::create_connection(const server_t* server) {
     int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
     if (fd < 0) return nullptr;
 
@@ -173,7 +388,7 @@ std::shared_ptr<Connection> ConnectionPool::create_connection(const server_t* se
         }
     }
 
-    return std::make_shared<Connection>(fd, server->addr);
+    return std::make_unique<Connection>(fd, server->addr, &watcher_);
 }
 
 ConnectionManager& ConnectionManager::instance() {
@@ -213,11 +428,12 @@ void destroy_connection_pool(void* pool) {
 
 int acquire_connection(void* pool, struct server* srv) {
     auto cpp_pool = static_cast<ultrabalancer::ConnectionPool*>(pool);
-    auto conn = cpp_pool->acquire(srv);
-    return conn ? conn->get_fd() : -1;
+    return cpp_pool->acquire_fd(srv);
 }
 
 void release_connection(void* pool, int fd) {
+    auto cpp_pool = static_cast<ultrabalancer::ConnectionPool*>(pool);
+    cpp_pool->release_fd(fd);
 }
 
 size_t get_pool_active_connections(void* pool) {
@@ -1,4 +1,5 @@
 #include "core/loadbalancer.h"
+#include "health/health.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,11 +8,13 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <math.h>
 
 #define likely(x)   __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
@@ -33,11 +36,20 @@ loadbalancer_t* lb_create(uint16_t port, lb_algorithm_t algorithm) {
     lb->config.keepalive_timeout_ms = 60000;
     lb->config.health_check_interval_ms = 5000;
     lb->config.max_connections = MAX_CONNECTIONS;
+    lb->config.write_high_water = WRITE_HIGH_WATER;
+    lb->config.dns_ttl_ms = DNS_TTL_MS;
+    lb->config.upstream_idle_timeout_ms = UPSTREAM_IDLE_TIMEOUT_MS;
     lb->config.health_check_fail_threshold = 3;
+    lb->config.health_check_type = HCHK_TYPE_HTTP;
+    lb->config.outlier_consecutive_failures = LB_OUTLIER_FAILURES;
+    lb->config.outlier_base_eject_ms = LB_OUTLIER_BASE_EJECT_MS;
+    lb->config.outlier_max_eject_percent = LB_OUTLIER_MAX_EJECT_PCT;
     lb->config.tcp_nodelay = true;
     lb->config.so_reuseport = true;
     lb->config.defer_accept = true;
     lb->config.health_check_enabled = true;
+    lb->config.queue_max = LB_QUEUE_MAX;
+    lb->config.queue_timeout_ms = LB_QUEUE_TIMEOUT_MS;
 
     lb->epfd = epoll_create1(EPOLL_CLOEXEC);
     if (lb->epfd < 0) {
@@ -45,25 +57,15 @@ loadbalancer_t* lb_create(uint16_t port, lb_algorithm_t algorithm) {
         return NULL;
     }
 
-    size_t pool_size = 1024 * 1024 * 1024;
-    lb->memory_pool = mmap(NULL, pool_size, PROT_READ | PROT_WRITE,
-                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
-    if (lb->memory_pool == MAP_FAILED) {
+    // Reserved only: workers carve node-local arenas of their own, this one
+    // serves the other threads and commits what they touch
+    lb->memory_pool = memory_pool_create(1024 * 1024 * 1024);
+    if (!lb->memory_pool) {
         close(lb->epfd);
         free(lb);
         return NULL;
     }
 
-    if (madvise(lb->memory_pool, pool_size, MADV_HUGEPAGE) == -1) {
-        madvise(lb->memory_pool, pool_size, MADV_SEQUENTIAL);
-    }
-
-    memory_pool_t* pool = (memory_pool_t*)lb->memory_pool;
-    pool->base = (char*)lb->memory_pool + sizeof(memory_pool_t);
-    pool->size = pool_size - sizeof(memory_pool_t);
-    pool->used = 0;
-    pthread_spin_init(&pool->lock, PTHREAD_PROCESS_PRIVATE);
-
     return lb;
 }
 
@@ -79,12 +81,11 @@ void lb_destroy(loadbalancer_t* lb) {
         }
     }
 
-    if (lb->memory_pool && lb->memory_pool != MAP_FAILED) {
-        munmap(lb->memory_pool, 1024 * 1024 * 1024);
-    }
+    memory_pool_destroy((memory_pool_t*)lb->memory_pool);
 
     if (lb->epfd >= 0) close(lb->epfd);
     pthread_spin_destroy(&lb->conn_pool_lock);
+    lb_snapshot_free(lb);
 
     free(lb->workers);
     free(lb);
@@ -104,11 +105,122 @@ int lb_add_backend(loadbalancer_t* lb, const char* host, uint16_t port, uint32_t
 
     pthread_spin_init(&backend->lock, PTHREAD_PROCESS_PRIVATE);
 
-    lb->backends[lb->backend_count++] = backend;
+    // A failed first lookup is retried by the resolver thread
+    lb_resolver_add_backend(lb, backend);
+
+    backend->id = lb->backend_count;
+    lb->backends[backend->id] = backend;
+    // A reload adds backends while the health checker and stats walk the
+    // array: the slot is filled before the count covers it
+    atomic_thread_fence(memory_order_release);
+    lb->backend_count = backend->id + 1;
+    lb_backends_changed(lb);
 
     return 0;
 }
 
+backend_t* lb_find_backend(loadbalancer_t* lb, const char* host, uint16_t port) {
+    for (uint32_t i = 0; i < lb->backend_count; i++) {
+        backend_t* b = lb->backends[i];
+        if (b && b->port == port && strcmp(b->host, host) == 0) return b;
+    }
+    return NULL;
+}
+
+int lb_backend_drain(loadbalancer_t* lb, backend_t* backend, uint32_t reason) {
+    backend_state_t state = atomic_load(&backend->state);
+    atomic_fetch_or(&backend->drain_reasons, reason);
+    do {
+        if (state == BACKEND_MAINT) {
+            atomic_fetch_and(&backend->drain_reasons, ~reason);
+            return -1;
+        }
+        if (state == BACKEND_DRAIN) return 0;
+    } while (!atomic_compare_exchange_weak(&backend->state, &state, BACKEND_DRAIN));
+
+    atomic_store(&backend->drained, false);
+    atomic_store(&backend->drain_since_ns, get_time_ns());
+    printf("[DRAIN] Backend %s:%u draining, %u active connections\n",
+           backend->host, backend->port, atomic_load(&backend->active_conns));
+    lb_backends_changed(lb);
+    return 0;
+}
+
+int lb_backend_undrain(loadbalancer_t* lb, backend_t* backend, uint32_t reason) {
+    if (atomic_fetch_and(&backend->drain_reasons, ~reason) & ~reason) return -1;
+
+    backend_state_t state = BACKEND_DRAIN;
+    if (!atomic_compare_exchange_strong(&backend->state, &state, BACKEND_UP)) return -1;
+
+    // The health checker takes it down again if it did not come back
+    atomic_store(&backend->drain_since_ns, 0);
+    printf("[DRAIN] Backend %s:%u back in rotation\n", backend->host, backend->port);
+    lb_backend_slow_start(lb, backend);
+    lb_backends_changed(lb);
+    return 0;
+}
+
+// Backends are never freed while running: their ids key the per-worker
+// counters and connections may still point at them. Removal drains the
+// backend for good instead.
+int lb_remove_backend(loadbalancer_t* lb, const char* host, uint16_t port) {
+    backend_t* backend = lb_find_backend(lb, host, port);
+    if (!backend) return -1;
+    return lb_backend_drain(lb, backend, LB_DRAIN_REMOVED);
+}
+
+// Apply config.drain_file when it changed: listed backends drain, ones it
+// drained that are no longer listed come back unless something else drains
+// them too. Gone or unreadable, nothing is listed.
+static void lb_drain_file_poll(loadbalancer_t* lb) {
+    static struct timespec seen;
+    static bool present;
+
+    struct stat st;
+    bool exists = stat(lb->config.drain_file, &st) == 0;
+    if (exists == present && (!exists || (st.st_mtim.tv_sec == seen.tv_sec &&
+                                          st.st_mtim.tv_nsec == seen.tv_nsec))) {
+        return;
+    }
+    present = exists;
+    if (exists) seen = st.st_mtim;
+
+    bool listed[MAX_BACKENDS] = { false };
+    FILE* f = exists ? fopen(lb->config.drain_file, "r") : NULL;
+    char line[320];
+    while (f && fgets(line, sizeof(line), f)) {
+        char host[256];
+        unsigned port;
+        if (line[0] == '#' || sscanf(line, " %255[^:]:%u", host, &port) != 2) continue;
+        backend_t* b = lb_find_backend(lb, host, (uint16_t)port);
+        if (b) listed[b->id] = true;
+    }
+    if (f) fclose(f);
+
+    for (uint32_t i = 0; i < lb->backend_count; i++) {
+        backend_t* b = lb->backends[i];
+        if (!b) continue;
+        if (listed[i]) lb_backend_drain(lb, b, LB_DRAIN_FILE);
+        else if (atomic_load(&b->drain_reasons) & LB_DRAIN_FILE) lb_backend_undrain(lb, b, LB_DRAIN_FILE);
+    }
+}
+
+void lb_drain_sweep(loadbalancer_t* lb) {
+    if (lb->config.drain_file) lb_drain_file_poll(lb);
+
+    uint64_t now = get_time_ns();
+    for (uint32_t i = 0; i < lb->backend_count; i++) {
+        backend_t* b = lb->backends[i];
+        if (!b || atomic_load(&b->state) != BACKEND_DRAIN || atomic_load(&b->drained)) continue;
+        if (atomic_load(&b->active_conns) != 0) continue;
+
+        atomic_store(&b->drained, true);
+        printf("[DRAIN] Backend %s:%u drained after %.1fs\n", b->host, b->port,
+               (now - atomic_load(&b->drain_since_ns)) / 1e9);
+        fflush(stdout);
+    }
+}
+
 int create_listen_socket(uint16_t port, bool reuseport) {
     int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (sockfd < 0) return -1;
@@ -155,33 +267,435 @@ int create_listen_socket(uint16_t port, bool reuseport) {
     return sockfd;
 }
 
+// Per-thread xorshift64*; selection must not contend on a shared state
+static __thread uint64_t lb_rng_state;
+
+static inline uint32_t lb_rand(void) {
+    uint64_t x = lb_rng_state;
+    if (unlikely(x == 0)) x = get_time_ns() ^ (uintptr_t)&lb_rng_state ^ 0x9e3779b97f4a7c15ULL;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    lb_rng_state = x;
+    return (uint32_t)((x * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+void lb_backend_observe(backend_t* backend, uint64_t latency_ns) {
+    uint64_t now = get_time_ns();
+    uint64_t old = atomic_load_explicit(&backend->ewma_ns, memory_order_relaxed);
+    uint64_t stamp = atomic_load_explicit(&backend->ewma_stamp_ns, memory_order_relaxed);
+    uint64_t ewma;
+
+    // Peak-sensitive: a slower sample replaces the average outright, faster
+    // ones pull it down with a weight that grows with the time since the
+    // last sample. Racing updates lose a sample, which is harmless here.
+    if (old == 0 || latency_ns >= old) {
+        ewma = latency_ns;
+    } else {
+        double w = exp(-(double)(now - stamp) / (double)LB_EWMA_DECAY_NS);
+        ewma = (uint64_t)(old * w + latency_ns * (1.0 - w));
+    }
+    if (ewma == 0) ewma = 1;
+
+    atomic_store_explicit(&backend->ewma_ns, ewma, memory_order_relaxed);
+    atomic_store_explicit(&backend->ewma_stamp_ns, now, memory_order_relaxed);
+
+    // 1/16 weight per sample
+    uint64_t avg = atomic_load_explicit(&backend->latency_avg_ns, memory_order_relaxed);
+    avg = avg ? avg - avg / 16 + latency_ns / 16 : latency_ns;
+    atomic_store_explicit(&backend->latency_avg_ns, avg, memory_order_relaxed);
+}
+
+// Average latency when it reflects current traffic: sampled within the
+// decay constant and after the backend's last ejection ended; 0 otherwise
+static uint64_t lb_outlier_latency(backend_t* b, uint64_t now) {
+    uint64_t stamp = atomic_load_explicit(&b->ewma_stamp_ns, memory_order_relaxed);
+    if (now - stamp > LB_EWMA_DECAY_NS) return 0;
+    if (stamp <= atomic_load_explicit(&b->ejected_until_ns, memory_order_relaxed)) return 0;
+    return atomic_load_explicit(&b->latency_avg_ns, memory_order_relaxed);
+}
+
+static bool lb_backend_eject(loadbalancer_t* lb, backend_t* b, uint64_t now, const char* why) {
+    // The selection snapshot must keep at least one backend
+    const lb_snapshot_t* snap = atomic_load_explicit(&lb->snapshot, memory_order_acquire);
+    if (!snap || snap->count <= 1) return false;
+
+    uint32_t cap = lb->backend_count * lb->config.outlier_max_eject_percent / 100;
+    if (cap == 0) cap = 1;
+    uint32_t out = atomic_load(&lb->ejected_count);
+    do {
+        if (out >= cap) return false;
+    } while (!atomic_compare_exchange_weak(&lb->ejected_count, &out, out + 1));
+
+    bool expected = false;
+    if (!atomic_compare_exchange_strong(&b->ejected, &expected, true)) {
+        atomic_fetch_sub(&lb->ejected_count, 1);
+        return false;
+    }
+
+    uint32_t k = atomic_fetch_add(&b->ejections, 1);
+    uint64_t ms = (uint64_t)lb->config.outlier_base_eject_ms << (k < 16 ? k : 16);
+    if (ms > LB_OUTLIER_MAX_EJECT_MS) ms = LB_OUTLIER_MAX_EJECT_MS;
+    atomic_store(&b->ejected_until_ns, now + ms * 1000000ULL);
+    atomic_store(&b->consecutive_failures, 0);
+
+    printf("[OUTLIER] Backend %s:%u ejected for %lums: %s\n", b->host, b->port, ms, why);
+    lb_backends_changed(lb);
+    return true;
+}
+
+void lb_backend_report(loadbalancer_t* lb, backend_t* backend, lb_outcome_t outcome) {
+    // Success is the common case: leave the cache line alone unless a
+    // failure streak has to end
+    if (outcome == LB_OUTCOME_OK) {
+        if (atomic_load_explicit(&backend->consecutive_failures, memory_order_relaxed)) {
+            atomic_store_explicit(&backend->consecutive_failures, 0, memory_order_relaxed);
+        }
+        return;
+    }
+
+    uint32_t limit = lb->config.outlier_consecutive_failures;
+    uint32_t fails = atomic_fetch_add_explicit(&backend->consecutive_failures, 1,
+                                               memory_order_relaxed) + 1;
+    if (limit == 0 || fails < limit || atomic_load(&backend->ejected)) return;
+
+    static const char* const why[] = {
+        [LB_OUTCOME_CONNECT_FAIL] = "connect failures",
+        [LB_OUTCOME_RESET] = "connection resets",
+        [LB_OUTCOME_5XX] = "5xx responses",
+    };
+    lb_backend_eject(lb, backend, get_time_ns(), why[outcome]);
+}
+
+static int lb_u64_cmp(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+void lb_outlier_sweep(loadbalancer_t* lb) {
+    uint64_t now = get_time_ns();
+    uint64_t forgive_ns = LB_OUTLIER_MAX_EJECT_MS * 1000000ULL;
+    bool changed = false;
+
+    for (uint32_t i = 0; i < lb->backend_count; i++) {
+        backend_t* b = lb->backends[i];
+        if (!b) continue;
+
+        uint64_t until = atomic_load(&b->ejected_until_ns);
+        if (atomic_load(&b->ejected)) {
+            if (now < until) continue;
+            atomic_store(&b->consecutive_failures, 0);
+            atomic_store(&b->ejected, false);
+            atomic_fetch_sub(&lb->ejected_count, 1);
+            lb_backend_slow_start(lb, b);
+            printf("[OUTLIER] Backend %s:%u back in rotation\n", b->host, b->port);
+            changed = true;
+        } else if (atomic_load(&b->ejections) && now - until > forgive_ns) {
+            atomic_store(&b->ejections, 0);
+        }
+    }
+    if (changed) lb_backends_changed(lb);
+
+    if (lb->config.outlier_consecutive_failures == 0) return;
+
+    // Latency outliers among the backends in rotation, judged only on
+    // samples taken since their last return
+    const lb_snapshot_t* snap = atomic_load_explicit(&lb->snapshot, memory_order_acquire);
+    if (!snap || snap->count < LB_OUTLIER_MIN_HOSTS) return;
+
+    uint64_t lat[MAX_BACKENDS];
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < snap->count; i++) {
+        uint64_t v = lb_outlier_latency(snap->backends[i], now);
+        if (v) lat[n++] = v;
+    }
+    if (n < LB_OUTLIER_MIN_HOSTS) return;
+
+    qsort(lat, n, sizeof(lat[0]), lb_u64_cmp);
+    uint64_t limit = lat[n / 2] * LB_OUTLIER_LATENCY_FACTOR;
+    if (limit < LB_OUTLIER_LATENCY_MIN_NS) limit = LB_OUTLIER_LATENCY_MIN_NS;
+
+    for (uint32_t i = 0; i < snap->count; i++) {
+        backend_t* b = snap->backends[i];
+        if (lb_outlier_latency(b, now) > limit && !lb_backend_eject(lb, b, now, "latency outlier")) break;
+    }
+}
+
+// Expected wait on b: latency times the requests already queued on it. An
+// average older than the decay constant says little about the backend now,
+// so it counts as unknown and the backend gets probed again.
+static inline uint64_t lb_p2c_cost(backend_t* b, uint64_t now) {
+    uint64_t ewma = atomic_load_explicit(&b->ewma_ns, memory_order_relaxed);
+    uint64_t stamp = atomic_load_explicit(&b->ewma_stamp_ns, memory_order_relaxed);
+    if (ewma == 0 || now - stamp > LB_EWMA_DECAY_NS) ewma = LB_EWMA_INITIAL_NS;
+    return ewma * (atomic_load_explicit(&b->active_conns, memory_order_relaxed) + 1);
+}
+
+static backend_t* lb_select_p2c(const lb_snapshot_t* snap) {
+    uint32_t n = snap->count;
+    if (n == 1) return snap->backends[0];
+
+    uint32_t i = lb_rand() % n;
+    uint32_t j = (i + 1 + lb_rand() % (n - 1)) % n;
+    uint64_t now = get_time_ns();
+    uint64_t ca = lb_p2c_cost(snap->backends[i], now);
+    uint64_t cb = lb_p2c_cost(snap->backends[j], now);
+    if (snap->ramping) {
+        ca = ca * LB_RAMP_FULL / snap->ramp[i];
+        cb = cb * LB_RAMP_FULL / snap->ramp[j];
+    }
+    return cb < ca ? snap->backends[j] : snap->backends[i];
+}
+
+static pthread_mutex_t lb_snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Share of LB_RAMP_FULL that b is ready for at now
+static uint32_t lb_backend_ramp(const loadbalancer_t* lb, backend_t* b, uint64_t now) {
+    uint64_t since = atomic_load_explicit(&b->up_since_ns, memory_order_relaxed);
+    uint64_t window = lb->config.slow_start_ms * 1000000ULL;
+    if (since == 0 || window == 0 || now - since >= window) return LB_RAMP_FULL;
+
+    double p = (double)(now - since) / (double)window;
+    double lo = (double)LB_SLOW_START_MIN_RAMP / LB_RAMP_FULL;
+    double f = lb->config.slow_start_exponential ? lo * pow(1.0 / lo, p) : lo + (1.0 - lo) * p;
+    uint32_t r = (uint32_t)(f * LB_RAMP_FULL);
+    if (r < LB_SLOW_START_MIN_RAMP) r = LB_SLOW_START_MIN_RAMP;
+    return r < LB_RAMP_FULL ? r : LB_RAMP_FULL - 1;
+}
+
+// Call before lb_backends_changed() when backend comes into rotation
+void lb_backend_slow_start(loadbalancer_t* lb, backend_t* backend) {
+    if (lb->config.slow_start_ms == 0) return;
+    atomic_store_explicit(&backend->ramp, LB_SLOW_START_MIN_RAMP, memory_order_relaxed);
+    atomic_store_explicit(&backend->up_since_ns, get_time_ns(), memory_order_relaxed);
+}
+
+void lb_slow_start_sweep(loadbalancer_t* lb) {
+    if (lb->config.slow_start_ms == 0) return;
+
+    uint64_t now = get_time_ns();
+    bool stale = false;
+
+    for (uint32_t i = 0; i < lb->backend_count; i++) {
+        backend_t* b = lb->backends[i];
+        if (!b || atomic_load_explicit(&b->up_since_ns, memory_order_relaxed) == 0) continue;
+        // Only what is in rotation has a ramp in the snapshot
+        if (atomic_load(&b->state) != BACKEND_UP || atomic_load(&b->ejected)) continue;
+
+        uint32_t r = lb_backend_ramp(lb, b, now);
+        uint32_t used = atomic_load_explicit(&b->ramp, memory_order_relaxed);
+        if (r == LB_RAMP_FULL) {
+            atomic_store_explicit(&b->up_since_ns, 0, memory_order_relaxed);
+            if (used != LB_RAMP_FULL) stale = true;
+        } else if ((uint64_t)r * 100 >= (uint64_t)used * (100 + LB_SLOW_START_STEP_PCT)) {
+            stale = true;
+        }
+    }
+    if (stale) lb_backends_changed(lb);
+}
+
+static uint32_t lb_gcd(uint32_t a, uint32_t b) {
+    while (b) {
+        uint32_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+static lb_snapshot_t* lb_snapshot_build(loadbalancer_t* lb) {
+    backend_t* members[MAX_BACKENDS];
+    uint32_t weight[MAX_BACKENDS];
+    uint32_t slots[MAX_BACKENDS];
+    int64_t credit[MAX_BACKENDS];
+    uint32_t n = 0;
+    uint32_t g = 0;
+    uint64_t total = 0;
+    uint64_t len = 0;
+
+    uint32_t ramp[MAX_BACKENDS];
+    uint32_t ramping = 0;
+    uint64_t now = get_time_ns();
+
+    for (uint32_t i = 0; i < lb->backend_count; i++) {
+        backend_t* b = lb->backends[i];
+        if (!b || atomic_load(&b->state) != BACKEND_UP || atomic_load(&b->ejected)) continue;
+        uint32_t w = atomic_load(&b->weight);
+        if (w == 0) continue;
+        uint32_t r = lb_backend_ramp(lb, b, now);
+        atomic_store_explicit(&b->ramp, r, memory_order_relaxed);
+        if (r < LB_RAMP_FULL) {
+            uint64_t scaled = (uint64_t)w * r / LB_RAMP_FULL;
+            w = scaled ? (uint32_t)scaled : 1;
+            ramping++;
+        }
+        members[n] = b;
+        ramp[n] = r;
+        weight[n] = w;
+        total += w;
+        g = lb_gcd(g, w);
+        n++;
+    }
+    if (n == 0) return NULL;
+
+    // The round-robin cycle runs on weights reduced by their GCD and, when
+    // that is still too long, scaled down
+    for (uint32_t i = 0; i < n; i++) {
+        slots[i] = weight[i] / g;
+        len += slots[i];
+    }
+    if (len > LB_WRR_MAX_SLOTS) {
+        uint64_t scaled = 0;
+        for (uint32_t i = 0; i < n; i++) {
+            uint64_t w = (uint64_t)slots[i] * LB_WRR_MAX_SLOTS / len;
+            slots[i] = w ? (uint32_t)w : 1;
+            scaled += slots[i];
+        }
+        len = scaled;
+    }
+
+    lb_snapshot_t* snap = malloc(sizeof(lb_snapshot_t) + n * sizeof(backend_t*) +
+                                 n * sizeof(uint64_t) + len * sizeof(backend_t*) +
+                                 n * sizeof(uint32_t));
+    if (!snap) return NULL;
+    snap->count = n;
+    snap->wrr_len = (uint32_t)len;
+    snap->ramping = ramping;
+    snap->total_weight = total;
+    snap->retired_at = 0;
+    snap->retired_next = NULL;
+    snap->backends = (backend_t**)(snap + 1);
+    snap->cum_weight = (uint64_t*)(snap->backends + n);
+    snap->wrr = (backend_t**)(snap->cum_weight + n);
+    snap->ramp = (uint32_t*)(snap->wrr + len);
+
+    uint64_t sum = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        snap->backends[i] = members[i];
+        snap->ramp[i] = ramp[i];
+        sum += weight[i];
+        snap->cum_weight[i] = sum;
+    }
+
+    // Off the hot path, so the O(len * n) walk is fine and keeps the order
+    // exactly nginx's
+    memset(credit, 0, n * sizeof(credit[0]));
+    for (uint32_t s = 0; s < snap->wrr_len; s++) {
+        uint32_t best = 0;
+        for (uint32_t i = 0; i < n; i++) {
+            credit[i] += slots[i];
+            if (credit[i] > credit[best]) best = i;
+        }
+        credit[best] -= (int64_t)len;
+        snap->wrr[s] = members[best];
+    }
+
+    return snap;
+}
+
+// Free the retired snapshots past their grace; lb_snapshot_lock held
+static void lb_snapshot_reap(loadbalancer_t* lb, time_t now) {
+    lb_snapshot_t** pp = &lb->snapshot_retired;
+    while (*pp) {
+        lb_snapshot_t* r = *pp;
+        if (now - r->retired_at >= LB_SNAPSHOT_GRACE) {
+            *pp = r->retired_next;
+            free(r);
+        } else {
+            pp = &r->retired_next;
+        }
+    }
+}
+
+void lb_backends_changed(loadbalancer_t* lb) {
+    pthread_mutex_lock(&lb_snapshot_lock);
+
+    lb_snapshot_t* snap = lb_snapshot_build(lb);
+    lb_snapshot_t* old = atomic_exchange_explicit(&lb->snapshot, snap, memory_order_acq_rel);
+    time_t now = time(NULL);
+    if (old) {
+        old->retired_at = now;
+        old->retired_next = lb->snapshot_retired;
+        lb->snapshot_retired = old;
+    }
+    lb_snapshot_reap(lb, now);
+
+    pthread_mutex_unlock(&lb_snapshot_lock);
+}
+
+void lb_snapshot_reclaim(loadbalancer_t* lb) {
+    pthread_mutex_lock(&lb_snapshot_lock);
+    lb_snapshot_reap(lb, time(NULL));
+    pthread_mutex_unlock(&lb_snapshot_lock);
+}
+
+void lb_snapshot_free(loadbalancer_t* lb) {
+    free(atomic_exchange(&lb->snapshot, NULL));
+    while (lb->snapshot_retired) {
+        lb_snapshot_t* r = lb->snapshot_retired;
+        lb->snapshot_retired = r->retired_next;
+        free(r);
+    }
+}
+
+// Each thread walks the shared cycle with its own cursor, started at a
+// random point so that workers do not move through it in step
+static __thread uint32_t lb_wrr_pos;
+
+static backend_t* lb_select_wrr(const lb_snapshot_t* snap) {
+    if (unlikely(lb_wrr_pos == 0)) lb_wrr_pos = lb_rand();
+    return snap->wrr[lb_wrr_pos++ % snap->wrr_len];
+}
+
+// Weighted random: the first backend whose running weight sum passes r
+static backend_t* lb_select_weighted(const lb_snapshot_t* snap) {
+    uint64_t r = (((uint64_t)lb_rand() << 32) | lb_rand()) % snap->total_weight;
+    uint32_t lo = 0, hi = snap->count - 1;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (snap->cum_weight[mid] > r) hi = mid;
+        else lo = mid + 1;
+    }
+    return snap->backends[lo];
+}
+
+// For the algorithms that do not go by weight: starting from entry i, the
+// first backend that takes the pick; one still ramping up takes its share
+static inline backend_t* lb_ramp_admit(const lb_snapshot_t* snap, uint32_t i) {
+    for (uint32_t k = 1; snap->ramping && k < snap->count; k++) {
+        if (snap->ramp[i] >= LB_RAMP_FULL || lb_rand() % LB_RAMP_FULL < snap->ramp[i]) break;
+        i = (i + 1) % snap->count;
+    }
+    return snap->backends[i];
+}
+
 backend_t* lb_select_backend(loadbalancer_t* lb, struct sockaddr_in* client_addr) {
+    const lb_snapshot_t* snap = atomic_load_explicit(&lb->snapshot, memory_order_acquire);
+    if (!snap) return NULL;
+
+    uint32_t n = snap->count;
     backend_t* selected = NULL;
-    uint32_t min_conns = UINT32_MAX;
 
     switch (lb->algorithm) {
         case LB_ALGO_ROUNDROBIN: {
-            uint32_t attempts = 0;
-            while (attempts < lb->backend_count) {
-                uint32_t idx = atomic_fetch_add(&lb->round_robin_idx, 1) % lb->backend_count;
-                backend_t* b = lb->backends[idx];
-                if (b && atomic_load(&b->state) == BACKEND_UP) {
-                    return b;
-                }
-                attempts++;
-            }
-            break;
+            uint32_t idx = atomic_fetch_add_explicit(&lb->round_robin_idx, 1, memory_order_relaxed);
+            return lb_ramp_admit(snap, idx % n);
         }
 
+        case LB_ALGO_STATIC_RR:
+            return lb_select_wrr(snap);
+
         case LB_ALGO_LEASTCONN: {
-            for (uint32_t i = 0; i < lb->backend_count; i++) {
-                backend_t* b = lb->backends[i];
-                if (b && atomic_load(&b->state) == BACKEND_UP) {
-                    uint32_t conns = atomic_load(&b->active_conns);
-                    if (conns < min_conns) {
-                        min_conns = conns;
-                        selected = b;
-                    }
+            // A ramping backend counts its connections as that many more
+            uint64_t min_load = UINT64_MAX;
+            for (uint32_t i = 0; i < n; i++) {
+                backend_t* b = snap->backends[i];
+                uint64_t load = atomic_load_explicit(&b->active_conns, memory_order_relaxed) + 1;
+                if (snap->ramping) load = load * LB_RAMP_FULL / snap->ramp[i];
+                if (load < min_load) {
+                    min_load = load;
+                    selected = b;
                 }
             }
             break;
@@ -192,64 +706,82 @@ backend_t* lb_select_backend(loadbalancer_t* lb, struct sockaddr_in* client_addr
             hash = ((hash >> 16) ^ hash) * 0x45d9f3b;
             hash = ((hash >> 16) ^ hash) * 0x45d9f3b;
             hash = (hash >> 16) ^ hash;
-
-            uint32_t idx = hash % lb->backend_count;
-            for (uint32_t i = 0; i < lb->backend_count; i++) {
-                uint32_t try_idx = (idx + i) % lb->backend_count;
-                backend_t* b = lb->backends[try_idx];
-                if (b && atomic_load(&b->state) == BACKEND_UP) {
-                    return b;
-                }
-            }
-            break;
+            return lb_ramp_admit(snap, hash % n);
         }
 
-        case LB_ALGO_STICKY: {
-            uint32_t total_weight = 0;
-            for (uint32_t i = 0; i < lb->backend_count; i++) {
-                backend_t* b = lb->backends[i];
-                if (b && atomic_load(&b->state) == BACKEND_UP) {
-                    total_weight += atomic_load(&b->weight);
-                }
-            }
-
-            if (total_weight == 0) break;
-
-            uint32_t random_weight = (rand() % total_weight) + 1;
-            uint32_t current_weight = 0;
-
-            for (uint32_t i = 0; i < lb->backend_count; i++) {
-                backend_t* b = lb->backends[i];
-                if (b && atomic_load(&b->state) == BACKEND_UP) {
-                    current_weight += atomic_load(&b->weight);
-                    if (random_weight <= current_weight) {
-                        return b;
-                    }
-                }
-            }
-            break;
-        }
+        case LB_ALGO_STICKY:
+            return lb_select_weighted(snap);
 
         case LB_ALGO_RANDOM: {
             uint64_t min_response_time = UINT64_MAX;
-            for (uint32_t i = 0; i < lb->backend_count; i++) {
-                backend_t* b = lb->backends[i];
-                if (b && atomic_load(&b->state) == BACKEND_UP) {
-                    uint64_t rt = atomic_load(&b->response_time_ns);
-                    uint32_t conns = atomic_load(&b->active_conns);
-                    uint64_t score = rt * (conns + 1);
-                    if (score < min_response_time) {
-                        min_response_time = score;
-                        selected = b;
-                    }
+            for (uint32_t i = 0; i < n; i++) {
+                backend_t* b = snap->backends[i];
+                uint64_t rt = atomic_load_explicit(&b->response_time_ns, memory_order_relaxed);
+                uint32_t conns = atomic_load_explicit(&b->active_conns, memory_order_relaxed);
+                uint64_t score = rt * (conns + 1);
+                if (snap->ramping) score = score * LB_RAMP_FULL / snap->ramp[i];
+                if (score < min_response_time) {
+                    min_response_time = score;
+                    selected = b;
                 }
             }
             break;
         }
 
+        case LB_ALGO_P2C:
+            return lb_select_p2c(snap);
+
         default:
             break;
     }
 
     return selected;
-}
\ No newline at end of file
+}
+
+bool lb_backend_acquire(loadbalancer_t* lb, backend_t* backend) {
+    uint32_t group = lb->config.group_maxconn;
+    if (atomic_fetch_add(&lb->active_conns, 1) >= group && group) {
+        atomic_fetch_sub(&lb->active_conns, 1);
+        return false;
+    }
+
+    uint32_t limit = atomic_load_explicit(&backend->max_conns, memory_order_relaxed);
+    if (limit == 0) limit = lb->config.server_maxconn;
+    if (limit == 0) {
+        atomic_fetch_add(&backend->active_conns, 1);
+        return true;
+    }
+
+    uint32_t cur = atomic_load_explicit(&backend->active_conns, memory_order_relaxed);
+    do {
+        if (cur >= limit) {
+            atomic_fetch_sub(&lb->active_conns, 1);
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak(&backend->active_conns, &cur, cur + 1));
+    return true;
+}
+
+void lb_backend_release(loadbalancer_t* lb, backend_t* backend) {
+    atomic_fetch_sub(&backend->active_conns, 1);
+    atomic_fetch_sub(&lb->active_conns, 1);
+}
+
+backend_t* lb_backend_admit(loadbalancer_t* lb, struct sockaddr_in* client_addr, bool* full) {
+    *full = false;
+    backend_t* picked = lb_select_backend(lb, client_addr);
+    if (!picked || lb_backend_acquire(lb, picked)) return picked;
+
+    // Past the pool's limit no backend will do
+    uint32_t group = lb->config.group_maxconn;
+    const lb_snapshot_t* snap = atomic_load_explicit(&lb->snapshot, memory_order_acquire);
+    if (snap && !(group && atomic_load(&lb->active_conns) >= group)) {
+        uint32_t first = lb_rand() % snap->count;
+        for (uint32_t i = 0; i < snap->count; i++) {
+            backend_t* b = snap->backends[(first + i) % snap->count];
+            if (b != picked && lb_backend_acquire(lb, b)) return b;
+        }
+    }
+    *full = true;
+    return NULL;
+}
@@ -0,0 +1,89 @@
+#include "core/lb_numa.h"
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define LB_MPOL_PREFERRED 1  // <numaif.h> comes with libnuma
+
+typedef struct {
+    lb_cpu_slot_t slot;
+    uint16_t thread;  // 0 for the first hyperthread of its core
+} lb_cpu_rank_t;
+
+static int lb_numa_cpu_node(int cpu) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR* dir = opendir(path);
+    if (!dir) return 0;
+
+    int node = 0;
+    struct dirent* e;
+    while ((e = readdir(dir))) {
+        if (strncmp(e->d_name, "node", 4) == 0 && e->d_name[4] >= '0' && e->d_name[4] <= '9') {
+            node = atoi(e->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node < LB_NUMA_MAX_NODES ? node : 0;
+}
+
+// thread_siblings_list starts with the core's first hyperthread
+static int lb_numa_cpu_thread(int cpu) {
+    char path[96];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+    FILE* f = fopen(path, "r");
+    if (!f) return 0;
+
+    int first = cpu;
+    if (fscanf(f, "%d", &first) != 1) first = cpu;
+    fclose(f);
+    return first == cpu ? 0 : 1;
+}
+
+static int lb_numa_rank_cmp(const void* a, const void* b) {
+    const lb_cpu_rank_t* x = a;
+    const lb_cpu_rank_t* y = b;
+    if (x->slot.node != y->slot.node) return (int)x->slot.node - (int)y->slot.node;
+    if (x->thread != y->thread) return (int)x->thread - (int)y->thread;
+    return (int)x->slot.cpu - (int)y->slot.cpu;
+}
+
+uint32_t lb_numa_cpus(lb_cpu_slot_t* slots, uint32_t max) {
+    cpu_set_t set;
+    uint32_t n = 0;
+
+    if (max > LB_NUMA_MAX_CPUS) max = LB_NUMA_MAX_CPUS;
+    lb_cpu_rank_t* ranks = malloc(max * sizeof(*ranks));
+
+    if (ranks && sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE && n < max; cpu++) {
+            if (!CPU_ISSET(cpu, &set)) continue;
+            ranks[n].slot.cpu = (uint16_t)cpu;
+            ranks[n].slot.node = (uint16_t)lb_numa_cpu_node(cpu);
+            ranks[n].thread = (uint16_t)lb_numa_cpu_thread(cpu);
+            n++;
+        }
+        qsort(ranks, n, sizeof(*ranks), lb_numa_rank_cmp);
+        for (uint32_t i = 0; i < n; i++) slots[i] = ranks[i].slot;
+    }
+    free(ranks);
+
+    if (n == 0 && max > 0) {
+        slots[0] = (lb_cpu_slot_t){ 0, 0 };
+        n = 1;
+    }
+    return n;
+}
+
+int lb_numa_prefer(void* addr, size_t len, int node) {
+    if (node < 0 || node >= LB_NUMA_MAX_NODES) return -1;
+
+    unsigned long mask = 1UL << node;
+    return syscall(SYS_mbind, addr, len, LB_MPOL_PREFERRED, &mask,
+                   (unsigned long)LB_NUMA_MAX_NODES + 1, 0) == 0 ? 0 : -1;
+}
@@ -0,0 +1,373 @@
+#include "core/lb_reload.h"
+#include "core/loadbalancer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#define LB_HANDOVER_MAGIC  0x55424844u  // "UBHD"
+
+typedef struct {
+    char host[256];
+    uint16_t port;
+    uint32_t weight;
+    uint32_t maxconn;
+} lb_reload_entry_t;
+
+// HOST:PORT[@WEIGHT][/MAXCONN], IPv6 literals bracketed; 1 when parsed, 0
+// for a blank or comment line, -1 when malformed
+static int lb_reload_parse_line(char* line, lb_reload_entry_t* e) {
+    char* p = line + strspn(line, " \t");
+    p[strcspn(p, "#\r\n")] = '\0';
+    char* end = p + strlen(p);
+    while (end > p && (end[-1] == ' ' || end[-1] == '\t')) *--end = '\0';
+    if (!*p) return 0;
+
+    char* host = p;
+    char* colon;
+    if (*p == '[') {
+        char* close = strchr(p, ']');
+        if (!close || close[1] != ':') return -1;
+        *close = '\0';
+        host = p + 1;
+        colon = close + 1;
+    } else {
+        colon = strrchr(p, ':');
+        if (!colon) return -1;
+    }
+    *colon = '\0';
+
+    char* tail;
+    unsigned long port = strtoul(colon + 1, &tail, 10);
+    if (port == 0 || port > 65535 || (*tail && *tail != '@' && *tail != '/')) return -1;
+
+    unsigned long weight = 1;
+    if (*tail == '@') {
+        weight = strtoul(tail + 1, &tail, 10);
+        if (weight == 0 || (*tail && *tail != '/')) return -1;
+    }
+    unsigned long maxconn = 0;
+    if (*tail == '/') {
+        maxconn = strtoul(tail + 1, &tail, 10);
+        if (maxconn == 0 || maxconn > UINT32_MAX || *tail) return -1;
+    }
+
+    if (!*host || strlen(host) >= sizeof(e->host)) return -1;
+    strcpy(e->host, host);
+    e->port = (uint16_t)port;
+    e->weight = (uint32_t)weight;
+    e->maxconn = (uint32_t)maxconn;
+    return 1;
+}
+
+int lb_reload_backends(loadbalancer_t* lb, const char* path) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "[RELOAD] %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    lb_reload_entry_t* entries = malloc(MAX_BACKENDS * sizeof(*entries));
+    if (!entries) {
+        fclose(f);
+        return -1;
+    }
+
+    // All of it parses before anything changes
+    uint32_t n = 0;
+    int line_num = 0;
+    char line[320];
+    while (fgets(line, sizeof(line), f)) {
+        line_num++;
+        if (n == MAX_BACKENDS) {
+            fprintf(stderr, "[RELOAD] %s: more than %d backends\n", path, MAX_BACKENDS);
+            goto fail;
+        }
+        int ret = lb_reload_parse_line(line, &entries[n]);
+        if (ret < 0) {
+            fprintf(stderr, "[RELOAD] %s:%d: expected HOST:PORT[@WEIGHT][/MAXCONN]\n",
+                    path, line_num);
+            goto fail;
+        }
+        n += ret;
+    }
+    fclose(f);
+    f = NULL;
+
+    bool listed[MAX_BACKENDS] = { false };
+    uint32_t added = 0, reweighted = 0, restored = 0, drained = 0;
+    bool changed = false;
+
+    for (uint32_t i = 0; i < n; i++) {
+        lb_reload_entry_t* e = &entries[i];
+        backend_t* b = lb_find_backend(lb, e->host, e->port);
+
+        if (!b) {
+            if (lb_add_backend(lb, e->host, e->port, e->weight) < 0) {
+                fprintf(stderr, "[RELOAD] Failed to add backend %s:%u\n", e->host, e->port);
+                continue;
+            }
+            b = lb->backends[lb->backend_count - 1];
+            // As main_lb_start does with the first ones; the health checker
+            // takes it down if it is not
+            if (lb->running) {
+                atomic_store(&b->state, BACKEND_UP);
+                lb_backend_slow_start(lb, b);
+            }
+            changed = true;
+            added++;
+        } else {
+            if (atomic_load(&b->weight) != e->weight) {
+                atomic_store(&b->weight, e->weight);
+                changed = true;
+                reweighted++;
+            }
+            if ((atomic_load(&b->drain_reasons) & LB_DRAIN_RELOAD) && !listed[b->id] &&
+                lb_backend_undrain(lb, b, LB_DRAIN_RELOAD) == 0) {
+                restored++;
+            }
+        }
+        // Takes effect with the next admission; nothing already on it is cut
+        atomic_store(&b->max_conns, e->maxconn);
+        listed[b->id] = true;
+    }
+
+    for (uint32_t i = 0; i < lb->backend_count; i++) {
+        backend_t* b = lb->backends[i];
+        if (!b || listed[i]) continue;
+        if (atomic_load(&b->drain_reasons) & LB_DRAIN_RELOAD) continue;
+        // Already draining for another reason, it now stays out for this one too
+        bool draining = atomic_load(&b->state) == BACKEND_DRAIN;
+        if (lb_backend_drain(lb, b, LB_DRAIN_RELOAD) == 0 && !draining) drained++;
+    }
+
+    if (changed) lb_backends_changed(lb);
+
+    printf("[RELOAD] %s: %u backends, %u added, %u reweighted, %u back, %u draining\n",
+           path, n, added, reweighted, restored, drained);
+    fflush(stdout);
+    free(entries);
+    return 0;
+
+fail:
+    if (f) fclose(f);
+    free(entries);
+    return -1;
+}
+
+void lb_stop_accepting(loadbalancer_t* lb) {
+    if (!atomic_exchange(&lb->accepting, false)) return;
+
+    // io_uring workers cancel their own accepts when they see the flag
+    for (uint32_t i = 0; lb->worker_ctx && i < lb->worker_threads; i++) {
+        lb_worker_t* w = &lb->worker_ctx[i];
+        if (w->owns_fds) epoll_ctl(w->epfd, EPOLL_CTL_DEL, w->listen_fd, NULL);
+    }
+    epoll_ctl(lb->epfd, EPOLL_CTL_DEL, lb->listen_fd, NULL);
+}
+
+static int lb_handover_addr(const char* path, struct sockaddr_un* addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+static void lb_handover_timeout(int fd, uint32_t ms) {
+    struct timeval tv = { .tv_sec = ms / 1000, .tv_usec = (ms % 1000) * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+int lb_handover_take(const char* path, int* fds, uint32_t max, int* conn) {
+    struct sockaddr_un addr;
+    if (lb_handover_addr(path, &addr) < 0) return -1;
+
+    int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (s < 0) return -1;
+    if (connect(s, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        int err = errno;
+        close(s);
+        // Nothing there, or what is left of a process gone
+        return (err == ENOENT || err == ECONNREFUSED) ? 0 : -1;
+    }
+    lb_handover_timeout(s, 5000);
+
+    uint32_t hdr[2];
+    struct iovec iov = { .iov_base = hdr, .iov_len = sizeof(hdr) };
+    union {
+        char buf[CMSG_SPACE(LB_HANDOVER_MAX_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf)
+    };
+
+    ssize_t len = recvmsg(s, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    uint32_t n = 0;
+    for (struct cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+        uint32_t count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (uint32_t i = 0; i < count; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+            if (n < max) fds[n++] = fd;
+            else close(fd);
+        }
+    }
+
+    if (len != (ssize_t)sizeof(hdr) || hdr[0] != LB_HANDOVER_MAGIC || n == 0 ||
+        (msg.msg_flags & MSG_CTRUNC)) {
+        for (uint32_t i = 0; i < n; i++) close(fds[i]);
+        close(s);
+        errno = EPROTO;
+        return -1;
+    }
+
+    *conn = s;
+    return (int)n;
+}
+
+int lb_handover_ack(int conn) {
+    char ack = 1;
+    int ret = write(conn, &ack, 1) == 1 ? 0 : -1;
+    close(conn);
+    return ret;
+}
+
+bool lb_handover_match(int fd, uint16_t port, bool reuseport) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (getsockname(fd, (struct sockaddr*)&addr, &len) < 0 || len != sizeof(addr) ||
+        addr.sin_family != AF_INET || addr.sin_addr.s_addr != htonl(INADDR_ANY) ||
+        addr.sin_port != htons(port)) {
+        return false;
+    }
+
+    int val = 0, listening = 0;
+    len = sizeof(val);
+    if (getsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, &len) < 0) return false;
+    len = sizeof(listening);
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) < 0 || !listening) return false;
+    return (val != 0) == reuseport;
+}
+
+typedef struct {
+    loadbalancer_t* lb;
+    int fd;
+} lb_handover_server_t;
+
+// The socket every worker accepts on: lb->listen_fd first, then those the
+// workers own in reuseport mode
+static uint32_t lb_handover_fds(loadbalancer_t* lb, int* fds) {
+    uint32_t n = 0;
+    fds[n++] = lb->listen_fd;
+    for (uint32_t i = 0; lb->worker_ctx && i < lb->worker_threads && n < LB_HANDOVER_MAX_FDS; i++) {
+        lb_worker_t* w = &lb->worker_ctx[i];
+        if (w->owns_fds && w->listen_fd >= 0 && w->listen_fd != lb->listen_fd) fds[n++] = w->listen_fd;
+    }
+    return n;
+}
+
+static int lb_handover_send(loadbalancer_t* lb, int conn) {
+    int fds[LB_HANDOVER_MAX_FDS];
+    uint32_t n = lb_handover_fds(lb, fds);
+
+    uint32_t hdr[2] = { LB_HANDOVER_MAGIC, n };
+    struct iovec iov = { .iov_base = hdr, .iov_len = sizeof(hdr) };
+    union {
+        char buf[CMSG_SPACE(LB_HANDOVER_MAX_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = CMSG_SPACE(n * sizeof(int))
+    };
+    struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(n * sizeof(int));
+    memcpy(CMSG_DATA(c), fds, n * sizeof(int));
+
+    return sendmsg(conn, &msg, MSG_NOSIGNAL) == (ssize_t)sizeof(hdr) ? 0 : -1;
+}
+
+static void* lb_handover_thread(void* arg) {
+    lb_handover_server_t* srv = arg;
+    loadbalancer_t* lb = srv->lb;
+
+    while (lb->running) {
+        int conn = accept4(srv->fd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("handover accept");
+            break;
+        }
+        lb_handover_timeout(conn, LB_HANDOVER_ACK_MS);
+
+        // Until the new process says it runs, nothing changes here
+        char ack = 0;
+        if (lb_handover_send(lb, conn) == 0 && read(conn, &ack, 1) == 1 && ack == 1) {
+            printf("[HANDOVER] Listeners taken over by a new process, draining\n");
+            fflush(stdout);
+            lb_stop_accepting(lb);
+            close(conn);
+            break;
+        }
+        close(conn);
+        printf("[HANDOVER] New process did not take over, still serving\n");
+        fflush(stdout);
+    }
+
+    close(srv->fd);
+    free(srv);
+    return NULL;
+}
+
+int lb_handover_serve(loadbalancer_t* lb, const char* path) {
+    struct sockaddr_un addr;
+    if (lb_handover_addr(path, &addr) < 0) return -1;
+
+    lb_handover_server_t* srv = malloc(sizeof(*srv));
+    if (!srv) return -1;
+    srv->lb = lb;
+    srv->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (srv->fd < 0) {
+        free(srv);
+        return -1;
+    }
+
+    // A previous process may still be bound there, draining: the path is
+    // ours from now on
+    unlink(path);
+    if (bind(srv->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(srv->fd, 1) < 0) {
+        close(srv->fd);
+        free(srv);
+        return -1;
+    }
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, lb_handover_thread, srv) != 0) {
+        close(srv->fd);
+        free(srv);
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
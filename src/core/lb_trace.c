@@ -0,0 +1,101 @@
+#include "core/lb_trace.h"
+#include "stats/lb_stats.h"
+#include <stdio.h>
+#include <string.h>
+
+uint32_t lb_trace_every = 0;
+bool lb_ticks_clock = true;
+
+// ns = ticks * lb_tick_mult >> 32
+static uint64_t lb_tick_mult = 1ULL << 32;
+
+static void* lb_phase_timers[LB_PHASE_COUNT];
+static const char* const lb_phase_names[LB_PHASE_COUNT] = {
+    [LB_PHASE_ACCEPT] = "lb.phase.accept",
+    [LB_PHASE_REQUEST] = "lb.phase.request",
+    [LB_PHASE_SELECT] = "lb.phase.select",
+    [LB_PHASE_CONNECT] = "lb.phase.connect",
+    [LB_PHASE_FIRST_BYTE] = "lb.phase.first_byte",
+    [LB_PHASE_CLIENT_STALL] = "lb.phase.client_stall",
+    [LB_PHASE_TOTAL] = "lb.phase.total",
+};
+
+static _Thread_local uint32_t lb_trace_skip;
+
+#if defined(__x86_64__)
+// A TSC that stops in deep C-states or changes rate with the clock cannot
+// be compared across time
+static bool lb_tsc_invariant(void) {
+    FILE* f = fopen("/proc/cpuinfo", "r");
+    if (!f) return false;
+
+    char line[4096];
+    bool invariant = false;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "flags", 5) == 0) {
+            invariant = strstr(line, " constant_tsc") && strstr(line, " nonstop_tsc");
+            break;
+        }
+    }
+    fclose(f);
+    return invariant;
+}
+
+static uint64_t lb_raw_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+#endif
+
+// Rate of the counter lb_ticks() reads, against the clock over 20ms
+static void lb_ticks_calibrate(void) {
+#if defined(__x86_64__)
+    if (!lb_tsc_invariant()) return;
+
+    uint64_t ns0 = lb_raw_ns(), t0 = __rdtsc();
+    struct timespec pause = { 0, 20000000 };
+    nanosleep(&pause, NULL);
+    uint64_t ns1 = lb_raw_ns(), t1 = __rdtsc();
+    if (t1 <= t0 || ns1 <= ns0) return;
+
+    lb_tick_mult = (uint64_t)(((unsigned __int128)(ns1 - ns0) << 32) / (t1 - t0));
+    lb_ticks_clock = false;
+#elif defined(__aarch64__)
+    uint64_t freq;
+    __asm__ __volatile__("mrs %0, cntfrq_el0" : "=r"(freq));
+    if (freq) lb_tick_mult = (uint64_t)(((unsigned __int128)1000000000ULL << 32) / freq);
+    lb_ticks_clock = false;
+#endif
+}
+
+void lb_trace_init(uint32_t every) {
+    if (every == 0) return;
+
+    lb_ticks_calibrate();
+    for (int i = 0; i < LB_PHASE_COUNT; i++) {
+        lb_phase_timers[i] = metrics_timer_handle(lb_phase_names[i]);
+    }
+    lb_trace_every = every;
+}
+
+bool lb_trace_pick(void) {
+    if (lb_trace_skip) {
+        lb_trace_skip--;
+        return false;
+    }
+    lb_trace_skip = lb_trace_every - 1;
+    return true;
+}
+
+uint64_t lb_ticks_ns(uint64_t ticks) {
+    return (uint64_t)(((unsigned __int128)ticks * lb_tick_mult) >> 32);
+}
+
+void lb_trace_phase(lb_phase_t phase, uint64_t ticks) {
+    metrics_timer_record_ns(lb_phase_timers[phase], lb_ticks_ns(ticks));
+}
+
+void lb_trace_phase_ns(lb_phase_t phase, uint64_t ns) {
+    metrics_timer_record_ns(lb_phase_timers[phase], ns);
+}
@@ -0,0 +1,121 @@
+#include "core/liveness.hpp"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cerrno>
+
+namespace ultrabalancer {
+
+LivenessWatcher::LivenessWatcher(std::function<void()> on_dead)
+    : on_dead_(std::move(on_dead)) {
+    epfd_ = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epfd_ < 0 || wake_fd_ < 0) return;
+
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u64 = UINT64_MAX;
+    if (epoll_ctl(epfd_, EPOLL_CTL_ADD, wake_fd_, &ev) < 0) return;
+
+    thread_ = std::thread([this] { run(); });
+}
+
+LivenessWatcher::~LivenessWatcher() {
+    stop();
+    if (epfd_ >= 0) close(epfd_);
+    if (wake_fd_ >= 0) close(wake_fd_);
+    for (auto& chunk : chunks_) {
+        delete[] chunk.load(std::memory_order_relaxed);
+    }
+}
+
+void LivenessWatcher::stop() noexcept {
+    if (!thread_.joinable()) return;
+
+    uint64_t one = 1;
+    if (write(wake_fd_, &one, sizeof(one)) < 0) {
+        // Counter full, a wakeup is pending anyway
+    }
+    thread_.join();
+}
+
+uint32_t LivenessWatcher::watch(int fd) noexcept {
+    if (fd < 0 || !thread_.joinable()) return kNoSlot;
+
+    uint32_t slot;
+    {
+        std::lock_guard lock(mutex_);
+        if (free_head_ != kNoSlot) {
+            slot = free_head_;
+            free_head_ = slot_at(slot).next_free;
+        } else {
+            if (allocated_ == kChunkSize * kMaxChunks) return kNoSlot;
+            slot = allocated_;
+            auto& chunk = chunks_[slot >> kChunkBits];
+            if (!chunk.load(std::memory_order_relaxed)) {
+                Slot* fresh = new (std::nothrow) Slot[kChunkSize];
+                if (!fresh) return kNoSlot;
+                chunk.store(fresh, std::memory_order_release);
+            }
+            allocated_++;
+        }
+    }
+
+    // Only the owner writes a live slot's generation, so this is stable
+    Slot& s = slot_at(slot);
+    uint64_t generation = s.state.load(std::memory_order_relaxed) >> 1;
+    s.state.store(generation << 1 | 1, std::memory_order_release);
+
+    epoll_event ev{};
+    ev.events = EPOLLRDHUP | EPOLLET;
+    ev.data.u64 = (uint64_t)slot << 32 | (uint32_t)generation;
+    if (epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        unwatch(slot);
+        return kNoSlot;
+    }
+    return slot;
+}
+
+void LivenessWatcher::unwatch(uint32_t slot) noexcept {
+    if (slot == kNoSlot) return;
+
+    // Closing the socket takes it out of the epoll set; the new generation
+    // voids any event for it that the watcher already holds
+    Slot& s = slot_at(slot);
+    uint64_t generation = (uint32_t)((s.state.load(std::memory_order_relaxed) >> 1) + 1);
+    s.state.store(generation << 1, std::memory_order_release);
+
+    std::lock_guard lock(mutex_);
+    s.next_free = free_head_;
+    free_head_ = slot;
+}
+
+void LivenessWatcher::run() noexcept {
+    epoll_event events[64];
+
+    for (;;) {
+        int n = epoll_wait(epfd_, events, 64, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+
+        bool dead = false;
+        for (int i = 0; i < n; i++) {
+            uint64_t data = events[i].data.u64;
+            if (data == UINT64_MAX) return;
+
+            uint32_t slot = data >> 32;
+            uint64_t expected = (uint64_t)(uint32_t)data << 1 | 1;
+            if (slot_at(slot).state.compare_exchange_strong(expected, expected & ~1ULL,
+                                                           std::memory_order_acq_rel)) {
+                hangups_.fetch_add(1, std::memory_order_relaxed);
+                dead = true;
+            }
+        }
+
+        if (dead && on_dead_) on_dead_();
+    }
+}
+
+}
@@ -1,5 +1,7 @@
 #include "core/proxy.h"
 #include "core/lb_types.h"
+#include "core/lb_memory.h"
+#include "core/lb_utils.h"
 #include "utils/log.h"
 #include "health/health.h"
 #include "http/http.h"
@@ -12,6 +14,9 @@
 
 struct proxy *proxies_list = NULL;
 static pthread_rwlock_t proxy_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t chash_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void server_chash_free(server_chash_t *ch);
 
 proxy_t* proxy_new(const char *name, int mode) {
     proxy_t *px = calloc(1, sizeof(proxy_t));
@@ -56,6 +61,14 @@ void proxy_free(proxy_t *px) {
         srv = next;
     }
 
+    server_chash_free(atomic_load(&px->chash));
+    while (px->chash_retired) {
+        server_chash_t *ch = px->chash_retired;
+        px->chash_retired = ch->retired_next;
+        server_chash_free(ch);
+    }
+
+    free(px->lb_arg);
     free(px->id);
     free(px);
 }
@@ -79,6 +92,7 @@ int proxy_start(proxy_t *px) {
             start_health_check(srv);
         }
     }
+    proxy_servers_changed(px);
 
     px->state = PR_FL_READY;
     log_info("Proxy %s started", px->id);
@@ -103,6 +117,7 @@ void proxy_stop(proxy_t *px) {
     for (srv = px->servers; srv; srv = srv->next) {
         srv->cur_state = SRV_MAINTAIN;
     }
+    proxy_servers_changed(px);
 
     log_info("Proxy %s stopped", px->id);
 }
@@ -214,15 +229,153 @@ server_t* select_server_source(proxy_t *px, uint32_t hash) {
     return NULL;
 }
 
+static void server_chash_free(server_chash_t *ch) {
+    if (!ch) return;
+    free(ch->servers);
+    free(ch);
+}
+
+// Running servers with a weight; the backups only when no other is left
+static server_chash_t* server_chash_build(proxy_t *px) {
+    uint32_t active = 0, backup = 0;
+    server_t *srv;
+
+    for (srv = px->servers; srv; srv = srv->next) {
+        if (srv->cur_state != SRV_RUNNING || srv->weight == 0) continue;
+        if (srv->flags & SRV_BACKUP) backup++;
+        else active++;
+    }
+    bool use_backup = active == 0;
+    uint32_t n = use_backup ? backup : active;
+    if (n == 0) return NULL;
+
+    uint32_t size = CONSISTENT_HASH_SIZE;
+    maglev_member_t *m = calloc(n, sizeof(*m));
+    uint32_t *idx = malloc(size * sizeof(*idx));
+    server_chash_t *ch = calloc(1, sizeof(*ch) + size * sizeof(server_t *));
+    server_t **servers = malloc(n * sizeof(*servers));
+    if (!m || !idx || !ch || !servers) goto fail;
+
+    uint32_t i = 0;
+    for (srv = px->servers; srv; srv = srv->next) {
+        if (srv->cur_state != SRV_RUNNING || srv->weight == 0) continue;
+        if (!!(srv->flags & SRV_BACKUP) != use_backup) continue;
+        // Named by id, so readdressing a server keeps its keys
+        m[i].name_hash = murmur3_64(srv->id, strlen(srv->id), 0);
+        m[i].weight = srv->weight;
+        m[i].member = srv;
+        i++;
+    }
+    qsort(m, n, sizeof(*m), maglev_member_cmp);
+    if (maglev_fill(idx, size, m, n) < 0) goto fail;
+
+    ch->size = size;
+    ch->count = n;
+    ch->servers = servers;
+    for (i = 0; i < n; i++) servers[i] = m[i].member;
+    for (i = 0; i < size; i++) ch->slot[i] = m[idx[i]].member;
+
+    free(idx);
+    free(m);
+    return ch;
+
+fail:
+    log_error("Proxy %s: out of memory building the hash table", px->id);
+    free(servers);
+    free(ch);
+    free(idx);
+    free(m);
+    return NULL;
+}
+
+void proxy_servers_changed(proxy_t *px) {
+    if (!px) return;
+
+    pthread_mutex_lock(&chash_lock);
+
+    server_chash_t *ch = server_chash_build(px);
+    server_chash_t *old = atomic_exchange_explicit(&px->chash, ch, memory_order_acq_rel);
+    time_t now = time(NULL);
+    if (old) {
+        old->retired_at = now;
+        old->retired_next = px->chash_retired;
+        px->chash_retired = old;
+    }
+
+    server_chash_t **pp = &px->chash_retired;
+    while (*pp) {
+        server_chash_t *r = *pp;
+        if (now - r->retired_at >= CONSISTENT_HASH_GRACE) {
+            *pp = r->retired_next;
+            server_chash_free(r);
+        } else {
+            pp = &r->retired_next;
+        }
+    }
+
+    pthread_mutex_unlock(&chash_lock);
+}
+
+/*
+ * A key goes to the owner of its slot unless hash-balance-factor is set and
+ * that server already holds factor% of the average in-flight count (this
+ * request included); it then walks on to the owners of the next slots.
+ */
+static server_t* select_server_hash(proxy_t *px, uint64_t hash) {
+    server_chash_t *ch = atomic_load_explicit(&px->chash, memory_order_acquire);
+    if (!ch) return NULL;
+
+    int64_t cap = INT64_MAX;
+    if (px->hash_balance_factor) {
+        int64_t total = 0;
+        for (uint32_t i = 0; i < ch->count; i++) {
+            total += atomic_load_explicit(&ch->servers[i]->cur_conns, memory_order_relaxed);
+        }
+        if (total < 0) total = 0;
+        cap = ((int64_t)px->hash_balance_factor * (total + 1) + 100 * ch->count - 1) /
+              (100 * ch->count);
+    }
+
+    uint32_t idx = maglev_slot(hash, ch->size);
+    server_t *first = NULL;
+    for (uint32_t i = 0; i < ch->size; i++) {
+        server_t *srv = ch->slot[(idx + i) % ch->size];
+        if (!server_is_usable(srv)) continue;
+        if (!first) first = srv;
+        if (atomic_load_explicit(&srv->cur_conns, memory_order_relaxed) < cap) return srv;
+    }
+
+    return first;
+}
+
 server_t* select_server_uri(proxy_t *px, const char *uri, size_t len) {
-    uint32_t hash = 0;
-    size_t i;
+    // The path only, as the query string often carries per-client noise
+    const char *q = memchr(uri, '?', len);
+    if (q) len = q - uri;
 
-    for (i = 0; i < len; i++) {
-        hash = ((hash << 5) + hash) + uri[i];
+    return select_server_hash(px, murmur3_64(uri, len, 0));
+}
+
+static server_t* select_server_url_param(proxy_t *px, const char *uri, size_t len) {
+    const char *q = memchr(uri, '?', len);
+    size_t name_len = strlen(px->lb_arg);
+
+    if (!q) return NULL;
+    const char *p = q + 1;
+    const char *end = uri + len;
+
+    while (p < end) {
+        const char *amp = memchr(p, '&', end - p);
+        const char *stop = amp ? amp : end;
+        if ((size_t)(stop - p) > name_len && p[name_len] == '=' &&
+            memcmp(p, px->lb_arg, name_len) == 0) {
+            p += name_len + 1;
+            return select_server_hash(px, murmur3_64(p, stop - p, 0));
+        }
+        p = stop + 1;
     }
 
-    return select_server_source(px, hash);
+    return NULL;
 }
 
 server_t* proxy_select_server(proxy_t *px, session_t *sess) {
@@ -249,6 +402,24 @@ server_t* proxy_select_server(proxy_t *px, session_t *sess) {
             }
             return select_server_roundrobin(px);
 
+        // Requests without the parameter or header are spread round robin
+        case LB_ALGO_URL_PARAM:
+            if (sess && sess->txn && sess->txn->uri && px->lb_arg) {
+                server_t *srv = select_server_url_param(px, sess->txn->uri, sess->txn->uri_len);
+                if (srv) return srv;
+            }
+            return select_server_roundrobin(px);
+
+        case LB_ALGO_HDR:
+            if (sess && sess->txn && px->lb_arg) {
+                const char *value = http_header_get(&sess->txn->req, px->lb_arg);
+                if (value) {
+                    server_t *srv = select_server_hash(px, murmur3_64(value, strlen(value), 0));
+                    if (srv) return srv;
+                }
+            }
+            return select_server_roundrobin(px);
+
         case LB_ALGO_RANDOM:
             return select_server_source(px, rand());
 
@@ -0,0 +1,118 @@
+#include "core/rate_limiter.hpp"
+#include <algorithm>
+#include <chrono>
+
+// stick_tables.h is C only (its counters are _Atomic), so the one call
+// made from here is declared by hand
+extern "C" int stktable_share_count(struct stick_table* t, const char* name, const char* node,
+                                    uint32_t local, uint64_t* remote, uint32_t* nodes);
+
+namespace ultrabalancer {
+
+namespace {
+
+constexpr int64_t kSecond = 1000000000;
+
+int64_t now_ns() noexcept {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint32_t shard_index() noexcept {
+    static std::atomic<uint32_t> next{0};
+    static thread_local uint32_t index =
+        next.fetch_add(1, std::memory_order_relaxed) % RateLimiter::kShards;
+    return index;
+}
+
+}
+
+RateLimiter::RateLimiter(uint32_t rate, uint32_t burst)
+    : rate_(rate),
+      burst_(burst ? burst : rate),
+      // 0 leaves the bucket empty from the start
+      span_(rate ? (int64_t)burst_ * (kSecond / std::min<int64_t>(rate, kSecond)) : 0) {
+    set_local_rate(rate);
+}
+
+void RateLimiter::set_local_rate(uint32_t rate) noexcept {
+    local_rate_.store(rate, std::memory_order_relaxed);
+    lease_.store(std::clamp<int64_t>(rate / 1000, 1, kMaxLease), std::memory_order_relaxed);
+    interval_.store(rate ? std::max<int64_t>(kSecond / rate, 1) : 0, std::memory_order_relaxed);
+}
+
+void RateLimiter::share(struct stick_table* table, std::string name, std::string node) {
+    table_ = table;
+    name_ = std::move(name);
+    node_ = std::move(node);
+    last_sync_.store(now_ns(), std::memory_order_relaxed);
+    next_sync_.store(0, std::memory_order_relaxed);
+}
+
+bool RateLimiter::try_acquire() noexcept {
+    Shard& shard = shards_[shard_index()];
+
+    int64_t tokens = shard.tokens.load(std::memory_order_relaxed);
+    while (tokens > 0) {
+        if (shard.tokens.compare_exchange_weak(tokens, tokens - 1, std::memory_order_relaxed)) {
+            return true;
+        }
+    }
+    return refill(shard);
+}
+
+bool RateLimiter::refill(Shard& shard) noexcept {
+    int64_t now = now_ns();
+    if (table_ && now >= next_sync_.load(std::memory_order_relaxed)) sync(now);
+
+    int64_t interval = interval_.load(std::memory_order_relaxed);
+    int64_t want = lease_.load(std::memory_order_relaxed);
+    int64_t tat = tat_.load(std::memory_order_relaxed);
+
+    // A lower local rate shrinks the burst with it, down to one token
+    int64_t span = std::max(span_, interval);
+
+    while (interval > 0) {
+        // Whole tokens the bucket holds now, and the lease out of them
+        int64_t base = std::max(tat, now);
+        int64_t room = (now + span - base) / interval;
+        if (room <= 0) break;
+
+        int64_t n = std::min(want, room);
+        if (tat_.compare_exchange_weak(tat, base + n * interval, std::memory_order_relaxed)) {
+            allowed_.fetch_add(n, std::memory_order_relaxed);
+            if (n > 1) shard.tokens.fetch_add(n - 1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+
+    refused_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+void RateLimiter::sync(int64_t now) noexcept {
+    int64_t next = next_sync_.load(std::memory_order_relaxed);
+    if (now < next || !next_sync_.compare_exchange_strong(next, now + kSecond,
+                                                          std::memory_order_relaxed)) {
+        return;
+    }
+
+    // Only the thread that moved next_sync_ gets here, once a second
+    int64_t elapsed = std::max<int64_t>(now - last_sync_.exchange(now, std::memory_order_relaxed), 1);
+    uint64_t allowed = allowed_.load(std::memory_order_relaxed);
+    uint64_t taken = allowed - synced_allowed_.exchange(allowed, std::memory_order_relaxed);
+    uint32_t local = (uint32_t)std::min<uint64_t>((unsigned __int128)taken * kSecond / elapsed,
+                                                  UINT32_MAX);
+
+    uint64_t remote;
+    uint32_t nodes;
+    if (stktable_share_count(table_, name_.c_str(), node_.c_str(), local, &remote, &nodes) < 0) {
+        return;
+    }
+
+    uint64_t left = remote < rate_ ? rate_ - remote : 0;
+    uint64_t share = rate_ / (nodes + 1);
+    set_local_rate((uint32_t)std::max(left, share));
+}
+
+}
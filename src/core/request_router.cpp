@@ -10,12 +10,36 @@ namespace ultrabalancer {
 RouteRule::RouteRule(MatchType type, const std::string& pattern)
     : type_(type), pattern_(pattern) {
     if (type_ == MatchType::REGEX) {
-        regex_ = std::regex(pattern);
+        regex_set_.reset(regex_set_create());
+        if (!regex_set_ ||
+            regex_set_add(regex_set_.get(), pattern.data(), pattern.size(), REGEX_SET_ANCHORED) < 0 ||
+            regex_set_compile(regex_set_.get()) < 0) {
+            regex_set_.reset();
+            regex_ = std::regex(pattern);
+        }
+    }
+    if (type_ == MatchType::HEADER) {
+        // Split once here rather than on every match
+        auto pos = pattern_.find(':');
+        if (pos != std::string::npos) {
+            header_name_ = pattern_.substr(0, pos);
+            header_value_ = pattern_.substr(pos + 1);
+        }
     }
 }
 
 bool RouteRule::matches(const std::string& path,
                        const std::unordered_map<std::string, std::string>& headers) const {
+    if (type_ == MatchType::METHOD) {
+        static const std::string method_header("method");
+        auto it = headers.find(method_header);
+        return it != headers.end() && it->second == pattern_;
+    }
+    return matches(std::string_view(), path, headers);
+}
+
+bool RouteRule::matches(std::string_view method, const std::string& path,
+                       const std::unordered_map<std::string, std::string>& headers) const {
     switch (type_) {
         case MatchType::EXACT:
             return path == pattern_;
@@ -28,23 +52,17 @@ bool RouteRule::matches(const std::string& path,
         }
 
         case MatchType::REGEX:
+            if (regex_set_) return regex_set_match(regex_set_.get(), path.data(), path.size(), nullptr);
             return std::regex_match(path, regex_);
 
         case MatchType::HEADER: {
-            auto pos = pattern_.find(':');
-            if (pos != std::string::npos) {
-                // Use string_view to avoid unnecessary allocations during parsing
-                std::string_view header_name(pattern_.data(), pos);
-                std::string_view header_value(pattern_.data() + pos + 1, pattern_.length() - pos - 1);
-
-                auto it = headers.find(std::string(header_name));
-                return it != headers.end() && it->second == header_value;
-            }
-            return false;
+            if (header_name_.empty()) return false;
+            auto it = headers.find(header_name_);
+            return it != headers.end() && it->second == header_value_;
         }
 
         case MatchType::METHOD:
-            return headers.count("method") && headers.at("method") == pattern_;
+            return method == pattern_;
 
         case MatchType::QUERY_PARAM: {
             auto query_pos = path.find('?');
@@ -95,6 +113,16 @@ bool Route::matches(const std::string& path,
     return !rules_.empty();
 }
 
+bool Route::matches(std::string_view method, const std::string& path,
+                   const std::unordered_map<std::string, std::string>& headers) const {
+    for (const auto& rule : rules_) {
+        if (!rule->matches(method, path, headers)) {
+            return false;
+        }
+    }
+    return !rules_.empty();
+}
+
 std::shared_ptr<RouteTarget> Route::select_target() const {
     if (targets_.empty()) return nullptr;
 
@@ -170,8 +198,334 @@ bool Route::is_circuit_open() const {
     return false;
 }
 
+namespace {
+
+// FNV-1a with a seed, continued across the parts of a key
+inline uint64_t hash_part(uint64_t h, std::string_view part) {
+    for (unsigned char c : part) {
+        h ^= c;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/*
+ * Lookup table over a key set fixed when it is built: the seed and size are
+ * searched until every key has a slot of its own, so a lookup is one hash
+ * and one compare. Keys are one string, or a name and value pair hashed
+ * with a NUL between them.
+ */
+class PerfectTable {
+public:
+    static constexpr uint32_t kMissing = UINT32_MAX;
+
+    // Key i is found as i
+    void build(const std::vector<std::pair<std::string, std::string>>& keys) {
+        keys_ = keys;
+        if (keys_.empty()) return;
+
+        for (size_t size = 2; ; size <<= 1) {
+            if (size < keys_.size() * 2) continue;
+            for (uint64_t seed = 1; seed <= 64; seed++) {
+                if (try_build(seed, size)) return;
+            }
+        }
+    }
+
+    uint32_t find(std::string_view name, std::string_view value = {}) const {
+        if (slots_.empty()) return kMissing;
+
+        uint32_t i = slots_[hash(seed_, name, value) & (slots_.size() - 1)];
+        if (i == kMissing || keys_[i].first != name || keys_[i].second != value) return kMissing;
+        return i;
+    }
+
+private:
+    static uint64_t hash(uint64_t seed, std::string_view name, std::string_view value) {
+        uint64_t h = hash_part(0xcbf29ce484222325ULL ^ (seed * 0x9e3779b97f4a7c15ULL), name);
+        if (!value.empty()) h = hash_part(hash_part(h, std::string_view("\0", 1)), value);
+        return h ^ (h >> 29);
+    }
+
+    bool try_build(uint64_t seed, size_t size) {
+        slots_.assign(size, kMissing);
+        for (uint32_t i = 0; i < keys_.size(); i++) {
+            uint32_t& slot = slots_[hash(seed, keys_[i].first, keys_[i].second) & (size - 1)];
+            if (slot != kMissing) return false;
+            slot = i;
+        }
+        seed_ = seed;
+        return true;
+    }
+
+    std::vector<std::pair<std::string, std::string>> keys_;
+    std::vector<uint32_t> slots_;
+    uint64_t seed_ = 0;
+};
+
+// Radix trie while it is built; flattened into CompiledRoutes::nodes
+struct BuildNode {
+    std::string label;
+    std::vector<std::unique_ptr<BuildNode>> children;
+    std::vector<uint32_t> exact;
+    std::vector<uint32_t> prefix;
+};
+
+void trie_insert(BuildNode* node, std::string_view key, uint32_t rank, bool prefix) {
+    for (;;) {
+        if (key.empty()) {
+            (prefix ? node->prefix : node->exact).push_back(rank);
+            return;
+        }
+
+        BuildNode* child = nullptr;
+        for (auto& c : node->children) {
+            if (c->label[0] == key[0]) {
+                child = c.get();
+                break;
+            }
+        }
+        if (!child) {
+            auto leaf = std::make_unique<BuildNode>();
+            leaf->label = std::string(key);
+            (prefix ? leaf->prefix : leaf->exact).push_back(rank);
+            node->children.push_back(std::move(leaf));
+            return;
+        }
+
+        size_t common = 0;
+        while (common < child->label.size() && common < key.size() &&
+               child->label[common] == key[common]) {
+            common++;
+        }
+
+        if (common < child->label.size()) {
+            // Split the edge where the key leaves it
+            auto mid = std::make_unique<BuildNode>();
+            mid->label = child->label.substr(0, common);
+            for (auto& c : node->children) {
+                if (c.get() == child) {
+                    c->label.erase(0, common);
+                    mid->children.push_back(std::move(c));
+                    c = std::move(mid);
+                    child = c.get();
+                    break;
+                }
+            }
+        }
+
+        node = child;
+        key.remove_prefix(common);
+    }
+}
+
+}
+
+struct RequestRouter::CompiledRoutes {
+    struct Span {
+        uint32_t begin = 0;
+        uint32_t count = 0;
+    };
+
+    struct TrieNode {
+        uint32_t label;             // in labels
+        uint32_t label_len;
+        uint32_t first_child;       // children are contiguous in nodes
+        uint32_t child_count;
+        Span exact;                 // in ranks
+        Span prefix;
+    };
+
+    uint64_t version;
+    std::vector<std::shared_ptr<Route>> routes;         // by rank, priority order
+    std::shared_ptr<RouteTarget> default_target;
+
+    std::string labels;
+    std::vector<TrieNode> nodes;                        // root first
+    std::vector<uint32_t> ranks;
+
+    PerfectTable methods;
+    std::vector<Span> method_routes;                    // by method key
+    PerfectTable headers;
+    std::vector<Span> header_routes;                    // by name:value key
+    std::vector<std::string> header_names;              // each probed once per request
+    std::unique_ptr<regex_set_t, void (*)(regex_set_t*)> regexes{nullptr, regex_set_destroy};
+    std::vector<uint32_t> regex_routes;                 // by pattern id
+    std::vector<uint32_t> always;
+
+    std::unordered_map<std::string, std::shared_ptr<RateLimiter>> limiters;
+
+    CompiledRoutes(uint64_t v, const std::vector<std::shared_ptr<Route>>& r,
+                   const std::string& default_backend,
+                   const std::unordered_map<std::string, std::shared_ptr<RateLimiter>>& l)
+        : version(v), routes(r), limiters(l) {
+        if (!default_backend.empty()) {
+            default_target = std::make_shared<RouteTarget>(default_backend);
+        }
+
+        BuildNode root;
+        std::vector<std::pair<std::string, std::string>> method_keys, header_keys;
+        std::vector<std::vector<uint32_t>> by_method, by_header;
+
+        auto key_index = [](auto& keys, auto& lists, std::string a, std::string b) -> auto& {
+            for (size_t i = 0; i < keys.size(); i++) {
+                if (keys[i].first == a && keys[i].second == b) return lists[i];
+            }
+            keys.emplace_back(std::move(a), std::move(b));
+            return lists.emplace_back();
+        };
+
+        for (uint32_t rank = 0; rank < routes.size(); rank++) {
+            // The first rule of the most selective kind that can be indexed
+            const RouteRule* anchor = nullptr;
+            for (auto type : {RouteRule::MatchType::EXACT, RouteRule::MatchType::PREFIX,
+                              RouteRule::MatchType::METHOD, RouteRule::MatchType::HEADER,
+                              RouteRule::MatchType::REGEX}) {
+                for (const auto& rule : routes[rank]->get_rules()) {
+                    if (rule->get_type() == type &&
+                        (type != RouteRule::MatchType::HEADER || !rule->header_name().empty())) {
+                        anchor = rule.get();
+                        break;
+                    }
+                }
+                if (anchor) break;
+            }
+
+            if (anchor && anchor->get_type() == RouteRule::MatchType::REGEX) {
+                if (!regexes) regexes.reset(regex_set_create());
+                const std::string& pattern = anchor->get_pattern();
+                if (regexes && regex_set_add(regexes.get(), pattern.data(), pattern.size(),
+                                             REGEX_SET_ANCHORED) >= 0) {
+                    regex_routes.push_back(rank);
+                    continue;
+                }
+                anchor = nullptr;
+            }
+
+            if (!anchor) {
+                always.push_back(rank);
+                continue;
+            }
+            switch (anchor->get_type()) {
+                case RouteRule::MatchType::EXACT:
+                case RouteRule::MatchType::PREFIX:
+                    trie_insert(&root, anchor->get_pattern(), rank,
+                                anchor->get_type() == RouteRule::MatchType::PREFIX);
+                    break;
+                case RouteRule::MatchType::METHOD:
+                    key_index(method_keys, by_method, anchor->get_pattern(), "").push_back(rank);
+                    break;
+                default:
+                    key_index(header_keys, by_header, anchor->header_name(),
+                              anchor->header_value()).push_back(rank);
+                    if (std::find(header_names.begin(), header_names.end(),
+                                  anchor->header_name()) == header_names.end()) {
+                        header_names.push_back(anchor->header_name());
+                    }
+                    break;
+            }
+        }
+
+        flatten(root);
+        methods.build(method_keys);
+        for (const auto& list : by_method) method_routes.push_back(append(list));
+        headers.build(header_keys);
+        for (const auto& list : by_header) header_routes.push_back(append(list));
+
+        if (regexes && regex_set_compile(regexes.get()) < 0) {
+            always.insert(always.end(), regex_routes.begin(), regex_routes.end());
+            regex_routes.clear();
+            regexes.reset();
+        }
+    }
+
+    Span append(const std::vector<uint32_t>& list) {
+        Span span{(uint32_t)ranks.size(), (uint32_t)list.size()};
+        ranks.insert(ranks.end(), list.begin(), list.end());
+        return span;
+    }
+
+    // Breadth first, so that each node's children sit next to each other
+    void flatten(const BuildNode& root) {
+        std::vector<const BuildNode*> order{&root};
+        for (size_t i = 0; i < order.size(); i++) {
+            const BuildNode* node = order[i];
+            TrieNode flat{(uint32_t)labels.size(), (uint32_t)node->label.size(),
+                          (uint32_t)(order.size()), (uint32_t)node->children.size(),
+                          append(node->exact), append(node->prefix)};
+            labels += node->label;
+            nodes.push_back(flat);
+            for (const auto& child : node->children) order.push_back(child.get());
+        }
+    }
+
+    void add(Span span, std::vector<uint32_t>& out) const {
+        out.insert(out.end(), ranks.begin() + span.begin, ranks.begin() + span.begin + span.count);
+    }
+
+    // The ranks of every route that may match, ascending
+    void candidates(std::string_view method, std::string_view path,
+                    const std::unordered_map<std::string, std::string>& request_headers,
+                    std::vector<uint32_t>& out) const {
+        out.clear();
+
+        const TrieNode* node = &nodes[0];
+        add(node->prefix, out);
+        for (size_t pos = 0; ; ) {
+            if (pos == path.size()) {
+                add(node->exact, out);
+                break;
+            }
+
+            const TrieNode* next = nullptr;
+            for (uint32_t i = 0; i < node->child_count; i++) {
+                const TrieNode* child = &nodes[node->first_child + i];
+                if (labels[child->label] == path[pos]) {
+                    next = child;
+                    break;
+                }
+            }
+            if (!next || path.compare(pos, next->label_len,
+                                      std::string_view(labels).substr(next->label, next->label_len)) != 0) {
+                break;
+            }
+
+            pos += next->label_len;
+            node = next;
+            add(node->prefix, out);
+        }
+
+        uint32_t m = methods.find(method);
+        if (m != PerfectTable::kMissing) add(method_routes[m], out);
+
+        for (const std::string& name : header_names) {
+            auto it = request_headers.find(name);
+            if (it == request_headers.end()) continue;
+            uint32_t h = headers.find(name, it->second);
+            if (h != PerfectTable::kMissing) add(header_routes[h], out);
+        }
+
+        if (!regex_routes.empty()) {
+            static thread_local std::vector<uint64_t> matched;
+            matched.resize(regex_set_words(regexes.get()));
+            if (regex_set_match(regexes.get(), path.data(), path.size(), matched.data())) {
+                for (size_t w = 0; w < matched.size(); w++) {
+                    for (uint64_t bits = matched[w]; bits; bits &= bits - 1) {
+                        out.push_back(regex_routes[w * 64 + __builtin_ctzll(bits)]);
+                    }
+                }
+            }
+        }
+
+        out.insert(out.end(), always.begin(), always.end());
+        std::sort(out.begin(), out.end());
+    }
+};
+
+static std::atomic<uint64_t> next_router_id{1};
+
 RequestRouter::RequestRouter()
-    : default_backend_target_(nullptr) {}
+    : id_(next_router_id.fetch_add(1, std::memory_order_relaxed)) {}
 
 void RequestRouter::add_route(std::shared_ptr<Route> route) {
     std::unique_lock<std::shared_mutex> lock(routes_mutex_);
@@ -183,6 +537,7 @@ void RequestRouter::add_route(std::shared_ptr<Route> route) {
             return a->get_priority() > b->get_priority();
         });
     routes_.insert(insert_pos, route);
+    version_.fetch_add(1, std::memory_order_release);
 }
 
 void RequestRouter::remove_route(const std::string& name) {
@@ -194,6 +549,41 @@ void RequestRouter::remove_route(const std::string& name) {
                           return route->get_name() == name;
                       }),
         routes_.end());
+    version_.fetch_add(1, std::memory_order_release);
+}
+
+std::shared_ptr<const RequestRouter::CompiledRoutes> RequestRouter::compile() {
+    std::unique_lock<std::shared_mutex> lock(routes_mutex_);
+
+    // Another thread may have compiled this version while we waited
+    uint64_t version = version_.load(std::memory_order_relaxed);
+    auto current = compiled_.load(std::memory_order_acquire);
+    if (current && current->version == version) return current;
+
+    auto compiled = std::make_shared<const CompiledRoutes>(version, routes_, default_backend_,
+                                                          rate_limiters_);
+    compiled_.store(compiled, std::memory_order_release);
+    return compiled;
+}
+
+const RequestRouter::CompiledRoutes* RequestRouter::snapshot() {
+    struct Cached {
+        uint64_t router = 0;
+        std::shared_ptr<const CompiledRoutes> routes;
+    };
+    static thread_local Cached cached;
+
+    uint64_t version = version_.load(std::memory_order_acquire);
+    if (cached.router == id_ && cached.routes && cached.routes->version == version) {
+        return cached.routes.get();
+    }
+
+    auto routes = compiled_.load(std::memory_order_acquire);
+    if (!routes || routes->version != version) routes = compile();
+
+    cached.router = id_;
+    cached.routes = std::move(routes);
+    return cached.routes.get();
 }
 
 std::shared_ptr<RouteTarget> RequestRouter::route_request(
@@ -204,104 +594,58 @@ std::shared_ptr<RouteTarget> RequestRouter::route_request(
     // Use atomic operations for stats to reduce lock contention
     stats_.total_requests.fetch_add(1, std::memory_order_relaxed);
 
-    // Hold read lock only during route matching, release before stats updates
-    std::shared_ptr<RouteTarget> target;
-    {
-        std::shared_lock<std::shared_mutex> lock(routes_mutex_);
-
-        for (const auto& route : routes_) {
-            if (route->matches(path, headers)) {
-                target = route->select_target();
-                if (target) {
-                    break;
-                }
-            }
-        }
-    }
+    const CompiledRoutes* compiled = snapshot();
 
-    // Update stats outside of routes lock to reduce contention
-    if (target) {
-        stats_.routed_requests.fetch_add(1, std::memory_order_relaxed);
-        // Use atomic increment for backend selection counter
-        const std::string& backend = target->get_backend();
-        std::lock_guard<std::mutex> stats_lock(stats_mutex_);
-        stats_.backend_selections[backend]++;
-        return target;
-    }
+    static thread_local std::vector<uint32_t> candidates;
+    compiled->candidates(method, path, headers, candidates);
 
-    // Reuse cached default backend target to avoid repeated allocations
-    if (!default_backend_.empty()) {
-        stats_.default_route_hits.fetch_add(1, std::memory_order_relaxed);
+    for (uint32_t rank : candidates) {
+        const Route* route = compiled->routes[rank].get();
+        if (!route->matches(method, path, headers)) continue;
 
-        // Check if we have a cached default target
-        auto cached = default_backend_target_.load(std::memory_order_acquire);
-        if (cached && cached->get_backend() == default_backend_) {
-            return std::shared_ptr<RouteTarget>(cached);
+        auto target = route->select_target();
+        if (target) {
+            stats_.routed_requests.fetch_add(1, std::memory_order_relaxed);
+            route->count_hit();
+            target->count_selection();
+            return target;
         }
+    }
 
-        // Create new target and cache it
-        auto new_target = std::make_shared<RouteTarget>(default_backend_);
-        default_backend_target_.store(new_target.get(), std::memory_order_release);
-        return new_target;
+    if (compiled->default_target) {
+        stats_.default_route_hits.fetch_add(1, std::memory_order_relaxed);
+        return compiled->default_target;
     }
 
     return nullptr;
 }
 
 void RequestRouter::set_default_backend(const std::string& backend) {
+    std::unique_lock<std::shared_mutex> lock(routes_mutex_);
     default_backend_ = backend;
-    // Invalidate cached default target when backend changes
-    default_backend_target_.store(nullptr, std::memory_order_release);
+    version_.fetch_add(1, std::memory_order_release);
 }
 
 void RequestRouter::enable_rate_limiting(const std::string& route_name,
-                                        int requests_per_second) {
-    std::lock_guard<std::mutex> lock(rate_limiters_mutex_);
-
-    auto limiter = std::make_unique<RateLimiter>();
-    limiter->max_tokens = requests_per_second;
-    limiter->tokens = requests_per_second;
-    limiter->last_refill = std::chrono::steady_clock::now();
+                                        int requests_per_second,
+                                        struct stick_table* shared,
+                                        const std::string& node) {
+    // A new limiter rather than a changed one, for the threads still using it
+    auto limiter = std::make_shared<RateLimiter>((uint32_t)std::max(requests_per_second, 0));
+    if (shared) limiter->share(shared, route_name, node);
 
+    std::unique_lock<std::shared_mutex> lock(routes_mutex_);
     rate_limiters_[route_name] = std::move(limiter);
+    version_.fetch_add(1, std::memory_order_release);
 }
 
 bool RequestRouter::check_rate_limit(const std::string& route_name) {
-    // Fast path: check if rate limiter exists without holding the global lock
-    RateLimiter* limiter = nullptr;
-    {
-        std::lock_guard<std::mutex> lock(rate_limiters_mutex_);
-        auto it = rate_limiters_.find(route_name);
-        if (it == rate_limiters_.end()) {
-            return true;  // No rate limit configured
-        }
-        limiter = it->second.get();
-    }
-
-    // Hold only the specific limiter's lock, not the global map lock
-    std::lock_guard<std::mutex> limiter_lock(limiter->mutex);
-
-    refill_tokens(limiter, limiter->max_tokens);
-
-    if (limiter->tokens > 0) {
-        limiter->tokens--;
-        return true;
-    }
-
-    return false;
-}
-
-void RequestRouter::refill_tokens(RateLimiter* limiter, int tokens_per_second) {
-    auto now = std::chrono::steady_clock::now();
-    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
-        now - limiter->last_refill).count();
-
-    if (elapsed > 0) {
-        int tokens_to_add = (tokens_per_second * elapsed) / 1000;
-        limiter->tokens = std::min(limiter->max_tokens,
-                                  limiter->tokens + tokens_to_add);
-        limiter->last_refill = now;
+    const CompiledRoutes* compiled = snapshot();
+    auto it = compiled->limiters.find(route_name);
+    if (it == compiled->limiters.end()) {
+        return true;  // No rate limit configured
     }
+    return it->second->try_acquire();
 }
 
 RequestRouter::RoutingStats RequestRouter::get_stats() const {
@@ -311,9 +655,13 @@ RequestRouter::RoutingStats RequestRouter::get_stats() const {
     snapshot.routed_requests = stats_.routed_requests.load(std::memory_order_relaxed);
     snapshot.default_route_hits = stats_.default_route_hits.load(std::memory_order_relaxed);
 
-    // Only lock for the map copy
-    std::lock_guard<std::mutex> lock(stats_mutex_);
-    snapshot.backend_selections = stats_.backend_selections;
+    std::shared_lock<std::shared_mutex> lock(routes_mutex_);
+    for (const auto& route : routes_) {
+        snapshot.route_hits[route->get_name()] += route->get_hits();
+        for (const auto& target : route->get_targets()) {
+            snapshot.backend_selections[target->get_backend()] += target->get_selections();
+        }
+    }
 
     return snapshot;
 }
@@ -323,8 +671,11 @@ void RequestRouter::reset_stats() {
     stats_.routed_requests.store(0, std::memory_order_relaxed);
     stats_.default_route_hits.store(0, std::memory_order_relaxed);
 
-    std::lock_guard<std::mutex> lock(stats_mutex_);
-    stats_.backend_selections.clear();
+    std::shared_lock<std::shared_mutex> lock(routes_mutex_);
+    for (const auto& route : routes_) {
+        route->reset_hits();
+        for (const auto& target : route->get_targets()) target->reset_selections();
+    }
 }
 
 RouterManager& RouterManager::instance() {
@@ -349,11 +700,11 @@ void RouterManager::register_router(const std::string& name,
 extern "C" {
 
 void* create_request_router() {
-    auto router = std::make_shared<ultrabalancer::RequestRouter>();
-    return router.get();
+    return new ultrabalancer::RequestRouter();
 }
 
 void destroy_request_router(void* router) {
+    delete static_cast<ultrabalancer::RequestRouter*>(router);
 }
 
 void router_add_route(void* router, const char* name, int priority) {
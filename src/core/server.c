@@ -51,9 +51,12 @@ void server_set_state(server_t *srv, int state) {
     srv->prev_state = srv->cur_state;
     srv->cur_state = state;
     srv->last_change = time(NULL);
+    if (srv->prev_state != state) proxy_servers_changed(srv->proxy);
 }
 
+/* maxconn 0 is unlimited */
 int server_is_usable(server_t *srv) {
+    int32_t max = atomic_load(&srv->max_conns);
     return srv->cur_state == SRV_RUNNING &&
-           atomic_load(&srv->cur_conns) < srv->max_conns;
+           (max == 0 || atomic_load(&srv->cur_conns) < max);
 }
\ No newline at end of file
@@ -0,0 +1,217 @@
+#include "database/db_cache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+db_cache_t* db_cache_create(const char* name, uint32_t max_size, uint32_t max_object_size) {
+    db_cache_t* cache = (db_cache_t*)calloc(1, sizeof(db_cache_t));
+    if (!cache) return NULL;
+
+    cache->store = cache_create(name, max_size, max_object_size);
+    if (!cache->store) {
+        free(cache);
+        return NULL;
+    }
+
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+void db_cache_destroy(db_cache_t* cache) {
+    if (!cache) return;
+
+    cache_destroy(cache->store);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+int db_cache_add_rule(db_cache_t* cache, const char* table, uint32_t ttl) {
+    if (!cache || !table || !*table) return -1;
+
+    const char* dot = strchr(table, '.');
+    size_t schema_len = dot ? (size_t)(dot - table) : 0;
+    const char* name = dot ? dot + 1 : table;
+    if (schema_len >= DB_CACHE_NAME_MAX || strlen(name) >= DB_CACHE_NAME_MAX || !*name) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+
+    uint32_t count = atomic_load_explicit(&cache->rule_count, memory_order_relaxed);
+    if (count == DB_CACHE_MAX_RULES) {
+        pthread_mutex_unlock(&cache->lock);
+        return -1;
+    }
+
+    // Filled in before the count publishes it
+    db_cache_rule_t* rule = &cache->rules[count];
+    memcpy(rule->schema, table, schema_len);
+    rule->schema[schema_len] = '\0';
+    strcpy(rule->table, name);
+    rule->ttl = ttl;
+    atomic_init(&rule->generation, 0);
+    atomic_store_explicit(&cache->rule_count, count + 1, memory_order_release);
+
+    pthread_mutex_unlock(&cache->lock);
+    return 0;
+}
+
+// Case-insensitive, with a trailing '*' in pattern matching any rest
+static bool db_cache_name_match(const char* pattern, const char* name, size_t len) {
+    size_t plen = strlen(pattern);
+    if (plen > 0 && pattern[plen - 1] == '*') {
+        return len >= plen - 1 && strncasecmp(pattern, name, plen - 1) == 0;
+    }
+    return len == plen && strncasecmp(pattern, name, len) == 0;
+}
+
+static bool db_cache_rule_match(const db_cache_rule_t* rule, const db_table_ref_t* ref) {
+    if (rule->schema[0] &&
+        (!ref->schema || !db_cache_name_match(rule->schema, ref->schema, ref->schema_length))) {
+        return false;
+    }
+    return db_cache_name_match(rule->table, ref->name, ref->name_length);
+}
+
+// Index of the first rule for ref, -1 when none matches
+static int db_cache_find_rule(db_cache_t* cache, uint32_t count, const db_table_ref_t* ref) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (db_cache_rule_match(&cache->rules[i], ref)) return (int)i;
+    }
+    return -1;
+}
+
+static bool db_cache_sql(const db_query_info_t* info) {
+    return (info->protocol == DB_PROTOCOL_POSTGRESQL || info->protocol == DB_PROTOCOL_MYSQL) &&
+           info->query_text && info->query_length > 0;
+}
+
+int db_cache_lookup(db_cache_t* cache, const db_query_info_t* info,
+                    const void* params, size_t params_length,
+                    db_cache_key_t* key, cache_entry_t** entry) {
+    if (!cache || !info || !key || !entry) return DB_CACHE_BYPASS;
+    *entry = NULL;
+
+    uint32_t count = atomic_load_explicit(&cache->rule_count, memory_order_acquire);
+    if (count == 0 || !db_cache_sql(info) || info->query_type != DB_QUERY_READ ||
+        info->hint == DB_HINT_PRIMARY) {
+        goto bypass;
+    }
+
+    db_table_ref_t tables[DB_CACHE_MAX_TABLES];
+    int ntables = db_protocol_query_tables(info->query_text, info->query_length,
+                                           tables, DB_CACHE_MAX_TABLES);
+    if (ntables <= 0) goto bypass;
+
+    // Every table must be covered, or a write to it would go unnoticed
+    uint64_t generations[DB_CACHE_MAX_TABLES];
+    key->ttl = UINT32_MAX;
+    for (int i = 0; i < ntables; i++) {
+        int r = db_cache_find_rule(cache, count, &tables[i]);
+        if (r < 0) goto bypass;
+
+        const db_cache_rule_t* rule = &cache->rules[r];
+        uint32_t ttl = rule->ttl ? rule->ttl : cache->store->max_age;
+        if (ttl < key->ttl) key->ttl = ttl;
+        generations[i] = atomic_load_explicit(&rule->generation, memory_order_acquire);
+    }
+
+    char text[CACHE_KEY_MAX];
+    size_t text_len = db_protocol_normalize_query(info->protocol, info->query_text,
+                                                  info->query_length, text, sizeof(text));
+    if (text_len == (size_t)-1) goto bypass;
+
+    uint8_t protocol = (uint8_t)info->protocol;
+    key->buf.len = 0;
+    if (cache_key_append(&key->buf, (const char*)&protocol, 1) < 0 ||
+        cache_key_append(&key->buf, text, text_len) < 0 ||
+        cache_key_append(&key->buf, (const char*)params, params ? params_length : 0) < 0 ||
+        cache_key_append(&key->buf, (const char*)generations,
+                         (size_t)ntables * sizeof(generations[0])) < 0) {
+        goto bypass;
+    }
+    cache_key_init(&key->key, key->buf.data, key->buf.len);
+
+    *entry = cache_lookup_key(cache->store, &key->key);
+    if (*entry) {
+        atomic_fetch_add_explicit(&cache->stats.hits, 1, memory_order_relaxed);
+        return DB_CACHE_HIT;
+    }
+    atomic_fetch_add_explicit(&cache->stats.misses, 1, memory_order_relaxed);
+    return DB_CACHE_MISS;
+
+bypass:
+    atomic_fetch_add_explicit(&cache->stats.bypassed, 1, memory_order_relaxed);
+    return DB_CACHE_BYPASS;
+}
+
+int db_cache_store(db_cache_t* cache, const db_cache_key_t* key,
+                   const void* response, size_t length) {
+    if (!cache || !key || !response || length == 0) return -1;
+    if (length > cache->store->max_object_size) return -1;
+
+    cache_entry_t* entry = (cache_entry_t*)calloc(1, sizeof(cache_entry_t));
+    if (!entry) return -1;
+
+    entry->data.ptr = (char*)malloc(length);
+    if (!entry->data.ptr) {
+        free(entry);
+        return -1;
+    }
+    memcpy(entry->data.ptr, response, length);
+    entry->data.len = length;
+    entry->data.alloc = length;
+    entry->size = (uint32_t)length;
+
+    entry->flags = CACHE_F_MAX_AGE;
+    entry->expires = time(NULL) + key->ttl;
+
+    if (cache_insert_key(cache->store, &key->key, entry) < 0) {
+        free(entry->key);
+        free(entry->data.ptr);
+        free(entry);
+        return -1;
+    }
+
+    atomic_fetch_add_explicit(&cache->stats.stores, 1, memory_order_relaxed);
+    return 0;
+}
+
+uint64_t db_cache_written_rules(db_cache_t* cache, const db_query_info_t* info) {
+    if (!cache || !info || !db_cache_sql(info)) return 0;
+
+    uint32_t count = atomic_load_explicit(&cache->rule_count, memory_order_acquire);
+    if (count == 0) return 0;
+
+    uint64_t all = count == DB_CACHE_MAX_RULES ? ~0ULL : (1ULL << count) - 1;
+    if (info->query_type != DB_QUERY_WRITE) {
+        // Unclassified statements (COPY, DO, VACUUM ...) may write anything
+        return info->query_type == DB_QUERY_UNKNOWN ? all : 0;
+    }
+
+    db_table_ref_t tables[DB_CACHE_MAX_TABLES];
+    int ntables = db_protocol_query_tables(info->query_text, info->query_length,
+                                           tables, DB_CACHE_MAX_TABLES);
+    if (ntables <= 0) return all;
+
+    // Every rule a table matches, not only the first one a read would use
+    uint64_t rules = 0;
+    for (int i = 0; i < ntables; i++) {
+        for (uint32_t r = 0; r < count; r++) {
+            if (db_cache_rule_match(&cache->rules[r], &tables[i])) rules |= 1ULL << r;
+        }
+    }
+    return rules;
+}
+
+void db_cache_invalidate(db_cache_t* cache, uint64_t rules) {
+    if (!cache || !rules) return;
+
+    for (uint32_t r = 0; r < DB_CACHE_MAX_RULES; r++) {
+        if (rules & (1ULL << r)) {
+            atomic_fetch_add_explicit(&cache->rules[r].generation, 1, memory_order_release);
+        }
+    }
+    atomic_fetch_add_explicit(&cache->stats.invalidations, 1, memory_order_relaxed);
+}
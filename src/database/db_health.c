@@ -1,17 +1,31 @@
 #include "database/db_health.h"
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <stdatomic.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <time.h>
 
 static void* db_health_check_thread(void* arg);
 
+// Lag is 0 while everything received has been replayed, so an idle primary
+// does not make its replicas look behind
+#define DB_HEALTH_PG_QUERY \
+    "SELECT CASE WHEN pg_last_wal_receive_lsn() = pg_last_wal_replay_lsn() THEN 0 " \
+    "ELSE (EXTRACT(EPOCH FROM now() - pg_last_xact_replay_timestamp()) * 1000)::bigint END, " \
+    "(pg_last_wal_replay_lsn() - '0/0')::bigint"
+#define DB_HEALTH_MYSQL_QUERY "SHOW REPLICA STATUS"
+#define DB_HEALTH_MYSQL_LEGACY_QUERY "SHOW SLAVE STATUS"
+#define DB_HEALTH_MYSQL_PARSE_ERROR 1064    // ER_PARSE_ERROR
+#define DB_HEALTH_REDIS_PING  "*1\r\n$4\r\nPING\r\n"
+
 db_health_checker_t* db_health_checker_create(db_pool_t* pool,
                                                 uint32_t check_interval_ms,
                                                 uint32_t timeout_ms,
@@ -22,14 +36,23 @@ db_health_checker_t* db_health_checker_create(db_pool_t* pool,
     if (!checker) return NULL;
 
     checker->pool = pool;
-    checker->check_interval_ms = check_interval_ms;
-    checker->timeout_ms = timeout_ms;
+    checker->check_interval_ms = check_interval_ms ? check_interval_ms : DB_HEALTH_INTERVAL_MS;
+    checker->timeout_ms = timeout_ms ? timeout_ms : DB_HEALTH_TIMEOUT_MS;
     checker->max_lag_ms = max_lag_ms;
+    strcpy(checker->user, DB_HEALTH_USER);
+    strcpy(checker->database, DB_HEALTH_DATABASE);
     atomic_store(&checker->running, false);
 
     return checker;
 }
 
+static void db_health_monitor_close(db_health_monitor_t* m) {
+    if (m->fd >= 0) close(m->fd);
+    m->fd = -1;
+    m->state = DB_MONITOR_DOWN;
+    m->in_len = 0;
+}
+
 void db_health_checker_destroy(db_health_checker_t* checker) {
     if (!checker) return;
 
@@ -37,9 +60,28 @@ void db_health_checker_destroy(db_health_checker_t* checker) {
         db_health_checker_stop(checker);
     }
 
+    for (uint32_t i = 0; i < checker->monitor_count; i++) {
+        db_health_monitor_close(&checker->monitors[i]);
+        free(checker->monitors[i].in);
+    }
+    free(checker->monitors);
     free(checker);
 }
 
+void db_health_checker_set_login(db_health_checker_t* checker, const char* user,
+                                 const char* database) {
+    if (!checker) return;
+
+    if (user) {
+        strncpy(checker->user, user, sizeof(checker->user) - 1);
+        checker->user[sizeof(checker->user) - 1] = '\0';
+    }
+    if (database) {
+        strncpy(checker->database, database, sizeof(checker->database) - 1);
+        checker->database[sizeof(checker->database) - 1] = '\0';
+    }
+}
+
 int db_health_checker_start(db_health_checker_t* checker) {
     if (!checker || atomic_load(&checker->running)) return -1;
 
@@ -107,41 +149,550 @@ static int db_health_check_tcp(const char* host, uint16_t port, uint32_t timeout
     return 0;
 }
 
-static uint64_t db_health_check_postgresql_lag(const char* host, uint16_t port) {
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (fd < 0) return UINT64_MAX;
+static uint64_t db_health_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static int db_health_monitor_init(db_health_monitor_t* m, const db_backend_t* backend) {
+    memset(m, 0, sizeof(*m));
+    m->in = (uint8_t*)malloc(DB_HEALTH_BUF_SIZE);
+    if (!m->in) return -1;
+
+    m->backend_id = backend->id;
+    memcpy(m->host, backend->host, sizeof(m->host));
+    m->port = backend->port;
+    m->role = backend->role;
+    m->protocol = backend->protocol;
+    m->fd = -1;
+    m->lag_ms = UINT64_MAX;
+    return 0;
+}
+
+// Monitors for backends added to the pool since the last round
+static void db_health_sync(db_health_checker_t* checker) {
+    uint32_t count = db_pool_backend_count(checker->pool);
+    if (count <= checker->monitor_count) return;
+
+    db_health_monitor_t* monitors = (db_health_monitor_t*)realloc(
+        checker->monitors, count * sizeof(db_health_monitor_t));
+    if (!monitors) return;
+    checker->monitors = monitors;
+
+    while (checker->monitor_count < count) {
+        db_backend_t backend;
+        if (db_pool_get_backend(checker->pool, checker->monitor_count + 1, &backend) < 0 ||
+            db_health_monitor_init(&monitors[checker->monitor_count], &backend) < 0) {
+            return;
+        }
+        checker->monitor_count++;
+    }
+}
 
+static int db_health_send(db_health_monitor_t* m, const void* data, size_t len) {
+    // Requests are a few hundred bytes on an otherwise idle socket
+    ssize_t sent = send(m->fd, data, len, MSG_NOSIGNAL);
+    return sent == (ssize_t)len ? 0 : -1;
+}
+
+static void db_health_put32be(uint8_t* p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static uint32_t db_health_get32be(const uint8_t* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static size_t db_health_put_str(uint8_t* p, const char* s) {
+    size_t n = strlen(s) + 1;
+    memcpy(p, s, n);
+    return n;
+}
+
+static int db_health_pg_startup(db_health_checker_t* checker, db_health_monitor_t* m) {
+    uint8_t msg[256];
+    size_t n = 8;
+
+    db_health_put32be(msg + 4, 196608);     // protocol 3.0
+    n += db_health_put_str(msg + n, "user");
+    n += db_health_put_str(msg + n, checker->user);
+    n += db_health_put_str(msg + n, "database");
+    n += db_health_put_str(msg + n, checker->database);
+    n += db_health_put_str(msg + n, "application_name");
+    n += db_health_put_str(msg + n, "ultrabalancer-health");
+    msg[n++] = '\0';
+    db_health_put32be(msg, (uint32_t)n);
+
+    return db_health_send(m, msg, n);
+}
+
+// HandshakeResponse41 with an empty auth response
+static int db_health_mysql_login(db_health_checker_t* checker, db_health_monitor_t* m,
+                                 uint8_t seq) {
+    // CLIENT_LONG_PASSWORD | PROTOCOL_41 | SECURE_CONNECTION | PLUGIN_AUTH
+    const uint32_t caps = 0x00000001 | 0x00000200 | 0x00008000 | 0x00080000;
+    uint8_t pkt[160];
+    size_t n = 4;
+
+    memset(pkt, 0, sizeof(pkt));
+    for (int i = 0; i < 4; i++) pkt[n++] = (uint8_t)(caps >> (8 * i));
+    pkt[n + 2] = 0x01;                      // max packet 16M
+    n += 4;
+    pkt[n++] = 33;                          // utf8_general_ci
+    n += 23;
+    n += db_health_put_str(pkt + n, checker->user);
+    pkt[n++] = 0;                           // no password
+    n += db_health_put_str(pkt + n, "mysql_native_password");
+
+    size_t len = n - 4;
+    pkt[0] = (uint8_t)len;
+    pkt[1] = (uint8_t)(len >> 8);
+    pkt[2] = (uint8_t)(len >> 16);
+    pkt[3] = seq;
+    return db_health_send(m, pkt, n);
+}
+
+static int db_health_mysql_send(db_health_monitor_t* m, uint8_t seq, uint8_t command,
+                                const char* text) {
+    uint8_t pkt[64];
+    size_t len = text ? strlen(text) : 0;
+    size_t n = 4;
+
+    if (command) pkt[n++] = command;
+    if (len + n > sizeof(pkt)) return -1;
+    if (len) memcpy(pkt + n, text, len);
+    n += len;
+
+    pkt[0] = (uint8_t)(n - 4);
+    pkt[1] = 0;
+    pkt[2] = 0;
+    pkt[3] = seq;
+    return db_health_send(m, pkt, n);
+}
+
+static int db_health_probe(db_health_monitor_t* m, uint64_t deadline) {
+    m->state = DB_MONITOR_PROBING;
+    m->deadline_ms = deadline;
+    m->step = 0;
+    m->columns = 0;
+    m->column = 0;
+    m->lag_column = -1;
+    m->lag_ms = m->role == DB_BACKEND_REPLICA ? UINT64_MAX : 0;
+    m->position = 0;
+
+    switch (m->protocol) {
+        case DB_PROTOCOL_POSTGRESQL: {
+            uint8_t msg[512];
+            size_t len = sizeof(DB_HEALTH_PG_QUERY);
+            msg[0] = 'Q';
+            db_health_put32be(msg + 1, (uint32_t)len + 4);
+            memcpy(msg + 5, DB_HEALTH_PG_QUERY, len);
+            return db_health_send(m, msg, len + 5);
+        }
+        case DB_PROTOCOL_MYSQL:
+            return db_health_mysql_send(m, 0, 0x03, m->mysql_slave_status ?
+                                        DB_HEALTH_MYSQL_LEGACY_QUERY : DB_HEALTH_MYSQL_QUERY);
+        case DB_PROTOCOL_REDIS:
+            return db_health_send(m, DB_HEALTH_REDIS_PING, sizeof(DB_HEALTH_REDIS_PING) - 1);
+        default:
+            return -1;
+    }
+}
+
+static int db_health_connected(db_health_checker_t* checker, db_health_monitor_t* m,
+                               uint64_t deadline) {
+    int flag = 1;
+    setsockopt(m->fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+    m->state = DB_MONITOR_STARTUP;
+    m->step = 0;
+    switch (m->protocol) {
+        case DB_PROTOCOL_POSTGRESQL:
+            return db_health_pg_startup(checker, m);
+        case DB_PROTOCOL_MYSQL:
+            return 0;   // the server speaks first
+        default:
+            return db_health_probe(m, deadline);
+    }
+}
+
+static int db_health_dial(db_health_checker_t* checker, db_health_monitor_t* m,
+                          uint64_t deadline) {
     struct sockaddr_in addr;
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
+    addr.sin_port = htons(m->port);
+    if (inet_pton(AF_INET, m->host, &addr.sin_addr) <= 0) return -1;
 
-    if (inet_pton(AF_INET, host, &addr.sin_addr) <= 0) {
-        close(fd);
-        return UINT64_MAX;
+    m->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (m->fd < 0) return -1;
+
+    m->in_len = 0;
+    m->deadline_ms = deadline;
+
+    if (connect(m->fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+        return db_health_connected(checker, m, deadline);
     }
+    if (errno != EINPROGRESS) return -1;
 
-    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        close(fd);
-        return UINT64_MAX;
+    m->state = DB_MONITOR_CONNECTING;
+    return 0;
+}
+
+// The probe's answer is in: hand it to the pool
+static void db_health_publish(db_health_checker_t* checker, db_health_monitor_t* m) {
+    m->state = DB_MONITOR_READY;
+    if (!checker->pool) return;
+
+    atomic_fetch_add_explicit(&checker->stats.probes, 1, memory_order_relaxed);
+
+    bool healthy = true;
+    if (m->role == DB_BACKEND_REPLICA) {
+        db_pool_set_replica_state(checker->pool, m->backend_id, m->lag_ms, m->position);
+        healthy = m->lag_ms <= checker->max_lag_ms;
     }
+    db_pool_set_backend_health(checker->pool, m->backend_id, healthy);
+}
 
-    const char* query = "SELECT EXTRACT(EPOCH FROM (now() - pg_last_xact_replay_timestamp())) * 1000;";
-    ssize_t sent = send(fd, query, strlen(query), 0);
+static void db_health_fail(db_health_checker_t* checker, db_health_monitor_t* m) {
+    db_health_monitor_close(m);
+    m->lag_ms = UINT64_MAX;
+    if (!checker->pool) return;
 
-    if (sent <= 0) {
-        close(fd);
-        return 0;
+    atomic_fetch_add_explicit(&checker->stats.failures, 1, memory_order_relaxed);
+    db_pool_set_backend_health(checker->pool, m->backend_id, false);
+}
+
+static uint64_t db_health_parse_uint(const uint8_t* p, size_t len) {
+    uint64_t v = 0;
+    if (len == 0 || p[0] == '-') return 0;     // clocks a little apart
+    for (size_t i = 0; i < len && p[i] >= '0' && p[i] <= '9'; i++) {
+        v = v * 10 + (uint64_t)(p[i] - '0');
     }
+    return v;
+}
 
-    close(fd);
-    return 0;
+// DataRow: the lag and the replay LSN, either may be NULL
+static void db_health_pg_row(db_health_monitor_t* m, const uint8_t* body, size_t len) {
+    if (len < 2) return;
+    uint16_t fields = (uint16_t)(body[0] << 8 | body[1]);
+    size_t off = 2;
+
+    for (uint16_t i = 0; i < fields && i < 2 && off + 4 <= len; i++) {
+        int32_t flen = (int32_t)db_health_get32be(body + off);
+        off += 4;
+        if (flen < 0) continue;
+        if (off + (size_t)flen > len) return;
+
+        uint64_t v = db_health_parse_uint(body + off, (size_t)flen);
+        if (i == 0) m->lag_ms = v;
+        else m->position = v;
+        off += (size_t)flen;
+    }
 }
 
-static uint64_t db_health_check_mysql_lag(const char* host, uint16_t port) {
-    (void)host;
-    (void)port;
-    return UINT64_MAX;
+static int db_health_pg_message(db_health_checker_t* checker, db_health_monitor_t* m,
+                                uint8_t type, const uint8_t* body, size_t len,
+                                uint64_t deadline) {
+    switch (type) {
+        case 'R':
+            // Only AuthenticationOk: the monitor user logs in without a password
+            return len >= 4 && db_health_get32be(body) == 0 ? 0 : -1;
+        case 'E':
+            return -1;
+        case 'D':
+            if (m->state == DB_MONITOR_PROBING) db_health_pg_row(m, body, len);
+            return 0;
+        case 'Z':
+            if (m->state == DB_MONITOR_STARTUP) return db_health_probe(m, deadline);
+            db_health_publish(checker, m);
+            return 0;
+        default:
+            return 0;   // ParameterStatus, BackendKeyData, RowDescription, ...
+    }
+}
+
+// Length-encoded integer; NULL past the end
+static const uint8_t* db_health_lenenc(const uint8_t* p, const uint8_t* end, uint64_t* v,
+                                       bool* null) {
+    if (p >= end) return NULL;
+    *null = false;
+
+    uint8_t first = *p++;
+    size_t bytes = 0;
+    if (first < 0xfb) {
+        *v = first;
+        return p;
+    }
+    if (first == 0xfb) {
+        *null = true;
+        *v = 0;
+        return p;
+    }
+    bytes = first == 0xfc ? 2 : first == 0xfd ? 3 : 8;
+    if (p + bytes > end) return NULL;
+
+    *v = 0;
+    for (size_t i = 0; i < bytes; i++) *v |= (uint64_t)p[i] << (8 * i);
+    return p + bytes;
+}
+
+// Column definition: catalog, schema, table, org_table, then the name
+static bool db_health_mysql_lag_column(const uint8_t* p, size_t len) {
+    const uint8_t* end = p + len;
+    uint64_t n = 0;
+    bool null;
+
+    for (int i = 0; i < 5; i++) {
+        p = db_health_lenenc(p, end, &n, &null);
+        if (!p || (uint64_t)(end - p) < n) return false;
+        if (i < 4) p += n;
+    }
+    return (n == 21 && memcmp(p, "Seconds_Behind_Source", 21) == 0) ||
+           (n == 21 && memcmp(p, "Seconds_Behind_Master", 21) == 0);
+}
+
+static void db_health_mysql_row(db_health_monitor_t* m, const uint8_t* p, size_t len) {
+    const uint8_t* end = p + len;
+    uint64_t n = 0;
+    bool null = true;
+
+    if (m->lag_column < 0) return;
+    for (int i = 0; i <= m->lag_column; i++) {
+        p = db_health_lenenc(p, end, &n, &null);
+        if (!p || (uint64_t)(end - p) < n) return;
+        if (i < m->lag_column) p += n;
+    }
+    // NULL while the SQL thread is stopped: lag stays unknown
+    if (!null) m->lag_ms = db_health_parse_uint(p, n) * 1000;
+}
+
+// Server version from the initial handshake: SHOW REPLICA STATUS came with
+// MySQL 8.0.22 and MariaDB 10.5.1. MariaDB may announce itself as
+// "5.5.5-10.x.y-MariaDB" for old clients.
+static bool db_health_mysql_legacy(const uint8_t* p, size_t len) {
+    char version[64];
+    size_t n = 0;
+    while (n < len && n < sizeof(version) - 1 && p[n]) {
+        version[n] = (char)p[n];
+        n++;
+    }
+    version[n] = '\0';
+
+    const char* v = version;
+    bool mariadb = strstr(version, "MariaDB") != NULL;
+    if (mariadb && strncmp(v, "5.5.5-", 6) == 0) v += 6;
+
+    unsigned major = 0, minor = 0, patch = 0;
+    if (sscanf(v, "%u.%u.%u", &major, &minor, &patch) < 2) return false;
+
+    uint32_t have = major << 16 | minor << 8 | patch;
+    uint32_t since = mariadb ? (10u << 16 | 5u << 8 | 1u) : (8u << 16 | 0u << 8 | 22u);
+    return have < since;
+}
+
+static int db_health_mysql_packet(db_health_checker_t* checker, db_health_monitor_t* m,
+                                  uint8_t seq, const uint8_t* p, size_t len,
+                                  uint64_t deadline) {
+    if (len == 0) return -1;
+    bool eof = p[0] == 0xfe && len < 9;
+
+    if (m->state == DB_MONITOR_STARTUP) {
+        if (p[0] == 0xff) return -1;
+        if (m->step == 0) {
+            // Initial handshake, protocol 10
+            if (p[0] != 10) return -1;
+            m->mysql_slave_status = db_health_mysql_legacy(p + 1, len - 1);
+            m->step = 1;
+            return db_health_mysql_login(checker, m, (uint8_t)(seq + 1));
+        }
+        if (p[0] == 0x00) return db_health_probe(m, deadline);
+        if (p[0] == 0xfe) {
+            // Auth switch: the empty password again, for the new plugin
+            return db_health_mysql_send(m, (uint8_t)(seq + 1), 0, NULL);
+        }
+        // caching_sha2_password: 0x01 0x03 is fast auth done, 0x04 wants the password
+        return (p[0] == 0x01 && len >= 2 && p[1] == 0x03) ? 0 : -1;
+    }
+
+    switch (m->step) {
+        case 0: {
+            // Column count, or an OK/ERR without a result set
+            if (p[0] == 0xff) {
+                // A version string that does not tell, the old name then
+                uint16_t code = len >= 3 ? (uint16_t)(p[1] | p[2] << 8) : 0;
+                if (code != DB_HEALTH_MYSQL_PARSE_ERROR || m->mysql_slave_status) return -1;
+                m->mysql_slave_status = true;
+                return db_health_mysql_send(m, 0, 0x03, DB_HEALTH_MYSQL_LEGACY_QUERY);
+            }
+            if (p[0] == 0x00) {
+                db_health_publish(checker, m);
+                return 0;
+            }
+            uint64_t n;
+            bool null;
+            if (!db_health_lenenc(p, p + len, &n, &null) || n == 0) return -1;
+            m->columns = (uint32_t)n;
+            m->step = 1;
+            return 0;
+        }
+        case 1:
+            if (db_health_mysql_lag_column(p, len)) m->lag_column = (int)m->column;
+            if (++m->column == m->columns) m->step = 2;
+            return 0;
+        case 2:
+            // EOF after the column definitions
+            if (!eof) return -1;
+            m->step = 3;
+            return 0;
+        default:
+            if (p[0] == 0xff) return -1;
+            if (eof) {
+                // Not replicating at all: a primary, or lag unknown
+                db_health_publish(checker, m);
+                return 0;
+            }
+            db_health_mysql_row(m, p, len);
+            return 0;
+    }
+}
+
+// Everything complete in the buffer; -1 when the monitor has to go down
+static int db_health_parse(db_health_checker_t* checker, db_health_monitor_t* m,
+                           uint64_t deadline) {
+    size_t off = 0;
+    int rc = 0;
+
+    while (rc == 0 && (m->state == DB_MONITOR_STARTUP || m->state == DB_MONITOR_PROBING)) {
+        const uint8_t* p = m->in + off;
+        size_t avail = m->in_len - off;
+
+        if (m->protocol == DB_PROTOCOL_POSTGRESQL) {
+            if (avail < 5) break;
+            uint32_t len = db_health_get32be(p + 1);
+            if (len < 4 || len + 1 > DB_HEALTH_BUF_SIZE) return -1;
+            if (avail < len + 1) break;
+            rc = db_health_pg_message(checker, m, p[0], p + 5, len - 4, deadline);
+            off += len + 1;
+        } else if (m->protocol == DB_PROTOCOL_MYSQL) {
+            if (avail < 4) break;
+            size_t len = (size_t)p[0] | (size_t)p[1] << 8 | (size_t)p[2] << 16;
+            if (len + 4 > DB_HEALTH_BUF_SIZE) return -1;
+            if (avail < len + 4) break;
+            rc = db_health_mysql_packet(checker, m, p[3], p + 4, len, deadline);
+            off += len + 4;
+        } else {
+            // Redis: any one-line reply means it is serving
+            const uint8_t* nl = memchr(p, '\n', avail);
+            if (!nl) break;
+            db_health_publish(checker, m);
+            off += (size_t)(nl - p) + 1;
+        }
+    }
+
+    memmove(m->in, m->in + off, m->in_len - off);
+    m->in_len -= off;
+    return rc;
+}
+
+static int db_health_readable(db_health_checker_t* checker, db_health_monitor_t* m,
+                              uint64_t deadline) {
+    for (;;) {
+        if (m->in_len == DB_HEALTH_BUF_SIZE) return -1;
+        ssize_t n = recv(m->fd, m->in + m->in_len, DB_HEALTH_BUF_SIZE - m->in_len, 0);
+        if (n > 0) {
+            m->in_len += (size_t)n;
+            continue;
+        }
+        if (n == 0) return -1;
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+        return -1;
+    }
+    return db_health_parse(checker, m, deadline);
+}
+
+static bool db_health_pending(const db_health_monitor_t* m) {
+    return m->state == DB_MONITOR_CONNECTING || m->state == DB_MONITOR_STARTUP ||
+           m->state == DB_MONITOR_PROBING;
+}
+
+/*
+ * One round over monitors: dial the ones that are down, send every probe,
+ * then poll them all until each has answered or timed out. A connection
+ * dialled in the round logs in and is probed in the same round.
+ */
+static void db_health_round(db_health_checker_t* checker, db_health_monitor_t* monitors,
+                            uint32_t count) {
+    uint64_t now = db_health_now_ms();
+    uint64_t deadline = now + checker->timeout_ms;
+
+    for (uint32_t i = 0; i < count; i++) {
+        db_health_monitor_t* m = &monitors[i];
+        int rc;
+        if (m->state == DB_MONITOR_DOWN) {
+            atomic_fetch_add_explicit(&checker->stats.reconnects, 1, memory_order_relaxed);
+            rc = db_health_dial(checker, m, deadline);
+        } else {
+            rc = db_health_probe(m, deadline);
+        }
+        if (rc < 0) db_health_fail(checker, m);
+    }
+
+    struct pollfd* fds = (struct pollfd*)malloc(count * sizeof(struct pollfd));
+    uint32_t* index = (uint32_t*)malloc(count * sizeof(uint32_t));
+    if (!fds || !index) {
+        free(fds);
+        free(index);
+        return;
+    }
+
+    while (atomic_load(&checker->running) || !checker->pool) {
+        nfds_t nfds = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            if (!db_health_pending(&monitors[i])) continue;
+            fds[nfds].fd = monitors[i].fd;
+            fds[nfds].events = monitors[i].state == DB_MONITOR_CONNECTING ? POLLOUT : POLLIN;
+            fds[nfds].revents = 0;
+            index[nfds++] = i;
+        }
+        if (nfds == 0) break;
+
+        now = db_health_now_ms();
+        int wait = deadline > now ? (int)(deadline - now) : 0;
+        int ready = poll(fds, nfds, wait);
+        if (ready < 0 && errno != EINTR) break;
+
+        for (nfds_t k = 0; ready > 0 && k < nfds; k++) {
+            if (!fds[k].revents) continue;
+            db_health_monitor_t* m = &monitors[index[k]];
+            int rc;
+
+            if (m->state == DB_MONITOR_CONNECTING) {
+                int error = 0;
+                socklen_t len = sizeof(error);
+                rc = (getsockopt(m->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error) ?
+                     -1 : db_health_connected(checker, m, deadline);
+            } else {
+                rc = db_health_readable(checker, m, deadline);
+            }
+            if (rc < 0) db_health_fail(checker, m);
+        }
+
+        now = db_health_now_ms();
+        for (uint32_t i = 0; i < count; i++) {
+            if (db_health_pending(&monitors[i]) && now >= monitors[i].deadline_ms) {
+                db_health_fail(checker, &monitors[i]);
+            }
+        }
+    }
+
+    free(fds);
+    free(index);
 }
 
 int db_health_check_backend(db_backend_t* backend) {
@@ -167,22 +718,21 @@ uint64_t db_health_check_replication_lag(db_backend_t* backend) {
         return 0;
     }
 
-    uint64_t lag = 0;
+    // A round of its own over one monitor, reporting to no pool
+    db_health_checker_t checker;
+    memset(&checker, 0, sizeof(checker));
+    checker.timeout_ms = DB_HEALTH_TIMEOUT_MS;
+    strcpy(checker.user, DB_HEALTH_USER);
+    strcpy(checker.database, DB_HEALTH_DATABASE);
 
-    switch (backend->protocol) {
-        case DB_PROTOCOL_POSTGRESQL:
-            lag = db_health_check_postgresql_lag(backend->host, backend->port);
-            break;
-        case DB_PROTOCOL_MYSQL:
-            lag = db_health_check_mysql_lag(backend->host, backend->port);
-            break;
-        case DB_PROTOCOL_REDIS:
-            lag = 0;
-            break;
-        default:
-            lag = 0;
-            break;
-    }
+    db_health_monitor_t m;
+    if (db_health_monitor_init(&m, backend) < 0) return UINT64_MAX;
+
+    db_health_round(&checker, &m, 1);
+    uint64_t lag = m.state == DB_MONITOR_READY ? m.lag_ms : UINT64_MAX;
+
+    db_health_monitor_close(&m);
+    free(m.in);
 
     backend->replication_lag_ms = lag;
     return lag;
@@ -192,35 +742,16 @@ static void* db_health_check_thread(void* arg) {
     db_health_checker_t* checker = (db_health_checker_t*)arg;
 
     while (atomic_load(&checker->running)) {
-        pthread_mutex_t* mutex = (pthread_mutex_t*)checker->pool->mutex;
-        pthread_mutex_lock(mutex);
-
-        db_backend_t* backend = checker->pool->backends;
-        while (backend) {
-            db_backend_t* next = backend->next;
-            pthread_mutex_unlock(mutex);
-
-            int health_result = db_health_check_backend(backend);
-
-            if (backend->role == DB_BACKEND_REPLICA && health_result == 0) {
-                uint64_t lag = db_health_check_replication_lag(backend);
-
-                pthread_mutex_lock(mutex);
-                if (lag > checker->max_lag_ms && backend->is_healthy) {
-                    backend->is_healthy = false;
-                } else if (lag <= checker->max_lag_ms && !backend->is_healthy) {
-                    backend->is_healthy = true;
-                }
-                pthread_mutex_unlock(mutex);
-            }
-
-            pthread_mutex_lock(mutex);
-            backend = next;
-        }
+        uint64_t start = db_health_now_ms();
 
-        pthread_mutex_unlock(mutex);
+        db_health_sync(checker);
+        db_health_round(checker, checker->monitors, checker->monitor_count);
+        atomic_fetch_add_explicit(&checker->stats.rounds, 1, memory_order_relaxed);
 
-        usleep(checker->check_interval_ms * 1000);
+        uint64_t elapsed = db_health_now_ms() - start;
+        if (elapsed < checker->check_interval_ms) {
+            usleep((useconds_t)(checker->check_interval_ms - elapsed) * 1000);
+        }
     }
 
     return NULL;
@@ -6,6 +6,7 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <errno.h>
 #include <cstring>
 #include <algorithm>
@@ -14,16 +15,22 @@
 namespace ultrabalancer {
 namespace database {
 
-Connection::Connection(int fd, db_protocol_type_t protocol, uint64_t backend_id)
+Connection::Connection(int fd, db_protocol_type_t protocol, uint64_t backend_id,
+                       LivenessWatcher* watcher)
     : fd_(fd),
       protocol_(protocol),
       backend_id_(backend_id),
       in_transaction_(false),
       created_at_(std::chrono::steady_clock::now()),
       last_used_(std::chrono::steady_clock::now()),
-      state_(ConnectionState::Idle) {}
+      state_(ConnectionState::Idle),
+      watcher_(watcher),
+      watch_slot_(LivenessWatcher::kNoSlot) {
+    if (watcher_) watch_slot_ = watcher_->watch(fd_);
+}
 
 Connection::~Connection() {
+    if (watch_slot_ != LivenessWatcher::kNoSlot) watcher_->unwatch(watch_slot_);
     if (fd_ >= 0) {
         close(fd_);
     }
@@ -36,12 +43,16 @@ Connection::Connection(Connection&& other) noexcept
       in_transaction_(other.in_transaction_),
       created_at_(other.created_at_),
       last_used_(other.last_used_),
-      state_(other.state_) {
+      state_(other.state_),
+      watcher_(other.watcher_),
+      watch_slot_(other.watch_slot_) {
     other.fd_ = -1;
+    other.watch_slot_ = LivenessWatcher::kNoSlot;
 }
 
 Connection& Connection::operator=(Connection&& other) noexcept {
     if (this != &other) {
+        if (watch_slot_ != LivenessWatcher::kNoSlot) watcher_->unwatch(watch_slot_);
         if (fd_ >= 0) {
             close(fd_);
         }
@@ -52,13 +63,17 @@ Connection& Connection::operator=(Connection&& other) noexcept {
         created_at_ = other.created_at_;
         last_used_ = other.last_used_;
         state_ = other.state_;
+        watcher_ = other.watcher_;
+        watch_slot_ = other.watch_slot_;
         other.fd_ = -1;
+        other.watch_slot_ = LivenessWatcher::kNoSlot;
     }
     return *this;
 }
 
 bool Connection::is_valid() const noexcept {
     if (fd_ < 0) return false;
+    if (watch_slot_ != LivenessWatcher::kNoSlot) return watcher_->alive(watch_slot_);
 
     int error = 0;
     socklen_t len = sizeof(error);
@@ -84,6 +99,7 @@ void Connection::mark_used() noexcept {
 
 bool Connection::validate() {
     if (!is_valid()) return false;
+    if (watch_slot_ != LivenessWatcher::kNoSlot) return true;
 
     char buf;
     int result = recv(fd_, &buf, 1, MSG_PEEK | MSG_DONTWAIT);
@@ -101,7 +117,26 @@ Backend::Backend(uint64_t id, std::string host, uint16_t port,
       role_(role),
       protocol_(protocol) {}
 
-expected<int, std::string> Backend::create_connection() {
+static uint64_t monotonic_ms() noexcept {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Backend::set_replication_lag(uint64_t lag_ms) noexcept {
+    replication_lag_ms_.store(lag_ms);
+
+    uint64_t now = monotonic_ms();
+    replayed_until_ms_.store(lag_ms < now ? now - lag_ms : 0);
+}
+
+bool Backend::caught_up(const db_causal_t& causal) const noexcept {
+    if (causal.position) {
+        return replay_position() >= causal.position;
+    }
+    return replayed_until_ms() >= causal.written_ms;
+}
+
+expected<int, std::string> Backend::start_connection() {
     int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
     if (fd < 0) {
         return make_unexpected(std::string("Failed to create socket: ") + strerror(errno));
@@ -126,23 +161,34 @@ expected<int, std::string> Backend::create_connection() {
         return make_unexpected(std::string("Connection failed: ") + strerror(errno));
     }
 
-    fd_set write_fds;
-    FD_ZERO(&write_fds);
-    FD_SET(fd, &write_fds);
+    return fd;
+}
 
-    struct timeval timeout;
-    timeout.tv_sec = 5;
-    timeout.tv_usec = 0;
+// 0 once a started connect has succeeded, else why it failed
+static int connect_error(int fd) noexcept {
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) return errno;
+    return error;
+}
 
-    result = select(fd + 1, nullptr, &write_fds, nullptr, &timeout);
+expected<int, std::string> Backend::create_connection() {
+    auto started = start_connection();
+    if (!started) return started;
+    int fd = started.value();
+
+    struct pollfd pfd = { fd, POLLOUT, 0 };
+    int result;
+    do {
+        result = poll(&pfd, 1, DB_POOL_CONNECT_TIMEOUT_MS);
+    } while (result < 0 && errno == EINTR);
     if (result <= 0) {
         close(fd);
         return make_unexpected(std::string("Connection timeout"));
     }
 
-    int error = 0;
-    socklen_t len = sizeof(error);
-    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
+    int error = connect_error(fd);
+    if (error != 0) {
         close(fd);
         return make_unexpected(std::string("Connection error: ") + strerror(error));
     }
@@ -150,142 +196,422 @@ expected<int, std::string> Backend::create_connection() {
     return fd;
 }
 
+IdleRing::IdleRing(uint32_t capacity) {
+    // With one cell, a full cell's seq is also what the next push waits for
+    uint64_t n = 2;
+    while (n < capacity) n <<= 1;
+
+    cells_ = std::make_unique<Cell[]>(n);
+    mask_ = n - 1;
+    for (uint64_t i = 0; i < n; i++) {
+        cells_[i].seq.store(i, std::memory_order_relaxed);
+        cells_[i].conn = nullptr;
+    }
+}
+
+// A cell is free for the push at position p when its seq is p, and holds
+// the connection for the pop at p once seq is p + 1
+bool IdleRing::push(Connection* conn) noexcept {
+    uint64_t pos = tail_.load(std::memory_order_relaxed);
+    for (;;) {
+        Cell& cell = cells_[pos & mask_];
+        uint64_t seq = cell.seq.load(std::memory_order_acquire);
+        int64_t diff = (int64_t)(seq - pos);
+        if (diff == 0) {
+            if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                cell.conn = conn;
+                cell.seq.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = tail_.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+Connection* IdleRing::pop() noexcept {
+    uint64_t pos = head_.load(std::memory_order_relaxed);
+    for (;;) {
+        Cell& cell = cells_[pos & mask_];
+        uint64_t seq = cell.seq.load(std::memory_order_acquire);
+        int64_t diff = (int64_t)(seq - (pos + 1));
+        if (diff == 0) {
+            if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                Connection* conn = cell.conn;
+                cell.seq.store(pos + mask_ + 1, std::memory_order_release);
+                return conn;
+            }
+        } else if (diff < 0) {
+            return nullptr;
+        } else {
+            pos = head_.load(std::memory_order_relaxed);
+        }
+    }
+}
+
 DatabasePool::DatabasePool(uint32_t max_connections, uint32_t min_idle, uint32_t max_idle,
                            std::chrono::seconds max_lifetime, std::chrono::seconds idle_timeout)
     : max_connections_(max_connections),
       min_idle_(min_idle),
       max_idle_(max_idle),
       max_lifetime_(max_lifetime),
-      idle_timeout_(idle_timeout) {}
+      idle_timeout_(idle_timeout) {
+    sets_.push_back(std::make_unique<BackendSet>());
+    backend_set_.store(sets_.back().get(), std::memory_order_release);
+
+    if (min_idle_ > 0) {
+        maintainer_ = std::thread([this] { maintain(); });
+    }
+}
 
 DatabasePool::~DatabasePool() {
-    std::unique_lock lock(mutex_);
-    idle_connections_.clear();
+    if (maintainer_.joinable()) {
+        {
+            std::lock_guard lock(maintain_mutex_);
+            stopping_ = true;
+        }
+        maintain_cv_.notify_all();
+        maintainer_.join();
+    }
+    watcher_.stop();
+    for (auto& shard : shards_) {
+        while (Connection* conn = shard->idle.pop()) {
+            delete conn;
+        }
+    }
 }
 
 uint64_t DatabasePool::add_backend(const std::string& host, uint16_t port,
                                     BackendRole role, db_protocol_type_t protocol) {
-    std::unique_lock lock(mutex_);
+    std::lock_guard lock(config_mutex_);
 
-    uint64_t id = next_backend_id_.fetch_add(1);
-    auto backend = std::make_unique<Backend>(id, host, port, role, protocol);
-    backends_.push_back(std::move(backend));
+    uint64_t id = shards_.size() + 1;
+    shards_.push_back(std::make_unique<Shard>(
+        std::make_unique<Backend>(id, host, port, role, protocol), max_idle_));
+
+    auto set = std::make_unique<BackendSet>(*backend_set());
+    set->shards.push_back(shards_.back().get());
+    backend_set_.store(set.get(), std::memory_order_release);
+    sets_.push_back(std::move(set));
 
     return id;
 }
 
+DatabasePool::Shard* DatabasePool::get_shard(const BackendSet* set, uint64_t id) const noexcept {
+    if (id == 0 || id > set->shards.size()) return nullptr;
+    return set->shards[id - 1];
+}
+
+Connection* DatabasePool::pop_idle(Shard* shard) noexcept {
+    Connection* conn = shard->idle.pop();
+    if (conn) shard->idle_count.fetch_sub(1, std::memory_order_relaxed);
+    return conn;
+}
+
+bool DatabasePool::push_idle(Shard* shard, Connection* conn) noexcept {
+    if (shard->idle_count.fetch_add(1, std::memory_order_relaxed) >= max_idle_ ||
+        !shard->idle.push(conn)) {
+        shard->idle_count.fetch_sub(1, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+void DatabasePool::close_connection(std::unique_ptr<Connection> conn) noexcept {
+    conn.reset();
+    total_connections_.fetch_sub(1);
+    stats_.total_closed.fetch_add(1);
+}
+
 expected<std::unique_ptr<Connection>, std::string>
 DatabasePool::acquire(db_query_type_t query_type, bool in_transaction,
-                      std::optional<uint64_t> session_backend_id) {
-    std::unique_lock lock(mutex_);
-
+                      std::optional<uint64_t> session_backend_id,
+                      const db_causal_t* causal) {
+    const BackendSet* set = backend_set();
     Backend* backend = nullptr;
 
     if (session_backend_id.has_value()) {
-        backend = get_backend_by_id(session_backend_id.value());
+        Shard* shard = get_shard(set, session_backend_id.value());
+        backend = shard ? shard->backend.get() : nullptr;
         if (!backend || !backend->is_healthy()) {
             return make_unexpected(std::string("Session backend unavailable"));
         }
     } else {
-        auto opt_backend = select_backend(query_type);
-        if (!opt_backend) {
+        // Picked from the set loaded above so the shard lookup below
+        // cannot miss a backend that add_backend published meanwhile
+        backend = select_backend(set, query_type, causal);
+        if (!backend) {
             return make_unexpected(std::string("No healthy backend available"));
         }
-        backend = *opt_backend;
     }
 
-    auto& conns = idle_connections_[backend->id()];
+    Shard* shard = get_shard(set, backend->id());
 
-    while (!conns.empty()) {
-        auto conn = std::move(conns.back());
-        conns.pop_back();
+    while (Connection* idle = pop_idle(shard)) {
+        std::unique_ptr<Connection> conn(idle);
 
+        // A flag, not a syscall, for watched connections
         if (conn->validate() && conn->age() < max_lifetime_) {
             conn->mark_used();
             conn->set_transaction(in_transaction);
             backend->increment_connections();
             stats_.total_acquired.fetch_add(1);
             return conn;
-        } else {
-            stats_.total_closed.fetch_add(1);
         }
+        close_connection(std::move(conn));
     }
 
-    if (total_connections_.load() >= max_connections_) {
+    // Reserve the slot first so that racing acquires cannot overshoot
+    if (total_connections_.fetch_add(1) >= max_connections_) {
+        total_connections_.fetch_sub(1);
         return make_unexpected(std::string("Connection pool exhausted"));
     }
 
     auto conn = create_new_connection(backend);
-    if (conn) {
-        conn->set_transaction(in_transaction);
-        backend->increment_connections();
-        total_connections_.fetch_add(1);
-        stats_.total_created.fetch_add(1);
-        stats_.total_acquired.fetch_add(1);
+    if (!conn) {
+        total_connections_.fetch_sub(1);
+        return make_unexpected(std::string("Failed to connect to backend"));
     }
 
+    conn->set_transaction(in_transaction);
+    backend->increment_connections();
+    stats_.total_created.fetch_add(1);
+    stats_.total_acquired.fetch_add(1);
+
     return conn;
 }
 
 void DatabasePool::release(std::unique_ptr<Connection> conn) {
     if (!conn) return;
 
-    std::unique_lock lock(mutex_);
-
-    auto* backend = get_backend_by_id(conn->backend_id());
-    if (backend) {
-        backend->decrement_connections();
+    Shard* shard = get_shard(backend_set(), conn->backend_id());
+    if (!shard) {
+        close_connection(std::move(conn));
+        return;
     }
+    shard->backend->decrement_connections();
 
     // Check both idle time and age to ensure connections don't become stale
     if (!conn->validate() || conn->idle_time() > idle_timeout_ || conn->age() > max_lifetime_) {
-        total_connections_.fetch_sub(1);
-        stats_.total_closed.fetch_add(1);
+        close_connection(std::move(conn));
         return;
     }
 
-    auto& conns = idle_connections_[conn->backend_id()];
-    if (conns.size() < max_idle_) {
-        conn->set_transaction(false);
-        conns.push_back(std::move(conn));
+    conn->set_transaction(false);
+    if (push_idle(shard, conn.get())) {
+        conn.release();
         stats_.total_released.fetch_add(1);
     } else {
-        total_connections_.fetch_sub(1);
-        stats_.total_closed.fetch_add(1);
+        close_connection(std::move(conn));
+    }
+}
+
+void DatabasePool::discard(std::unique_ptr<Connection> conn) {
+    if (!conn) return;
+
+    if (Backend* backend = get_backend_by_id(conn->backend_id())) {
+        backend->decrement_connections();
     }
+    close_connection(std::move(conn));
 }
 
-std::optional<Backend*> DatabasePool::select_backend(db_query_type_t query_type) {
+std::optional<Backend*> DatabasePool::select_backend(db_query_type_t query_type,
+                                                     const db_causal_t* causal) {
+    Backend* backend = select_backend(backend_set(), query_type, causal);
+    if (!backend) return std::nullopt;
+    return backend;
+}
+
+Backend* DatabasePool::select_backend(const BackendSet* set, db_query_type_t query_type,
+                                      const db_causal_t* causal) {
     switch (query_type) {
         case DB_QUERY_WRITE:
         case DB_QUERY_TRANSACTION_BEGIN:
         case DB_QUERY_SESSION_VAR:
-            return select_primary();
+            return select_primary(set);
 
         case DB_QUERY_READ:
-            return select_replica();
+            return select_replica(set, causal);
 
         default:
-            return select_primary();
+            return select_primary(set);
     }
 }
 
 void DatabasePool::cleanup_idle_connections() {
-    std::unique_lock lock(mutex_);
-
-    for (auto& [backend_id, conns] : idle_connections_) {
-        auto it = std::remove_if(conns.begin(), conns.end(),
-            [this](const std::unique_ptr<Connection>& conn) {
-                bool should_remove = !conn->validate() ||
-                                    conn->idle_time() > idle_timeout_ ||
-                                    conn->age() > max_lifetime_;
-                if (should_remove) {
-                    total_connections_.fetch_sub(1);
-                    stats_.total_closed.fetch_add(1);
+    const BackendSet* set = backend_set();
+
+    for (Shard* shard : set->shards) {
+        // One pass over what is idle now; acquires keep popping meanwhile
+        uint32_t n = shard->idle_count.load(std::memory_order_relaxed);
+        std::vector<Connection*> keep;
+        keep.reserve(n);
+
+        for (uint32_t i = 0; i < n; i++) {
+            Connection* idle = pop_idle(shard);
+            if (!idle) break;
+
+            bool valid = idle->validate();
+            if (!valid) stats_.total_validation_failures.fetch_add(1);
+
+            // The idle timeout only trims what is above min_idle_, or the
+            // maintainer would reopen what it closes
+            bool surplus = shard->idle_count.load(std::memory_order_relaxed) + keep.size() >= min_idle_;
+            if (!valid || (surplus && idle->idle_time() > idle_timeout_) ||
+                idle->age() > max_lifetime_) {
+                close_connection(std::unique_ptr<Connection>(idle));
+            } else {
+                keep.push_back(idle);
+            }
+        }
+
+        for (Connection* conn : keep) {
+            if (!push_idle(shard, conn)) {
+                close_connection(std::unique_ptr<Connection>(conn));
+            }
+        }
+    }
+}
+
+void DatabasePool::drain_idle(Shard* shard) noexcept {
+    while (Connection* idle = pop_idle(shard)) {
+        close_connection(std::unique_ptr<Connection>(idle));
+    }
+}
+
+void DatabasePool::maintain_shard(Shard* shard, bool refresh,
+                                  std::vector<PendingConnect>& pending) {
+    Backend* backend = shard->backend.get();
+    uint32_t budget = DB_POOL_WARM_BATCH;
+
+    // Retire connections near the end of their lifetime while they are
+    // idle, a batch at a time so a cohort opened together is spread out
+    auto refresh_age = max_lifetime_ - std::max<std::chrono::seconds>(
+        max_lifetime_ * DB_POOL_REFRESH_PERCENT / 100, std::chrono::seconds(1));
+    uint32_t n = refresh ? shard->idle_count.load(std::memory_order_relaxed) : 0;
+    std::vector<Connection*> keep;
+    keep.reserve(n);
+
+    for (uint32_t i = 0; i < n && budget > 0; i++) {
+        Connection* idle = pop_idle(shard);
+        if (!idle) break;
+
+        if (idle->age() >= refresh_age) {
+            close_connection(std::unique_ptr<Connection>(idle));
+            budget--;
+        } else {
+            keep.push_back(idle);
+        }
+    }
+    for (Connection* conn : keep) {
+        if (!push_idle(shard, conn)) {
+            close_connection(std::unique_ptr<Connection>(conn));
+        }
+    }
+
+    // Started here, waited on with every other backend's in finish_connects
+    uint32_t idle = shard->idle_count.load(std::memory_order_relaxed);
+    uint32_t want = idle < min_idle_ ? std::min<uint32_t>(min_idle_ - idle, DB_POOL_WARM_BATCH) : 0;
+    for (uint32_t i = 0; i < want; i++) {
+        if (total_connections_.fetch_add(1) >= max_connections_) {
+            total_connections_.fetch_sub(1);
+            return;
+        }
+
+        auto fd = backend->start_connection();
+        if (!fd) {
+            // Tried again next interval
+            total_connections_.fetch_sub(1);
+            return;
+        }
+        pending.push_back({shard, fd.value()});
+    }
+}
+
+void DatabasePool::finish_connects(std::vector<PendingConnect>& pending) {
+    std::vector<struct pollfd> pfds;
+    pfds.reserve(pending.size());
+    for (const auto& p : pending) pfds.push_back({p.fd, POLLOUT, 0});
+
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(DB_POOL_CONNECT_TIMEOUT_MS);
+    size_t left = pending.size();
+
+    while (left > 0) {
+        auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now()).count();
+        if (wait <= 0) break;
+
+        int n = poll(pfds.data(), pfds.size(), (int)wait);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+
+        for (size_t i = 0; i < pfds.size(); i++) {
+            if (pfds[i].fd < 0 || !pfds[i].revents) continue;
+
+            PendingConnect& p = pending[i];
+            if (connect_error(p.fd) == 0) {
+                Backend* backend = p.shard->backend.get();
+                auto conn = std::make_unique<Connection>(p.fd, backend->protocol(), backend->id(),
+                                                         &watcher_);
+                stats_.total_created.fetch_add(1);
+                if (push_idle(p.shard, conn.get())) {
+                    conn.release();
+                } else {
+                    close_connection(std::move(conn));
                 }
-                return should_remove;
-            });
-        conns.erase(it, conns.end());
+            } else {
+                close(p.fd);
+                total_connections_.fetch_sub(1);
+            }
+            // Negative fds are skipped by poll
+            pfds[i].fd = -1;
+            p.fd = -1;
+            left--;
+        }
+    }
+
+    // Timed out; tried again next interval
+    for (const auto& p : pending) {
+        if (p.fd < 0) continue;
+        close(p.fd);
+        total_connections_.fetch_sub(1);
+    }
+    pending.clear();
+}
+
+void DatabasePool::maintain() {
+    // Every backend counts as down until first seen, so the first pass warms them all
+    std::vector<bool> healthy;
+    std::vector<PendingConnect> pending;
+    uint64_t pass = 0;
+
+    std::unique_lock lock(maintain_mutex_);
+    while (!stopping_) {
+        lock.unlock();
+
+        const BackendSet* set = backend_set();
+        healthy.resize(set->shards.size(), false);
+
+        for (size_t i = 0; i < set->shards.size(); i++) {
+            Shard* shard = set->shards[i];
+            bool up = shard->backend->is_healthy() && shard->backend->role() != BackendRole::Down;
+
+            // What was open to a backend that went down is not trusted after
+            if (healthy[i] && !up) drain_idle(shard);
+            healthy[i] = up;
+
+            // Ages move slowly; the idle ring is only walked once a second
+            if (up) maintain_shard(shard, pass % (1000 / DB_POOL_MAINTAIN_INTERVAL_MS) == 0, pending);
+        }
+        finish_connects(pending);
+        pass++;
+
+        lock.lock();
+        maintain_cv_.wait_for(lock, std::chrono::milliseconds(DB_POOL_MAINTAIN_INTERVAL_MS),
+                              [this] { return stopping_; });
     }
 }
 
@@ -300,7 +626,7 @@ ConnectionStatsSnapshot DatabasePool::get_stats() const noexcept {
 }
 
 std::string DatabasePool::get_stats_json() const {
-    std::shared_lock lock(mutex_);
+    const BackendSet* set = backend_set();
 
     std::ostringstream oss;
     oss << "{"
@@ -313,7 +639,8 @@ std::string DatabasePool::get_stats_json() const {
         << "\"backends\":[";
 
     bool first = true;
-    for (const auto& backend : backends_) {
+    for (const Shard* shard : set->shards) {
+        const Backend* backend = shard->backend.get();
         if (!first) oss << ",";
         first = false;
         oss << "{"
@@ -323,7 +650,9 @@ std::string DatabasePool::get_stats_json() const {
             << "\"role\":\"" << (backend->role() == BackendRole::Primary ? "primary" : "replica") << "\","
             << "\"healthy\":" << (backend->is_healthy() ? "true" : "false") << ","
             << "\"active_connections\":" << backend->active_connections() << ","
-            << "\"replication_lag_ms\":" << backend->replication_lag_ms()
+            << "\"idle_connections\":" << shard->idle_count.load(std::memory_order_relaxed) << ","
+            << "\"replication_lag_ms\":" << backend->replication_lag_ms() << ","
+            << "\"replay_position\":" << backend->replay_position()
             << "}";
     }
 
@@ -337,53 +666,69 @@ std::unique_ptr<Connection> DatabasePool::create_new_connection(Backend* backend
         return nullptr;
     }
 
-    return std::make_unique<Connection>(result.value(), backend->protocol(), backend->id());
+    return std::make_unique<Connection>(result.value(), backend->protocol(), backend->id(),
+                                        &watcher_);
 }
 
-Backend* DatabasePool::select_primary() {
-    for (auto& backend : backends_) {
+Backend* DatabasePool::select_primary(const BackendSet* set) {
+    for (Shard* shard : set->shards) {
+        Backend* backend = shard->backend.get();
         if (backend->role() == BackendRole::Primary && backend->is_healthy()) {
-            return backend.get();
+            return backend;
         }
     }
     return nullptr;
 }
 
-Backend* DatabasePool::select_replica() {
+void DatabasePool::set_lag_thresholds(uint64_t soft_ms, uint64_t hard_ms) noexcept {
+    lag_soft_ms_.store(soft_ms);
+    lag_hard_ms_.store(std::max(hard_ms, soft_ms + 1));
+}
+
+uint32_t DatabasePool::replica_weight(uint64_t lag_ms) const noexcept {
+    uint64_t soft = lag_soft_ms_.load(std::memory_order_relaxed);
+    uint64_t hard = lag_hard_ms_.load(std::memory_order_relaxed);
+
+    if (lag_ms <= soft) return DB_REPLICA_WEIGHT_FULL;
+    if (lag_ms >= hard) return DB_REPLICA_WEIGHT_MIN;
+    return DB_REPLICA_WEIGHT_FULL -
+           (uint32_t)((DB_REPLICA_WEIGHT_FULL - DB_REPLICA_WEIGHT_MIN) * (lag_ms - soft) / (hard - soft));
+}
+
+// Least loaded relative to the lag-scaled weight, lower lag on ties. With a
+// causal requirement only replicas that have caught up are candidates.
+Backend* DatabasePool::select_replica(const BackendSet* set, const db_causal_t* causal) {
     Backend* best = nullptr;
-    uint32_t min_connections = UINT32_MAX;
+    uint64_t best_load = UINT64_MAX;
     uint64_t min_lag = UINT64_MAX;
 
-    for (auto& backend : backends_) {
+    for (Shard* shard : set->shards) {
+        Backend* backend = shard->backend.get();
         if (backend->role() != BackendRole::Replica || !backend->is_healthy()) {
             continue;
         }
+        if (causal && !backend->caught_up(*causal)) continue;
 
         uint64_t lag = backend->replication_lag_ms();
-        if (lag > 5000) continue;
-
-        uint32_t conns = backend->active_connections();
-        if (conns < min_connections || (conns == min_connections && lag < min_lag)) {
-            best = backend.get();
-            min_connections = conns;
+        uint64_t load = (uint64_t)(backend->active_connections() + 1) * DB_REPLICA_WEIGHT_FULL /
+                        replica_weight(lag);
+        if (load < best_load || (load == best_load && lag < min_lag)) {
+            best = backend;
+            best_load = load;
             min_lag = lag;
         }
     }
 
     if (!best) {
-        return select_primary();
+        return select_primary(set);
     }
 
     return best;
 }
 
 Backend* DatabasePool::get_backend_by_id(uint64_t id) const noexcept {
-    std::shared_lock lock(mutex_);
-
-    auto it = std::find_if(backends_.begin(), backends_.end(),
-        [id](const std::unique_ptr<Backend>& b) { return b->id() == id; });
-
-    return it != backends_.end() ? it->get() : nullptr;
+    Shard* shard = get_shard(backend_set(), id);
+    return shard ? shard->backend.get() : nullptr;
 }
 
 }
@@ -435,6 +780,12 @@ int db_pool_add_backend(db_pool_t* pool, const char* host, uint16_t port,
 
 db_connection_t* db_pool_acquire(db_pool_t* pool, db_query_type_t query_type,
                                   bool in_transaction, uint64_t session_backend_id) {
+    return db_pool_acquire_causal(pool, query_type, in_transaction, session_backend_id, nullptr);
+}
+
+db_connection_t* db_pool_acquire_causal(db_pool_t* pool, db_query_type_t query_type,
+                                        bool in_transaction, uint64_t session_backend_id,
+                                        const db_causal_t* causal) {
     if (!pool || !pool->mutex) return nullptr;
 
     auto* cpp_pool = static_cast<DatabasePool*>(pool->mutex);
@@ -442,12 +793,15 @@ db_connection_t* db_pool_acquire(db_pool_t* pool, db_query_type_t query_type,
     std::optional<uint64_t> backend_opt =
         (session_backend_id > 0) ? std::optional<uint64_t>(session_backend_id) : std::nullopt;
 
-    auto result = cpp_pool->acquire(query_type, in_transaction, backend_opt);
+    auto result = cpp_pool->acquire(query_type, in_transaction, backend_opt, causal);
     if (!result) return nullptr;
 
     auto conn_ptr = std::move(result).value();
     db_connection_t* conn = (db_connection_t*)malloc(sizeof(db_connection_t));
-    if (!conn) return nullptr;
+    if (!conn) {
+        cpp_pool->release(std::move(conn_ptr));
+        return nullptr;
+    }
 
     conn->fd = conn_ptr->fd();
     conn->protocol = conn_ptr->protocol();
@@ -458,6 +812,7 @@ db_connection_t* db_pool_acquire(db_pool_t* pool, db_query_type_t query_type,
     conn->last_used = time(nullptr);
     conn->query_count = 0;
     conn->next = nullptr;
+    conn->handle = conn_ptr.release();
 
     // Fix: Properly get backend role instead of hardcoding to PRIMARY
     auto* backend = cpp_pool->get_backend_by_id(conn->backend_id);
@@ -470,9 +825,7 @@ db_connection_t* db_pool_acquire(db_pool_t* pool, db_query_type_t query_type,
 void db_pool_release(db_pool_t* pool, db_connection_t* conn) {
     if (!pool || !pool->mutex || !conn) return;
 
-    auto cpp_conn = std::make_unique<Connection>(
-        conn->fd, conn->protocol, conn->backend_id
-    );
+    std::unique_ptr<Connection> cpp_conn(static_cast<Connection*>(conn->handle));
     cpp_conn->set_transaction(conn->in_transaction);
 
     auto* cpp_pool = static_cast<DatabasePool*>(pool->mutex);
@@ -481,18 +834,17 @@ void db_pool_release(db_pool_t* pool, db_connection_t* conn) {
     free(conn);
 }
 
-db_backend_t* db_pool_select_backend(db_pool_t* pool, db_query_type_t query_type) {
-    if (!pool || !pool->mutex) return nullptr;
-
-    auto* cpp_pool = static_cast<DatabasePool*>(pool->mutex);
-    auto backend_opt = cpp_pool->select_backend(query_type);
+void db_pool_discard(db_pool_t* pool, db_connection_t* conn) {
+    if (!pool || !pool->mutex || !conn) return;
 
-    if (!backend_opt) return nullptr;
+    std::unique_ptr<Connection> cpp_conn(static_cast<Connection*>(conn->handle));
+    static_cast<DatabasePool*>(pool->mutex)->discard(std::move(cpp_conn));
 
-    auto* backend = backend_opt.value();
-    db_backend_t* c_backend = (db_backend_t*)malloc(sizeof(db_backend_t));
-    if (!c_backend) return nullptr;
+    free(conn);
+}
 
+static void db_pool_copy_backend(const Backend* backend, db_backend_t* c_backend) {
+    memset(c_backend, 0, sizeof(*c_backend));
     c_backend->id = backend->id();
     strncpy(c_backend->host, backend->host().c_str(), sizeof(c_backend->host) - 1);
     c_backend->port = backend->port();
@@ -503,12 +855,63 @@ db_backend_t* db_pool_select_backend(db_pool_t* pool, db_query_type_t query_type
     c_backend->active_connections = backend->active_connections();
     c_backend->replication_lag_ms = backend->replication_lag_ms();
     c_backend->next = nullptr;
+}
+
+db_backend_t* db_pool_select_backend(db_pool_t* pool, db_query_type_t query_type) {
+    if (!pool || !pool->mutex) return nullptr;
+
+    auto* cpp_pool = static_cast<DatabasePool*>(pool->mutex);
+    auto backend_opt = cpp_pool->select_backend(query_type);
+
+    if (!backend_opt) return nullptr;
 
+    db_backend_t* c_backend = (db_backend_t*)malloc(sizeof(db_backend_t));
+    if (!c_backend) return nullptr;
+
+    db_pool_copy_backend(backend_opt.value(), c_backend);
     return c_backend;
 }
 
+uint32_t db_pool_backend_count(db_pool_t* pool) {
+    if (!pool || !pool->mutex) return 0;
+    return static_cast<uint32_t>(static_cast<DatabasePool*>(pool->mutex)->backend_count());
+}
+
+int db_pool_get_backend(db_pool_t* pool, uint64_t backend_id, db_backend_t* out) {
+    if (!pool || !pool->mutex || !out) return -1;
+
+    auto* backend = static_cast<DatabasePool*>(pool->mutex)->get_backend_by_id(backend_id);
+    if (!backend) return -1;
+
+    db_pool_copy_backend(backend, out);
+    return 0;
+}
+
+int db_pool_set_backend_health(db_pool_t* pool, uint64_t backend_id, bool healthy) {
+    if (!pool || !pool->mutex) return -1;
+
+    auto* backend = static_cast<DatabasePool*>(pool->mutex)->get_backend_by_id(backend_id);
+    if (!backend) return -1;
+
+    backend->set_healthy(healthy);
+    return 0;
+}
+
+int db_pool_set_replica_state(db_pool_t* pool, uint64_t backend_id,
+                              uint64_t lag_ms, uint64_t position) {
+    if (!pool || !pool->mutex) return -1;
+
+    auto* backend = static_cast<DatabasePool*>(pool->mutex)->get_backend_by_id(backend_id);
+    if (!backend) return -1;
+
+    backend->set_replication_lag(lag_ms);
+    if (position) backend->set_replay_position(position);
+    return 0;
+}
+
 int db_pool_validate_connection(db_connection_t* conn) {
     if (!conn || conn->fd < 0) return -1;
+    if (conn->handle) return static_cast<Connection*>(conn->handle)->validate() ? 0 : -1;
 
     char buf;
     int result = recv(conn->fd, &buf, 1, MSG_PEEK | MSG_DONTWAIT);
@@ -1,5 +1,7 @@
 #include "database/db_protocol.h"
 #include <string.h>
+#include <strings.h>
+#include <stdlib.h>
 #include <ctype.h>
 
 db_protocol_type_t db_protocol_detect(const uint8_t* data, size_t length) {
@@ -13,6 +15,20 @@ db_protocol_type_t db_protocol_detect(const uint8_t* data, size_t length) {
         return DB_PROTOCOL_MYSQL;
     }
 
+    // A whole query or prepare frame: PostgreSQL 'Q'/'P' with a big endian
+    // length that counts itself, MySQL COM_QUERY/COM_STMT_PREPARE behind a
+    // 3-byte length and sequence number
+    if (length >= 5 && (data[0] == 'Q' || data[0] == 'P') &&
+        ((uint32_t)data[1] << 24 | (uint32_t)data[2] << 16 |
+         (uint32_t)data[3] << 8 | data[4]) + 1 == length) {
+        return DB_PROTOCOL_POSTGRESQL;
+    }
+
+    if (length >= 5 && (data[4] == 0x03 || data[4] == 0x16) &&
+        ((uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16) + 4 == length) {
+        return DB_PROTOCOL_MYSQL;
+    }
+
     if (data[0] == '*' || data[0] == '+' || data[0] == '-' ||
         data[0] == ':' || data[0] == '$') {
         return DB_PROTOCOL_REDIS;
@@ -21,129 +37,566 @@ db_protocol_type_t db_protocol_detect(const uint8_t* data, size_t length) {
     return DB_PROTOCOL_UNKNOWN;
 }
 
-static bool is_select_query(const char* query, size_t length) {
-    if (length < 6) return false;
-    const char* p = query;
-    while (p < query + length && isspace(*p)) p++;
-    return (length >= 6 &&
-            (p[0] == 'S' || p[0] == 's') &&
-            (p[1] == 'E' || p[1] == 'e') &&
-            (p[2] == 'L' || p[2] == 'l') &&
-            (p[3] == 'E' || p[3] == 'e') &&
-            (p[4] == 'C' || p[4] == 'c') &&
-            (p[5] == 'T' || p[5] == 't'));
+/*
+ * One pass over the statement: skip whitespace, comments and quoted text,
+ * pick up ub: hints from comments, look the leading keyword up in a sorted
+ * table and, for reads, keep scanning for anything that makes them a write
+ * or take row locks.
+ */
+enum {
+    SQL_KW_NONE = 0,
+    SQL_KW_READ,
+    SQL_KW_WRITE,
+    SQL_KW_BEGIN,
+    SQL_KW_START,
+    SQL_KW_COMMIT,
+    SQL_KW_ROLLBACK,
+    SQL_KW_SET,
+    SQL_KW_WITH,
+    SQL_KW_EXPLAIN
+};
+
+typedef struct {
+    const char* word;
+    uint8_t lead;           /* SQL_KW_* when the statement starts with it */
+    bool in_read;           /* turns a SELECT or WITH into a write */
+} sql_keyword_t;
+
+// Sorted for bsearch
+static const sql_keyword_t sql_keywords[] = {
+    { "ABORT",    SQL_KW_ROLLBACK, false },
+    { "ALTER",    SQL_KW_WRITE,    false },
+    { "BEGIN",    SQL_KW_BEGIN,    false },
+    { "CALL",     SQL_KW_WRITE,    false },
+    { "COMMIT",   SQL_KW_COMMIT,   false },
+    { "CREATE",   SQL_KW_WRITE,    false },
+    { "DELETE",   SQL_KW_WRITE,    true  },
+    { "DESC",     SQL_KW_READ,     false },
+    { "DESCRIBE", SQL_KW_READ,     false },
+    { "DROP",     SQL_KW_WRITE,    false },
+    { "END",      SQL_KW_COMMIT,   false },
+    { "EXPLAIN",  SQL_KW_EXPLAIN,  false },
+    { "GRANT",    SQL_KW_WRITE,    false },
+    { "INSERT",   SQL_KW_WRITE,    true  },
+    { "INTO",     SQL_KW_NONE,     true  },   /* SELECT INTO, INTO OUTFILE */
+    { "LOCK",     SQL_KW_WRITE,    true  },   /* LOCK IN SHARE MODE */
+    { "MERGE",    SQL_KW_WRITE,    true  },
+    { "RENAME",   SQL_KW_WRITE,    false },
+    { "REPLACE",  SQL_KW_WRITE,    false },
+    { "REVOKE",   SQL_KW_WRITE,    false },
+    { "ROLLBACK", SQL_KW_ROLLBACK, false },
+    { "SELECT",   SQL_KW_READ,     false },
+    { "SET",      SQL_KW_SET,      false },
+    { "SHARE",    SQL_KW_NONE,     true  },   /* FOR SHARE, FOR KEY SHARE */
+    { "SHOW",     SQL_KW_READ,     false },
+    { "START",    SQL_KW_START,    false },
+    { "TABLE",    SQL_KW_READ,     false },
+    { "TRUNCATE", SQL_KW_WRITE,    false },
+    { "UPDATE",   SQL_KW_WRITE,    true  },   /* also FOR [NO KEY] UPDATE */
+    { "VALUES",   SQL_KW_READ,     false },
+    { "WITH",     SQL_KW_WITH,     false },
+};
+
+#define SQL_WORD_MAX 12
+
+typedef struct {
+    const char* p;
+    const char* end;
+    db_route_hint_t hint;
+} sql_lex_t;
+
+static int sql_keyword_cmp(const void* key, const void* entry) {
+    return strcmp((const char*)key, ((const sql_keyword_t*)entry)->word);
 }
 
-static bool is_show_query(const char* query, size_t length) {
-    if (length < 4) return false;
-    const char* p = query;
-    while (p < query + length && isspace(*p)) p++;
-    return (length >= 4 &&
-            (p[0] == 'S' || p[0] == 's') &&
-            (p[1] == 'H' || p[1] == 'h') &&
-            (p[2] == 'O' || p[2] == 'o') &&
-            (p[3] == 'W' || p[3] == 'w'));
+static const sql_keyword_t* sql_keyword_find(const char* word) {
+    return bsearch(word, sql_keywords, sizeof(sql_keywords) / sizeof(sql_keywords[0]),
+                   sizeof(sql_keywords[0]), sql_keyword_cmp);
 }
 
-static bool is_write_query(const char* query, size_t length) {
-    if (length < 6) return false;
-    const char* p = query;
-    while (p < query + length && isspace(*p)) p++;
-
-    if (length >= 6) {
-        if ((p[0] == 'I' || p[0] == 'i') &&
-            (p[1] == 'N' || p[1] == 'n') &&
-            (p[2] == 'S' || p[2] == 's') &&
-            (p[3] == 'E' || p[3] == 'e') &&
-            (p[4] == 'R' || p[4] == 'r') &&
-            (p[5] == 'T' || p[5] == 't')) return true;
-
-        if ((p[0] == 'U' || p[0] == 'u') &&
-            (p[1] == 'P' || p[1] == 'p') &&
-            (p[2] == 'D' || p[2] == 'd') &&
-            (p[3] == 'A' || p[3] == 'a') &&
-            (p[4] == 'T' || p[4] == 't') &&
-            (p[5] == 'E' || p[5] == 'e')) return true;
-
-        if ((p[0] == 'D' || p[0] == 'd') &&
-            (p[1] == 'E' || p[1] == 'e') &&
-            (p[2] == 'L' || p[2] == 'l') &&
-            (p[3] == 'E' || p[3] == 'e') &&
-            (p[4] == 'T' || p[4] == 't') &&
-            (p[5] == 'E' || p[5] == 'e')) return true;
+static bool sql_word_char(char c) {
+    return isalnum((unsigned char)c) || c == '_' || c == '$';
+}
+
+static bool sql_prefix(const char* p, const char* end, const char* word) {
+    for (; *word; word++, p++) {
+        if (p >= end || toupper((unsigned char)*p) != *word) return false;
     }
+    return true;
+}
+
+// "/* ub:replica */" or "/*+ ub:primary */"
+static void sql_comment_hint(sql_lex_t* lx, const char* p, const char* end) {
+    while (p < end && (isspace((unsigned char)*p) || *p == '+')) p++;
+    if (!sql_prefix(p, end, "UB:")) return;
+    p += 3;
 
-    return false;
+    if (sql_prefix(p, end, "REPLICA")) lx->hint = DB_HINT_REPLICA;
+    else if (sql_prefix(p, end, "PRIMARY")) lx->hint = DB_HINT_PRIMARY;
 }
 
-static bool is_transaction_begin(const char* query, size_t length) {
-    if (length < 5) return false;
-    const char* p = query;
-    while (p < query + length && isspace(*p)) p++;
-
-    if (length >= 5 &&
-        (p[0] == 'B' || p[0] == 'b') &&
-        (p[1] == 'E' || p[1] == 'e') &&
-        (p[2] == 'G' || p[2] == 'g') &&
-        (p[3] == 'I' || p[3] == 'i') &&
-        (p[4] == 'N' || p[4] == 'n')) return true;
-
-    if (length >= 5 &&
-        (p[0] == 'S' || p[0] == 's') &&
-        (p[1] == 'T' || p[1] == 't') &&
-        (p[2] == 'A' || p[2] == 'a') &&
-        (p[3] == 'R' || p[3] == 'r') &&
-        (p[4] == 'T' || p[4] == 't')) return true;
-
-    return false;
+static void sql_skip_space(sql_lex_t* lx) {
+    while (lx->p < lx->end) {
+        char c = *lx->p;
+        if (isspace((unsigned char)c)) {
+            lx->p++;
+        } else if (c == '/' && lx->p + 1 < lx->end && lx->p[1] == '*') {
+            const char* body = lx->p + 2;
+            const char* q = body;
+            while (q + 1 < lx->end && !(q[0] == '*' && q[1] == '/')) q++;
+            sql_comment_hint(lx, body, q);
+            lx->p = (q + 1 < lx->end) ? q + 2 : lx->end;
+        } else if ((c == '-' && lx->p + 1 < lx->end && lx->p[1] == '-') || c == '#') {
+            while (lx->p < lx->end && *lx->p != '\n') lx->p++;
+        } else {
+            break;
+        }
+    }
 }
 
-static bool is_transaction_end(const char* query, size_t length) {
-    if (length < 6) return false;
-    const char* p = query;
-    while (p < query + length && isspace(*p)) p++;
-
-    if (length >= 6 &&
-        (p[0] == 'C' || p[0] == 'c') &&
-        (p[1] == 'O' || p[1] == 'o') &&
-        (p[2] == 'M' || p[2] == 'm') &&
-        (p[3] == 'M' || p[3] == 'm') &&
-        (p[4] == 'I' || p[4] == 'i') &&
-        (p[5] == 'T' || p[5] == 't')) return true;
-
-    if (length >= 8 &&
-        (p[0] == 'R' || p[0] == 'r') &&
-        (p[1] == 'O' || p[1] == 'o') &&
-        (p[2] == 'L' || p[2] == 'l') &&
-        (p[3] == 'L' || p[3] == 'l') &&
-        (p[4] == 'B' || p[4] == 'b') &&
-        (p[5] == 'A' || p[5] == 'a') &&
-        (p[6] == 'C' || p[6] == 'c') &&
-        (p[7] == 'K' || p[7] == 'k')) return true;
-
-    return false;
+// Quoted strings and identifiers, including PostgreSQL $tag$ bodies.
+// backslash: a backslash escapes the next character, except in `names`.
+static void sql_skip_quoted(sql_lex_t* lx, bool backslash) {
+    char quote = *lx->p;
+
+    if (quote == '$') {
+        const char* tag = lx->p;
+        const char* q = tag + 1;
+        while (q < lx->end && (isalnum((unsigned char)*q) || *q == '_')) q++;
+        if (q >= lx->end || *q != '$') {
+            lx->p++;
+            return;
+        }
+        size_t tag_len = (size_t)(q - tag) + 1;
+        for (q++; q + tag_len <= lx->end; q++) {
+            if (memcmp(q, tag, tag_len) == 0) {
+                lx->p = q + tag_len;
+                return;
+            }
+        }
+        lx->p = lx->end;
+        return;
+    }
+
+    for (lx->p++; lx->p < lx->end; lx->p++) {
+        if (*lx->p == '\\' && backslash && quote != '`') {
+            lx->p++;
+        } else if (*lx->p == quote) {
+            if (lx->p + 1 < lx->end && lx->p[1] == quote) {
+                lx->p++;  // doubled quote
+            } else {
+                lx->p++;
+                return;
+            }
+        }
+    }
 }
 
-static bool is_session_var(const char* query, size_t length) {
-    if (length < 3) return false;
-    const char* p = query;
-    while (p < query + length && isspace(*p)) p++;
-    return (length >= 3 &&
-            (p[0] == 'S' || p[0] == 's') &&
-            (p[1] == 'E' || p[1] == 'e') &&
-            (p[2] == 'T' || p[2] == 't'));
+// Next bare word, upper-cased into word; false at the end of the statement.
+// Words longer than any keyword come back empty.
+static bool sql_next_word(sql_lex_t* lx, char word[SQL_WORD_MAX + 1]) {
+    for (;;) {
+        sql_skip_space(lx);
+        if (lx->p >= lx->end || *lx->p == ';') return false;
+
+        char c = *lx->p;
+        if (c == '\'' || c == '"' || c == '`' || c == '$') {
+            sql_skip_quoted(lx, true);
+        } else if (sql_word_char(c)) {
+            size_t n = 0;
+            while (lx->p < lx->end && sql_word_char(*lx->p)) {
+                if (n <= SQL_WORD_MAX) word[n] = (char)toupper((unsigned char)*lx->p);
+                n++;
+                lx->p++;
+            }
+            word[n <= SQL_WORD_MAX ? n : 0] = '\0';
+            return true;
+        } else {
+            lx->p++;
+        }
+    }
 }
 
-db_query_type_t db_protocol_classify_query(const char* query, size_t length) {
+static uint8_t sql_next_keyword(sql_lex_t* lx, bool* in_read) {
+    char word[SQL_WORD_MAX + 1];
+    if (!sql_next_word(lx, word)) return SQL_KW_NONE;
+
+    const sql_keyword_t* kw = sql_keyword_find(word);
+    if (in_read) *in_read = kw && kw->in_read;
+    return kw ? kw->lead : SQL_KW_NONE;
+}
+
+static bool sql_next_is(sql_lex_t* lx, const char* expect) {
+    char word[SQL_WORD_MAX + 1];
+    return sql_next_word(lx, word) && strcmp(word, expect) == 0;
+}
+
+static db_query_type_t sql_classify(sql_lex_t* lx) {
+    sql_lex_t rest;
+    bool in_read = false;
+
+    switch (sql_next_keyword(lx, NULL)) {
+        case SQL_KW_BEGIN:
+            return DB_QUERY_TRANSACTION_BEGIN;
+
+        case SQL_KW_START:
+            return sql_next_is(lx, "TRANSACTION") ? DB_QUERY_TRANSACTION_BEGIN : DB_QUERY_UNKNOWN;
+
+        case SQL_KW_COMMIT:
+            return DB_QUERY_TRANSACTION_END;
+
+        case SQL_KW_ROLLBACK:
+            // ROLLBACK TO SAVEPOINT keeps the transaction open
+            rest = *lx;
+            return sql_next_is(&rest, "TO") ? DB_QUERY_UNKNOWN : DB_QUERY_TRANSACTION_END;
+
+        case SQL_KW_SET:
+            // SET LOCAL only lasts until the end of the transaction
+            rest = *lx;
+            return sql_next_is(&rest, "LOCAL") ? DB_QUERY_UNKNOWN : DB_QUERY_SESSION_VAR;
+
+        case SQL_KW_EXPLAIN:
+            // EXPLAIN ANALYZE runs the statement
+            rest = *lx;
+            if (!sql_next_is(&rest, "ANALYZE")) return DB_QUERY_READ;
+            *lx = rest;
+            return sql_classify(lx);
+
+        case SQL_KW_WRITE:
+            return DB_QUERY_WRITE;
+
+        case SQL_KW_READ:
+        case SQL_KW_WITH:
+            // Data-modifying CTEs, SELECT INTO and row locks need the primary
+            while (lx->p < lx->end && *lx->p != ';') {
+                sql_next_keyword(lx, &in_read);
+                if (in_read) return DB_QUERY_WRITE;
+            }
+            return DB_QUERY_READ;
+
+        default:
+            return DB_QUERY_UNKNOWN;
+    }
+}
+
+// How much a verdict binds the router when a message holds several
+// statements: any write, BEGIN or SET decides over the reads around it
+static const uint8_t sql_class_rank[] = {
+    [DB_QUERY_READ] = 0,
+    [DB_QUERY_TRANSACTION_END] = 1,
+    [DB_QUERY_UNKNOWN] = 2,
+    [DB_QUERY_WRITE] = 3,
+    [DB_QUERY_SESSION_VAR] = 4,
+    [DB_QUERY_TRANSACTION_BEGIN] = 5,
+};
+
+// Every statement of a simple-query message, giving the strongest verdict
+static db_query_type_t sql_classify_all(sql_lex_t* lx) {
+    char word[SQL_WORD_MAX + 1];
+    db_query_type_t type = DB_QUERY_READ;
+    bool any = false;
+
+    for (;;) {
+        sql_skip_space(lx);
+        if (lx->p >= lx->end) break;
+        if (*lx->p == ';') {
+            lx->p++;  // empty statement
+            continue;
+        }
+
+        db_query_type_t t = sql_classify(lx);
+        if (!any || sql_class_rank[t] > sql_class_rank[type]) type = t;
+        any = true;
+
+        // Rest of the statement, up to the ';' outside quotes and comments
+        while (sql_next_word(lx, word)) {
+        }
+    }
+    return any ? type : DB_QUERY_UNKNOWN;
+}
+
+/*
+ * Verdicts for statements of at least DB_CLASSIFY_CACHE_MIN bytes, which
+ * are mostly the same prepared statements over and over, are kept in a
+ * small direct-mapped cache per thread keyed by a hash of the text.
+ */
+typedef struct {
+    uint64_t hash;
+    uint32_t length;
+    uint8_t type;
+    uint8_t hint;
+} db_classify_cache_t;
+
+static __thread db_classify_cache_t db_classify_cache[DB_CLASSIFY_CACHE_SIZE];
+
+db_query_type_t db_protocol_classify_query_hint(const char* query, size_t length,
+                                                db_route_hint_t* hint) {
+    if (hint) *hint = DB_HINT_NONE;
     if (!query || length == 0) return DB_QUERY_UNKNOWN;
 
-    if (is_transaction_begin(query, length)) return DB_QUERY_TRANSACTION_BEGIN;
-    if (is_transaction_end(query, length)) return DB_QUERY_TRANSACTION_END;
-    if (is_session_var(query, length)) return DB_QUERY_SESSION_VAR;
-    if (is_select_query(query, length) || is_show_query(query, length)) return DB_QUERY_READ;
-    if (is_write_query(query, length)) return DB_QUERY_WRITE;
+    db_classify_cache_t* slot = NULL;
+    uint64_t h = 0;
+    if (length >= DB_CLASSIFY_CACHE_MIN) {
+        h = 0xcbf29ce484222325ULL;
+        for (size_t i = 0; i < length; i++) {
+            h = (h ^ (uint8_t)query[i]) * 0x100000001b3ULL;
+        }
+        slot = &db_classify_cache[h & (DB_CLASSIFY_CACHE_SIZE - 1)];
+        if (slot->hash == h && slot->length == length) {
+            if (hint) *hint = (db_route_hint_t)slot->hint;
+            return (db_query_type_t)slot->type;
+        }
+    }
+
+    sql_lex_t lx = { query, query + length, DB_HINT_NONE };
+    db_query_type_t type = sql_classify_all(&lx);
+
+    if (slot) {
+        slot->hash = h;
+        slot->length = (uint32_t)length;
+        slot->type = (uint8_t)type;
+        slot->hint = (uint8_t)lx.hint;
+    }
+    if (hint) *hint = lx.hint;
+    return type;
+}
+
+db_query_type_t db_protocol_classify_query(const char* query, size_t length) {
+    return db_protocol_classify_query_hint(query, length, NULL);
+}
+
+/*
+ * Table references, for the result cache. A name is taken after FROM, JOIN,
+ * INTO, UPDATE, TABLE and TRUNCATE, and after each comma of a FROM or
+ * UPDATE list at the depth the list started. A parenthesis where a name
+ * is expected (a subquery or a nested join) and a join keyword other than
+ * JOIN itself (STRAIGHT_JOIN) may hide tables, so the statement is given
+ * up on as if it named too many. Nesting deeper than SQL_TBL_MAX_DEPTH
+ * counts as too many tables as well.
+ */
+#define SQL_TBL_MAX_DEPTH 63
+
+enum {
+    SQL_TBL_NONE = 0,
+    SQL_TBL_NEXT,           /* a table name follows */
+    SQL_TBL_LIST,           /* a comma separated list of them follows */
+    SQL_TBL_SKIP,           /* may sit between the keyword and the name */
+    SQL_TBL_END             /* ends a FROM or UPDATE list */
+};
+
+typedef struct {
+    const char* word;
+    uint8_t role;
+} sql_table_word_t;
+
+// Sorted for bsearch
+static const sql_table_word_t sql_table_words[] = {
+    { "EXCEPT",    SQL_TBL_END  },
+    { "EXISTS",    SQL_TBL_SKIP },
+    { "FETCH",     SQL_TBL_END  },
+    { "FOR",       SQL_TBL_END  },
+    { "FROM",      SQL_TBL_LIST },
+    { "GROUP",     SQL_TBL_END  },
+    { "HAVING",    SQL_TBL_END  },
+    { "IF",        SQL_TBL_SKIP },
+    { "INTERSECT", SQL_TBL_END  },
+    { "INTO",      SQL_TBL_NEXT },
+    { "JOIN",      SQL_TBL_NEXT },
+    { "LATERAL",   SQL_TBL_SKIP },
+    { "LIMIT",     SQL_TBL_END  },
+    { "NOT",       SQL_TBL_SKIP },
+    { "OFFSET",    SQL_TBL_END  },
+    { "ONLY",      SQL_TBL_SKIP },
+    { "ORDER",     SQL_TBL_END  },
+    { "RETURNING", SQL_TBL_END  },
+    { "SELECT",    SQL_TBL_END  },
+    { "SET",       SQL_TBL_END  },
+    { "TABLE",     SQL_TBL_NEXT },
+    { "TRUNCATE",  SQL_TBL_NEXT },
+    { "UNION",     SQL_TBL_END  },
+    { "UPDATE",    SQL_TBL_LIST },
+    { "VALUES",    SQL_TBL_END  },
+    { "WHERE",     SQL_TBL_END  },
+    { "WINDOW",    SQL_TBL_END  },
+};
+
+// A join spelled as one word, which JOIN alone cannot match
+static bool sql_join_word(const char* p, size_t len) {
+    return len > 4 && strncasecmp(p + len - 4, "JOIN", 4) == 0;
+}
+
+static int sql_table_word_cmp(const void* key, const void* entry) {
+    return strcmp((const char*)key, ((const sql_table_word_t*)entry)->word);
+}
+
+static uint8_t sql_table_role(const char* p, size_t len) {
+    char word[SQL_WORD_MAX + 1];
+    if (len > SQL_WORD_MAX) return SQL_TBL_NONE;
+    for (size_t i = 0; i < len; i++) word[i] = (char)toupper((unsigned char)p[i]);
+    word[len] = '\0';
+
+    const sql_table_word_t* w = bsearch(word, sql_table_words,
+                                        sizeof(sql_table_words) / sizeof(sql_table_words[0]),
+                                        sizeof(sql_table_words[0]), sql_table_word_cmp);
+    return w ? w->role : SQL_TBL_NONE;
+}
+
+// One bare or quoted name part at lx->p, without its quotes
+static bool sql_read_name(sql_lex_t* lx, const char** name, size_t* len, bool* quoted) {
+    char c = *lx->p;
+
+    if (c == '"' || c == '`') {
+        const char* start = lx->p + 1;
+        sql_skip_quoted(lx, false);
+        *name = start;
+        *len = (lx->p > start && lx->p[-1] == c) ? (size_t)(lx->p - 1 - start) : (size_t)(lx->p - start);
+        *quoted = true;
+        return true;
+    }
+    if (!sql_word_char(c) || isdigit((unsigned char)c) || c == '$') return false;
+
+    *name = lx->p;
+    while (lx->p < lx->end && sql_word_char(*lx->p)) lx->p++;
+    *len = (size_t)(lx->p - *name);
+    *quoted = false;
+    return true;
+}
+
+int db_protocol_query_tables(const char* query, size_t length, db_table_ref_t* tables, int max) {
+    if (!query || !tables) return -1;
+
+    sql_lex_t lx = { query, query + length, DB_HINT_NONE };
+    int count = 0;
+    int depth = 0;
+    uint64_t lists = 0;     /* bit d: a FROM or UPDATE list is open at depth d */
+    bool expect = false;
+
+    for (;;) {
+        sql_skip_space(&lx);
+        if (lx.p >= lx.end || *lx.p == ';') break;
+
+        char c = *lx.p;
+        const char* name;
+        size_t len;
+        bool quoted;
+
+        if (c == ',' && (lists & (1ULL << depth))) {
+            lx.p++;
+            expect = true;
+            continue;
+        }
+        if (c == '\'' || c == '$') {
+            sql_skip_quoted(&lx, true);
+            expect = false;
+            continue;
+        }
+        if (!sql_read_name(&lx, &name, &len, &quoted)) {
+            if (c == '(' && (expect || ++depth > SQL_TBL_MAX_DEPTH)) return -1;
+            if (c == ')' && depth > 0) lists &= ~(1ULL << depth--);
+            lx.p++;
+            expect = false;
+            continue;
+        }
+
+        if (!quoted && sql_join_word(name, len)) return -1;
+        uint8_t role = quoted ? SQL_TBL_NONE : sql_table_role(name, len);
+
+        if (expect && role == SQL_TBL_SKIP) continue;
+
+        if (expect && role != SQL_TBL_NEXT && role != SQL_TBL_LIST) {
+            db_table_ref_t ref = { NULL, 0, name, len };
+
+            // schema.table, or database.schema.table: keep the last two parts
+            while (lx.p + 1 < lx.end && *lx.p == '.') {
+                lx.p++;
+                if (!sql_read_name(&lx, &name, &len, &quoted)) break;
+                ref.schema = ref.name;
+                ref.schema_length = ref.name_length;
+                ref.name = name;
+                ref.name_length = len;
+            }
+
+            if (count == max) return -1;
+            tables[count++] = ref;
+            expect = false;
+            continue;
+        }
+
+        expect = false;
+        if (role == SQL_TBL_NEXT || role == SQL_TBL_LIST) {
+            expect = true;
+            if (role == SQL_TBL_LIST) lists |= 1ULL << depth;
+        } else if (role == SQL_TBL_END) {
+            lists &= ~(1ULL << depth);
+        }
+    }
+
+    return count;
+}
+
+// End of the quoted text at p, by the quoting rules of protocol
+static const char* sql_quoted_end(db_protocol_type_t protocol, const char* start,
+                                  const char* p, const char* end) {
+    sql_lex_t lx = { p, end, DB_HINT_NONE };
 
-    return DB_QUERY_UNKNOWN;
+    // PostgreSQL only honours backslashes in E'...' strings
+    bool backslash = protocol == DB_PROTOCOL_MYSQL ||
+                     (*p == '\'' && p > start && (p[-1] == 'E' || p[-1] == 'e'));
+    if (*p == '$' && protocol != DB_PROTOCOL_POSTGRESQL) return p + 1;
+
+    sql_skip_quoted(&lx, backslash);
+    return lx.p;
+}
+
+size_t db_protocol_normalize_query(db_protocol_type_t protocol, const char* query, size_t length,
+                                   char* out, size_t cap) {
+    const char* p = query;
+    const char* end = query + length;
+    size_t n = 0;
+    bool space = false;
+
+    while (p < end) {
+        char c = *p;
+
+        if (isspace((unsigned char)c)) {
+            p++;
+            space = true;
+            continue;
+        }
+        // Comments go, but not MySQL's executable /*! ... */ ones, and "--"
+        // only when MySQL would also read it as a comment
+        if (c == '/' && p + 1 < end && p[1] == '*' && !(p + 2 < end && p[2] == '!')) {
+            p += 2;
+            while (p + 1 < end && !(p[0] == '*' && p[1] == '/')) p++;
+            p = (p + 1 < end) ? p + 2 : end;
+            space = true;
+            continue;
+        }
+        if (c == '-' && p + 1 < end && p[1] == '-' &&
+            (p + 2 == end || isspace((unsigned char)p[2]))) {
+            while (p < end && *p != '\n') p++;
+            space = true;
+            continue;
+        }
+
+        const char* token = p;
+        if (c == '\'' || c == '"' || c == '`' || c == '$') {
+            p = sql_quoted_end(protocol, query, p, end);
+        } else {
+            p++;
+        }
+
+        size_t token_len = (size_t)(p - token);
+        if (n + token_len + 1 > cap) return (size_t)-1;
+        if (space && n > 0) out[n++] = ' ';
+        memcpy(out + n, token, token_len);
+        n += token_len;
+        space = false;
+    }
+
+    if (n > 0 && out[n - 1] == ';') n--;
+    if (n > 0 && out[n - 1] == ' ') n--;
+    return n;
 }
 
 int db_protocol_parse_postgresql(const uint8_t* data, size_t length, db_query_info_t* info) {
@@ -152,14 +605,33 @@ int db_protocol_parse_postgresql(const uint8_t* data, size_t length, db_query_in
     info->protocol = DB_PROTOCOL_POSTGRESQL;
     info->is_transaction = false;
     info->requires_sticky = false;
+    info->hint = DB_HINT_NONE;
 
     char message_type = data[0];
     uint32_t message_length = (data[1] << 24) | (data[2] << 16) | (data[3] << 8) | data[4];
 
-    if (message_type == 'Q' && length >= message_length + 1) {
-        info->query_text = (const char*)(data + 5);
-        info->query_length = message_length - 4;
-        info->query_type = db_protocol_classify_query(info->query_text, info->query_length);
+    if ((message_type == 'Q' || message_type == 'P') && length >= message_length + 1 &&
+        message_length >= 4) {
+        const char* text = (const char*)(data + 5);
+        size_t text_len = message_length - 4;
+
+        // Parse: statement name, then the query
+        if (message_type == 'P') {
+            const char* name_end = memchr(text, '\0', text_len);
+            if (!name_end) {
+                info->query_type = DB_QUERY_UNKNOWN;
+                return 0;
+            }
+            text_len -= (size_t)(name_end + 1 - text);
+            text = name_end + 1;
+            const char* query_end = memchr(text, '\0', text_len);
+            if (query_end) text_len = (size_t)(query_end - text);
+        }
+
+        info->query_text = text;
+        info->query_length = text_len;
+        info->query_type = db_protocol_classify_query_hint(info->query_text, info->query_length,
+                                                           &info->hint);
 
         if (info->query_type == DB_QUERY_TRANSACTION_BEGIN ||
             info->query_type == DB_QUERY_SESSION_VAR) {
@@ -179,14 +651,18 @@ int db_protocol_parse_mysql(const uint8_t* data, size_t length, db_query_info_t*
     info->protocol = DB_PROTOCOL_MYSQL;
     info->is_transaction = false;
     info->requires_sticky = false;
+    info->hint = DB_HINT_NONE;
 
     uint32_t packet_length = data[0] | (data[1] << 8) | (data[2] << 16);
     uint8_t command = data[4];
 
-    if (command == 0x03 && length >= packet_length + 4) {
+    // COM_QUERY or COM_STMT_PREPARE
+    if ((command == 0x03 || command == 0x16) && length >= packet_length + 4 &&
+        packet_length >= 1) {
         info->query_text = (const char*)(data + 5);
         info->query_length = packet_length - 1;
-        info->query_type = db_protocol_classify_query(info->query_text, info->query_length);
+        info->query_type = db_protocol_classify_query_hint(info->query_text, info->query_length,
+                                                           &info->hint);
 
         if (info->query_type == DB_QUERY_TRANSACTION_BEGIN ||
             info->query_type == DB_QUERY_SESSION_VAR) {
@@ -206,6 +682,7 @@ int db_protocol_parse_redis(const uint8_t* data, size_t length, db_query_info_t*
     info->protocol = DB_PROTOCOL_REDIS;
     info->is_transaction = false;
     info->requires_sticky = false;
+    info->hint = DB_HINT_NONE;
     info->query_type = DB_QUERY_READ;
 
     if (data[0] == '*') {
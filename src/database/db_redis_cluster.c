@@ -0,0 +1,826 @@
+#include "database/db_redis_cluster.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <ctype.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define RC_ERR_UNAVAILABLE  "-ERR cluster node unavailable\r\n"
+#define RC_ERR_UNSUPPORTED  "-ERR command not supported by the cluster proxy\r\n"
+#define RC_ASKING           "*1\r\n$6\r\nASKING\r\n"
+#define RC_CLUSTER_SLOTS    "*2\r\n$7\r\nCLUSTER\r\n$5\r\nSLOTS\r\n"
+#define RC_NONE             0xffff
+#define RC_RX_CHUNK         16384
+
+typedef struct {
+    const uint8_t* data;
+    size_t len;
+    uint16_t node;
+    uint16_t next;          /* in its node's list for the round */
+    bool asking;
+    bool asking_done;       /* the +OK for ASKING was dropped */
+    const char* error;      /* replied by the proxy itself */
+    uint16_t reply_node;
+    size_t reply_off;
+    size_t reply_len;
+} rc_cmd_t;
+
+typedef struct {
+    int fd;
+    bool connecting;
+    db_redis_buf_t tx;
+    size_t tx_off;
+    db_redis_buf_t rx;      /* replies of the current call */
+    size_t rx_off;
+    uint32_t expect;
+    uint16_t head;
+    uint16_t tail;
+} rc_conn_t;
+
+struct db_redis_client {
+    db_redis_cluster_t* cluster;
+    rc_conn_t conns[DB_REDIS_MAX_NODES];
+    rc_cmd_t cmds[DB_REDIS_MAX_BATCH];
+    uint16_t list[DB_REDIS_MAX_BATCH];
+    uint16_t redirect[DB_REDIS_MAX_BATCH];
+};
+
+/* CRC16-CCITT (XMODEM), as the cluster specification uses for key slots */
+static const uint16_t crc16_table[256] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+    0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+    0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+    0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+    0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+    0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+    0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+    0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+    0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+    0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+    0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+    0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+    0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+    0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+    0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+    0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+    0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+    0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+    0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+    0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+    0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+    0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+    0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0,
+};
+
+uint16_t db_redis_key_slot(const uint8_t* key, size_t len) {
+    // Only what is inside the first non-empty {...} is hashed
+    const uint8_t* open = memchr(key, '{', len);
+    if (open) {
+        const uint8_t* close = memchr(open + 1, '}', len - (size_t)(open + 1 - key));
+        if (close && close > open + 1) {
+            key = open + 1;
+            len = (size_t)(close - key);
+        }
+    }
+
+    uint16_t crc = 0;
+    for (size_t i = 0; i < len; i++) {
+        crc = (uint16_t)(crc << 8) ^ crc16_table[((crc >> 8) ^ key[i]) & 0xff];
+    }
+    return crc & (DB_REDIS_SLOTS - 1);
+}
+
+static int rc_buf_reserve(db_redis_buf_t* b, size_t len) {
+    if (b->len + len <= b->cap) return 0;
+
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap < b->len + len) cap *= 2;
+    uint8_t* p = realloc(b->data, cap);
+    if (!p) return -1;
+    b->data = p;
+    b->cap = cap;
+    return 0;
+}
+
+static int rc_buf_put(db_redis_buf_t* b, const void* data, size_t len) {
+    if (rc_buf_reserve(b, len) < 0) return -1;
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+// Bytes up to and including the LF that ends the line at p, 0 if incomplete
+static size_t resp_line(const uint8_t* p, size_t len) {
+    const uint8_t* lf = memchr(p, '\n', len);
+    return lf ? (size_t)(lf - p) + 1 : 0;
+}
+
+// The integer after the type byte of a line of n bytes
+static bool resp_int(const uint8_t* p, size_t n, int64_t* v) {
+    if (n < 4 || p[n - 2] != '\r') return false;
+
+    size_t i = 1;
+    bool neg = p[i] == '-';
+    if (neg) i++;
+    if (i >= n - 2) return false;
+
+    int64_t x = 0;
+    for (; i < n - 2; i++) {
+        if (p[i] < '0' || p[i] > '9' || x > ((int64_t)1 << 40)) return false;
+        x = x * 10 + (p[i] - '0');
+    }
+    *v = neg ? -x : x;
+    return true;
+}
+
+// Size of the complete reply at p: 0 if more data is needed, -1 if malformed
+static ssize_t resp_size(const uint8_t* p, size_t len, int depth) {
+    if (len == 0) return 0;
+    if (depth > 32) return -1;
+
+    size_t line = resp_line(p, len);
+    if (!line) return 0;
+    if (line < 3 || p[line - 2] != '\r') return -1;
+
+    int64_t n;
+    switch (p[0]) {
+        case '+': case '-': case ':': case '_': case ',': case '#': case '(':
+            return (ssize_t)line;
+
+        case '$': case '=': case '!':
+            if (!resp_int(p, line, &n)) return -1;
+            if (n < 0) return (ssize_t)line;
+            if (len < line + (size_t)n + 2) return 0;
+            return (ssize_t)(line + (size_t)n + 2);
+
+        case '*': case '~': case '>': case '%': {
+            if (!resp_int(p, line, &n)) return -1;
+            if (n < 0) return (ssize_t)line;
+            if (p[0] == '%') n *= 2;
+
+            size_t off = line;
+            for (int64_t i = 0; i < n; i++) {
+                ssize_t r = resp_size(p + off, len - off, depth + 1);
+                if (r <= 0) return r;
+                off += (size_t)r;
+            }
+            return (ssize_t)off;
+        }
+
+        default:
+            return -1;
+    }
+}
+
+/*
+ * Commands not routed by their first argument. key is the argument that
+ * carries the key: 0 for any node, -1 refused, 3 after EVAL's numkeys.
+ */
+typedef struct {
+    const char* name;
+    int8_t key;
+} rc_command_t;
+
+// Sorted for bsearch
+static const rc_command_t rc_commands[] = {
+    { "AUTH",         -1 },
+    { "BLMOVE",       -1 },
+    { "BLMPOP",       -1 },
+    { "BLPOP",        -1 },
+    { "BRPOP",        -1 },
+    { "BRPOPLPUSH",   -1 },
+    { "BZMPOP",       -1 },
+    { "BZPOPMAX",     -1 },
+    { "BZPOPMIN",     -1 },
+    { "CLIENT",        0 },
+    { "CLUSTER",       0 },
+    { "COMMAND",       0 },
+    { "CONFIG",        0 },
+    { "DBSIZE",        0 },
+    { "DISCARD",      -1 },
+    { "ECHO",          0 },
+    { "EVAL",          3 },
+    { "EVALSHA",       3 },
+    { "EVALSHA_RO",    3 },
+    { "EVAL_RO",       3 },
+    { "EXEC",         -1 },
+    { "FCALL",         3 },
+    { "FCALL_RO",      3 },
+    { "FLUSHALL",     -1 },
+    { "FLUSHDB",      -1 },
+    { "HELLO",         0 },
+    { "INFO",          0 },
+    { "KEYS",         -1 },
+    { "MONITOR",      -1 },
+    { "MULTI",        -1 },
+    { "PING",          0 },
+    { "PSUBSCRIBE",   -1 },
+    { "PUNSUBSCRIBE", -1 },
+    { "QUIT",          0 },
+    { "RANDOMKEY",    -1 },
+    { "SCAN",         -1 },
+    { "SCRIPT",        0 },
+    { "SELECT",       -1 },
+    { "SSUBSCRIBE",   -1 },
+    { "SUBSCRIBE",    -1 },
+    { "TIME",          0 },
+    { "UNSUBSCRIBE",  -1 },
+    { "UNWATCH",      -1 },
+    { "WAIT",         -1 },
+    { "WATCH",        -1 },
+};
+
+#define RC_NAME_MAX 16
+
+static int rc_command_cmp(const void* key, const void* entry) {
+    return strcmp((const char*)key, ((const rc_command_t*)entry)->name);
+}
+
+static int rc_key_index(const uint8_t* name, size_t len) {
+    char upper[RC_NAME_MAX + 1];
+    if (len > RC_NAME_MAX) return 1;
+    for (size_t i = 0; i < len; i++) upper[i] = (char)toupper(name[i]);
+    upper[len] = '\0';
+
+    const rc_command_t* c = bsearch(upper, rc_commands, sizeof(rc_commands) / sizeof(rc_commands[0]),
+                                    sizeof(rc_commands[0]), rc_command_cmp);
+    return c ? c->key : 1;
+}
+
+static uint16_t rc_any_node(db_redis_cluster_t* cl) {
+    uint16_t node = atomic_load_explicit(&cl->slots[0], memory_order_relaxed);
+    return node == DB_REDIS_NO_NODE ? 0 : node;
+}
+
+/*
+ * Parse one complete command and pick its node. Returns its size, 0 if it
+ * is incomplete, -1 if malformed. Inline commands go to any node.
+ */
+static ssize_t rc_parse_command(db_redis_cluster_t* cl, const uint8_t* p, size_t len,
+                                rc_cmd_t* cmd) {
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->data = p;
+    cmd->reply_node = RC_NONE;
+
+    size_t line = resp_line(p, len);
+    if (!line) return 0;
+
+    if (p[0] != '*') {
+        cmd->len = line;
+        cmd->node = rc_any_node(cl);
+        return (ssize_t)line;
+    }
+
+    int64_t argc;
+    if (!resp_int(p, line, &argc) || argc < 1) return -1;
+
+    const uint8_t* args[4] = { NULL };
+    size_t arg_len[4] = { 0 };
+    size_t off = line;
+    for (int64_t i = 0; i < argc; i++) {
+        size_t l = resp_line(p + off, len - off);
+        if (!l) return 0;
+        int64_t n;
+        if (p[off] != '$' || !resp_int(p + off, l, &n) || n < 0) return -1;
+        if (len - off < l + (size_t)n + 2) return 0;
+        if (i < 4) {
+            args[i] = p + off + l;
+            arg_len[i] = (size_t)n;
+        }
+        off += l + (size_t)n + 2;
+    }
+    cmd->len = off;
+
+    int key = rc_key_index(args[0], arg_len[0]);
+    if (key == 3 && (argc < 4 || arg_len[2] != 1 || args[2][0] == '0')) key = 0;
+    if (key >= argc) key = 0;
+
+    if (key < 0) {
+        cmd->error = RC_ERR_UNSUPPORTED;
+    } else if (key == 0) {
+        cmd->node = rc_any_node(cl);
+    } else {
+        uint16_t node = atomic_load_explicit(&cl->slots[db_redis_key_slot(args[key], arg_len[key])],
+                                             memory_order_relaxed);
+        cmd->node = node == DB_REDIS_NO_NODE ? rc_any_node(cl) : node;
+    }
+    return (ssize_t)off;
+}
+
+static uint16_t rc_node_get(db_redis_cluster_t* cl, const char* host, size_t host_len, uint16_t port) {
+    if (host_len >= sizeof(cl->nodes[0].host)) return RC_NONE;
+
+    uint32_t count = atomic_load_explicit(&cl->node_count, memory_order_acquire);
+    for (uint32_t i = 0; i < count; i++) {
+        if (cl->nodes[i].port == port && strlen(cl->nodes[i].host) == host_len &&
+            memcmp(cl->nodes[i].host, host, host_len) == 0) {
+            return (uint16_t)i;
+        }
+    }
+
+    pthread_mutex_lock(&cl->lock);
+    uint32_t n = atomic_load_explicit(&cl->node_count, memory_order_relaxed);
+    for (uint32_t i = count; i < n; i++) {
+        if (cl->nodes[i].port == port && strlen(cl->nodes[i].host) == host_len &&
+            memcmp(cl->nodes[i].host, host, host_len) == 0) {
+            pthread_mutex_unlock(&cl->lock);
+            return (uint16_t)i;
+        }
+    }
+    if (n == DB_REDIS_MAX_NODES) {
+        pthread_mutex_unlock(&cl->lock);
+        return RC_NONE;
+    }
+    memcpy(cl->nodes[n].host, host, host_len);
+    cl->nodes[n].host[host_len] = '\0';
+    cl->nodes[n].port = port;
+    atomic_store_explicit(&cl->node_count, n + 1, memory_order_release);
+    pthread_mutex_unlock(&cl->lock);
+
+    return (uint16_t)n;
+}
+
+db_redis_cluster_t* db_redis_cluster_create(const char* seed_host, uint16_t seed_port) {
+    if (!seed_host) return NULL;
+
+    db_redis_cluster_t* cl = calloc(1, sizeof(db_redis_cluster_t));
+    if (!cl) return NULL;
+
+    pthread_mutex_init(&cl->lock, NULL);
+    for (uint32_t i = 0; i < DB_REDIS_SLOTS; i++) {
+        atomic_init(&cl->slots[i], DB_REDIS_NO_NODE);
+    }
+    if (rc_node_get(cl, seed_host, strlen(seed_host), seed_port) == RC_NONE) {
+        pthread_mutex_destroy(&cl->lock);
+        free(cl);
+        return NULL;
+    }
+    atomic_store(&cl->stale, true);
+
+    return cl;
+}
+
+void db_redis_cluster_destroy(db_redis_cluster_t* cluster) {
+    if (!cluster) return;
+    pthread_mutex_destroy(&cluster->lock);
+    free(cluster);
+}
+
+db_redis_client_t* db_redis_client_create(db_redis_cluster_t* cluster) {
+    if (!cluster) return NULL;
+
+    db_redis_client_t* c = calloc(1, sizeof(db_redis_client_t));
+    if (!c) return NULL;
+
+    c->cluster = cluster;
+    // Nodes a redirect adds mid-batch are past what rc_reset_rx covered
+    for (uint32_t i = 0; i < DB_REDIS_MAX_NODES; i++) {
+        c->conns[i].fd = -1;
+        c->conns[i].head = c->conns[i].tail = RC_NONE;
+    }
+    return c;
+}
+
+static void rc_conn_close(rc_conn_t* conn) {
+    if (conn->fd >= 0) close(conn->fd);
+    conn->fd = -1;
+    conn->connecting = false;
+}
+
+void db_redis_client_destroy(db_redis_client_t* client) {
+    if (!client) return;
+
+    for (uint32_t i = 0; i < DB_REDIS_MAX_NODES; i++) {
+        rc_conn_close(&client->conns[i]);
+        free(client->conns[i].tx.data);
+        free(client->conns[i].rx.data);
+    }
+    free(client);
+}
+
+static int rc_connect(db_redis_client_t* c, uint16_t node) {
+    rc_conn_t* conn = &c->conns[node];
+    if (conn->fd >= 0) return 0;
+
+    const db_redis_node_t* n = &c->cluster->nodes[node];
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(n->port);
+    if (inet_pton(AF_INET, n->host, &addr.sin_addr) <= 0) return -1;
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) return -1;
+
+    int flag = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    conn->fd = fd;
+    conn->connecting = true;
+    return 0;
+}
+
+// The node's outstanding commands get an error reply and its connection,
+// now out of step, is closed
+static void rc_conn_fail(db_redis_client_t* c, uint16_t node) {
+    rc_conn_t* conn = &c->conns[node];
+    for (uint16_t i = conn->head; i != RC_NONE; i = c->cmds[i].next) {
+        c->cmds[i].error = RC_ERR_UNAVAILABLE;
+    }
+    conn->head = conn->tail = RC_NONE;
+    conn->expect = 0;
+    conn->tx.len = conn->tx_off = 0;
+    rc_conn_close(conn);
+}
+
+// Hand the next complete replies in the node's buffer to its commands
+static int rc_conn_parse(db_redis_client_t* c, uint16_t node) {
+    rc_conn_t* conn = &c->conns[node];
+
+    while (conn->expect > 0) {
+        ssize_t sz = resp_size(conn->rx.data + conn->rx_off, conn->rx.len - conn->rx_off, 0);
+        if (sz == 0) return 0;
+        if (sz < 0) return -1;
+
+        rc_cmd_t* cmd = &c->cmds[conn->head];
+        if (cmd->asking && !cmd->asking_done) {
+            cmd->asking_done = true;
+        } else {
+            cmd->reply_node = node;
+            cmd->reply_off = conn->rx_off;
+            cmd->reply_len = (size_t)sz;
+            conn->head = cmd->next;
+        }
+        conn->rx_off += (size_t)sz;
+        conn->expect--;
+    }
+    return 0;
+}
+
+/*
+ * Send the listed commands, each node's share as one pipeline, and collect
+ * the replies from every node in parallel.
+ */
+static void rc_round(db_redis_client_t* c, const uint16_t* list, uint32_t n) {
+    uint16_t used[DB_REDIS_MAX_NODES];
+    uint32_t nused = 0;
+
+    for (uint32_t i = 0; i < n; i++) {
+        rc_cmd_t* cmd = &c->cmds[list[i]];
+        rc_conn_t* conn = &c->conns[cmd->node];
+
+        if (!conn->expect && conn->head == RC_NONE && conn->tx.len == 0) {
+            conn->head = conn->tail = RC_NONE;
+            used[nused++] = cmd->node;
+        }
+        if (conn->fd < 0 && rc_connect(c, cmd->node) < 0) {
+            cmd->error = RC_ERR_UNAVAILABLE;
+            continue;
+        }
+        if ((cmd->asking && rc_buf_put(&conn->tx, RC_ASKING, strlen(RC_ASKING)) < 0) ||
+            rc_buf_put(&conn->tx, cmd->data, cmd->len) < 0) {
+            cmd->error = RC_ERR_UNAVAILABLE;
+            continue;
+        }
+
+        cmd->next = RC_NONE;
+        cmd->asking_done = false;
+        if (conn->tail == RC_NONE) conn->head = list[i];
+        else c->cmds[conn->tail].next = list[i];
+        conn->tail = list[i];
+        conn->expect += 1 + cmd->asking;
+    }
+
+    struct pollfd pfds[DB_REDIS_MAX_NODES];
+    uint16_t pnode[DB_REDIS_MAX_NODES];
+
+    for (;;) {
+        uint32_t np = 0;
+        for (uint32_t i = 0; i < nused; i++) {
+            rc_conn_t* conn = &c->conns[used[i]];
+            if (conn->fd < 0 || (!conn->expect && conn->tx_off == conn->tx.len)) continue;
+            pfds[np].fd = conn->fd;
+            pfds[np].events = POLLIN;
+            if (conn->connecting || conn->tx_off < conn->tx.len) pfds[np].events |= POLLOUT;
+            pfds[np].revents = 0;
+            pnode[np++] = used[i];
+        }
+        if (!np) break;
+
+        int r = poll(pfds, np, DB_REDIS_IO_TIMEOUT_MS);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            for (uint32_t i = 0; i < np; i++) rc_conn_fail(c, pnode[i]);
+            break;
+        }
+
+        for (uint32_t i = 0; i < np; i++) {
+            rc_conn_t* conn = &c->conns[pnode[i]];
+            short ev = pfds[i].revents;
+            if (!ev) continue;
+
+            if ((ev & (POLLERR | POLLHUP)) && !(ev & POLLIN)) {
+                rc_conn_fail(c, pnode[i]);
+                continue;
+            }
+
+            if (ev & POLLOUT) {
+                if (conn->connecting) {
+                    int err = 0;
+                    socklen_t len = sizeof(err);
+                    if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+                        rc_conn_fail(c, pnode[i]);
+                        continue;
+                    }
+                    conn->connecting = false;
+                }
+                if (conn->tx_off < conn->tx.len) {
+                    ssize_t s = send(conn->fd, conn->tx.data + conn->tx_off,
+                                     conn->tx.len - conn->tx_off, MSG_NOSIGNAL);
+                    if (s < 0 && errno != EAGAIN && errno != EINTR) {
+                        rc_conn_fail(c, pnode[i]);
+                        continue;
+                    }
+                    if (s > 0) conn->tx_off += (size_t)s;
+                    if (conn->tx_off == conn->tx.len) conn->tx.len = conn->tx_off = 0;
+                }
+            }
+
+            if (ev & (POLLIN | POLLHUP)) {
+                if (rc_buf_reserve(&conn->rx, RC_RX_CHUNK) < 0) {
+                    rc_conn_fail(c, pnode[i]);
+                    continue;
+                }
+                ssize_t got = recv(conn->fd, conn->rx.data + conn->rx.len,
+                                   conn->rx.cap - conn->rx.len, 0);
+                if (got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR)) {
+                    rc_conn_fail(c, pnode[i]);
+                    continue;
+                }
+                if (got > 0) {
+                    conn->rx.len += (size_t)got;
+                    if (rc_conn_parse(c, pnode[i]) < 0) rc_conn_fail(c, pnode[i]);
+                }
+            }
+        }
+    }
+}
+
+static bool rc_reply_is(const rc_cmd_t* cmd, const uint8_t* reply, const char* prefix) {
+    size_t n = strlen(prefix);
+    return cmd->reply_len > n && memcmp(reply, prefix, n) == 0;
+}
+
+// "-MOVED 3999 127.0.0.1:6381": the slot and the node now serving it
+static bool rc_parse_redirect(const uint8_t* p, size_t len, int64_t* slot,
+                              const char** host, size_t* host_len, uint16_t* port) {
+    const uint8_t* sp = memchr(p, ' ', len);
+    if (!sp) return false;
+    const uint8_t* q = sp + 1;
+    const uint8_t* end = p + len - 2;
+
+    int64_t s = 0;
+    for (; q < end && *q >= '0' && *q <= '9'; q++) s = s * 10 + (*q - '0');
+    if (q >= end || *q != ' ' || s >= DB_REDIS_SLOTS) return false;
+
+    const uint8_t* addr = q + 1;
+    const uint8_t* colon = NULL;
+    for (const uint8_t* r = addr; r < end; r++) {
+        if (*r == ':') colon = r;
+    }
+    if (!colon || colon == addr) return false;
+
+    uint32_t v = 0;
+    for (const uint8_t* r = colon + 1; r < end; r++) {
+        if (*r < '0' || *r > '9' || (v = v * 10 + (uint32_t)(*r - '0')) > 65535) return false;
+    }
+
+    *slot = s;
+    *host = (const char*)addr;
+    *host_len = (size_t)(colon - addr);
+    *port = (uint16_t)v;
+    return true;
+}
+
+// Reroute the commands whose reply was MOVED or ASK; returns how many
+static uint32_t rc_redirects(db_redis_client_t* c, const uint16_t* list, uint32_t n,
+                             uint16_t* out) {
+    db_redis_cluster_t* cl = c->cluster;
+    uint32_t count = 0;
+
+    for (uint32_t i = 0; i < n; i++) {
+        rc_cmd_t* cmd = &c->cmds[list[i]];
+        if (cmd->error || cmd->reply_node == RC_NONE) continue;
+
+        const uint8_t* reply = c->conns[cmd->reply_node].rx.data + cmd->reply_off;
+        bool moved = rc_reply_is(cmd, reply, "-MOVED ");
+        if (!moved && !rc_reply_is(cmd, reply, "-ASK ")) continue;
+
+        int64_t slot;
+        const char* host;
+        size_t host_len;
+        uint16_t port;
+        if (!rc_parse_redirect(reply, cmd->reply_len, &slot, &host, &host_len, &port)) continue;
+
+        uint16_t node = rc_node_get(cl, host, host_len, port);
+        if (node == RC_NONE) continue;
+
+        if (moved) {
+            atomic_store_explicit(&cl->slots[slot], node, memory_order_relaxed);
+            atomic_store(&cl->stale, true);
+            atomic_fetch_add(&cl->stats.moved, 1);
+        } else {
+            atomic_fetch_add(&cl->stats.asked, 1);
+        }
+        cmd->asking = !moved;
+        cmd->node = node;
+        cmd->reply_node = RC_NONE;
+        out[count++] = list[i];
+    }
+    return count;
+}
+
+static void rc_reset_rx(db_redis_client_t* c) {
+    uint32_t count = atomic_load_explicit(&c->cluster->node_count, memory_order_acquire);
+    for (uint32_t i = 0; i < count; i++) {
+        c->conns[i].rx.len = c->conns[i].rx_off = 0;
+        c->conns[i].head = c->conns[i].tail = RC_NONE;
+    }
+}
+
+static bool rc_read_array(const uint8_t* p, size_t len, size_t* off, int64_t* n) {
+    size_t l = resp_line(p + *off, len - *off);
+    if (!l || p[*off] != '*' || !resp_int(p + *off, l, n)) return false;
+    *off += l;
+    return true;
+}
+
+static bool rc_read_int(const uint8_t* p, size_t len, size_t* off, int64_t* v) {
+    size_t l = resp_line(p + *off, len - *off);
+    if (!l || p[*off] != ':' || !resp_int(p + *off, l, v)) return false;
+    *off += l;
+    return true;
+}
+
+static bool rc_read_bulk(const uint8_t* p, size_t len, size_t* off, const char** s, size_t* n) {
+    size_t l = resp_line(p + *off, len - *off);
+    int64_t v;
+    if (!l || p[*off] != '$' || !resp_int(p + *off, l, &v) || v < 0) return false;
+    *s = (const char*)p + *off + l;
+    *n = (size_t)v;
+    *off += l + (size_t)v + 2;
+    return true;
+}
+
+static bool rc_skip(const uint8_t* p, size_t len, size_t* off) {
+    ssize_t r = resp_size(p + *off, len - *off, 0);
+    if (r <= 0) return false;
+    *off += (size_t)r;
+    return true;
+}
+
+// CLUSTER SLOTS: [[start, end, [host, port, id...], replicas...], ...]
+static int rc_apply_slots(db_redis_cluster_t* cl, const uint8_t* p, size_t len, uint16_t asked) {
+    size_t off = 0;
+    int64_t ranges;
+    if (!rc_read_array(p, len, &off, &ranges)) return -1;
+
+    for (int64_t r = 0; r < ranges; r++) {
+        int64_t fields, start, end, parts, port;
+        const char* host;
+        size_t host_len;
+
+        if (!rc_read_array(p, len, &off, &fields) || fields < 3 ||
+            !rc_read_int(p, len, &off, &start) || !rc_read_int(p, len, &off, &end) ||
+            !rc_read_array(p, len, &off, &parts) || parts < 2 ||
+            !rc_read_bulk(p, len, &off, &host, &host_len) ||
+            !rc_read_int(p, len, &off, &port)) {
+            return -1;
+        }
+        for (int64_t i = 2; i < parts; i++) {
+            if (!rc_skip(p, len, &off)) return -1;
+        }
+        for (int64_t i = 3; i < fields; i++) {
+            if (!rc_skip(p, len, &off)) return -1;
+        }
+
+        // An empty or "?" host means the node that answered
+        if (host_len == 0 || (host_len == 1 && host[0] == '?')) {
+            host = cl->nodes[asked].host;
+            host_len = strlen(host);
+        }
+        uint16_t node = rc_node_get(cl, host, host_len, (uint16_t)port);
+        if (node == RC_NONE || start < 0 || end >= DB_REDIS_SLOTS || start > end) continue;
+
+        for (int64_t s = start; s <= end; s++) {
+            atomic_store_explicit(&cl->slots[s], node, memory_order_relaxed);
+        }
+    }
+    return 0;
+}
+
+int db_redis_cluster_refresh(db_redis_client_t* client) {
+    if (!client) return -1;
+
+    db_redis_cluster_t* cl = client->cluster;
+    uint32_t count = atomic_load_explicit(&cl->node_count, memory_order_acquire);
+
+    for (uint32_t i = 0; i < count; i++) {
+        rc_reset_rx(client);
+
+        rc_cmd_t* cmd = &client->cmds[0];
+        memset(cmd, 0, sizeof(*cmd));
+        cmd->data = (const uint8_t*)RC_CLUSTER_SLOTS;
+        cmd->len = strlen(RC_CLUSTER_SLOTS);
+        cmd->node = (uint16_t)i;
+        cmd->reply_node = RC_NONE;
+        client->list[0] = 0;
+        rc_round(client, client->list, 1);
+
+        if (cmd->error || cmd->reply_node == RC_NONE) continue;
+        const uint8_t* reply = client->conns[i].rx.data + cmd->reply_off;
+        if (reply[0] != '*') continue;
+        if (rc_apply_slots(cl, reply, cmd->reply_len, (uint16_t)i) == 0) {
+            atomic_fetch_add(&cl->stats.refreshes, 1);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+ssize_t db_redis_execute(db_redis_client_t* client, const uint8_t* in, size_t len,
+                         db_redis_buf_t* out) {
+    if (!client || !in || !out) return -1;
+
+    db_redis_cluster_t* cl = client->cluster;
+    if (atomic_exchange(&cl->stale, false)) {
+        db_redis_cluster_refresh(client);
+    }
+    rc_reset_rx(client);
+
+    uint32_t n = 0;
+    size_t off = 0;
+    while (n < DB_REDIS_MAX_BATCH && off < len) {
+        ssize_t sz = rc_parse_command(cl, in + off, len - off, &client->cmds[n]);
+        if (sz < 0 && n == 0) return -1;
+        if (sz <= 0) break;
+        // Refused commands get their error without a round trip
+        if (!client->cmds[n].error) client->list[n] = (uint16_t)n;
+        else client->list[n] = RC_NONE;
+        off += (size_t)sz;
+        n++;
+    }
+    if (n == 0) return 0;
+
+    uint32_t sent = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        if (client->list[i] != RC_NONE) client->list[sent++] = client->list[i];
+    }
+    rc_round(client, client->list, sent);
+
+    uint16_t* list = client->list;
+    uint16_t* redirect = client->redirect;
+    for (int r = 0; r < DB_REDIS_MAX_REDIRECTS && sent; r++) {
+        sent = rc_redirects(client, list, sent, redirect);
+        if (sent) rc_round(client, redirect, sent);
+        uint16_t* t = list;
+        list = redirect;
+        redirect = t;
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        rc_cmd_t* cmd = &client->cmds[i];
+        int rc;
+        if (cmd->error || cmd->reply_node == RC_NONE) {
+            const char* err = cmd->error ? cmd->error : RC_ERR_UNAVAILABLE;
+            rc = rc_buf_put(out, err, strlen(err));
+        } else {
+            rc = rc_buf_put(out, client->conns[cmd->reply_node].rx.data + cmd->reply_off,
+                            cmd->reply_len);
+        }
+        if (rc < 0) return -1;
+    }
+
+    atomic_fetch_add(&cl->stats.commands, n);
+    atomic_fetch_add(&cl->stats.batches, 1);
+    return (ssize_t)off;
+}
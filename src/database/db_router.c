@@ -11,18 +11,31 @@ db_router_t* db_router_create(db_pool_t* pool, uint32_t max_sessions) {
     db_router_t* router = (db_router_t*)calloc(1, sizeof(db_router_t));
     if (!router) return NULL;
 
+    uint32_t buckets = 1;
+    while (buckets < max_sessions) buckets <<= 1;
+
     router->pool = pool;
     router->max_sessions = max_sessions;
     router->sessions = (db_session_t*)calloc(max_sessions, sizeof(db_session_t));
+    router->buckets = (db_session_t**)calloc(buckets, sizeof(db_session_t*));
+    router->bucket_mask = buckets - 1;
 
-    if (!router->sessions) {
+    if (!router->sessions || !router->buckets) {
+        free(router->sessions);
+        free(router->buckets);
         free(router);
         return NULL;
     }
 
+    for (uint32_t i = max_sessions; i > 0; i--) {
+        router->sessions[i - 1].hash_next = router->free_list;
+        router->free_list = &router->sessions[i - 1];
+    }
+
     pthread_mutex_t* mutex = (pthread_mutex_t*)malloc(sizeof(pthread_mutex_t));
     if (!mutex) {
         free(router->sessions);
+        free(router->buckets);
         free(router);
         return NULL;
     }
@@ -38,99 +51,250 @@ void db_router_destroy(db_router_t* router) {
     pthread_mutex_t* mutex = (pthread_mutex_t*)router->mutex;
     pthread_mutex_destroy(mutex);
     free(mutex);
+    free(router->buckets);
     free(router->sessions);
     free(router);
 }
 
+static inline db_session_t** db_router_bucket(db_router_t* router, uint64_t session_id) {
+    uint64_t h = session_id;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return &router->buckets[h & router->bucket_mask];
+}
+
 static db_session_t* db_router_find_session(db_router_t* router, uint64_t session_id) {
-    for (uint32_t i = 0; i < router->session_count; i++) {
-        if (router->sessions[i].session_id == session_id) {
-            return &router->sessions[i];
+    for (db_session_t* s = *db_router_bucket(router, session_id); s; s = s->hash_next) {
+        if (s->session_id == session_id) {
+            return s;
         }
     }
     return NULL;
 }
 
-static db_session_t* db_router_create_session(db_router_t* router, uint64_t session_id) {
-    if (router->session_count >= router->max_sessions) {
-        time_t oldest_time = 0;
-        uint32_t oldest_idx = 0;
-        bool found_non_transaction = false;
-
-        // Find the first non-transaction session to initialize baseline
-        for (uint32_t i = 0; i < router->session_count; i++) {
-            if (!router->sessions[i].in_transaction) {
-                oldest_time = router->sessions[i].last_activity;
-                oldest_idx = i;
-                found_non_transaction = true;
-                break;
-            }
-        }
+static void db_router_unhash(db_router_t* router, db_session_t* session) {
+    db_session_t** pp = db_router_bucket(router, session->session_id);
+    while (*pp != session) pp = &(*pp)->hash_next;
+    *pp = session->hash_next;
+}
 
-        // If we found a non-transaction session, continue to find the oldest one
-        if (found_non_transaction) {
-            for (uint32_t i = oldest_idx + 1; i < router->session_count; i++) {
-                if (!router->sessions[i].in_transaction &&
-                    router->sessions[i].last_activity < oldest_time) {
-                    oldest_time = router->sessions[i].last_activity;
-                    oldest_idx = i;
-                }
-            }
+static void db_router_lru_unlink(db_router_t* router, db_session_t* session) {
+    if (!session->in_lru) return;
 
-            // Always evict oldest session when at max capacity
-            router->sessions[oldest_idx].session_id = session_id;
-            router->sessions[oldest_idx].backend_id = 0;
-            router->sessions[oldest_idx].in_transaction = false;
-            router->sessions[oldest_idx].last_activity = time(NULL);
-            return &router->sessions[oldest_idx];
-        }
+    if (session->lru_prev) session->lru_prev->lru_next = session->lru_next;
+    else router->lru_head = session->lru_next;
+    if (session->lru_next) session->lru_next->lru_prev = session->lru_prev;
+    else router->lru_tail = session->lru_prev;
+
+    session->lru_prev = session->lru_next = NULL;
+    session->in_lru = false;
+}
+
+// A session that holds a server connection or an open transaction cannot
+// be evicted
+static bool db_router_session_busy(const db_session_t* session) {
+    return session->in_transaction || session->server;
+}
+
+// Record activity: idle sessions move to the head of the LRU, busy ones
+// leave it until they are idle again
+static void db_router_touch(db_router_t* router, db_session_t* session) {
+    session->last_activity = time(NULL);
+    db_router_lru_unlink(router, session);
+    if (db_router_session_busy(session)) return;
+
+    session->lru_next = router->lru_head;
+    if (router->lru_head) router->lru_head->lru_prev = session;
+    else router->lru_tail = session;
+    router->lru_head = session;
+    session->in_lru = true;
+}
+
+static db_session_t* db_router_create_session(db_router_t* router, uint64_t session_id) {
+    db_session_t* session = router->free_list;
 
-        return NULL;  // All sessions in transaction
+    if (session) {
+        router->free_list = session->hash_next;
+        router->session_count++;
+    } else {
+        // Always evict the least recently used idle session when full
+        session = router->lru_tail;
+        if (!session) return NULL;  // All sessions busy
+        db_router_lru_unlink(router, session);
+        db_router_unhash(router, session);
+        db_cache_invalidate(router->cache, session->cache_rules);
     }
 
-    db_session_t* session = &router->sessions[router->session_count++];
     session->session_id = session_id;
     session->backend_id = 0;
     session->in_transaction = false;
-    session->last_activity = time(NULL);
+    session->pinned = false;
+    session->write_pending = false;
+    session->write_position = 0;
+    session->written_ms = 0;
+    session->causal_until_ms = 0;
+    session->cache_rules = 0;
+    session->used = true;
+    session->server = NULL;
+
+    db_session_t** bucket = db_router_bucket(router, session_id);
+    session->hash_next = *bucket;
+    *bucket = session;
+    db_router_touch(router, session);
 
     return session;
 }
 
-db_connection_t* db_router_route_query(db_router_t* router,
-                                        const uint8_t* query_data,
-                                        size_t query_length,
-                                        uint64_t client_session_id) {
-    if (!router || !query_data || query_length == 0) return NULL;
+static uint64_t db_router_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
 
-    db_query_info_t query_info = {0};
+// Statements the result cache treats as writes
+static bool db_router_cache_writes(const db_query_info_t* info) {
+    return info->query_type == DB_QUERY_WRITE || info->query_type == DB_QUERY_UNKNOWN;
+}
 
-    db_protocol_type_t protocol = db_protocol_detect(query_data, query_length);
+static bool db_router_tracks_writes(const db_router_t* router, const db_query_info_t* info) {
+    if (router->cache && db_router_cache_writes(info) && info->query_length > 0) return true;
+    return router->causal_window_ms && info->query_type == DB_QUERY_WRITE;
+}
 
-    switch (protocol) {
+// Remember what the write touches; it is invalidated once it completes
+static void db_router_cache_note(db_router_t* router, db_session_t* session,
+                                 const db_query_info_t* info) {
+    if (router->cache && session && db_router_cache_writes(info)) {
+        session->cache_rules |= db_cache_written_rules(router->cache, info);
+    }
+}
+
+// Read-your-writes: a write (or the COMMIT after writes) opens the session's
+// window, a read inside it gets the requirement to hand to the pool
+static const db_causal_t* db_router_causal(db_router_t* router, db_session_t* session,
+                                           const db_query_info_t* info, db_causal_t* causal) {
+    if (!router->causal_window_ms || !session) return NULL;
+
+    uint64_t now = db_router_now_ms();
+    if (info->query_type == DB_QUERY_WRITE ||
+        (info->query_type == DB_QUERY_TRANSACTION_END && session->write_pending)) {
+        if (!session->write_pending) session->write_position = 0;
+        session->write_pending = true;
+        session->written_ms = now;
+        session->causal_until_ms = now + router->causal_window_ms;
+        return NULL;
+    }
+
+    if (now >= session->causal_until_ms) return NULL;
+
+    causal->position = session->write_position;
+    causal->written_ms = session->written_ms;
+    return causal;
+}
+
+// A hint sends a read or an unclassified statement to either side, but
+// never moves writes or transaction control off the primary
+static db_query_type_t db_router_route_type(const db_query_info_t* info) {
+    if (info->query_type != DB_QUERY_READ && info->query_type != DB_QUERY_UNKNOWN) {
+        return info->query_type;
+    }
+    if (info->hint == DB_HINT_REPLICA) return DB_QUERY_READ;
+    if (info->hint == DB_HINT_PRIMARY) return DB_QUERY_WRITE;
+    return info->query_type;
+}
+
+// Transaction pooling: reuse the connection the session holds, or borrow one
+// and keep it when the statement opens a transaction or changes the session
+static db_connection_t* db_router_route_transaction(db_router_t* router,
+                                                    const db_query_info_t* info,
+                                                    uint64_t session_id) {
+    db_session_t* session = db_router_find_session(router, session_id);
+    bool begins = info->query_type == DB_QUERY_TRANSACTION_BEGIN;
+    bool sets = info->query_type == DB_QUERY_SESSION_VAR;
+
+    if (!session && (begins || sets || db_router_tracks_writes(router, info))) {
+        session = db_router_create_session(router, session_id);
+        if (!session) return NULL;
+    }
+
+    db_causal_t causal;
+    const db_causal_t* need = db_router_causal(router, session, info, &causal);
+    db_router_cache_note(router, session, info);
+
+    db_connection_t* conn;
+    if (session && session->server) {
+        conn = session->server;
+    } else {
+        conn = db_pool_acquire_causal(router->pool, db_router_route_type(info),
+                                      begins || (session && session->in_transaction), 0, need);
+        if (!conn) return NULL;
+    }
+
+    if (session) {
+        if (begins) {
+            session->in_transaction = true;
+        } else if (info->query_type == DB_QUERY_TRANSACTION_END) {
+            session->in_transaction = false;
+        }
+        if (sets) session->pinned = true;
+
+        if (!session->server && (session->in_transaction || session->pinned)) {
+            session->server = conn;
+            session->backend_id = conn->backend_id;
+            router->lent_count++;
+        }
+        db_router_touch(router, session);
+    }
+
+    return conn;
+}
+
+static int db_router_parse(const uint8_t* query_data, size_t query_length,
+                           db_query_info_t* info) {
+    switch (db_protocol_detect(query_data, query_length)) {
         case DB_PROTOCOL_POSTGRESQL:
-            db_protocol_parse_postgresql(query_data, query_length, &query_info);
-            break;
+            return db_protocol_parse_postgresql(query_data, query_length, info);
         case DB_PROTOCOL_MYSQL:
-            db_protocol_parse_mysql(query_data, query_length, &query_info);
-            break;
+            return db_protocol_parse_mysql(query_data, query_length, info);
         case DB_PROTOCOL_REDIS:
-            db_protocol_parse_redis(query_data, query_length, &query_info);
-            break;
+            return db_protocol_parse_redis(query_data, query_length, info);
         default:
-            return NULL;
+            return -1;
     }
+}
+
+db_connection_t* db_router_route_query(db_router_t* router,
+                                        const uint8_t* query_data,
+                                        size_t query_length,
+                                        uint64_t client_session_id) {
+    if (!router || !query_data || query_length == 0) return NULL;
+
+    db_query_info_t query_info = {0};
+    if (db_router_parse(query_data, query_length, &query_info) < 0) return NULL;
 
     pthread_mutex_t* mutex = (pthread_mutex_t*)router->mutex;
     pthread_mutex_lock(mutex);
 
+    if (router->mode == DB_POOL_TRANSACTION) {
+        db_connection_t* conn = db_router_route_transaction(router, &query_info,
+                                                            client_session_id);
+        pthread_mutex_unlock(mutex);
+        return conn;
+    }
+
     db_session_t* session = db_router_find_session(router, client_session_id);
 
     if (!session && (query_info.requires_sticky ||
-                     query_info.query_type == DB_QUERY_TRANSACTION_BEGIN)) {
+                     query_info.query_type == DB_QUERY_TRANSACTION_BEGIN ||
+                     db_router_tracks_writes(router, &query_info))) {
         session = db_router_create_session(router, client_session_id);
     }
 
+    db_causal_t causal;
+    const db_causal_t* need = db_router_causal(router, session, &query_info, &causal);
+    db_router_cache_note(router, session, &query_info);
+
     uint64_t backend_id = 0;
     bool in_transaction = false;
 
@@ -148,12 +312,12 @@ db_connection_t* db_router_route_query(db_router_t* router,
             in_transaction = session->in_transaction;
         }
 
-        session->last_activity = time(NULL);
+        db_router_touch(router, session);
     }
 
     // Keep mutex locked while acquiring connection to prevent race condition
-    db_connection_t* conn = db_pool_acquire(router->pool, query_info.query_type,
-                                             in_transaction, backend_id);
+    db_connection_t* conn = db_pool_acquire_causal(router->pool, db_router_route_type(&query_info),
+                                                    in_transaction, backend_id, need);
 
     // Update session backend_id if it was just created
     if (conn && session && session->backend_id == 0) {
@@ -165,21 +329,135 @@ db_connection_t* db_router_route_query(db_router_t* router,
     return conn;
 }
 
+void db_router_set_mode(db_router_t* router, db_pool_mode_t mode) {
+    if (!router) return;
+
+    pthread_mutex_t* mutex = (pthread_mutex_t*)router->mutex;
+    pthread_mutex_lock(mutex);
+    router->mode = mode;
+    pthread_mutex_unlock(mutex);
+}
+
+void db_router_set_causal_window(db_router_t* router, uint32_t window_ms) {
+    if (!router) return;
+
+    pthread_mutex_t* mutex = (pthread_mutex_t*)router->mutex;
+    pthread_mutex_lock(mutex);
+    router->causal_window_ms = window_ms;
+    pthread_mutex_unlock(mutex);
+}
+
+void db_router_set_cache(db_router_t* router, db_cache_t* cache) {
+    if (!router) return;
+
+    pthread_mutex_t* mutex = (pthread_mutex_t*)router->mutex;
+    pthread_mutex_lock(mutex);
+    router->cache = cache;
+    pthread_mutex_unlock(mutex);
+}
+
+int db_router_cache_lookup(db_router_t* router, const uint8_t* query_data, size_t query_length,
+                           const void* params, size_t params_length,
+                           uint64_t client_session_id, db_cache_key_t* key,
+                           cache_entry_t** entry) {
+    if (!router || !query_data || query_length == 0) return DB_CACHE_BYPASS;
+
+    db_query_info_t query_info = {0};
+    if (db_router_parse(query_data, query_length, &query_info) < 0) return DB_CACHE_BYPASS;
+
+    pthread_mutex_t* mutex = (pthread_mutex_t*)router->mutex;
+    pthread_mutex_lock(mutex);
+
+    db_cache_t* cache = router->cache;
+    db_session_t* session = db_router_find_session(router, client_session_id);
+    bool own_state = session && (session->in_transaction || session->pinned ||
+                                 session->cache_rules);
+
+    pthread_mutex_unlock(mutex);
+
+    if (!cache || own_state) return DB_CACHE_BYPASS;
+    return db_cache_lookup(cache, &query_info, params, params_length, key, entry);
+}
+
+void db_router_set_write_position(db_router_t* router, uint64_t client_session_id,
+                                  uint64_t position) {
+    if (!router) return;
+
+    pthread_mutex_t* mutex = (pthread_mutex_t*)router->mutex;
+    pthread_mutex_lock(mutex);
+
+    db_session_t* session = db_router_find_session(router, client_session_id);
+    if (session && position > session->write_position) {
+        session->write_position = position;
+    }
+
+    pthread_mutex_unlock(mutex);
+}
+
+void db_router_query_done(db_router_t* router, uint64_t client_session_id,
+                          db_connection_t* conn) {
+    if (!router || !conn) return;
+
+    pthread_mutex_t* mutex = (pthread_mutex_t*)router->mutex;
+    pthread_mutex_lock(mutex);
+
+    db_session_t* session = db_router_find_session(router, client_session_id);
+
+    // The write has completed: its window runs from now
+    if (session && session->write_pending) {
+        session->written_ms = db_router_now_ms();
+        session->causal_until_ms = session->written_ms + router->causal_window_ms;
+        if (!session->in_transaction) session->write_pending = false;
+    }
+
+    if (session && session->cache_rules && !session->in_transaction) {
+        db_cache_invalidate(router->cache, session->cache_rules);
+        session->cache_rules = 0;
+    }
+
+    if (session && session->server == conn) {
+        if (session->in_transaction || session->pinned) {
+            pthread_mutex_unlock(mutex);
+            return;
+        }
+        session->server = NULL;
+        router->lent_count--;
+        db_router_touch(router, session);
+    }
+
+    pthread_mutex_unlock(mutex);
+
+    db_pool_release(router->pool, conn);
+}
+
 void db_router_end_session(db_router_t* router, uint64_t client_session_id) {
     if (!router) return;
 
     pthread_mutex_t* mutex = (pthread_mutex_t*)router->mutex;
     pthread_mutex_lock(mutex);
 
-    for (uint32_t i = 0; i < router->session_count; i++) {
-        if (router->sessions[i].session_id == client_session_id) {
-            if (i < router->session_count - 1) {
-                memmove(&router->sessions[i], &router->sessions[i + 1],
-                        (router->session_count - i - 1) * sizeof(db_session_t));
+    db_session_t* session = db_router_find_session(router, client_session_id);
+    if (session) {
+        // A write cut off mid-flight may still have committed
+        db_cache_invalidate(router->cache, session->cache_rules);
+
+        if (session->server) {
+            // Closing aborts an open transaction and drops changed state
+            if (session->in_transaction || session->pinned) {
+                db_pool_discard(router->pool, session->server);
+            } else {
+                db_pool_release(router->pool, session->server);
             }
-            router->session_count--;
-            break;
+            router->lent_count--;
         }
+
+        db_router_lru_unlink(router, session);
+        db_router_unhash(router, session);
+        session->used = false;
+        session->server = NULL;
+        session->hash_next = router->free_list;
+        router->free_list = session;
+        router->session_count--;
     }
 
     pthread_mutex_unlock(mutex);
@@ -192,18 +470,42 @@ int db_router_get_stats(db_router_t* router, char* buffer, size_t buffer_size) {
     pthread_mutex_lock(mutex);
 
     int written = snprintf(buffer, buffer_size,
-        "{\"session_count\":%u,\"max_sessions\":%u,\"sessions\":[",
-        router->session_count, router->max_sessions);
+        "{\"mode\":\"%s\",\"session_count\":%u,\"max_sessions\":%u,"
+        "\"lent_connections\":%u,",
+        router->mode == DB_POOL_TRANSACTION ? "transaction" : "session",
+        router->session_count, router->max_sessions, router->lent_count);
+
+    if (router->cache && written < (int)buffer_size) {
+        const db_cache_t* cache = router->cache;
+        written += snprintf(buffer + written, buffer_size - written,
+            "\"cache\":{\"hits\":%lu,\"misses\":%lu,\"bypassed\":%lu,"
+            "\"stores\":%lu,\"invalidations\":%lu},",
+            (unsigned long)atomic_load(&cache->stats.hits),
+            (unsigned long)atomic_load(&cache->stats.misses),
+            (unsigned long)atomic_load(&cache->stats.bypassed),
+            (unsigned long)atomic_load(&cache->stats.stores),
+            (unsigned long)atomic_load(&cache->stats.invalidations));
+    }
+
+    if (written < (int)buffer_size) {
+        written += snprintf(buffer + written, buffer_size - written, "\"sessions\":[");
+    }
+
+    bool first = true;
+    for (uint32_t i = 0; i < router->max_sessions && written < (int)buffer_size; i++) {
+        const db_session_t* session = &router->sessions[i];
+        if (!session->used) continue;
 
-    for (uint32_t i = 0; i < router->session_count && written < (int)buffer_size; i++) {
-        if (i > 0) {
+        if (!first) {
             written += snprintf(buffer + written, buffer_size - written, ",");
         }
+        first = false;
         written += snprintf(buffer + written, buffer_size - written,
-            "{\"session_id\":%lu,\"backend_id\":%lu,\"in_transaction\":%s}",
-            (unsigned long)router->sessions[i].session_id,
-            (unsigned long)router->sessions[i].backend_id,
-            router->sessions[i].in_transaction ? "true" : "false");
+            "{\"session_id\":%lu,\"backend_id\":%lu,\"in_transaction\":%s,\"pinned\":%s}",
+            (unsigned long)session->session_id,
+            (unsigned long)session->backend_id,
+            session->in_transaction ? "true" : "false",
+            session->pinned ? "true" : "false");
     }
 
     written += snprintf(buffer + written, buffer_size - written, "]}");
@@ -46,253 +46,202 @@ check_t* check_new(check_type_t type) {
     return check;
 }
 
-int check_tcp(check_t *check) {
-    struct server *srv = check->server;
+void check_free(check_t *check) {
+    if (!check) return;
+    if (check->conn.fd >= 0) close(check->conn.fd);
+    if (check->conn.buf) buffer_free(check->conn.buf);
+    free(check);
+}
 
-    // Create socket
-    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
-    if (fd < 0) {
-        set_server_check_status(check, HCHK_STATUS_L4CON, strerror(errno));
-        return -1;
-    }
+int check_probe_request(const check_t *check, char *buf, size_t size) {
+    int len;
 
-    // Set socket options
-    int val = 1;
-    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
-    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &val, sizeof(val));
+    switch (check->type) {
+        case HCHK_TYPE_HTTP:
+            len = snprintf(buf, size,
+                           "%s %s HTTP/1.%d\r\n"
+                           "Host: %s\r\n"
+                           "User-Agent: UltraBalancer/1.0\r\n"
+                           "Connection: close\r\n"
+                           "\r\n",
+                           check->http.method ? check->http.method : "OPTIONS",
+                           check->http.uri ? check->http.uri : "/",
+                           check->http.version ? check->http.version : 1,
+                           check->http.host ? check->http.host : "localhost");
+            return (len < 0 || (size_t)len >= size) ? -1 : len;
 
-    struct timeval tv;
-    tv.tv_sec = check->interval.timeout / 1000;
-    tv.tv_usec = (check->interval.timeout % 1000) * 1000;
-    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        case HCHK_TYPE_REDIS:
+            len = snprintf(buf, size, "*1\r\n$4\r\nPING\r\n");
+            return (len < 0 || (size_t)len >= size) ? -1 : len;
 
-    // Connect to backend
-    struct sockaddr_in *sin = (struct sockaddr_in *)&srv->addr;
-    struct sockaddr_in addr = {
-        .sin_family = AF_INET,
-        .sin_port = htons(check->port ? check->port : srv->port),
-        .sin_addr = sin->sin_addr
-    };
+        case HCHK_TYPE_MYSQL:
+            // The server sends its handshake first
+            return 0;
 
-    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        if (errno != EINPROGRESS) {
-            close(fd);
-            set_server_check_status(check, HCHK_STATUS_L4CON, strerror(errno));
-            return -1;
-        }
+        default:
+            if (!check->tcp.send_string || check->tcp.send_len == 0) return 0;
+            if (check->tcp.send_len > size) return -1;
+            memcpy(buf, check->tcp.send_string, check->tcp.send_len);
+            return (int)check->tcp.send_len;
     }
+}
 
-    check->conn.fd = fd;
-
-    // Send check data if configured
-    if (check->tcp.send_string && check->tcp.send_len > 0) {
-        ssize_t sent = send(fd, check->tcp.send_string, check->tcp.send_len, MSG_NOSIGNAL);
-        if (sent < 0) {
-            close(fd);
-            check->conn.fd = -1;
-            set_server_check_status(check, HCHK_STATUS_L4CON, "Send failed");
-            return -1;
-        }
+static int check_tcp_response(check_t *check, const char *data, size_t len, bool eof) {
+    if (!check->tcp.expect_string && !check->tcp.expect_regex) {
+        set_server_check_status(check, HCHK_STATUS_L4OK, "TCP check passed");
+        return 1;
     }
 
-    // Receive and check response
-    if (check->tcp.expect_string || check->tcp.expect_regex) {
-        char buffer[4096];
-        ssize_t received = recv(fd, buffer, sizeof(buffer) - 1, 0);
-
-        if (received <= 0) {
-            close(fd);
-            check->conn.fd = -1;
-            set_server_check_status(check, HCHK_STATUS_L4TOUT, "No response");
-            return -1;
-        }
-
-        buffer[received] = '\0';
+    if (len == 0) {
+        if (!eof) return 0;
+        set_server_check_status(check, HCHK_STATUS_L4TOUT, "No response");
+        return 1;
+    }
 
-        // Check expected response
-        if (check->tcp.expect_string) {
-            if (!strstr(buffer, check->tcp.expect_string)) {
-                close(fd);
-                check->conn.fd = -1;
-                set_server_check_status(check, HCHK_STATUS_L7RSP, "Unexpected response");
-                return -1;
-            }
-        }
+    if (check->tcp.expect_string &&
+        !memmem(data, len, check->tcp.expect_string, strlen(check->tcp.expect_string))) {
+        if (!eof) return 0;
+        set_server_check_status(check, HCHK_STATUS_L7RSP, "Unexpected response");
+        return 1;
+    }
 
-        if (check->tcp.expect_regex) {
+    if (check->tcp.expect_regex) {
 #ifdef USE_PCRE
-            int ovector[30];
-            int ret = pcre_exec(check->tcp.expect_regex, NULL, buffer, received,
-                               0, 0, ovector, 30);
-            if (ret < 0) {
-                close(fd);
-                check->conn.fd = -1;
-                set_server_check_status(check, HCHK_STATUS_L7RSP, "Regex mismatch");
-                return -1;
-            }
+        int ovector[30];
+        if (pcre_exec(check->tcp.expect_regex, NULL, data, len, 0, 0, ovector, 30) < 0) {
+            if (!eof) return 0;
+            set_server_check_status(check, HCHK_STATUS_L7RSP, "Regex mismatch");
+            return 1;
+        }
 #else
-            // PCRE not available, skip regex check
-            log_warning("PCRE regex check skipped (library not available)");
+        // PCRE not available, skip regex check
+        log_warning("PCRE regex check skipped (library not available)");
 #endif
-        }
     }
 
-    close(fd);
-    check->conn.fd = -1;
-
     set_server_check_status(check, HCHK_STATUS_L4OK, "TCP check passed");
-    return 0;
+    return 1;
 }
 
-int check_http(check_t *check) {
-    struct server *srv = check->server;
+static int check_http_response(check_t *check, const char *data, size_t len, bool eof) {
+    // The status line is all that is judged
+    const char *eol = len ? memchr(data, '\n', len) : NULL;
+    if (!eol && !eof) return 0;
 
-    // First establish TCP connection
-    if (check_tcp(check) < 0) {
-        return -1;
-    }
-
-    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
-    if (fd < 0) {
-        set_server_check_status(check, HCHK_STATUS_L4CON, strerror(errno));
-        return -1;
-    }
-
-    struct sockaddr_in *sin = (struct sockaddr_in *)&srv->addr;
-    struct sockaddr_in addr = {
-        .sin_family = AF_INET,
-        .sin_port = htons(check->port ? check->port : srv->port),
-        .sin_addr = sin->sin_addr
-    };
-
-    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        if (errno != EINPROGRESS && errno != EISCONN) {
-            close(fd);
-            set_server_check_status(check, HCHK_STATUS_L4CON, strerror(errno));
-            return -1;
-        }
-    }
-
-    // Build HTTP request
-    char request[1024];
-    int len = snprintf(request, sizeof(request),
-                      "%s %s HTTP/1.%d\r\n"
-                      "Host: %s\r\n"
-                      "User-Agent: UltraBalancer/1.0\r\n"
-                      "Connection: close\r\n"
-                      "\r\n",
-                      check->http.method ? check->http.method : "OPTIONS",
-                      check->http.uri ? check->http.uri : "/",
-                      check->http.version ? check->http.version : 1,
-                      check->http.host ? check->http.host : "localhost");
-
-    if (send(fd, request, len, MSG_NOSIGNAL) < 0) {
-        close(fd);
-        set_server_check_status(check, HCHK_STATUS_L6RSP, "Failed to send request");
-        return -1;
-    }
-
-    // Read response
-    char response[4096];
-    ssize_t received = recv(fd, response, sizeof(response) - 1, 0);
-
-    if (received <= 0) {
-        close(fd);
+    if (len == 0) {
         set_server_check_status(check, HCHK_STATUS_L6TOUT, "No HTTP response");
-        return -1;
+        return 1;
     }
 
-    response[received] = '\0';
+    char line[128];
+    size_t line_len = eol ? (size_t)(eol - data) : len;
+    if (line_len >= sizeof(line)) line_len = sizeof(line) - 1;
+    memcpy(line, data, line_len);
+    line[line_len] = '\0';
 
     // Parse status code
     int status_code = 0;
-    if (sscanf(response, "HTTP/%*d.%*d %d", &status_code) != 1) {
-        close(fd);
+    if (sscanf(line, "HTTP/%*d.%*d %d", &status_code) != 1) {
         set_server_check_status(check, HCHK_STATUS_L7RSP, "Invalid HTTP response");
-        return -1;
+        return 1;
     }
 
     // Check expected status
+    char msg[64];
     if (check->tcp.expect_status > 0) {
         if (status_code != check->tcp.expect_status) {
-            close(fd);
-            char msg[64];
             snprintf(msg, sizeof(msg), "Status %d != %d", status_code, check->tcp.expect_status);
             set_server_check_status(check, HCHK_STATUS_L7STS, msg);
-            return -1;
+            return 1;
         }
-    } else {
+    } else if (status_code < 200 || status_code >= 400) {
         // Default: accept 2xx and 3xx
-        if (status_code < 200 || status_code >= 400) {
-            close(fd);
-            char msg[64];
-            snprintf(msg, sizeof(msg), "HTTP status %d", status_code);
-            set_server_check_status(check, HCHK_STATUS_L7STS, msg);
-            return -1;
-        }
+        snprintf(msg, sizeof(msg), "HTTP status %d", status_code);
+        set_server_check_status(check, HCHK_STATUS_L7STS, msg);
+        return 1;
     }
 
-    close(fd);
     set_server_check_status(check, HCHK_STATUS_L7OK, "HTTP check passed");
-    return 0;
+    return 1;
 }
 
-int check_mysql(check_t *check) {
-    struct server *srv = check->server;
-
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (fd < 0) {
-        set_server_check_status(check, HCHK_STATUS_L4CON, strerror(errno));
-        return -1;
-    }
-
-    struct sockaddr_in *sin = (struct sockaddr_in *)&srv->addr;
-    struct sockaddr_in addr = {
-        .sin_family = AF_INET,
-        .sin_port = htons(check->port ? check->port : 3306),
-        .sin_addr = sin->sin_addr
-    };
-
-    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        close(fd);
-        set_server_check_status(check, HCHK_STATUS_L4CON, strerror(errno));
-        return -1;
-    }
-
-    // Read MySQL handshake packet
-    uint8_t packet[256];
-    ssize_t received = recv(fd, packet, sizeof(packet), 0);
-
-    if (received < 4) {
-        close(fd);
+static int check_mysql_response(check_t *check, const char *data, size_t len, bool eof) {
+    // Packet header and the protocol version of the handshake
+    if (len < 5) {
+        if (!eof) return 0;
         set_server_check_status(check, HCHK_STATUS_L6RSP, "Invalid MySQL handshake");
-        return -1;
+        return 1;
     }
 
-    // Check packet header
+    const uint8_t *packet = (const uint8_t *)data;
     uint32_t packet_len = packet[0] | (packet[1] << 8) | (packet[2] << 16);
     uint8_t packet_num = packet[3];
 
     if (packet_len < 4 || packet_num != 0) {
-        close(fd);
         set_server_check_status(check, HCHK_STATUS_L6RSP, "Invalid MySQL packet");
-        return -1;
+        return 1;
     }
 
-    // Check protocol version (packet[4])
     if (packet[4] != 10 && packet[4] != 9) {
-        close(fd);
         set_server_check_status(check, HCHK_STATUS_L6RSP, "Unsupported MySQL version");
-        return -1;
+        return 1;
     }
 
-    close(fd);
     set_server_check_status(check, HCHK_STATUS_L6OK, "MySQL check passed");
-    return 0;
+    return 1;
 }
 
-int check_redis(check_t *check) {
+static int check_redis_response(check_t *check, const char *data, size_t len, bool eof) {
+    static const char pong[] = "+PONG\r\n";
+    const size_t pong_len = sizeof(pong) - 1;
+
+    // Wait for the rest of a reply that starts out right
+    if (len < pong_len && !eof && memcmp(data, pong, len) == 0) return 0;
+
+    if (len < pong_len || memcmp(data, pong, pong_len) != 0) {
+        set_server_check_status(check, HCHK_STATUS_L6RSP, "Invalid PONG response");
+        return 1;
+    }
+
+    set_server_check_status(check, HCHK_STATUS_L6OK, "Redis check passed");
+    return 1;
+}
+
+int check_probe_response(check_t *check, const char *data, size_t len, bool eof) {
+    switch (check->type) {
+        case HCHK_TYPE_HTTP:
+            return check_http_response(check, data, len, eof);
+        case HCHK_TYPE_MYSQL:
+            return check_mysql_response(check, data, len, eof);
+        case HCHK_TYPE_REDIS:
+            return check_redis_response(check, data, len, eof);
+        default:
+            return check_tcp_response(check, data, len, eof);
+    }
+}
+
+bool check_passed(const check_t *check) {
+    switch (check->status) {
+        case HCHK_STATUS_L4OK:
+        case HCHK_STATUS_L6OK:
+        case HCHK_STATUS_L7OK:
+        case HCHK_STATUS_L7OKC:
+            return true;
+        default:
+            return false;
+    }
+}
+
+uint32_t check_next_interval(const check_t *check, bool up) {
+    if (up) {
+        return check->consecutive_errors ? check->interval.fastinter : check->interval.inter;
+    }
+    return check->consecutive_success ? check->interval.fastinter : check->interval.downinter;
+}
+
+// Blocking run of one probe against the server; the socket timeouts bound
+// every step
+static int check_run(check_t *check, uint16_t default_port) {
     struct server *srv = check->server;
 
     int fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -301,40 +250,77 @@ int check_redis(check_t *check) {
         return -1;
     }
 
+    // Set socket options
+    int val = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+
+    struct timeval tv;
+    tv.tv_sec = check->interval.timeout / 1000;
+    tv.tv_usec = (check->interval.timeout % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
     struct sockaddr_in *sin = (struct sockaddr_in *)&srv->addr;
     struct sockaddr_in addr = {
         .sin_family = AF_INET,
-        .sin_port = htons(check->port ? check->port : 6379),
+        .sin_port = htons(check->port ? check->port : default_port),
         .sin_addr = sin->sin_addr
     };
 
     if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
         close(fd);
-        set_server_check_status(check, HCHK_STATUS_L4CON, strerror(errno));
+        set_server_check_status(check, errno == EINPROGRESS ? HCHK_STATUS_L4TOUT : HCHK_STATUS_L4CON,
+                                strerror(errno));
         return -1;
     }
 
-    // Send PING command
-    const char *ping_cmd = "*1\r\n$4\r\nPING\r\n";
-    if (send(fd, ping_cmd, strlen(ping_cmd), MSG_NOSIGNAL) < 0) {
+    char request[1024];
+    int len = check_probe_request(check, request, sizeof(request));
+    if (len < 0) {
         close(fd);
-        set_server_check_status(check, HCHK_STATUS_L6RSP, "Failed to send PING");
+        set_server_check_status(check, HCHK_STATUS_L6RSP, "Check request too large");
         return -1;
     }
 
-    // Expect "+PONG\r\n"
-    char response[32];
-    ssize_t received = recv(fd, response, sizeof(response) - 1, 0);
+    for (int off = 0; off < len; ) {
+        ssize_t sent = send(fd, request + off, len - off, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            close(fd);
+            set_server_check_status(check, HCHK_STATUS_L4CON, "Send failed");
+            return -1;
+        }
+        off += sent;
+    }
 
-    if (received < 7 || strncmp(response, "+PONG\r\n", 7) != 0) {
-        close(fd);
-        set_server_check_status(check, HCHK_STATUS_L6RSP, "Invalid PONG response");
-        return -1;
+    char response[4096];
+    size_t received = 0;
+    while (!check_probe_response(check, response, received, received == sizeof(response))) {
+        ssize_t n = recv(fd, response + received, sizeof(response) - received, 0);
+        if (n <= 0) {
+            check_probe_response(check, response, received, true);
+            break;
+        }
+        received += n;
     }
 
     close(fd);
-    set_server_check_status(check, HCHK_STATUS_L6OK, "Redis check passed");
-    return 0;
+    return check_passed(check) ? 0 : -1;
+}
+
+int check_tcp(check_t *check) {
+    return check_run(check, check->server->port);
+}
+
+int check_http(check_t *check) {
+    return check_run(check, check->server->port);
+}
+
+int check_mysql(check_t *check) {
+    return check_run(check, 3306);
+}
+
+int check_redis(check_t *check) {
+    return check_run(check, 6379);
 }
 
 void set_server_check_status(check_t *check, check_status_t status, const char *desc) {
@@ -345,44 +331,38 @@ void set_server_check_status(check_t *check, check_status_t status, const char *
         check->desc[sizeof(check->desc) - 1] = '\0';
     }
 
+    time_t now = time(NULL);
+    check->last_check = now;
+
+    bool passed = check_passed(check);
+    if (passed) {
+        check->consecutive_success++;
+        check->consecutive_errors = 0;
+    } else {
+        check->consecutive_errors++;
+        check->consecutive_success = 0;
+    }
+
+    // Checks that are not attached to a server only keep the counters
     struct server *srv = check->server;
     if (!srv) return;
 
-    time_t now = time(NULL);
-
     // Update server state based on check result
-    switch (status) {
-        case HCHK_STATUS_L4OK:
-        case HCHK_STATUS_L6OK:
-        case HCHK_STATUS_L7OK:
-        case HCHK_STATUS_L7OKC:
-            check->consecutive_success++;
-            check->consecutive_errors = 0;
-
-            if (check->consecutive_success >= check->interval.rise) {
-                if (srv->cur_state != SRV_RUNNING) {
-                    srv->cur_state = SRV_RUNNING;
-                    srv->last_change = now;
-                    log_info("Server %s:%d is UP", srv->hostname, srv->port);
-                }
-            }
-            break;
-
-        default:
-            check->consecutive_errors++;
-            check->consecutive_success = 0;
-
-            if (check->consecutive_errors >= check->interval.fall) {
-                if (srv->cur_state == SRV_RUNNING) {
-                    srv->cur_state = SRV_MAINTAIN;
-                    srv->last_change = now;
-                    log_warning("Server %s:%d is DOWN: %s", srv->hostname, srv->port, desc);
-                }
-            }
-            break;
+    if (passed) {
+        if (check->consecutive_success >= check->interval.rise && srv->cur_state != SRV_RUNNING) {
+            srv->cur_state = SRV_RUNNING;
+            srv->last_change = now;
+            log_info("Server %s:%d is UP", srv->hostname, srv->port);
+            proxy_servers_changed(srv->proxy);
+        }
+    } else {
+        if (check->consecutive_errors >= check->interval.fall && srv->cur_state == SRV_RUNNING) {
+            srv->cur_state = SRV_MAINTAIN;
+            srv->last_change = now;
+            log_warning("Server %s:%d is DOWN: %s", srv->hostname, srv->port, desc);
+            proxy_servers_changed(srv->proxy);
+        }
     }
-
-    check->last_check = now;
 }
 
 struct task* process_check(struct task *t, void *context, unsigned int state) {
@@ -418,14 +398,7 @@ struct task* process_check(struct task *t, void *context, unsigned int state) {
     check->duration = (time(NULL) - check->start_time) * 1000;
 
     // Schedule next check
-    uint32_t interval;
-    if (check->server->cur_state == SRV_RUNNING) {
-        interval = check->interval.inter;
-    } else if (check->consecutive_errors == 0) {
-        interval = check->interval.fastinter;
-    } else {
-        interval = check->interval.downinter;
-    }
+    uint32_t interval = check_next_interval(check, check->server->cur_state == SRV_RUNNING);
 
     t->expire = tick_add(now_ms, interval);
 
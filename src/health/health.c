@@ -1,4 +1,8 @@
 #include "core/loadbalancer.h"
+#include "stats/lb_stats.h"
+#include "core/lb_health.h"
+#include "core/lb_timer.h"
+#include "health/health.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,140 +16,381 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <fcntl.h>
-#include <sys/select.h>
+#include <stddef.h>
+
+// Only moves between UP and DOWN, MAINT and DRAIN belong to the operator.
+// Selection works from views built off the backend states; rebuild them
+// on every transition.
+static bool health_set_state(loadbalancer_t* lb, backend_t* backend,
+                             backend_state_t from, backend_state_t to) {
+    if (!atomic_compare_exchange_strong(&backend->state, &from, to)) return false;
+    if (to == BACKEND_UP) lb_backend_slow_start(lb, backend);
+    lb_backends_changed(lb);
+    return true;
+}
 
-void* health_check_thread(void* arg) {
-    loadbalancer_t* lb = (loadbalancer_t*)arg;
+/*
+ * Event-driven checker: one probe per backend, all driven from a single
+ * epoll loop, so a slow or silent backend only holds its own socket. The
+ * timer of a probe is its next run while idle and its deadline while in
+ * flight. The wire format and the verdict come from check_probe_request
+ * and check_probe_response (health/checks.c).
+ */
+typedef enum {
+    PROBE_IDLE,
+    PROBE_CONNECTING,
+    PROBE_SENDING,
+    PROBE_READING
+} probe_phase_t;
+
+typedef struct health_probe {
+    backend_t* backend;
+    check_t* check;
+    int fd;
+    uint32_t events;  // registered with epoll, 0 while not
+    probe_phase_t phase;
+    uint64_t start_ns;
+    lb_timer_t timer;
+    uint32_t out_len;
+    uint32_t out_off;
+    uint32_t in_len;
+    char out[LB_HEALTH_BUF_SIZE];
+    char in[LB_HEALTH_BUF_SIZE];
+} health_probe_t;
+
+typedef struct health_loop {
+    loadbalancer_t* lb;
+    int epfd;
+    lb_timer_wheel_t wheel;
+    health_probe_t** probes;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t inflight;
+    uint64_t rand;
+} health_loop_t;
+
+static uint64_t health_now_ms(void) {
+    return get_time_ns() / 1000000ULL;
+}
 
-    while (lb->running) {
-        // Skip health checks if disabled
-        if (!lb->config.health_check_enabled) {
-            sleep(1);
-            continue;
+static uint64_t health_rand(health_loop_t* loop) {
+    loop->rand ^= loop->rand << 13;
+    loop->rand ^= loop->rand >> 7;
+    loop->rand ^= loop->rand << 17;
+    return loop->rand;
+}
+
+// Spread runs by +-12.5% so that backends added together drift apart
+static uint32_t health_jitter(health_loop_t* loop, uint32_t interval_ms) {
+    uint32_t spread = interval_ms / 4;
+    return interval_ms - interval_ms / 8 + (uint32_t)(health_rand(loop) % (spread + 1));
+}
+
+static health_probe_t* health_probe_new(loadbalancer_t* lb, backend_t* backend) {
+    health_probe_t* p = calloc(1, sizeof(*p));
+    if (!p) return NULL;
+
+    p->check = check_new((check_type_t)lb->config.health_check_type);
+    if (!p->check) {
+        free(p);
+        return NULL;
+    }
+
+    uint32_t inter = lb->config.health_check_interval_ms ? lb->config.health_check_interval_ms : 1;
+    p->check->http.method = "HEAD";
+    p->check->http.uri = "/";
+    p->check->interval.inter = inter;
+    p->check->interval.fastinter = inter / 4 ? inter / 4 : 1;
+    p->check->interval.downinter = inter;
+    p->check->interval.timeout = inter < LB_HEALTH_TIMEOUT_MS ? inter : LB_HEALTH_TIMEOUT_MS;
+    p->check->interval.rise = 1;
+    p->check->interval.fall = lb->config.health_check_fail_threshold ?
+                              lb->config.health_check_fail_threshold : 1;
+
+    p->backend = backend;
+    p->fd = -1;
+    return p;
+}
+
+static void health_probe_done(health_loop_t* loop, health_probe_t* p) {
+    if (lb_timer_pending(&p->timer)) lb_timer_cancel(&loop->wheel, &p->timer);
+    if (p->fd >= 0) {
+        close(p->fd);
+        p->fd = -1;
+        p->events = 0;
+        loop->inflight--;
+    }
+    p->phase = PROBE_IDLE;
+
+    backend_t* backend = p->backend;
+    check_t* check = p->check;
+    uint64_t now_ns = get_time_ns();
+    atomic_store(&backend->last_check_ns, now_ns);
+    if (check_passed(check)) {
+        atomic_store(&backend->response_time_ns, now_ns - p->start_ns);
+    }
+
+    backend_state_t state = atomic_load(&backend->state);
+    if (state == BACKEND_DOWN && check->consecutive_success >= check->interval.rise) {
+        if (health_set_state(loop->lb, backend, BACKEND_DOWN, BACKEND_UP)) {
+            printf("[HEALTH] Backend %s:%u is now UP (response time: %.2fms)\n",
+                   backend->host, backend->port, (now_ns - p->start_ns) / 1000000.0);
         }
+    } else if (state == BACKEND_UP && check->consecutive_errors >= check->interval.fall) {
+        if (health_set_state(loop->lb, backend, BACKEND_UP, BACKEND_DOWN)) {
+            printf("[HEALTH] Backend %s:%u marked DOWN after %u failed checks: %s\n",
+                   backend->host, backend->port, check->consecutive_errors, check->desc);
+        }
+    }
 
-        for (uint32_t i = 0; i < lb->backend_count; i++) {
-            backend_t* backend = lb->backends[i];
-            if (!backend) continue;
-
-            int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-            if (sockfd < 0) continue;
-
-            struct timeval tv = {
-                .tv_sec = 2,
-                .tv_usec = 0
-            };
-            setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-            setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
-
-            // Set connect timeout
-            fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK);
-
-            struct sockaddr_in addr = {
-                .sin_family = AF_INET,
-                .sin_port = htons(backend->port)
-            };
-
-            if (inet_pton(AF_INET, backend->host, &addr.sin_addr) <= 0) {
-                struct hostent* he = gethostbyname(backend->host);
-                if (!he) {
-                    close(sockfd);
-                    atomic_store(&backend->state, BACKEND_DOWN);
-                    continue;
-                }
-                memcpy(&addr.sin_addr, he->h_addr_list[0], he->h_length);
+    uint32_t interval = check_next_interval(check, atomic_load(&backend->state) != BACKEND_DOWN);
+    lb_timer_add(&loop->wheel, &p->timer, health_now_ms() + health_jitter(loop, interval));
+}
+
+static int health_probe_watch(health_loop_t* loop, health_probe_t* p, uint32_t events) {
+    if (p->events == events) return 0;
+
+    struct epoll_event ev = { .events = events, .data.ptr = p };
+    if (epoll_ctl(loop->epfd, p->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, p->fd, &ev) < 0) {
+        set_server_check_status(p->check, HCHK_STATUS_L4CON, strerror(errno));
+        health_probe_done(loop, p);
+        return -1;
+    }
+    p->events = events;
+    return 0;
+}
+
+static void health_probe_read(health_loop_t* loop, health_probe_t* p) {
+    for (;;) {
+        ssize_t n = recv(p->fd, p->in + p->in_len, sizeof(p->in) - p->in_len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (n > 0) p->in_len += n;
+
+        bool eof = n <= 0 || p->in_len == sizeof(p->in);
+        if (check_probe_response(p->check, p->in, p->in_len, eof)) {
+            health_probe_done(loop, p);
+            return;
+        }
+    }
+}
+
+static void health_probe_send(health_loop_t* loop, health_probe_t* p) {
+    while (p->out_off < p->out_len) {
+        ssize_t n = send(p->fd, p->out + p->out_off, p->out_len - p->out_off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                health_probe_watch(loop, p, EPOLLOUT);
+                return;
             }
+            set_server_check_status(p->check, HCHK_STATUS_L4CON, "Send failed");
+            health_probe_done(loop, p);
+            return;
+        }
+        p->out_off += n;
+    }
 
-            uint64_t start_ns = get_time_ns();
+    // Plain TCP checks without an expectation pass right here
+    p->phase = PROBE_READING;
+    p->in_len = 0;
+    if (check_probe_response(p->check, p->in, 0, false)) {
+        health_probe_done(loop, p);
+        return;
+    }
+    if (health_probe_watch(loop, p, EPOLLIN | EPOLLRDHUP) == 0) {
+        health_probe_read(loop, p);
+    }
+}
 
-            // Try non-blocking connect with proper timeout handling
-            int connect_result = connect(sockfd, (struct sockaddr*)&addr, sizeof(addr));
+static void health_probe_connected(health_loop_t* loop, health_probe_t* p) {
+    int len = check_probe_request(p->check, p->out, sizeof(p->out));
+    if (len < 0) {
+        set_server_check_status(p->check, HCHK_STATUS_L6RSP, "Check request too large");
+        health_probe_done(loop, p);
+        return;
+    }
 
-            if (connect_result < 0 && errno == EINPROGRESS) {
-                // Wait for connection with select
-                fd_set write_fds;
-                FD_ZERO(&write_fds);
-                FD_SET(sockfd, &write_fds);
+    p->phase = PROBE_SENDING;
+    p->out_len = len;
+    p->out_off = 0;
+    health_probe_send(loop, p);
+}
 
-                struct timeval connect_tv = { .tv_sec = 2, .tv_usec = 0 };
-                int select_result = select(sockfd + 1, NULL, &write_fds, NULL, &connect_tv);
+static void health_probe_start(health_loop_t* loop, health_probe_t* p) {
+    uint64_t now_ms = health_now_ms();
 
-                if (select_result > 0) {
-                    int sock_error = 0;
-                    socklen_t len = sizeof(sock_error);
-                    getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &sock_error, &len);
-                    connect_result = (sock_error == 0) ? 0 : -1;
-                } else {
-                    connect_result = -1;
-                }
-            }
+    // Operator-held backends are not probed; look again later
+    if (atomic_load(&p->backend->state) == BACKEND_MAINT) {
+        lb_timer_add(&loop->wheel, &p->timer, now_ms + health_jitter(loop, p->check->interval.inter));
+        return;
+    }
+
+    if (loop->inflight >= LB_HEALTH_MAX_INFLIGHT) {
+        lb_timer_add(&loop->wheel, &p->timer, now_ms + LB_HEALTH_BUSY_MS);
+        return;
+    }
+
+    p->start_ns = get_time_ns();
+
+    lb_sockaddr_t addr;
+    socklen_t addr_len;
+    if (lb_net_resolve_backend(p->backend, &addr, &addr_len) < 0) {
+        set_server_check_status(p->check, HCHK_STATUS_L4CON, "Cannot resolve backend");
+        health_probe_done(loop, p);
+        return;
+    }
+
+    int fd = socket(addr.sa.sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        set_server_check_status(p->check, HCHK_STATUS_L4CON, strerror(errno));
+        health_probe_done(loop, p);
+        return;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    p->fd = fd;
+    p->events = 0;
+    loop->inflight++;
+    lb_timer_add(&loop->wheel, &p->timer, now_ms + p->check->interval.timeout);
+
+    if (connect(fd, &addr.sa, addr_len) == 0) {
+        health_probe_connected(loop, p);
+    } else if (errno == EINPROGRESS) {
+        p->phase = PROBE_CONNECTING;
+        health_probe_watch(loop, p, EPOLLOUT);
+    } else {
+        set_server_check_status(p->check, HCHK_STATUS_L4CON, strerror(errno));
+        health_probe_done(loop, p);
+    }
+}
 
-            // Set socket back to blocking for send/recv
-            fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) & ~O_NONBLOCK);
-
-            if (connect_result == 0) {
-                const char* http_req = "HEAD / HTTP/1.0\r\nHost: localhost\r\nConnection: close\r\n\r\n";
-                ssize_t sent = send(sockfd, http_req, strlen(http_req), MSG_NOSIGNAL);
-
-                if (sent > 0) {
-                    char response[512];
-                    ssize_t received = recv(sockfd, response, sizeof(response) - 1, 0);
-
-                    if (received > 0) {
-                        response[received] = '\0';
-                        if (strstr(response, "HTTP/1.") &&
-                            (strstr(response, " 200 ") || strstr(response, " 204 ") ||
-                             strstr(response, " 301 ") || strstr(response, " 302 "))) {
-
-                            backend_state_t prev_state = atomic_load(&backend->state);
-                            atomic_store(&backend->state, BACKEND_UP);
-                            atomic_store(&backend->failed_conns, 0);
-                            uint64_t response_time = get_time_ns() - start_ns;
-                            atomic_store(&backend->response_time_ns, response_time);
-                            atomic_store(&backend->last_check_ns, get_time_ns());
-
-                            if (prev_state != BACKEND_UP) {
-                                printf("[HEALTH] Backend %s:%u is now UP (response time: %.2fms)\n",
-                                       backend->host, backend->port, response_time / 1000000.0);
-                            }
-                        } else {
-                            uint32_t fails = atomic_fetch_add(&backend->failed_conns, 1) + 1;
-                            if (fails >= lb->config.health_check_fail_threshold) {
-                                atomic_store(&backend->state, BACKEND_DOWN);
-                                printf("[HEALTH] Backend %s:%u marked DOWN after %u failed checks\n",
-                                       backend->host, backend->port, fails);
-                            }
-                        }
-                    } else {
-                        uint32_t fails = atomic_fetch_add(&backend->failed_conns, 1) + 1;
-                        if (fails >= lb->config.health_check_fail_threshold) {
-                            atomic_store(&backend->state, BACKEND_DOWN);
-                            printf("[HEALTH] Backend %s:%u marked DOWN after %u failed checks\n",
-                                   backend->host, backend->port, fails);
-                        }
-                    }
-                } else {
-                    uint32_t fails = atomic_fetch_add(&backend->failed_conns, 1) + 1;
-                    if (fails >= lb->config.health_check_fail_threshold) {
-                        atomic_store(&backend->state, BACKEND_DOWN);
-                        printf("[HEALTH] Backend %s:%u marked DOWN after %u failed checks\n",
-                               backend->host, backend->port, fails);
-                    }
-                }
-            } else {
-                uint32_t fails = atomic_fetch_add(&backend->failed_conns, 1) + 1;
-                if (fails >= lb->config.health_check_fail_threshold) {
-                    atomic_store(&backend->state, BACKEND_DOWN);
-                    printf("[HEALTH] Backend %s:%u marked DOWN after %u failed checks\n",
-                           backend->host, backend->port, fails);
-                }
+static void health_probe_event(health_loop_t* loop, health_probe_t* p) {
+    switch (p->phase) {
+        case PROBE_CONNECTING: {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            if (getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) err = errno;
+            if (err) {
+                set_server_check_status(p->check, HCHK_STATUS_L4CON, strerror(err));
+                health_probe_done(loop, p);
+                return;
             }
+            health_probe_connected(loop, p);
+            break;
+        }
+        case PROBE_SENDING:
+            health_probe_send(loop, p);
+            break;
+        case PROBE_READING:
+            health_probe_read(loop, p);
+            break;
+        default:
+            break;
+    }
+}
+
+static void health_probe_timer(lb_timer_t* timer, void* arg) {
+    health_loop_t* loop = arg;
+    health_probe_t* p = (health_probe_t*)((char*)timer - offsetof(health_probe_t, timer));
+
+    switch (p->phase) {
+        case PROBE_IDLE:
+            health_probe_start(loop, p);
+            return;
+        case PROBE_CONNECTING:
+            set_server_check_status(p->check, HCHK_STATUS_L4TOUT, "Connection timeout");
+            break;
+        case PROBE_SENDING:
+            set_server_check_status(p->check, HCHK_STATUS_L4TOUT, "Send timeout");
+            break;
+        case PROBE_READING:
+            check_probe_response(p->check, p->in, p->in_len, true);
+            break;
+    }
+    health_probe_done(loop, p);
+}
 
-            close(sockfd);
+// Backends are only ever appended; pick up the new ones and start them at
+// a random point of their interval
+static void health_sync_probes(health_loop_t* loop) {
+    loadbalancer_t* lb = loop->lb;
+
+    while (loop->count < lb->backend_count) {
+        backend_t* backend = lb->backends[loop->count];
+        if (!backend) break;
+
+        if (loop->count == loop->capacity) {
+            uint32_t capacity = loop->capacity ? loop->capacity * 2 : 64;
+            health_probe_t** probes = realloc(loop->probes, capacity * sizeof(*probes));
+            if (!probes) return;
+            loop->probes = probes;
+            loop->capacity = capacity;
         }
 
-        usleep(lb->config.health_check_interval_ms * 1000 * 2);
+        health_probe_t* p = health_probe_new(lb, backend);
+        if (!p) return;
+
+        loop->probes[loop->count++] = p;
+        lb_timer_add(&loop->wheel, &p->timer,
+                     health_now_ms() + health_rand(loop) % p->check->interval.inter);
     }
+}
+
+void* health_check_thread(void* arg) {
+    loadbalancer_t* lb = (loadbalancer_t*)arg;
+
+    health_loop_t loop = { .lb = lb };
+    loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop.epfd < 0) {
+        perror("health check epoll_create1");
+        return NULL;
+    }
+    lb_timer_wheel_init(&loop.wheel, health_now_ms());
+    loop.rand = get_time_ns() | 1;
+
+    struct epoll_event events[LB_HEALTH_EVENTS];
+
+    uint64_t next_sweep_ms = 0;
+
+    while (lb->running) {
+        // Outlier detection, slow start and drains ride on this thread's clock
+        uint64_t now_ms = health_now_ms();
+        if (now_ms >= next_sweep_ms) {
+            lb_outlier_sweep(lb);
+            lb_slow_start_sweep(lb);
+            lb_drain_sweep(lb);
+            lb_snapshot_reclaim(lb);
+            next_sweep_ms = now_ms + LB_OUTLIER_SWEEP_MS;
+        }
+
+        // Skip health checks if disabled
+        if (!lb->config.health_check_enabled) {
+            usleep(LB_OUTLIER_SWEEP_MS * 1000);
+            continue;
+        }
+
+        health_sync_probes(&loop);
+
+        int timeout = lb_timer_next_timeout(&loop.wheel, LB_OUTLIER_SWEEP_MS);
+        int n = epoll_wait(loop.epfd, events, LB_HEALTH_EVENTS, timeout);
+        for (int i = 0; i < n; i++) {
+            health_probe_event(&loop, events[i].data.ptr);
+        }
+
+        lb_timer_advance(&loop.wheel, health_now_ms(), health_probe_timer, &loop);
+    }
+
+    for (uint32_t i = 0; i < loop.count; i++) {
+        health_probe_t* p = loop.probes[i];
+        if (p->fd >= 0) close(p->fd);
+        check_free(p->check);
+        free(p);
+    }
+    free(loop.probes);
+    close(loop.epfd);
 
     return NULL;
 }
@@ -154,13 +399,17 @@ void* stats_thread(void* arg) {
     loadbalancer_t* lb = (loadbalancer_t*)arg;
 
     while (lb->running) {
+        lb_stats_totals_t totals;
+        lb_stats_collect(lb, &totals);
+
         printf("\n========== Load Balancer Statistics ==========\n");
         printf("Global Stats:\n");
-        printf("  Total Requests:     %lu\n", atomic_load(&lb->global_stats.total_requests));
-        printf("  Failed Requests:    %lu\n", atomic_load(&lb->global_stats.failed_requests));
-        printf("  Active Connections: %u\n", atomic_load(&lb->global_stats.active_connections));
-        printf("  Bytes In:           %lu MB\n", atomic_load(&lb->global_stats.bytes_in) / (1024 * 1024));
-        printf("  Bytes Out:          %lu MB\n", atomic_load(&lb->global_stats.bytes_out) / (1024 * 1024));
+        printf("  Total Requests:     %lu\n", totals.total_requests);
+        printf("  Failed Requests:    %lu\n", totals.failed_requests);
+        printf("  Active Connections: %lu\n", totals.active_connections);
+        if (atomic_load(&lb->queued)) printf("  Queued:             %u\n", atomic_load(&lb->queued));
+        printf("  Bytes In:           %lu MB\n", totals.bytes_in / (1024 * 1024));
+        printf("  Bytes Out:          %lu MB\n", totals.bytes_out / (1024 * 1024));
 
         printf("\nBackend Stats:\n");
         for (uint32_t i = 0; i < lb->backend_count; i++) {
@@ -169,18 +418,23 @@ void* stats_thread(void* arg) {
 
             const char* state_str = "UNKNOWN";
             switch (atomic_load(&b->state)) {
-                case BACKEND_UP: state_str = "UP"; break;
+                case BACKEND_UP: state_str = atomic_load(&b->ejected) ? "EJECTED" : "UP"; break;
                 case BACKEND_DOWN: state_str = "DOWN"; break;
-                case BACKEND_DRAIN: state_str = "DRAIN"; break;
+                case BACKEND_DRAIN: state_str = atomic_load(&b->drained) ? "DRAINED" : "DRAIN"; break;
                 case BACKEND_MAINT: state_str = "MAINT"; break;
             }
 
-            printf("  [%s:%u] State: %s, Active: %u, Total: %u, Failed: %u, RT: %.2fms\n",
+            uint64_t bytes_in, bytes_out;
+            lb_stats_backend_bytes(lb, b, &bytes_in, &bytes_out);
+
+            printf("  [%s:%u] State: %s, Active: %u, Total: %u, Failed: %u, RT: %.2fms, "
+                   "In: %lu KB, Out: %lu KB\n",
                    b->host, b->port, state_str,
                    atomic_load(&b->active_conns),
                    atomic_load(&b->total_conns),
                    atomic_load(&b->failed_conns),
-                   atomic_load(&b->response_time_ns) / 1000000.0);
+                   atomic_load(&b->response_time_ns) / 1000000.0,
+                   bytes_in / 1024, bytes_out / 1024);
         }
 
         sleep(5);
@@ -243,8 +497,10 @@ int lb_start(loadbalancer_t* lb) {
         case LB_ALGO_LEASTCONN: printf("Least Connections\n"); break;
         case LB_ALGO_SOURCE: printf("IP Hash\n"); break;
         case LB_ALGO_STICKY: printf("Weighted\n"); break;
+        case LB_ALGO_STATIC_RR: printf("Smooth Weighted Round Robin\n"); break;
         case LB_ALGO_URI: printf("Consistent Hash\n"); break;
         case LB_ALGO_RANDOM: printf("Least Response Time\n"); break;
+        case LB_ALGO_P2C: printf("Power of Two Choices (EWMA)\n"); break;
         default: printf("Unknown\n");
     }
 
@@ -4,7 +4,11 @@
 #include "utils/log.h"
 #include <string.h>
 #include <stdlib.h>
+#include <strings.h>
 #include <ctype.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 static const char *http_methods[] = {
     "OPTIONS", "GET", "HEAD", "POST", "PUT", "DELETE",
@@ -44,6 +48,98 @@ static const struct {
     {0, NULL}
 };
 
+static const struct {
+    const char *name;
+    size_t len;
+} http_known_hdrs[HTTP_HDR_KNOWN] = {
+    [HTTP_HDR_HOST]              = {"host", 4},
+    [HTTP_HDR_CONTENT_LENGTH]    = {"content-length", 14},
+    [HTTP_HDR_TRANSFER_ENCODING] = {"transfer-encoding", 17},
+    [HTTP_HDR_CONNECTION]        = {"connection", 10},
+    [HTTP_HDR_UPGRADE]           = {"upgrade", 7},
+    [HTTP_HDR_KEEP_ALIVE]        = {"keep-alive", 10},
+    [HTTP_HDR_EXPECT]            = {"expect", 6},
+    [HTTP_HDR_CACHE_CONTROL]     = {"cache-control", 13},
+    [HTTP_HDR_COOKIE]            = {"cookie", 6},
+    [HTTP_HDR_ETAG]              = {"etag", 4},
+    [HTTP_HDR_LAST_MODIFIED]     = {"last-modified", 13},
+    [HTTP_HDR_VARY]              = {"vary", 4},
+    [HTTP_HDR_IF_NONE_MATCH]     = {"if-none-match", 13},
+    [HTTP_HDR_IF_MODIFIED_SINCE] = {"if-modified-since", 17},
+    [HTTP_HDR_ACCEPT_ENCODING]   = {"accept-encoding", 15},
+    [HTTP_HDR_CONTENT_ENCODING]  = {"content-encoding", 16},
+    [HTTP_HDR_CONTENT_TYPE]      = {"content-type", 12},
+    [HTTP_HDR_USER_AGENT]        = {"user-agent", 10},
+    [HTTP_HDR_AUTHORIZATION]     = {"authorization", 13},
+    [HTTP_HDR_X_FORWARDED_FOR]   = {"x-forwarded-for", 15},
+};
+
+// Perfect hash of the names above on (length, first, last byte); any other
+// name landing on a used slot is rejected by the final compare
+#define HTTP_HDR_HASH(n, len) \
+    ((((len) << 3) + (((n)[0] | 0x20) << 5) + ((n)[(len) - 1] | 0x20)) & 63)
+
+static const uint8_t http_hdr_hash[64] = {
+    [4]  = HTTP_HDR_EXPECT,
+    [7]  = HTTP_HDR_CONTENT_ENCODING,
+    [12] = HTTP_HDR_LAST_MODIFIED,
+    [13] = HTTP_HDR_IF_MODIFIED_SINCE,
+    [20] = HTTP_HDR_HOST,
+    [21] = HTTP_HDR_KEEP_ALIVE,
+    [25] = HTTP_HDR_VARY,
+    [30] = HTTP_HDR_CONNECTION,
+    [36] = HTTP_HDR_USER_AGENT,
+    [37] = HTTP_HDR_CONTENT_TYPE,
+    [39] = HTTP_HDR_ETAG,
+    [42] = HTTP_HDR_X_FORWARDED_FOR,
+    [47] = HTTP_HDR_TRANSFER_ENCODING,
+    [48] = HTTP_HDR_IF_NONE_MATCH,
+    [52] = HTTP_HDR_CACHE_CONTROL,
+    [53] = HTTP_HDR_COOKIE,
+    [54] = HTTP_HDR_AUTHORIZATION,
+    [56] = HTTP_HDR_CONTENT_LENGTH,
+    [61] = HTTP_HDR_UPGRADE,
+    [63] = HTTP_HDR_ACCEPT_ENCODING,
+};
+
+int http_header_id(const char *name, size_t len) {
+    if (len == 0 || len > 17)
+        return HTTP_HDR_OTHER;
+
+    int id = http_hdr_hash[HTTP_HDR_HASH((const unsigned char *)name, len)];
+    if (id != HTTP_HDR_OTHER && http_known_hdrs[id].len == len &&
+        strncasecmp(name, http_known_hdrs[id].name, len) == 0)
+        return id;
+    return HTTP_HDR_OTHER;
+}
+
+// First occurrence of a or b in [p, end), or end. Compares 32 or 16 bytes
+// per step where the target has AVX2/SSE2; the tail is done bytewise.
+static inline char *http_scan2(char *p, char *end, char a, char b) {
+#ifdef __AVX2__
+    const __m256i wa = _mm256_set1_epi8(a), wb = _mm256_set1_epi8(b);
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        uint32_t m = (uint32_t)_mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, wa), _mm256_cmpeq_epi8(v, wb)));
+        if (m) return p + __builtin_ctz(m);
+        p += 32;
+    }
+#endif
+#ifdef __SSE2__
+    const __m128i na = _mm_set1_epi8(a), nb = _mm_set1_epi8(b);
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        uint32_t m = (uint32_t)_mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(v, na), _mm_cmpeq_epi8(v, nb)));
+        if (m) return p + __builtin_ctz(m);
+        p += 16;
+    }
+#endif
+    while (p < end && *p != a && *p != b) p++;
+    return p;
+}
+
 // Get human-readable status text from code
 const char* http_get_status_text(int code) {
     for (int i = 0; http_status_codes[i].text != NULL; i++) {
@@ -141,29 +237,55 @@ int http_parse_request_line(http_msg_t *msg, char *data, size_t len) {
     return p - data;
 }
 
+int http_header_add_tail(http_msg_t *msg, http_hdr_t *hdr) {
+    if (msg->hdr_count >= HTTP_MAX_HDRS)
+        return -1;
+
+    http_hdr_t *slot = &msg->hdrs[msg->hdr_count];
+    if (hdr != slot)
+        *slot = *hdr;
+
+    if (slot->id != HTTP_HDR_OTHER && !msg->hdr_idx[slot->id])
+        msg->hdr_idx[slot->id] = msg->hdr_count + 1;
+    msg->hdr_count++;
+    return 0;
+}
+
+http_hdr_t* http_header_find(http_msg_t *msg, int id) {
+    if (id <= HTTP_HDR_OTHER || id >= HTTP_HDR_KNOWN || !msg->hdr_idx[id])
+        return NULL;
+    return &msg->hdrs[msg->hdr_idx[id] - 1];
+}
+
 int http_parse_headers(http_msg_t *msg, struct buffer *buf) {
     char *p = buf->area + msg->next;
     char *end = buf->area + buf->data;
     http_hdr_t *hdr;
 
     while (p < end) {
-        char *eol = memchr(p, '\n', end - p);
-        if (!eol) break;
-
-        if (p == eol || (p + 1 == eol && *p == '\r')) {
-            msg->next = eol + 1 - buf->area;
-            msg->msg_state = HTTP_MSG_BODY;
-            return 1;
+        // One pass finds the colon, or the LF of a line without one
+        char *colon = http_scan2(p, end, ':', '\n');
+        if (colon == end) break;
+
+        if (*colon == '\n') {
+            if (p == colon || (p + 1 == colon && *p == '\r')) {
+                msg->next = colon + 1 - buf->area;
+                msg->msg_state = HTTP_MSG_BODY;
+                return 1;
+            }
+            msg->msg_state = HTTP_MSG_ERROR;
+            return -1;
         }
 
-        char *colon = memchr(p, ':', eol - p);
-        if (!colon) {
+        // Values may hold colons, only the LF matters from here
+        char *eol = memchr(colon + 1, '\n', end - colon - 1);
+        if (!eol) break;
+
+        if (msg->hdr_count >= HTTP_MAX_HDRS) {
             msg->msg_state = HTTP_MSG_ERROR;
             return -1;
         }
-
-        hdr = calloc(1, sizeof(http_hdr_t));
-        if (!hdr) return -1;
+        hdr = &msg->hdrs[msg->hdr_count];
 
         hdr->n.ptr = p;
         hdr->n.len = colon - p;
@@ -183,27 +305,34 @@ int http_parse_headers(http_msg_t *msg, struct buffer *buf) {
         while (hdr->v.len > 0 && isspace(hdr->v.ptr[hdr->v.len - 1]))
             hdr->v.len--;
 
-        if (strncasecmp(hdr->n.ptr, "content-length", hdr->n.len) == 0) {
-            msg->body_len = strtoll(hdr->v.ptr, NULL, 10);
-            msg->flags |= HTTP_MSGF_CNT_LEN;
-        } else if (strncasecmp(hdr->n.ptr, "transfer-encoding", hdr->n.len) == 0) {
-            if (strncasecmp(hdr->v.ptr, "chunked", 7) == 0) {
-                msg->flags |= HTTP_MSGF_TE_CHNK;
-            }
-        } else if (strncasecmp(hdr->n.ptr, "connection", hdr->n.len) == 0) {
-            if (strncasecmp(hdr->v.ptr, "close", 5) == 0) {
-                msg->flags |= HTTP_MSGF_CONN_CLO;
-            } else if (strncasecmp(hdr->v.ptr, "keep-alive", 10) == 0) {
-                msg->flags |= HTTP_MSGF_CONN_KAL;
-            } else if (strncasecmp(hdr->v.ptr, "upgrade", 7) == 0) {
-                msg->flags |= HTTP_MSGF_CONN_UPG;
-            }
-        } else if (strncasecmp(hdr->n.ptr, "upgrade", hdr->n.len) == 0) {
-            if (strncasecmp(hdr->v.ptr, "websocket", 9) == 0) {
-                msg->flags |= HTTP_MSGF_WEBSOCKET;
-            } else if (strncasecmp(hdr->v.ptr, "h2c", 3) == 0) {
-                msg->flags |= HTTP_MSGF_UPGRADE_H2C;
-            }
+        hdr->id = http_header_id(hdr->n.ptr, hdr->n.len);
+
+        switch (hdr->id) {
+            case HTTP_HDR_CONTENT_LENGTH:
+                msg->body_len = strtoll(hdr->v.ptr, NULL, 10);
+                msg->flags |= HTTP_MSGF_CNT_LEN;
+                break;
+            case HTTP_HDR_TRANSFER_ENCODING:
+                if (strncasecmp(hdr->v.ptr, "chunked", 7) == 0) {
+                    msg->flags |= HTTP_MSGF_TE_CHNK;
+                }
+                break;
+            case HTTP_HDR_CONNECTION:
+                if (strncasecmp(hdr->v.ptr, "close", 5) == 0) {
+                    msg->flags |= HTTP_MSGF_CONN_CLO;
+                } else if (strncasecmp(hdr->v.ptr, "keep-alive", 10) == 0) {
+                    msg->flags |= HTTP_MSGF_CONN_KAL;
+                } else if (strncasecmp(hdr->v.ptr, "upgrade", 7) == 0) {
+                    msg->flags |= HTTP_MSGF_CONN_UPG;
+                }
+                break;
+            case HTTP_HDR_UPGRADE:
+                if (strncasecmp(hdr->v.ptr, "websocket", 9) == 0) {
+                    msg->flags |= HTTP_MSGF_WEBSOCKET;
+                } else if (strncasecmp(hdr->v.ptr, "h2c", 3) == 0) {
+                    msg->flags |= HTTP_MSGF_UPGRADE_H2C;
+                }
+                break;
         }
 
         http_header_add_tail(msg, hdr);
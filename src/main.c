@@ -14,17 +14,33 @@
 #include "core/lb_types.h"
 #include "core/common.h"
 #include "core/lb_network.h"
+#include "core/lb_memory.h"
+#include "core/lb_utils.h"
+#include "core/loadbalancer.h"
+#include "core/lb_reload.h"
+#include "core/lb_numa.h"
 #include "config/config.h"
+#include "utils/log.h"
+#include "stats/lb_stats.h"
+#include "health/health.h"
 
 #define MEMORY_POOL_SIZE (256 * 1024 * 1024)  // 256MB
 
 static loadbalancer_t* global_lb = NULL;
+static volatile sig_atomic_t reload_requested = 0;
+
+// Listening sockets taken over from the previous process, each used where
+// main_lb_start or main_lb_setup_workers would bind one at its address
+static int handover_fds[LB_HANDOVER_MAX_FDS];
+static uint32_t handover_count = 0;
 
 static loadbalancer_t* main_lb_create(uint16_t port, lb_algorithm_t algorithm);
 static void main_lb_destroy(loadbalancer_t* lb);
 static int main_lb_start(loadbalancer_t* lb);
 static void main_lb_stop(loadbalancer_t* lb);
 static int main_lb_add_backend(loadbalancer_t* lb, const char* host, uint16_t port, uint32_t weight);
+static int main_lb_setup_workers(loadbalancer_t* lb);
+static void main_lb_teardown_workers(loadbalancer_t* lb);
 
 extern void* health_check_thread(void* arg);
 extern void* stats_thread(void* arg);
@@ -44,6 +60,11 @@ static void signal_handler(int sig) {
     }
 }
 
+static void reload_handler(int sig) {
+    (void)sig;
+    reload_requested = 1;
+}
+
 static void print_usage(const char* prog) {
     printf("Usage: %s [OPTIONS]\n", prog);
     printf("Options:\n");
@@ -54,13 +75,54 @@ static void print_usage(const char* prog) {
     printf("                           least-conn\n");
     printf("                           ip-hash\n");
     printf("                           weighted\n");
+    printf("                           weighted-rr (smooth weighted round robin)\n");
     printf("                           response-time\n");
-    printf("  -b, --backend HOST:PORT  Add backend server (can specify multiple)\n");
+    printf("                           p2c (power of two choices, latency EWMA)\n");
+    printf("  -b, --backend HOST:PORT[@WEIGHT][/MAXCONN]\n");
+    printf("                           Add backend server (can specify multiple)\n");
     printf("  -w, --workers NUM        Number of worker threads (default: CPU*2)\n");
     printf("  --health-check-enabled   Enable health checks (default: true)\n");
     printf("  --no-health-check        Disable health checks\n");
     printf("  --health-check-interval  Health check interval in ms (default: 5000)\n");
     printf("  --health-check-fails     Failed checks before marking down (default: 3)\n");
+    printf("  --health-check-type TYPE Probe protocol: tcp, http, mysql, redis (default: http)\n");
+    printf("  --outlier-failures N     Live-traffic failures in a row (connect errors, resets,\n");
+    printf("                           5xx) that eject a backend; 0 disables (default: 5)\n");
+    printf("  --outlier-eject-time MS  First ejection length, doubled on repeats (default: 1000)\n");
+    printf("  --outlier-max-eject PCT  Most backends ejected at once, in percent (default: 50)\n");
+    printf("  --slow-start MS          Ramp a backend coming back into rotation up to its full\n");
+    printf("                           weight over MS milliseconds (default: 0, off)\n");
+    printf("  --slow-start-mode MODE   Ramp shape: linear, exp (default: linear)\n");
+    printf("  --drain-file PATH        Drain the backends listed in PATH (HOST:PORT per line)\n");
+    printf("                           and undrain them once removed; re-read on change\n");
+    printf("  --backends-file PATH     Read backends from PATH (as for -b, one per line)\n");
+    printf("                           instead of -b; re-read on SIGHUP\n");
+    printf("  --handover PATH          Take the listeners of the process serving PATH, if\n");
+    printf("                           any, then serve them there for the next one\n");
+    printf("  --reuseport-listeners    Per-worker epoll and SO_REUSEPORT listen socket\n");
+    printf("  --splice-relay           Zero-copy splice() relay for TCP traffic\n");
+    printf("  --io-engine ENGINE       Worker event engine: epoll, io_uring (default: epoll)\n");
+    printf("  --write-high-water BYTES Per-connection queued bytes before reads pause\n");
+    printf("                           (default: 262144)\n");
+    printf("  --dns-ttl SECONDS        Re-resolve backend host names this often (default: 30)\n");
+    printf("  --upstream-keepalive     Reuse idle HTTP/1.1 backend connections\n");
+    printf("  --backend-fastopen       Send the first client bytes in the backend SYN (TFO)\n");
+    printf("  --backend-preconnect N   Keep N backend connections opened ahead per backend\n");
+    printf("                           and worker (default: 0)\n");
+    printf("  --backend-source ADDR    Local address for backend connections\n");
+    printf("  --balance-per-request    Pick a backend for every HTTP/1.1 request rather than\n");
+    printf("                           for every client connection\n");
+    printf("  --http2                  Also accept HTTP/2 with prior knowledge (h2c); each\n");
+    printf("                           stream is balanced on its own\n");
+    printf("  --phase-sample N         Time the phases of one connection in N (accept,\n");
+    printf("                           select, connect, first byte...) into lb.phase.*\n");
+    printf("                           timers (default: 0, off)\n");
+    printf("  --maxconn N              Connections each backend takes at once, unless\n");
+    printf("                           it sets /MAXCONN (default: 0, no limit)\n");
+    printf("  --maxconn-group N        Connections all backends take at once (default: 0)\n");
+    printf("  --queue-size N           Clients waiting for a backend slot, in all, before\n");
+    printf("                           new ones get a 503 (default: 1024)\n");
+    printf("  --queue-timeout MS       Longest wait for a slot before a 503 (default: 1000)\n");
     printf("  -h, --help              Show this help message\n");
     printf("\nExamples:\n");
     printf("  %s -c config/ultrabalancer.yaml\n", prog);
@@ -85,11 +147,20 @@ static loadbalancer_t* main_lb_create(uint16_t port, lb_algorithm_t algorithm) {
     lb->config.keepalive_timeout_ms = 60000;
     lb->config.health_check_interval_ms = 5000;
     lb->config.max_connections = MAX_CONNECTIONS;
+    lb->config.write_high_water = WRITE_HIGH_WATER;
+    lb->config.dns_ttl_ms = DNS_TTL_MS;
+    lb->config.upstream_idle_timeout_ms = UPSTREAM_IDLE_TIMEOUT_MS;
     lb->config.health_check_fail_threshold = 3;
+    lb->config.health_check_type = HCHK_TYPE_HTTP;
+    lb->config.outlier_consecutive_failures = LB_OUTLIER_FAILURES;
+    lb->config.outlier_base_eject_ms = LB_OUTLIER_BASE_EJECT_MS;
+    lb->config.outlier_max_eject_percent = LB_OUTLIER_MAX_EJECT_PCT;
     lb->config.tcp_nodelay = true;
     lb->config.so_reuseport = true;
     lb->config.defer_accept = true;
     lb->config.health_check_enabled = true;
+    lb->config.queue_max = LB_QUEUE_MAX;
+    lb->config.queue_timeout_ms = LB_QUEUE_TIMEOUT_MS;
 
     lb->epfd = epoll_create1(EPOLL_CLOEXEC);
     if (lb->epfd < 0) {
@@ -97,35 +168,16 @@ static loadbalancer_t* main_lb_create(uint16_t port, lb_algorithm_t algorithm) {
         return NULL;
     }
 
-    // Initialize memory pool
-    lb->memory_pool = mmap(NULL, MEMORY_POOL_SIZE, PROT_READ | PROT_WRITE,
-                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (lb->memory_pool == MAP_FAILED) {
+    // Relay buffers for threads without an arena of their own, and for
+    // workers whose arena is full; faulted in on first use
+    lb->memory_pool = memory_pool_create(MEMORY_POOL_SIZE);
+    if (!lb->memory_pool) {
         close(lb->epfd);
         free(lb);
         return NULL;
     }
 
-    // Initialize cleanup queue
-    lb->cleanup_queue = calloc(1, sizeof(cleanup_queue_t));
-    if (!lb->cleanup_queue) {
-        munmap(lb->memory_pool, MEMORY_POOL_SIZE);
-        close(lb->epfd);
-        free(lb);
-        return NULL;
-    }
-
-    // Initialize mutex for cleanup queue
-    if (pthread_mutex_init(&lb->cleanup_queue->lock, NULL) != 0) {
-        free(lb->cleanup_queue);
-        munmap(lb->memory_pool, MEMORY_POOL_SIZE);
-        close(lb->epfd);
-        free(lb);
-        return NULL;
-    }
-
-    atomic_store(&lb->cleanup_queue->head, 0);
-    atomic_store(&lb->cleanup_queue->tail, 0);
+    atomic_store(&lb->reclaim_epoch, 0);
 
     return lb;
 }
@@ -140,19 +192,11 @@ static void main_lb_destroy(loadbalancer_t* lb) {
         }
     }
 
-    if (lb->memory_pool && lb->memory_pool != MAP_FAILED) {
-        munmap(lb->memory_pool, MEMORY_POOL_SIZE);
-    }
+    memory_pool_destroy((memory_pool_t*)lb->memory_pool);
 
     if (lb->epfd >= 0) close(lb->epfd);
     pthread_spin_destroy(&lb->conn_pool_lock);
-
-    // Cleanup queue with mutex destruction
-    if (lb->cleanup_queue) {
-        pthread_mutex_destroy(&lb->cleanup_queue->lock);
-        free(lb->cleanup_queue);
-        lb->cleanup_queue = NULL;
-    }
+    lb_snapshot_free(lb);
 
     // Cleanup listen wrapper
     if (lb->listen_wrapper) {
@@ -183,7 +227,12 @@ static int main_lb_add_backend(loadbalancer_t* lb, const char* host, uint16_t po
 
     pthread_spin_init(&backend->lock, PTHREAD_PROCESS_PRIVATE);
 
+    // A failed first lookup is retried by the resolver thread
+    lb_resolver_add_backend(lb, backend);
+
+    backend->id = lb->backend_count;
     lb->backends[lb->backend_count++] = backend;
+    lb_backends_changed(lb);
 
     return 0;
 }
@@ -191,6 +240,30 @@ static int main_lb_add_backend(loadbalancer_t* lb, const char* host, uint16_t po
 // Forward declaration - defined in lb_core.c
 extern int create_listen_socket(uint16_t port, bool reuseport);
 
+// An inherited socket bound as this one would be, else a fresh one
+static int main_listen_socket(uint16_t port, bool reuseport) {
+    for (uint32_t i = 0; i < handover_count; i++) {
+        int fd = handover_fds[i];
+        if (fd >= 0 && lb_handover_match(fd, port, reuseport)) {
+            handover_fds[i] = -1;
+            return fd;
+        }
+    }
+    return create_listen_socket(port, reuseport);
+}
+
+// The inherited sockets are exactly the listeners main_lb_start() opens;
+// otherwise none is taken and the old process is not asked to stop
+static bool main_handover_fits(loadbalancer_t* lb) {
+    bool reuseport = lb->config.so_reuseport || lb->config.reuseport_listeners;
+    uint32_t needed = lb->config.reuseport_listeners ? lb->worker_threads : 1;
+    if (handover_count != needed) return false;
+    for (uint32_t i = 0; i < handover_count; i++) {
+        if (!lb_handover_match(handover_fds[i], lb->port, reuseport)) return false;
+    }
+    return true;
+}
+
 static backend_t* main_lb_select_backend(loadbalancer_t* lb, struct sockaddr_in* client_addr) {
     backend_t* selected = NULL;
     uint32_t min_conns = UINT32_MAX;
@@ -238,10 +311,109 @@ static backend_t* main_lb_select_backend(loadbalancer_t* lb, struct sockaddr_in*
 
 // Old worker_thread removed - using worker_thread_v2 from lb_net.c
 
+static void main_lb_teardown_workers(loadbalancer_t* lb) {
+    if (!lb->worker_ctx) return;
+
+    // Retired connections go back to their owners' slabs before any slab is
+    // destroyed
+    for (uint32_t i = 0; i < lb->worker_threads; i++) {
+        lb_net_worker_reclaim_all(lb, &lb->worker_ctx[i]);
+        lb_net_worker_close_idle(&lb->worker_ctx[i]);
+    }
+
+    for (uint32_t i = 0; i < lb->worker_threads; i++) {
+        lb_worker_t* w = &lb->worker_ctx[i];
+        slab_cache_destroy(w->conn_slab);
+        w->conn_slab = NULL;
+        memory_pool_destroy(w->arena);
+        w->arena = NULL;
+        pthread_spin_destroy(&w->timer_lock);
+        pthread_spin_destroy(&w->queue_lock);
+        lb_stats_worker_destroy(w->stats);
+        w->stats = NULL;
+        if (!w->owns_fds) continue;
+        // lb->listen_fd is closed by main_lb_stop
+        if (w->listen_fd >= 0 && w->listen_fd != lb->listen_fd) close(w->listen_fd);
+        if (w->epfd >= 0) close(w->epfd);
+    }
+
+    free(lb->worker_ctx);
+    lb->worker_ctx = NULL;
+}
+
+// Build one event loop context per worker. In the default mode all workers
+// share lb->epfd and the single listen socket; with reuseport_listeners every
+// worker gets a private epoll instance and its own SO_REUSEPORT socket so the
+// kernel spreads accepts across workers and a connection never changes core.
+static int main_lb_setup_workers(loadbalancer_t* lb) {
+    // Cache-line aligned so each worker's quiescent_epoch has its own line
+    lb->worker_ctx = aligned_alloc(CACHE_LINE_SIZE, lb->worker_threads * sizeof(lb_worker_t));
+    if (!lb->worker_ctx) return -1;
+    memset(lb->worker_ctx, 0, lb->worker_threads * sizeof(lb_worker_t));
+
+    lb_cpu_slot_t cpus[LB_NUMA_MAX_CPUS];
+    uint32_t cpu_count = lb_numa_cpus(cpus, LB_NUMA_MAX_CPUS);
+
+    for (uint32_t i = 0; i < lb->worker_threads; i++) {
+        lb_worker_t* w = &lb->worker_ctx[i];
+        w->id = i;
+        w->lb = lb;
+        w->cpu = cpus[i % cpu_count].cpu;
+        w->node = cpus[i % cpu_count].node;
+        w->epfd = lb->epfd;
+        w->listen_fd = lb->listen_fd;
+        w->owns_fds = false;
+        w->now_ms = get_time_ns() / 1000000;
+        lb_timer_wheel_init(&w->timers, w->now_ms);
+        pthread_spin_init(&w->timer_lock, PTHREAD_PROCESS_PRIVATE);
+        pthread_spin_init(&w->queue_lock, PTHREAD_PROCESS_PRIVATE);
+        w->conn_slab = slab_cache_create(sizeof(lb_connection_t), 256);
+        w->stats = lb_stats_worker_create();
+        if (!w->conn_slab || !w->stats) goto fail;
+        // Nothing is committed until the worker, pinned on the node, touches it
+        w->arena = memory_pool_create_node(WORKER_ARENA_SIZE, w->node);
+        w->conn_slab->pool = w->arena;
+    }
+
+    if (!lb->config.reuseport_listeners) return 0;
+
+    for (uint32_t i = 0; i < lb->worker_threads; i++) {
+        lb_worker_t* w = &lb->worker_ctx[i];
+
+        // Worker 0 adopts the socket main_lb_start already bound
+        int listen_fd = (i == 0) ? lb->listen_fd : main_listen_socket(lb->port, true);
+        if (listen_fd < 0) goto fail;
+
+        w->listen_fd = listen_fd;
+        w->epfd = epoll_create1(EPOLL_CLOEXEC);
+        w->owns_fds = true;
+        if (w->epfd < 0) goto fail;
+
+        w->listen_wrapper.type = SOCKET_TYPE_LISTEN;
+        w->listen_wrapper.fd = listen_fd;
+        w->listen_wrapper.conn = NULL;
+
+        struct epoll_event ev = {
+            .events = EPOLLIN,
+            .data.ptr = &w->listen_wrapper
+        };
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) goto fail;
+    }
+
+    // The shared epoll instance no longer carries the listener
+    epoll_ctl(lb->epfd, EPOLL_CTL_DEL, lb->listen_fd, NULL);
+    return 0;
+
+fail:
+    main_lb_teardown_workers(lb);
+    return -1;
+}
+
 static int main_lb_start(loadbalancer_t* lb) {
     if (!lb || lb->running) return -1;
 
-    lb->listen_fd = create_listen_socket(lb->port, lb->config.so_reuseport);
+    lb->listen_fd = main_listen_socket(lb->port,
+                                       lb->config.so_reuseport || lb->config.reuseport_listeners);
     if (lb->listen_fd < 0) {
         perror("Failed to create listen socket");
         return -1;
@@ -272,32 +444,71 @@ static int main_lb_start(loadbalancer_t* lb) {
         return -1;
     }
 
+    if (main_lb_setup_workers(lb) < 0) {
+        perror("Failed to set up worker event loops");
+        epoll_ctl(lb->epfd, EPOLL_CTL_DEL, lb->listen_fd, NULL);
+        free(lb->listen_wrapper);
+        lb->listen_wrapper = NULL;
+        close(lb->listen_fd);
+        return -1;
+    }
+
     lb->running = true;
+    atomic_store(&lb->accepting, true);
 
     // Start all backends as UP for testing
     for (uint32_t i = 0; i < lb->backend_count; i++) {
         lb->backends[i]->state = BACKEND_UP;
     }
+    lb_backends_changed(lb);
 
     lb->workers = calloc(lb->worker_threads, sizeof(pthread_t));
     if (!lb->workers) {
+        main_lb_teardown_workers(lb);
         close(lb->listen_fd);
         return -1;
     }
 
+    void* (*worker_fn)(void*) = worker_thread_v2;
+    if (lb->config.io_engine == IO_ENGINE_URING) {
+        if (lb_uring_available()) {
+            worker_fn = worker_thread_uring;
+            if (lb->config.splice_relay) {
+                printf("io_uring engine relays through provided buffers; --splice-relay ignored\n");
+            }
+            if (lb->config.upstream_keepalive || lb->config.per_request_balance ||
+                lb->config.http2) {
+                printf("io_uring engine does not frame HTTP; --upstream-keepalive, "
+                       "--balance-per-request and --http2 ignored\n");
+            }
+            if (lb->config.backend_fastopen || lb->config.backend_preconnect ||
+                lb->config.backend_source.sa.sa_family != AF_UNSPEC) {
+                printf("io_uring engine connects on its own; backend connect options ignored\n");
+            }
+        } else {
+            fprintf(stderr, "io_uring not supported by this build or kernel, using epoll\n");
+        }
+    }
+
     for (uint32_t i = 0; i < lb->worker_threads; i++) {
-        if (pthread_create(&lb->workers[i], NULL, worker_thread_v2, lb) != 0) {
+        if (pthread_create(&lb->workers[i], NULL, worker_fn, &lb->worker_ctx[i]) != 0) {
             lb->running = false;
             for (uint32_t j = 0; j < i; j++) {
                 pthread_join(lb->workers[j], NULL);
             }
             free(lb->workers);
             lb->workers = NULL;
+            main_lb_teardown_workers(lb);
             close(lb->listen_fd);
             return -1;
         }
     }
 
+    pthread_t resolver_tid;
+    if (pthread_create(&resolver_tid, NULL, lb_resolver_thread, lb) == 0) {
+        pthread_detach(resolver_tid);
+    }
+
     pthread_t health_thread;
     if (pthread_create(&health_thread, NULL, health_check_thread, lb) == 0) {
         pthread_detach(health_thread);
@@ -315,6 +526,8 @@ static int main_lb_start(loadbalancer_t* lb) {
         case LB_ALGO_LEASTCONN: printf("Least Connections\n"); break;
         case LB_ALGO_SOURCE: printf("IP Hash\n"); break;
         case LB_ALGO_STICKY: printf("Weighted\n"); break;
+        case LB_ALGO_STATIC_RR: printf("Smooth Weighted Round Robin\n"); break;
+        case LB_ALGO_P2C: printf("Power of Two Choices (EWMA)\n"); break;
         default: printf("Unknown\n");
     }
     printf("\nHealth checks enabled (interval: %ums)\n", lb->config.health_check_interval_ms);
@@ -334,6 +547,8 @@ static void main_lb_stop(loadbalancer_t* lb) {
         }
     }
 
+    main_lb_teardown_workers(lb);
+
     if (lb->listen_fd >= 0) {
         close(lb->listen_fd);
     }
@@ -349,12 +564,39 @@ int main(int argc, char** argv) {
         char host[256];
         uint16_t port;
         uint32_t weight;
+        uint32_t maxconn;
     } backends[MAX_BACKENDS];
     int backend_count = 0;
     uint32_t workers = 0;
     bool health_check_enabled = true;
     uint32_t health_check_interval = 5000;
     uint32_t health_check_fails = 3;
+    check_type_t health_check_type = HCHK_TYPE_HTTP;
+    int outlier_failures = -1;
+    int outlier_eject_ms = -1;
+    int outlier_max_eject = -1;
+    uint32_t slow_start_ms = 0;
+    bool slow_start_exponential = false;
+    const char* drain_file = NULL;
+    const char* backends_file = NULL;
+    const char* handover_path = NULL;
+    uint32_t phase_sample = 0;
+    uint32_t server_maxconn = 0;
+    uint32_t group_maxconn = 0;
+    int queue_max = -1;
+    int queue_timeout_ms = -1;
+    bool reuseport_listeners = false;
+    bool splice_relay = false;
+    io_engine_t io_engine = IO_ENGINE_EPOLL;
+    long write_high_water = 0;
+    int dns_ttl = -1;
+    bool upstream_keepalive = false;
+    bool backend_fastopen = false;
+    int backend_preconnect = 0;
+    bool per_request_balance = false;
+    bool http2 = false;
+    lb_sockaddr_t backend_source;
+    memset(&backend_source, 0, sizeof(backend_source));
 
     static struct option long_options[] = {
         {"config", required_argument, 0, 'c'},
@@ -366,6 +608,31 @@ int main(int argc, char** argv) {
         {"no-health-check", no_argument, 0, 1002},
         {"health-check-interval", required_argument, 0, 1003},
         {"health-check-fails", required_argument, 0, 1004},
+        {"reuseport-listeners", no_argument, 0, 1005},
+        {"splice-relay", no_argument, 0, 1006},
+        {"io-engine", required_argument, 0, 1007},
+        {"write-high-water", required_argument, 0, 1008},
+        {"dns-ttl", required_argument, 0, 1009},
+        {"upstream-keepalive", no_argument, 0, 1010},
+        {"backend-fastopen", no_argument, 0, 1011},
+        {"backend-preconnect", required_argument, 0, 1012},
+        {"backend-source", required_argument, 0, 1013},
+        {"balance-per-request", no_argument, 0, 1014},
+        {"http2", no_argument, 0, 1015},
+        {"health-check-type", required_argument, 0, 1016},
+        {"outlier-failures", required_argument, 0, 1017},
+        {"outlier-eject-time", required_argument, 0, 1018},
+        {"outlier-max-eject", required_argument, 0, 1019},
+        {"slow-start", required_argument, 0, 1020},
+        {"slow-start-mode", required_argument, 0, 1021},
+        {"drain-file", required_argument, 0, 1022},
+        {"backends-file", required_argument, 0, 1023},
+        {"handover", required_argument, 0, 1024},
+        {"phase-sample", required_argument, 0, 1025},
+        {"maxconn", required_argument, 0, 1026},
+        {"maxconn-group", required_argument, 0, 1027},
+        {"queue-size", required_argument, 0, 1028},
+        {"queue-timeout", required_argument, 0, 1029},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}
     };
@@ -388,10 +655,14 @@ int main(int argc, char** argv) {
                     algorithm = LB_ALGO_LEASTCONN;
                 } else if (strcmp(optarg, "ip-hash") == 0) {
                     algorithm = LB_ALGO_SOURCE;
-                } else if (strcmp(optarg, "weighted") == 0 || strcmp(optarg, "weighted-rr") == 0) {
+                } else if (strcmp(optarg, "weighted") == 0) {
                     algorithm = LB_ALGO_STICKY;
+                } else if (strcmp(optarg, "weighted-rr") == 0) {
+                    algorithm = LB_ALGO_STATIC_RR;
                 } else if (strcmp(optarg, "response-time") == 0) {
                     algorithm = LB_ALGO_RANDOM;
+                } else if (strcmp(optarg, "p2c") == 0) {
+                    algorithm = LB_ALGO_P2C;
                 } else {
                     fprintf(stderr, "Unknown algorithm: %s\n", optarg);
                     exit(1);
@@ -404,21 +675,36 @@ int main(int argc, char** argv) {
                     exit(1);
                 }
 
+                // IPv6 literals are bracketed: [::1]:8001
+                char* host = optarg;
                 char* colon = strchr(optarg, ':');
+                if (optarg[0] == '[') {
+                    char* end = strchr(optarg, ']');
+                    colon = (end && end[1] == ':') ? end + 1 : NULL;
+                    if (colon) {
+                        *end = '\0';
+                        host = optarg + 1;
+                    }
+                }
                 if (!colon) {
                     fprintf(stderr, "Invalid backend format: %s (expected HOST:PORT)\n", optarg);
                     exit(1);
                 }
 
                 *colon = '\0';
-                strncpy(backends[backend_count].host, optarg, 255);
+                strncpy(backends[backend_count].host, host, 255);
                 backends[backend_count].port = atoi(colon + 1);
                 backends[backend_count].weight = 1;
+                backends[backend_count].maxconn = 0;
 
                 char* at = strchr(colon + 1, '@');
                 if (at) {
                     backends[backend_count].weight = atoi(at + 1);
                 }
+                char* slash = strchr(colon + 1, '/');
+                if (slash) {
+                    backends[backend_count].maxconn = atoi(slash + 1);
+                }
 
                 backend_count++;
                 break;
@@ -444,6 +730,151 @@ int main(int argc, char** argv) {
                 health_check_fails = atoi(optarg);
                 break;
 
+            case 1005:
+                reuseport_listeners = true;
+                break;
+
+            case 1006:
+                splice_relay = true;
+                break;
+
+            case 1007:
+                if (strcmp(optarg, "epoll") == 0) {
+                    io_engine = IO_ENGINE_EPOLL;
+                } else if (strcmp(optarg, "io_uring") == 0 || strcmp(optarg, "uring") == 0) {
+                    io_engine = IO_ENGINE_URING;
+                } else {
+                    fprintf(stderr, "Unknown I/O engine: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 1008:
+                write_high_water = atol(optarg);
+                if (write_high_water <= 0) {
+                    fprintf(stderr, "Invalid write high-water mark: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 1009:
+                dns_ttl = atoi(optarg);
+                // In milliseconds it has to fit dns_ttl_ms
+                if (dns_ttl <= 0 || (uint32_t)dns_ttl > UINT32_MAX / 1000) {
+                    fprintf(stderr, "Invalid DNS TTL: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 1010:
+                upstream_keepalive = true;
+                break;
+
+            case 1011:
+                backend_fastopen = true;
+                break;
+
+            case 1012:
+                backend_preconnect = atoi(optarg);
+                if (backend_preconnect <= 0 || backend_preconnect > UPSTREAM_IDLE_MAX) {
+                    fprintf(stderr, "Invalid preconnect count: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 1013:
+                if (inet_pton(AF_INET, optarg, &backend_source.in.sin_addr) == 1) {
+                    backend_source.in.sin_family = AF_INET;
+                } else if (inet_pton(AF_INET6, optarg, &backend_source.in6.sin6_addr) == 1) {
+                    backend_source.in6.sin6_family = AF_INET6;
+                } else {
+                    fprintf(stderr, "Invalid backend source address: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 1014:
+                per_request_balance = true;
+                break;
+
+            case 1015:
+                http2 = true;
+                break;
+
+            case 1016:
+                if (strcmp(optarg, "tcp") == 0) {
+                    health_check_type = HCHK_TYPE_TCP;
+                } else if (strcmp(optarg, "http") == 0) {
+                    health_check_type = HCHK_TYPE_HTTP;
+                } else if (strcmp(optarg, "mysql") == 0) {
+                    health_check_type = HCHK_TYPE_MYSQL;
+                } else if (strcmp(optarg, "redis") == 0) {
+                    health_check_type = HCHK_TYPE_REDIS;
+                } else {
+                    fprintf(stderr, "Unknown health check type: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 1017:
+                outlier_failures = atoi(optarg);
+                break;
+
+            case 1018:
+                outlier_eject_ms = atoi(optarg);
+                break;
+
+            case 1019:
+                outlier_max_eject = atoi(optarg);
+                break;
+
+            case 1020:
+                slow_start_ms = atoi(optarg);
+                break;
+
+            case 1021:
+                if (strcmp(optarg, "linear") == 0) {
+                    slow_start_exponential = false;
+                } else if (strcmp(optarg, "exp") == 0) {
+                    slow_start_exponential = true;
+                } else {
+                    fprintf(stderr, "Unknown slow start mode: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 1022:
+                drain_file = optarg;
+                break;
+
+            case 1023:
+                backends_file = optarg;
+                break;
+
+            case 1024:
+                handover_path = optarg;
+                break;
+
+            case 1025:
+                phase_sample = (uint32_t)atoi(optarg);
+                break;
+
+            case 1026:
+                server_maxconn = (uint32_t)atoi(optarg);
+                break;
+
+            case 1027:
+                group_maxconn = (uint32_t)atoi(optarg);
+                break;
+
+            case 1028:
+                queue_max = atoi(optarg);
+                break;
+
+            case 1029:
+                queue_timeout_ms = atoi(optarg);
+                break;
+
             case 'h':
                 print_usage(argv[0]);
                 exit(0);
@@ -470,20 +901,28 @@ int main(int argc, char** argv) {
         exit(0);
     }
 
+    if (backends_file && backend_count > 0) {
+        fprintf(stderr, "--backends-file and -b cannot be combined\n");
+        exit(1);
+    }
+
     // default backend if none specified
     
-    if (backend_count == 0) {
+    if (backend_count == 0 && !backends_file) {
         strncpy(backends[0].host, "127.0.0.1", sizeof(backends[0].host) - 1);
         backends[0].port = 8001;
         backends[0].weight = 1;
+        backends[0].maxconn = 0;
 
         strncpy(backends[1].host, "127.0.0.1", sizeof(backends[1].host) - 1);
         backends[1].port = 8002;
         backends[1].weight = 1;
+        backends[1].maxconn = 0;
 
         strncpy(backends[2].host, "127.0.0.1", sizeof(backends[2].host) - 1);
         backends[2].port = 8003;
         backends[2].weight = 1;
+        backends[2].maxconn = 0;
 
         backend_count = 3;
         printf("No backends specified, using defaults: 127.0.0.1:8001-8003\n");
@@ -493,6 +932,10 @@ int main(int argc, char** argv) {
     signal(SIGTERM, signal_handler);
     signal(SIGPIPE, SIG_IGN);
 
+    struct sigaction sa = { .sa_handler = reload_handler };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGHUP, &sa, NULL);
+
     start_time = time(NULL);
 
     global_lb = main_lb_create(port, algorithm);
@@ -509,6 +952,43 @@ int main(int argc, char** argv) {
     global_lb->config.health_check_enabled = health_check_enabled;
     global_lb->config.health_check_interval_ms = health_check_interval;
     global_lb->config.health_check_fail_threshold = health_check_fails;
+    global_lb->config.health_check_type = health_check_type;
+    if (outlier_failures >= 0) {
+        global_lb->config.outlier_consecutive_failures = outlier_failures;
+    }
+    if (outlier_eject_ms > 0) {
+        global_lb->config.outlier_base_eject_ms = outlier_eject_ms;
+    }
+    if (outlier_max_eject >= 0) {
+        global_lb->config.outlier_max_eject_percent = outlier_max_eject > 100 ? 100 : outlier_max_eject;
+    }
+    global_lb->config.slow_start_ms = slow_start_ms;
+    global_lb->config.slow_start_exponential = slow_start_exponential;
+    global_lb->config.drain_file = drain_file;
+    global_lb->config.reuseport_listeners = reuseport_listeners;
+    global_lb->config.splice_relay = splice_relay;
+    global_lb->config.io_engine = io_engine;
+    if (write_high_water > 0) {
+        global_lb->config.write_high_water = write_high_water;
+    }
+    global_lb->config.upstream_keepalive = upstream_keepalive;
+    global_lb->config.backend_fastopen = backend_fastopen;
+    global_lb->config.backend_preconnect = backend_preconnect;
+    global_lb->config.backend_source = backend_source;
+    global_lb->config.per_request_balance = per_request_balance;
+    global_lb->config.http2 = http2;
+    global_lb->config.phase_sample = phase_sample;
+    global_lb->config.server_maxconn = server_maxconn;
+    global_lb->config.group_maxconn = group_maxconn;
+    if (queue_max >= 0) {
+        global_lb->config.queue_max = queue_max;
+    }
+    if (queue_timeout_ms >= 0) {
+        global_lb->config.queue_timeout_ms = queue_timeout_ms;
+    }
+    if (dns_ttl > 0) {
+        global_lb->config.dns_ttl_ms = (uint32_t)dns_ttl * 1000;
+    }
 
     printf("Health check: %s (interval: %ums, fail threshold: %u)\n",
            health_check_enabled ? "enabled" : "disabled",
@@ -520,22 +1000,91 @@ int main(int argc, char** argv) {
             fprintf(stderr, "Failed to add backend %s:%u\n",
                    backends[i].host, backends[i].port);
         } else {
+            backend_t* b = global_lb->backends[global_lb->backend_count - 1];
+            atomic_store(&b->max_conns, backends[i].maxconn);
             printf("Added backend: %s:%u (weight: %u)\n",
                    backends[i].host, backends[i].port, backends[i].weight);
         }
     }
 
+    if (backends_file && lb_reload_backends(global_lb, backends_file) < 0) {
+        fprintf(stderr, "Failed to load backends from %s\n", backends_file);
+        main_lb_destroy(global_lb);
+        exit(1);
+    }
+
+    int handover_conn = -1;
+    if (handover_path) {
+        int n = lb_handover_take(handover_path, handover_fds, LB_HANDOVER_MAX_FDS, &handover_conn);
+        if (n < 0) {
+            fprintf(stderr, "Handover from %s failed: %s\n", handover_path, strerror(errno));
+            main_lb_destroy(global_lb);
+            exit(1);
+        }
+        handover_count = (uint32_t)n;
+        if (n > 0 && !main_handover_fits(global_lb)) {
+            fprintf(stderr, "Handover from %s refused: its %d listening sockets are not the ones "
+                    "this configuration opens; binding afresh, the old process keeps serving\n",
+                    handover_path, n);
+            for (uint32_t i = 0; i < handover_count; i++) close(handover_fds[i]);
+            handover_count = 0;
+            close(handover_conn);
+            handover_conn = -1;
+        } else if (n > 0) {
+            printf("Took %d listening sockets over from %s\n", n, handover_path);
+        }
+    }
+
+    lb_trace_init(global_lb->config.phase_sample);
+
+    // Workers log through per-thread rings from here on
+    log_start();
+
     if (main_lb_start(global_lb) < 0) {
         fprintf(stderr, "Failed to start load balancer\n");
+        // The old process keeps serving without an ack
+        if (handover_conn >= 0) close(handover_conn);
         main_lb_destroy(global_lb);
+        log_stop();
         exit(1);
     }
 
+    if (handover_conn >= 0 && lb_handover_ack(handover_conn) < 0) {
+        fprintf(stderr, "Handover ack failed, both processes accept\n");
+    }
+    if (handover_path && lb_handover_serve(global_lb, handover_path) < 0) {
+        fprintf(stderr, "Cannot serve handover on %s: %s\n", handover_path, strerror(errno));
+    }
+
+    uint64_t drain_since_ms = 0;
     while (global_lb->running) {
         sleep(1);
         now_ms += 1000; // Update time
+
+        if (reload_requested) {
+            reload_requested = 0;
+            if (backends_file) lb_reload_backends(global_lb, backends_file);
+            else printf("[RELOAD] SIGHUP ignored: no --backends-file\n");
+        }
+
+        // Handed over: the new process accepts, this one finishes what it
+        // has then exits
+        if (!atomic_load(&global_lb->accepting)) {
+            uint64_t now = get_time_ns() / 1000000;
+            if (!drain_since_ms) drain_since_ms = now;
+
+            lb_stats_totals_t totals;
+            lb_stats_collect(global_lb, &totals);
+            if (totals.active_connections == 0 || now - drain_since_ms >= LB_HANDOVER_GRACE_MS) {
+                printf("[HANDOVER] Exiting, %lu connections left\n",
+                       (unsigned long)totals.active_connections);
+                break;
+            }
+        }
     }
 
+    main_lb_stop(global_lb);
     main_lb_destroy(global_lb);
+    log_stop();
     return 0;
 }
\ No newline at end of file
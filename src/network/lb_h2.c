@@ -0,0 +1,1095 @@
+#include "core/lb_h2.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stddef.h>
+
+enum {
+    H2_STATE_PREFACE,
+    H2_STATE_SETTINGS,  // preface read, the client's SETTINGS must come first
+    H2_STATE_FRAMES,
+    H2_STATE_DEAD
+};
+
+enum {
+    H2_DATA,
+    H2_HEADERS,
+    H2_PRIORITY,
+    H2_RST_STREAM,
+    H2_SETTINGS,
+    H2_PUSH_PROMISE,
+    H2_PING,
+    H2_GOAWAY,
+    H2_WINDOW_UPDATE,
+    H2_CONTINUATION
+};
+
+#define H2_FLAG_END_STREAM   0x01
+#define H2_FLAG_ACK          0x01
+#define H2_FLAG_END_HEADERS  0x04
+#define H2_FLAG_PADDED       0x08
+#define H2_FLAG_PRIORITY     0x20
+
+enum {
+    H2_NO_ERROR = 0x0,
+    H2_PROTOCOL_ERROR = 0x1,
+    H2_INTERNAL_ERROR = 0x2,
+    H2_FLOW_CONTROL_ERROR = 0x3,
+    H2_STREAM_CLOSED = 0x5,
+    H2_FRAME_SIZE_ERROR = 0x6,
+    H2_REFUSED_STREAM = 0x7,
+    H2_COMPRESSION_ERROR = 0x9,
+    H2_ENHANCE_YOUR_CALM = 0xb
+};
+
+// How the upstream response is delimited, once its head is through
+enum {
+    H2_RSP_HEAD,
+    H2_RSP_LENGTH,
+    H2_RSP_CLOSE,
+    H2_RSP_CHUNK_SIZE,
+    H2_RSP_CHUNK_EXT,
+    H2_RSP_CHUNK_DATA,
+    H2_RSP_CHUNK_CRLF,
+    H2_RSP_TRAILER
+};
+
+#define H2_WINDOW_MAX 0x7fffffff
+
+static const char lb_h2_preface[LB_H2_PREFACE_LEN] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+static inline uint32_t lb_h2_get32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void lb_h2_put32(uint8_t* p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+bool lb_h2_preface_prefix(const uint8_t* data, size_t len) {
+    if (len > LB_H2_PREFACE_LEN) len = LB_H2_PREFACE_LEN;
+    return memcmp(data, lb_h2_preface, len) == 0;
+}
+
+lb_h2_t* lb_h2_create(const lb_h2_ops_t* ops, void* ctx) {
+    lb_h2_t* h2 = (lb_h2_t*)calloc(1, sizeof(*h2));
+    if (!h2) return NULL;
+
+    h2->ops = ops;
+    h2->ctx = ctx;
+    h2->state = H2_STATE_PREFACE;
+    h2->send_window = LB_H2_WINDOW;
+    h2->peer_initial_window = LB_H2_WINDOW;
+    h2->peer_max_frame = LB_H2_FRAME_MAX;
+    lb_hpack_init(&h2->hpack);
+    for (int i = 0; i < LB_H2_MAX_STREAMS; i++) {
+        h2->streams[i].fd = -1;
+        h2->streams[i].wrapper.fd = -1;
+    }
+    return h2;
+}
+
+void lb_h2_destroy(lb_h2_t* h2) {
+    if (!h2) return;
+    for (int i = 0; i < LB_H2_MAX_STREAMS; i++) {
+        free(h2->streams[i].rsp_head);
+        free(h2->streams[i].stash);
+    }
+    free(h2->out);
+    free(h2);
+}
+
+/* ---- output ---- */
+
+// Append a frame header to out and return where its payload goes, NULL
+// when out cannot grow; the connection then fails at the next flush
+static uint8_t* lb_h2_frame(lb_h2_t* h2, uint8_t type, uint8_t flags, uint32_t id, size_t len) {
+    if (h2->out_len + 9 + len > h2->out_cap) {
+        size_t cap = h2->out_cap ? h2->out_cap : 4096;
+        while (cap < h2->out_len + 9 + len) cap *= 2;
+        uint8_t* out = (uint8_t*)realloc(h2->out, cap);
+        if (!out) {
+            h2->state = H2_STATE_DEAD;
+            return NULL;
+        }
+        h2->out = out;
+        h2->out_cap = cap;
+    }
+
+    uint8_t* p = h2->out + h2->out_len;
+    p[0] = len >> 16;
+    p[1] = len >> 8;
+    p[2] = len;
+    p[3] = type;
+    p[4] = flags;
+    lb_h2_put32(p + 5, id & H2_WINDOW_MAX);
+    h2->out_len += 9 + len;
+    return p + 9;
+}
+
+static void lb_h2_window_update(lb_h2_t* h2, uint32_t id, uint32_t inc) {
+    uint8_t* p = lb_h2_frame(h2, H2_WINDOW_UPDATE, 0, id, 4);
+    if (p) lb_h2_put32(p, inc);
+}
+
+static void lb_h2_rst(lb_h2_t* h2, uint32_t id, uint32_t code) {
+    uint8_t* p = lb_h2_frame(h2, H2_RST_STREAM, 0, id, 4);
+    if (p) lb_h2_put32(p, code);
+    h2->reset_ids[h2->reset_next++ % LB_H2_RESET_IDS] = id;
+}
+
+static bool lb_h2_was_reset(const lb_h2_t* h2, uint32_t id) {
+    for (int i = 0; i < LB_H2_RESET_IDS; i++) {
+        if (h2->reset_ids[i] == id) return true;
+    }
+    return false;
+}
+
+static int lb_h2_conn_error(lb_h2_t* h2, uint32_t code) {
+    uint8_t* p = lb_h2_frame(h2, H2_GOAWAY, 0, 0, 8);
+    if (p) {
+        lb_h2_put32(p, h2->last_stream_id);
+        lb_h2_put32(p + 4, code);
+    }
+    h2->state = H2_STATE_DEAD;
+    return -1;
+}
+
+static int lb_h2_flush(lb_h2_t* h2) {
+    int ret = 0;
+    if (h2->out_len > 0) {
+        ret = h2->ops->send(h2->ctx, h2->out, h2->out_len);
+        h2->out_len = 0;
+    }
+    return h2->state == H2_STATE_DEAD ? -1 : ret;
+}
+
+/* ---- streams ---- */
+
+static lb_h2_stream_t* lb_h2_stream_find(lb_h2_t* h2, uint32_t id) {
+    for (int i = 0; i < LB_H2_MAX_STREAMS; i++) {
+        if (h2->streams[i].id == id) return &h2->streams[i];
+    }
+    return NULL;
+}
+
+static lb_h2_stream_t* lb_h2_stream_new(lb_h2_t* h2, uint32_t id) {
+    lb_h2_stream_t* st = lb_h2_stream_find(h2, 0);
+    if (!st) return NULL;
+
+    memset(st, 0, sizeof(*st));
+    st->id = id;
+    st->send_window = h2->peer_initial_window;
+    st->fd = -1;
+    st->wrapper.fd = -1;
+    h2->active++;
+    return st;
+}
+
+static void lb_h2_release(lb_h2_t* h2, lb_h2_stream_t* st, bool reusable) {
+    if (st->released) return;
+    st->released = true;
+    h2->ops->release(h2->ctx, st, reusable);
+}
+
+static void lb_h2_stream_free(lb_h2_t* h2, lb_h2_stream_t* st) {
+    lb_h2_release(h2, st, false);
+    free(st->rsp_head);
+    free(st->stash);
+    st->rsp_head = NULL;
+    st->stash = NULL;
+    st->stash_len = st->stash_cap = 0;
+    st->id = 0;
+    h2->active--;
+}
+
+static void lb_h2_stream_reset(lb_h2_t* h2, lb_h2_stream_t* st, uint32_t code) {
+    lb_h2_rst(h2, st->id, code);
+    lb_h2_stream_free(h2, st);
+}
+
+// END_STREAM went out. A client still sending its body is told to stop.
+static void lb_h2_stream_close(lb_h2_t* h2, lb_h2_stream_t* st) {
+    st->end_local = true;
+    if (!st->end_remote) lb_h2_rst(h2, st->id, H2_NO_ERROR);
+    lb_h2_stream_free(h2, st);
+}
+
+// HEADERS plus as many CONTINUATION frames as the block needs
+static void lb_h2_send_headers(lb_h2_t* h2, lb_h2_stream_t* st, const uint8_t* block, size_t len,
+                               bool end_stream) {
+    size_t off = 0;
+    bool first = true;
+    do {
+        size_t n = len - off;
+        if (n > h2->peer_max_frame) n = h2->peer_max_frame;
+        uint8_t flags = (first && end_stream ? H2_FLAG_END_STREAM : 0) |
+                        (off + n == len ? H2_FLAG_END_HEADERS : 0);
+        uint8_t* p = lb_h2_frame(h2, first ? H2_HEADERS : H2_CONTINUATION, flags, st->id, n);
+        if (!p) return;
+        memcpy(p, block + off, n);
+        off += n;
+        first = false;
+    } while (off < len);
+}
+
+// Answer a stream with a bodyless status of our own
+static void lb_h2_reply(lb_h2_t* h2, lb_h2_stream_t* st, int status) {
+    uint8_t block[8];
+    ssize_t n = lb_hpack_encode_status(block, sizeof(block), status);
+    lb_h2_send_headers(h2, st, block, n, true);
+    st->rsp_started = true;
+    lb_h2_stream_close(h2, st);
+}
+
+// Backend trouble: a 502 while nothing was sent yet, else a reset
+static void lb_h2_stream_fail(lb_h2_t* h2, lb_h2_stream_t* st) {
+    if (!st->rsp_started) {
+        lb_h2_release(h2, st, false);
+        lb_h2_reply(h2, st, 502);
+    } else {
+        lb_h2_stream_reset(h2, st, H2_INTERNAL_ERROR);
+    }
+}
+
+static size_t lb_h2_data_room(const lb_h2_t* h2, const lb_h2_stream_t* st, size_t len) {
+    int32_t win = st->send_window < h2->send_window ? st->send_window : h2->send_window;
+    if (win <= 0) return 0;
+    if (len > (size_t)win) len = win;
+    if (len > h2->peer_max_frame) len = h2->peer_max_frame;
+    return len;
+}
+
+static bool lb_h2_data_frame(lb_h2_t* h2, lb_h2_stream_t* st, const uint8_t* data, size_t n,
+                             bool end) {
+    uint8_t* p = lb_h2_frame(h2, H2_DATA, end ? H2_FLAG_END_STREAM : 0, st->id, n);
+    if (!p) return false;
+    memcpy(p, data, n);
+    st->send_window -= n;
+    h2->send_window -= n;
+    return true;
+}
+
+// Send what the windows admit from st's stash, then END_STREAM once the
+// response is complete and nothing is left
+static void lb_h2_stream_push(lb_h2_t* h2, lb_h2_stream_t* st) {
+    size_t off = 0;
+    while (off < st->stash_len) {
+        size_t n = lb_h2_data_room(h2, st, st->stash_len - off);
+        if (n == 0) break;
+        bool end = st->rsp_done && off + n == st->stash_len;
+        if (!lb_h2_data_frame(h2, st, st->stash + off, n, end)) return;
+        off += n;
+        if (end) {
+            lb_h2_stream_close(h2, st);
+            return;
+        }
+    }
+    if (off > 0) {
+        memmove(st->stash, st->stash + off, st->stash_len - off);
+        st->stash_len -= off;
+    }
+
+    if (st->stash_len == 0 && st->rsp_done) {
+        if (lb_h2_frame(h2, H2_DATA, H2_FLAG_END_STREAM, st->id, 0)) lb_h2_stream_close(h2, st);
+    }
+}
+
+static void lb_h2_push_all(lb_h2_t* h2) {
+    for (int i = 0; i < LB_H2_MAX_STREAMS && h2->send_window > 0; i++) {
+        lb_h2_stream_t* st = &h2->streams[i];
+        if (st->id && (st->stash_len > 0 || st->rsp_done)) lb_h2_stream_push(h2, st);
+    }
+}
+
+// Response body bytes: straight into DATA frames while the windows allow,
+// the rest into the stash
+static int lb_h2_stream_data(lb_h2_t* h2, lb_h2_stream_t* st, const uint8_t* data, size_t len) {
+    while (st->stash_len == 0 && len > 0) {
+        size_t n = lb_h2_data_room(h2, st, len);
+        if (n == 0) break;
+        if (!lb_h2_data_frame(h2, st, data, n, false)) return -1;
+        data += n;
+        len -= n;
+    }
+    if (len == 0) return 0;
+
+    if (st->stash_len + len > st->stash_cap) {
+        size_t cap = st->stash_cap ? st->stash_cap : LB_H2_FRAME_MAX;
+        while (cap < st->stash_len + len) cap *= 2;
+        uint8_t* stash = (uint8_t*)realloc(st->stash, cap);
+        if (!stash) return -1;
+        st->stash = stash;
+        st->stash_cap = cap;
+    }
+    memcpy(st->stash + st->stash_len, data, len);
+    st->stash_len += len;
+    return 0;
+}
+
+/* ---- requests: HEADERS to an HTTP/1.1 head ---- */
+
+typedef struct lb_h2_req {
+    const char* pseudo[4];  // :method, :scheme, :path, :authority
+    size_t pseudo_len[4];
+    bool regular;           // a regular field was seen
+    bool has_length;
+    bool malformed;
+    size_t ps_len;
+    size_t hdrs_len;
+    size_t cookie_len;
+    char ps[HTTP_HEADER_MAX];
+    char hdrs[HTTP_HEADER_MAX];
+    char cookie[HTTP_HEADER_MAX];
+} lb_h2_req_t;
+
+enum { H2_PS_METHOD, H2_PS_SCHEME, H2_PS_PATH, H2_PS_AUTHORITY };
+
+static bool lb_h2_append(char* buf, size_t* len, size_t cap, const char* s, size_t n) {
+    if (*len + n > cap) return false;
+    memcpy(buf + *len, s, n);
+    *len += n;
+    return true;
+}
+
+static bool lb_h2_name_ok(const char* name, size_t len) {
+    if (len == 0) return false;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = name[i];
+        if (c <= 0x20 || c >= 0x7f || (c >= 'A' && c <= 'Z') || (c == ':' && i > 0)) return false;
+    }
+    return true;
+}
+
+static bool lb_h2_value_ok(const char* value, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (value[i] == '\0' || value[i] == '\r' || value[i] == '\n') return false;
+    }
+    return true;
+}
+
+static inline bool lb_h2_is(const char* name, size_t len, const char* lit) {
+    return len == strlen(lit) && memcmp(name, lit, len) == 0;
+}
+
+// Connection-specific fields have no meaning in HTTP/2 (RFC 9113 8.2.2)
+static bool lb_h2_hop_by_hop(const char* name, size_t len) {
+    return lb_h2_is(name, len, "connection") || lb_h2_is(name, len, "keep-alive") ||
+           lb_h2_is(name, len, "proxy-connection") || lb_h2_is(name, len, "transfer-encoding") ||
+           lb_h2_is(name, len, "upgrade");
+}
+
+// Decoding carries on past a bad field: the dynamic table must stay in step
+static int lb_h2_req_field(void* arg, const char* name, size_t name_len,
+                           const char* value, size_t value_len) {
+    lb_h2_req_t* r = (lb_h2_req_t*)arg;
+    if (r->malformed) return 0;
+
+    if (!lb_h2_name_ok(name, name_len) || !lb_h2_value_ok(value, value_len)) {
+        r->malformed = true;
+        return 0;
+    }
+
+    if (name[0] == ':') {
+        static const char* const names[4] = {":method", ":scheme", ":path", ":authority"};
+        int i = 0;
+        while (i < 4 && !lb_h2_is(name, name_len, names[i])) i++;
+        if (i == 4 || r->regular || r->pseudo[i] ||
+            !lb_h2_append(r->ps, &r->ps_len, sizeof(r->ps), value, value_len)) {
+            r->malformed = true;
+            return 0;
+        }
+        r->pseudo[i] = r->ps + r->ps_len - value_len;
+        r->pseudo_len[i] = value_len;
+        return 0;
+    }
+    r->regular = true;
+
+    if (lb_h2_hop_by_hop(name, name_len)) {
+        r->malformed = true;
+        return 0;
+    }
+    if (lb_h2_is(name, name_len, "te")) {
+        if (value_len != 8 || memcmp(value, "trailers", 8) != 0) r->malformed = true;
+        return 0;  // nothing for an HTTP/1.1 backend to act on
+    }
+    // :authority wins over a Host field
+    if (lb_h2_is(name, name_len, "host") && r->pseudo[H2_PS_AUTHORITY]) return 0;
+
+    // Cookie may be split across fields; HTTP/1.1 wants one line
+    if (lb_h2_is(name, name_len, "cookie")) {
+        if ((r->cookie_len > 0 && !lb_h2_append(r->cookie, &r->cookie_len, sizeof(r->cookie), "; ", 2)) ||
+            !lb_h2_append(r->cookie, &r->cookie_len, sizeof(r->cookie), value, value_len)) {
+            r->malformed = true;
+        }
+        return 0;
+    }
+    if (lb_h2_is(name, name_len, "content-length")) r->has_length = true;
+
+    if (!lb_h2_append(r->hdrs, &r->hdrs_len, sizeof(r->hdrs), name, name_len) ||
+        !lb_h2_append(r->hdrs, &r->hdrs_len, sizeof(r->hdrs), ": ", 2) ||
+        !lb_h2_append(r->hdrs, &r->hdrs_len, sizeof(r->hdrs), value, value_len) ||
+        !lb_h2_append(r->hdrs, &r->hdrs_len, sizeof(r->hdrs), "\r\n", 2)) {
+        r->malformed = true;
+    }
+    return 0;
+}
+
+static int lb_h2_trailer_field(void* arg, const char* name, size_t name_len,
+                               const char* value, size_t value_len) {
+    return 0;  // chunked trailers are not forwarded
+}
+
+// Lay out the HTTP/1.1 head in r->ps behind the pseudo-header values.
+// Returns its length, 0 when it does not fit.
+static size_t lb_h2_req_head(lb_h2_req_t* r, char* head, size_t cap, bool chunked) {
+    size_t len = 0;
+    bool ok = lb_h2_append(head, &len, cap, r->pseudo[H2_PS_METHOD], r->pseudo_len[H2_PS_METHOD]) &&
+              lb_h2_append(head, &len, cap, " ", 1) &&
+              lb_h2_append(head, &len, cap, r->pseudo[H2_PS_PATH], r->pseudo_len[H2_PS_PATH]) &&
+              lb_h2_append(head, &len, cap, " HTTP/1.1\r\n", 11);
+    if (ok && r->pseudo[H2_PS_AUTHORITY]) {
+        ok = lb_h2_append(head, &len, cap, "host: ", 6) &&
+             lb_h2_append(head, &len, cap, r->pseudo[H2_PS_AUTHORITY], r->pseudo_len[H2_PS_AUTHORITY]) &&
+             lb_h2_append(head, &len, cap, "\r\n", 2);
+    }
+    ok = ok && lb_h2_append(head, &len, cap, r->hdrs, r->hdrs_len);
+    if (ok && r->cookie_len > 0) {
+        ok = lb_h2_append(head, &len, cap, "cookie: ", 8) &&
+             lb_h2_append(head, &len, cap, r->cookie, r->cookie_len) &&
+             lb_h2_append(head, &len, cap, "\r\n", 2);
+    }
+    if (ok && chunked) ok = lb_h2_append(head, &len, cap, "transfer-encoding: chunked\r\n", 28);
+    ok = ok && lb_h2_append(head, &len, cap, "\r\n", 2);
+    return ok ? len : 0;
+}
+
+// A complete header block for stream id
+static int lb_h2_headers_done(lb_h2_t* h2, uint32_t id, bool end_stream) {
+    lb_h2_stream_t* st = lb_h2_stream_find(h2, id);
+
+    if (st) {
+        // Trailers: they can only close the request body
+        if (lb_hpack_decode(&h2->hpack, h2->hblock, h2->hblock_len, lb_h2_trailer_field, NULL) < 0) {
+            return lb_h2_conn_error(h2, H2_COMPRESSION_ERROR);
+        }
+        if (st->end_remote || !end_stream) {
+            lb_h2_stream_reset(h2, st, H2_PROTOCOL_ERROR);
+            return 0;
+        }
+        st->end_remote = true;
+        if (st->req_chunked && h2->ops->request_body(h2->ctx, st, (const uint8_t*)"0\r\n\r\n", 5) < 0) {
+            lb_h2_stream_fail(h2, st);
+        }
+        return 0;
+    }
+    if (id <= h2->last_stream_id) {
+        // Sent before our RST_STREAM arrived (RFC 9113 5.1): decoded for
+        // the dynamic table's sake, then dropped. A stream that was never
+        // opened, or that closed cleanly, cannot take HEADERS.
+        if (!lb_h2_was_reset(h2, id)) return lb_h2_conn_error(h2, H2_STREAM_CLOSED);
+        if (lb_hpack_decode(&h2->hpack, h2->hblock, h2->hblock_len, lb_h2_trailer_field, NULL) < 0) {
+            return lb_h2_conn_error(h2, H2_COMPRESSION_ERROR);
+        }
+        return 0;
+    }
+    h2->last_stream_id = id;
+
+    static _Thread_local lb_h2_req_t req;
+    lb_h2_req_t* r = &req;
+    memset(r, 0, offsetof(lb_h2_req_t, ps));
+    if (lb_hpack_decode(&h2->hpack, h2->hblock, h2->hblock_len, lb_h2_req_field, r) < 0) {
+        return lb_h2_conn_error(h2, H2_COMPRESSION_ERROR);
+    }
+
+    if (h2->active >= LB_H2_MAX_STREAMS) {
+        lb_h2_rst(h2, id, H2_REFUSED_STREAM);
+        return 0;
+    }
+    st = lb_h2_stream_new(h2, id);
+    st->end_remote = end_stream;
+
+    if (r->malformed || !r->pseudo[H2_PS_METHOD]) {
+        lb_h2_stream_reset(h2, st, H2_PROTOCOL_ERROR);
+        return 0;
+    }
+    // No tunnels over a pooled HTTP/1.1 connection
+    if (lb_h2_is(r->pseudo[H2_PS_METHOD], r->pseudo_len[H2_PS_METHOD], "CONNECT")) {
+        lb_h2_reply(h2, st, 501);
+        return 0;
+    }
+    if (!r->pseudo[H2_PS_SCHEME] || !r->pseudo[H2_PS_PATH] || r->pseudo_len[H2_PS_PATH] == 0) {
+        lb_h2_stream_reset(h2, st, H2_PROTOCOL_ERROR);
+        return 0;
+    }
+
+    st->head_req = lb_h2_is(r->pseudo[H2_PS_METHOD], r->pseudo_len[H2_PS_METHOD], "HEAD");
+    // A body of unknown length goes to the backend chunked
+    st->req_chunked = !end_stream && !r->has_length;
+
+    char head[HTTP_HEADER_MAX * 2];
+    size_t len = lb_h2_req_head(r, head, sizeof(head), st->req_chunked);
+    if (len == 0) {
+        lb_h2_reply(h2, st, 431);
+        return 0;
+    }
+    if (h2->ops->request(h2->ctx, st, head, len) < 0) lb_h2_reply(h2, st, 503);
+    return 0;
+}
+
+// Request body bytes, re-framed as a chunk when needed
+static int lb_h2_body(lb_h2_t* h2, lb_h2_stream_t* st, const uint8_t* data, size_t len) {
+    if (!st->req_chunked) return h2->ops->request_body(h2->ctx, st, data, len);
+
+    char size[24];
+    int n = snprintf(size, sizeof(size), "%zx\r\n", len);
+    int a = h2->ops->request_body(h2->ctx, st, (const uint8_t*)size, n);
+    int b = a < 0 ? a : h2->ops->request_body(h2->ctx, st, data, len);
+    int c = b < 0 ? b : h2->ops->request_body(h2->ctx, st, (const uint8_t*)"\r\n", 2);
+    if (a < 0 || b < 0 || c < 0) return -1;
+    return a | b | c;
+}
+
+/* ---- frames ---- */
+
+static int lb_h2_on_data(lb_h2_t* h2, uint8_t flags, uint32_t id, const uint8_t* p, size_t len) {
+    if (id == 0) return lb_h2_conn_error(h2, H2_PROTOCOL_ERROR);
+
+    // The whole frame counts against the windows, padding included
+    size_t flen = len;
+    h2->recv_unacked += flen;
+    if (h2->recv_unacked > LB_H2_WINDOW) return lb_h2_conn_error(h2, H2_FLOW_CONTROL_ERROR);
+
+    size_t pad = 0;
+    if (flags & H2_FLAG_PADDED) {
+        if (len < 1 || p[0] >= len) return lb_h2_conn_error(h2, H2_PROTOCOL_ERROR);
+        pad = p[0];
+        p++;
+        len--;
+    }
+
+    lb_h2_stream_t* st = lb_h2_stream_find(h2, id);
+    if (!st) {
+        // Streams we reset or refused may still have frames in flight
+        return id > h2->last_stream_id ? lb_h2_conn_error(h2, H2_PROTOCOL_ERROR) : 0;
+    }
+    if (st->end_remote) {
+        lb_h2_stream_reset(h2, st, H2_STREAM_CLOSED);
+        return 0;
+    }
+    st->recv_unacked += flen;
+    if (st->recv_unacked > LB_H2_WINDOW) {
+        lb_h2_stream_reset(h2, st, H2_FLOW_CONTROL_ERROR);
+        return 0;
+    }
+
+    int ret = len - pad > 0 ? lb_h2_body(h2, st, p, len - pad) : 0;
+    if (ret >= 0 && (flags & H2_FLAG_END_STREAM)) {
+        st->end_remote = true;
+        if (st->req_chunked) {
+            int end = h2->ops->request_body(h2->ctx, st, (const uint8_t*)"0\r\n\r\n", 5);
+            if (end < 0) ret = -1;
+        }
+    }
+    if (ret < 0) {
+        lb_h2_stream_fail(h2, st);
+        return 0;
+    }
+
+    if (ret == 1) {
+        st->window_held = true;
+    } else if (!st->window_held && !st->end_remote && st->recv_unacked >= LB_H2_WINDOW / 2) {
+        lb_h2_window_update(h2, id, st->recv_unacked);
+        st->recv_unacked = 0;
+    }
+    return 0;
+}
+
+static int lb_h2_on_headers(lb_h2_t* h2, uint8_t flags, uint32_t id, const uint8_t* p, size_t len) {
+    if (id == 0 || (id & 1) == 0) return lb_h2_conn_error(h2, H2_PROTOCOL_ERROR);
+
+    size_t off = 0, pad = 0;
+    if (flags & H2_FLAG_PADDED) {
+        if (len < 1) return lb_h2_conn_error(h2, H2_PROTOCOL_ERROR);
+        pad = p[0];
+        off = 1;
+    }
+    if (flags & H2_FLAG_PRIORITY) off += 5;  // dependency and weight, ignored
+    if (off + pad > len) return lb_h2_conn_error(h2, H2_PROTOCOL_ERROR);
+
+    size_t n = len - off - pad;
+    if (n > sizeof(h2->hblock)) return lb_h2_conn_error(h2, H2_ENHANCE_YOUR_CALM);
+    memcpy(h2->hblock, p + off, n);
+    h2->hblock_len = n;
+
+    if (flags & H2_FLAG_END_HEADERS) return lb_h2_headers_done(h2, id, flags & H2_FLAG_END_STREAM);
+    h2->cont_stream = id;
+    h2->cont_end_stream = flags & H2_FLAG_END_STREAM;
+    return 0;
+}
+
+static int lb_h2_on_continuation(lb_h2_t* h2, uint8_t flags, uint32_t id, const uint8_t* p,
+                                 size_t len) {
+    if (id != h2->cont_stream) return lb_h2_conn_error(h2, H2_PROTOCOL_ERROR);
+    if (h2->hblock_len + len > sizeof(h2->hblock)) return lb_h2_conn_error(h2, H2_ENHANCE_YOUR_CALM);
+    memcpy(h2->hblock + h2->hblock_len, p, len);
+    h2->hblock_len += len;
+
+    if (!(flags & H2_FLAG_END_HEADERS)) return 0;
+    h2->cont_stream = 0;
+    return lb_h2_headers_done(h2, id, h2->cont_end_stream);
+}
+
+static int lb_h2_on_settings(lb_h2_t* h2, uint8_t flags, uint32_t id, const uint8_t* p, size_t len) {
+    if (id != 0) return lb_h2_conn_error(h2, H2_PROTOCOL_ERROR);
+    if (flags & H2_FLAG_ACK) return len == 0 ? 0 : lb_h2_conn_error(h2, H2_FRAME_SIZE_ERROR);
+    if (len % 6) return lb_h2_conn_error(h2, H2_FRAME_SIZE_ERROR);
+
+    for (size_t i = 0; i < len; i += 6) {
+        uint16_t param = (p[i] << 8) | p[i + 1];
+        uint32_t value = lb_h2_get32(p + i + 2);
+
+        switch (param) {
+            case 0x2:  // ENABLE_PUSH: we never push anyway
+                if (value > 1) return lb_h2_conn_error(h2, H2_PROTOCOL_ERROR);
+                break;
+            case 0x4: {  // INITIAL_WINDOW_SIZE applies to open streams too
+                if (value > H2_WINDOW_MAX) return lb_h2_conn_error(h2, H2_FLOW_CONTROL_ERROR);
+                int64_t delta = (int64_t)value - h2->peer_initial_window;
+                for (int s = 0; s < LB_H2_MAX_STREAMS; s++) {
+                    lb_h2_stream_t* st = &h2->streams[s];
+                    if (!st->id) continue;
+                    if (st->send_window + delta > H2_WINDOW_MAX) {
+                        return lb_h2_conn_error(h2, H2_FLOW_CONTROL_ERROR);
+                    }
+                    st->send_window += delta;
+                }
+                h2->peer_initial_window = value;
+                break;
+            }
+            case 0x5:  // MAX_FRAME_SIZE
+                if (value < LB_H2_FRAME_MAX || value > 0xffffff) {
+                    return lb_h2_conn_error(h2, H2_PROTOCOL_ERROR);
+                }
+                h2->peer_max_frame = value;
+                break;
+            default:  // table size (we never index), limits we do not exceed
+                break;
+        }
+    }
+
+    lb_h2_frame(h2, H2_SETTINGS, H2_FLAG_ACK, 0, 0);
+    lb_h2_push_all(h2);
+    return 0;
+}
+
+static int lb_h2_on_window_update(lb_h2_t* h2, uint32_t id, const uint8_t* p, size_t len) {
+    if (len != 4) return lb_h2_conn_error(h2, H2_FRAME_SIZE_ERROR);
+    uint32_t inc = lb_h2_get32(p) & H2_WINDOW_MAX;
+
+    if (id == 0) {
+        if (inc == 0) return lb_h2_conn_error(h2, H2_PROTOCOL_ERROR);
+        if ((int64_t)h2->send_window + inc > H2_WINDOW_MAX) {
+            return lb_h2_conn_error(h2, H2_FLOW_CONTROL_ERROR);
+        }
+        h2->send_window += inc;
+        lb_h2_push_all(h2);
+        return 0;
+    }
+
+    lb_h2_stream_t* st = lb_h2_stream_find(h2, id);
+    if (!st) return id > h2->last_stream_id ? lb_h2_conn_error(h2, H2_PROTOCOL_ERROR) : 0;
+    if (inc == 0) {
+        lb_h2_stream_reset(h2, st, H2_PROTOCOL_ERROR);
+    } else if ((int64_t)st->send_window + inc > H2_WINDOW_MAX) {
+        lb_h2_stream_reset(h2, st, H2_FLOW_CONTROL_ERROR);
+    } else {
+        st->send_window += inc;
+        lb_h2_stream_push(h2, st);
+    }
+    return 0;
+}
+
+static inline size_t lb_h2_frame_len(const uint8_t* frame) {
+    return ((size_t)frame[0] << 16) | ((size_t)frame[1] << 8) | frame[2];
+}
+
+static int lb_h2_on_frame(lb_h2_t* h2, const uint8_t* frame) {
+    size_t len = lb_h2_frame_len(frame);
+    uint8_t type = frame[3];
+    uint8_t flags = frame[4];
+    uint32_t id = lb_h2_get32(frame + 5) & H2_WINDOW_MAX;
+    const uint8_t* p = frame + 9;
+
+    if (h2->state == H2_STATE_SETTINGS) {
+        if (type != H2_SETTINGS || (flags & H2_FLAG_ACK)) return lb_h2_conn_error(h2, H2_PROTOCOL_ERROR);
+        h2->state = H2_STATE_FRAMES;
+    }
+    // Nothing may interleave with a header block
+    if (h2->cont_stream && type != H2_CONTINUATION) return lb_h2_conn_error(h2, H2_PROTOCOL_ERROR);
+
+    switch (type) {
+        case H2_DATA:
+            return lb_h2_on_data(h2, flags, id, p, len);
+        case H2_HEADERS:
+            return lb_h2_on_headers(h2, flags, id, p, len);
+        case H2_CONTINUATION:
+            return lb_h2_on_continuation(h2, flags, id, p, len);
+        case H2_PRIORITY:
+            if (id == 0) return lb_h2_conn_error(h2, H2_PROTOCOL_ERROR);
+            if (len != 5) lb_h2_rst(h2, id, H2_FRAME_SIZE_ERROR);
+            return 0;
+        case H2_RST_STREAM: {
+            if (id == 0) return lb_h2_conn_error(h2, H2_PROTOCOL_ERROR);
+            if (len != 4) return lb_h2_conn_error(h2, H2_FRAME_SIZE_ERROR);
+            lb_h2_stream_t* st = lb_h2_stream_find(h2, id);
+            if (!st) return id > h2->last_stream_id ? lb_h2_conn_error(h2, H2_PROTOCOL_ERROR) : 0;
+            lb_h2_stream_free(h2, st);
+            return 0;
+        }
+        case H2_SETTINGS:
+            return lb_h2_on_settings(h2, flags, id, p, len);
+        case H2_PING: {
+            if (id != 0) return lb_h2_conn_error(h2, H2_PROTOCOL_ERROR);
+            if (len != 8) return lb_h2_conn_error(h2, H2_FRAME_SIZE_ERROR);
+            if (flags & H2_FLAG_ACK) return 0;
+            uint8_t* ack = lb_h2_frame(h2, H2_PING, H2_FLAG_ACK, 0, 8);
+            if (ack) memcpy(ack, p, 8);
+            return 0;
+        }
+        case H2_GOAWAY:
+            // Streams already open run to completion; the client opens no more
+            return id == 0 ? 0 : lb_h2_conn_error(h2, H2_PROTOCOL_ERROR);
+        case H2_WINDOW_UPDATE:
+            return lb_h2_on_window_update(h2, id, p, len);
+        case H2_PUSH_PROMISE:
+            return lb_h2_conn_error(h2, H2_PROTOCOL_ERROR);
+        default:
+            return 0;  // unknown frame types are ignored
+    }
+}
+
+int lb_h2_start(lb_h2_t* h2) {
+    uint8_t* p = lb_h2_frame(h2, H2_SETTINGS, 0, 0, 12);
+    if (p) {
+        p[0] = 0;
+        p[1] = 0x3;  // MAX_CONCURRENT_STREAMS
+        lb_h2_put32(p + 2, LB_H2_MAX_STREAMS);
+        p[6] = 0;
+        p[7] = 0x6;  // MAX_HEADER_LIST_SIZE
+        lb_h2_put32(p + 8, HTTP_HEADER_MAX);
+    }
+    return lb_h2_flush(h2);
+}
+
+int lb_h2_feed(lb_h2_t* h2, const uint8_t* data, size_t len) {
+    if (h2->state == H2_STATE_DEAD) return -1;
+
+    if (h2->state == H2_STATE_PREFACE) {
+        size_t n = LB_H2_PREFACE_LEN - h2->in_len;
+        if (n > len) n = len;
+        if (memcmp(data, lb_h2_preface + h2->in_len, n) != 0) {
+            lb_h2_conn_error(h2, H2_PROTOCOL_ERROR);
+            return lb_h2_flush(h2);
+        }
+        h2->in_len += n;
+        data += n;
+        len -= n;
+        if (h2->in_len < LB_H2_PREFACE_LEN) return 0;
+        h2->in_len = 0;
+        h2->state = H2_STATE_SETTINGS;
+    }
+
+    while (len > 0 && h2->state != H2_STATE_DEAD) {
+        if (h2->in_len == 0 && len >= 9) {
+            size_t flen = lb_h2_frame_len(data);
+            if (flen > LB_H2_FRAME_MAX) {
+                lb_h2_conn_error(h2, H2_FRAME_SIZE_ERROR);
+                break;
+            }
+            if (len >= 9 + flen) {
+                // Whole frame in this read: no copy
+                const uint8_t* frame = data;
+                data += 9 + flen;
+                len -= 9 + flen;
+                if (lb_h2_on_frame(h2, frame) < 0) break;
+                continue;
+            }
+        }
+
+        // Gather the frame header, then its payload, in h2->in
+        size_t need = 9;
+        if (h2->in_len >= 9) need += lb_h2_frame_len(h2->in);
+        size_t n = need - h2->in_len;
+        if (n > len) n = len;
+        memcpy(h2->in + h2->in_len, data, n);
+        h2->in_len += n;
+        data += n;
+        len -= n;
+
+        if (need == 9 && h2->in_len == 9) {
+            if (lb_h2_frame_len(h2->in) > LB_H2_FRAME_MAX) {
+                lb_h2_conn_error(h2, H2_FRAME_SIZE_ERROR);
+                break;
+            }
+            need += lb_h2_frame_len(h2->in);
+        }
+        if (h2->in_len < need) continue;
+
+        h2->in_len = 0;
+        if (lb_h2_on_frame(h2, h2->in) < 0) break;
+    }
+
+    // Connection window back in one update per read
+    if (h2->state != H2_STATE_DEAD && h2->recv_unacked >= LB_H2_WINDOW / 2) {
+        lb_h2_window_update(h2, 0, h2->recv_unacked);
+        h2->recv_unacked = 0;
+    }
+    return lb_h2_flush(h2);
+}
+
+/* ---- responses: HTTP/1.1 from the backend to HEADERS and DATA ---- */
+
+// Translate the response head in st->rsp_head (len bytes, blank line
+// included). Returns 1 for an interim response, 0 for the final one and -1
+// when it cannot be relayed.
+static int lb_h2_response_head(lb_h2_t* h2, lb_h2_stream_t* st, size_t len) {
+    char* line = st->rsp_head;
+    char* end = st->rsp_head + len;
+    char* eol = memchr(line, '\n', end - line);
+
+    if (strncmp(line, "HTTP/1.", 7) != 0 || line[8] != ' ') return -1;
+    int status = atoi(line + 9);
+    if (status < 100 || status > 999 || status == 101) return -1;
+    st->rsp_keepalive = line[7] == '1';
+
+    uint8_t block[HTTP_HEADER_MAX * 2];
+    ssize_t blen = lb_hpack_encode_status(block, sizeof(block), status);
+    if (blen < 0) return -1;
+
+    bool chunked = false, has_length = false;
+    uint64_t length = 0;
+
+    for (line = eol + 1; line < end; line = eol + 1) {
+        eol = memchr(line, '\n', end - line);
+        char* stop = eol;
+        if (stop > line && stop[-1] == '\r') stop--;
+        if (stop == line) break;  // blank line
+
+        char* colon = memchr(line, ':', stop - line);
+        if (!colon || colon == line) return -1;
+        size_t nlen = colon - line;
+        for (size_t i = 0; i < nlen; i++) {
+            if (line[i] >= 'A' && line[i] <= 'Z') line[i] |= 0x20;
+        }
+        char* value = colon + 1;
+        while (value < stop && (*value == ' ' || *value == '\t')) value++;
+        while (stop > value && (stop[-1] == ' ' || stop[-1] == '\t')) stop--;
+        size_t vlen = stop - value;
+
+        if (lb_h2_is(line, nlen, "connection")) {
+            if (memmem(value, vlen, "close", 5)) st->rsp_keepalive = false;
+            else if (memmem(value, vlen, "keep-alive", 10)) st->rsp_keepalive = true;
+            continue;
+        }
+        if (lb_h2_is(line, nlen, "transfer-encoding")) {
+            if (vlen >= 7 && strncasecmp(stop - 7, "chunked", 7) == 0) chunked = true;
+            continue;
+        }
+        if (lb_h2_hop_by_hop(line, nlen) || lb_h2_is(line, nlen, "te")) continue;
+        if (lb_h2_is(line, nlen, "content-length")) {
+            char* num_end;
+            if (vlen == 0 || *value < '0' || *value > '9') return -1;
+            length = strtoull(value, &num_end, 10);
+            if (num_end != stop) return -1;
+            has_length = true;
+        }
+
+        ssize_t n = lb_hpack_encode(block + blen, sizeof(block) - blen, line, nlen, value, vlen);
+        if (n < 0) return -1;
+        blen += n;
+    }
+
+    // 1xx goes out as its own header block; the final response follows
+    if (status < 200) {
+        lb_h2_send_headers(h2, st, block, blen, false);
+        return 1;
+    }
+
+    bool body;
+    if (st->head_req || status == 204 || status == 304) {
+        body = false;
+    } else if (chunked) {
+        body = true;
+        st->rsp_state = H2_RSP_CHUNK_SIZE;
+        st->rsp_remaining = 0;
+    } else if (has_length) {
+        body = length > 0;
+        st->rsp_state = H2_RSP_LENGTH;
+        st->rsp_remaining = length;
+    } else {
+        body = true;
+        st->rsp_state = H2_RSP_CLOSE;
+        st->rsp_keepalive = false;
+    }
+
+    lb_h2_send_headers(h2, st, block, blen, !body);
+    st->rsp_started = true;
+    if (!body) {
+        st->rsp_done = true;
+        st->end_local = true;
+    }
+    return 0;
+}
+
+static int lb_h2_rsp_chunked(lb_h2_t* h2, lb_h2_stream_t* st, const uint8_t** data, size_t* len) {
+    const uint8_t* p = *data;
+    const uint8_t* end = p + *len;
+
+    while (p < end && !st->rsp_done) {
+        if (st->rsp_state == H2_RSP_CHUNK_DATA) {
+            size_t n = end - p;
+            if (n > st->rsp_remaining) n = st->rsp_remaining;
+            if (lb_h2_stream_data(h2, st, p, n) < 0) return -1;
+            p += n;
+            st->rsp_remaining -= n;
+            if (st->rsp_remaining == 0) st->rsp_state = H2_RSP_CHUNK_CRLF;
+            continue;
+        }
+
+        char c = (char)*p++;
+        switch (st->rsp_state) {
+            case H2_RSP_CHUNK_SIZE: {
+                int d = -1;
+                if (c >= '0' && c <= '9') d = c - '0';
+                else if (c >= 'a' && c <= 'f') d = c - 'a' + 10;
+                else if (c >= 'A' && c <= 'F') d = c - 'A' + 10;
+
+                if (d >= 0) {
+                    if (st->rsp_remaining >> 56) return -1;
+                    st->rsp_remaining = st->rsp_remaining * 16 + d;
+                } else if (c == ';' || c == ' ' || c == '\t') {
+                    st->rsp_state = H2_RSP_CHUNK_EXT;
+                } else if (c == '\n') {
+                    st->rsp_state = st->rsp_remaining ? H2_RSP_CHUNK_DATA : H2_RSP_TRAILER;
+                } else if (c != '\r') {
+                    return -1;
+                }
+                break;
+            }
+            case H2_RSP_CHUNK_EXT:
+                if (c == '\n') st->rsp_state = st->rsp_remaining ? H2_RSP_CHUNK_DATA : H2_RSP_TRAILER;
+                break;
+            case H2_RSP_CHUNK_CRLF:
+                if (c == '\n') st->rsp_state = H2_RSP_CHUNK_SIZE;
+                else if (c != '\r') return -1;
+                break;
+            case H2_RSP_TRAILER:
+                // rsp_remaining flags a non-empty trailer line
+                if (c == '\n') {
+                    if (st->rsp_remaining == 0) st->rsp_done = true;
+                    st->rsp_remaining = 0;
+                } else if (c != '\r') {
+                    st->rsp_remaining = 1;
+                }
+                break;
+        }
+    }
+    *len = end - p;
+    *data = p;
+    return 0;
+}
+
+static int lb_h2_rsp_feed(lb_h2_t* h2, lb_h2_stream_t* st, const uint8_t* data, size_t len) {
+    while (len > 0 && !st->rsp_done) {
+        switch (st->rsp_state) {
+            case H2_RSP_HEAD: {
+                if (!st->rsp_head && !(st->rsp_head = (char*)malloc(HTTP_HEADER_MAX))) return -1;
+                size_t room = HTTP_HEADER_MAX - st->rsp_head_len;
+                if (room == 0) return -1;
+                size_t n = len < room ? len : room;
+                size_t from = st->rsp_head_len > 3 ? st->rsp_head_len - 3 : 0;
+                memcpy(st->rsp_head + st->rsp_head_len, data, n);
+
+                char* end = memmem(st->rsp_head + from, st->rsp_head_len + n - from, "\r\n\r\n", 4);
+                if (!end) {
+                    st->rsp_head_len += n;
+                    data += n;
+                    len -= n;
+                    break;
+                }
+                size_t head_len = end + 4 - st->rsp_head;
+                data += head_len - st->rsp_head_len;
+                len -= head_len - st->rsp_head_len;
+                st->rsp_head_len = 0;
+
+                int ret = lb_h2_response_head(h2, st, head_len);
+                if (ret < 0) return -1;
+                if (ret == 0) {
+                    free(st->rsp_head);
+                    st->rsp_head = NULL;
+                }
+                break;
+            }
+            case H2_RSP_LENGTH: {
+                size_t n = len;
+                if (n > st->rsp_remaining) n = st->rsp_remaining;
+                if (lb_h2_stream_data(h2, st, data, n) < 0) return -1;
+                data += n;
+                len -= n;
+                st->rsp_remaining -= n;
+                if (st->rsp_remaining == 0) st->rsp_done = true;
+                break;
+            }
+            case H2_RSP_CLOSE:
+                if (lb_h2_stream_data(h2, st, data, len) < 0) return -1;
+                len = 0;
+                break;
+            default:
+                if (lb_h2_rsp_chunked(h2, st, &data, &len) < 0) return -1;
+                break;
+        }
+    }
+
+    if (st->rsp_done) {
+        // Bytes past the response mean the backend cannot be trusted again
+        lb_h2_release(h2, st, st->rsp_keepalive && st->end_remote && len == 0);
+        if (st->end_local) lb_h2_stream_close(h2, st);
+        else lb_h2_stream_push(h2, st);
+    }
+    return 0;
+}
+
+int lb_h2_response(lb_h2_t* h2, lb_h2_stream_t* st, const uint8_t* data, size_t len) {
+    if (h2->state == H2_STATE_DEAD) return -1;
+    if (st->id && !st->rsp_done && lb_h2_rsp_feed(h2, st, data, len) < 0) lb_h2_stream_fail(h2, st);
+    return lb_h2_flush(h2);
+}
+
+int lb_h2_response_end(lb_h2_t* h2, lb_h2_stream_t* st, bool error) {
+    if (h2->state == H2_STATE_DEAD) return -1;
+    if (st->id && !st->rsp_done) {
+        if (!error && st->rsp_state == H2_RSP_CLOSE) {
+            st->rsp_done = true;
+            lb_h2_release(h2, st, false);
+            lb_h2_stream_push(h2, st);
+        } else {
+            lb_h2_stream_fail(h2, st);
+        }
+    }
+    return lb_h2_flush(h2);
+}
+
+int lb_h2_drained(lb_h2_t* h2, lb_h2_stream_t* st) {
+    if (h2->state == H2_STATE_DEAD) return -1;
+    if (st->id && st->window_held) {
+        st->window_held = false;
+        if (st->recv_unacked > 0 && !st->end_remote) lb_h2_window_update(h2, st->id, st->recv_unacked);
+        st->recv_unacked = 0;
+    }
+    return lb_h2_flush(h2);
+}
@@ -0,0 +1,362 @@
+#include "core/lb_hpack.h"
+#include <string.h>
+
+#define HPACK_ENTRY_OVERHEAD 32
+
+static const struct {
+    const char* name;
+    const char* value;
+} hpack_static[] = {
+    {NULL, NULL},
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+#define HPACK_STATIC_COUNT 61
+
+// The HPACK Huffman code is canonical, so symbols sorted by code length
+// (then value) and the number of codes of each length describe it fully
+static const uint8_t hpack_huff_count[31] = {
+    0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+    0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4
+};
+
+static const uint16_t hpack_huff_syms[257] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51,
+    52, 53, 54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109,
+    110, 112, 114, 117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+    77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89, 106, 107, 113, 118,
+    119, 120, 121, 122, 38, 42, 44, 59, 88, 90, 33, 34, 40, 41, 63, 39,
+    43, 124, 35, 62, 0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+    195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172, 176, 177,
+    179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154, 156, 160,
+    163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+    233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150, 151, 152, 155, 157,
+    158, 165, 166, 168, 174, 175, 180, 182, 183, 188, 191, 197, 231, 239, 9, 142,
+    144, 145, 148, 159, 171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+    200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211,
+    212, 214, 221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254,
+    2, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+    21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220, 249, 10, 13, 22,
+    256,
+};
+
+#define HPACK_HUFF_EOS 256
+
+void lb_hpack_init(lb_hpack_t* hp) {
+    memset(hp, 0, sizeof(*hp));
+    hp->max_size = LB_HPACK_TABLE_SIZE;
+}
+
+static void lb_hpack_evict(lb_hpack_t* hp) {
+    lb_hpack_entry_t* e = &hp->ent[0];
+    uint32_t n = e->name_len + e->value_len;
+
+    hp->size -= n + HPACK_ENTRY_OVERHEAD;
+    hp->used -= n;
+    hp->count--;
+    memmove(hp->data, hp->data + n, hp->used);
+    memmove(hp->ent, hp->ent + 1, hp->count * sizeof(hp->ent[0]));
+    for (uint32_t i = 0; i < hp->count; i++) hp->ent[i].off -= n;
+}
+
+static void lb_hpack_insert(lb_hpack_t* hp, const char* name, size_t name_len,
+                            const char* value, size_t value_len) {
+    size_t need = name_len + value_len + HPACK_ENTRY_OVERHEAD;
+
+    while (hp->count > 0 && hp->size + need > hp->max_size) lb_hpack_evict(hp);
+    // An entry larger than the table empties it and is not added
+    if (need > hp->max_size) return;
+
+    lb_hpack_entry_t* e = &hp->ent[hp->count++];
+    e->off = hp->used;
+    e->name_len = name_len;
+    e->value_len = value_len;
+    memcpy(hp->data + hp->used, name, name_len);
+    memcpy(hp->data + hp->used + name_len, value, value_len);
+    hp->used += name_len + value_len;
+    hp->size += need;
+}
+
+// Resolve a 1-based index into the static then the dynamic table
+static int lb_hpack_lookup(const lb_hpack_t* hp, uint64_t index, const char** name, size_t* name_len,
+                           const char** value, size_t* value_len) {
+    if (index == 0) return -1;
+    if (index <= HPACK_STATIC_COUNT) {
+        *name = hpack_static[index].name;
+        *name_len = strlen(*name);
+        *value = hpack_static[index].value;
+        *value_len = strlen(*value);
+        return 0;
+    }
+
+    index -= HPACK_STATIC_COUNT;
+    if (index > hp->count) return -1;
+    const lb_hpack_entry_t* e = &hp->ent[hp->count - index];  // 1 is the newest
+    *name = hp->data + e->off;
+    *name_len = e->name_len;
+    *value = hp->data + e->off + e->name_len;
+    *value_len = e->value_len;
+    return 0;
+}
+
+static int lb_hpack_int(const uint8_t** p, const uint8_t* end, int prefix, uint64_t* out) {
+    if (*p >= end) return -1;
+
+    uint64_t mask = (1u << prefix) - 1;
+    uint64_t v = **p & mask;
+    (*p)++;
+    if (v < mask) {
+        *out = v;
+        return 0;
+    }
+
+    for (int shift = 0; shift <= 28; shift += 7) {
+        if (*p >= end) return -1;
+        uint8_t b = *(*p)++;
+        v += (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *out = v;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Canonical Huffman decode, one bit at a time. At most 7 bits of padding,
+// all ones (a prefix of EOS), may follow the last symbol.
+static ssize_t lb_hpack_huff_decode(const uint8_t* in, size_t len, char* out, size_t room) {
+    size_t n = 0;
+    uint32_t code = 0, first = 0, index = 0, bits = 0;
+    bool ones = true;
+
+    for (size_t i = 0; i < len; i++) {
+        for (int b = 7; b >= 0; b--) {
+            uint32_t bit = (in[i] >> b) & 1;
+            code |= bit;
+            ones = ones && bit;
+            bits++;
+            if (bits > 30) return -1;
+
+            uint32_t count = hpack_huff_count[bits];
+            if (code - first < count) {
+                uint16_t sym = hpack_huff_syms[index + code - first];
+                if (sym == HPACK_HUFF_EOS || n >= room) return -1;
+                out[n++] = (char)sym;
+                code = first = index = bits = 0;
+                ones = true;
+                continue;
+            }
+            index += count;
+            first = (first + count) << 1;
+            code <<= 1;
+        }
+    }
+
+    if (bits > 7 || !ones) return -1;
+    return (ssize_t)n;
+}
+
+static int lb_hpack_string(const uint8_t** p, const uint8_t* end, char* buf, size_t room,
+                           const char** str, size_t* str_len) {
+    if (*p >= end) return -1;
+
+    bool huffman = **p & 0x80;
+    uint64_t len;
+    if (lb_hpack_int(p, end, 7, &len) < 0 || len > (uint64_t)(end - *p)) return -1;
+
+    if (huffman) {
+        ssize_t n = lb_hpack_huff_decode(*p, len, buf, room);
+        if (n < 0) return -1;
+        *str = buf;
+        *str_len = n;
+    } else {
+        if (len > room) return -1;
+        *str = (const char*)*p;
+        *str_len = len;
+    }
+    *p += len;
+    return 0;
+}
+
+int lb_hpack_decode(lb_hpack_t* hp, const uint8_t* in, size_t len, lb_hpack_emit_fn emit, void* arg) {
+    const uint8_t* p = in;
+    const uint8_t* end = in + len;
+    char name_buf[LB_HPACK_STRING_MAX];
+    char value_buf[LB_HPACK_STRING_MAX];
+
+    while (p < end) {
+        const char *name, *value;
+        size_t name_len, value_len;
+        uint64_t index;
+        uint8_t b = *p;
+        bool add = false;
+
+        if (b & 0x80) {
+            // Indexed field
+            if (lb_hpack_int(&p, end, 7, &index) < 0 ||
+                lb_hpack_lookup(hp, index, &name, &name_len, &value, &value_len) < 0) {
+                return -1;
+            }
+        } else if ((b & 0xe0) == 0x20) {
+            // Dynamic table size update
+            if (lb_hpack_int(&p, end, 5, &index) < 0 || index > LB_HPACK_TABLE_SIZE) return -1;
+            hp->max_size = (uint32_t)index;
+            while (hp->count > 0 && hp->size > hp->max_size) lb_hpack_evict(hp);
+            continue;
+        } else {
+            // Literal: with incremental indexing (01), without (0000) or never (0001)
+            add = (b & 0xc0) == 0x40;
+            if (lb_hpack_int(&p, end, add ? 6 : 4, &index) < 0) return -1;
+
+            if (index > 0) {
+                const char* unused;
+                size_t unused_len;
+                if (lb_hpack_lookup(hp, index, &name, &name_len, &unused, &unused_len) < 0) return -1;
+                // The name may live in the dynamic table, which inserting can shift
+                if (add) {
+                    if (name_len > sizeof(name_buf)) return -1;
+                    memcpy(name_buf, name, name_len);
+                    name = name_buf;
+                }
+            } else if (lb_hpack_string(&p, end, name_buf, sizeof(name_buf), &name, &name_len) < 0) {
+                return -1;
+            }
+            if (lb_hpack_string(&p, end, value_buf, sizeof(value_buf), &value, &value_len) < 0) {
+                return -1;
+            }
+        }
+
+        int ret = emit(arg, name, name_len, value, value_len);
+        if (add) lb_hpack_insert(hp, name, name_len, value, value_len);
+        if (ret != 0) return ret;
+    }
+    return 0;
+}
+
+static ssize_t lb_hpack_put_int(uint8_t* out, size_t room, int prefix, uint8_t flags, uint64_t v) {
+    uint64_t mask = (1u << prefix) - 1;
+    size_t n = 0;
+
+    if (room == 0) return -1;
+    if (v < mask) {
+        out[n++] = flags | (uint8_t)v;
+        return (ssize_t)n;
+    }
+    out[n++] = flags | (uint8_t)mask;
+    v -= mask;
+    while (v >= 0x80) {
+        if (n >= room) return -1;
+        out[n++] = (uint8_t)(v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    if (n >= room) return -1;
+    out[n++] = (uint8_t)v;
+    return (ssize_t)n;
+}
+
+static ssize_t lb_hpack_put_string(uint8_t* out, size_t room, const char* s, size_t len) {
+    ssize_t n = lb_hpack_put_int(out, room, 7, 0x00, len);
+    if (n < 0 || (size_t)n + len > room) return -1;
+    memcpy(out + n, s, len);
+    return n + (ssize_t)len;
+}
+
+ssize_t lb_hpack_encode(uint8_t* out, size_t room, const char* name, size_t name_len,
+                        const char* value, size_t value_len) {
+    ssize_t n, total;
+    int index = 0;
+
+    // A static name index saves spelling the name out
+    for (int i = 1; i <= HPACK_STATIC_COUNT; i++) {
+        if (strlen(hpack_static[i].name) == name_len &&
+            memcmp(hpack_static[i].name, name, name_len) == 0) {
+            index = i;
+            break;
+        }
+    }
+
+    // Literal header field without indexing (0000 prefix)
+    if ((total = lb_hpack_put_int(out, room, 4, 0x00, index)) < 0) return -1;
+    if (index == 0) {
+        if ((n = lb_hpack_put_string(out + total, room - total, name, name_len)) < 0) return -1;
+        total += n;
+    }
+    if ((n = lb_hpack_put_string(out + total, room - total, value, value_len)) < 0) return -1;
+    return total + n;
+}
+
+ssize_t lb_hpack_encode_status(uint8_t* out, size_t room, int status) {
+    // Indexed when the static table has the code
+    for (int i = 8; i <= 14; i++) {
+        if (status == (hpack_static[i].value[0] - '0') * 100 +
+                      (hpack_static[i].value[1] - '0') * 10 + (hpack_static[i].value[2] - '0')) {
+            return lb_hpack_put_int(out, room, 7, 0x80, i);
+        }
+    }
+
+    char value[4];
+    value[0] = '0' + (status / 100) % 10;
+    value[1] = '0' + (status / 10) % 10;
+    value[2] = '0' + status % 10;
+    return lb_hpack_encode(out, room, ":status", 7, value, 3);
+}
@@ -0,0 +1,297 @@
+#include "core/lb_http1.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+enum {
+    H1_START_LINE,
+    H1_HDR_NAME,
+    H1_HDR_VALUE,
+    H1_BODY,
+    H1_CHUNK_SIZE,
+    H1_CHUNK_EXT,
+    H1_CHUNK_DATA,
+    H1_CHUNK_CRLF,
+    H1_TRAILER,
+    H1_DEAD
+};
+
+enum {
+    H1_HDR_OTHER,
+    H1_HDR_CONTENT_LENGTH,
+    H1_HDR_TRANSFER_ENCODING,
+    H1_HDR_CONNECTION,
+    H1_HDR_UPGRADE
+};
+
+void lb_http1_init(lb_http1_t* h, bool response) {
+    memset(h, 0, sizeof(*h));
+    h->response = response;
+    h->state = H1_START_LINE;
+}
+
+bool lb_http1_idle(const lb_http1_t* h) {
+    return h->state == H1_START_LINE && h->len == 0 && !h->noreuse;
+}
+
+static int lb_http1_dead(lb_http1_t* h) {
+    h->state = H1_DEAD;
+    h->noreuse = true;
+    return -1;
+}
+
+static inline void lb_http1_push(lb_http1_t* h, char c) {
+    if (h->len < sizeof(h->line) - 1) h->line[h->len++] = c;
+}
+
+// NUL-terminate line, dropping trailing CR and blanks
+static void lb_http1_terminate(lb_http1_t* h) {
+    while (h->len > 0 && (h->line[h->len - 1] == '\r' || h->line[h->len - 1] == ' ' ||
+                          h->line[h->len - 1] == '\t')) {
+        h->len--;
+    }
+    h->line[h->len] = '\0';
+}
+
+static void lb_http1_complete(lb_http1_t* h) {
+    h->messages++;
+    h->state = H1_START_LINE;
+    h->chunked = false;
+    h->has_te = false;
+    h->has_length = false;
+    h->remaining = 0;
+    h->len = 0;
+}
+
+static int lb_http1_start_line(lb_http1_t* h) {
+    lb_http1_terminate(h);
+
+    if (h->response) {
+        if (strncmp(h->line, "HTTP/1.", 7) != 0 || h->line[8] != ' ') return -1;
+        h->keepalive = (h->line[7] == '1');
+        h->status = (uint16_t)atoi(h->line + 9);
+        // Switching protocols: whatever follows is not HTTP/1
+        if (h->status < 100 || h->status == 101) return -1;
+        return 0;
+    }
+
+    // A HEAD or CONNECT response cannot be framed without its request, so
+    // such connections are never pooled
+    if (strncmp(h->line, "HEAD ", 5) == 0 || strncmp(h->line, "CONNECT ", 8) == 0) return -1;
+    size_t n = strlen(h->line);
+    h->keepalive = !(n >= 8 && strcmp(h->line + n - 8, "HTTP/1.0") == 0);
+    return 0;
+}
+
+// Whether the last coding in a Transfer-Encoding list is chunked. Codings
+// on later lines follow those on earlier ones, so each line decides anew.
+static bool lb_http1_last_chunked(const char* value) {
+    const char* last = strrchr(value, ',');
+    last = last ? last + 1 : value;
+    while (*last == ' ' || *last == '\t') last++;
+    return strcasecmp(last, "chunked") == 0;
+}
+
+static int lb_http1_header(lb_http1_t* h) {
+    // A value cut at the end of line cannot be judged
+    bool truncated = h->len == sizeof(h->line) - 1;
+    lb_http1_terminate(h);
+
+    switch (h->header) {
+        case H1_HDR_CONTENT_LENGTH: {
+            char* end;
+            // A second Content-Length, even an equal one, is not worth
+            // trusting on a connection shared with other clients
+            if (h->has_length || truncated) return -1;
+            if (h->len == 0 || h->line[0] < '0' || h->line[0] > '9') return -1;
+            unsigned long long v = strtoull(h->line, &end, 10);
+            if (*end != '\0') return -1;
+            h->has_length = true;
+            h->remaining = v;
+            break;
+        }
+        case H1_HDR_TRANSFER_ENCODING:
+            if (truncated) return -1;
+            h->has_te = true;
+            h->chunked = lb_http1_last_chunked(h->line);
+            break;
+        case H1_HDR_CONNECTION:
+            if (strcasestr(h->line, "close")) h->keepalive = false;
+            else if (strcasestr(h->line, "keep-alive")) h->keepalive = true;
+            if (h->keepalive == false && !h->response) h->noreuse = true;
+            break;
+        case H1_HDR_UPGRADE:
+            if (!h->response) return -1;
+            break;
+        default:
+            break;
+    }
+    return 0;
+}
+
+static uint8_t lb_http1_header_id(const lb_http1_t* h) {
+    if (h->len == 14 && strncasecmp(h->line, "content-length", 14) == 0) return H1_HDR_CONTENT_LENGTH;
+    if (h->len == 17 && strncasecmp(h->line, "transfer-encoding", 17) == 0) return H1_HDR_TRANSFER_ENCODING;
+    if (h->len == 10 && strncasecmp(h->line, "connection", 10) == 0) return H1_HDR_CONNECTION;
+    if (h->len == 7 && strncasecmp(h->line, "upgrade", 7) == 0) return H1_HDR_UPGRADE;
+    return H1_HDR_OTHER;
+}
+
+// Header block finished: work out how the body is delimited
+static int lb_http1_headers_done(lb_http1_t* h) {
+    h->len = 0;
+
+    if (h->response) {
+        if (h->status < 200) {
+            // Interim (1xx) response; the final one follows
+            h->state = H1_START_LINE;
+            h->chunked = false;
+            h->has_te = false;
+            h->has_length = false;
+            return 0;
+        }
+        if (h->status == 204 || h->status == 304) {
+            lb_http1_complete(h);
+            return 0;
+        }
+    }
+
+    // Both framings, or codings not ending in chunked, leave the end of the
+    // body to the peer's reading of the message (RFC 9112 6.1, 6.3)
+    if (h->has_te && (h->has_length || !h->chunked)) return -1;
+
+    if (h->chunked) {
+        h->remaining = 0;
+        h->state = H1_CHUNK_SIZE;
+    } else if (h->has_length) {
+        if (h->remaining == 0) lb_http1_complete(h);
+        else h->state = H1_BODY;
+    } else if (h->response) {
+        return -1;  // delimited by close
+    } else {
+        lb_http1_complete(h);
+    }
+    return 0;
+}
+
+static int lb_http1_chunk_size_done(lb_http1_t* h) {
+    if (h->len == 0) return -1;  // no hex digits
+    h->len = 0;
+    h->state = h->remaining == 0 ? H1_TRAILER : H1_CHUNK_DATA;
+    return 0;
+}
+
+// Frame data, stopping right after the first message that completes when
+// one_message is set. Returns the bytes consumed, -1 once framing is lost.
+static ssize_t lb_http1_run(lb_http1_t* h, const uint8_t* data, size_t len, bool one_message) {
+    uint32_t start = h->messages;
+    size_t i = 0;
+
+    while (i < len) {
+        if (h->state == H1_DEAD) return -1;
+        if (one_message && h->messages != start) break;
+
+        if (h->state == H1_BODY || h->state == H1_CHUNK_DATA) {
+            size_t n = len - i;
+            if (n > h->remaining) n = h->remaining;
+            h->remaining -= n;
+            i += n;
+            if (h->remaining == 0) {
+                if (h->state == H1_BODY) lb_http1_complete(h);
+                else h->state = H1_CHUNK_CRLF;
+            }
+            continue;
+        }
+
+        char c = (char)data[i++];
+        switch (h->state) {
+            case H1_START_LINE:
+                if (c == '\n') {
+                    if (h->len == 0) break;  // stray CRLF between messages
+                    if (lb_http1_start_line(h) < 0) return lb_http1_dead(h);
+                    h->len = 0;
+                    h->state = H1_HDR_NAME;
+                } else if (c != '\r' || h->len > 0) {
+                    lb_http1_push(h, c);
+                }
+                break;
+
+            case H1_HDR_NAME:
+                if (c == '\n') {
+                    if (h->len == 0) {
+                        if (lb_http1_headers_done(h) < 0) return lb_http1_dead(h);
+                    }
+                    h->len = 0;  // line without a colon: ignored
+                } else if (c == ':') {
+                    h->header = lb_http1_header_id(h);
+                    h->len = 0;
+                    h->state = H1_HDR_VALUE;
+                } else if (c != '\r') {
+                    lb_http1_push(h, c);
+                }
+                break;
+
+            case H1_HDR_VALUE:
+                if (c == '\n') {
+                    if (lb_http1_header(h) < 0) return lb_http1_dead(h);
+                    h->len = 0;
+                    h->state = H1_HDR_NAME;
+                } else if (h->len > 0 || (c != ' ' && c != '\t')) {
+                    lb_http1_push(h, c);
+                }
+                break;
+
+            case H1_CHUNK_SIZE: {
+                int d = -1;
+                if (c >= '0' && c <= '9') d = c - '0';
+                else if (c >= 'a' && c <= 'f') d = c - 'a' + 10;
+                else if (c >= 'A' && c <= 'F') d = c - 'A' + 10;
+
+                if (d >= 0) {
+                    if (h->remaining >> 56) return lb_http1_dead(h);
+                    h->remaining = h->remaining * 16 + d;
+                    h->len = 1;
+                } else if (c == ';' || c == ' ' || c == '\t') {
+                    h->state = H1_CHUNK_EXT;
+                } else if (c == '\n') {
+                    if (lb_http1_chunk_size_done(h) < 0) return lb_http1_dead(h);
+                } else if (c != '\r') {
+                    return lb_http1_dead(h);
+                }
+                break;
+            }
+
+            case H1_CHUNK_EXT:
+                if (c == '\n' && lb_http1_chunk_size_done(h) < 0) return lb_http1_dead(h);
+                break;
+
+            case H1_CHUNK_CRLF:
+                if (c == '\n') {
+                    h->remaining = 0;
+                    h->len = 0;
+                    h->state = H1_CHUNK_SIZE;
+                } else if (c != '\r') {
+                    return lb_http1_dead(h);
+                }
+                break;
+
+            case H1_TRAILER:
+                if (c == '\n') {
+                    if (h->len == 0) lb_http1_complete(h);
+                    else h->len = 0;
+                } else if (c != '\r') {
+                    h->len = 1;
+                }
+                break;
+        }
+    }
+    return (ssize_t)i;
+}
+
+int lb_http1_feed(lb_http1_t* h, const uint8_t* data, size_t len) {
+    return lb_http1_run(h, data, len, false) < 0 ? -1 : 0;
+}
+
+ssize_t lb_http1_feed_message(lb_http1_t* h, const uint8_t* data, size_t len) {
+    return lb_http1_run(h, data, len, true);
+}
@@ -1,4 +1,8 @@
 #include "core/loadbalancer.h"
+#include "core/lb_h2.h"
+#include "utils/log.h"
+#include "stats/lb_stats.h"
+#include "utils/usdt.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,6 +10,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/sendfile.h>
@@ -14,172 +19,350 @@
 #include <netdb.h>
 
 #define MAX_SPLICE_SIZE (64 * 1024)
+#define ACCEPT_BATCH 64
+// Relay read size and the size of one pooled write-queue segment
+#define IO_BUFFER_SIZE 16384
+#define WQ_SEG_CAPACITY (IO_BUFFER_SIZE - sizeof(lb_wseg_t))
+#define WQ_IOV_MAX 32
+
+// Worker running on this thread; decides local vs remote slab frees
+static _Thread_local lb_worker_t* lb_net_self = NULL;
+
+static void lb_net_conn_free(loadbalancer_t* lb, lb_connection_t* conn);
+
+// Relayed bytes, charged to the calling worker's counter block
+static inline void lb_net_count_backend_bytes(const backend_t* backend, bool to_backend, uint64_t n) {
+    lb_worker_stats_t* st = lb_net_self->stats;
+    if (to_backend) {
+        lb_stat_add(&st->bytes_in, n);
+        if (backend) lb_stat_add(&st->backends[backend->id].bytes_in, n);
+    } else {
+        lb_stat_add(&st->bytes_out, n);
+        if (backend) lb_stat_add(&st->backends[backend->id].bytes_out, n);
+    }
+}
 
-// Thread-safe enqueue connection to cleanup queue
-static bool cleanup_queue_enqueue(cleanup_queue_t* queue, lb_connection_t* conn) {
-    if (!queue || !conn) return false;
-
-    pthread_mutex_lock(&queue->lock);
+static inline void lb_net_count_bytes(const lb_connection_t* conn, bool to_backend, uint64_t n) {
+    lb_net_count_backend_bytes(conn->backend, to_backend, n);
+}
 
-    uint32_t tail = atomic_load(&queue->tail);
-    uint32_t next_tail = (tail + 1) % CLEANUP_QUEUE_SIZE;
-    uint32_t head = atomic_load(&queue->head);
+int lb_net_set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
 
-    // Check if queue is full
-    if (next_tail == head) {
-        pthread_mutex_unlock(&queue->lock);
-        fprintf(stderr, "[WARN] Cleanup queue full, immediate free\n");
-        return false;
-    }
+#define PRECONNECT_INTERVAL_MS 100
 
-    queue->queue[tail] = conn;
-    atomic_store(&queue->tail, next_tail);
+static int lb_net_connect_to_backend(loadbalancer_t* lb, backend_t* backend, bool fastopen) {
+    lb_sockaddr_t addr;
+    socklen_t addr_len;
+    if (lb_net_resolve_backend(backend, &addr, &addr_len) < 0) return -1;
 
-    pthread_mutex_unlock(&queue->lock);
-    return true;
-}
+    int sockfd = socket(addr.sa.sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sockfd < 0) return -1;
 
-// Thread-safe dequeue connection from cleanup queue
-static lb_connection_t* cleanup_queue_dequeue(cleanup_queue_t* queue) {
-    if (!queue) return NULL;
+    int val = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
 
-    pthread_mutex_lock(&queue->lock);
+    const lb_sockaddr_t* src = &lb->config.backend_source;
+    if (src->sa.sa_family == addr.sa.sa_family) {
+        // Leave the port to connect(), which only needs it unique per
+        // destination, instead of reserving one outright at bind()
+        setsockopt(sockfd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &val, sizeof(val));
+        socklen_t src_len = src->sa.sa_family == AF_INET6 ? sizeof(src->in6) : sizeof(src->in);
+        if (bind(sockfd, &src->sa, src_len) < 0) {
+            LB_ERROR_RATELIMIT(5, 1000, "bind to backend source address: %s", strerror(errno));
+            close(sockfd);
+            return -1;
+        }
+    }
 
-    uint32_t head = atomic_load(&queue->head);
-    uint32_t tail = atomic_load(&queue->tail);
+    // connect() then returns at once and the SYN leaves with the first
+    // send(), carrying its bytes once the kernel holds a cookie for the
+    // backend; older kernels just do a normal handshake
+    if (fastopen) setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &val, sizeof(val));
 
-    // Check if queue is empty
-    if (head == tail) {
-        pthread_mutex_unlock(&queue->lock);
-        return NULL;
+    if (connect(sockfd, &addr.sa, addr_len) < 0) {
+        if (errno != EINPROGRESS) {
+            close(sockfd);
+            return -1;
+        }
     }
 
-    lb_connection_t* conn = queue->queue[head];
-    atomic_store(&queue->head, (head + 1) % CLEANUP_QUEUE_SIZE);
+    return sockfd;
+}
 
-    pthread_mutex_unlock(&queue->lock);
-    return conn;
+// Take a pooled connection to backend, dropping any the backend has closed
+// (or written to) while it sat idle. Without fresh_only, sockets left
+// between two HTTP messages qualify too. A preconnected socket may still be
+// handshaking: *connecting, when given, tells so the caller can time it.
+static int lb_net_idle_get(lb_worker_t* worker, backend_t* backend, bool fresh_only,
+                           bool* connecting) {
+    for (uint32_t i = worker->idle_count; i-- > 0;) {
+        if (worker->idle[i].backend != backend || (fresh_only && !worker->idle[i].fresh)) continue;
+
+        int fd = worker->idle[i].fd;
+        bool fresh = worker->idle[i].fresh;
+        worker->idle[i] = worker->idle[--worker->idle_count];
+
+        // A failed connect reads as its error here
+        char probe;
+        ssize_t n = recv(fd, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (connecting) {
+                struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+                *connecting = fresh && poll(&pfd, 1, 0) == 0;
+            }
+            return fd;
+        }
+        close(fd);
+    }
+    return -1;
 }
 
-// Process cleanup queue - drain and free all pending connections
-static void process_cleanup_queue(loadbalancer_t* lb) {
-    if (!lb || !lb->cleanup_queue) return;
+static bool lb_net_idle_put(lb_worker_t* worker, backend_t* backend, int fd, bool fresh) {
+    if (worker->idle_count >= UPSTREAM_IDLE_MAX) return false;
+    // Nothing is kept for a backend out of rotation, a draining one above all
+    if (atomic_load_explicit(&backend->state, memory_order_relaxed) != BACKEND_UP) return false;
+    worker->idle[worker->idle_count++] = (lb_idle_conn_t){
+        .fd = fd,
+        .backend = backend,
+        .since_ns = get_time_ns(),
+        .fresh = fresh
+    };
+    return true;
+}
 
-    lb_connection_t* conn;
-    int count = 0;
-    while ((conn = cleanup_queue_dequeue(lb->cleanup_queue)) != NULL) {
-        // Free all connection resources with NULL checks to prevent double-free
-        if (conn->read_buffer) {
-            free(conn->read_buffer);
-            conn->read_buffer = NULL;
-        }
-        if (conn->write_buffer) {
-            free(conn->write_buffer);
-            conn->write_buffer = NULL;
+// Top up this worker's pool with backend_preconnect sockets per healthy
+// backend, so a new client is paired with a handshake already under way or
+// done. Dead ones are weeded out when taken or when they expire.
+static void lb_net_preconnect(loadbalancer_t* lb, lb_worker_t* worker) {
+    uint32_t want = lb->config.backend_preconnect;
+    if (want == 0 || worker->now_ms < worker->preconnect_next_ms) return;
+    worker->preconnect_next_ms = worker->now_ms + PRECONNECT_INTERVAL_MS;
+
+    for (uint32_t b = 0; b < lb->backend_count; b++) {
+        backend_t* backend = lb->backends[b];
+        if (!backend || atomic_load(&backend->state) != BACKEND_UP) continue;
+
+        uint32_t have = 0;
+        for (uint32_t i = 0; i < worker->idle_count; i++) {
+            if (worker->idle[i].backend == backend && worker->idle[i].fresh) have++;
         }
-        if (conn->to_backend_buffer) {
-            free(conn->to_backend_buffer);
-            conn->to_backend_buffer = NULL;
+        for (; have < want && worker->idle_count < UPSTREAM_IDLE_MAX; have++) {
+            int fd = lb_net_connect_to_backend(lb, backend, false);
+            if (fd < 0) break;
+            lb_net_idle_put(worker, backend, fd, true);
         }
-        if (conn->to_client_buffer) {
-            free(conn->to_client_buffer);
-            conn->to_client_buffer = NULL;
+    }
+}
+
+// Close pooled connections idle for longer than the upstream idle timeout,
+// before the backend's own keep-alive timer can race a reuse, and those to
+// backends that left rotation (drained ones right away)
+static void lb_net_idle_expire(loadbalancer_t* lb, lb_worker_t* worker) {
+    if (worker->idle_count == 0) return;
+
+    uint64_t cutoff = get_time_ns() - (uint64_t)lb->config.upstream_idle_timeout_ms * 1000000ULL;
+    for (uint32_t i = worker->idle_count; i-- > 0;) {
+        backend_t* backend = worker->idle[i].backend;
+        if (worker->idle[i].since_ns < cutoff ||
+            atomic_load_explicit(&backend->state, memory_order_relaxed) != BACKEND_UP) {
+            close(worker->idle[i].fd);
+            worker->idle[i] = worker->idle[--worker->idle_count];
         }
-        // Free wrappers - safe since FDs are closed and EPOLL_CTL_DEL done
-        if (conn->client_wrapper) {
-            free(conn->client_wrapper);
-            conn->client_wrapper = NULL;
+    }
+}
+
+void lb_net_worker_close_idle(lb_worker_t* worker) {
+    while (worker->idle_count > 0) {
+        close(worker->idle[--worker->idle_count].fd);
+    }
+}
+
+// Every framed request sent has been answered by a complete response
+static bool lb_net_exchange_done(const lb_connection_t* conn) {
+    return conn->http_framed && conn->backend && conn->to_backend.bytes == 0 &&
+           lb_http1_idle(&conn->req_framer) && lb_http1_idle(&conn->rsp_framer) &&
+           conn->rsp_framer.messages > 0 &&
+           conn->req_framer.messages == conn->rsp_framer.messages;
+}
+
+// The backend fd can serve another client only between two messages, when
+// the last response allows keep-alive
+static bool lb_net_backend_reusable(const lb_connection_t* conn) {
+    return conn->http_keepalive && !conn->backend_eof && lb_net_exchange_done(conn) &&
+           conn->rsp_framer.keepalive;
+}
+
+static void lb_net_conn_close_pipes(lb_connection_t* conn) {
+    for (int i = 0; i < 2; i++) {
+        if (conn->c2b_pipe[i] >= 0) {
+            close(conn->c2b_pipe[i]);
+            conn->c2b_pipe[i] = -1;
         }
-        if (conn->backend_wrapper) {
-            free(conn->backend_wrapper);
-            conn->backend_wrapper = NULL;
+        if (conn->b2c_pipe[i] >= 0) {
+            close(conn->b2c_pipe[i]);
+            conn->b2c_pipe[i] = -1;
         }
-        free(conn);
-        count++;
     }
+    conn->c2b_pending = 0;
+    conn->b2c_pending = 0;
+}
 
-    if (count > 0) {
-        fprintf(stderr, "[DEBUG] Cleaned up %d deferred connections\n", count);
+// Pending relay data is queued in IO_BUFFER_SIZE segments carved from the
+// running worker's arena, on its node, then from the shared lb->memory_pool;
+// attached only while a peer is not keeping up
+static lb_wseg_t* lb_net_wseg_alloc(loadbalancer_t* lb) {
+    memory_pool_t* arena = lb_net_self ? lb_net_self->arena : NULL;
+    memory_pool_t* pool = (memory_pool_t*)lb->memory_pool;
+    lb_wseg_t* seg = arena ? (lb_wseg_t*)memory_pool_alloc(arena, IO_BUFFER_SIZE) : NULL;
+    if (!seg && pool) seg = (lb_wseg_t*)memory_pool_alloc(pool, IO_BUFFER_SIZE);
+    if (!seg) seg = (lb_wseg_t*)malloc(IO_BUFFER_SIZE);  // arenas exhausted
+    if (seg) {
+        seg->next = NULL;
+        seg->start = 0;
+        seg->end = 0;
     }
+    return seg;
 }
 
-int lb_net_set_nonblocking(int fd) {
-    int flags = fcntl(fd, F_GETFL, 0);
-    if (flags < 0) return -1;
-    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+static memory_pool_t* lb_net_wseg_pool(loadbalancer_t* lb, lb_wseg_t* seg) {
+    if (lb_net_self && lb_net_self->arena && memory_pool_owns(lb_net_self->arena, seg)) {
+        return lb_net_self->arena;
+    }
+    // In shared mode another worker may have queued it; at teardown, any
+    for (uint32_t i = 0; lb->worker_ctx && i < lb->worker_threads; i++) {
+        memory_pool_t* arena = lb->worker_ctx[i].arena;
+        if (arena && memory_pool_owns(arena, seg)) return arena;
+    }
+    memory_pool_t* pool = (memory_pool_t*)lb->memory_pool;
+    return pool && memory_pool_owns(pool, seg) ? pool : NULL;
 }
 
-static int lb_net_connect_to_backend(backend_t* backend) {
-    int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
-    if (sockfd < 0) return -1;
+static void lb_net_wseg_free(loadbalancer_t* lb, lb_wseg_t* seg) {
+    memory_pool_t* pool = lb_net_wseg_pool(lb, seg);
+    if (pool) {
+        memory_pool_free(pool, seg, IO_BUFFER_SIZE);
+    } else {
+        free(seg);
+    }
+}
 
-    int val = 1;
-    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+// Tail segment with free space, chaining a new one when the tail is full
+static lb_wseg_t* lb_net_wq_tail(loadbalancer_t* lb, lb_wqueue_t* q) {
+    if (q->tail && q->tail->end < WQ_SEG_CAPACITY) return q->tail;
 
-    struct sockaddr_in addr = {
-        .sin_family = AF_INET,
-        .sin_port = htons(backend->port),
-    };
+    lb_wseg_t* seg = lb_net_wseg_alloc(lb);
+    if (!seg) return NULL;
+    if (q->tail) {
+        q->tail->next = seg;
+    } else {
+        q->head = seg;
+    }
+    q->tail = seg;
+    return seg;
+}
 
-    if (inet_pton(AF_INET, backend->host, &addr.sin_addr) <= 0) {
-        struct hostent* he = gethostbyname(backend->host);
-        if (!he) {
-            close(sockfd);
-            return -1;
-        }
-        memcpy(&addr.sin_addr, he->h_addr_list[0], he->h_length);
+static int lb_net_wq_append(loadbalancer_t* lb, lb_wqueue_t* q, const uint8_t* data, size_t len) {
+    while (len > 0) {
+        lb_wseg_t* seg = lb_net_wq_tail(lb, q);
+        if (!seg) return -1;
+        size_t n = WQ_SEG_CAPACITY - seg->end;
+        if (n > len) n = len;
+        memcpy(seg->data + seg->end, data, n);
+        seg->end += n;
+        q->bytes += n;
+        data += n;
+        len -= n;
     }
+    return 0;
+}
 
-    if (connect(sockfd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        if (errno != EINPROGRESS) {
-            close(sockfd);
-            return -1;
+static void lb_net_wq_consume(loadbalancer_t* lb, lb_wqueue_t* q, size_t n) {
+    q->bytes -= n;
+    while (n > 0 && q->head) {
+        lb_wseg_t* seg = q->head;
+        size_t avail = seg->end - seg->start;
+        if (n < avail) {
+            seg->start += n;
+            return;
         }
+        n -= avail;
+        q->head = seg->next;
+        if (!q->head) q->tail = NULL;
+        lb_net_wseg_free(lb, seg);
     }
-
-    return sockfd;
 }
 
-static lb_connection_t* lb_net_conn_create(loadbalancer_t* lb) {
-    // Use malloc for simplicity and reliability
-    lb_connection_t* conn = (lb_connection_t*)calloc(1, sizeof(lb_connection_t));
-    if (!conn) {
-        fprintf(stderr, "[ERROR] Failed to allocate connection struct\n");
-        return NULL;
+static void lb_net_wq_clear(loadbalancer_t* lb, lb_wqueue_t* q) {
+    while (q->head) {
+        lb_wseg_t* seg = q->head;
+        q->head = seg->next;
+        lb_net_wseg_free(lb, seg);
     }
+    q->tail = NULL;
+    q->bytes = 0;
+}
 
-    conn->read_buffer = (uint8_t*)malloc(BUFFER_SIZE);
-    conn->write_buffer = (uint8_t*)malloc(BUFFER_SIZE);
-    conn->client_wrapper = (epoll_data_wrapper_t*)malloc(sizeof(epoll_data_wrapper_t));
-    conn->backend_wrapper = (epoll_data_wrapper_t*)malloc(sizeof(epoll_data_wrapper_t));
+// Send as much of q as fd takes, up to WQ_IOV_MAX segments per sendmsg().
+// Returns the bytes sent (0 when the socket is full) or -1 on error.
+static ssize_t lb_net_wq_flush(loadbalancer_t* lb, lb_wqueue_t* q, int fd) {
+    ssize_t total = 0;
+
+    while (q->bytes > 0) {
+        struct iovec iov[WQ_IOV_MAX];
+        size_t want = 0;
+        int n = 0;
+        for (lb_wseg_t* seg = q->head; seg && n < WQ_IOV_MAX; seg = seg->next) {
+            iov[n].iov_base = seg->data + seg->start;
+            iov[n].iov_len = seg->end - seg->start;
+            want += iov[n].iov_len;
+            n++;
+        }
+
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = n };
+        ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+
+        lb_net_wq_consume(lb, q, sent);
+        total += sent;
+        if ((size_t)sent < want) break;  // socket buffer is full
+    }
+    return total;
+}
 
-    // Check all allocations succeeded
-    if (!conn->read_buffer || !conn->write_buffer || !conn->client_wrapper || !conn->backend_wrapper) {
-        fprintf(stderr, "[ERROR] Failed to allocate connection buffers\n");
-        free(conn->backend_wrapper);
-        free(conn->client_wrapper);
-        free(conn->write_buffer);
-        free(conn->read_buffer);
-        free(conn);
+static lb_connection_t* lb_net_conn_create(loadbalancer_t* lb, lb_worker_t* worker) {
+    lb_connection_t* conn = (lb_connection_t*)slab_alloc(worker->conn_slab);
+    if (!conn) {
+        LB_ERROR_RATELIMIT(5, 1000, "Failed to allocate connection struct");
         return NULL;
     }
+    memset(conn, 0, sizeof(*conn));
 
+    // Wrappers live inside the connection; I/O buffers are attached on demand
+    conn->worker = worker;
+    conn->client_wrapper = &conn->wrappers[0];
+    conn->backend_wrapper = &conn->wrappers[1];
     conn->client_fd = -1;
     conn->backend_fd = -1;
     conn->state = STATE_DISCONNECTED;
-    conn->to_backend_buffer = NULL;
-    conn->to_backend_size = 0;
-    conn->to_backend_capacity = 0;
-    conn->to_client_buffer = NULL;
-    conn->to_client_size = 0;
-    conn->to_client_capacity = 0;
-
-    memset(conn->client_wrapper, 0, sizeof(epoll_data_wrapper_t));
+    conn->use_splice = false;
+    conn->c2b_pipe[0] = conn->c2b_pipe[1] = -1;
+    conn->b2c_pipe[0] = conn->b2c_pipe[1] = -1;
+    conn->c2b_pending = 0;
+    conn->b2c_pending = 0;
+    conn->client_eof = false;
+    conn->backend_eof = false;
+
     conn->client_wrapper->type = SOCKET_TYPE_CLIENT;
     conn->client_wrapper->conn = conn;
     conn->client_wrapper->fd = -1;
 
-    memset(conn->backend_wrapper, 0, sizeof(epoll_data_wrapper_t));
     conn->backend_wrapper->type = SOCKET_TYPE_BACKEND;
     conn->backend_wrapper->conn = conn;
     conn->backend_wrapper->fd = -1;
@@ -191,177 +374,1085 @@ static void lb_net_conn_destroy(loadbalancer_t* lb, lb_connection_t* conn) {
     if (!conn) return;
 
     if (conn->client_fd >= 0) {
-        epoll_ctl(lb->epfd, EPOLL_CTL_DEL, conn->client_fd, NULL);
+        epoll_ctl(conn->worker->epfd, EPOLL_CTL_DEL, conn->client_fd, NULL);
         close(conn->client_fd);
         conn->client_fd = -1;
     }
     if (conn->backend_fd >= 0) {
-        epoll_ctl(lb->epfd, EPOLL_CTL_DEL, conn->backend_fd, NULL);
+        epoll_ctl(conn->worker->epfd, EPOLL_CTL_DEL, conn->backend_fd, NULL);
         close(conn->backend_fd);
         conn->backend_fd = -1;
     }
 
+    lb_net_conn_close_pipes(conn);
+
     if (conn->backend) {
-        atomic_fetch_sub(&conn->backend->active_conns, 1);
+        lb_backend_release(lb, conn->backend);
         conn->backend = NULL;
     }
 
-    // Free buffers and mark as NULL to prevent double-free
-    if (conn->read_buffer) {
-        free(conn->read_buffer);
-        conn->read_buffer = NULL;
+    lb_net_conn_free(lb, conn);
+}
+
+// Release pooled buffers and hand conn back to the slab of the worker that
+// accepted it; in shared-epoll mode a different worker may have closed it
+static void lb_net_conn_free(loadbalancer_t* lb, lb_connection_t* conn) {
+    lb_net_wq_clear(lb, &conn->to_backend);
+    lb_net_wq_clear(lb, &conn->to_client);
+    lb_net_wq_clear(lb, &conn->held);
+    lb_h2_destroy(conn->h2);
+    conn->h2 = NULL;
+
+    lb_worker_t* owner = conn->worker;
+    if (owner == lb_net_self) {
+        slab_free(owner->conn_slab, conn);
+    } else {
+        slab_free_remote(owner->conn_slab, conn);
     }
-    if (conn->write_buffer) {
-        free(conn->write_buffer);
-        conn->write_buffer = NULL;
+}
+
+/*
+ * Quiescent-state based reclamation for closed connections.
+ *
+ * In shared-epoll mode another worker may already have pulled an event for
+ * a connection out of epoll_wait() when it is closed; the memory has to
+ * stay valid until that worker finishes its batch. A worker holds no events
+ * between two batches, so it publishes lb->reclaim_epoch in
+ * quiescent_epoch there. Connections closed during a batch are tagged with
+ * a freshly bumped epoch and freed once every worker has published an
+ * epoch at least that large. A worker with a private epoll instance is the
+ * only one that can see its connections' events and frees them right away.
+ */
+static inline void lb_net_conn_lock(lb_connection_t* conn) {
+    while (atomic_exchange_explicit(&conn->busy, true, memory_order_acquire)) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
     }
-    if (conn->to_backend_buffer) {
-        free(conn->to_backend_buffer);
-        conn->to_backend_buffer = NULL;
+}
+
+static inline void lb_net_conn_unlock(lb_connection_t* conn) {
+    atomic_store_explicit(&conn->busy, false, memory_order_release);
+}
+
+static void lb_net_conn_retire(lb_worker_t* worker, lb_connection_t* conn) {
+    conn->next_retired = worker->retired;
+    worker->retired = conn;
+}
+
+static void lb_net_quiescent(loadbalancer_t* lb, lb_worker_t* worker) {
+    uint64_t epoch = atomic_load(&lb->reclaim_epoch);
+
+    if (worker->retired) {
+        epoch = atomic_fetch_add(&lb->reclaim_epoch, 1) + 1;
+        while (worker->retired) {
+            lb_connection_t* conn = worker->retired;
+            worker->retired = conn->next_retired;
+            conn->retire_epoch = epoch;
+            conn->next_retired = NULL;
+            if (worker->limbo_tail) {
+                worker->limbo_tail->next_retired = conn;
+            } else {
+                worker->limbo_head = conn;
+            }
+            worker->limbo_tail = conn;
+        }
     }
-    if (conn->to_client_buffer) {
-        free(conn->to_client_buffer);
-        conn->to_client_buffer = NULL;
+    atomic_store(&worker->quiescent_epoch, epoch);
+
+    if (!worker->limbo_head) return;
+
+    uint64_t safe = epoch;
+    if (!worker->owns_fds) {
+        for (uint32_t i = 0; i < lb->worker_threads; i++) {
+            uint64_t seen = atomic_load(&lb->worker_ctx[i].quiescent_epoch);
+            if (seen < safe) safe = seen;
+        }
     }
-    // Free wrappers - safe since FDs are closed and EPOLL_CTL_DEL done
-    if (conn->client_wrapper) {
-        free(conn->client_wrapper);
-        conn->client_wrapper = NULL;
+
+    while (worker->limbo_head && worker->limbo_head->retire_epoch <= safe) {
+        lb_connection_t* conn = worker->limbo_head;
+        worker->limbo_head = conn->next_retired;
+        lb_net_conn_free(lb, conn);
     }
-    if (conn->backend_wrapper) {
-        free(conn->backend_wrapper);
-        conn->backend_wrapper = NULL;
+    if (!worker->limbo_head) worker->limbo_tail = NULL;
+}
+
+// Free everything a stopped worker still has waiting for a grace period
+void lb_net_worker_reclaim_all(loadbalancer_t* lb, lb_worker_t* worker) {
+    while (worker->retired) {
+        lb_connection_t* conn = worker->retired;
+        worker->retired = conn->next_retired;
+        lb_net_conn_free(lb, conn);
+    }
+    while (worker->limbo_head) {
+        lb_connection_t* conn = worker->limbo_head;
+        worker->limbo_head = conn->next_retired;
+        lb_net_conn_free(lb, conn);
     }
-    free(conn);
+    worker->limbo_tail = NULL;
 }
 
-// Forward data from client to backend
-int handle_client_to_backend(loadbalancer_t* lb, lb_connection_t* conn) {
-    char buffer[16384];
-    ssize_t bytes_read;
+// Interest set for one side of a connection: readable until it hit EOF or
+// the opposite direction is backed up past the high-water mark (or in its
+// splice pipe, or held behind a pending response, or it waits for a backend
+// slot), writable while bytes are queued for it
+static uint32_t lb_net_conn_interest(const lb_connection_t* conn, socket_type_t side) {
+    size_t hwm = conn->worker->lb->config.write_high_water;
+    uint32_t events = EPOLLONESHOT;
+    if (side == SOCKET_TYPE_CLIENT) {
+        if (!conn->client_eof && conn->to_backend.bytes < hwm && conn->c2b_pending == 0 &&
+            conn->held.bytes == 0 && conn->queued_ms == 0) {
+            events |= EPOLLIN;
+        }
+        if (conn->to_client.bytes > 0 || conn->b2c_pending > 0) events |= EPOLLOUT;
+        // A client that gives up while queued leaves the queue
+        if (conn->queued_ms) events |= EPOLLRDHUP;
+    } else {
+        if (!conn->backend_eof && conn->to_client.bytes < hwm && conn->b2c_pending == 0) {
+            events |= EPOLLIN;
+        }
+        if (conn->to_backend.bytes > 0 || conn->c2b_pending > 0) events |= EPOLLOUT;
+    }
+    return events;
+}
 
-    fprintf(stderr, "[DEBUG] handle_client_to_backend called\n");
+// Re-arm one side for its current interest set. The side whose event was
+// just handled must always be re-armed (EPOLLONESHOT); the other side only
+// when a handler changed what it should wait for.
+static void lb_net_conn_arm(lb_connection_t* conn, socket_type_t side, bool force) {
+    bool client = (side == SOCKET_TYPE_CLIENT);
+    int fd = client ? conn->client_fd : conn->backend_fd;
+    if (fd < 0) return;
+
+    uint32_t* armed = client ? &conn->client_events : &conn->backend_events;
+    uint32_t events = lb_net_conn_interest(conn, side);
+    if (!force && events == *armed) return;
+
+    struct epoll_event ev = {
+        .events = events,
+        .data.ptr = client ? conn->client_wrapper : conn->backend_wrapper
+    };
+    epoll_ctl(conn->worker->epfd, EPOLL_CTL_MOD, fd, &ev);
+    *armed = events;
+}
 
-    if (conn->to_backend_size > 0 && conn->backend_fd >= 0) {
-        ssize_t sent = send(conn->backend_fd, conn->to_backend_buffer, conn->to_backend_size, MSG_NOSIGNAL);
-        if (sent > 0) {
-            if ((size_t)sent < conn->to_backend_size) {
-                memmove(conn->to_backend_buffer, conn->to_backend_buffer + sent, conn->to_backend_size - sent);
-            }
-            conn->to_backend_size -= sent;
-            atomic_fetch_add(&lb->global_stats.bytes_in, sent);
-            if (conn->backend) {
-                atomic_fetch_add(&conn->backend->stats.bytes_in, sent);
-            }
-        } else if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-            fprintf(stderr, "[DEBUG] Error flushing to backend: %s\n", strerror(errno));
-            return -1;
-        }
+/*
+ * Connection timeouts. Each connection has one timer in its owner's wheel,
+ * armed for the timeout of the state it is in: queue while it waits for a
+ * backend slot, connect while the backend connect is in flight, write
+ * while bytes wait for a peer, keepalive while an HTTP connection sits
+ * between requests, read otherwise. Events only update last_active_ms;
+ * when the timer fires the deadline is recomputed and the timer re-added
+ * if the connection has been active since.
+ */
+#define LB_NET_MAX_WAIT_MS 1000  // quiescent points must keep coming
+
+static inline void lb_net_wheel_lock(lb_worker_t* worker) {
+    if (!worker->owns_fds) pthread_spin_lock(&worker->timer_lock);
+}
+
+static inline void lb_net_wheel_unlock(lb_worker_t* worker) {
+    if (!worker->owns_fds) pthread_spin_unlock(&worker->timer_lock);
+}
+
+// Deadline for conn's current state, UINT64_MAX when that timeout is disabled
+static uint64_t lb_net_conn_deadline(const loadbalancer_t* lb, const lb_connection_t* conn) {
+    uint32_t timeout;
+
+    if (conn->queued_ms) {
+        timeout = lb->config.queue_timeout_ms;
+        return timeout ? conn->queued_ms + timeout : UINT64_MAX;
+    }
+    if (conn->backend_connecting) {
+        timeout = lb->config.connect_timeout_ms;
+    } else if (conn->to_backend.bytes || conn->to_client.bytes ||
+               conn->c2b_pending || conn->b2c_pending) {
+        timeout = lb->config.write_timeout_ms;
+    } else if (conn->h2 && lb_h2_idle(conn->h2)) {
+        timeout = lb->config.keepalive_timeout_ms;
+    } else if (conn->http_framed && conn->rsp_framer.messages > 0 &&
+               conn->req_framer.messages == conn->rsp_framer.messages &&
+               lb_http1_idle(&conn->req_framer) && lb_http1_idle(&conn->rsp_framer)) {
+        timeout = lb->config.keepalive_timeout_ms;
+    } else {
+        timeout = lb->config.read_timeout_ms;
+    }
+
+    return timeout ? conn->last_active_ms + timeout : UINT64_MAX;
+}
+
+static void lb_net_conn_schedule(loadbalancer_t* lb, lb_connection_t* conn) {
+    lb_worker_t* owner = conn->worker;
+    uint64_t deadline = lb_net_conn_deadline(lb, conn);
+
+    // A disabled timeout is re-checked now and then: the state may change
+    if (deadline == UINT64_MAX) deadline = conn->last_active_ms + LB_NET_MAX_WAIT_MS;
+
+    lb_net_wheel_lock(owner);
+    lb_timer_add(&owner->timers, &conn->timer, deadline);
+    lb_net_wheel_unlock(owner);
+}
+
+// Backend connect finished. The state's timeout may now be shorter than the
+// connect timeout the timer was armed for.
+static void lb_net_conn_connected(loadbalancer_t* lb, lb_connection_t* conn) {
+    if (!conn->backend_connecting) return;
+    conn->backend_connecting = false;
+    LB_USDT2(ultrabalancer, backend_connected, conn, conn->backend_fd);
+    if (conn->phases.connecting) {
+        lb_trace_phase(LB_PHASE_CONNECT, lb_ticks() - conn->phases.connecting);
+        conn->phases.connecting = 0;
+    }
+    if (lb_net_conn_deadline(lb, conn) < conn->timer.expires) lb_net_conn_schedule(lb, conn);
+}
 
-        if (conn->to_backend_size == 0) {
-            struct epoll_event ev = {
-                .events = EPOLLIN | EPOLLONESHOT,
-                .data.ptr = conn->backend_wrapper
-            };
-            epoll_ctl(lb->epfd, EPOLL_CTL_MOD, conn->backend_fd, &ev);
+/*
+ * Admission queue. When every backend is at its connection limit
+ * (lb_backend_admit) a connection waits on its owner's FIFO, its first
+ * bytes in to_backend and the client left unread. Between batches each
+ * worker hands the slots freed meanwhile to its oldest waiters; one still
+ * waiting after queue_timeout_ms is answered 503 by its timer. lb->queued
+ * caps the waiters across workers at queue_max, and while there are any a
+ * newcomer queues behind them instead of taking a freed slot first.
+ */
+#define LB_NET_QUEUE_POLL_MS 1  // other workers' releases are seen this late
+
+static const char lb_net_503[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+static inline void lb_net_queue_lock(lb_worker_t* worker) {
+    if (!worker->owns_fds) pthread_spin_lock(&worker->queue_lock);
+}
+
+static inline void lb_net_queue_unlock(lb_worker_t* worker) {
+    if (!worker->owns_fds) pthread_spin_unlock(&worker->queue_lock);
+}
+
+static bool lb_net_queue_add(loadbalancer_t* lb, lb_connection_t* conn) {
+    if (atomic_fetch_add(&lb->queued, 1) >= lb->config.queue_max) {
+        atomic_fetch_sub(&lb->queued, 1);
+        return false;
+    }
+
+    lb_worker_t* owner = conn->worker;
+    conn->queued_ms = lb_net_self->now_ms;
+    conn->queue_next = NULL;
+    lb_net_queue_lock(owner);
+    conn->queue_prev = owner->queue_tail;
+    if (owner->queue_tail) {
+        owner->queue_tail->queue_next = conn;
+    } else {
+        owner->queue_head = conn;
+    }
+    owner->queue_tail = conn;
+    lb_net_queue_unlock(owner);
+
+    LB_USDT2(ultrabalancer, conn_queued, conn, atomic_load(&lb->queued));
+    lb_net_conn_schedule(lb, conn);
+    return true;
+}
+
+static void lb_net_queue_remove(loadbalancer_t* lb, lb_connection_t* conn) {
+    if (!conn->queued_ms) return;
+
+    lb_worker_t* owner = conn->worker;
+    lb_net_queue_lock(owner);
+    if (conn->queue_prev) {
+        conn->queue_prev->queue_next = conn->queue_next;
+    } else {
+        owner->queue_head = conn->queue_next;
+    }
+    if (conn->queue_next) {
+        conn->queue_next->queue_prev = conn->queue_prev;
+    } else {
+        owner->queue_tail = conn->queue_prev;
+    }
+    lb_net_queue_unlock(owner);
+
+    conn->queue_prev = conn->queue_next = NULL;
+    conn->queued_ms = 0;
+    atomic_fetch_sub(&lb->queued, 1);
+}
+
+static bool lb_net_queue_waiting(lb_worker_t* worker) {
+    lb_net_queue_lock(worker);
+    bool waiting = worker->queue_head != NULL;
+    lb_net_queue_unlock(worker);
+    return waiting;
+}
+
+// Turn conn away before it reached a backend: a 503 for what is taken to
+// be an HTTP client, nothing for a spliced L4 stream. Accepted sockets
+// inherit SO_LINGER {1,0} and unread bytes make close() reset as well, so
+// neither may cut the reply off.
+static void lb_net_reply_busy(lb_worker_t* worker, lb_connection_t* conn) {
+    lb_stat_add(&worker->stats->failed_requests, 1);
+    if (conn->use_splice) return;
+
+    struct linger lng = {0, 0};
+    setsockopt(conn->client_fd, SOL_SOCKET, SO_LINGER, &lng, sizeof(lng));
+    send(conn->client_fd, lb_net_503, sizeof(lb_net_503) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+    shutdown(conn->client_fd, SHUT_WR);
+
+    char discard[IO_BUFFER_SIZE];
+    for (int i = 0; i < 4; i++) {
+        if (recv(conn->client_fd, discard, sizeof(discard), MSG_DONTWAIT) <= 0) break;
+    }
+}
+
+// Backends of the HTTP/2 streams still open when conn closes; their
+// requests are cut off, so none of them is pooled
+static void lb_net_h2_close_streams(loadbalancer_t* lb, lb_worker_t* worker, lb_connection_t* conn) {
+    for (int i = 0; i < LB_H2_MAX_STREAMS; i++) {
+        lb_h2_stream_t* st = &conn->h2->streams[i];
+        if (st->fd < 0) continue;
+
+        epoll_ctl(worker->epfd, EPOLL_CTL_DEL, st->fd, NULL);
+        close(st->fd);
+        lb_backend_release(lb, st->backend);
+        lb_net_wq_clear(lb, &st->to_backend);
+        st->fd = -1;
+        st->wrapper.fd = -1;
+        st->wrapper.conn = NULL;
+    }
+}
+
+// Close both sides of conn and retire it. A backend fd between two HTTP
+// messages goes back to worker's idle pool unless backend_failed.
+static void lb_net_conn_close(loadbalancer_t* lb, lb_worker_t* worker, lb_connection_t* conn,
+                              bool backend_failed) {
+    lb_worker_t* owner = conn->worker;
+    lb_net_queue_remove(lb, conn);
+    lb_net_wheel_lock(owner);
+    lb_timer_cancel(&owner->timers, &conn->timer);
+    lb_net_wheel_unlock(owner);
+
+    // Remove from epoll first
+    if (conn->client_fd >= 0) {
+        if (conn->backend_eof) {
+            // Accepted sockets inherit SO_LINGER {1,0} from the listener;
+            // a completed response must not be cut off by an RST
+            struct linger lng = {0, 0};
+            setsockopt(conn->client_fd, SOL_SOCKET, SO_LINGER, &lng, sizeof(lng));
         }
+        epoll_ctl(worker->epfd, EPOLL_CTL_DEL, conn->client_fd, NULL);
+        close(conn->client_fd);
+        conn->client_fd = -1;  // Mark as closed
+    }
+    if (conn->backend_fd >= 0) {
+        epoll_ctl(worker->epfd, EPOLL_CTL_DEL, conn->backend_fd, NULL);
+        if (backend_failed) conn->http_keepalive = false;
+        if (!lb_net_backend_reusable(conn) ||
+            !lb_net_idle_put(worker, conn->backend, conn->backend_fd, false)) {
+            close(conn->backend_fd);
+        }
+        conn->backend_fd = -1;  // Mark as closed
     }
 
-    // Read all available data from client
-    while ((bytes_read = recv(conn->client_fd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
-        fprintf(stderr, "[DEBUG] Read %zd bytes from client\n", bytes_read);
+    if (conn->h2) lb_net_h2_close_streams(lb, worker, conn);
+    lb_net_conn_close_pipes(conn);
 
-        // If no backend connection yet, establish one
-        if (conn->backend_fd < 0) {
-            fprintf(stderr, "[DEBUG] No backend connection, creating one\n");
-            backend_t* backend = lb_select_backend(lb, &conn->client_addr);
-            if (!backend) {
-                fprintf(stderr, "[DEBUG] No backend available\n");
-                return -1;  // Caller will close connection
-            }
+    uint64_t duration = get_time_ns() - conn->start_time_ns;
+    LB_USDT2(ultrabalancer, conn_close, conn, duration);
+    if (conn->phases.accepted) {
+        uint64_t now = lb_ticks();
+        if (conn->phases.stall_since) conn->phases.stall_ticks += now - conn->phases.stall_since;
+        lb_trace_phase(LB_PHASE_CLIENT_STALL, conn->phases.stall_ticks);
+        lb_trace_phase(LB_PHASE_TOTAL, now - conn->phases.accepted);
+    }
+    if (conn->backend) {
+        atomic_store(&conn->backend->response_time_ns, duration);
+        lb_backend_release(lb, conn->backend);
+    }
 
-            conn->backend_fd = lb_net_connect_to_backend(backend);
-            if (conn->backend_fd < 0) {
-                fprintf(stderr, "[DEBUG] Failed to connect to backend\n");
-                atomic_fetch_add(&backend->failed_conns, 1);
-                atomic_fetch_add(&lb->global_stats.failed_requests, 1);
-                return -1;  // Caller will close connection properly
-            }
+    // Stale events for this connection may still be in flight in
+    // this or another worker's batch; they see conn == NULL
+    if (conn->client_wrapper) conn->client_wrapper->conn = NULL;
+    if (conn->backend_wrapper) conn->backend_wrapper->conn = NULL;
+    lb_net_conn_retire(worker, conn);
 
-            fprintf(stderr, "[DEBUG] Connected to backend fd=%d\n", conn->backend_fd);
-
-            conn->backend = backend;
-            atomic_fetch_add(&backend->active_conns, 1);
-            atomic_fetch_add(&backend->total_conns, 1);
-
-            // Register backend socket with epoll using EPOLLONESHOT
-            if (conn->backend_wrapper) {
-                conn->backend_wrapper->fd = conn->backend_fd;
-                struct epoll_event ev = {
-                    .events = EPOLLIN | EPOLLONESHOT,
-                    .data.ptr = conn->backend_wrapper
-                };
-                if (epoll_ctl(lb->epfd, EPOLL_CTL_ADD, conn->backend_fd, &ev) < 0) {
-                    perror("epoll_ctl backend");
-                    return -1;
+    lb_stat_add(&worker->stats->conns_closed, 1);
+}
+
+static void lb_net_timer_fired(lb_timer_t* timer, void* arg) {
+    lb_connection_t** expired = (lb_connection_t**)arg;
+    lb_connection_t* conn = (lb_connection_t*)((char*)timer - offsetof(lb_connection_t, timer));
+    conn->next_expired = *expired;
+    *expired = conn;
+}
+
+// Turn worker's wheel and close whatever really timed out. Fired timers are
+// collected first so no connection lock is taken under the wheel lock.
+static void lb_net_expire_timers(loadbalancer_t* lb, lb_worker_t* worker) {
+    lb_connection_t* expired = NULL;
+    bool shared = !worker->owns_fds;
+
+    lb_net_wheel_lock(worker);
+    lb_timer_advance(&worker->timers, worker->now_ms, lb_net_timer_fired, &expired);
+    lb_net_wheel_unlock(worker);
+
+    while (expired) {
+        lb_connection_t* conn = expired;
+        expired = conn->next_expired;
+
+        if (shared) lb_net_conn_lock(conn);
+        // Closed meanwhile by another worker: reclamation keeps it valid
+        if (conn->client_wrapper->conn == conn) {
+            if (lb_net_conn_deadline(lb, conn) <= worker->now_ms) {
+                LB_DEBUG("Connection timed out (fd=%d)", conn->client_fd);
+                if (conn->queued_ms) {
+                    LB_USDT2(ultrabalancer, queue_timeout, conn, worker->now_ms - conn->queued_ms);
+                    lb_net_queue_remove(lb, conn);
+                    lb_net_reply_busy(worker, conn);
+                } else if (conn->backend && conn->backend_connecting) {
+                    lb_backend_report(lb, conn->backend, LB_OUTCOME_CONNECT_FAIL);
                 }
-                fprintf(stderr, "[DEBUG] Registered backend socket with epoll\n");
+                lb_net_conn_close(lb, worker, conn, true);
+            } else {
+                lb_net_conn_schedule(lb, conn);
             }
         }
+        if (shared) lb_net_conn_unlock(conn);
+    }
+}
 
-        // Forward to backend
-        ssize_t sent = 0;
-        ssize_t total_sent = 0;
-        while (total_sent < bytes_read) {
-            sent = send(conn->backend_fd, buffer + total_sent, bytes_read - total_sent, MSG_NOSIGNAL);
+// Start a non-blocking connect to backend, whose slot conn holds, and
+// register the backend socket with the owning worker's epoll instance
+static int lb_net_connect_backend(loadbalancer_t* lb, lb_connection_t* conn, backend_t* backend,
+                                  uint64_t picking) {
+    // Any connection can take a preconnected socket; only a framed HTTP
+    // one can continue on a socket another client left between messages
+    int idle_fd = -1;
+    bool connecting = true;
+    if (lb_net_self && (conn->http_keepalive || lb->config.backend_preconnect)) {
+        idle_fd = lb_net_idle_get(lb_net_self, backend, !conn->http_keepalive, &connecting);
+    }
+    conn->backend_fd = idle_fd >= 0 ? idle_fd
+                                    : lb_net_connect_to_backend(lb, backend, lb->config.backend_fastopen);
+    if (conn->backend_fd < 0) {
+        LB_ERROR_RATELIMIT(5, 1000, "Failed to connect to backend %s:%u", backend->host, backend->port);
+        atomic_fetch_add(&backend->failed_conns, 1);
+        lb_stat_add(&lb_net_self->stats->failed_requests, 1);
+        lb_backend_report(lb, backend, LB_OUTCOME_CONNECT_FAIL);
+        lb_backend_release(lb, backend);
+        return -1;
+    }
+
+    LB_DEBUG("%s backend fd=%d", idle_fd >= 0 ? "Reusing" : "Connected to", conn->backend_fd);
+
+    conn->backend = backend;
+    if (connecting) {
+        // The connect timeout is usually the shortest; bring the timer forward
+        conn->backend_connecting = true;
+        conn->phases.connecting = picking;
+        lb_net_conn_schedule(lb, conn);
+    }
+    atomic_fetch_add(&backend->total_conns, 1);
+
+    // Register backend socket with epoll using EPOLLONESHOT
+    if (conn->backend_wrapper) {
+        conn->backend_wrapper->fd = conn->backend_fd;
+        struct epoll_event ev = {
+            .events = EPOLLIN | EPOLLONESHOT,
+            .data.ptr = conn->backend_wrapper
+        };
+        if (epoll_ctl(conn->worker->epfd, EPOLL_CTL_ADD, conn->backend_fd, &ev) < 0) {
+            LB_ERROR_RATELIMIT(5, 1000, "epoll_ctl backend: %s", strerror(errno));
+            return -1;
+        }
+        conn->backend_events = ev.events;
+        LB_DEBUG("Registered backend socket with epoll");
+    }
+
+    return 0;
+}
+
+// Select a backend for conn and connect to it. Returns 1 when every
+// backend is full and conn was queued instead; with the queue full too the
+// client is told so and -1 returned like for any failure.
+static int lb_net_attach_backend(loadbalancer_t* lb, lb_connection_t* conn) {
+    LB_DEBUG("No backend connection, creating one");
+    uint64_t picking = conn->phases.accepted ? lb_ticks() : 0;
+    if (picking && !conn->phases.requested) {
+        conn->phases.requested = true;
+        lb_trace_phase(LB_PHASE_REQUEST, picking - conn->phases.accepted);
+    }
+    bool full = atomic_load_explicit(&lb->queued, memory_order_relaxed) > 0;
+    backend_t* backend = full ? NULL : lb_backend_admit(lb, &conn->client_addr, &full);
+    LB_USDT2(ultrabalancer, backend_select, conn, backend ? backend->id : UINT32_MAX);
+    if (picking) {
+        uint64_t picked = lb_ticks();
+        lb_trace_phase(LB_PHASE_SELECT, picked - picking);
+        picking = picked;
+    }
+    if (full) {
+        if (lb_net_queue_add(lb, conn)) return 1;
+        LB_ERROR_RATELIMIT(5, 1000, "Backends and admission queue full");
+        lb_net_reply_busy(lb_net_self, conn);
+        return -1;
+    }
+    if (!backend) {
+        LB_ERROR_RATELIMIT(5, 1000, "No backend available");
+        return -1;
+    }
+
+    return lb_net_connect_backend(lb, conn, backend, picking);
+}
+
+// Give the slots freed up since the last batch to worker's queue, oldest
+// first, and send what the waiters brought along
+static void lb_net_queue_dispatch(loadbalancer_t* lb, lb_worker_t* worker) {
+    bool shared = !worker->owns_fds;
+
+    for (;;) {
+        lb_net_queue_lock(worker);
+        lb_connection_t* conn = worker->queue_head;
+        lb_net_queue_unlock(worker);
+        if (!conn) break;
+
+        if (shared) lb_net_conn_lock(conn);
+        // Closed meanwhile by another worker: reclamation keeps it valid
+        if (!conn->queued_ms) {
+            if (shared) lb_net_conn_unlock(conn);
+            continue;
+        }
+
+        bool full;
+        backend_t* backend = lb_backend_admit(lb, &conn->client_addr, &full);
+        if (full) {
+            if (shared) lb_net_conn_unlock(conn);
+            break;
+        }
+
+        LB_USDT2(ultrabalancer, conn_dequeued, conn, worker->now_ms - conn->queued_ms);
+        lb_net_queue_remove(lb, conn);
+        conn->last_active_ms = worker->now_ms;
+        uint64_t picking = conn->phases.accepted ? lb_ticks() : 0;
+        if (!backend || lb_net_connect_backend(lb, conn, backend, picking) < 0) {
+            lb_net_conn_close(lb, worker, conn, true);
+        } else {
+            if (conn->to_backend.bytes > 0 && conn->rsp_wait_ns == 0) conn->rsp_wait_ns = get_time_ns();
+            lb_net_conn_arm(conn, SOCKET_TYPE_BACKEND, true);
+            lb_net_conn_arm(conn, SOCKET_TYPE_CLIENT, false);
+            lb_net_conn_schedule(lb, conn);
+        }
+        if (shared) lb_net_conn_unlock(conn);
+    }
+}
+
+// Give the backend back once its exchange is over: to the idle pool when
+// it can be reused, otherwise closed. The next request attaches afresh.
+static void lb_net_detach_backend(loadbalancer_t* lb, lb_connection_t* conn) {
+    LB_DEBUG("Request done, releasing backend fd=%d", conn->backend_fd);
+
+    epoll_ctl(conn->worker->epfd, EPOLL_CTL_DEL, conn->backend_fd, NULL);
+    if (!lb_net_backend_reusable(conn) ||
+        !lb_net_idle_put(lb_net_self, conn->backend, conn->backend_fd, false)) {
+        close(conn->backend_fd);
+    }
+    lb_backend_release(lb, conn->backend);
+
+    conn->backend = NULL;
+    conn->backend_fd = -1;
+    conn->backend_wrapper->fd = -1;
+    conn->backend_events = 0;
+    conn->backend_eof = false;
+    conn->backend_connecting = false;
+    conn->phases.connecting = 0;
+    conn->rsp_wait_ns = 0;
+}
+
+// The backend connection broke; before the connect completed that is the
+// connect failing
+static void lb_net_backend_failed(loadbalancer_t* lb, lb_connection_t* conn) {
+    if (!conn->backend) return;
+    lb_backend_report(lb, conn->backend, conn->backend_connecting ? LB_OUTCOME_CONNECT_FAIL
+                                                                   : LB_OUTCOME_RESET);
+}
+
+// Send to the backend, attaching one first if needed; whatever the socket
+// does not take right away is queued
+static int lb_net_send_backend(loadbalancer_t* lb, lb_connection_t* conn,
+                               const uint8_t* data, size_t len) {
+    if (conn->backend_fd < 0) {
+        int ret = conn->queued_ms ? 1 : lb_net_attach_backend(lb, conn);
+        if (ret < 0) return -1;
+        // Queued: the bytes go out with the slot
+        if (ret > 0) return lb_net_wq_append(lb, &conn->to_backend, data, len);
+    }
+
+    // Forward to backend directly unless earlier bytes are still queued
+    ssize_t total_sent = 0;
+    if (conn->to_backend.bytes == 0) {
+        while ((size_t)total_sent < len) {
+            ssize_t sent = send(conn->backend_fd, data + total_sent, len - total_sent, MSG_NOSIGNAL);
             if (sent < 0) {
                 if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                    break;  // Would block, try again later
+                    break;  // Would block, queue the rest
                 }
-                fprintf(stderr, "[DEBUG] Error sending to backend: %s\n", strerror(errno));
+                LB_DEBUG("Error sending to backend: %s", strerror(errno));
+                lb_net_backend_failed(lb, conn);
                 return -1;  // Real error
             }
             total_sent += sent;
         }
+        if (total_sent > 0) lb_net_conn_connected(lb, conn);
+    }
 
-        if (total_sent < bytes_read) {
-            size_t remaining = bytes_read - total_sent;
-            if (conn->to_backend_capacity < conn->to_backend_size + remaining) {
-                size_t new_cap = (conn->to_backend_size + remaining) * 2;
-                uint8_t* new_buf = (uint8_t*)realloc(conn->to_backend_buffer, new_cap);
-                if (!new_buf) {
-                    fprintf(stderr, "[DEBUG] Failed to allocate to_backend_buffer\n");
-                    return -1;
-                }
-                conn->to_backend_buffer = new_buf;
-                conn->to_backend_capacity = new_cap;
+    // A framed stream starts a new sample with the first request bytes
+    // sent while no response is under way
+    if (conn->rsp_wait_ns == 0 && (!conn->http_framed || lb_http1_idle(&conn->rsp_framer))) {
+        conn->rsp_wait_ns = get_time_ns();
+    }
+
+    if ((size_t)total_sent < len &&
+        lb_net_wq_append(lb, &conn->to_backend, data + total_sent, len - total_sent) < 0) {
+        LB_DEBUG("Failed to queue data for backend");
+        return -1;
+    }
+
+    LB_DEBUG("Sent %zd bytes to backend", total_sent);
+
+    lb_net_count_bytes(conn, true, total_sent);
+    return 0;
+}
+
+// Per-request balancing: cut client bytes at request boundaries and send
+// each request to the backend chosen for it. A pipelined request is held
+// until the response before it is complete, so responses reach the client
+// in request order. Once framing is lost the connection stays where it is.
+static int lb_net_relay_requests(loadbalancer_t* lb, lb_connection_t* conn,
+                                 const uint8_t* data, size_t len) {
+    while (len > 0) {
+        size_t n = len;
+
+        if (conn->held.bytes > 0) {
+            return lb_net_wq_append(lb, &conn->held, data, len);
+        }
+        if (lb_http1_idle(&conn->req_framer)) {
+            if (conn->req_framer.messages > conn->rsp_framer.messages) {
+                return lb_net_wq_append(lb, &conn->held, data, len);
+            }
+            if (lb_net_exchange_done(conn)) lb_net_detach_backend(lb, conn);
+        }
+
+        if (!conn->req_framer.noreuse) {
+            ssize_t used = lb_http1_feed_message(&conn->req_framer, data, len);
+            if (used >= 0) n = (size_t)used;
+        }
+
+        if (lb_net_send_backend(lb, conn, data, n) < 0) return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// The response to the last request sent is complete: release its backend
+// and start on whatever the client pipelined meanwhile
+static int lb_net_next_request(loadbalancer_t* lb, lb_connection_t* conn) {
+    lb_net_detach_backend(lb, conn);
+    if (conn->held.bytes == 0) return 0;
+
+    // Relaying may hold part of it again, behind the next request
+    lb_wqueue_t held = conn->held;
+    memset(&conn->held, 0, sizeof(conn->held));
+
+    int ret = 0;
+    for (lb_wseg_t* seg = held.head; seg && ret == 0; seg = seg->next) {
+        ret = lb_net_relay_requests(lb, conn, seg->data + seg->start, seg->end - seg->start);
+    }
+    lb_net_wq_clear(lb, &held);
+    return ret;
+}
+
+/*
+ * HTTP/2 frontend. A client whose first bytes are the prior-knowledge
+ * preface is handed to lb_h2 (lb_h2.c); each stream then goes to a backend
+ * chosen for it, over a connection of its own taken from the idle pool
+ * when one is parked there. Stream sockets sit in the owning worker's epoll
+ * set next to the client fd, under the connection's lock and timer.
+ */
+static inline lb_h2_stream_t* lb_net_h2_stream(epoll_data_wrapper_t* wrapper) {
+    return (lb_h2_stream_t*)((char*)wrapper - offsetof(lb_h2_stream_t, wrapper));
+}
+
+// Like lb_net_conn_interest: the backend is read only while the client
+// keeps up and the stream's flow-control window has room
+static uint32_t lb_net_h2_interest(const lb_connection_t* conn, const lb_h2_stream_t* st) {
+    uint32_t events = EPOLLONESHOT;
+    if (lb_h2_stream_readable(st) && conn->to_client.bytes < conn->worker->lb->config.write_high_water) {
+        events |= EPOLLIN;
+    }
+    if (st->to_backend.bytes > 0) events |= EPOLLOUT;
+    return events;
+}
+
+static void lb_net_h2_arm(lb_connection_t* conn, lb_h2_stream_t* st, bool force) {
+    if (st->fd < 0) return;
+
+    uint32_t events = lb_net_h2_interest(conn, st);
+    if (!force && events == st->events) return;
+    // Nothing to wait for: stay disarmed, or a hangup would fire non-stop
+    if (!(events & (EPOLLIN | EPOLLOUT))) {
+        st->events = 0;
+        return;
+    }
+
+    struct epoll_event ev = {.events = events, .data.ptr = &st->wrapper};
+    epoll_ctl(conn->worker->epfd, EPOLL_CTL_MOD, st->fd, &ev);
+    st->events = events;
+}
+
+static void lb_net_h2_arm_streams(lb_connection_t* conn) {
+    for (int i = 0; i < LB_H2_MAX_STREAMS; i++) {
+        lb_net_h2_arm(conn, &conn->h2->streams[i], false);
+    }
+}
+
+static int lb_net_h2_send(void* ctx, const uint8_t* data, size_t len) {
+    lb_connection_t* conn = (lb_connection_t*)ctx;
+    loadbalancer_t* lb = conn->worker->lb;
+
+    size_t total = 0;
+    if (conn->to_client.bytes == 0) {
+        while (total < len) {
+            ssize_t sent = send(conn->client_fd, data + total, len - total, MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                LB_DEBUG("Error sending to client: %s", strerror(errno));
+                return -1;
+            }
+            total += sent;
+        }
+    }
+    if (total < len && lb_net_wq_append(lb, &conn->to_client, data + total, len - total) < 0) {
+        LB_DEBUG("Failed to queue data for client");
+        return -1;
+    }
+    return 0;
+}
+
+static int lb_net_h2_stream_send(loadbalancer_t* lb, lb_h2_stream_t* st, const uint8_t* data, size_t len) {
+    size_t total = 0;
+    if (st->to_backend.bytes == 0) {
+        while (total < len) {
+            ssize_t sent = send(st->fd, data + total, len - total, MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                LB_DEBUG("Error sending to backend: %s", strerror(errno));
+                return -1;
+            }
+            total += sent;
+        }
+    }
+    if (total < len && lb_net_wq_append(lb, &st->to_backend, data + total, len - total) < 0) {
+        LB_DEBUG("Failed to queue data for backend");
+        return -1;
+    }
+    lb_net_count_backend_bytes(st->backend, true, total);
+    return 0;
+}
+
+static int lb_net_h2_request(void* ctx, lb_h2_stream_t* st, const char* head, size_t len) {
+    lb_connection_t* conn = (lb_connection_t*)ctx;
+    loadbalancer_t* lb = conn->worker->lb;
+
+    // A stream is not queued: with every backend full it is refused
+    bool full;
+    backend_t* backend = lb_backend_admit(lb, &conn->client_addr, &full);
+    if (!backend) {
+        if (!full) LB_ERROR_RATELIMIT(5, 1000, "No backend available");
+        return -1;
+    }
+
+    int fd = lb_net_idle_get(lb_net_self, backend, false, NULL);
+    if (fd < 0) fd = lb_net_connect_to_backend(lb, backend, lb->config.backend_fastopen);
+    if (fd < 0) {
+        LB_ERROR_RATELIMIT(5, 1000, "Failed to connect to backend %s:%u", backend->host, backend->port);
+        atomic_fetch_add(&backend->failed_conns, 1);
+        lb_stat_add(&lb_net_self->stats->failed_requests, 1);
+        lb_backend_report(lb, backend, LB_OUTCOME_CONNECT_FAIL);
+        lb_backend_release(lb, backend);
+        return -1;
+    }
+    LB_DEBUG("HTTP/2 stream %u on backend fd=%d", st->id, fd);
+
+    st->fd = fd;
+    st->backend = backend;
+    st->wrapper.type = SOCKET_TYPE_H2_STREAM;
+    st->wrapper.conn = conn;
+    st->wrapper.fd = fd;
+    atomic_fetch_add(&backend->total_conns, 1);
+
+    // On failure the stream is answered and released, which closes fd
+    if (lb_net_h2_stream_send(lb, st, (const uint8_t*)head, len) < 0) return -1;
+
+    struct epoll_event ev = {.events = lb_net_h2_interest(conn, st), .data.ptr = &st->wrapper};
+    if (epoll_ctl(conn->worker->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        LB_ERROR_RATELIMIT(5, 1000, "epoll_ctl backend: %s", strerror(errno));
+        return -1;
+    }
+    st->events = ev.events;
+    return 0;
+}
+
+static int lb_net_h2_request_body(void* ctx, lb_h2_stream_t* st, const uint8_t* data, size_t len) {
+    lb_connection_t* conn = (lb_connection_t*)ctx;
+    loadbalancer_t* lb = conn->worker->lb;
+
+    if (st->fd < 0) return 0;  // answered already, the rest is dropped
+    if (lb_net_h2_stream_send(lb, st, data, len) < 0) return -1;
+    return st->to_backend.bytes >= lb->config.write_high_water ? 1 : 0;
+}
+
+static void lb_net_h2_release(void* ctx, lb_h2_stream_t* st, bool reusable) {
+    lb_connection_t* conn = (lb_connection_t*)ctx;
+    loadbalancer_t* lb = conn->worker->lb;
+
+    if (st->fd < 0) return;
+    epoll_ctl(conn->worker->epfd, EPOLL_CTL_DEL, st->fd, NULL);
+    if (!reusable || st->to_backend.bytes > 0 ||
+        !lb_net_idle_put(lb_net_self, st->backend, st->fd, false)) {
+        close(st->fd);
+    }
+    lb_backend_release(lb, st->backend);
+    lb_net_wq_clear(lb, &st->to_backend);
+
+    // A stale event for the old fd sees the wrapper detached
+    st->fd = -1;
+    st->wrapper.fd = -1;
+    st->wrapper.conn = NULL;
+    st->events = 0;
+    st->backend = NULL;
+}
+
+static const lb_h2_ops_t lb_net_h2_ops = {
+    .request = lb_net_h2_request,
+    .request_body = lb_net_h2_request_body,
+    .send = lb_net_h2_send,
+    .release = lb_net_h2_release
+};
+
+static int lb_net_h2_begin(lb_connection_t* conn) {
+    conn->h2 = lb_h2_create(&lb_net_h2_ops, conn);
+    if (!conn->h2) {
+        LB_ERROR_RATELIMIT(5, 1000, "Failed to allocate HTTP/2 state");
+        return -1;
+    }
+    conn->is_http2 = true;
+    LB_DEBUG("HTTP/2 client fd=%d", conn->client_fd);
+    return lb_h2_start(conn->h2);
+}
+
+// Event on a stream's backend socket: flush the request, relay the
+// response. Stream failures are answered on the stream; -1 only when the
+// client connection itself has to go.
+static int lb_net_h2_stream_io(loadbalancer_t* lb, lb_connection_t* conn, lb_h2_stream_t* st) {
+    char buffer[IO_BUFFER_SIZE];
+    size_t hwm = lb->config.write_high_water;
+
+    if (st->to_backend.bytes > 0) {
+        ssize_t sent = lb_net_wq_flush(lb, &st->to_backend, st->fd);
+        if (sent < 0) {
+            LB_DEBUG("Error flushing to backend: %s", strerror(errno));
+            return lb_h2_response_end(conn->h2, st, true);
+        }
+        lb_net_count_backend_bytes(st->backend, true, sent);
+        if (st->to_backend.bytes < hwm && st->window_held && lb_h2_drained(conn->h2, st) < 0) {
+            return -1;
+        }
+    }
+
+    while (st->fd >= 0 && lb_h2_stream_readable(st) && conn->to_client.bytes < hwm) {
+        ssize_t n = recv(st->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (n > 0) {
+            lb_net_count_backend_bytes(st->backend, false, n);
+            if (lb_h2_response(conn->h2, st, (const uint8_t*)buffer, n) < 0) return -1;
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n < 0) LB_DEBUG("Error reading from backend: %s", strerror(errno));
+        return lb_h2_response_end(conn->h2, st, n < 0);
+    }
+    return 0;
+}
+
+#ifdef USE_SPLICE
+// Move whatever is parked in a relay pipe onto the copy-path queue so a
+// connection can leave splice mode without losing bytes
+static int lb_net_pipe_to_queue(loadbalancer_t* lb, int pipe_rd, size_t pending, lb_wqueue_t* q) {
+    while (pending > 0) {
+        lb_wseg_t* seg = lb_net_wq_tail(lb, q);
+        if (!seg) return -1;
+        size_t room = WQ_SEG_CAPACITY - seg->end;
+        ssize_t n = read(pipe_rd, seg->data + seg->end, room < pending ? room : pending);
+        if (n <= 0) return -1;
+        seg->end += n;
+        q->bytes += n;
+        pending -= n;
+    }
+    return 0;
+}
+
+// Kernel refused splice for this socket pair: continue on the copy path
+static int lb_net_splice_fallback(loadbalancer_t* lb, lb_connection_t* conn) {
+    LB_DEBUG("splice unsupported (%s), using copy relay", strerror(errno));
+
+    if (lb_net_pipe_to_queue(lb, conn->c2b_pipe[0], conn->c2b_pending, &conn->to_backend) < 0 ||
+        lb_net_pipe_to_queue(lb, conn->b2c_pipe[0], conn->b2c_pending, &conn->to_client) < 0) {
+        return -1;
+    }
+
+    lb_net_conn_close_pipes(conn);
+    conn->use_splice = false;
+    return 0;
+}
+
+static inline bool lb_net_splice_refused(void) {
+    return errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP;
+}
+
+static int lb_net_splice_pipe_init(int p[2]) {
+    if (p[0] >= 0) return 0;
+    if (pipe2(p, O_NONBLOCK | O_CLOEXEC) < 0) return -1;
+    fcntl(p[1], F_SETPIPE_SZ, MAX_SPLICE_SIZE);
+    return 0;
+}
+
+// Move bytes src -> pipe -> dst without copying them through user space.
+// Returns 1 while the connection stays open, 0 on EOF from src, -1 on error
+// and -2 when the kernel refuses splice on this socket pair.
+static int lb_net_splice_relay(loadbalancer_t* lb, lb_connection_t* conn, socket_type_t src_side) {
+    bool from_client = (src_side == SOCKET_TYPE_CLIENT);
+    int src_fd = from_client ? conn->client_fd : conn->backend_fd;
+    int dst_fd = from_client ? conn->backend_fd : conn->client_fd;
+    int* p = from_client ? conn->c2b_pipe : conn->b2c_pipe;
+    size_t* pending = from_client ? &conn->c2b_pending : &conn->b2c_pending;
+    bool* src_eof = from_client ? &conn->client_eof : &conn->backend_eof;
+
+    if (lb_net_splice_pipe_init(p) < 0) {
+        return (lb_net_splice_refused() || errno == EMFILE || errno == ENFILE) ? -2 : -1;
+    }
+
+    for (;;) {
+        // Drain the pipe first; while dst is full leave src unread so the
+        // peer's TCP window provides backpressure
+        while (*pending > 0) {
+            ssize_t sent = splice(p[0], NULL, dst_fd, NULL, *pending,
+                                  SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (sent > 0) {
+                *pending -= sent;
+                lb_net_count_bytes(conn, from_client, sent);
+                continue;
+            }
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return 1;  // dst is re-armed for EPOLLOUT by the worker
             }
-            memcpy(conn->to_backend_buffer + conn->to_backend_size, buffer + total_sent, remaining);
-            conn->to_backend_size += remaining;
+            if (sent < 0 && lb_net_splice_refused()) return -2;
+            return -1;
+        }
 
-            struct epoll_event ev = {
-                .events = EPOLLIN | EPOLLOUT | EPOLLONESHOT,
-                .data.ptr = conn->backend_wrapper
-            };
-            epoll_ctl(lb->epfd, EPOLL_CTL_MOD, conn->backend_fd, &ev);
+        if (*src_eof) return 0;
+
+        ssize_t n = splice(src_fd, NULL, p[1], NULL, MAX_SPLICE_SIZE,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == 0) {
+            // Deliver what is still parked in the pipe before closing
+            *src_eof = true;
+            continue;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+            if (lb_net_splice_refused()) return -2;
+            return -1;
         }
+        *pending += n;
+    }
+}
+#endif
+
+// Forward data from client to backend
+int handle_client_to_backend(loadbalancer_t* lb, lb_connection_t* conn) {
+    char buffer[IO_BUFFER_SIZE];
+    size_t hwm = lb->config.write_high_water;
+    ssize_t bytes_read = 1;
 
-        fprintf(stderr, "[DEBUG] Sent %zd bytes to backend\n", total_sent);
+    LB_DEBUG("handle_client_to_backend called");
 
-        atomic_fetch_add(&lb->global_stats.bytes_in, total_sent);
-        if (conn->backend) {
-            atomic_fetch_add(&conn->backend->stats.bytes_in, total_sent);
+#ifdef USE_SPLICE
+    if (conn->use_splice) {
+        if (conn->backend_fd < 0) {
+            int ret = conn->queued_ms ? 1 : lb_net_attach_backend(lb, conn);
+            if (ret != 0) return ret;
+        }
+        int ret = lb_net_splice_relay(lb, conn, SOCKET_TYPE_CLIENT);
+        if (ret != -2) return ret;
+        if (lb_net_splice_fallback(lb, conn) < 0) return -1;
+    }
+#endif
+
+    if (conn->to_backend.bytes > 0 && conn->backend_fd >= 0) {
+        ssize_t sent = lb_net_wq_flush(lb, &conn->to_backend, conn->backend_fd);
+        if (sent < 0) {
+            LB_DEBUG("Error flushing to backend: %s", strerror(errno));
+            lb_net_backend_failed(lb, conn);
+            return -1;
+        }
+        lb_net_count_bytes(conn, true, sent);
+    }
+
+    // Client already closed: finish once its last bytes are delivered
+    if (conn->client_eof) return conn->to_backend.bytes > 0 ? 1 : 0;
+
+    // Read from the client until it runs dry or the queue reaches the high-water
+    // mark; past it the client is left unread (see lb_net_conn_interest)
+    while (conn->to_backend.bytes < hwm && conn->held.bytes == 0 && conn->queued_ms == 0 &&
+           (bytes_read = recv(conn->client_fd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+        LB_DEBUG("Read %zd bytes from client", bytes_read);
+
+        if (conn->h2_sniff) {
+            conn->h2_sniff = false;
+            if (lb_h2_preface_prefix((const uint8_t*)buffer, bytes_read) && lb_net_h2_begin(conn) < 0) {
+                return -1;
+            }
+        }
+        if (conn->h2) {
+            if (lb_h2_feed(conn->h2, (const uint8_t*)buffer, bytes_read) < 0) return -1;
+            continue;
+        }
+
+        if (conn->per_request) {
+            if (lb_net_relay_requests(lb, conn, (const uint8_t*)buffer, bytes_read) < 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        if (conn->http_framed) {
+            lb_http1_feed(&conn->req_framer, (const uint8_t*)buffer, bytes_read);
+        }
+        // Caller will close the connection properly on failure
+        if (lb_net_send_backend(lb, conn, (const uint8_t*)buffer, bytes_read) < 0) {
+            return -1;
         }
     }
 
     if (bytes_read == 0) {
-        fprintf(stderr, "[DEBUG] Client closed connection\n");
-        // Client closed connection
-        return 0;
+        LB_DEBUG("Client closed connection");
+        // Client closed connection; queued bytes still go out before close
+        conn->client_eof = true;
+        return conn->to_backend.bytes > 0 ? 1 : 0;
     }
 
     if (bytes_read < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-        fprintf(stderr, "[DEBUG] Error reading from client: %s\n", strerror(errno));
+        LB_DEBUG("Error reading from client: %s", strerror(errno));
         // Real error
         return -1;
     }
@@ -371,93 +1462,124 @@ int handle_client_to_backend(loadbalancer_t* lb, lb_connection_t* conn) {
 
 // Forward data from backend to client
 int handle_backend_to_client(loadbalancer_t* lb, lb_connection_t* conn) {
-    char buffer[16384];
-    ssize_t bytes_read;
+    char buffer[IO_BUFFER_SIZE];
+    size_t hwm = lb->config.write_high_water;
+    ssize_t bytes_read = 1;
 
-    fprintf(stderr, "[DEBUG] handle_backend_to_client called\n");
+    LB_DEBUG("handle_backend_to_client called");
 
-    if (conn->to_client_size > 0) {
-        ssize_t sent = send(conn->client_fd, conn->to_client_buffer, conn->to_client_size, MSG_NOSIGNAL);
-        if (sent > 0) {
-            if ((size_t)sent < conn->to_client_size) {
-                memmove(conn->to_client_buffer, conn->to_client_buffer + sent, conn->to_client_size - sent);
-            }
-            conn->to_client_size -= sent;
-            atomic_fetch_add(&lb->global_stats.bytes_out, sent);
-            if (conn->backend) {
-                atomic_fetch_add(&conn->backend->stats.bytes_out, sent);
-            }
-        } else if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-            fprintf(stderr, "[DEBUG] Error flushing to client: %s\n", strerror(errno));
+#ifdef USE_SPLICE
+    if (conn->use_splice) {
+        int ret = lb_net_splice_relay(lb, conn, SOCKET_TYPE_BACKEND);
+        if (ret != -2) return ret;
+        if (lb_net_splice_fallback(lb, conn) < 0) return -1;
+    }
+#endif
+
+    if (conn->to_client.bytes > 0 && conn->client_fd >= 0) {
+        ssize_t sent = lb_net_wq_flush(lb, &conn->to_client, conn->client_fd);
+        if (sent < 0) {
+            LB_DEBUG("Error flushing to client: %s", strerror(errno));
             return -1;
         }
-
-        if (conn->to_client_size == 0) {
-            struct epoll_event ev = {
-                .events = EPOLLIN | EPOLLONESHOT,
-                .data.ptr = conn->client_wrapper
-            };
-            epoll_ctl(lb->epfd, EPOLL_CTL_MOD, conn->client_fd, &ev);
+        lb_net_count_bytes(conn, false, sent);
+        if (conn->to_client.bytes == 0) {
+            LB_USDT1(ultrabalancer, client_drained, conn);
+            if (conn->phases.stall_since) {
+                conn->phases.stall_ticks += lb_ticks() - conn->phases.stall_since;
+                conn->phases.stall_since = 0;
+            }
         }
     }
 
-    // Read all available data from backend
-    while ((bytes_read = recv(conn->backend_fd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
-        fprintf(stderr, "[DEBUG] Read %zd bytes from backend\n", bytes_read);
+    // Backend already closed: finish once its last bytes are delivered
+    if (conn->backend_eof) return conn->to_client.bytes > 0 ? 1 : 0;
+    // Between two requests of a per-request connection
+    if (conn->backend_fd < 0) return 1;
+
+    // Read from the backend until it runs dry or the queue reaches the high-water
+    // mark; past it the backend is left unread (see lb_net_conn_interest)
+    while (conn->to_client.bytes < hwm &&
+           (bytes_read = recv(conn->backend_fd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+        LB_DEBUG("Read %zd bytes from backend", bytes_read);
+        if (conn->rsp_wait_ns && conn->rsp_wait_ns != UINT64_MAX) {
+            uint64_t wait_ns = get_time_ns() - conn->rsp_wait_ns;
+            LB_USDT2(ultrabalancer, backend_first_byte, conn, wait_ns);
+            if (conn->phases.accepted) lb_trace_phase_ns(LB_PHASE_FIRST_BYTE, wait_ns);
+            lb_backend_observe(conn->backend, wait_ns);
+            conn->rsp_wait_ns = conn->http_framed ? 0 : UINT64_MAX;
+            if (!conn->http_framed) lb_backend_report(lb, conn->backend, LB_OUTCOME_OK);
+        }
+        if (conn->http_framed) {
+            // A framed response is judged by its status once complete
+            uint32_t done = conn->rsp_framer.messages;
+            lb_http1_feed(&conn->rsp_framer, (const uint8_t*)buffer, bytes_read);
+            if (conn->rsp_framer.messages != done) {
+                lb_backend_report(lb, conn->backend, conn->rsp_framer.status >= 500 ?
+                                  LB_OUTCOME_5XX : LB_OUTCOME_OK);
+            }
+        }
 
-        // Forward to client
-        ssize_t sent = 0;
+        // Forward to client directly unless earlier bytes are still queued
         ssize_t total_sent = 0;
-        while (total_sent < bytes_read) {
-            sent = send(conn->client_fd, buffer + total_sent, bytes_read - total_sent, MSG_NOSIGNAL);
-            if (sent < 0) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                    break;  // Would block, try again later
+        if (conn->to_client.bytes == 0) {
+            while (total_sent < bytes_read) {
+                ssize_t sent = send(conn->client_fd, buffer + total_sent, bytes_read - total_sent,
+                                    MSG_NOSIGNAL);
+                if (sent < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        break;  // Would block, queue the rest
+                    }
+                    LB_DEBUG("Error sending to client: %s", strerror(errno));
+                    return -1;  // Real error
                 }
-                fprintf(stderr, "[DEBUG] Error sending to client: %s\n", strerror(errno));
-                return -1;  // Real error
+                total_sent += sent;
             }
-            total_sent += sent;
         }
 
         if (total_sent < bytes_read) {
-            size_t remaining = bytes_read - total_sent;
-            if (conn->to_client_capacity < conn->to_client_size + remaining) {
-                size_t new_cap = (conn->to_client_size + remaining) * 2;
-                uint8_t* new_buf = (uint8_t*)realloc(conn->to_client_buffer, new_cap);
-                if (!new_buf) {
-                    fprintf(stderr, "[DEBUG] Failed to allocate to_client_buffer\n");
-                    return -1;
-                }
-                conn->to_client_buffer = new_buf;
-                conn->to_client_capacity = new_cap;
+            // The client is not keeping up; responses wait until it drains
+            if (conn->to_client.bytes == 0) {
+                LB_USDT2(ultrabalancer, client_stalled, conn, bytes_read - total_sent);
+                if (conn->phases.accepted) conn->phases.stall_since = lb_ticks();
+            }
+            if (lb_net_wq_append(lb, &conn->to_client, (const uint8_t*)buffer + total_sent,
+                                 bytes_read - total_sent) < 0) {
+                LB_DEBUG("Failed to queue data for client");
+                return -1;
             }
-            memcpy(conn->to_client_buffer + conn->to_client_size, buffer + total_sent, remaining);
-            conn->to_client_size += remaining;
-
-            struct epoll_event ev = {
-                .events = EPOLLIN | EPOLLOUT | EPOLLONESHOT,
-                .data.ptr = conn->client_wrapper
-            };
-            epoll_ctl(lb->epfd, EPOLL_CTL_MOD, conn->client_fd, &ev);
         }
 
-        fprintf(stderr, "[DEBUG] Sent %zd bytes to client\n", total_sent);
+        LB_DEBUG("Sent %zd bytes to client", total_sent);
 
-        atomic_fetch_add(&lb->global_stats.bytes_out, total_sent);
-        if (conn->backend) {
-            atomic_fetch_add(&conn->backend->stats.bytes_out, total_sent);
-        }
+        lb_net_count_bytes(conn, false, total_sent);
+        if (conn->per_request && lb_net_exchange_done(conn)) break;
+    }
+
+    if (bytes_read == 0) conn->backend_eof = true;
+
+    // Also when the backend closed right after its response
+    if (conn->per_request && lb_net_exchange_done(conn)) {
+        return lb_net_next_request(lb, conn) < 0 ? -1 : 1;
+    }
+
+    // A draining backend lets go of keep-alive clients between two
+    // messages; their next request is balanced afresh
+    if (conn->http_framed && !conn->backend_eof && lb_net_exchange_done(conn) &&
+        atomic_load_explicit(&conn->backend->state, memory_order_relaxed) == BACKEND_DRAIN) {
+        lb_net_detach_backend(lb, conn);
+        return 1;
     }
 
     if (bytes_read == 0) {
-        fprintf(stderr, "[DEBUG] Backend closed connection\n");
-        // Backend closed connection
-        return 0;
+        LB_DEBUG("Backend closed connection");
+        // Backend closed connection; queued bytes still go out before close
+        return conn->to_client.bytes > 0 ? 1 : 0;
     }
 
     if (bytes_read < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-        fprintf(stderr, "[DEBUG] Error reading from backend: %s\n", strerror(errno));
+        LB_DEBUG("Error reading from backend: %s", strerror(errno));
+        if (errno == ECONNRESET) lb_backend_report(lb, conn->backend, LB_OUTCOME_RESET);
         // Real error
         return -1;
     }
@@ -589,29 +1711,39 @@ const char* get_check_status_string(int status) {
 
 // Renamed to avoid LTO internalization - called from main.c
 void* worker_thread_v2(void* arg) {
-    loadbalancer_t* lb = (loadbalancer_t*)arg;
+    lb_worker_t* worker = (lb_worker_t*)arg;
+    loadbalancer_t* lb = worker->lb;
     struct epoll_event events[MAX_EVENTS];
 
     cpu_set_t cpuset;
     CPU_ZERO(&cpuset);
-    CPU_SET(pthread_self() % sysconf(_SC_NPROCESSORS_ONLN), &cpuset);
+    CPU_SET(worker->cpu, &cpuset);
     pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
 
-    FILE* debug = fopen("/tmp/worker_debug.log", "a");
-    if (debug) {
-        fprintf(debug, "[DEBUG] Worker thread %lu started\n", pthread_self());
-        fflush(debug);
-    }
+    lb_net_self = worker;
+
+    LB_DEBUG("Worker %u started", worker->id);
 
     while (lb->running) {
-        // Process cleanup queue before handling new events
-        process_cleanup_queue(lb);
+        // Between batches: publish quiescence and free what is past its grace period
+        lb_net_quiescent(lb, worker);
+        lb_net_idle_expire(lb, worker);
+        lb_net_preconnect(lb, worker);
+
+        lb_net_wheel_lock(worker);
+        int timeout = lb_timer_next_timeout(&worker->timers, LB_NET_MAX_WAIT_MS);
+        lb_net_wheel_unlock(worker);
+        if (timeout > LB_NET_QUEUE_POLL_MS && lb_net_queue_waiting(worker)) {
+            timeout = LB_NET_QUEUE_POLL_MS;
+        }
 
-        int nfds = epoll_wait(lb->epfd, events, MAX_EVENTS, 100);
+        int nfds = epoll_wait(worker->epfd, events, MAX_EVENTS, timeout);
+        worker->now_ms = get_time_ns() / 1000000;
+        // Listener readiness, as near as the worker can see it
+        uint64_t woke = lb_trace_on() ? lb_ticks() : 0;
 
-        if (nfds > 0 && debug) {
-            fprintf(debug, "[DEBUG] epoll_wait returned %d events\n", nfds);
-            fflush(debug);
+        if (nfds > 0) {
+            LB_DEBUG("epoll_wait returned %d events", nfds);
         }
 
         for (int i = 0; i < nfds; i++) {
@@ -622,83 +1754,84 @@ void* worker_thread_v2(void* arg) {
             if (wrapper && wrapper->type == SOCKET_TYPE_LISTEN) {
                 // This is the listen socket
                 int fd = wrapper->fd;
-                if (fd == lb->listen_fd) {
-                    if (debug) {
-                        fprintf(debug, "[DEBUG] Listen socket event\n");
-                        fflush(debug);
-                    }
-                    // Accept new connection
-                    struct sockaddr_in client_addr;
-                    socklen_t addr_len = sizeof(client_addr);
-
-                    int client_fd = accept4(lb->listen_fd, (struct sockaddr*)&client_addr,
-                                           &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
-
-                    if (client_fd < 0) {
-                        if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                            perror("accept");
+                if (fd == worker->listen_fd) {
+                    LB_DEBUG("Listen socket event");
+                    // Drain a batch of pending connections per wakeup; with a
+                    // private SO_REUSEPORT listener no other worker will.
+                    for (int n = 0; n < ACCEPT_BATCH; n++) {
+                        struct sockaddr_in client_addr;
+                        socklen_t addr_len = sizeof(client_addr);
+
+                        int client_fd = accept4(fd, (struct sockaddr*)&client_addr,
+                                               &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+                        if (client_fd < 0) {
+                            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                                LB_ERROR_RATELIMIT(5, 1000, "accept: %s", strerror(errno));
+                            }
+                            break;
                         }
-                        continue;
-                    }
 
-                    if (debug) {
-                        fprintf(debug, "[DEBUG] Accepted client fd=%d\n", client_fd);
-                        fflush(debug);
-                    }
+                        LB_DEBUG("Accepted client fd=%d", client_fd);
 
-                    atomic_fetch_add(&lb->global_stats.total_requests, 1);
-                    atomic_fetch_add(&lb->global_stats.active_connections, 1);
+                        lb_stat_add(&worker->stats->total_requests, 1);
 
-                    int val = 1;
-                    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+                        int val = 1;
+                        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
 
-                    lb_connection_t* conn = lb_net_conn_create(lb);
-                    if (!conn) {
-                        fprintf(stderr, "[ERROR] lb_net_conn_create FAILED for fd=%d\n", client_fd);
-                        if (debug) {
-                            fprintf(debug, "[DEBUG] lb_net_conn_create failed\n");
-                            fflush(debug);
+                        lb_connection_t* conn = lb_net_conn_create(lb, worker);
+                        if (!conn) {
+                            LB_ERROR_RATELIMIT(5, 1000, "Failed to allocate connection for fd=%d", client_fd);
+                            close(client_fd);
+                            continue;
                         }
-                        close(client_fd);
-                        atomic_fetch_sub(&lb->global_stats.active_connections, 1);
-                        continue;
-                    }
-
-                    fprintf(stderr, "[INFO] lb_net_conn_create SUCCESS for fd=%d\n", client_fd);
-                    if (debug) {
-                        fprintf(debug, "[DEBUG] lb_net_conn_create succeeded, client_wrapper=%p backend_wrapper=%p\n",
-                                (void*)conn->client_wrapper, (void*)conn->backend_wrapper);
-                        fflush(debug);
-                    }
 
-                    conn->client_fd = client_fd;
-                    conn->client_addr = client_addr;
-                    conn->start_time_ns = get_time_ns();
-                    conn->state = STATE_CONNECTED;
+                        LB_DEBUG("lb_net_conn_create succeeded, client_wrapper=%p backend_wrapper=%p",
+                                 (void*)conn->client_wrapper, (void*)conn->backend_wrapper);
 
-                    // Set wrapper FD
-                    if (conn->client_wrapper) {
-                        conn->client_wrapper->fd = client_fd;
-                    }
-
-                    // Register client socket with epoll using EPOLLONESHOT to prevent stale events
-                    struct epoll_event ev = {
-                        .events = EPOLLIN | EPOLLONESHOT,
-                        .data.ptr = conn->client_wrapper
-                    };
-
-                    if (epoll_ctl(lb->epfd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
-                        if (debug) {
-                            fprintf(debug, "[DEBUG] epoll_ctl failed: %s\n", strerror(errno));
-                            fflush(debug);
+                        conn->client_fd = client_fd;
+                        conn->client_addr = client_addr;
+                        conn->start_time_ns = get_time_ns();
+                        LB_USDT2(ultrabalancer, conn_accept, conn, client_fd);
+                        if (woke && lb_trace_pick()) {
+                            conn->phases.accepted = lb_ticks();
+                            lb_trace_phase(LB_PHASE_ACCEPT, conn->phases.accepted - woke);
+                        }
+                        conn->last_active_ms = worker->now_ms;
+                        conn->state = STATE_CONNECTED;
+                        conn->http_keepalive = lb->config.upstream_keepalive;
+                        conn->per_request = lb->config.per_request_balance;
+                        conn->http_framed = conn->http_keepalive || conn->per_request;
+                        conn->h2_sniff = lb->config.http2;
+                        if (conn->http_framed) {
+                            lb_http1_init(&conn->req_framer, false);
+                            lb_http1_init(&conn->rsp_framer, true);
                         }
-                        perror("epoll_ctl client");
-                        lb_net_conn_destroy(lb, conn);
-                        atomic_fetch_sub(&lb->global_stats.active_connections, 1);
-                    } else {
-                        if (debug) {
-                            fprintf(debug, "[DEBUG] Registered client socket with epoll\n");
-                            fflush(debug);
+#ifdef USE_SPLICE
+                        // Without HTTP framing no byte needs to reach user space
+                        conn->use_splice = lb->config.splice_relay && !conn->http_framed &&
+                                           !conn->h2_sniff;
+#endif
+
+                        // Set wrapper FD
+                        if (conn->client_wrapper) {
+                            conn->client_wrapper->fd = client_fd;
+                        }
+
+                        // Register client socket with epoll using EPOLLONESHOT to prevent stale events
+                        struct epoll_event ev = {
+                            .events = EPOLLIN | EPOLLONESHOT,
+                            .data.ptr = conn->client_wrapper
+                        };
+
+                        conn->client_events = ev.events;
+                        if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+                            LB_ERROR_RATELIMIT(5, 1000, "epoll_ctl client: %s", strerror(errno));
+                            lb_net_conn_destroy(lb, conn);
+                        } else {
+                            LB_DEBUG("Registered client socket with epoll");
+                            lb_stat_add(&worker->stats->conns_opened, 1);
+                            lb_net_conn_schedule(lb, conn);
                         }
                     }
                 }
@@ -707,54 +1840,68 @@ void* worker_thread_v2(void* arg) {
 
             // This is a wrapper for client or backend socket
             if (!wrapper || !wrapper->conn) {
-                if (debug) {
-                    fprintf(debug, "[DEBUG] Invalid wrapper\n");
-                    fflush(debug);
-                }
+                LB_DEBUG("Invalid wrapper");
                 continue;
             }
 
             lb_connection_t* conn = (lb_connection_t*)wrapper->conn;
 
-            // Validate the connection is still valid
-            if (conn->client_fd < 0 && conn->backend_fd < 0) {
-                // Connection was closed, skip this event
+            // With a shared epoll instance the client and backend fds of one
+            // connection can fire on two workers at once; serialise them
+            bool shared = !worker->owns_fds;
+            if (shared) lb_net_conn_lock(conn);
+
+            // Validate the connection is still valid; it may have been closed
+            // while we waited (reclamation keeps the memory valid meanwhile)
+            if (wrapper->conn != conn || (conn->client_fd < 0 && conn->backend_fd < 0)) {
+                if (shared) lb_net_conn_unlock(conn);
                 continue;
             }
 
             // Additional check: if this is for a specific FD that's already closed, skip
-            if (wrapper->type == SOCKET_TYPE_CLIENT && conn->client_fd < 0) {
-                continue;
-            }
-            if (wrapper->type == SOCKET_TYPE_BACKEND && conn->backend_fd < 0) {
+            if ((wrapper->type == SOCKET_TYPE_CLIENT && conn->client_fd < 0) ||
+                (wrapper->type == SOCKET_TYPE_BACKEND && conn->backend_fd < 0) ||
+                (wrapper->type == SOCKET_TYPE_H2_STREAM && wrapper->fd < 0)) {
+                if (shared) lb_net_conn_unlock(conn);
                 continue;
             }
 
-            if (debug) {
-                fprintf(debug, "[DEBUG] Socket event: type=%d\n", wrapper->type);
-                fflush(debug);
-            }
+            LB_DEBUG("Socket event: type=%d", wrapper->type);
             bool should_close = false;
             int result = 0;
 
-            if (events[i].events & (EPOLLHUP | EPOLLERR)) {
-                if (debug) {
-                    fprintf(debug, "[DEBUG] EPOLLHUP or EPOLLERR\n");
-                    fflush(debug);
+            conn->last_active_ms = worker->now_ms;
+
+            // One HTTP/2 stream's backend. Errors and hangups surface from
+            // recv(), so an event left over from a slot's previous stream
+            // costs the new one nothing.
+            if (wrapper->type == SOCKET_TYPE_H2_STREAM) {
+                lb_h2_stream_t* st = lb_net_h2_stream(wrapper);
+                if (lb_net_h2_stream_io(lb, conn, st) < 0) {
+                    lb_net_conn_close(lb, worker, conn, false);
+                } else {
+                    lb_net_h2_arm(conn, st, true);
+                    lb_net_conn_arm(conn, SOCKET_TYPE_CLIENT, false);
+                    lb_net_h2_arm_streams(conn);
                 }
+                if (shared) lb_net_conn_unlock(conn);
+                continue;
+            }
+            if (wrapper->type == SOCKET_TYPE_BACKEND && !(events[i].events & (EPOLLHUP | EPOLLERR))) {
+                lb_net_conn_connected(lb, conn);
+            }
+
+            if ((events[i].events & (EPOLLHUP | EPOLLERR)) ||
+                (conn->queued_ms && (events[i].events & EPOLLRDHUP))) {
+                LB_DEBUG("EPOLLHUP or EPOLLERR");
+                if (wrapper->type == SOCKET_TYPE_BACKEND) lb_net_backend_failed(lb, conn);
                 should_close = true;
             } else if (events[i].events & EPOLLOUT) {
                 if (wrapper->type == SOCKET_TYPE_CLIENT) {
-                    if (debug) {
-                        fprintf(debug, "[DEBUG] Client socket writable\n");
-                        fflush(debug);
-                    }
+                    LB_DEBUG("Client socket writable");
                     result = handle_backend_to_client(lb, conn);
                 } else if (wrapper->type == SOCKET_TYPE_BACKEND) {
-                    if (debug) {
-                        fprintf(debug, "[DEBUG] Backend socket writable\n");
-                        fflush(debug);
-                    }
+                    LB_DEBUG("Backend socket writable");
                     result = handle_client_to_backend(lb, conn);
                 }
 
@@ -764,17 +1911,11 @@ void* worker_thread_v2(void* arg) {
             } else if (events[i].events & EPOLLIN) {
                 // Determine which socket has data
                 if (wrapper->type == SOCKET_TYPE_CLIENT) {
-                    if (debug) {
-                        fprintf(debug, "[DEBUG] Client socket has data\n");
-                        fflush(debug);
-                    }
+                    LB_DEBUG("Client socket has data");
                     // Data from client → forward to backend
                     result = handle_client_to_backend(lb, conn);
                 } else if (wrapper->type == SOCKET_TYPE_BACKEND) {
-                    if (debug) {
-                        fprintf(debug, "[DEBUG] Backend socket has data\n");
-                        fflush(debug);
-                    }
+                    LB_DEBUG("Backend socket has data");
                     // Data from backend → forward to client
                     result = handle_backend_to_client(lb, conn);
                 }
@@ -785,99 +1926,27 @@ void* worker_thread_v2(void* arg) {
             }
 
             if (should_close) {
-                if (debug) {
-                    fprintf(debug, "[DEBUG] Marking connection for close\n");
-                    fflush(debug);
-                }
-
-                // Remove from epoll first
-                if (conn->client_fd >= 0) {
-                    epoll_ctl(lb->epfd, EPOLL_CTL_DEL, conn->client_fd, NULL);
-                    close(conn->client_fd);
-                    conn->client_fd = -1;  // Mark as closed
-                }
-                if (conn->backend_fd >= 0) {
-                    epoll_ctl(lb->epfd, EPOLL_CTL_DEL, conn->backend_fd, NULL);
-                    close(conn->backend_fd);
-                    conn->backend_fd = -1;  // Mark as closed
-                }
-
-                uint64_t duration = get_time_ns() - conn->start_time_ns;
-                if (conn->backend) {
-                    atomic_store(&conn->backend->response_time_ns, duration);
-                    atomic_fetch_sub(&conn->backend->active_conns, 1);
-                }
-
-                // Enqueue connection for deferred cleanup
-                // Mark wrapper as invalid by setting conn to NULL to prevent use after this batch
-                if (conn->client_wrapper) conn->client_wrapper->conn = NULL;
-                if (conn->backend_wrapper) conn->backend_wrapper->conn = NULL;
-
-                // Enqueue for cleanup at the start of next iteration
-                if (!cleanup_queue_enqueue(lb->cleanup_queue, conn)) {
-                    // Queue full, free immediately with NULL checks
-                    fprintf(stderr, "[WARN] Cleanup queue full, freeing connection immediately\n");
-                    if (conn->read_buffer) {
-                        free(conn->read_buffer);
-                        conn->read_buffer = NULL;
-                    }
-                    if (conn->write_buffer) {
-                        free(conn->write_buffer);
-                        conn->write_buffer = NULL;
-                    }
-                    if (conn->to_backend_buffer) {
-                        free(conn->to_backend_buffer);
-                        conn->to_backend_buffer = NULL;
-                    }
-                    if (conn->to_client_buffer) {
-                        free(conn->to_client_buffer);
-                        conn->to_client_buffer = NULL;
-                    }
-                    // Free wrappers - safe since FDs are closed and EPOLL_CTL_DEL done
-                    if (conn->client_wrapper) {
-                        free(conn->client_wrapper);
-                        conn->client_wrapper = NULL;
-                    }
-                    if (conn->backend_wrapper) {
-                        free(conn->backend_wrapper);
-                        conn->backend_wrapper = NULL;
-                    }
-                    free(conn);
-                }
-
-                atomic_fetch_sub(&lb->global_stats.active_connections, 1);
+                LB_DEBUG("Marking connection for close");
+                bool backend_failed = result < 0 ||
+                    (wrapper->type == SOCKET_TYPE_BACKEND && (events[i].events & (EPOLLHUP | EPOLLERR)));
+                lb_net_conn_close(lb, worker, conn, backend_failed);
             } else {
-                // Connection still alive - re-arm EPOLLONESHOT for next event
-                if (wrapper->type == SOCKET_TYPE_CLIENT && conn->client_fd >= 0) {
-                    uint32_t events = EPOLLIN | EPOLLONESHOT;
-                    // Keep EPOLLOUT if there's buffered data to send to client
-                    if (conn->to_client_size > 0) {
-                        events |= EPOLLOUT;
-                    }
-                    struct epoll_event ev = {
-                        .events = events,
-                        .data.ptr = conn->client_wrapper
-                    };
-                    epoll_ctl(lb->epfd, EPOLL_CTL_MOD, conn->client_fd, &ev);
-                } else if (wrapper->type == SOCKET_TYPE_BACKEND && conn->backend_fd >= 0) {
-                    uint32_t events = EPOLLIN | EPOLLONESHOT;
-                    // Keep EPOLLOUT if there's buffered data to send to backend
-                    if (conn->to_backend_size > 0) {
-                        events |= EPOLLOUT;
-                    }
-                    struct epoll_event ev = {
-                        .events = events,
-                        .data.ptr = conn->backend_wrapper
-                    };
-                    epoll_ctl(lb->epfd, EPOLL_CTL_MOD, conn->backend_fd, &ev);
-                }
+                // Connection still alive - re-arm EPOLLONESHOT for next event,
+                // and the peer fd if the handler changed what it waits for
+                socket_type_t peer = wrapper->type == SOCKET_TYPE_CLIENT ?
+                                     SOCKET_TYPE_BACKEND : SOCKET_TYPE_CLIENT;
+                lb_net_conn_arm(conn, wrapper->type, true);
+                lb_net_conn_arm(conn, peer, false);
+                if (conn->h2) lb_net_h2_arm_streams(conn);
             }
+
+            if (shared) lb_net_conn_unlock(conn);
         }
-    }
 
-    if (debug) {
-        fprintf(debug, "[DEBUG] Worker thread %lu exiting\n", pthread_self());
-        fclose(debug);
+        lb_net_expire_timers(lb, worker);
+        lb_net_queue_dispatch(lb, worker);
     }
+
+    LB_DEBUG("Worker %u exiting", worker->id);
     return NULL;
 }
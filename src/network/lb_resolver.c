@@ -0,0 +1,139 @@
+#include "core/loadbalancer.h"
+#include "utils/log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+
+#define RESOLVER_SCAN_INTERVAL_NS 100000000ULL  // 100ms
+#define RESOLVER_RETRY_NS         1000000000ULL // failed lookups retry after 1s
+
+// Publish a new record set; there is a single writer (registration before
+// the workers start, the resolver thread afterwards)
+static void lb_resolver_publish(backend_t* backend, const lb_sockaddr_t* addrs, uint32_t count) {
+    uint32_t seq = atomic_load_explicit(&backend->addr_seq, memory_order_relaxed);
+    atomic_store_explicit(&backend->addr_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    memcpy(backend->addrs, addrs, count * sizeof(lb_sockaddr_t));
+    backend->addr_count = count;
+
+    atomic_store_explicit(&backend->addr_seq, seq + 2, memory_order_release);
+}
+
+// IP literals never change, so they are filled once and never refreshed
+static bool lb_resolver_literal(backend_t* backend) {
+    lb_sockaddr_t addr;
+    memset(&addr, 0, sizeof(addr));
+
+    if (inet_pton(AF_INET, backend->host, &addr.in.sin_addr) == 1) {
+        addr.in.sin_family = AF_INET;
+        addr.in.sin_port = htons(backend->port);
+    } else if (inet_pton(AF_INET6, backend->host, &addr.in6.sin6_addr) == 1) {
+        addr.in6.sin6_family = AF_INET6;
+        addr.in6.sin6_port = htons(backend->port);
+    } else {
+        return false;
+    }
+
+    lb_resolver_publish(backend, &addr, 1);
+    backend->addr_expires_ns = UINT64_MAX;
+    return true;
+}
+
+// Blocking lookup of every A/AAAA record for the backend's host name
+static int lb_resolver_lookup(backend_t* backend, lb_sockaddr_t* addrs, uint32_t* count) {
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = AI_ADDRCONFIG
+    };
+    struct addrinfo* res = NULL;
+    char port[8];
+    snprintf(port, sizeof(port), "%u", backend->port);
+
+    int err = getaddrinfo(backend->host, port, &hints, &res);
+    if (err != 0) {
+        LB_WARN("Cannot resolve backend %s: %s", backend->host, gai_strerror(err));
+        return -1;
+    }
+
+    uint32_t n = 0;
+    for (struct addrinfo* ai = res; ai && n < BACKEND_MAX_ADDRS; ai = ai->ai_next) {
+        if (ai->ai_addrlen > sizeof(lb_sockaddr_t)) continue;
+        memset(&addrs[n], 0, sizeof(lb_sockaddr_t));
+        memcpy(&addrs[n], ai->ai_addr, ai->ai_addrlen);
+        n++;
+    }
+    freeaddrinfo(res);
+
+    *count = n;
+    return n > 0 ? 0 : -1;
+}
+
+static int lb_resolver_refresh(loadbalancer_t* lb, backend_t* backend, uint64_t now) {
+    lb_sockaddr_t addrs[BACKEND_MAX_ADDRS];
+    uint32_t count = 0;
+
+    if (lb_resolver_lookup(backend, addrs, &count) < 0) {
+        // Keep serving the last good records until a lookup succeeds
+        backend->addr_expires_ns = now + RESOLVER_RETRY_NS;
+        return -1;
+    }
+
+    lb_resolver_publish(backend, addrs, count);
+    backend->addr_expires_ns = now + (uint64_t)lb->config.dns_ttl_ms * 1000000ULL;
+    return 0;
+}
+
+// Called while registering a backend, before it is visible to workers
+int lb_resolver_add_backend(loadbalancer_t* lb, backend_t* backend) {
+    atomic_store(&backend->addr_seq, 0);
+    atomic_store(&backend->addr_rr, 0);
+    backend->addr_count = 0;
+
+    if (lb_resolver_literal(backend)) return 0;
+    return lb_resolver_refresh(lb, backend, get_time_ns());
+}
+
+// Copy one cached address for a new connection, rotating through the
+// records. Never blocks; fails only when nothing has resolved yet.
+int lb_net_resolve_backend(backend_t* backend, lb_sockaddr_t* addr, socklen_t* len) {
+    uint32_t seq;
+    uint32_t count;
+
+    do {
+        seq = atomic_load_explicit(&backend->addr_seq, memory_order_acquire);
+        if (seq & 1) continue;
+
+        count = backend->addr_count;
+        if (count > 0) {
+            uint32_t idx = atomic_fetch_add_explicit(&backend->addr_rr, 1, memory_order_relaxed);
+            *addr = backend->addrs[idx % count];
+        }
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || atomic_load_explicit(&backend->addr_seq, memory_order_relaxed) != seq);
+
+    if (count == 0) return -1;
+    *len = addr->sa.sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+    return 0;
+}
+
+void* lb_resolver_thread(void* arg) {
+    loadbalancer_t* lb = (loadbalancer_t*)arg;
+    struct timespec idle = { 0, RESOLVER_SCAN_INTERVAL_NS };
+
+    while (lb->running) {
+        uint64_t now = get_time_ns();
+        for (uint32_t i = 0; i < lb->backend_count; i++) {
+            backend_t* backend = lb->backends[i];
+            if (backend && backend->addr_expires_ns <= now) {
+                lb_resolver_refresh(lb, backend, now);
+            }
+        }
+        nanosleep(&idle, NULL);
+    }
+    return NULL;
+}
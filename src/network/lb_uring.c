@@ -0,0 +1,894 @@
+#include "core/loadbalancer.h"
+#include "utils/log.h"
+#include "stats/lb_stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/*
+ * io_uring event engine.
+ *
+ * Each worker owns one ring. The listen socket is served by a multishot
+ * accept, client and backend reads pick buffers from a per-worker provided
+ * buffer ring, and the send for a received buffer is queued straight from
+ * the recv completion. All SQEs produced while reaping a batch of CQEs go
+ * to the kernel in the next io_uring_enter(), which also waits for the
+ * next completions, so a steady-state relay costs one syscall per loop
+ * iteration instead of one per recv, send and epoll re-arm.
+ *
+ * Connect, read and write timeouts run on a per-worker timer wheel, the
+ * ring's wait ending when the wheel next needs to turn. As on the epoll
+ * path a timer is not moved on every transfer: when it fires the deadline
+ * is recomputed from the last activity and the timer re-added if it has
+ * not passed. The engine does not frame HTTP, so the keep-alive timeout
+ * never applies and an idle connection is under the read timeout.
+ */
+
+#define URING_ENTRIES   1024
+#define URING_BUF_COUNT 512          // must be a power of two
+#define URING_BUF_SIZE  16384
+#define URING_BGID      0
+#define URING_WAIT_NS   100000000ULL // same 100ms tick as epoll_wait
+#define URING_QUEUE_WAIT_NS 1000000ULL // while clients wait for a slot
+#define URING_MAX_WAIT_MS 1000       // re-check of a connection whose timeout is off
+
+enum {
+    URING_OP_ACCEPT,
+    URING_OP_CONNECT,
+    URING_OP_RECV,
+    URING_OP_SEND
+};
+
+// user_data layout: connection pointer | op << 1 | direction
+#define URING_UD(conn, op, dir) ((uint64_t)(uintptr_t)(conn) | ((uint64_t)(op) << 1) | (uint64_t)(dir))
+#define URING_UD_CONN(ud)       ((uring_conn_t*)(uintptr_t)((ud) & ~(uint64_t)7))
+#define URING_UD_OP(ud)         ((int)(((ud) >> 1) & 3))
+#define URING_UD_DIR(ud)        ((int)((ud) & 1))
+
+enum { URING_CLIENT = 0, URING_BACKEND = 1 };
+
+struct uring_conn;
+
+// One relay direction: dir[0] is client -> backend, dir[1] is backend -> client
+typedef struct uring_dir {
+    struct uring_conn* conn;
+    struct uring_dir* next_starved;
+    uint32_t len;
+    uint32_t off;
+    uint16_t bid;
+    bool has_buf;
+    bool starved;
+} uring_dir_t;
+
+typedef struct uring_conn {
+    int fd[2];
+    backend_t* backend;
+    lb_sockaddr_t backend_addr;
+    socklen_t backend_addr_len;
+    uint64_t start_time_ns;
+    uint64_t rsp_wait_ns;     // first client bytes sent, UINT64_MAX once sampled
+    uint32_t inflight;
+    bool closing;
+    bool graceful;
+    bool connecting;          // backend connect queued, not yet completed
+    uint64_t last_active_ms;
+    lb_timer_t timer;
+    struct uring_conn* next_expired;
+    uring_dir_t dir[2];
+    struct sockaddr_in client_addr;
+    uint64_t queued_ms;       // waiting for a backend slot since, 0 if not
+    struct uring_conn* queue_next;
+    struct uring_conn* prev;
+    struct uring_conn* next;
+} __attribute__((aligned(8))) uring_conn_t;
+
+typedef struct {
+    int fd;
+    void* ring_ptr;
+    size_t ring_sz;
+    struct io_uring_sqe* sqes;
+    size_t sqes_sz;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sqe_tail;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+} lb_uring_t;
+
+typedef struct {
+    lb_uring_t ring;
+    struct io_uring_buf_ring* br;
+    size_t br_sz;
+    uint8_t* bufs;
+    uint16_t br_tail;
+    uring_dir_t* starved_head;
+    uring_dir_t* starved_tail;
+    uring_conn_t* conns;
+    // Clients waiting for a backend slot, oldest first, as on the epoll path
+    uring_conn_t* queue_head;
+    uring_conn_t* queue_tail;
+    lb_timer_wheel_t timers;
+    lb_worker_t* worker;
+    loadbalancer_t* lb;
+    bool accepting;  // the multishot accept is armed, until lb->accepting clears
+} uring_worker_t;
+
+static inline int uring_setup(unsigned entries, struct io_uring_params* p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags, void* arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static inline int uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_ring_exit(lb_uring_t* r) {
+    if (r->sqes && r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_sz);
+    if (r->ring_ptr && r->ring_ptr != MAP_FAILED) munmap(r->ring_ptr, r->ring_sz);
+    if (r->fd >= 0) close(r->fd);
+    r->fd = -1;
+    r->sqes = NULL;
+    r->ring_ptr = NULL;
+}
+
+static int uring_ring_init(lb_uring_t* r, unsigned entries) {
+    struct io_uring_params p;
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+
+    // The ring is only ever touched by the worker thread that created it
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN |
+              IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = entries * 4;
+    r->fd = uring_setup(entries, &p);
+    if (r->fd < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = entries * 4;
+        r->fd = uring_setup(entries, &p);
+    }
+    if (r->fd < 0) return -1;
+
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG) ||
+        !(p.features & IORING_FEAT_NODROP)) {
+        errno = ENOSYS;
+        uring_ring_exit(r);
+        return -1;
+    }
+
+    size_t sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->ring_sz = sq_sz > cq_sz ? sq_sz : cq_sz;
+    r->ring_ptr = mmap(NULL, r->ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       r->fd, IORING_OFF_SQ_RING);
+    if (r->ring_ptr == MAP_FAILED) {
+        uring_ring_exit(r);
+        return -1;
+    }
+
+    r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        uring_ring_exit(r);
+        return -1;
+    }
+
+    uint8_t* base = (uint8_t*)r->ring_ptr;
+    r->sq_head = (unsigned*)(base + p.sq_off.head);
+    r->sq_tail = (unsigned*)(base + p.sq_off.tail);
+    r->sq_array = (unsigned*)(base + p.sq_off.array);
+    r->sq_mask = *(unsigned*)(base + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->sqe_tail = *r->sq_tail;
+    r->cq_head = (unsigned*)(base + p.cq_off.head);
+    r->cq_tail = (unsigned*)(base + p.cq_off.tail);
+    r->cq_mask = *(unsigned*)(base + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(base + p.cq_off.cqes);
+    return 0;
+}
+
+// Publish queued SQEs and optionally wait for completions
+static int uring_submit(lb_uring_t* r, unsigned wait_nr, uint64_t timeout_ns) {
+    unsigned tail = *r->sq_tail;
+    unsigned to_submit = r->sqe_tail - tail;
+    __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+
+    if (wait_nr == 0) {
+        if (to_submit == 0) return 0;
+        return uring_enter(r->fd, to_submit, 0, 0, NULL, 0);
+    }
+
+    struct __kernel_timespec ts = {
+        .tv_sec = (long long)(timeout_ns / 1000000000ULL),
+        .tv_nsec = (long long)(timeout_ns % 1000000000ULL)
+    };
+    struct io_uring_getevents_arg arg = {
+        .sigmask = 0,
+        .sigmask_sz = 0,
+        .ts = (uint64_t)(uintptr_t)&ts
+    };
+    return uring_enter(r->fd, to_submit, wait_nr, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                       &arg, sizeof(arg));
+}
+
+static struct io_uring_sqe* uring_get_sqe(lb_uring_t* r) {
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (r->sqe_tail - head >= r->sq_entries) {
+        // SQ full: hand what we have to the kernel before queueing more
+        if (uring_submit(r, 0, 0) < 0) return NULL;
+        head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        if (r->sqe_tail - head >= r->sq_entries) return NULL;
+    }
+    unsigned idx = r->sqe_tail & r->sq_mask;
+    struct io_uring_sqe* sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    r->sqe_tail++;
+    return sqe;
+}
+
+static int uring_bufs_init(uring_worker_t* w) {
+    w->br_sz = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    w->br = mmap(NULL, w->br_sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (w->br == MAP_FAILED) {
+        w->br = NULL;
+        return -1;
+    }
+
+    w->bufs = (uint8_t*)malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    if (!w->bufs) return -1;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)w->br;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BGID;
+    if (uring_register(w->ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return -1;
+
+    for (uint16_t i = 0; i < URING_BUF_COUNT; i++) {
+        struct io_uring_buf* b = &w->br->bufs[i];
+        b->addr = (uint64_t)(uintptr_t)(w->bufs + (size_t)i * URING_BUF_SIZE);
+        b->len = URING_BUF_SIZE;
+        b->bid = i;
+    }
+    w->br_tail = URING_BUF_COUNT;
+    __atomic_store_n(&w->br->tail, w->br_tail, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static void uring_bufs_exit(uring_worker_t* w) {
+    if (w->br) munmap(w->br, w->br_sz);
+    free(w->bufs);
+    w->br = NULL;
+    w->bufs = NULL;
+}
+
+static inline uint8_t* uring_buf_addr(uring_worker_t* w, uint16_t bid) {
+    return w->bufs + (size_t)bid * URING_BUF_SIZE;
+}
+
+static bool uring_queue_recv(uring_worker_t* w, uring_conn_t* c, int dir);
+static void uring_conn_close(uring_worker_t* w, uring_conn_t* c, bool graceful);
+static void uring_conn_free(uring_worker_t* w, uring_conn_t* c);
+
+// Hand a buffer back to the kernel and wake one reader that ran dry
+static void uring_buf_recycle(uring_worker_t* w, uint16_t bid) {
+    struct io_uring_buf* b = &w->br->bufs[w->br_tail & (URING_BUF_COUNT - 1)];
+    b->addr = (uint64_t)(uintptr_t)uring_buf_addr(w, bid);
+    b->len = URING_BUF_SIZE;
+    b->bid = bid;
+    w->br_tail++;
+    __atomic_store_n(&w->br->tail, w->br_tail, __ATOMIC_RELEASE);
+
+    uring_dir_t* d = w->starved_head;
+    if (d) {
+        w->starved_head = d->next_starved;
+        if (!w->starved_head) w->starved_tail = NULL;
+        d->next_starved = NULL;
+        d->starved = false;
+        uring_conn_t* c = d->conn;
+        if (!uring_queue_recv(w, c, (int)(d - c->dir))) {
+            uring_conn_close(w, c, false);
+            if (c->inflight == 0) uring_conn_free(w, c);
+        }
+    }
+}
+
+static void uring_starve(uring_worker_t* w, uring_dir_t* d) {
+    d->starved = true;
+    d->next_starved = NULL;
+    if (w->starved_tail) {
+        w->starved_tail->next_starved = d;
+    } else {
+        w->starved_head = d;
+    }
+    w->starved_tail = d;
+}
+
+static void uring_unstarve(uring_worker_t* w, uring_dir_t* d) {
+    uring_dir_t* prev = NULL;
+    for (uring_dir_t* it = w->starved_head; it; prev = it, it = it->next_starved) {
+        if (it != d) continue;
+        if (prev) {
+            prev->next_starved = it->next_starved;
+        } else {
+            w->starved_head = it->next_starved;
+        }
+        if (w->starved_tail == it) w->starved_tail = prev;
+        break;
+    }
+    d->starved = false;
+    d->next_starved = NULL;
+}
+
+static bool uring_queue_accept(uring_worker_t* w) {
+    struct io_uring_sqe* sqe = uring_get_sqe(&w->ring);
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = w->worker->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = URING_UD(NULL, URING_OP_ACCEPT, 0);
+    return true;
+}
+
+// The listeners went to a new process: the cancel completes as an accept
+// with dir 1
+static bool uring_cancel_accept(uring_worker_t* w) {
+    struct io_uring_sqe* sqe = uring_get_sqe(&w->ring);
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = URING_UD(NULL, URING_OP_ACCEPT, 0);
+    sqe->user_data = URING_UD(NULL, URING_OP_ACCEPT, 1);
+    return true;
+}
+
+static bool uring_queue_connect(uring_worker_t* w, uring_conn_t* c) {
+    struct io_uring_sqe* sqe = uring_get_sqe(&w->ring);
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->fd = c->fd[URING_BACKEND];
+    sqe->addr = (uint64_t)(uintptr_t)&c->backend_addr;
+    sqe->off = c->backend_addr_len;
+    sqe->user_data = URING_UD(c, URING_OP_CONNECT, 0);
+    c->inflight++;
+    return true;
+}
+
+static bool uring_queue_recv(uring_worker_t* w, uring_conn_t* c, int dir) {
+    struct io_uring_sqe* sqe = uring_get_sqe(&w->ring);
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd[dir];
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = URING_UD(c, URING_OP_RECV, dir);
+    c->inflight++;
+    return true;
+}
+
+static bool uring_queue_send(uring_worker_t* w, uring_conn_t* c, int dir) {
+    uring_dir_t* d = &c->dir[dir];
+    struct io_uring_sqe* sqe = uring_get_sqe(&w->ring);
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = c->fd[!dir];
+    sqe->addr = (uint64_t)(uintptr_t)(uring_buf_addr(w, d->bid) + d->off);
+    sqe->len = d->len - d->off;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = URING_UD(c, URING_OP_SEND, dir);
+    c->inflight++;
+    return true;
+}
+
+static void uring_queue_remove(uring_worker_t* w, uring_conn_t* c) {
+    uring_conn_t** at = &w->queue_head;
+    uring_conn_t* prev = NULL;
+    while (*at != c) {
+        prev = *at;
+        at = &(*at)->queue_next;
+    }
+    *at = c->queue_next;
+    if (w->queue_tail == c) w->queue_tail = prev;
+    c->queue_next = NULL;
+    c->queued_ms = 0;
+    atomic_fetch_sub(&w->lb->queued, 1);
+}
+
+// Deadline for c's current state, UINT64_MAX when that timeout is disabled
+static uint64_t uring_conn_deadline(const loadbalancer_t* lb, const uring_conn_t* c) {
+    uint32_t timeout;
+
+    if (c->connecting) {
+        timeout = lb->config.connect_timeout_ms;
+    } else if (c->dir[URING_CLIENT].has_buf || c->dir[URING_BACKEND].has_buf) {
+        timeout = lb->config.write_timeout_ms;
+    } else {
+        timeout = lb->config.read_timeout_ms;
+    }
+
+    return timeout ? c->last_active_ms + timeout : UINT64_MAX;
+}
+
+static void uring_conn_schedule(uring_worker_t* w, uring_conn_t* c) {
+    uint64_t deadline = uring_conn_deadline(w->lb, c);
+
+    // A disabled timeout is re-checked now and then: the state may change
+    if (deadline == UINT64_MAX) deadline = c->last_active_ms + URING_MAX_WAIT_MS;
+    lb_timer_add(&w->timers, &c->timer, deadline);
+}
+
+static void uring_conn_free(uring_worker_t* w, uring_conn_t* c) {
+    lb_timer_cancel(&w->timers, &c->timer);
+    if (c->queued_ms) uring_queue_remove(w, c);
+    for (int dir = 0; dir < 2; dir++) {
+        if (c->dir[dir].starved) uring_unstarve(w, &c->dir[dir]);
+        if (c->dir[dir].has_buf) {
+            c->dir[dir].has_buf = false;
+            uring_buf_recycle(w, c->dir[dir].bid);
+        }
+    }
+
+    if (c->fd[URING_CLIENT] >= 0) {
+        if (c->graceful) {
+            // Accepted sockets inherit SO_LINGER {1,0} from the listener;
+            // a completed response must not be cut off by an RST
+            struct linger lng = {0, 0};
+            setsockopt(c->fd[URING_CLIENT], SOL_SOCKET, SO_LINGER, &lng, sizeof(lng));
+        }
+        close(c->fd[URING_CLIENT]);
+    }
+    if (c->fd[URING_BACKEND] >= 0) close(c->fd[URING_BACKEND]);
+
+    if (c->backend) {
+        atomic_store(&c->backend->response_time_ns, get_time_ns() - c->start_time_ns);
+        lb_backend_release(w->lb, c->backend);
+    }
+    lb_stat_add(&w->worker->stats->conns_closed, 1);
+
+    if (c->prev) c->prev->next = c->next;
+    else w->conns = c->next;
+    if (c->next) c->next->prev = c->prev;
+    free(c);
+}
+
+// Start tearing a connection down; the reaper frees it once no SQE
+// references it any more
+static void uring_conn_close(uring_worker_t* w, uring_conn_t* c, bool graceful) {
+    if (c->closing) return;
+    c->closing = true;
+    c->graceful = graceful;
+    lb_timer_cancel(&w->timers, &c->timer);
+    for (int dir = 0; dir < 2; dir++) {
+        if (c->dir[dir].starved) uring_unstarve(w, &c->dir[dir]);
+    }
+    // Pending recvs and sends hold the sockets open; shutdown() makes them
+    // complete so the connection can drain out of the ring
+    if (c->inflight > 0) {
+        for (int i = 0; i < 2; i++) {
+            if (c->fd[i] >= 0) shutdown(c->fd[i], SHUT_RDWR);
+        }
+    }
+}
+
+static void uring_conn_abort(uring_worker_t* w, uring_conn_t* c) {
+    uring_conn_close(w, c, false);
+    uring_conn_free(w, c);
+}
+
+static const char uring_503[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+// Nothing is in flight for a client that never got a backend, so the
+// answer goes out directly and the connection is freed at once
+static void uring_reply_busy(uring_worker_t* w, uring_conn_t* c) {
+    int fd = c->fd[URING_CLIENT];
+    lb_stat_add(&w->worker->stats->failed_requests, 1);
+    send(fd, uring_503, sizeof(uring_503) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+    shutdown(fd, SHUT_WR);
+
+    // What the client sent meanwhile would turn the close into an RST
+    char discard[URING_BUF_SIZE];
+    for (int i = 0; i < 4; i++) {
+        if (recv(fd, discard, sizeof(discard), MSG_DONTWAIT) <= 0) break;
+    }
+    uring_conn_close(w, c, true);
+    uring_conn_free(w, c);
+}
+
+static bool uring_queue_add(uring_worker_t* w, uring_conn_t* c) {
+    loadbalancer_t* lb = w->lb;
+    if (atomic_fetch_add(&lb->queued, 1) >= lb->config.queue_max) {
+        atomic_fetch_sub(&lb->queued, 1);
+        return false;
+    }
+    c->queued_ms = w->worker->now_ms ? w->worker->now_ms : 1;
+    c->queue_next = NULL;
+    if (w->queue_tail) w->queue_tail->queue_next = c;
+    else w->queue_head = c;
+    w->queue_tail = c;
+    return true;
+}
+
+// Connect c to backend, whose slot it holds
+static void uring_conn_connect(uring_worker_t* w, uring_conn_t* c, backend_t* backend) {
+    c->backend = backend;
+    if (lb_net_resolve_backend(backend, &c->backend_addr, &c->backend_addr_len) == 0) {
+        c->fd[URING_BACKEND] = socket(c->backend_addr.sa.sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    }
+    if (c->fd[URING_BACKEND] < 0) {
+        atomic_fetch_add(&backend->failed_conns, 1);
+        lb_stat_add(&w->worker->stats->failed_requests, 1);
+        uring_conn_abort(w, c);
+        return;
+    }
+    int val = 1;
+    setsockopt(c->fd[URING_BACKEND], IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+    atomic_fetch_add(&backend->total_conns, 1);
+
+    // Client bytes can queue up in its socket while the backend connects
+    if (!uring_queue_connect(w, c)) {
+        uring_conn_abort(w, c);
+        return;
+    }
+    c->connecting = true;
+    c->last_active_ms = w->worker->now_ms;
+    uring_conn_schedule(w, c);
+}
+
+static void uring_handle_accept(uring_worker_t* w, int res, uint32_t flags) {
+    loadbalancer_t* lb = w->lb;
+
+    if (!(flags & IORING_CQE_F_MORE) && lb->running && w->accepting) {
+        // Multishot accept terminated (error or overflow); re-arm it
+        uring_queue_accept(w);
+    }
+    if (res < 0) {
+        if (res != -EAGAIN && res != -ECANCELED) {
+            LB_ERROR_RATELIMIT(5, 1000, "io_uring accept: %s", strerror(-res));
+        }
+        return;
+    }
+
+    int client_fd = res;
+    lb_stat_add(&w->worker->stats->total_requests, 1);
+
+    uring_conn_t* c = (uring_conn_t*)calloc(1, sizeof(uring_conn_t));
+    if (!c) {
+        LB_ERROR_RATELIMIT(5, 1000, "Failed to allocate connection struct");
+        close(client_fd);
+        return;
+    }
+    lb_stat_add(&w->worker->stats->conns_opened, 1);
+    c->fd[URING_CLIENT] = client_fd;
+    c->fd[URING_BACKEND] = -1;
+    c->start_time_ns = get_time_ns();
+    for (int dir = 0; dir < 2; dir++) c->dir[dir].conn = c;
+    c->next = w->conns;
+    if (w->conns) w->conns->prev = c;
+    w->conns = c;
+
+    int val = 1;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+
+    // Multishot accept shares one sockaddr between completions, so the peer
+    // address is only fetched when the algorithm needs it
+    if (lb->algorithm == LB_ALGO_SOURCE) {
+        socklen_t addr_len = sizeof(c->client_addr);
+        getpeername(client_fd, (struct sockaddr*)&c->client_addr, &addr_len);
+    }
+
+    // Behind clients already waiting, or with every backend full, join the
+    // queue; past queue_max the client is told so
+    bool full = atomic_load_explicit(&lb->queued, memory_order_relaxed) > 0;
+    backend_t* backend = full ? NULL : lb_backend_admit(lb, &c->client_addr, &full);
+    if (full) {
+        if (!uring_queue_add(w, c)) {
+            LB_ERROR_RATELIMIT(5, 1000, "Backends and admission queue full");
+            uring_reply_busy(w, c);
+        }
+        return;
+    }
+    if (!backend) {
+        uring_conn_abort(w, c);
+        return;
+    }
+    uring_conn_connect(w, c, backend);
+}
+
+// Hand the slots freed since the last batch to the oldest waiters, and
+// answer those that waited queue_timeout_ms with 503
+static void uring_queue_dispatch(uring_worker_t* w) {
+    loadbalancer_t* lb = w->lb;
+    uint64_t now_ms = w->worker->now_ms;
+
+    while (w->queue_head) {
+        uring_conn_t* c = w->queue_head;
+        if (now_ms - c->queued_ms >= lb->config.queue_timeout_ms) {
+            uring_reply_busy(w, c);
+            continue;
+        }
+
+        bool full;
+        backend_t* backend = lb_backend_admit(lb, &c->client_addr, &full);
+        if (full) break;
+
+        uring_queue_remove(w, c);
+        if (!backend) {
+            uring_conn_abort(w, c);
+            continue;
+        }
+        uring_conn_connect(w, c, backend);
+    }
+}
+
+static void uring_handle_connect(uring_worker_t* w, uring_conn_t* c, int res) {
+    c->connecting = false;
+    if (c->closing) return;
+    if (res < 0) {
+        atomic_fetch_add(&c->backend->failed_conns, 1);
+        lb_stat_add(&w->worker->stats->failed_requests, 1);
+        lb_backend_report(w->lb, c->backend, LB_OUTCOME_CONNECT_FAIL);
+        uring_conn_close(w, c, false);
+        return;
+    }
+    if (!uring_queue_recv(w, c, URING_CLIENT) || !uring_queue_recv(w, c, URING_BACKEND)) {
+        uring_conn_close(w, c, false);
+        return;
+    }
+    // The read timeout may be shorter than the connect timeout armed
+    c->last_active_ms = w->worker->now_ms;
+    if (uring_conn_deadline(w->lb, c) < c->timer.expires) uring_conn_schedule(w, c);
+}
+
+static void uring_handle_recv(uring_worker_t* w, uring_conn_t* c, int dir, int res, uint32_t flags) {
+    uring_dir_t* d = &c->dir[dir];
+
+    if (flags & IORING_CQE_F_BUFFER) {
+        d->bid = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+        d->has_buf = true;
+    }
+    if (c->closing) return;
+
+    if (res > 0) {
+        c->last_active_ms = w->worker->now_ms;
+        if (dir == URING_BACKEND && c->backend && c->rsp_wait_ns && c->rsp_wait_ns != UINT64_MAX) {
+            lb_backend_observe(c->backend, get_time_ns() - c->rsp_wait_ns);
+            lb_backend_report(w->lb, c->backend, LB_OUTCOME_OK);
+            c->rsp_wait_ns = UINT64_MAX;
+        }
+        d->len = (uint32_t)res;
+        d->off = 0;
+        if (!uring_queue_send(w, c, dir)) uring_conn_close(w, c, false);
+        return;
+    }
+    if (res == -ENOBUFS) {
+        // Every buffer is in flight; retry once one comes back
+        uring_starve(w, d);
+        return;
+    }
+    // EOF from either peer ends the connection, as on the epoll path;
+    // everything read before it has already been sent
+    if (res == -ECONNRESET && dir == URING_BACKEND && c->backend) {
+        lb_backend_report(w->lb, c->backend, LB_OUTCOME_RESET);
+    }
+    uring_conn_close(w, c, res == 0 && dir == URING_BACKEND);
+}
+
+static void uring_handle_send(uring_worker_t* w, uring_conn_t* c, int dir, int res) {
+    uring_dir_t* d = &c->dir[dir];
+
+    if (res > 0) {
+        c->last_active_ms = w->worker->now_ms;
+        d->off += (uint32_t)res;
+        lb_worker_stats_t* st = w->worker->stats;
+        if (dir == URING_CLIENT) {
+            if (c->rsp_wait_ns == 0) c->rsp_wait_ns = get_time_ns();
+            lb_stat_add(&st->bytes_in, res);
+            if (c->backend) lb_stat_add(&st->backends[c->backend->id].bytes_in, res);
+        } else {
+            lb_stat_add(&st->bytes_out, res);
+            if (c->backend) lb_stat_add(&st->backends[c->backend->id].bytes_out, res);
+        }
+    }
+    if (c->closing) return;
+    if (res <= 0) {
+        uring_conn_close(w, c, false);
+        return;
+    }
+    if (d->off < d->len) {
+        if (!uring_queue_send(w, c, dir)) uring_conn_close(w, c, false);
+        return;
+    }
+
+    d->has_buf = false;
+    uring_buf_recycle(w, d->bid);
+    if (!c->closing && !d->starved && !uring_queue_recv(w, c, dir)) {
+        uring_conn_close(w, c, false);
+    }
+}
+
+static void uring_timer_fired(lb_timer_t* timer, void* arg) {
+    uring_conn_t** expired = (uring_conn_t**)arg;
+    uring_conn_t* c = (uring_conn_t*)((char*)timer - offsetof(uring_conn_t, timer));
+    c->next_expired = *expired;
+    *expired = c;
+}
+
+// Turn the wheel and close whatever really timed out
+static void uring_expire_timers(uring_worker_t* w) {
+    uring_conn_t* expired = NULL;
+    lb_timer_advance(&w->timers, w->worker->now_ms, uring_timer_fired, &expired);
+
+    while (expired) {
+        uring_conn_t* c = expired;
+        expired = c->next_expired;
+
+        if (uring_conn_deadline(w->lb, c) > w->worker->now_ms) {
+            uring_conn_schedule(w, c);
+            continue;
+        }
+        LB_DEBUG("Connection timed out (fd=%d)", c->fd[URING_CLIENT]);
+        if (c->connecting) {
+            atomic_fetch_add(&c->backend->failed_conns, 1);
+            lb_stat_add(&w->worker->stats->failed_requests, 1);
+            lb_backend_report(w->lb, c->backend, LB_OUTCOME_CONNECT_FAIL);
+        }
+        uring_conn_close(w, c, false);
+        if (c->inflight == 0) uring_conn_free(w, c);
+    }
+}
+
+static int uring_worker_init(uring_worker_t* w, lb_worker_t* worker) {
+    memset(w, 0, sizeof(*w));
+    w->worker = worker;
+    w->lb = worker->lb;
+    lb_timer_wheel_init(&w->timers, get_time_ns() / 1000000);
+    if (uring_ring_init(&w->ring, URING_ENTRIES) < 0) return -1;
+    if (uring_bufs_init(w) < 0) {
+        uring_bufs_exit(w);
+        uring_ring_exit(&w->ring);
+        return -1;
+    }
+    return 0;
+}
+
+static void uring_worker_exit(uring_worker_t* w) {
+    // Closing the ring cancels whatever is still in flight
+    uring_ring_exit(&w->ring);
+    while (w->conns) {
+        uring_conn_t* c = w->conns;
+        for (int dir = 0; dir < 2; dir++) {
+            c->dir[dir].starved = false;
+            c->dir[dir].has_buf = false;
+        }
+        c->inflight = 0;
+        uring_conn_free(w, c);
+    }
+    uring_bufs_exit(w);
+}
+
+bool lb_uring_available(void) {
+    uring_worker_t w;
+    memset(&w, 0, sizeof(w));
+    if (uring_ring_init(&w.ring, 8) < 0) return false;
+    bool ok = uring_bufs_init(&w) == 0;
+    uring_bufs_exit(&w);
+    uring_ring_exit(&w.ring);
+    return ok;
+}
+
+void* worker_thread_uring(void* arg) {
+    lb_worker_t* worker = (lb_worker_t*)arg;
+    loadbalancer_t* lb = worker->lb;
+
+    uring_worker_t* w = (uring_worker_t*)calloc(1, sizeof(uring_worker_t));
+    if (!w || uring_worker_init(w, worker) < 0) {
+        LB_WARN("Worker %u: io_uring setup failed (%s), using epoll", worker->id, strerror(errno));
+        free(w);
+        return worker_thread_v2(arg);
+    }
+    w->accepting = uring_queue_accept(w);
+
+    // Never holds epoll events, so never delays epoll workers' reclamation
+    atomic_store(&worker->quiescent_epoch, UINT64_MAX);
+
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(worker->cpu, &cpuset);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+
+    while (lb->running) {
+        if (w->accepting && !atomic_load(&lb->accepting) && uring_cancel_accept(w)) {
+            w->accepting = false;
+        }
+
+        // Slots other workers free are only seen between batches
+        uint64_t wait_ns = (uint64_t)lb_timer_next_timeout(&w->timers, URING_WAIT_NS / 1000000) * 1000000;
+        if (w->queue_head && wait_ns > URING_QUEUE_WAIT_NS) wait_ns = URING_QUEUE_WAIT_NS;
+        int ret = uring_submit(&w->ring, 1, wait_ns);
+        if (ret < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+            perror("io_uring_enter");
+            break;
+        }
+        worker->now_ms = get_time_ns() / 1000000;
+
+        unsigned head = *w->ring.cq_head;
+        unsigned tail = __atomic_load_n(w->ring.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe* cqe = &w->ring.cqes[head & w->ring.cq_mask];
+            uint64_t ud = cqe->user_data;
+            int res = cqe->res;
+            uint32_t flags = cqe->flags;
+            head++;
+
+            uring_conn_t* c = URING_UD_CONN(ud);
+            int op = URING_UD_OP(ud);
+            int dir = URING_UD_DIR(ud);
+
+            if (op == URING_OP_ACCEPT) {
+                if (!dir) uring_handle_accept(w, res, flags);
+                continue;
+            }
+
+            c->inflight--;
+            switch (op) {
+                case URING_OP_CONNECT: uring_handle_connect(w, c, res); break;
+                case URING_OP_RECV:    uring_handle_recv(w, c, dir, res, flags); break;
+                case URING_OP_SEND:    uring_handle_send(w, c, dir, res); break;
+            }
+            if (c->closing && c->inflight == 0) uring_conn_free(w, c);
+
+            // Release the slot as we go so the kernel can keep posting
+            if (head == tail) {
+                __atomic_store_n(w->ring.cq_head, head, __ATOMIC_RELEASE);
+                tail = __atomic_load_n(w->ring.cq_tail, __ATOMIC_ACQUIRE);
+            }
+        }
+        __atomic_store_n(w->ring.cq_head, head, __ATOMIC_RELEASE);
+
+        uring_expire_timers(w);
+        if (w->queue_head) uring_queue_dispatch(w);
+    }
+
+    uring_worker_exit(w);
+    free(w);
+    return NULL;
+}
+
+#else /* !USE_IO_URING */
+
+bool lb_uring_available(void) {
+    return false;
+}
+
+void* worker_thread_uring(void* arg) {
+    return worker_thread_v2(arg);
+}
+
+#endif /* USE_IO_URING */
@@ -0,0 +1,698 @@
+#include "peers.h"
+#include "utils/log.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+/* Counter fields in STKTABLE_DATA_* bit order */
+static const struct {
+    size_t off;
+    uint8_t size;
+} peers_fields[] = {
+    { offsetof(stick_counter_t, conn_cnt), 4 },
+    { offsetof(stick_counter_t, conn_cur), 4 },
+    { offsetof(stick_counter_t, conn_rate), 4 },
+    { offsetof(stick_counter_t, sess_cnt), 4 },
+    { offsetof(stick_counter_t, sess_rate), 4 },
+    { offsetof(stick_counter_t, http_req_cnt), 4 },
+    { offsetof(stick_counter_t, http_req_rate), 4 },
+    { offsetof(stick_counter_t, http_err_cnt), 4 },
+    { offsetof(stick_counter_t, http_err_rate), 4 },
+    { offsetof(stick_counter_t, bytes_in), 8 },
+    { offsetof(stick_counter_t, bytes_out), 8 },
+    { offsetof(stick_counter_t, server_id), 4 },
+    { offsetof(stick_counter_t, gpc0), 4 },
+    { offsetof(stick_counter_t, gpc1), 4 },
+};
+
+#define PEERS_NFIELDS   (sizeof(peers_fields) / sizeof(peers_fields[0]))
+#define PEERS_MSG_MAX   UINT16_MAX
+/* Largest UPDATE besides its key: header, key length, expire, mask, counters */
+#define PEERS_UPDATE_OVERHEAD  (3 + 10 + 10 + 5 + PEERS_NFIELDS * 10)
+
+static uint64_t peers_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static size_t peers_put_varint(uint8_t *p, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    p[n++] = (uint8_t)v;
+    return n;
+}
+
+static int peers_get_varint(const uint8_t **p, const uint8_t *end, uint64_t *v) {
+    uint64_t r = 0;
+    for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+        uint8_t b = *(*p)++;
+        r |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = r;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Fixed wire length of a key type; 0 for the length-prefixed ones */
+static size_t peers_key_len(int type) {
+    switch (type) {
+        case STKTABLE_TYPE_IP:      return sizeof(struct in_addr);
+        case STKTABLE_TYPE_IPV6:    return sizeof(struct in6_addr);
+        case STKTABLE_TYPE_INTEGER: return sizeof(uint32_t);
+    }
+    return 0;
+}
+
+static inline void* peers_field(stick_entry_t *entry, size_t i) {
+    return (char*)&entry->counters + peers_fields[i].off;
+}
+
+static uint64_t peers_field_get(stick_entry_t *entry, size_t i) {
+    if (peers_fields[i].size == 8) {
+        return atomic_load_explicit((_Atomic uint64_t*)peers_field(entry, i), memory_order_relaxed);
+    }
+    return atomic_load_explicit((_Atomic uint32_t*)peers_field(entry, i), memory_order_relaxed);
+}
+
+static void peers_field_set(stick_entry_t *entry, size_t i, uint64_t v) {
+    if (peers_fields[i].size == 8) {
+        atomic_store_explicit((_Atomic uint64_t*)peers_field(entry, i), v, memory_order_relaxed);
+    } else {
+        atomic_store_explicit((_Atomic uint32_t*)peers_field(entry, i), (uint32_t)v, memory_order_relaxed);
+    }
+}
+
+static inline void peers_msg_header(uint8_t *out, uint8_t type, size_t payload) {
+    out[0] = type;
+    out[1] = (uint8_t)(payload >> 8);
+    out[2] = (uint8_t)payload;
+}
+
+/* Each encoder returns the bytes written, or 0 when room is too small */
+static size_t peers_encode_hello(uint8_t *out, size_t room, const char *name) {
+    size_t len = strlen(name);
+    if (len > 255 || room < 4 + len) return 0;
+
+    out[3] = PEERS_VERSION;
+    memcpy(out + 4, name, len);
+    peers_msg_header(out, PEERS_MSG_HELLO, 1 + len);
+    return 4 + len;
+}
+
+static size_t peers_encode_table(uint8_t *out, size_t room, const stick_table_t *t) {
+    size_t len = strlen(t->id);
+    if (len > 255 || room < 4 + len) return 0;
+
+    out[3] = (uint8_t)t->type;
+    memcpy(out + 4, t->id, len);
+    peers_msg_header(out, PEERS_MSG_TABLE, 1 + len);
+    return 4 + len;
+}
+
+static size_t peers_encode_update(uint8_t *out, size_t room, stick_entry_t *entry, uint32_t mask, time_t now) {
+    const stick_key_t *key = &entry->key;
+    size_t fixed = peers_key_len(key->type);
+    const void *kp = &key->data;
+    size_t klen = fixed;
+
+    if (key->type == STKTABLE_TYPE_STRING) {
+        kp = key->data.str.ptr;
+        klen = key->data.str.len;
+    } else if (key->type == STKTABLE_TYPE_BINARY) {
+        kp = key->data.bin.ptr;
+        klen = key->data.bin.len;
+    }
+
+    if (klen + PEERS_UPDATE_OVERHEAD > PEERS_MSG_MAX || room < klen + PEERS_UPDATE_OVERHEAD) {
+        return 0;
+    }
+
+    uint8_t *p = out + 3;
+    if (!fixed) {
+        p += peers_put_varint(p, klen);
+    }
+    memcpy(p, kp, klen);
+    p += klen;
+
+    time_t expire = atomic_load_explicit(&entry->expire, memory_order_relaxed);
+    p += peers_put_varint(p, expire > now ? (uint64_t)(expire - now) : 0);
+
+    mask &= (1u << PEERS_NFIELDS) - 1;
+    p += peers_put_varint(p, mask);
+    for (size_t i = 0; i < PEERS_NFIELDS; i++) {
+        if (mask & (1u << i)) {
+            p += peers_put_varint(p, peers_field_get(entry, i));
+        }
+    }
+
+    peers_msg_header(out, PEERS_MSG_UPDATE, (size_t)(p - out) - 3);
+    return (size_t)(p - out);
+}
+
+/* Whole messages only; false when the peer is too far behind */
+static bool peer_queue(peer_t *peer, const void *data, size_t len) {
+    if (peer->out_len + len > PEERS_BUF_SIZE) {
+        return false;
+    }
+    memcpy(peer->out + peer->out_len, data, len);
+    peer->out_len += len;
+    return true;
+}
+
+static void peer_resync_restart(peers_t *p, peer_t *peer) {
+    peer->resync = true;
+    peer->resync_table = 0;
+    peer->resync_pos = 0;
+    atomic_fetch_add_explicit(&p->stats.resyncs, 1, memory_order_relaxed);
+}
+
+/* A peer that cannot take the batch gets a full dump once it catches up */
+static void peers_send_batch(peers_t *p, size_t len) {
+    for (peer_t *peer = p->peers; peer; peer = peer->next) {
+        if (peer->connected && !peer_queue(peer, p->batch, len)) {
+            atomic_fetch_add_explicit(&p->stats.overflows, 1, memory_order_relaxed);
+            peer_resync_restart(p, peer);
+        }
+    }
+}
+
+/* Encode every dirty entry once and hand the batches to all peers */
+static void peers_flush(peers_t *p, time_t now) {
+    uint8_t *batch = (uint8_t*)p->batch;
+
+    for (uint32_t ti = 0; ti < p->ntables; ti++) {
+        stick_table_t *t = p->tables[ti];
+        stick_entry_t *entry = stktable_take_dirty(t);
+        if (!entry) continue;
+
+        size_t head = peers_encode_table(batch, PEERS_BUF_SIZE, t);
+        size_t len = head;
+
+        while (entry) {
+            /* Read the link first: once dirty is cleared the entry may be
+             * queued again by an update */
+            stick_entry_t *next = entry->dirty_next;
+            uint32_t mask = atomic_load_explicit(&entry->dirty, memory_order_acquire);
+
+            size_t n = peers_encode_update(batch + len, PEERS_BUF_SIZE - len, entry, mask, now);
+            if (!n && len > head) {
+                peers_send_batch(p, len);
+                len = head;
+                n = peers_encode_update(batch + len, PEERS_BUF_SIZE - len, entry, mask, now);
+            }
+            len += n;
+            if (n) {
+                atomic_fetch_add_explicit(&p->stats.updates_out, 1, memory_order_relaxed);
+            }
+
+            /* Changes that raced with the encoding queue it once more */
+            if (atomic_fetch_and_explicit(&entry->dirty, ~mask, memory_order_acq_rel) & ~mask) {
+                stktable_mark_dirty(t, entry, atomic_exchange_explicit(&entry->dirty, 0, memory_order_acq_rel));
+            }
+            entry = next;
+        }
+
+        if (len > head) {
+            peers_send_batch(p, len);
+        }
+    }
+}
+
+/* Continue a peer's full dump while its buffer has room to spare */
+static void peers_resync_pump(peers_t *p, peer_t *peer, time_t now) {
+    while (peer->resync && peer->out_len < PEERS_BUF_SIZE / 2) {
+        if (peer->resync_table >= p->ntables) {
+            peer->resync = false;
+            log_info("Peers: full resync to '%s' queued", peer->name);
+            return;
+        }
+
+        stick_table_t *t = p->tables[peer->resync_table];
+        uint8_t *out = (uint8_t*)peer->out + peer->out_len;
+        size_t room = PEERS_BUF_SIZE - peer->out_len;
+        size_t head = peers_encode_table(out, room, t);
+        size_t len = head;
+        bool done = false;
+
+        while (len < room / 2) {
+            uint32_t at = peer->resync_pos;
+            stick_entry_t *entry = stktable_next(t, &peer->resync_pos);
+            if (!entry) {
+                done = true;
+                break;
+            }
+
+            /* Only what is set; the peer has zeroes for the rest */
+            uint32_t mask = 0;
+            for (size_t i = 0; i < PEERS_NFIELDS; i++) {
+                if (peers_field_get(entry, i)) mask |= 1u << i;
+            }
+
+            size_t n = peers_encode_update(out + len, room - len, entry, mask, now);
+            if (!n && len > head) {
+                peer->resync_pos = at;   /* next round */
+                break;
+            }
+            len += n;
+        }
+
+        if (len > head) {
+            peer->out_len += len;
+        }
+        if (done) {
+            peer->resync_table++;
+            peer->resync_pos = 0;
+        }
+    }
+}
+
+static void peer_down(peer_t *peer, uint64_t now_ms) {
+    if (peer->connected) {
+        log_warning("Peers: lost connection to '%s'", peer->name);
+    }
+    close(peer->fd);
+    peer->fd = -1;
+    peer->connected = false;
+    peer->resync = false;
+    peer->out_len = 0;
+    peer->retry_ms = now_ms + PEERS_RETRY_MS;
+}
+
+static void peer_connect(peer_t *peer, uint64_t now_ms) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        peer->retry_ms = now_ms + PEERS_RETRY_MS;
+        return;
+    }
+
+    if (connect(fd, (struct sockaddr*)&peer->addr, sizeof(peer->addr)) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        peer->retry_ms = now_ms + PEERS_RETRY_MS;
+        return;
+    }
+
+    peer->fd = fd;
+    peer->connected = false;
+}
+
+/* Connected: introduce ourselves and owe the peer everything we have */
+static void peer_established(peers_t *p, peer_t *peer) {
+    peer->connected = true;
+    peer->out_len = peers_encode_hello((uint8_t*)peer->out, PEERS_BUF_SIZE, p->local);
+    peer_resync_restart(p, peer);
+    log_info("Peers: connected to '%s'", peer->name);
+}
+
+static int peer_write(peer_t *peer) {
+    while (peer->out_len > 0) {
+        ssize_t n = send(peer->fd, peer->out, peer->out_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+        }
+        memmove(peer->out, peer->out + n, peer->out_len - (size_t)n);
+        peer->out_len -= (size_t)n;
+    }
+    return 0;
+}
+
+static stick_table_t* peers_find_table(peers_t *p, int type, const char *id, size_t len) {
+    for (uint32_t i = 0; i < p->ntables; i++) {
+        stick_table_t *t = p->tables[i];
+        if (t->type == type && strlen(t->id) == len && memcmp(t->id, id, len) == 0) {
+            return t;
+        }
+    }
+    return NULL;
+}
+
+/* Apply one UPDATE without marking the entry dirty, so it is not echoed */
+static int peers_apply_update(peers_t *p, stick_table_t *t, const uint8_t *msg, size_t len, time_t now) {
+    const uint8_t *pos = msg, *end = msg + len;
+    stick_key_t key = { .type = t->type };
+    size_t fixed = peers_key_len(t->type);
+
+    if (fixed) {
+        if (len < fixed) return -1;
+        memcpy(&key.data, pos, fixed);
+        pos += fixed;
+    } else {
+        uint64_t klen;
+        if (peers_get_varint(&pos, end, &klen) < 0 || klen > (uint64_t)(end - pos)) return -1;
+        if (t->type == STKTABLE_TYPE_STRING) {
+            key.data.str.ptr = (char*)pos;
+            key.data.str.len = (size_t)klen;
+        } else {
+            key.data.bin.ptr = (void*)pos;
+            key.data.bin.len = (size_t)klen;
+        }
+        pos += klen;
+    }
+
+    uint64_t expire_in, mask;
+    if (peers_get_varint(&pos, end, &expire_in) < 0 || peers_get_varint(&pos, end, &mask) < 0) {
+        return -1;
+    }
+
+    uint64_t values[PEERS_NFIELDS];
+    for (size_t i = 0; i < PEERS_NFIELDS; i++) {
+        if ((mask & (1u << i)) && peers_get_varint(&pos, end, &values[i]) < 0) {
+            return -1;
+        }
+    }
+
+    stick_entry_t *entry = stktable_get(t, &key);
+    if (!entry) return 0;   /* full of tracked entries; a later update may fit */
+
+    for (size_t i = 0; i < PEERS_NFIELDS; i++) {
+        if (mask & (1u << i)) {
+            peers_field_set(entry, i, values[i]);
+        }
+    }
+
+    time_t expire = now + (time_t)expire_in;
+    if (expire > atomic_load_explicit(&entry->expire, memory_order_relaxed)) {
+        atomic_store_explicit(&entry->expire, expire, memory_order_relaxed);
+    }
+
+    atomic_fetch_add_explicit(&p->stats.updates_in, 1, memory_order_relaxed);
+    return 0;
+}
+
+/* Parse the complete messages in conn's buffer; -1 closes it */
+static int peers_conn_parse(peers_t *p, peer_conn_t *conn, time_t now) {
+    const uint8_t *in = (const uint8_t*)conn->in;
+    size_t off = 0;
+
+    while (conn->in_len - off >= 3) {
+        uint8_t type = in[off];
+        size_t len = ((size_t)in[off + 1] << 8) | in[off + 2];
+        if (conn->in_len - off - 3 < len) break;
+
+        const uint8_t *msg = in + off + 3;
+        switch (type) {
+            case PEERS_MSG_HELLO:
+                if (len < 1 || msg[0] != PEERS_VERSION) {
+                    log_warning("Peers: rejected a peer speaking version %d", len ? msg[0] : -1);
+                    return -1;
+                }
+                log_info("Peers: '%.*s' connected", (int)(len - 1), (const char*)msg + 1);
+                break;
+
+            case PEERS_MSG_TABLE:
+                if (len < 1) return -1;
+                /* Unknown tables are skipped, so nodes may differ */
+                conn->table = peers_find_table(p, msg[0], (const char*)msg + 1, len - 1);
+                break;
+
+            case PEERS_MSG_UPDATE:
+                if (conn->table && peers_apply_update(p, conn->table, msg, len, now) < 0) {
+                    log_warning("Peers: malformed update for table '%s'", conn->table->id);
+                    return -1;
+                }
+                break;
+
+            default:
+                return -1;
+        }
+        off += 3 + len;
+    }
+
+    memmove(conn->in, conn->in + off, conn->in_len - off);
+    conn->in_len -= off;
+    return 0;
+}
+
+static int peers_conn_read(peers_t *p, peer_conn_t *conn, time_t now) {
+    for (;;) {
+        ssize_t n = recv(conn->fd, conn->in + conn->in_len, PEERS_BUF_SIZE - conn->in_len, 0);
+        if (n == 0) return -1;
+        if (n < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+        }
+        conn->in_len += (size_t)n;
+        if (peers_conn_parse(p, conn, now) < 0) return -1;
+    }
+}
+
+static void peers_conn_free(peer_conn_t *conn) {
+    close(conn->fd);
+    free(conn->in);
+    free(conn);
+}
+
+static void peers_accept(peers_t *p) {
+    for (;;) {
+        int fd = accept4(p->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) return;
+
+        peer_conn_t *conn = calloc(1, sizeof(*conn));
+        if (conn) conn->in = malloc(PEERS_BUF_SIZE);
+        if (!conn || !conn->in) {
+            free(conn);
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->next = p->inbound;
+        p->inbound = conn;
+    }
+}
+
+static void* peers_thread(void *arg) {
+    peers_t *p = arg;
+    struct pollfd *pfd = NULL;
+    void **who = NULL;
+    size_t cap = 0;
+    uint64_t next_flush = peers_now_ms() + PEERS_FLUSH_MS;
+
+    while (atomic_load_explicit(&p->running, memory_order_acquire)) {
+        uint64_t now_ms = peers_now_ms();
+        time_t now = time(NULL);
+
+        if (now_ms >= next_flush) {
+            peers_flush(p, now);
+            next_flush = now_ms + PEERS_FLUSH_MS;
+        }
+
+        size_t n = 1, want = 1;
+        for (peer_t *peer = p->peers; peer; peer = peer->next) want++;
+        for (peer_conn_t *conn = p->inbound; conn; conn = conn->next) want++;
+        if (want > cap) {
+            struct pollfd *np = realloc(pfd, want * sizeof(*pfd));
+            if (np) pfd = np;
+            void **nw = np ? realloc(who, want * sizeof(*who)) : NULL;
+            if (nw) who = nw;
+            if (!np || !nw) {
+                usleep(PEERS_FLUSH_MS * 1000);
+                continue;
+            }
+            cap = want;
+        }
+
+        pfd[0] = (struct pollfd){ .fd = p->listen_fd, .events = POLLIN };
+        who[0] = NULL;
+
+        for (peer_t *peer = p->peers; peer; peer = peer->next) {
+            if (peer->fd < 0 && now_ms >= peer->retry_ms) {
+                peer_connect(peer, now_ms);
+            }
+            if (peer->fd < 0) continue;
+            if (peer->connected) {
+                peers_resync_pump(p, peer, now);
+            }
+            pfd[n] = (struct pollfd){
+                .fd = peer->fd,
+                .events = POLLIN | ((!peer->connected || peer->out_len) ? POLLOUT : 0),
+            };
+            who[n++] = peer;
+        }
+        size_t first_in = n;
+        for (peer_conn_t *conn = p->inbound; conn; conn = conn->next) {
+            pfd[n] = (struct pollfd){ .fd = conn->fd, .events = POLLIN };
+            who[n++] = conn;
+        }
+
+        int timeout = next_flush > now_ms ? (int)(next_flush - now_ms) : 0;
+        if (poll(pfd, n, timeout) <= 0) continue;
+
+        now_ms = peers_now_ms();
+        now = time(NULL);
+
+        if (pfd[0].revents & POLLIN) {
+            peers_accept(p);
+        }
+
+        for (size_t i = 1; i < first_in; i++) {
+            peer_t *peer = who[i];
+            short ev = pfd[i].revents;
+            if (!ev) continue;
+
+            if (!peer->connected) {
+                int err = 0;
+                socklen_t elen = sizeof(err);
+                if (getsockopt(peer->fd, SOL_SOCKET, SO_ERROR, &err, &elen) < 0 || err) {
+                    peer_down(peer, now_ms);
+                    continue;
+                }
+                peer_established(p, peer);
+                peers_resync_pump(p, peer, now);
+            }
+
+            /* The peer never sends on this connection; reading is for EOF */
+            if (ev & (POLLIN | POLLHUP | POLLERR)) {
+                char sink[256];
+                ssize_t r = recv(peer->fd, sink, sizeof(sink), MSG_DONTWAIT);
+                if (r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                    peer_down(peer, now_ms);
+                    continue;
+                }
+            }
+            if (peer_write(peer) < 0) {
+                peer_down(peer, now_ms);
+            }
+        }
+
+        for (size_t i = first_in; i < n; i++) {
+            if (pfd[i].revents && peers_conn_read(p, who[i], now) < 0) {
+                peer_conn_t *conn = who[i];
+                for (peer_conn_t **pp = &p->inbound; *pp; pp = &(*pp)->next) {
+                    if (*pp == conn) {
+                        *pp = conn->next;
+                        break;
+                    }
+                }
+                peers_conn_free(conn);
+            }
+        }
+    }
+
+    free(pfd);
+    free(who);
+    return NULL;
+}
+
+peers_t* peers_new(const char *local, const char *bind_addr, uint16_t port) {
+    peers_t *p = calloc(1, sizeof(*p));
+    if (!p) return NULL;
+
+    p->local = strdup(local);
+    p->batch = malloc(PEERS_BUF_SIZE);
+    p->bind.sin_family = AF_INET;
+    p->bind.sin_port = htons(port);
+    p->listen_fd = -1;
+
+    if (!p->local || !p->batch || inet_pton(AF_INET, bind_addr, &p->bind.sin_addr) != 1) {
+        log_error("Peers: invalid local peer '%s' at %s", local, bind_addr);
+        peers_free(p);
+        return NULL;
+    }
+
+    int one = 1;
+    socklen_t len = sizeof(p->bind);
+    p->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (p->listen_fd < 0 ||
+        setsockopt(p->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+        bind(p->listen_fd, (struct sockaddr*)&p->bind, sizeof(p->bind)) < 0 ||
+        listen(p->listen_fd, 16) < 0 ||
+        getsockname(p->listen_fd, (struct sockaddr*)&p->bind, &len) < 0) {
+        log_error("Peers: cannot listen on %s:%u: %s", bind_addr, port, strerror(errno));
+        peers_free(p);
+        return NULL;
+    }
+
+    return p;
+}
+
+int peers_add(peers_t *p, const char *name, const char *addr, uint16_t port) {
+    peer_t *peer = calloc(1, sizeof(*peer));
+    if (!peer) return -1;
+
+    peer->name = strdup(name);
+    peer->out = malloc(PEERS_BUF_SIZE);
+    peer->fd = -1;
+    peer->addr.sin_family = AF_INET;
+    peer->addr.sin_port = htons(port);
+
+    if (!peer->name || !peer->out || inet_pton(AF_INET, addr, &peer->addr.sin_addr) != 1) {
+        log_error("Peers: invalid peer '%s' at %s", name, addr);
+        free(peer->name);
+        free(peer->out);
+        free(peer);
+        return -1;
+    }
+
+    peer->next = p->peers;
+    p->peers = peer;
+    return 0;
+}
+
+int peers_attach(peers_t *p, stick_table_t *t) {
+    if (p->ntables >= PEERS_MAX_TABLES || atomic_load(&p->running)) {
+        return -1;
+    }
+
+    t->replicated = true;
+    p->tables[p->ntables++] = t;
+    return 0;
+}
+
+int peers_start(peers_t *p) {
+    atomic_store(&p->running, true);
+    if (pthread_create(&p->thread, NULL, peers_thread, p) != 0) {
+        atomic_store(&p->running, false);
+        return -1;
+    }
+
+    log_info("Peers: '%s' listening on port %u, %u tables replicated",
+             p->local, ntohs(p->bind.sin_port), p->ntables);
+    return 0;
+}
+
+void peers_free(peers_t *p) {
+    if (!p) return;
+
+    if (atomic_exchange(&p->running, false)) {
+        pthread_join(p->thread, NULL);
+    }
+
+    while (p->peers) {
+        peer_t *next = p->peers->next;
+        if (p->peers->fd >= 0) close(p->peers->fd);
+        free(p->peers->name);
+        free(p->peers->out);
+        free(p->peers);
+        p->peers = next;
+    }
+    while (p->inbound) {
+        peer_conn_t *next = p->inbound->next;
+        peers_conn_free(p->inbound);
+        p->inbound = next;
+    }
+
+    /* Entries still queued must not wait for a flush that never comes */
+    for (uint32_t i = 0; i < p->ntables; i++) {
+        p->tables[i]->replicated = false;
+        for (stick_entry_t *e = stktable_take_dirty(p->tables[i]); e; e = e->dirty_next) {
+            atomic_store(&e->dirty, 0);
+        }
+    }
+
+    if (p->listen_fd >= 0) close(p->listen_fd);
+    free(p->batch);
+    free(p->local);
+    free(p);
+}
@@ -0,0 +1,542 @@
+#include "ssl/ssl.h"
+#include "utils/log.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <openssl/rand.h>
+#include <openssl/evp.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+
+/*
+ * Server-side session cache shared by every worker (and by forked or
+ * restarted processes when it lives in a named shared-memory segment).
+ *
+ * Sessions are stored DER-encoded in fixed-size slots. A session ID hashes
+ * to one shard, each guarded by its own mutex, and to a home slot in that
+ * shard; the SSL_SESS_WAYS slots from there form its set. Inserts take a
+ * free or expired slot of the set, else the one closest to expiry.
+ *
+ * The mutexes are process-shared and robust: a process that dies holding
+ * one leaves its shard to the next locker, which empties the shard rather
+ * than trust a slot that may be half written.
+ */
+
+#define SSL_SESS_MAGIC     0x55425343u  // "UBSC"
+#define SSL_SESS_VERSION   2
+#define SSL_SESS_SHARDS    64
+#define SSL_SESS_WAYS      8
+#define SSL_SESS_DER_MAX   1024         // larger sessions (client certs) are not cached
+
+typedef struct ssl_sess_slot {
+    uint32_t expires;   // unix time, 0 when free
+    uint8_t  id_len;
+    uint8_t  id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+    uint16_t der_len;
+    uint8_t  der[SSL_SESS_DER_MAX];
+} ssl_sess_slot_t;
+
+typedef struct __attribute__((aligned(64))) ssl_sess_shard {
+    pthread_mutex_t lock;   // process-shared and robust, see ssl_sess_lock()
+} ssl_sess_shard_t;
+
+typedef struct ssl_sess_cache {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots_per_shard;
+    uint32_t slot_size;
+    ssl_sess_shard_t shards[SSL_SESS_SHARDS];
+    ssl_sess_slot_t slots[];
+} ssl_sess_cache_t;
+
+static ssl_sess_cache_t *sess_cache = NULL;
+static size_t sess_cache_size = 0;
+
+static inline void ssl_sess_lock(ssl_sess_shard_t *shard) {
+    if (pthread_mutex_lock(&shard->lock) == EOWNERDEAD) {
+        // The owner died mid-update: drop everything the shard held
+        size_t s = (size_t)(shard - sess_cache->shards);
+        ssl_sess_slot_t *slots = &sess_cache->slots[s * sess_cache->slots_per_shard];
+        for (uint32_t i = 0; i < sess_cache->slots_per_shard; i++)
+            slots[i].expires = 0;
+        pthread_mutex_consistent(&shard->lock);
+        log_warning("SSL session cache shard %zu recovered from a dead holder", s);
+    }
+}
+
+static inline void ssl_sess_unlock(ssl_sess_shard_t *shard) {
+    pthread_mutex_unlock(&shard->lock);
+}
+
+static uint64_t ssl_sess_hash(const unsigned char *id, unsigned int len) {
+    uint64_t h = 0xcbf29ce484222325ULL;  // FNV-1a
+    for (unsigned int i = 0; i < len; i++) {
+        h ^= id[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// First slot of id's set; *shard receives its (locked by the caller) shard
+static ssl_sess_slot_t *ssl_sess_set(const unsigned char *id, unsigned int len,
+                                     ssl_sess_shard_t **shard, uint32_t *home) {
+    uint64_t h = ssl_sess_hash(id, len);
+    uint32_t s = h % SSL_SESS_SHARDS;
+
+    *shard = &sess_cache->shards[s];
+    *home = (uint32_t)((h >> 32) % sess_cache->slots_per_shard);
+    return &sess_cache->slots[(size_t)s * sess_cache->slots_per_shard];
+}
+
+#define SSL_SESS_ATTACH_MS 2000  // wait for another process to format the segment
+
+// Empty the mapped cache and set up its mutexes; the magic goes in last so
+// that processes attaching meanwhile do not use it half formatted
+static void ssl_sess_format(ssl_sess_cache_t *cache, size_t bytes, uint32_t per_shard) {
+    memset(cache, 0, bytes);
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    for (int i = 0; i < SSL_SESS_SHARDS; i++)
+        pthread_mutex_init(&cache->shards[i].lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    cache->version = SSL_SESS_VERSION;
+    cache->slots_per_shard = per_shard;
+    cache->slot_size = sizeof(ssl_sess_slot_t);
+    __atomic_store_n(&cache->magic, SSL_SESS_MAGIC, __ATOMIC_RELEASE);
+}
+
+// Attach a segment another process created: wait for it to be sized and
+// to carry the magic. NULL if it never does or has another layout.
+static ssl_sess_cache_t *ssl_sess_shm_attach(int fd, size_t bytes, uint32_t per_shard) {
+    ssl_sess_cache_t *cache = NULL;
+
+    for (int waited = 0; waited < SSL_SESS_ATTACH_MS; waited++) {
+        if (!cache) {
+            struct stat st;
+            if (fstat(fd, &st) < 0)
+                return NULL;
+            if (st.st_size != 0 && (size_t)st.st_size != bytes)
+                return NULL;
+            if ((size_t)st.st_size == bytes) {
+                void *mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                if (mem == MAP_FAILED)
+                    return NULL;
+                cache = mem;
+            }
+        }
+        if (cache && __atomic_load_n(&cache->magic, __ATOMIC_ACQUIRE) == SSL_SESS_MAGIC) {
+            if (cache->version == SSL_SESS_VERSION && cache->slots_per_shard == per_shard &&
+                cache->slot_size == sizeof(ssl_sess_slot_t))
+                return cache;
+            break;
+        }
+        usleep(1000);
+    }
+    if (cache)
+        munmap(cache, bytes);
+    return NULL;
+}
+
+// Map shm_name at exactly bytes. Only the process whose O_EXCL open creates
+// the segment sizes and formats it; the others wait for it to be done. One
+// of another layout, or left unformatted by a creator that died, is
+// unlinked for a new one, leaving its current users their mapping.
+static ssl_sess_cache_t *ssl_sess_shm_map(const char *shm_name, size_t bytes,
+                                          uint32_t per_shard) {
+    for (int attempt = 0; attempt < 3; attempt++) {
+        int fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd >= 0) {
+            if (ftruncate(fd, bytes) < 0) {
+                log_error("Cannot size SSL session cache segment %s: %s", shm_name, strerror(errno));
+                close(fd);
+                shm_unlink(shm_name);
+                return NULL;
+            }
+            void *mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if (mem == MAP_FAILED) {
+                log_error("Cannot map SSL session cache: %s", strerror(errno));
+                shm_unlink(shm_name);
+                return NULL;
+            }
+            ssl_sess_format(mem, bytes, per_shard);
+            return mem;
+        }
+        if (errno != EEXIST)
+            break;
+
+        fd = shm_open(shm_name, O_RDWR, 0600);
+        if (fd < 0)
+            continue;  // unlinked meanwhile
+        ssl_sess_cache_t *cache = ssl_sess_shm_attach(fd, bytes, per_shard);
+        close(fd);
+        if (cache) {
+            log_info("Reattached SSL session cache %s", shm_name);
+            return cache;
+        }
+        log_warning("SSL session cache segment %s has another layout or was never "
+                    "formatted, replacing it", shm_name);
+        shm_unlink(shm_name);
+    }
+    log_error("shm_open(%s) for the SSL session cache: %s", shm_name, strerror(errno));
+    return NULL;
+}
+
+// size is the number of sessions to hold; shm_name, if set, names a POSIX
+// shared-memory segment that is reattached as long as its layout matches
+int ssl_sess_cache_init(unsigned int size, const char *shm_name) {
+    if (sess_cache)
+        return 0;
+    if (size < SSL_SESS_SHARDS * SSL_SESS_WAYS)
+        size = SSL_SESS_SHARDS * SSL_SESS_WAYS;
+
+    uint32_t per_shard = (size + SSL_SESS_SHARDS - 1) / SSL_SESS_SHARDS;
+    size_t bytes = sizeof(ssl_sess_cache_t) +
+                   (size_t)per_shard * SSL_SESS_SHARDS * sizeof(ssl_sess_slot_t);
+    ssl_sess_cache_t *cache;
+
+    if (shm_name) {
+        cache = ssl_sess_shm_map(shm_name, bytes, per_shard);
+        if (!cache)
+            return -1;
+    } else {
+        void *mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            log_error("Cannot map SSL session cache: %s", strerror(errno));
+            return -1;
+        }
+        cache = mem;
+        ssl_sess_format(cache, bytes, per_shard);
+    }
+
+    sess_cache = cache;
+    sess_cache_size = bytes;
+    return 0;
+}
+
+void ssl_sess_cache_deinit() {
+    if (!sess_cache)
+        return;
+    munmap(sess_cache, sess_cache_size);
+    sess_cache = NULL;
+    sess_cache_size = 0;
+}
+
+int ssl_sock_sess_new_cbk(SSL *ssl, SSL_SESSION *sess) {
+    unsigned int id_len;
+    const unsigned char *id = SSL_SESSION_get_id(sess, &id_len);
+    unsigned char der[SSL_SESS_DER_MAX];
+
+    int der_len = i2d_SSL_SESSION(sess, NULL);
+    if (id_len == 0 || id_len > SSL_MAX_SSL_SESSION_ID_LENGTH || der_len <= 0 ||
+        der_len > SSL_SESS_DER_MAX)
+        return 0;
+    unsigned char *p = der;
+    i2d_SSL_SESSION(sess, &p);
+
+    uint32_t now = (uint32_t)time(NULL);
+    uint32_t expires = (uint32_t)(SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess));
+
+    ssl_sess_shard_t *shard;
+    uint32_t home;
+    ssl_sess_slot_t *set = ssl_sess_set(id, id_len, &shard, &home);
+
+    ssl_sess_lock(shard);
+    ssl_sess_slot_t *victim = NULL;
+    for (uint32_t w = 0; w < SSL_SESS_WAYS; w++) {
+        ssl_sess_slot_t *slot = &set[(home + w) % sess_cache->slots_per_shard];
+        if (slot->expires <= now ||
+            (slot->id_len == id_len && memcmp(slot->id, id, id_len) == 0)) {
+            victim = slot;
+            break;
+        }
+        if (!victim || slot->expires < victim->expires)
+            victim = slot;
+    }
+    victim->expires = expires;
+    victim->id_len = (uint8_t)id_len;
+    memcpy(victim->id, id, id_len);
+    victim->der_len = (uint16_t)der_len;
+    memcpy(victim->der, der, der_len);
+    ssl_sess_unlock(shard);
+
+    return 0;  // no reference kept on sess
+}
+
+SSL_SESSION* ssl_sock_sess_get_cbk(SSL *ssl, const unsigned char *id, int len, int *copy) {
+    unsigned char der[SSL_SESS_DER_MAX];
+    int der_len = 0;
+
+    *copy = 0;
+    if (len <= 0 || len > SSL_MAX_SSL_SESSION_ID_LENGTH)
+        return NULL;
+
+    uint32_t now = (uint32_t)time(NULL);
+    ssl_sess_shard_t *shard;
+    uint32_t home;
+    ssl_sess_slot_t *set = ssl_sess_set(id, len, &shard, &home);
+
+    ssl_sess_lock(shard);
+    for (uint32_t w = 0; w < SSL_SESS_WAYS; w++) {
+        ssl_sess_slot_t *slot = &set[(home + w) % sess_cache->slots_per_shard];
+        if (slot->expires > now && slot->id_len == len && memcmp(slot->id, id, len) == 0) {
+            der_len = slot->der_len;
+            memcpy(der, slot->der, der_len);
+            break;
+        }
+    }
+    ssl_sess_unlock(shard);
+
+    if (der_len == 0)
+        return NULL;
+    const unsigned char *p = der;
+    return d2i_SSL_SESSION(NULL, &p, der_len);
+}
+
+void ssl_sock_sess_remove_cbk(SSL_CTX *ctx, SSL_SESSION *sess) {
+    unsigned int id_len;
+    const unsigned char *id = SSL_SESSION_get_id(sess, &id_len);
+    if (id_len == 0 || id_len > SSL_MAX_SSL_SESSION_ID_LENGTH)
+        return;
+
+    ssl_sess_shard_t *shard;
+    uint32_t home;
+    ssl_sess_slot_t *set = ssl_sess_set(id, id_len, &shard, &home);
+
+    ssl_sess_lock(shard);
+    for (uint32_t w = 0; w < SSL_SESS_WAYS; w++) {
+        ssl_sess_slot_t *slot = &set[(home + w) % sess_cache->slots_per_shard];
+        if (slot->id_len == id_len && memcmp(slot->id, id, id_len) == 0) {
+            slot->expires = 0;
+            break;
+        }
+    }
+    ssl_sess_unlock(shard);
+}
+
+// Route ctx's server sessions through the shared cache
+void ssl_ctx_set_sess_cache(SSL_CTX *ctx) {
+    if (!sess_cache)
+        return;
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+    SSL_CTX_sess_set_new_cb(ctx, ssl_sock_sess_new_cbk);
+    SSL_CTX_sess_set_get_cb(ctx, ssl_sock_sess_get_cbk);
+    SSL_CTX_sess_set_remove_cb(ctx, ssl_sock_sess_remove_cbk);
+}
+
+/*
+ * Session ticket keys. keys[0] encrypts new tickets, the older ones are
+ * still accepted and trigger a renewal. Keys are either generated and
+ * rotated every rotate_secs, or loaded from a file holding one base64
+ * encoded 48-byte key per line (name, HMAC secret, AES key; first line
+ * encrypts), re-read whenever it changes, so a fleet can share them.
+ */
+
+#define SSL_TKT_KEYS_MAX        3
+#define SSL_TKT_RELOAD_SECS     60
+
+typedef struct ssl_tkt_key {
+    unsigned char name[16];
+    unsigned char hmac_key[16];
+    unsigned char aes_key[16];
+} ssl_tkt_key_t;
+
+static struct {
+    pthread_rwlock_t lock;
+    ssl_tkt_key_t keys[SSL_TKT_KEYS_MAX];
+    int count;
+    char *file;
+    time_t file_mtime;
+    unsigned int rotate_secs;
+    time_t next_check;
+    int initialized;
+} tkt = { .lock = PTHREAD_RWLOCK_INITIALIZER };
+
+static int ssl_tkt_load_file(const char *file) {
+    FILE *f = fopen(file, "r");
+    if (!f) {
+        log_error("Cannot open TLS ticket key file %s: %s", file, strerror(errno));
+        return -1;
+    }
+
+    ssl_tkt_key_t keys[SSL_TKT_KEYS_MAX];
+    int count = 0;
+    char line[128];
+    while (count < SSL_TKT_KEYS_MAX && fgets(line, sizeof(line), f)) {
+        size_t len = strcspn(line, "\r\n");
+        if (len == 0 || line[0] == '#')
+            continue;
+
+        unsigned char raw[96];
+        // EVP_DecodeBlock counts the '=' padding as output bytes
+        int n = EVP_DecodeBlock(raw, (unsigned char *)line, len);
+        while (len > 0 && line[len - 1] == '=') {
+            len--;
+            n--;
+        }
+        if (n != (int)sizeof(ssl_tkt_key_t)) {
+            log_error("Invalid key in TLS ticket key file %s", file);
+            fclose(f);
+            return -1;
+        }
+        memcpy(&keys[count++], raw, sizeof(ssl_tkt_key_t));
+    }
+    fclose(f);
+
+    if (count == 0) {
+        log_error("No keys in TLS ticket key file %s", file);
+        return -1;
+    }
+
+    memcpy(tkt.keys, keys, sizeof(keys));
+    tkt.count = count;
+    OPENSSL_cleanse(keys, sizeof(keys));
+    return 0;
+}
+
+static int ssl_tkt_generate(void) {
+    ssl_tkt_key_t key;
+    if (RAND_bytes((unsigned char *)&key, sizeof(key)) != 1)
+        return -1;
+
+    memmove(&tkt.keys[1], &tkt.keys[0], (SSL_TKT_KEYS_MAX - 1) * sizeof(ssl_tkt_key_t));
+    tkt.keys[0] = key;
+    if (tkt.count < SSL_TKT_KEYS_MAX)
+        tkt.count++;
+    OPENSSL_cleanse(&key, sizeof(key));
+    return 0;
+}
+
+// Rotate or reload when due. Called from the ticket callback with no lock
+// held; a worker that loses the race simply keeps using the current keys.
+static void ssl_tkt_maybe_rotate(time_t now) {
+    if (now < __atomic_load_n(&tkt.next_check, __ATOMIC_RELAXED))
+        return;
+    if (pthread_rwlock_trywrlock(&tkt.lock) != 0)
+        return;
+
+    if (now >= tkt.next_check) {
+        if (tkt.file) {
+            struct stat st;
+            if (stat(tkt.file, &st) == 0 && st.st_mtime != tkt.file_mtime &&
+                ssl_tkt_load_file(tkt.file) == 0) {
+                tkt.file_mtime = st.st_mtime;
+                log_info("Reloaded TLS ticket keys from %s", tkt.file);
+            }
+            tkt.next_check = now + SSL_TKT_RELOAD_SECS;
+        } else {
+            ssl_tkt_generate();
+            tkt.next_check = now + tkt.rotate_secs;
+        }
+    }
+    pthread_rwlock_unlock(&tkt.lock);
+}
+
+int ssl_ticket_keys_init(const char *file, unsigned int rotate_secs) {
+    int ret = 0;
+
+    pthread_rwlock_wrlock(&tkt.lock);
+    if (tkt.initialized)
+        goto out;
+
+    tkt.rotate_secs = rotate_secs ? rotate_secs : SSL_TKT_ROTATE_SECS;
+    if (file) {
+        struct stat st;
+        if (stat(file, &st) < 0 || ssl_tkt_load_file(file) < 0) {
+            ret = -1;
+            goto out;
+        }
+        tkt.file = strdup(file);
+        tkt.file_mtime = st.st_mtime;
+        tkt.next_check = time(NULL) + SSL_TKT_RELOAD_SECS;
+    } else {
+        if (ssl_tkt_generate() < 0) {
+            ret = -1;
+            goto out;
+        }
+        tkt.next_check = time(NULL) + tkt.rotate_secs;
+    }
+    tkt.initialized = 1;
+
+out:
+    pthread_rwlock_unlock(&tkt.lock);
+    return ret;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int ssl_tkt_mac_init(EVP_MAC_CTX *hctx, const ssl_tkt_key_t *key) {
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, (void *)key->hmac_key,
+                                          sizeof(key->hmac_key)),
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0),
+        OSSL_PARAM_construct_end()
+    };
+    return EVP_MAC_CTX_set_params(hctx, params);
+}
+
+static int ssl_tkt_cbk(SSL *ssl, unsigned char *name, unsigned char *iv,
+                       EVP_CIPHER_CTX *cctx, EVP_MAC_CTX *hctx, int enc)
+#else
+static int ssl_tkt_mac_init(HMAC_CTX *hctx, const ssl_tkt_key_t *key) {
+    return HMAC_Init_ex(hctx, key->hmac_key, sizeof(key->hmac_key), EVP_sha256(), NULL);
+}
+
+static int ssl_tkt_cbk(SSL *ssl, unsigned char *name, unsigned char *iv,
+                       EVP_CIPHER_CTX *cctx, HMAC_CTX *hctx, int enc)
+#endif
+{
+    int ret = 0;
+
+    ssl_tkt_maybe_rotate(time(NULL));
+    pthread_rwlock_rdlock(&tkt.lock);
+
+    if (enc) {
+        const ssl_tkt_key_t *key = &tkt.keys[0];
+        if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) == 1 &&
+            EVP_EncryptInit_ex(cctx, EVP_aes_128_cbc(), NULL, key->aes_key, iv) == 1 &&
+            ssl_tkt_mac_init(hctx, key) == 1) {
+            memcpy(name, key->name, sizeof(key->name));
+            ret = 1;
+        } else {
+            ret = -1;
+        }
+    } else {
+        for (int i = 0; i < tkt.count; i++) {
+            const ssl_tkt_key_t *key = &tkt.keys[i];
+            if (memcmp(name, key->name, sizeof(key->name)) != 0)
+                continue;
+            if (ssl_tkt_mac_init(hctx, key) != 1 ||
+                EVP_DecryptInit_ex(cctx, EVP_aes_128_cbc(), NULL, key->aes_key, iv) != 1) {
+                ret = -1;
+                break;
+            }
+            ret = (i == 0) ? 1 : 2;  // 2: valid, but issue a ticket under the new key
+            break;
+        }
+    }
+
+    pthread_rwlock_unlock(&tkt.lock);
+    return ret;
+}
+
+void ssl_ctx_set_ticket_keys(SSL_CTX *ctx) {
+    if (!tkt.initialized)
+        return;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ssl_tkt_cbk);
+#else
+    SSL_CTX_set_tlsext_ticket_key_cb(ctx, ssl_tkt_cbk);
+#endif
+}
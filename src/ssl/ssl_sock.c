@@ -2,6 +2,9 @@
 #include "core/common.h"
 #include "utils/log.h"
 #include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <openssl/rand.h>
 #include <openssl/pem.h>
 
@@ -12,7 +15,9 @@ static int ssl_initialized = 0;
 static ENGINE *ssl_engines[32];
 static int ssl_engines_count = 0;
 #else
-// In OpenSSL 3.0+, we don't use engines
+// In OpenSSL 3.0+, hardware offload (e.g. qatprovider) comes as a provider
+#include <openssl/provider.h>
+static OSSL_PROVIDER *ssl_engines[32];
 static int ssl_engines_count = 0;
 #endif
 
@@ -141,10 +146,23 @@ SSL_CTX* ssl_ctx_new(ssl_bind_conf_t *conf) {
                              SSL_OP_NO_COMPRESSION | SSL_OP_NO_RENEGOTIATION |
                              SSL_OP_SINGLE_DH_USE | SSL_OP_SINGLE_ECDH_USE);
 
+#ifdef SSL_OP_ENABLE_KTLS
+    if (conf->ktls)
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
     SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
                           SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
                           SSL_MODE_RELEASE_BUFFERS);
 
+#ifdef SSL_MODE_ASYNC
+    // Private key and cipher operations run as async jobs: an engine or
+    // provider that offloads them pauses the job instead of blocking the
+    // worker. Without one the job simply completes inline.
+    if (global.ssl_mode_async)
+        SSL_CTX_set_mode(ctx, SSL_MODE_ASYNC);
+#endif
+
     SSL_CTX_set_verify(ctx, conf->verify ? SSL_VERIFY_PEER : SSL_VERIFY_NONE,
                       ssl_sock_verify_cbk);
 
@@ -154,6 +172,12 @@ SSL_CTX* ssl_ctx_new(ssl_bind_conf_t *conf) {
     SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
     SSL_CTX_sess_set_cache_size(ctx, conf->session_cache.size);
     SSL_CTX_set_timeout(ctx, conf->session_cache.lifetime);
+    if (conf->session_cache.size > 0 &&
+        ssl_sess_cache_init(conf->session_cache.size, conf->session_cache.shm_name) == 0)
+        ssl_ctx_set_sess_cache(ctx);
+
+    if (ssl_ticket_keys_init(conf->tls_ticket_keys, conf->tls_ticket_rotate) == 0)
+        ssl_ctx_set_ticket_keys(ctx);
 
     SSL_CTX_set_info_callback(ctx, ssl_sock_info_cbk);
     SSL_CTX_set_msg_callback(ctx, ssl_sock_msg_cbk);
@@ -221,6 +245,10 @@ int ssl_sock_handshake(struct connection *conn, unsigned int flag) {
         } else if (err == SSL_ERROR_WANT_WRITE) {
             conn->flags |= CO_FL_WAIT_WR;
             return 0;
+        } else if (err == SSL_ERROR_WANT_ASYNC || err == SSL_ERROR_WANT_ASYNC_JOB) {
+            // WANT_ASYNC_JOB: job pool exhausted, retry on the next loop pass
+            conn->flags |= CO_FL_WAIT_ASYNC;
+            return 0;
         } else if (err == SSL_ERROR_SYSCALL) {
             conn->flags |= CO_FL_ERROR;
             return -1;
@@ -235,7 +263,19 @@ int ssl_sock_handshake(struct connection *conn, unsigned int flag) {
     }
 
     ssl_ctx->flags |= SSL_SOCK_FL_HANDSHAKE_DONE;
-    conn->flags &= ~(CO_FL_WAIT_RD | CO_FL_WAIT_WR);
+    conn->flags &= ~(CO_FL_WAIT_RD | CO_FL_WAIT_WR | CO_FL_WAIT_ASYNC);
+
+#ifdef SSL_OP_ENABLE_KTLS
+    // OpenSSL moves the keys into the kernel only for ciphers the kernel
+    // supports; anything else keeps using SSL_read/SSL_write
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl)))
+        ssl_ctx->flags |= SSL_SOCK_FL_KTLS_TX;
+    if (BIO_get_ktls_recv(SSL_get_rbio(ssl)))
+        ssl_ctx->flags |= SSL_SOCK_FL_KTLS_RX;
+    if (ssl_ctx->flags & (SSL_SOCK_FL_KTLS_TX | SSL_SOCK_FL_KTLS_RX))
+        log_debug("kTLS enabled (tx=%d rx=%d)", !!(ssl_ctx->flags & SSL_SOCK_FL_KTLS_TX),
+                  !!(ssl_ctx->flags & SSL_SOCK_FL_KTLS_RX));
+#endif
 
     const unsigned char *alpn;
     unsigned int alpn_len;
@@ -258,6 +298,8 @@ int ssl_sock_recv(struct connection *conn, void *buf, size_t len, int flags) {
     SSL *ssl = ssl_ctx->ssl;
     int ret;
 
+    // Also with kTLS RX: the kernel decrypts, but alerts and other
+    // non-data records still have to be picked up and handled by OpenSSL
     ret = SSL_read(ssl, buf, len);
 
     if (ret <= 0) {
@@ -269,6 +311,9 @@ int ssl_sock_recv(struct connection *conn, void *buf, size_t len, int flags) {
         } else if (err == SSL_ERROR_WANT_WRITE) {
             conn->flags |= CO_FL_WAIT_WR;
             return 0;
+        } else if (err == SSL_ERROR_WANT_ASYNC || err == SSL_ERROR_WANT_ASYNC_JOB) {
+            conn->flags |= CO_FL_WAIT_ASYNC;
+            return 0;
         } else if (err == SSL_ERROR_ZERO_RETURN) {
             conn->flags |= CO_FL_SOCK_RD_SH;
             return 0;
@@ -278,6 +323,7 @@ int ssl_sock_recv(struct connection *conn, void *buf, size_t len, int flags) {
         }
     }
 
+    conn->flags &= ~CO_FL_WAIT_ASYNC;
     return ret;
 }
 
@@ -286,6 +332,20 @@ int ssl_sock_send(struct connection *conn, const void *buf, size_t len, int flag
     SSL *ssl = ssl_ctx->ssl;
     int ret;
 
+    if (ssl_ctx->flags & SSL_SOCK_FL_KTLS_TX) {
+        // The kernel frames and encrypts application data itself
+        ssize_t n = send(conn->fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                conn->flags |= CO_FL_WAIT_WR;
+                return 0;
+            }
+            conn->flags |= CO_FL_ERROR;
+            return -1;
+        }
+        return (int)n;
+    }
+
     ret = SSL_write(ssl, buf, len);
 
     if (ret <= 0) {
@@ -297,15 +357,58 @@ int ssl_sock_send(struct connection *conn, const void *buf, size_t len, int flag
         } else if (err == SSL_ERROR_WANT_READ) {
             conn->flags |= CO_FL_WAIT_RD;
             return 0;
+        } else if (err == SSL_ERROR_WANT_ASYNC || err == SSL_ERROR_WANT_ASYNC_JOB) {
+            // SSL_write must be repeated with the same buffer and length
+            conn->flags |= CO_FL_WAIT_ASYNC;
+            return 0;
         } else {
             conn->flags |= CO_FL_ERROR;
             return -1;
         }
     }
 
+    conn->flags &= ~CO_FL_WAIT_ASYNC;
     return ret;
 }
 
+int ssl_sock_async_fds(struct connection *conn, OSSL_ASYNC_FD *add, size_t *nadd,
+                       OSSL_ASYNC_FD *del, size_t *ndel) {
+    ssl_sock_ctx_t *ssl_ctx = conn->xprt_ctx;
+    size_t max_add = *nadd, max_del = *ndel;
+
+    if (!SSL_get_changed_async_fds(ssl_ctx->ssl, NULL, nadd, NULL, ndel))
+        return -1;
+    if (*nadd > max_add || *ndel > max_del)
+        return -1;
+    if (!SSL_get_changed_async_fds(ssl_ctx->ssl, add, nadd, del, ndel))
+        return -1;
+    return 0;
+}
+
+int ssl_sock_ktls_tx(struct connection *conn) {
+    ssl_sock_ctx_t *ssl_ctx = conn->xprt_ctx;
+    return ssl_ctx && (ssl_ctx->flags & SSL_SOCK_FL_KTLS_TX);
+}
+
+// Zero-copy file transmission over TLS; only possible with kTLS TX, callers
+// fall back to read + ssl_sock_send on ENOTSUP
+ssize_t ssl_sock_sendfile(struct connection *conn, int fd, off_t offset, size_t len) {
+    if (!ssl_sock_ktls_tx(conn)) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    ssize_t n = sendfile(conn->fd, fd, &offset, len);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            conn->flags |= CO_FL_WAIT_WR;
+            return 0;
+        }
+        conn->flags |= CO_FL_ERROR;
+    }
+    return n;
+}
+
 int ssl_sock_verify_cbk(int ok, X509_STORE_CTX *ctx) {
     SSL *ssl = X509_STORE_CTX_get_ex_data(ctx, SSL_get_ex_data_X509_STORE_CTX_idx());
     struct connection *conn = SSL_get_ex_data(ssl, 0);
@@ -395,9 +498,23 @@ int ssl_init_single_engine(const char *engine_name) {
 
     return 0;
 #else
-    // In OpenSSL 3.0+, use providers instead of engines
-    log_warning("ENGINE API is deprecated in OpenSSL 3.0+, engine '%s' not loaded", engine_name);
-    return -1;
+    // In OpenSSL 3.0+, use providers instead of engines. Keep the fallback
+    // default provider for whatever the offload provider does not implement.
+    if (ssl_engines_count >= (int)(sizeof(ssl_engines) / sizeof(ssl_engines[0]))) {
+        log_error("Too many SSL engines, '%s' not loaded", engine_name);
+        return -1;
+    }
+
+    OSSL_PROVIDER *prov = OSSL_PROVIDER_try_load(NULL, engine_name, 1);
+    if (!prov) {
+        log_error("Failed to load provider: %s", engine_name);
+        return -1;
+    }
+
+    ssl_engines[ssl_engines_count++] = prov;
+    log_info("SSL provider %s loaded successfully", engine_name);
+
+    return 0;
 #endif
 }
 
@@ -408,6 +525,9 @@ void ssl_free_engines() {
         ENGINE_finish(ssl_engines[i]);
         ENGINE_free(ssl_engines[i]);
     }
+#else
+    for (int i = 0; i < ssl_engines_count; i++)
+        OSSL_PROVIDER_unload(ssl_engines[i]);
 #endif
     ssl_engines_count = 0;
 }
@@ -416,11 +536,27 @@ void ssl_sock_msg_cbk(int write_p, int version, int content_type,
                      const void *buf, size_t len, SSL *ssl, void *arg) {
 }
 
+/* Pick the first protocol of the comma-separated alpn_str (server
+ * preference, e.g. "h2,http/1.1") that the client offered; out points into
+ * the client's wire-format list. */
 int ssl_sock_alpn_select_cbk(SSL *ssl, const unsigned char **out, unsigned char *outlen,
                             const unsigned char *in, unsigned int inlen, void *arg) {
-    *out = in;
-    *outlen = inlen > 0 ? 1 : 0;
-    return SSL_TLSEXT_ERR_OK;
+    struct ssl_bind_conf *conf = arg;
+    const char *p = conf->alpn_str;
+
+    while (p && *p) {
+        size_t len = strcspn(p, ",");
+        for (unsigned int i = 0; len > 0 && i < inlen; i += 1 + in[i]) {
+            if (in[i] == len && i + 1 + len <= inlen && memcmp(in + i + 1, p, len) == 0) {
+                *out = in + i + 1;
+                *outlen = in[i];
+                return SSL_TLSEXT_ERR_OK;
+            }
+        }
+        p += len;
+        if (*p == ',') p++;
+    }
+    return SSL_TLSEXT_ERR_NOACK;
 }
 
 int ssl_sock_npn_advertise_cbk(SSL *ssl, const unsigned char **data, unsigned int *len, void *arg) {
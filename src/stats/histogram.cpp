@@ -0,0 +1,109 @@
+#include "stats/histogram.hpp"
+#include <algorithm>
+#include <cmath>
+#include <new>
+
+namespace ultrabalancer {
+
+uint32_t thread_slot() noexcept {
+    static std::atomic<uint32_t> next{0};
+    static thread_local uint32_t slot = next.fetch_add(1, std::memory_order_relaxed);
+    return slot;
+}
+
+uint64_t HistogramSnapshot::value_at(double percentile) const noexcept {
+    if (total_ == 0) return 0;
+
+    double p = std::clamp(percentile, 0.0, 100.0);
+    uint64_t rank = std::max<uint64_t>((uint64_t)std::ceil(p / 100.0 * (double)total_), 1);
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts_.size(); ++i) {
+        seen += counts_[i];
+        if (seen >= rank) return Histogram::highest_value(bits_, i);
+    }
+    return Histogram::highest_value(bits_, counts_.size() - 1);
+}
+
+uint64_t HistogramSnapshot::min() const noexcept {
+    for (size_t i = 0; i < counts_.size(); ++i) {
+        if (counts_[i]) return Histogram::lowest_value(bits_, i);
+    }
+    return 0;
+}
+
+uint64_t HistogramSnapshot::max() const noexcept {
+    for (size_t i = counts_.size(); i-- > 0;) {
+        if (counts_[i]) return Histogram::highest_value(bits_, i);
+    }
+    return 0;
+}
+
+Histogram::Histogram(uint64_t highest, uint32_t bits)
+    : bits_(std::clamp<uint32_t>(bits, 2, 16)),
+      highest_(std::max<uint64_t>(highest, 1)),
+      buckets_(bucket(highest_) + 1) {}
+
+Histogram::~Histogram() {
+    for (auto& shard : shards_) {
+        delete[] shard.load(std::memory_order_relaxed);
+    }
+}
+
+uint64_t Histogram::lowest_value(uint32_t bits, size_t bucket) noexcept {
+    size_t half = (size_t)1 << (bits - 1);
+    int shift = std::max<int>((int)(bucket >> (bits - 1)) - 1, 0);
+    return (uint64_t)(bucket - (size_t)shift * half) << shift;
+}
+
+uint64_t Histogram::highest_value(uint32_t bits, size_t bucket) noexcept {
+    int shift = std::max<int>((int)(bucket >> (bits - 1)) - 1, 0);
+    return lowest_value(bits, bucket) + ((uint64_t)1 << shift) - 1;
+}
+
+std::atomic<uint64_t>* Histogram::add_shard(uint32_t index) noexcept {
+    auto* counts = new (std::nothrow) std::atomic<uint64_t>[2 * buckets_]();
+    if (!counts) return nullptr;
+
+    // Threads past kMaxThreads may race for the same shard
+    std::atomic<uint64_t>* expected = nullptr;
+    if (!shards_[index].compare_exchange_strong(expected, counts, std::memory_order_acq_rel)) {
+        delete[] counts;
+        return expected;
+    }
+    return counts;
+}
+
+HistogramSnapshot Histogram::gather(uint64_t window, bool clear) const {
+    HistogramSnapshot snapshot;
+    snapshot.bits_ = bits_;
+    snapshot.counts_.assign(buckets_, 0);
+
+    size_t offset = (window & 1) * buckets_;
+    for (const auto& shard : shards_) {
+        std::atomic<uint64_t>* counts = shard.load(std::memory_order_acquire);
+        if (!counts) continue;
+
+        for (size_t i = 0; i < buckets_; ++i) {
+            std::atomic<uint64_t>& c = counts[offset + i];
+            uint64_t n = clear ? c.exchange(0, std::memory_order_relaxed)
+                               : c.load(std::memory_order_relaxed);
+            snapshot.counts_[i] += n;
+            snapshot.total_ += n;
+        }
+    }
+    return snapshot;
+}
+
+HistogramSnapshot Histogram::rotate() {
+    std::lock_guard<std::mutex> lock(rotate_mutex_);
+    uint64_t closed = window_.fetch_add(1, std::memory_order_relaxed);
+    return gather(closed, true);
+}
+
+HistogramSnapshot Histogram::current() const {
+    std::lock_guard<std::mutex> lock(rotate_mutex_);
+    return gather(window_.load(std::memory_order_relaxed), false);
+}
+
+}
@@ -0,0 +1,50 @@
+#include "stats/lb_stats.h"
+#include <stdlib.h>
+#include <string.h>
+
+lb_worker_stats_t* lb_stats_worker_create(void) {
+    lb_worker_stats_t* stats = aligned_alloc(CACHE_LINE_SIZE, sizeof(lb_worker_stats_t));
+    if (stats) memset(stats, 0, sizeof(*stats));
+    return stats;
+}
+
+void lb_stats_worker_destroy(lb_worker_stats_t* stats) {
+    free(stats);
+}
+
+void lb_stats_collect(const loadbalancer_t* lb, lb_stats_totals_t* totals) {
+    uint64_t opened = 0, closed = 0;
+
+    totals->total_requests = atomic_load(&lb->global_stats.total_requests);
+    totals->failed_requests = atomic_load(&lb->global_stats.failed_requests);
+    totals->bytes_in = atomic_load(&lb->global_stats.bytes_in);
+    totals->bytes_out = atomic_load(&lb->global_stats.bytes_out);
+
+    for (uint32_t i = 0; lb->worker_ctx && i < lb->worker_threads; i++) {
+        const lb_worker_stats_t* st = lb->worker_ctx[i].stats;
+        if (!st) continue;
+        totals->total_requests += atomic_load_explicit(&st->total_requests, memory_order_relaxed);
+        totals->failed_requests += atomic_load_explicit(&st->failed_requests, memory_order_relaxed);
+        totals->bytes_in += atomic_load_explicit(&st->bytes_in, memory_order_relaxed);
+        totals->bytes_out += atomic_load_explicit(&st->bytes_out, memory_order_relaxed);
+        opened += atomic_load_explicit(&st->conns_opened, memory_order_relaxed);
+        closed += atomic_load_explicit(&st->conns_closed, memory_order_relaxed);
+    }
+
+    // Blocks are read one after another; never report a transient underflow
+    totals->active_connections = atomic_load(&lb->global_stats.active_connections) +
+                                 (opened > closed ? opened - closed : 0);
+}
+
+void lb_stats_backend_bytes(const loadbalancer_t* lb, const backend_t* backend,
+                            uint64_t* bytes_in, uint64_t* bytes_out) {
+    *bytes_in = atomic_load(&backend->stats.bytes_in);
+    *bytes_out = atomic_load(&backend->stats.bytes_out);
+
+    for (uint32_t i = 0; lb->worker_ctx && i < lb->worker_threads; i++) {
+        const lb_worker_stats_t* st = lb->worker_ctx[i].stats;
+        if (!st) continue;
+        *bytes_in += atomic_load_explicit(&st->backends[backend->id].bytes_in, memory_order_relaxed);
+        *bytes_out += atomic_load_explicit(&st->backends[backend->id].bytes_out, memory_order_relaxed);
+    }
+}
@@ -37,6 +37,18 @@ void MetricsAggregator::record_timer(const std::string& name,
     metric->record_time(duration);
 }
 
+Counter MetricsAggregator::counter(const std::string& name) {
+    return Counter(get_or_create(name, Metric::COUNTER).get());
+}
+
+Gauge MetricsAggregator::gauge(const std::string& name) {
+    return Gauge(get_or_create(name, Metric::GAUGE).get());
+}
+
+Timer MetricsAggregator::timer(const std::string& name) {
+    return Timer(get_or_create(name, Metric::TIMER).get());
+}
+
 std::shared_ptr<Metric> MetricsAggregator::get_metric(const std::string& name) {
     std::lock_guard<std::mutex> lock(mutex_);
     auto it = metrics_.find(name);
@@ -70,12 +82,11 @@ MetricsAggregator::Stats MetricsAggregator::get_stats() {
 
     if (auto m = get_metric("response.time")) {
         stats.avg_response_time_ms = m->get_mean();
-        auto percentiles = m->get_percentiles({50, 95, 99});
-        if (percentiles.size() >= 3) {
-            stats.p50_response_time_ms = percentiles[0];
-            stats.p95_response_time_ms = percentiles[1];
-            stats.p99_response_time_ms = percentiles[2];
-        }
+        auto percentiles = m->get_percentiles({50, 95, 99, 99.9});
+        stats.p50_response_time_ms = percentiles[0];
+        stats.p95_response_time_ms = percentiles[1];
+        stats.p99_response_time_ms = percentiles[2];
+        stats.p999_response_time_ms = percentiles[3];
     }
 
     if (auto m = get_metric("connections.active")) {
@@ -95,16 +106,9 @@ MetricsAggregator::Stats MetricsAggregator::get_stats() {
 
 void MetricsAggregator::reset_stats() {
     std::lock_guard<std::mutex> lock(mutex_);
-    metrics_.clear();
-
-    get_or_create("requests.total", Metric::COUNTER);
-    get_or_create("requests.success", Metric::COUNTER);
-    get_or_create("requests.failed", Metric::COUNTER);
-    get_or_create("response.time", Metric::TIMER);
-    get_or_create("connections.active", Metric::GAUGE);
-    get_or_create("bytes.in", Metric::COUNTER);
-    get_or_create("bytes.out", Metric::COUNTER);
-    // get_all_metrics().clear();
+    for (auto& entry : metrics_) {
+        entry.second->reset();
+    }
 }
 
 std::shared_ptr<Metric> MetricsAggregator::get_or_create(const std::string& name,
@@ -137,6 +141,16 @@ void metrics_record_timer_ns(const char* name, uint64_t nanoseconds) {
         name, std::chrono::nanoseconds(nanoseconds));
 }
 
+// Resolved once, for C hot paths; like the C++ handles it lives as long as
+// the process
+void* metrics_timer_handle(const char* name) {
+    return new ultrabalancer::Timer(ultrabalancer::MetricsAggregator::instance().timer(name));
+}
+
+void metrics_timer_record_ns(void* timer, uint64_t nanoseconds) {
+    static_cast<ultrabalancer::Timer*>(timer)->record(std::chrono::nanoseconds(nanoseconds));
+}
+
 void metrics_get_stats(void* stats_struct) {
     auto stats = ultrabalancer::MetricsAggregator::instance().get_stats();
     if (stats_struct) {
@@ -175,4 +189,9 @@ void metrics_get_percentiles(const char* name, double* p50, double* p95, double*
     }
 }
 
+double metrics_get_percentile(const char* name, double percentile) {
+    auto metric = ultrabalancer::MetricsAggregator::instance().get_metric(name);
+    return metric ? metric->get_percentiles({percentile})[0] : 0.0;
+}
+
 }
@@ -1,13 +1,43 @@
 #include "stick_tables.h"
 #include "core/proxy.h"
+#include "utils/hash.h"
 #include "utils/log.h"
+#include "core/lb_memory.h"
+#include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <stdatomic.h>
 
 /* Global list of stick tables */
 static stick_table_t *stick_tables = NULL;
 static pthread_rwlock_t stick_tables_lock = PTHREAD_RWLOCK_INITIALIZER;
 
+static uint64_t stktable_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static stick_slots_t* stktable_slots_new(uint32_t capacity) {
+    stick_slots_t *slots = calloc(1, sizeof(*slots));
+    if (!slots) return NULL;
+
+    slots->slot = aligned_alloc(64, capacity * sizeof(stick_slot_t));
+    if (!slots->slot) {
+        free(slots);
+        return NULL;
+    }
+    memset(slots->slot, 0, capacity * sizeof(stick_slot_t));
+    slots->mask = capacity - 1;
+    return slots;
+}
+
+static void stktable_slots_free(stick_slots_t *slots) {
+    free(slots->slot);
+    free(slots);
+}
+
 stick_table_t* stktable_new(const char *id, int type, uint32_t size, uint32_t expire) {
     stick_table_t *t = calloc(1, sizeof(*t));
     if (!t) return NULL;
@@ -18,27 +48,23 @@ stick_table_t* stktable_new(const char *id, int type, uint32_t size, uint32_t ex
     t->expire = expire;
     t->current = 0;
 
-    /* Initialize hash table with prime size for better distribution */
-    t->hash.size = size | 1;  // Make it odd
-    t->hash.entries = calloc(t->hash.size, sizeof(stick_entry_t*));
-    t->hash.locks = calloc(t->hash.size, sizeof(pthread_spinlock_t));
+    /* At most half full, so probe sequences stay short */
+    uint32_t capacity = 16;
+    while (capacity < size * 2 && capacity < (1u << 31)) {
+        capacity <<= 1;
+    }
 
-    if (!t->hash.entries || !t->hash.locks) {
-        free(t->hash.entries);
-        free(t->hash.locks);
+    stick_slots_t *slots = stktable_slots_new(capacity);
+    if (!t->id || !slots) {
+        free(slots);
         free(t->id);
         free(t);
         return NULL;
     }
+    atomic_init(&t->slots, slots);
 
-    /* Initialize per-bucket spinlocks for fine-grained locking */
-    for (uint32_t i = 0; i < t->hash.size; i++) {
-        pthread_spin_init(&t->hash.locks[i], PTHREAD_PROCESS_PRIVATE);
-    }
-
-    t->keys = EB_ROOT;
-    LIST_INIT(&t->lru);
-    pthread_rwlock_init(&t->lock, NULL);
+    pthread_spin_init(&t->write_lock, PTHREAD_PROCESS_PRIVATE);
+    lb_timer_wheel_init(&t->wheel, stktable_now_ms());
 
     /* Add to global list */
     pthread_rwlock_wrlock(&stick_tables_lock);
@@ -49,169 +75,380 @@ stick_table_t* stktable_new(const char *id, int type, uint32_t size, uint32_t ex
     return t;
 }
 
-/* Hash function for stick table keys - uses MurmurHash3 algorithm */
-static uint32_t stktable_hash(stick_key_t *key) {
-    uint32_t hash = 0x12345678;
-    const uint8_t *data = NULL;
-    size_t len = 0;
+/* Bytes of a key kept inline in its slot; 0 for the variable-length types */
+static size_t stktable_fixed_len(int type) {
+    switch (type) {
+        case STKTABLE_TYPE_IP:      return sizeof(struct in_addr);
+        case STKTABLE_TYPE_IPV6:    return sizeof(struct in6_addr);
+        case STKTABLE_TYPE_INTEGER: return sizeof(uint32_t);
+    }
+    return 0;
+}
 
+static uint64_t stktable_hash(const stick_key_t *key) {
     switch (key->type) {
         case STKTABLE_TYPE_IP:
-            data = (uint8_t*)&key->data.ipv4;
-            len = sizeof(key->data.ipv4);
-            break;
-        case STKTABLE_TYPE_IPV6:
-            data = (uint8_t*)&key->data.ipv6;
-            len = sizeof(key->data.ipv6);
-            break;
+            return hash64_u64(key->data.ipv4.s_addr);
         case STKTABLE_TYPE_INTEGER:
-            data = (uint8_t*)&key->data.integer;
-            len = sizeof(key->data.integer);
-            break;
+            return hash64_u64(key->data.integer);
+        case STKTABLE_TYPE_IPV6:
+            return hash64(&key->data.ipv6, sizeof(key->data.ipv6));
         case STKTABLE_TYPE_STRING:
-            data = (uint8_t*)key->data.str.ptr;
-            len = key->data.str.len;
-            break;
+            return hash64(key->data.str.ptr, key->data.str.len);
         case STKTABLE_TYPE_BINARY:
-            data = (uint8_t*)key->data.bin.ptr;
-            len = key->data.bin.len;
-            break;
+            return hash64(key->data.bin.ptr, key->data.bin.len);
     }
+    return 0;
+}
 
-    /* Simple hash for now - replace with MurmurHash3 for production */
-    for (size_t i = 0; i < len; i++) {
-        hash = ((hash << 5) + hash) + data[i];
+/* The slot tag: the hash's high half, kept clear of the reserved values */
+static inline uint32_t stktable_tag(uint64_t hash) {
+    uint32_t tag = (uint32_t)(hash >> 32);
+    return tag > STKTABLE_SLOT_TOMB ? tag : tag + 2;
+}
+
+static void stktable_slot_key(const stick_key_t *key, uint8_t out[16]) {
+    memset(out, 0, 16);
+    memcpy(out, &key->data, stktable_fixed_len(key->type));
+}
+
+static bool stktable_key_eq(const stick_key_t *a, const stick_key_t *b) {
+    switch (b->type) {
+        case STKTABLE_TYPE_STRING:
+            return a->data.str.len == b->data.str.len &&
+                   memcmp(a->data.str.ptr, b->data.str.ptr, b->data.str.len) == 0;
+        case STKTABLE_TYPE_BINARY:
+            return a->data.bin.len == b->data.bin.len &&
+                   memcmp(a->data.bin.ptr, b->data.bin.ptr, b->data.bin.len) == 0;
     }
+    return false;
+}
+
+/* Caller holds the write lock; readers see either the old or the new slot */
+static void stktable_slot_set(stick_slot_t *slot, uint32_t tag, const uint8_t *key, stick_entry_t *entry) {
+    uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
 
-    return hash;
+    atomic_store_explicit(&slot->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    slot->tag = tag;
+    if (key) {
+        memcpy(slot->key, key, sizeof(slot->key));
+    }
+    slot->entry = entry;
+
+    atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+}
+
+/* Entries and their keys come from the size-class pool (lb_alloc) */
+static void stktable_entry_free(stick_entry_t *entry) {
+    if (entry->key.type == STKTABLE_TYPE_STRING) {
+        size_t len = entry->key.data.str.len;
+        lb_free(entry->key.data.str.ptr, len ? len : 1);
+    } else if (entry->key.type == STKTABLE_TYPE_BINARY) {
+        size_t len = entry->key.data.bin.len;
+        lb_free(entry->key.data.bin.ptr, len ? len : 1);
+    }
+    pthread_rwlock_destroy(&entry->lock);
+    lb_free(entry, sizeof(*entry));
+}
+
+/* Copy a slot out, again if a writer changed it meanwhile */
+static inline void stktable_slot_read(stick_slot_t *slot, uint32_t *tag, uint8_t key[16], stick_entry_t **entry) {
+    uint32_t seq;
+    do {
+        seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        *tag = slot->tag;
+        memcpy(key, slot->key, 16);
+        *entry = slot->entry;
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq);
 }
 
 stick_entry_t* stktable_lookup(stick_table_t *t, stick_key_t *key) {
-    uint32_t hash = stktable_hash(key);
-    uint32_t idx = hash % t->hash.size;
-
-    /* Use per-bucket locking for better concurrency */
-    pthread_spin_lock(&t->hash.locks[idx]);
-
-    stick_entry_t *entry = t->hash.entries[idx];
-    while (entry) {
-        if (entry->key.type == key->type) {
-            bool match = false;
-
-            switch (key->type) {
-                case STKTABLE_TYPE_IP:
-                    match = memcmp(&entry->key.data.ipv4, &key->data.ipv4,
-                                  sizeof(struct in_addr)) == 0;
-                    break;
-                case STKTABLE_TYPE_IPV6:
-                    match = memcmp(&entry->key.data.ipv6, &key->data.ipv6,
-                                  sizeof(struct in6_addr)) == 0;
-                    break;
-                case STKTABLE_TYPE_INTEGER:
-                    match = entry->key.data.integer == key->data.integer;
-                    break;
-                case STKTABLE_TYPE_STRING:
-                    match = entry->key.data.str.len == key->data.str.len &&
-                           memcmp(entry->key.data.str.ptr, key->data.str.ptr,
-                                 key->data.str.len) == 0;
-                    break;
-            }
-
-            if (match) {
-                /* Update LRU and access time */
-                entry->last_access = time(NULL);
-                atomic_fetch_add(&t->stats.hits, 1);
-                pthread_spin_unlock(&t->hash.locks[idx]);
-                return entry;
-            }
+    if (key->type != t->type) return NULL;
+
+    uint64_t hash = stktable_hash(key);
+    uint32_t tag = stktable_tag(hash);
+    size_t fixed = stktable_fixed_len(key->type);
+    uint8_t want[16];
+    stktable_slot_key(key, want);
+
+    atomic_fetch_add_explicit(&t->stats.lookups, 1, memory_order_relaxed);
+
+    stick_slots_t *slots = atomic_load_explicit(&t->slots, memory_order_acquire);
+    uint32_t i = (uint32_t)hash & slots->mask;
+
+    for (uint32_t n = 0; n <= slots->mask; n++, i = (i + 1) & slots->mask) {
+        uint32_t stag;
+        uint8_t skey[16];
+        stick_entry_t *entry;
+        stktable_slot_read(&slots->slot[i], &stag, skey, &entry);
+
+        if (stag == STKTABLE_SLOT_EMPTY) {
+            break;
+        }
+        if (stag != tag) {
+            continue;
+        }
+
+        if (fixed ? memcmp(skey, want, sizeof(want)) == 0 : stktable_key_eq(&entry->key, key)) {
+            atomic_store_explicit(&entry->last_access, time(NULL), memory_order_relaxed);
+            atomic_fetch_add_explicit(&t->stats.hits, 1, memory_order_relaxed);
+            return entry;
         }
-        entry = entry->node.node_p;
     }
 
-    atomic_fetch_add(&t->stats.misses, 1);
-    pthread_spin_unlock(&t->hash.locks[idx]);
+    atomic_fetch_add_explicit(&t->stats.misses, 1, memory_order_relaxed);
     return NULL;
 }
 
-stick_entry_t* stktable_get(stick_table_t *t, stick_key_t *key) {
-    stick_entry_t *entry = stktable_lookup(t, key);
-    if (entry) return entry;
+/*
+ * Writer side probe: the slot holding key, or NULL with *free_slot set to
+ * the first tombstone or empty slot it passed. Caller holds the write lock.
+ */
+static stick_slot_t* stktable_find_locked(stick_slots_t *slots, const stick_key_t *key, uint64_t hash,
+                                          stick_slot_t **free_slot) {
+    uint32_t tag = stktable_tag(hash);
+    size_t fixed = stktable_fixed_len(key->type);
+    uint8_t want[16];
+    stktable_slot_key(key, want);
+
+    *free_slot = NULL;
+    uint32_t i = (uint32_t)hash & slots->mask;
+    for (uint32_t n = 0; n <= slots->mask; n++, i = (i + 1) & slots->mask) {
+        stick_slot_t *slot = &slots->slot[i];
+
+        if (slot->tag == STKTABLE_SLOT_EMPTY || slot->tag == STKTABLE_SLOT_TOMB) {
+            if (!*free_slot) *free_slot = slot;
+            if (slot->tag == STKTABLE_SLOT_EMPTY) break;
+            continue;
+        }
+        if (slot->tag == tag &&
+            (fixed ? memcmp(slot->key, want, sizeof(want)) == 0 : stktable_key_eq(&slot->entry->key, key))) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+/* Take entry out of the index and off the wheel; it is freed after the grace period */
+static void stktable_remove_locked(stick_table_t *t, stick_entry_t *entry, time_t now) {
+    stick_slots_t *slots = atomic_load_explicit(&t->slots, memory_order_relaxed);
+    uint32_t i = (uint32_t)entry->hash & slots->mask;
+
+    for (uint32_t n = 0; n <= slots->mask; n++, i = (i + 1) & slots->mask) {
+        stick_slot_t *slot = &slots->slot[i];
+        if (slot->tag == STKTABLE_SLOT_EMPTY) break;
+        if (slot->entry == entry) {
+            stktable_slot_set(slot, STKTABLE_SLOT_TOMB, NULL, NULL);
+            break;
+        }
+    }
+
+    lb_timer_cancel(&t->wheel, &entry->timer);
+    t->current--;
+
+    entry->retired = now;
+    entry->retire_next = t->retired;
+    t->retired = entry;
+}
+
+/* Free what was retired long enough ago that no reader can still hold it */
+static void stktable_reclaim_locked(stick_table_t *t, time_t now) {
+    for (stick_entry_t **p = &t->retired; *p; ) {
+        stick_entry_t *entry = *p;
+        if (now - entry->retired >= STKTABLE_RETIRE_GRACE &&
+            atomic_load_explicit(&entry->dirty, memory_order_acquire) == 0) {
+            *p = entry->retire_next;
+            stktable_entry_free(entry);
+        } else {
+            p = &entry->retire_next;
+        }
+    }
+
+    for (stick_slots_t **p = &t->retired_slots; *p; ) {
+        stick_slots_t *slots = *p;
+        if (now - slots->retired >= STKTABLE_RETIRE_GRACE) {
+            *p = slots->retire_next;
+            stktable_slots_free(slots);
+        } else {
+            p = &slots->retire_next;
+        }
+    }
+}
+
+static void stktable_arm(stick_table_t *t, stick_entry_t *entry, time_t expire, time_t now) {
+    uint64_t delay = expire > now ? (uint64_t)(expire - now) * 1000 : 0;
+    lb_timer_add(&t->wheel, &entry->timer, stktable_now_ms() + delay);
+}
+
+/* Wheel callback: touched or tracked entries go round again */
+static void stktable_expire_cb(lb_timer_t *timer, void *arg) {
+    stick_table_t *t = arg;
+    stick_entry_t *entry = (stick_entry_t*)((char*)timer - offsetof(stick_entry_t, timer));
+    time_t now = time(NULL);
+    time_t expire = atomic_load_explicit(&entry->expire, memory_order_relaxed);
+
+    if (expire > now) {
+        stktable_arm(t, entry, expire, now);
+        return;
+    }
+    if (atomic_load_explicit(&entry->ref_cnt, memory_order_relaxed) > 0) {
+        stktable_arm(t, entry, now + 1, now);
+        return;
+    }
+
+    stktable_remove_locked(t, entry, now);
+    atomic_fetch_add_explicit(&t->stats.expires, 1, memory_order_relaxed);
+}
+
+static void stktable_expire_locked(stick_table_t *t) {
+    lb_timer_advance(&t->wheel, stktable_now_ms(), stktable_expire_cb, t);
+    stktable_reclaim_locked(t, time(NULL));
+}
+
+void stktable_expire(stick_table_t *t) {
+    pthread_spin_lock(&t->write_lock);
+    stktable_expire_locked(t);
+    pthread_spin_unlock(&t->write_lock);
+}
+
+/*
+ * Table full: evict the entry closest to expiry among the untracked ones
+ * in a few occupied slots from where the new key lands. Sampling keeps the
+ * cost bounded without ordering all entries by age.
+ */
+static bool stktable_evict_locked(stick_table_t *t, uint64_t hash) {
+    stick_slots_t *slots = atomic_load_explicit(&t->slots, memory_order_relaxed);
+    stick_entry_t *victim = NULL;
+    uint32_t seen = 0;
+    uint32_t i = (uint32_t)hash & slots->mask;
+
+    for (uint32_t n = 0; n <= slots->mask && seen < STKTABLE_EVICT_SAMPLE; n++, i = (i + 1) & slots->mask) {
+        stick_entry_t *entry = slots->slot[i].entry;
+        if (!entry) continue;
+        seen++;
+        if (atomic_load_explicit(&entry->ref_cnt, memory_order_relaxed) == 0 &&
+            (!victim || atomic_load_explicit(&entry->expire, memory_order_relaxed) <
+                        atomic_load_explicit(&victim->expire, memory_order_relaxed))) {
+            victim = entry;
+        }
+    }
+
+    if (!victim) return false;
+
+    stktable_remove_locked(t, victim, time(NULL));
+    atomic_fetch_add_explicit(&t->stats.evictions, 1, memory_order_relaxed);
+    return true;
+}
+
+/* Too many tombstones: re-insert the live entries into a fresh array */
+static int stktable_rebuild_locked(stick_table_t *t) {
+    stick_slots_t *old = atomic_load_explicit(&t->slots, memory_order_relaxed);
+    stick_slots_t *slots = stktable_slots_new(old->mask + 1);
+    if (!slots) return -1;
+
+    for (uint32_t i = 0; i <= old->mask; i++) {
+        stick_slot_t *from = &old->slot[i];
+        if (!from->entry) continue;
 
-    /* Check if table is full - evict LRU entry if needed */
-    if (t->current >= t->size) {
-        stktable_expire(t);
-
-        if (t->current >= t->size) {
-            /* Still full - evict LRU entry */
-            pthread_rwlock_wrlock(&t->lock);
-
-            stick_entry_t *lru = LIST_ELEM(t->lru.p, stick_entry_t *, list);
-            if (lru && lru->ref_cnt == 0) {
-                uint32_t hash = stktable_hash(&lru->key);
-                uint32_t idx = hash % t->hash.size;
-
-                pthread_spin_lock(&t->hash.locks[idx]);
-                /* Remove from hash table */
-                stick_entry_t **p = &t->hash.entries[idx];
-                while (*p) {
-                    if (*p == lru) {
-                        *p = lru->node.node_p;
-                        break;
-                    }
-                    p = &(*p)->node.node_p;
-                }
-                pthread_spin_unlock(&t->hash.locks[idx]);
-
-                LIST_DEL(&lru->list);
-                pthread_rwlock_destroy(&lru->lock);
-
-                /* Free key data if needed */
-                if (lru->key.type == STKTABLE_TYPE_STRING && lru->key.data.str.ptr) {
-                    free(lru->key.data.str.ptr);
-                }
-
-                free(lru);
-                t->current--;
-                atomic_fetch_add(&t->stats.expires, 1);
-            }
-
-            pthread_rwlock_unlock(&t->lock);
+        uint32_t j = (uint32_t)from->entry->hash & slots->mask;
+        while (slots->slot[j].tag != STKTABLE_SLOT_EMPTY) {
+            j = (j + 1) & slots->mask;
         }
+        slots->slot[j].tag = from->tag;
+        memcpy(slots->slot[j].key, from->key, sizeof(from->key));
+        slots->slot[j].entry = from->entry;
+        slots->used++;
     }
 
-    /* Create new entry */
-    entry = calloc(1, sizeof(*entry));
+    atomic_store_explicit(&t->slots, slots, memory_order_release);
+
+    old->retired = time(NULL);
+    old->retire_next = t->retired_slots;
+    t->retired_slots = old;
+    return 0;
+}
+
+stick_entry_t* stktable_get(stick_table_t *t, stick_key_t *key) {
+    stick_entry_t *entry = stktable_lookup(t, key);
+    if (entry) return entry;
+    if (key->type != t->type) return NULL;
+
+    /* Create new entry before taking the lock */
+    entry = lb_alloc(sizeof(*entry));
     if (!entry) return NULL;
+    memset(entry, 0, sizeof(*entry));
 
     /* Copy key */
     entry->key = *key;
-    if (key->type == STKTABLE_TYPE_STRING) {
-        entry->key.data.str.ptr = malloc(key->data.str.len);
-        if (!entry->key.data.str.ptr) {
-            free(entry);
+    if (key->type == STKTABLE_TYPE_STRING || key->type == STKTABLE_TYPE_BINARY) {
+        size_t len = key->type == STKTABLE_TYPE_STRING ? key->data.str.len : key->data.bin.len;
+        const void *src = key->type == STKTABLE_TYPE_STRING ? (const void*)key->data.str.ptr : key->data.bin.ptr;
+        void *copy = lb_alloc(len ? len : 1);
+        if (!copy) {
+            lb_free(entry, sizeof(*entry));
             return NULL;
         }
-        memcpy(entry->key.data.str.ptr, key->data.str.ptr, key->data.str.len);
+        memcpy(copy, src, len);
+        if (key->type == STKTABLE_TYPE_STRING) {
+            entry->key.data.str.ptr = copy;
+        } else {
+            entry->key.data.bin.ptr = copy;
+        }
     }
 
-    entry->expire = time(NULL) + t->expire;
-    entry->last_access = time(NULL);
+    time_t now = time(NULL);
+    entry->hash = stktable_hash(key);
+    atomic_init(&entry->expire, now + t->expire);
+    atomic_init(&entry->last_access, now);
     pthread_rwlock_init(&entry->lock, NULL);
 
-    /* Insert into hash table */
-    uint32_t hash = stktable_hash(key);
-    uint32_t idx = hash % t->hash.size;
+    pthread_spin_lock(&t->write_lock);
 
-    pthread_spin_lock(&t->hash.locks[idx]);
-    entry->node.node_p = t->hash.entries[idx];
-    t->hash.entries[idx] = entry;
-    pthread_spin_unlock(&t->hash.locks[idx]);
+    stktable_expire_locked(t);
 
-    /* Add to LRU list */
-    pthread_rwlock_wrlock(&t->lock);
-    LIST_ADDQ(&t->lru, &entry->list);
+    /* Another thread may have inserted it since the lookup */
+    stick_slot_t *free_slot;
+    stick_slot_t *slot = stktable_find_locked(atomic_load_explicit(&t->slots, memory_order_relaxed),
+                                              key, entry->hash, &free_slot);
+    if (slot) {
+        stick_entry_t *found = slot->entry;
+        pthread_spin_unlock(&t->write_lock);
+        stktable_entry_free(entry);
+        return found;
+    }
+
+    if (t->current >= t->size && !stktable_evict_locked(t, entry->hash)) {
+        /* Full of tracked entries */
+        pthread_spin_unlock(&t->write_lock);
+        stktable_entry_free(entry);
+        return NULL;
+    }
+
+    stick_slots_t *slots = atomic_load_explicit(&t->slots, memory_order_relaxed);
+    if (slots->used >= (slots->mask + 1) / 4 * 3 && stktable_rebuild_locked(t) == 0) {
+        slots = atomic_load_explicit(&t->slots, memory_order_relaxed);
+    }
+    stktable_find_locked(slots, key, entry->hash, &free_slot);
+
+    if (!free_slot) {
+        pthread_spin_unlock(&t->write_lock);
+        stktable_entry_free(entry);
+        return NULL;
+    }
+
+    uint8_t inline_key[16];
+    stktable_slot_key(key, inline_key);
+    if (free_slot->tag == STKTABLE_SLOT_EMPTY) {
+        slots->used++;
+    }
+    stktable_slot_set(free_slot, stktable_tag(entry->hash), inline_key, entry);
     t->current++;
-    pthread_rwlock_unlock(&t->lock);
+    stktable_arm(t, entry, now + t->expire, now);
+
+    pthread_spin_unlock(&t->write_lock);
 
     atomic_fetch_add(&t->stats.inserts, 1);
 
@@ -219,59 +456,24 @@ stick_entry_t* stktable_get(stick_table_t *t, stick_key_t *key) {
 }
 
 void stktable_touch(stick_table_t *t, stick_entry_t *entry) {
-    /* Update access time and move to head of LRU */
-    entry->last_access = time(NULL);
-
-    pthread_rwlock_wrlock(&t->lock);
-    LIST_DEL(&entry->list);
-    LIST_ADD(&t->lru, &entry->list);
-    pthread_rwlock_unlock(&t->lock);
-}
-
-void stktable_expire(stick_table_t *t) {
+    /* The wheel notices the later expiry when the old one comes round */
     time_t now = time(NULL);
-    stick_entry_t *entry, *next;
-
-    pthread_rwlock_wrlock(&t->lock);
-
-    /* Walk LRU list from tail (oldest entries) */
-    list_for_each_entry_safe_rev(entry, next, &t->lru, list) {
-        if (entry->expire > now && entry->ref_cnt > 0)
-            break;  /* Still valid or in use */
-
-        if (entry->ref_cnt > 0)
-            continue;  /* Skip if referenced */
-
-        /* Remove from hash table */
-        uint32_t hash = stktable_hash(&entry->key);
-        uint32_t idx = hash % t->hash.size;
-
-        pthread_spin_lock(&t->hash.locks[idx]);
-        stick_entry_t **p = &t->hash.entries[idx];
-        while (*p) {
-            if (*p == entry) {
-                *p = entry->node.node_p;
-                break;
-            }
-            p = &(*p)->node.node_p;
-        }
-        pthread_spin_unlock(&t->hash.locks[idx]);
+    atomic_store_explicit(&entry->last_access, now, memory_order_relaxed);
+    atomic_store_explicit(&entry->expire, now + t->expire, memory_order_relaxed);
+}
 
-        /* Remove from LRU list */
-        LIST_DEL(&entry->list);
+void stktable_purge(stick_table_t *t) {
+    pthread_spin_lock(&t->write_lock);
 
-        /* Free entry */
-        if (entry->key.type == STKTABLE_TYPE_STRING && entry->key.data.str.ptr) {
-            free(entry->key.data.str.ptr);
+    stick_slots_t *slots = atomic_load_explicit(&t->slots, memory_order_relaxed);
+    time_t now = time(NULL);
+    for (uint32_t i = 0; i <= slots->mask; i++) {
+        if (slots->slot[i].entry) {
+            stktable_remove_locked(t, slots->slot[i].entry, now);
         }
-        pthread_rwlock_destroy(&entry->lock);
-        free(entry);
-
-        t->current--;
-        atomic_fetch_add(&t->stats.expires, 1);
     }
 
-    pthread_rwlock_unlock(&t->lock);
+    pthread_spin_unlock(&t->write_lock);
 }
 
 int stktable_update_key(stick_table_t *t, stick_key_t *key, int data_type, void *value) {
@@ -306,22 +508,94 @@ int stktable_update_key(stick_table_t *t, stick_key_t *key, int data_type, void
 
     pthread_rwlock_unlock(&entry->lock);
     atomic_fetch_add(&t->stats.updates, 1);
+    stktable_mark_dirty(t, entry, (uint32_t)data_type);
 
     return 0;
 }
 
+void stktable_mark_dirty(stick_table_t *t, stick_entry_t *entry, uint32_t data_types) {
+    if (!t->replicated) return;
+
+    /* Only the first change since the last send queues the entry */
+    if (atomic_fetch_or_explicit(&entry->dirty, data_types, memory_order_acq_rel) != 0) {
+        return;
+    }
+
+    stick_entry_t *head = atomic_load_explicit(&t->dirty, memory_order_relaxed);
+    do {
+        entry->dirty_next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&t->dirty, &head, entry,
+                                                    memory_order_release, memory_order_relaxed));
+}
+
+stick_entry_t* stktable_take_dirty(stick_table_t *t) {
+    /* Taking the whole list at once leaves no room for ABA */
+    return atomic_exchange_explicit(&t->dirty, NULL, memory_order_acquire);
+}
+
+stick_entry_t* stktable_next(stick_table_t *t, uint32_t *pos) {
+    stick_slots_t *slots = atomic_load_explicit(&t->slots, memory_order_acquire);
+
+    for (; *pos <= slots->mask; (*pos)++) {
+        uint32_t tag;
+        uint8_t key[16];
+        stick_entry_t *entry;
+        stktable_slot_read(&slots->slot[*pos], &tag, key, &entry);
+        if (entry) {
+            (*pos)++;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+int stktable_share_count(stick_table_t *t, const char *name, const char *node,
+                         uint32_t local, uint64_t *remote, uint32_t *nodes) {
+    if (t->type != STKTABLE_TYPE_STRING) return -1;
+
+    char own[256];
+    int own_len = snprintf(own, sizeof(own), "%s@%s", name, node);
+    if (own_len < 0 || own_len >= (int)sizeof(own)) return -1;
+
+    /* Touched first, so the record the peers send carries the new expiry */
+    stick_key_t key = { .type = STKTABLE_TYPE_STRING, .data.str = { own, own_len } };
+    stick_entry_t *entry = stktable_get(t, &key);
+    if (!entry) return -1;
+    stktable_touch(t, entry);
+    if (stktable_update_key(t, &key, STKTABLE_DATA_HTTP_REQ_CNT, &local) < 0) return -1;
+
+    size_t prefix = strlen(name) + 1;
+    time_t now = time(NULL);
+    uint32_t pos = 0;
+    *remote = 0;
+    *nodes = 0;
+
+    while ((entry = stktable_next(t, &pos))) {
+        size_t len = entry->key.data.str.len;
+        const char *k = entry->key.data.str.ptr;
+        if (len <= prefix || memcmp(k, own, prefix) != 0) continue;
+        if (len == (size_t)own_len && memcmp(k, own, len) == 0) continue;
+        if (atomic_load_explicit(&entry->expire, memory_order_relaxed) <= now) continue;
+
+        *remote += atomic_load_explicit(&entry->counters.http_req_cnt, memory_order_relaxed);
+        (*nodes)++;
+    }
+    return 0;
+}
+
 /* Track a session with stick table */
 int stksess_track(struct session *sess, stick_table_t *t, stick_key_t *key) {
     stick_entry_t *entry = stktable_get(t, key);
     if (!entry) return -1;
 
     /* Increment reference count to prevent eviction */
-    entry->ref_cnt++;
+    atomic_fetch_add(&entry->ref_cnt, 1);
 
     /* Update counters */
     atomic_fetch_add(&entry->counters.conn_cnt, 1);
     atomic_fetch_add(&entry->counters.conn_cur, 1);
     atomic_fetch_add(&entry->counters.sess_cnt, 1);
+    stktable_mark_dirty(t, entry, STKTABLE_DATA_CONN_CNT | STKTABLE_DATA_CONN_CUR | STKTABLE_DATA_SESS_CNT);
 
     /* Store in session for later use */
     if (sess->stkctr) {
@@ -371,27 +645,27 @@ void stick_tables_deinit() {
 void stktable_free(stick_table_t *t) {
     if (!t) return;
 
-    /* Free all entries */
-    for (uint32_t i = 0; i < t->hash.size; i++) {
-        stick_entry_t *entry = t->hash.entries[i];
-        while (entry) {
-            stick_entry_t *next = entry->node.node_p;
-
-            if (entry->key.type == STKTABLE_TYPE_STRING && entry->key.data.str.ptr) {
-                free(entry->key.data.str.ptr);
-            }
-
-            pthread_rwlock_destroy(&entry->lock);
-            free(entry);
-            entry = next;
+    /* No readers are left, so nothing waits out the grace period */
+    stick_slots_t *slots = atomic_load_explicit(&t->slots, memory_order_relaxed);
+    for (uint32_t i = 0; i <= slots->mask; i++) {
+        if (slots->slot[i].entry) {
+            stktable_entry_free(slots->slot[i].entry);
         }
+    }
+    stktable_slots_free(slots);
 
-        pthread_spin_destroy(&t->hash.locks[i]);
+    while (t->retired) {
+        stick_entry_t *next = t->retired->retire_next;
+        stktable_entry_free(t->retired);
+        t->retired = next;
+    }
+    while (t->retired_slots) {
+        stick_slots_t *next = t->retired_slots->retire_next;
+        stktable_slots_free(t->retired_slots);
+        t->retired_slots = next;
     }
 
-    free(t->hash.entries);
-    free(t->hash.locks);
+    pthread_spin_destroy(&t->write_lock);
     free(t->id);
-    pthread_rwlock_destroy(&t->lock);
     free(t);
-}
\ No newline at end of file
+}
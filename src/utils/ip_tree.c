@@ -0,0 +1,245 @@
+#include "utils/ip_tree.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define IPT_STRIDE  6
+
+typedef struct {
+    uint64_t hi, lo;            /* address, big endian bit order, past len zero */
+    uint32_t len;
+} ipt_prefix_t;
+
+typedef struct {
+    uint64_t leaf;              /* slots inside a prefix */
+    uint64_t child;             /* slots with a child node */
+    uint32_t base;              /* index of the first child */
+} ipt_node_t;
+
+typedef struct {
+    ipt_prefix_t *prefixes;
+    uint32_t prefix_count, prefix_cap;
+    ipt_node_t *nodes;          /* nodes[0] is the root, if any */
+    uint32_t node_count, node_cap;
+} ipt_trie_t;
+
+struct ip_tree {
+    ipt_trie_t v4, v6;
+};
+
+/* IPT_STRIDE bits of the 128-bit key from bit off, zero past its end */
+static inline unsigned ipt_slot(uint64_t hi, uint64_t lo, unsigned off) {
+    if (off <= 64 - IPT_STRIDE)
+        return (hi >> (64 - IPT_STRIDE - off)) & 63;
+    if (off < 64)
+        return ((hi << (off - (64 - IPT_STRIDE))) | (lo >> (128 - IPT_STRIDE - off))) & 63;
+    off -= 64;
+    if (off <= 64 - IPT_STRIDE)
+        return (lo >> (64 - IPT_STRIDE - off)) & 63;
+    return (lo << (off - (64 - IPT_STRIDE))) & 63;
+}
+
+static int ipt_add(ipt_trie_t *t, uint64_t hi, uint64_t lo, uint32_t len) {
+    if (t->prefix_count == t->prefix_cap) {
+        uint32_t cap = t->prefix_cap ? t->prefix_cap * 2 : 16;
+        ipt_prefix_t *p = realloc(t->prefixes, cap * sizeof(*p));
+        if (!p)
+            return -1;
+        t->prefixes = p;
+        t->prefix_cap = cap;
+    }
+
+    // Clear what the length leaves out, so equal prefixes compare equal
+    if (len < 64) {
+        hi &= len ? ~0ULL << (64 - len) : 0;
+        lo = 0;
+    } else if (len < 128) {
+        lo &= len > 64 ? ~0ULL << (128 - len) : 0;
+    }
+
+    t->prefixes[t->prefix_count++] = (ipt_prefix_t){hi, lo, len};
+    return 0;
+}
+
+static int ipt_cmp(const void *a, const void *b) {
+    const ipt_prefix_t *x = a, *y = b;
+    if (x->hi != y->hi)
+        return x->hi < y->hi ? -1 : 1;
+    if (x->lo != y->lo)
+        return x->lo < y->lo ? -1 : 1;
+    return (int)x->len - (int)y->len;
+}
+
+static bool ipt_covers(const ipt_prefix_t *p, const ipt_prefix_t *q) {
+    if (p->len > q->len)
+        return false;
+    if (p->len <= 64) {
+        uint64_t mask = p->len ? ~0ULL << (64 - p->len) : 0;
+        return (q->hi & mask) == p->hi;
+    }
+    uint64_t mask = ~0ULL << (128 - p->len);
+    return q->hi == p->hi && (q->lo & mask) == p->lo;
+}
+
+static int ipt_new_nodes(ipt_trie_t *t, uint32_t n) {
+    if (t->node_count + n > t->node_cap) {
+        uint32_t cap = t->node_cap ? t->node_cap : 64;
+        while (cap < t->node_count + n)
+            cap *= 2;
+        ipt_node_t *nodes = realloc(t->nodes, cap * sizeof(*nodes));
+        if (!nodes)
+            return -1;
+        t->nodes = nodes;
+        t->node_cap = cap;
+    }
+
+    uint32_t first = t->node_count;
+    memset(t->nodes + first, 0, n * sizeof(*t->nodes));
+    t->node_count += n;
+    return (int)first;
+}
+
+/* Fills node from prefixes [lo, hi), which all agree on their first off
+ * bits and are longer than that */
+static int ipt_build(ipt_trie_t *t, uint32_t node, uint32_t lo, uint32_t hi, unsigned off) {
+    uint64_t leaf = 0, child = 0;
+    uint32_t i;
+
+    for (i = lo; i < hi; i++) {
+        const ipt_prefix_t *p = &t->prefixes[i];
+        unsigned slot = ipt_slot(p->hi, p->lo, off);
+        if (p->len <= off + IPT_STRIDE) {
+            unsigned span = 1U << (off + IPT_STRIDE - p->len);
+            leaf |= (span == 64 ? ~0ULL : ((1ULL << span) - 1)) << slot;
+        } else {
+            child |= 1ULL << slot;
+        }
+    }
+
+    int base = 0;
+    if (child) {
+        base = ipt_new_nodes(t, (uint32_t)__builtin_popcountll(child));
+        if (base < 0)
+            return -1;
+    }
+    t->nodes[node].leaf = leaf;
+    t->nodes[node].child = child;
+    t->nodes[node].base = (uint32_t)base;
+
+    // Prefixes are sorted, so the ones under a slot are next to each other
+    uint32_t next = (uint32_t)base;
+    for (i = lo; i < hi;) {
+        const ipt_prefix_t *p = &t->prefixes[i];
+        unsigned slot = ipt_slot(p->hi, p->lo, off);
+        uint32_t end = i + 1;
+        while (end < hi && ipt_slot(t->prefixes[end].hi, t->prefixes[end].lo, off) == slot)
+            end++;
+
+        if (child & (1ULL << slot)) {
+            if (ipt_build(t, next++, i, end, off + IPT_STRIDE) < 0)
+                return -1;
+        }
+        i = end;
+    }
+    return 0;
+}
+
+static int ipt_compile(ipt_trie_t *t) {
+    t->node_count = 0;
+    if (!t->prefix_count)
+        return 0;
+
+    qsort(t->prefixes, t->prefix_count, sizeof(*t->prefixes), ipt_cmp);
+
+    // Sorted, a prefix comes right after the shortest one covering it
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < t->prefix_count; i++) {
+        if (kept && ipt_covers(&t->prefixes[kept - 1], &t->prefixes[i]))
+            continue;
+        t->prefixes[kept++] = t->prefixes[i];
+    }
+    t->prefix_count = kept;
+
+    if (ipt_new_nodes(t, 1) < 0 || ipt_build(t, 0, 0, kept, 0) < 0)
+        return -1;
+
+    ipt_node_t *nodes = realloc(t->nodes, t->node_count * sizeof(*nodes));
+    if (nodes) {
+        t->nodes = nodes;
+        t->node_cap = t->node_count;
+    }
+
+    // Only the nodes are needed from here on
+    free(t->prefixes);
+    t->prefixes = NULL;
+    t->prefix_count = t->prefix_cap = 0;
+    return 0;
+}
+
+static bool ipt_lookup(const ipt_trie_t *t, uint64_t hi, uint64_t lo) {
+    if (!t->node_count)
+        return false;
+
+    const ipt_node_t *n = t->nodes;
+    for (unsigned off = 0;; off += IPT_STRIDE) {
+        uint64_t bit = 1ULL << ipt_slot(hi, lo, off);
+        if (n->leaf & bit)
+            return true;
+        if (!(n->child & bit))
+            return false;
+        n = &t->nodes[n->base + __builtin_popcountll(n->child & (bit - 1))];
+    }
+}
+
+static void ipt_key6(const struct in6_addr *addr, uint64_t *hi, uint64_t *lo) {
+    const uint8_t *b = addr->s6_addr;
+    *hi = *lo = 0;
+    for (int i = 0; i < 8; i++) {
+        *hi = (*hi << 8) | b[i];
+        *lo = (*lo << 8) | b[i + 8];
+    }
+}
+
+ip_tree_t *ip_tree_create(void) {
+    return calloc(1, sizeof(ip_tree_t));
+}
+
+void ip_tree_destroy(ip_tree_t *tree) {
+    if (!tree)
+        return;
+    free(tree->v4.prefixes);
+    free(tree->v4.nodes);
+    free(tree->v6.prefixes);
+    free(tree->v6.nodes);
+    free(tree);
+}
+
+int ip_tree_add4(ip_tree_t *tree, struct in_addr addr, int len) {
+    if (len < 0 || len > 32)
+        return -1;
+    return ipt_add(&tree->v4, (uint64_t)ntohl(addr.s_addr) << 32, 0, (uint32_t)len);
+}
+
+int ip_tree_add6(ip_tree_t *tree, const struct in6_addr *addr, int len) {
+    if (len < 0 || len > 128)
+        return -1;
+    uint64_t hi, lo;
+    ipt_key6(addr, &hi, &lo);
+    return ipt_add(&tree->v6, hi, lo, (uint32_t)len);
+}
+
+int ip_tree_compile(ip_tree_t *tree) {
+    if (ipt_compile(&tree->v4) < 0 || ipt_compile(&tree->v6) < 0)
+        return -1;
+    return 0;
+}
+
+bool ip_tree_lookup4(const ip_tree_t *tree, struct in_addr addr) {
+    return ipt_lookup(&tree->v4, (uint64_t)ntohl(addr.s_addr) << 32, 0);
+}
+
+bool ip_tree_lookup6(const ip_tree_t *tree, const struct in6_addr *addr) {
+    uint64_t hi, lo;
+    ipt_key6(addr, &hi, &lo);
+    return ipt_lookup(&tree->v6, hi, lo);
+}
@@ -1,34 +1,217 @@
 #include "utils/log.h"
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define LOG_DRAIN_INTERVAL_NS 10000000  // 10ms
+#define LOG_BATCH_SIZE        65536
 
 static int log_level = LOG_INFO;
 static const char *log_ident = "ultrabalancer";
 
+static const char *level_str[] = {
+    "EMERG", "ALERT", "CRIT", "ERROR",
+    "WARN", "NOTICE", "INFO", "DEBUG"
+};
+
+// Single-producer/single-consumer ring: the owning thread formats lines into
+// slots and advances head, the drain thread writes them out and advances tail.
+// Rings are never freed since a thread may log at any point until exit.
+typedef struct log_ring {
+    struct log_ring *next;
+    _Atomic uint32_t head;
+    _Atomic uint32_t tail;
+    _Atomic uint64_t dropped;
+    struct {
+        uint32_t len;
+        char line[LOG_LINE_MAX];
+    } slots[LOG_RING_SLOTS];
+} log_ring_t;
+
+static _Atomic(log_ring_t *) log_rings;
+static __thread log_ring_t *log_self;
+static _Atomic bool log_async;
+static pthread_t log_thread;
+
 void log_init(const char *ident, int level) {
     if (ident) log_ident = ident;
     log_level = level;
 }
 
+int log_enabled(int level) {
+    return level <= log_level;
+}
+
+static uint64_t log_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Format one complete line, newline included, into buf
+static size_t log_format(char *buf, size_t size, int level, const char *fmt, va_list ap) {
+    static __thread time_t cached_sec = -1;
+    static __thread char timestamp[32];
+
+    time_t now = time(NULL);
+    if (now != cached_sec) {
+        struct tm tm;
+        localtime_r(&now, &tm);
+        strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", &tm);
+        cached_sec = now;
+    }
+
+    int n = snprintf(buf, size, "[%s] %s %s: ", timestamp, log_ident, level_str[level & 7]);
+    if (n < 0) n = 0;
+    if ((size_t)n < size - 1) {
+        int m = vsnprintf(buf + n, size - 1 - n, fmt, ap);
+        if (m > 0) n += m;
+    }
+    if ((size_t)n > size - 2) n = size - 2;  // truncated
+    buf[n++] = '\n';
+    buf[n] = '\0';
+    return n;
+}
+
+static log_ring_t *log_ring_get(void) {
+    if (log_self) return log_self;
+
+    log_ring_t *ring = calloc(1, sizeof(*ring));
+    if (!ring) return NULL;
+
+    log_ring_t *head = atomic_load(&log_rings);
+    do {
+        ring->next = head;
+    } while (!atomic_compare_exchange_weak(&log_rings, &head, ring));
+
+    log_self = ring;
+    return ring;
+}
+
 static void log_write(int level, const char *fmt, va_list ap) {
     if (level > log_level)
         return;
 
-    time_t now = time(NULL);
-    struct tm *tm = localtime(&now);
+    log_ring_t *ring = atomic_load_explicit(&log_async, memory_order_acquire) ? log_ring_get() : NULL;
+    if (!ring) {
+        char line[LOG_LINE_MAX];
+        size_t len = log_format(line, sizeof(line), level, fmt, ap);
+        ssize_t ret = write(STDERR_FILENO, line, len);
+        (void)ret;
+        return;
+    }
+
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail >= LOG_RING_SLOTS) {
+        // Never block the caller on a slow drain
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
 
-    char timestamp[32];
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", tm);
+    uint32_t idx = head & (LOG_RING_SLOTS - 1);
+    ring->slots[idx].len = log_format(ring->slots[idx].line, LOG_LINE_MAX, level, fmt, ap);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// Copy everything queued in all rings into batches, one write() per batch.
+// Returns the number of lines written.
+static size_t log_drain(void) {
+    static char batch[LOG_BATCH_SIZE];
+    size_t used = 0;
+    size_t lines = 0;
+
+    for (log_ring_t *ring = atomic_load(&log_rings); ring; ring = ring->next) {
+        uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+        for (; tail != head; tail++) {
+            uint32_t idx = tail & (LOG_RING_SLOTS - 1);
+            uint32_t len = ring->slots[idx].len;
+            if (used + len > sizeof(batch)) {
+                ssize_t ret = write(STDERR_FILENO, batch, used);
+                (void)ret;
+                used = 0;
+            }
+            memcpy(batch + used, ring->slots[idx].line, len);
+            used += len;
+            lines++;
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+        uint64_t dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+        if (dropped && used + LOG_LINE_MAX <= sizeof(batch)) {
+            used += snprintf(batch + used, LOG_LINE_MAX,
+                             "[log] %llu messages dropped (ring full)\n",
+                             (unsigned long long)dropped);
+        }
+    }
+
+    if (used > 0) {
+        ssize_t ret = write(STDERR_FILENO, batch, used);
+        (void)ret;
+    }
+    return lines;
+}
+
+static void *log_drain_thread(void *arg) {
+    (void)arg;
+    struct timespec idle = { 0, LOG_DRAIN_INTERVAL_NS };
+
+    while (atomic_load_explicit(&log_async, memory_order_acquire)) {
+        if (log_drain() == 0) {
+            nanosleep(&idle, NULL);
+        }
+    }
+    log_drain();
+    return NULL;
+}
+
+int log_start(void) {
+    if (atomic_load(&log_async)) return 0;
 
-    const char *level_str[] = {
-        "EMERG", "ALERT", "CRIT", "ERROR",
-        "WARN", "NOTICE", "INFO", "DEBUG"
-    };
+    atomic_store(&log_async, true);
+    if (pthread_create(&log_thread, NULL, log_drain_thread, NULL) != 0) {
+        atomic_store(&log_async, false);
+        return -1;
+    }
+    return 0;
+}
+
+void log_stop(void) {
+    if (!atomic_exchange(&log_async, false)) return;
+    pthread_join(log_thread, NULL);
+    log_drain();
+}
 
-    fprintf(stderr, "[%s] %s %s: ", timestamp, log_ident, level_str[level]);
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
+void log_emit(int level, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    log_write(level, fmt, ap);
+    va_end(ap);
+}
+
+// Returns UINT32_MAX when the caller should stay quiet, otherwise the number
+// of messages suppressed since the last one that went out
+uint32_t log_ratelimit_check(log_ratelimit_t *rl, uint32_t burst, uint32_t interval_ms) {
+    uint64_t now = log_now_ms();
+    uint64_t start = atomic_load_explicit(&rl->window_start_ms, memory_order_relaxed);
+
+    if (now - start >= interval_ms &&
+        atomic_compare_exchange_strong(&rl->window_start_ms, &start, now)) {
+        atomic_store_explicit(&rl->emitted, 0, memory_order_relaxed);
+    }
+
+    if (atomic_fetch_add_explicit(&rl->emitted, 1, memory_order_relaxed) >= burst) {
+        atomic_fetch_add_explicit(&rl->suppressed, 1, memory_order_relaxed);
+        return UINT32_MAX;
+    }
+    return atomic_exchange_explicit(&rl->suppressed, 0, memory_order_relaxed);
 }
 
 void log_error(const char *fmt, ...) {
@@ -57,4 +240,4 @@ void log_debug(const char *fmt, ...) {
     va_start(ap, fmt);
     log_write(LOG_DEBUG, fmt, ap);
     va_end(ap);
-}
\ No newline at end of file
+}
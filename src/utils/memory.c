@@ -1,62 +1,418 @@
 #include "core/loadbalancer.h"
+#include "core/lb_numa.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <sys/mman.h>
 
-#define ALIGN_SIZE(size) (((size) + 7) & ~7)
+// A free block: chained in a magazine or batch by next, batches in the
+// depot by next_batch
+typedef struct memory_block {
+    struct memory_block* next;
+    struct memory_block* next_batch;
+} memory_block_t;
+
+static _Atomic uint32_t memory_thread_count;
+static __thread int memory_thread_index = -1;
+
+// Live pools and the thread slots given back by exited threads, under
+// memory_pools_lock
+static pthread_mutex_t memory_pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static memory_pool_t* memory_pools;
+static int memory_free_slots[MEMORY_POOL_THREADS];
+static uint32_t memory_free_slot_count;
+static pthread_key_t memory_thread_key;
+static pthread_once_t memory_thread_once = PTHREAD_ONCE_INIT;
+
+static inline uint32_t memory_class(size_t size) {
+    if (size <= 128) return size ? (uint32_t)((size + 15) >> 4) - 1 : 0;
+    uint32_t k = 63 - __builtin_clzll(size - 1);
+    return 8 + (k - 7) * 4 + (uint32_t)(((size - 1) >> (k - 2)) & 3);
+}
 
-void* memory_pool_alloc(memory_pool_t* pool, size_t size) {
-    size = ALIGN_SIZE(size);
+static inline size_t memory_class_size(uint32_t c) {
+    if (c < 8) return (size_t)(c + 1) * 16;
+    uint32_t k = 7 + (c - 8) / 4;
+    return ((size_t)1 << k) + ((size_t)((c - 8) % 4 + 1) << (k - 2));
+}
 
-    pthread_spin_lock(&pool->lock);
+// Blocks moved per refill or return: about 64 KB, between 2 and 64 blocks
+static inline uint32_t memory_class_batch(uint32_t c) {
+    size_t n = MEMORY_CLASS_MAX / memory_class_size(c);
+    return n < 2 ? 2 : n > 64 ? 64 : (uint32_t)n;
+}
 
-    if (pool->free_list) {
-        memory_chunk_t* prev = NULL;
-        memory_chunk_t* chunk = pool->free_list;
+// At thread exit: every magazine the thread holds goes back to its
+// pool's depot as loose blocks, and the slot to the next thread
+static void memory_thread_exit(void* slot) {
+    int index = (int)(intptr_t)slot - 1;
+
+    pthread_mutex_lock(&memory_pools_lock);
+    for (memory_pool_t* pool = memory_pools; pool; pool = pool->next) {
+        memory_tcache_t* tc = pool->tcache[index];
+        if (!tc) continue;
+
+        pthread_spin_lock(&pool->lock);
+        for (uint32_t c = 0; c < MEMORY_CLASS_COUNT; c++) {
+            memory_block_t* head = tc->mag[c].head;
+            if (!head) continue;
+            memory_block_t* last = head;
+            while (last->next) last = last->next;
+            last->next = pool->depot[c].loose;
+            pool->depot[c].loose = head;
+        }
+        pthread_spin_unlock(&pool->lock);
+
+        pool->tcache[index] = NULL;
+        free(tc);
+    }
+    memory_free_slots[memory_free_slot_count++] = index;
+    pthread_mutex_unlock(&memory_pools_lock);
+
+    memory_thread_index = -1;
+}
 
-        while (chunk) {
-            if (chunk->size >= size) {
-                if (prev) {
-                    prev->next = chunk->next;
-                } else {
-                    pool->free_list = chunk->next;
-                }
+static void memory_thread_key_create(void) {
+    pthread_key_create(&memory_thread_key, memory_thread_exit);
+}
+
+static void memory_thread_claim(void) {
+    memory_thread_index = MEMORY_POOL_THREADS;
+    pthread_once(&memory_thread_once, memory_thread_key_create);
+
+    pthread_mutex_lock(&memory_pools_lock);
+    int index = -1;
+    if (memory_free_slot_count) {
+        index = memory_free_slots[--memory_free_slot_count];
+    } else if (atomic_load(&memory_thread_count) < MEMORY_POOL_THREADS) {
+        index = (int)atomic_fetch_add(&memory_thread_count, 1);
+    }
+    pthread_mutex_unlock(&memory_pools_lock);
+
+    if (index < 0) return;
+    if (pthread_setspecific(memory_thread_key, (void*)(intptr_t)(index + 1)) != 0) {
+        // Without the destructor the slot could not be given back
+        pthread_mutex_lock(&memory_pools_lock);
+        memory_free_slots[memory_free_slot_count++] = index;
+        pthread_mutex_unlock(&memory_pools_lock);
+        return;
+    }
+    memory_thread_index = index;
+}
+
+static memory_tcache_t* memory_tcache(memory_pool_t* pool) {
+    if (memory_thread_index < 0) memory_thread_claim();
+    if (memory_thread_index >= MEMORY_POOL_THREADS) return NULL;
+
+    memory_tcache_t* tc = pool->tcache[memory_thread_index];
+    if (!tc) {
+        tc = calloc(1, sizeof(*tc));
+        pool->tcache[memory_thread_index] = tc;
+    }
+    return tc;
+}
 
-                pthread_spin_unlock(&pool->lock);
-                return chunk;
+// Under the lock: fresh blocks cut from the unused end, line aligned when
+// the block size is a multiple of a line
+static void* memory_pool_carve(memory_pool_t* pool, size_t size) {
+    size_t align = (size % CACHE_LINE_SIZE) ? 16 : CACHE_LINE_SIZE;
+    size_t at = (pool->used + align - 1) & ~(align - 1);
+    if (at + size > pool->size) return NULL;
+    pool->used = at + size;
+    return (char*)pool->base + at;
+}
+
+static void memory_pool_refill(memory_pool_t* pool, uint32_t c, memory_magazine_t* mag) {
+    uint32_t batch = memory_class_batch(c);
+    size_t size = memory_class_size(c);
+    memory_depot_t* d = &pool->depot[c];
+
+    pthread_spin_lock(&pool->lock);
+    if (d->batches) {
+        mag->head = d->batches;
+        d->batches = d->batches->next_batch;
+        mag->count = batch;
+    } else {
+        while (mag->count < batch) {
+            memory_block_t* b = d->loose;
+            if (b) {
+                d->loose = b->next;
+            } else if (!(b = memory_pool_carve(pool, size))) {
+                break;
             }
-            prev = chunk;
-            chunk = chunk->next;
+            b->next = mag->head;
+            mag->head = b;
+            mag->count++;
         }
     }
+    pthread_spin_unlock(&pool->lock);
+}
 
-    if (pool->used + size > pool->size) {
-        pthread_spin_unlock(&pool->lock);
-        return NULL;
-    }
+// Hands the first batch of a full magazine back to the depot
+static void memory_pool_return(memory_pool_t* pool, uint32_t c, memory_magazine_t* mag) {
+    uint32_t batch = memory_class_batch(c);
+    memory_block_t* first = mag->head;
+    memory_block_t* last = first;
+    for (uint32_t i = 1; i < batch; i++) last = last->next;
+    mag->head = last->next;
+    mag->count -= batch;
+    last->next = NULL;
+
+    pthread_spin_lock(&pool->lock);
+    first->next_batch = pool->depot[c].batches;
+    pool->depot[c].batches = first;
+    pthread_spin_unlock(&pool->lock);
+}
 
-    void* ptr = (char*)pool->base + pool->used;
-    pool->used += size;
+static void* memory_pool_alloc_large(memory_pool_t* pool, size_t size) {
+    size = (size + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
 
+    pthread_spin_lock(&pool->lock);
+    void* ptr = NULL;
+    for (memory_chunk_t** at = &pool->free_list; *at; at = &(*at)->next) {
+        if ((*at)->size == size) {
+            ptr = *at;
+            *at = (*at)->next;
+            break;
+        }
+    }
+    if (!ptr) ptr = memory_pool_carve(pool, size);
     pthread_spin_unlock(&pool->lock);
     return ptr;
 }
 
+void* memory_pool_alloc(memory_pool_t* pool, size_t size) {
+    if (size > MEMORY_CLASS_MAX) return memory_pool_alloc_large(pool, size);
+
+    uint32_t c = memory_class(size);
+    memory_tcache_t* tc = memory_tcache(pool);
+    if (tc) {
+        memory_magazine_t* mag = &tc->mag[c];
+        if (!mag->head) memory_pool_refill(pool, c, mag);
+        memory_block_t* b = mag->head;
+        if (b) {
+            mag->head = b->next;
+            mag->count--;
+        }
+        return b;
+    }
+
+    // No magazine: one block from the depot
+    memory_depot_t* d = &pool->depot[c];
+    pthread_spin_lock(&pool->lock);
+    memory_block_t* b = d->loose;
+    if (b) {
+        d->loose = b->next;
+    } else if ((b = d->batches)) {
+        d->batches = b->next_batch;
+        d->loose = b->next;
+    } else {
+        b = memory_pool_carve(pool, memory_class_size(c));
+    }
+    pthread_spin_unlock(&pool->lock);
+    return b;
+}
+
 void memory_pool_free(memory_pool_t* pool, void* ptr, size_t size) {
     if (!ptr) return;
 
-    size = ALIGN_SIZE(size);
+    if (size > MEMORY_CLASS_MAX) {
+        memory_chunk_t* chunk = (memory_chunk_t*)ptr;
+        chunk->size = (size + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+        pthread_spin_lock(&pool->lock);
+        chunk->next = pool->free_list;
+        pool->free_list = chunk;
+        pthread_spin_unlock(&pool->lock);
+        return;
+    }
 
-    memory_chunk_t* chunk = (memory_chunk_t*)ptr;
-    chunk->size = size;
+    uint32_t c = memory_class(size);
+    memory_block_t* b = (memory_block_t*)ptr;
+    memory_tcache_t* tc = memory_tcache(pool);
+    if (tc) {
+        memory_magazine_t* mag = &tc->mag[c];
+        b->next = mag->head;
+        mag->head = b;
+        if (++mag->count >= 2 * memory_class_batch(c)) memory_pool_return(pool, c, mag);
+        return;
+    }
 
     pthread_spin_lock(&pool->lock);
-    chunk->next = pool->free_list;
-    pool->free_list = chunk;
+    b->next = pool->depot[c].loose;
+    pool->depot[c].loose = b;
     pthread_spin_unlock(&pool->lock);
 }
 
+void memory_pool_init(memory_pool_t* pool, void* base, size_t size) {
+    memset(pool, 0, sizeof(*pool));
+    pool->base = base;
+    pool->size = size;
+    pthread_spin_init(&pool->lock, PTHREAD_PROCESS_PRIVATE);
+
+    pthread_mutex_lock(&memory_pools_lock);
+    pool->next = memory_pools;
+    memory_pools = pool;
+    pthread_mutex_unlock(&memory_pools_lock);
+}
+
+memory_pool_t* memory_pool_create_node(size_t size, int node) {
+    size = (size + LB_ARENA_ALIGN - 1) & ~(size_t)(LB_ARENA_ALIGN - 1);
+
+    // The header lives on the heap, so an arena nobody allocates from
+    // never commits a page
+    memory_pool_t* pool = malloc(sizeof(*pool));
+    if (!pool) return NULL;
+
+    // Over-reserve to start on a huge page boundary, then give back the ends
+    size_t span = size + LB_ARENA_ALIGN;
+    char* raw = mmap(NULL, span, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (raw == MAP_FAILED) {
+        free(pool);
+        return NULL;
+    }
+
+    char* base = (char*)(((uintptr_t)raw + LB_ARENA_ALIGN - 1) & ~(uintptr_t)(LB_ARENA_ALIGN - 1));
+    if (base > raw) munmap(raw, base - raw);
+    if (base + size < raw + span) munmap(base + size, raw + span - (base + size));
+
+    madvise(base, size, MADV_HUGEPAGE);
+    if (node >= 0) lb_numa_prefer(base, size, node);
+
+    memory_pool_init(pool, base, size);
+    pool->map_size = size;
+    return pool;
+}
+
+memory_pool_t* memory_pool_create(size_t size) {
+    return memory_pool_create_node(size, -1);
+}
+
+void memory_pool_destroy(memory_pool_t* pool) {
+    if (!pool) return;
+
+    // Unlinked before the magazines go, so an exiting thread either
+    // empties its own first or no longer finds the pool
+    pthread_mutex_lock(&memory_pools_lock);
+    for (memory_pool_t** at = &memory_pools; *at; at = &(*at)->next) {
+        if (*at == pool) {
+            *at = pool->next;
+            break;
+        }
+    }
+    for (uint32_t i = 0; i < MEMORY_POOL_THREADS; i++) {
+        free(pool->tcache[i]);
+        pool->tcache[i] = NULL;
+    }
+    pthread_mutex_unlock(&memory_pools_lock);
+    pthread_spin_destroy(&pool->lock);
+
+    if (!pool->map_size) return;
+    munmap(pool->base, pool->map_size);
+    free(pool);
+}
+
+bool memory_pool_owns(const memory_pool_t* pool, const void* ptr) {
+    return (const char*)ptr >= (const char*)pool->base &&
+           (const char*)ptr < (const char*)pool->base + pool->size;
+}
+
+#define LB_SHARED_POOL_SIZE (1024UL * 1024 * 1024)  // reserved, committed on use
+
+static memory_pool_t* lb_shared_pool;
+static pthread_once_t lb_shared_pool_once = PTHREAD_ONCE_INIT;
+
+static void lb_shared_pool_create(void) {
+    lb_shared_pool = memory_pool_create(LB_SHARED_POOL_SIZE);
+}
+
+void* lb_alloc(size_t size) {
+    pthread_once(&lb_shared_pool_once, lb_shared_pool_create);
+    void* ptr = lb_shared_pool ? memory_pool_alloc(lb_shared_pool, size) : NULL;
+    return ptr ? ptr : malloc(size);
+}
+
+void lb_free(void* ptr, size_t size) {
+    if (!ptr) return;
+    if (lb_shared_pool && memory_pool_owns(lb_shared_pool, ptr)) {
+        memory_pool_free(lb_shared_pool, ptr, size);
+    } else {
+        free(ptr);
+    }
+}
+
+slab_cache_t* slab_cache_create(size_t obj_size, uint32_t objs_per_chunk) {
+    slab_cache_t* slab = calloc(1, sizeof(slab_cache_t));
+    if (!slab) return NULL;
+
+    // Keep objects cache-line aligned so neighbours never share a line
+    slab->obj_size = (obj_size + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+    slab->objs_per_chunk = objs_per_chunk ? objs_per_chunk : 64;
+    atomic_store(&slab->remote_free, NULL);
+    return slab;
+}
+
+void slab_cache_destroy(slab_cache_t* slab) {
+    if (!slab) return;
+    for (uint32_t i = 0; i < slab->chunk_count; i++) {
+        // Pool chunks go with the pool
+        if (!slab->pool || !memory_pool_owns(slab->pool, slab->chunks[i])) free(slab->chunks[i]);
+    }
+    free(slab->chunks);
+    free(slab);
+}
+
+static int slab_grow(slab_cache_t* slab) {
+    if (slab->chunk_count == slab->chunk_capacity) {
+        uint32_t new_cap = slab->chunk_capacity ? slab->chunk_capacity * 2 : 16;
+        void** chunks = realloc(slab->chunks, new_cap * sizeof(void*));
+        if (!chunks) return -1;
+        slab->chunks = chunks;
+        slab->chunk_capacity = new_cap;
+    }
+
+    size_t size = slab->obj_size * slab->objs_per_chunk;
+    char* chunk = slab->pool ? memory_pool_alloc(slab->pool, size) : NULL;
+    if (!chunk) chunk = aligned_alloc(CACHE_LINE_SIZE, size);
+    if (!chunk) return -1;
+    slab->chunks[slab->chunk_count++] = chunk;
+
+    for (uint32_t i = slab->objs_per_chunk; i > 0; i--) {
+        slab_obj_t* obj = (slab_obj_t*)(chunk + (size_t)(i - 1) * slab->obj_size);
+        obj->next = slab->free_list;
+        slab->free_list = obj;
+    }
+    return 0;
+}
+
+void* slab_alloc(slab_cache_t* slab) {
+    if (!slab->free_list) {
+        // Take everything other threads returned in one exchange
+        slab->free_list = atomic_exchange(&slab->remote_free, NULL);
+        if (!slab->free_list && slab_grow(slab) < 0) return NULL;
+    }
+
+    slab_obj_t* obj = slab->free_list;
+    slab->free_list = obj->next;
+    return obj;
+}
+
+void slab_free(slab_cache_t* slab, void* ptr) {
+    if (!ptr) return;
+    slab_obj_t* obj = (slab_obj_t*)ptr;
+    obj->next = slab->free_list;
+    slab->free_list = obj;
+}
+
+void slab_free_remote(slab_cache_t* slab, void* ptr) {
+    if (!ptr) return;
+    slab_obj_t* obj = (slab_obj_t*)ptr;
+    slab_obj_t* head = atomic_load(&slab->remote_free);
+    do {
+        obj->next = head;
+    } while (!atomic_compare_exchange_weak(&slab->remote_free, &head, obj));
+}
+
 uint64_t murmur3_64(const void* key, size_t len, uint64_t seed) {
     const uint64_t m = 0xc6a4a7935bd1e995ULL;
     const int r = 47;
@@ -103,99 +459,269 @@ uint64_t murmur3_64(const void* key, size_t len, uint64_t seed) {
     return h;
 }
 
-consistent_hash_t* consistent_hash_create(uint32_t size, uint32_t virtual_nodes) {
-    consistent_hash_t* ch = calloc(1, sizeof(consistent_hash_t));
-    if (!ch) return NULL;
+static bool is_prime(uint32_t n) {
+    if (n < 2) return false;
+    for (uint32_t d = 2; (uint64_t)d * d <= n; d++) {
+        if (n % d == 0) return false;
+    }
+    return true;
+}
 
-    ch->size = size;
-    ch->virtual_nodes = virtual_nodes;
-    ch->table = calloc(size, sizeof(hash_node_t*));
-    if (!ch->table) {
-        free(ch);
-        return NULL;
+uint32_t maglev_prime(uint32_t size) {
+    if (size == 0) size = CONSISTENT_HASH_SIZE;
+    if (size < 3) size = 3;
+    while (!is_prime(size)) size++;
+    return size;
+}
+
+int maglev_member_cmp(const void* a, const void* b) {
+    const maglev_member_t* x = a;
+    const maglev_member_t* y = b;
+    if (x->name_hash != y->name_hash) return x->name_hash < y->name_hash ? -1 : 1;
+    return 0;
+}
+
+int maglev_fill(uint32_t* slot, uint32_t size, const maglev_member_t* m, uint32_t n) {
+    uint32_t max_weight = 0;
+
+    if (n == 0) return -1;
+
+    struct { uint32_t offset, skip, next; } *perm = calloc(n, sizeof(*perm));
+    if (!perm) return -1;
+
+    for (uint32_t i = 0; i < n; i++) {
+        // The permutation depends only on the member's name, so one that
+        // comes back reclaims the same slots it had before
+        uint64_t h = m[i].name_hash;
+        perm[i].offset = h % size;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        perm[i].skip = h % (size - 1) + 1;
+        if (m[i].weight > max_weight) max_weight = m[i].weight;
+    }
+
+    for (uint32_t i = 0; i < size; i++) slot[i] = UINT32_MAX;
+
+    // Each round every member claims its next free slot, except that a
+    // member of weight w only takes w out of every max_weight rounds
+    uint32_t filled = 0;
+    for (uint64_t round = 0; filled < size; round++) {
+        for (uint32_t i = 0; i < n && filled < size; i++) {
+            if (m[i].weight < max_weight &&
+                (round + 1) * m[i].weight / max_weight == round * m[i].weight / max_weight) {
+                continue;
+            }
+            uint32_t c;
+            do {
+                c = (uint32_t)(((uint64_t)perm[i].offset + (uint64_t)perm[i].next * perm[i].skip) % size);
+                perm[i].next++;
+            } while (slot[c] != UINT32_MAX);
+            slot[c] = i;
+            filled++;
+        }
     }
 
-    pthread_spin_init(&ch->lock, PTHREAD_PROCESS_PRIVATE);
+    free(perm);
+    return 0;
+}
+
+consistent_hash_t* consistent_hash_create(uint32_t size) {
+    consistent_hash_t* ch = calloc(1, sizeof(consistent_hash_t));
+    if (!ch) return NULL;
+
+    ch->size = maglev_prime(size);
+    atomic_init(&ch->lookup, NULL);
+    pthread_mutex_init(&ch->lock, NULL);
 
     return ch;
 }
 
-void consistent_hash_add(consistent_hash_t* ch, backend_t* backend) {
-    char key[512];
+static void consistent_hash_reclaim(consistent_hash_t* ch, time_t now) {
+    hash_table_t** pp = &ch->retired;
+    while (*pp) {
+        hash_table_t* t = *pp;
+        if (now - t->retired_at >= CONSISTENT_HASH_GRACE) {
+            *pp = t->retired_next;
+            free(t);
+        } else {
+            pp = &t->retired_next;
+        }
+    }
+}
 
-    pthread_spin_lock(&ch->lock);
+// Called with ch->lock held
+static int consistent_hash_build(consistent_hash_t* ch) {
+    uint32_t size = ch->size;
+    maglev_member_t* m = NULL;
+    hash_table_t* table = NULL;
+    uint32_t n = 0;
 
-    for (uint32_t i = 0; i < ch->virtual_nodes; i++) {
-        snprintf(key, sizeof(key), "%s:%u#%u", backend->host, backend->port, i);
-        uint64_t hash = murmur3_64(key, strlen(key), 0);
+    if (ch->backend_count) {
+        m = calloc(ch->backend_count, sizeof(maglev_member_t));
+        if (!m) return -1;
+    }
 
-        uint32_t idx = hash % ch->size;
+    for (uint32_t i = 0; i < ch->backend_count; i++) {
+        backend_t* b = ch->backends[i];
+        uint32_t weight = atomic_load(&b->weight);
+        if (atomic_load(&b->state) != BACKEND_UP || weight == 0) continue;
+
+        char name[300];
+        int len = snprintf(name, sizeof(name), "%s:%u", b->host, b->port);
+        m[n].name_hash = murmur3_64(name, len, 0);
+        m[n].weight = weight;
+        m[n].member = b;
+        n++;
+    }
 
-        hash_node_t* node = malloc(sizeof(hash_node_t));
-        node->hash = hash;
-        node->backend = backend;
-        node->next = ch->table[idx];
-        ch->table[idx] = node;
+    if (n) {
+        // Ties in the fill go to earlier members; sorting keeps the table
+        // independent of configuration order, so every node builds the same one
+        qsort(m, n, sizeof(maglev_member_t), maglev_member_cmp);
+
+        table = calloc(1, sizeof(hash_table_t) + (size_t)size * sizeof(backend_t*));
+        uint32_t* idx = malloc((size_t)size * sizeof(uint32_t));
+        if (!table || !idx || maglev_fill(idx, size, m, n) < 0) {
+            free(idx);
+            free(table);
+            free(m);
+            return -1;
+        }
+        table->size = size;
+        table->backend_count = n;
+        for (uint32_t i = 0; i < size; i++) table->slot[i] = m[idx[i]].member;
+        free(idx);
+    }
+    free(m);
+
+    hash_table_t* old = atomic_exchange_explicit(&ch->lookup, table, memory_order_acq_rel);
+    time_t now = time(NULL);
+    if (old) {
+        old->retired_at = now;
+        old->retired_next = ch->retired;
+        ch->retired = old;
     }
+    consistent_hash_reclaim(ch, now);
 
-    pthread_spin_unlock(&ch->lock);
+    return 0;
 }
 
-backend_t* consistent_hash_get(consistent_hash_t* ch, const char* key) {
-    uint64_t hash = murmur3_64(key, strlen(key), 0);
-    uint32_t idx = hash % ch->size;
+int consistent_hash_add(consistent_hash_t* ch, backend_t* backend) {
+    int ret = 0;
+
+    pthread_mutex_lock(&ch->lock);
+
+    for (uint32_t i = 0; i < ch->backend_count; i++) {
+        if (ch->backends[i] == backend) {
+            pthread_mutex_unlock(&ch->lock);
+            return 0;
+        }
+    }
 
-    pthread_spin_lock(&ch->lock);
+    if (ch->backend_count == ch->backend_capacity) {
+        uint32_t cap = ch->backend_capacity ? ch->backend_capacity * 2 : 16;
+        backend_t** backends = realloc(ch->backends, cap * sizeof(backend_t*));
+        if (!backends) {
+            pthread_mutex_unlock(&ch->lock);
+            return -1;
+        }
+        ch->backends = backends;
+        ch->backend_capacity = cap;
+    }
+    ch->backends[ch->backend_count++] = backend;
+    ret = consistent_hash_build(ch);
 
-    hash_node_t* node = ch->table[idx];
-    backend_t* result = NULL;
-    uint64_t min_distance = UINT64_MAX;
+    pthread_mutex_unlock(&ch->lock);
 
-    while (node) {
-        if (atomic_load(&node->backend->state) == BACKEND_UP) {
-            uint64_t distance = (node->hash > hash) ?
-                (node->hash - hash) : (UINT64_MAX - hash + node->hash);
+    return ret;
+}
 
-            if (distance < min_distance) {
-                min_distance = distance;
-                result = node->backend;
-            }
+int consistent_hash_remove(consistent_hash_t* ch, backend_t* backend) {
+    int ret = -1;
+
+    pthread_mutex_lock(&ch->lock);
+
+    for (uint32_t i = 0; i < ch->backend_count; i++) {
+        if (ch->backends[i] == backend) {
+            ch->backends[i] = ch->backends[--ch->backend_count];
+            ret = consistent_hash_build(ch);
+            break;
         }
-        node = node->next;
-    }
-
-    if (!result) {
-        for (uint32_t i = 0; i < ch->size; i++) {
-            node = ch->table[i];
-            while (node) {
-                if (atomic_load(&node->backend->state) == BACKEND_UP) {
-                    result = node->backend;
-                    break;
-                }
-                node = node->next;
-            }
-            if (result) break;
+    }
+
+    pthread_mutex_unlock(&ch->lock);
+
+    return ret;
+}
+
+int consistent_hash_rebuild(consistent_hash_t* ch) {
+    pthread_mutex_lock(&ch->lock);
+    int ret = consistent_hash_build(ch);
+    pthread_mutex_unlock(&ch->lock);
+    return ret;
+}
+
+backend_t* consistent_hash_get_hash(consistent_hash_t* ch, uint64_t hash) {
+    hash_table_t* table = atomic_load_explicit(&ch->lookup, memory_order_acquire);
+    if (!table) return NULL;
+
+    uint32_t idx = maglev_slot(hash, table->size);
+    backend_t* b = table->slot[idx];
+    if (atomic_load_explicit(&b->state, memory_order_relaxed) == BACKEND_UP) {
+        return b;
+    }
+
+    // Went down since the last rebuild: borrow the next live slot until
+    // the owner calls consistent_hash_rebuild
+    for (uint32_t i = 1; i < table->size; i++) {
+        b = table->slot[(idx + i) % table->size];
+        if (atomic_load_explicit(&b->state, memory_order_relaxed) == BACKEND_UP) {
+            return b;
         }
     }
 
-    pthread_spin_unlock(&ch->lock);
+    return NULL;
+}
+
+backend_t* consistent_hash_get(consistent_hash_t* ch, const char* key) {
+    return consistent_hash_get_hash(ch, murmur3_64(key, strlen(key), 0));
+}
+
+backend_t* consistent_hash_get_bounded(consistent_hash_t* ch, uint64_t hash,
+                                       uint64_t total_load, uint32_t factor) {
+    hash_table_t* table = atomic_load_explicit(&ch->lookup, memory_order_acquire);
+    if (!table) return NULL;
+
+    uint64_t n = table->backend_count;
+    uint64_t cap = factor ? (factor * (total_load + 1) + 100 * n - 1) / (100 * n) : UINT64_MAX;
+    uint32_t idx = maglev_slot(hash, table->size);
+    backend_t* first = NULL;
+
+    // Slots after the key's own belong to the other backends in a
+    // key-dependent order, so spilled keys spread out instead of piling
+    // onto one neighbour
+    for (uint32_t i = 0; i < table->size; i++) {
+        backend_t* b = table->slot[(idx + i) % table->size];
+        if (atomic_load_explicit(&b->state, memory_order_relaxed) != BACKEND_UP) continue;
+        if (!first) first = b;
+        if (atomic_load_explicit(&b->active_conns, memory_order_relaxed) < cap) return b;
+    }
 
-    return result;
+    return first;
 }
 
 void consistent_hash_destroy(consistent_hash_t* ch) {
     if (!ch) return;
 
-    for (uint32_t i = 0; i < ch->size; i++) {
-        hash_node_t* node = ch->table[i];
-        while (node) {
-            hash_node_t* next = node->next;
-            free(node);
-            node = next;
-        }
+    free(atomic_load(&ch->lookup));
+    while (ch->retired) {
+        hash_table_t* t = ch->retired;
+        ch->retired = t->retired_next;
+        free(t);
     }
 
-    free(ch->table);
-    pthread_spin_destroy(&ch->lock);
+    free(ch->backends);
+    pthread_mutex_destroy(&ch->lock);
     free(ch);
-}
\ No newline at end of file
+}
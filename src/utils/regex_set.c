@@ -0,0 +1,918 @@
+#include "utils/regex_set.h"
+#include "utils/hash.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define RX_NONE     UINT32_MAX
+
+enum {
+    RX_CHAR,            /* one byte of set arg, then out */
+    RX_SPLIT,           /* out and out1 */
+    RX_EPS,             /* out */
+    RX_ACCEPT           /* pattern arg matched */
+};
+
+typedef struct {
+    uint8_t type;
+    bool at_end;        /* RX_ACCEPT: only if the input ends here */
+    uint32_t out;
+    uint32_t out1;
+    uint32_t arg;
+} rx_node_t;
+
+typedef struct {
+    uint64_t bits[4];
+} rx_bytes_t;
+
+typedef struct {
+    uint32_t anchored;  /* entered at offset 0 only */
+    uint32_t floating;  /* entered at every offset */
+} rx_pattern_t;
+
+typedef struct {
+    uint32_t lo, hi;            /* patterns [lo, hi) */
+    uint32_t word_lo, words;    /* the words of matched it can set */
+    uint32_t state_count;       /* 0 when the NFA is simulated instead */
+    uint32_t start;
+    uint32_t dead;              /* no pattern can match from here, or RX_NONE */
+    uint16_t *trans;            /* [state * class_count + class] */
+    uint32_t *sticky;           /* per state, offset in masks or RX_NONE */
+    uint32_t *at_end;
+    uint64_t *masks;
+} rx_group_t;
+
+struct regex_set {
+    rx_node_t *nodes;
+    uint32_t node_count, node_cap;
+    rx_bytes_t *sets;
+    uint32_t set_count, set_cap;
+    rx_pattern_t *patterns;
+    uint32_t pattern_count, pattern_cap;
+
+    uint8_t byte_class[256];
+    uint8_t class_byte[256];    /* one member of each class */
+    uint32_t class_count;
+
+    rx_group_t *groups;
+    uint32_t group_count;
+    bool compiled;
+};
+
+static inline void rx_bytes_add(rx_bytes_t *b, unsigned c) {
+    b->bits[c >> 6] |= 1ULL << (c & 63);
+}
+
+static inline bool rx_bytes_has(const rx_bytes_t *b, unsigned c) {
+    return b->bits[c >> 6] & (1ULL << (c & 63));
+}
+
+static void rx_bytes_range(rx_bytes_t *b, unsigned lo, unsigned hi) {
+    for (unsigned c = lo; c <= hi; c++) rx_bytes_add(b, c);
+}
+
+static void rx_bytes_invert(rx_bytes_t *b) {
+    for (int i = 0; i < 4; i++) b->bits[i] = ~b->bits[i];
+}
+
+static void rx_bytes_fold(rx_bytes_t *b) {
+    for (unsigned c = 'a'; c <= 'z'; c++) {
+        if (rx_bytes_has(b, c) || rx_bytes_has(b, c - 32)) {
+            rx_bytes_add(b, c);
+            rx_bytes_add(b, c - 32);
+        }
+    }
+}
+
+regex_set_t *regex_set_create(void) {
+    return calloc(1, sizeof(regex_set_t));
+}
+
+void regex_set_destroy(regex_set_t *set) {
+    if (!set) return;
+
+    for (uint32_t i = 0; i < set->group_count; i++) {
+        rx_group_t *g = &set->groups[i];
+        free(g->trans);
+        free(g->sticky);
+        free(g->at_end);
+        free(g->masks);
+    }
+    free(set->groups);
+    free(set->nodes);
+    free(set->sets);
+    free(set->patterns);
+    free(set);
+}
+
+uint32_t regex_set_count(const regex_set_t *set) {
+    return set ? set->pattern_count : 0;
+}
+
+static int rx_grow(void **ptr, uint32_t *cap, uint32_t need, size_t size) {
+    if (need <= *cap) return 0;
+
+    uint32_t n = *cap ? *cap * 2 : 64;
+    while (n < need) n *= 2;
+    void *p = realloc(*ptr, (size_t)n * size);
+    if (!p) return -1;
+    *ptr = p;
+    *cap = n;
+    return 0;
+}
+
+/* Parsing, into Thompson fragments with a single loose end each */
+
+typedef struct {
+    uint32_t start;
+    uint32_t end;       /* an RX_EPS whose out is patched by the next piece */
+} rx_frag_t;
+
+typedef struct {
+    regex_set_t *set;
+    const char *p;
+    const char *end;
+    int flags;
+    bool failed;
+} rx_parser_t;
+
+static uint32_t rx_node(rx_parser_t *ps, uint8_t type, uint32_t out, uint32_t out1, uint32_t arg) {
+    regex_set_t *set = ps->set;
+    if (ps->failed || set->node_count >= REGEX_SET_MAX_NODES ||
+        rx_grow((void **)&set->nodes, &set->node_cap, set->node_count + 1, sizeof(rx_node_t)) < 0) {
+        ps->failed = true;
+        return 0;
+    }
+
+    rx_node_t *n = &set->nodes[set->node_count];
+    n->type = type;
+    n->at_end = false;
+    n->out = out;
+    n->out1 = out1;
+    n->arg = arg;
+    return set->node_count++;
+}
+
+static void rx_patch(rx_parser_t *ps, uint32_t node, uint32_t to) {
+    if (!ps->failed) ps->set->nodes[node].out = to;
+}
+
+static rx_frag_t rx_empty(rx_parser_t *ps) {
+    uint32_t e = rx_node(ps, RX_EPS, RX_NONE, RX_NONE, 0);
+    return (rx_frag_t){e, e};
+}
+
+static rx_frag_t rx_bytes(rx_parser_t *ps, const rx_bytes_t *bytes) {
+    regex_set_t *set = ps->set;
+    if (ps->failed ||
+        rx_grow((void **)&set->sets, &set->set_cap, set->set_count + 1, sizeof(rx_bytes_t)) < 0) {
+        ps->failed = true;
+        return (rx_frag_t){0, 0};
+    }
+    set->sets[set->set_count] = *bytes;
+
+    uint32_t e = rx_node(ps, RX_EPS, RX_NONE, RX_NONE, 0);
+    uint32_t c = rx_node(ps, RX_CHAR, e, RX_NONE, set->set_count++);
+    return (rx_frag_t){c, e};
+}
+
+static rx_frag_t rx_concat(rx_parser_t *ps, rx_frag_t a, rx_frag_t b) {
+    rx_patch(ps, a.end, b.start);
+    return (rx_frag_t){a.start, b.end};
+}
+
+static rx_frag_t rx_alt(rx_parser_t *ps, rx_frag_t a, rx_frag_t b) {
+    uint32_t e = rx_node(ps, RX_EPS, RX_NONE, RX_NONE, 0);
+    uint32_t s = rx_node(ps, RX_SPLIT, a.start, b.start, 0);
+    rx_patch(ps, a.end, e);
+    rx_patch(ps, b.end, e);
+    return (rx_frag_t){s, e};
+}
+
+static rx_frag_t rx_star(rx_parser_t *ps, rx_frag_t a) {
+    uint32_t e = rx_node(ps, RX_EPS, RX_NONE, RX_NONE, 0);
+    uint32_t s = rx_node(ps, RX_SPLIT, a.start, e, 0);
+    rx_patch(ps, a.end, s);
+    return (rx_frag_t){s, e};
+}
+
+static rx_frag_t rx_plus(rx_parser_t *ps, rx_frag_t a) {
+    uint32_t e = rx_node(ps, RX_EPS, RX_NONE, RX_NONE, 0);
+    uint32_t s = rx_node(ps, RX_SPLIT, a.start, e, 0);
+    rx_patch(ps, a.end, s);
+    return (rx_frag_t){a.start, e};
+}
+
+static rx_frag_t rx_quest(rx_parser_t *ps, rx_frag_t a) {
+    uint32_t e = rx_node(ps, RX_EPS, RX_NONE, RX_NONE, 0);
+    uint32_t s = rx_node(ps, RX_SPLIT, a.start, e, 0);
+    rx_patch(ps, a.end, e);
+    return (rx_frag_t){s, e};
+}
+
+static int rx_hex(int c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/* After a backslash: a class into *bytes and -1, or a single byte */
+static int rx_escape(rx_parser_t *ps, rx_bytes_t *bytes) {
+    if (ps->p == ps->end) {
+        ps->failed = true;
+        return -1;
+    }
+
+    unsigned char c = (unsigned char)*ps->p++;
+    bool negate = isupper(c);
+    memset(bytes, 0, sizeof(*bytes));
+
+    switch (tolower(c)) {
+        case 'd':
+            rx_bytes_range(bytes, '0', '9');
+            break;
+        case 'w':
+            rx_bytes_range(bytes, '0', '9');
+            rx_bytes_range(bytes, 'a', 'z');
+            rx_bytes_range(bytes, 'A', 'Z');
+            rx_bytes_add(bytes, '_');
+            break;
+        case 's':
+            rx_bytes_add(bytes, ' ');
+            rx_bytes_range(bytes, '\t', '\r');
+            break;
+        default:
+            goto single;
+    }
+    if (negate) rx_bytes_invert(bytes);
+    return -1;
+
+single:
+    switch (c) {
+        case 'n': return '\n';
+        case 't': return '\t';
+        case 'r': return '\r';
+        case 'f': return '\f';
+        case 'v': return '\v';
+        case 'e': return 0x1b;
+        case 'a': return 0x07;
+        case '0':
+            if (ps->p < ps->end && isdigit((unsigned char)*ps->p)) break;
+            return 0;
+        case 'x': {
+            bool braced = ps->p < ps->end && *ps->p == '{';
+            if (braced) ps->p++;
+            if (ps->end - ps->p < 2) break;
+            int hi = rx_hex(ps->p[0]), lo = rx_hex(ps->p[1]);
+            if (hi < 0 || lo < 0) break;
+            ps->p += 2;
+            if (braced) {
+                if (ps->p == ps->end || *ps->p != '}') break;
+                ps->p++;
+            }
+            return hi << 4 | lo;
+        }
+        default:
+            // Other letters and digits are assertions, references and
+            // properties; punctuation stands for itself
+            if (isalnum(c)) break;
+            return c;
+    }
+
+    ps->failed = true;
+    return -1;
+}
+
+static rx_frag_t rx_class(rx_parser_t *ps) {
+    rx_bytes_t bytes = {{0}};
+    bool negate = ps->p < ps->end && *ps->p == '^';
+    if (negate) ps->p++;
+
+    for (bool first = true; ; first = false) {
+        if (ps->p == ps->end) {
+            ps->failed = true;
+            return (rx_frag_t){0, 0};
+        }
+        if (*ps->p == ']' && !first) {
+            ps->p++;
+            break;
+        }
+        if (*ps->p == '[' && ps->p + 1 < ps->end &&
+            (ps->p[1] == ':' || ps->p[1] == '=' || ps->p[1] == '.')) {
+            ps->failed = true;
+            return (rx_frag_t){0, 0};
+        }
+
+        int lo;
+        if (*ps->p == '\\') {
+            ps->p++;
+            rx_bytes_t esc;
+            lo = rx_escape(ps, &esc);
+            if (ps->failed) return (rx_frag_t){0, 0};
+            if (lo < 0) {
+                for (int i = 0; i < 4; i++) bytes.bits[i] |= esc.bits[i];
+                continue;
+            }
+        } else {
+            lo = (unsigned char)*ps->p++;
+        }
+
+        int hi = lo;
+        if (ps->end - ps->p >= 2 && ps->p[0] == '-' && ps->p[1] != ']') {
+            ps->p++;
+            if (*ps->p == '\\') {
+                ps->p++;
+                rx_bytes_t esc;
+                hi = rx_escape(ps, &esc);
+            } else {
+                hi = (unsigned char)*ps->p++;
+            }
+            if (ps->failed || hi < lo) {
+                ps->failed = true;
+                return (rx_frag_t){0, 0};
+            }
+        }
+        rx_bytes_range(&bytes, lo, hi);
+    }
+
+    if (ps->flags & REGEX_SET_CASELESS) rx_bytes_fold(&bytes);
+    if (negate) rx_bytes_invert(&bytes);
+    return rx_bytes(ps, &bytes);
+}
+
+static rx_frag_t rx_alternation(rx_parser_t *ps);
+
+static rx_frag_t rx_atom(rx_parser_t *ps) {
+    rx_bytes_t bytes = {{0}};
+    unsigned char c = (unsigned char)*ps->p++;
+
+    switch (c) {
+        case '(': {
+            if (ps->p < ps->end && *ps->p == '?') {
+                // Only groups that do not change what matches
+                const char *q = ps->p + 1;
+                if (q < ps->end && *q == ':') {
+                    ps->p = q + 1;
+                } else if (q < ps->end && (*q == '<' || (*q == 'P' && q + 1 < ps->end && q[1] == '<')) &&
+                           q + 1 < ps->end && q[1 + (*q == 'P')] != '=' && q[1 + (*q == 'P')] != '!') {
+                    const char *name_end = memchr(q, '>', ps->end - q);
+                    if (!name_end) break;
+                    ps->p = name_end + 1;
+                } else {
+                    break;
+                }
+            }
+            rx_frag_t f = rx_alternation(ps);
+            if (ps->failed || ps->p == ps->end || *ps->p != ')') break;
+            ps->p++;
+            return f;
+        }
+
+        case '[':
+            return rx_class(ps);
+
+        case '.':
+            rx_bytes_invert(&bytes);
+            bytes.bits['\n' >> 6] &= ~(1ULL << ('\n' & 63));
+            return rx_bytes(ps, &bytes);
+
+        case '\\': {
+            int single = rx_escape(ps, &bytes);
+            if (ps->failed) break;
+            if (single < 0) return rx_bytes(ps, &bytes);
+            c = (unsigned char)single;
+            goto literal;
+        }
+
+        case '^':
+        case '$':
+        case '*':
+        case '+':
+        case '?':
+            // Anchors inside the pattern, or nothing to repeat
+            break;
+
+        default:
+        literal:
+            rx_bytes_add(&bytes, c);
+            if (ps->flags & REGEX_SET_CASELESS) rx_bytes_fold(&bytes);
+            return rx_bytes(ps, &bytes);
+    }
+
+    ps->failed = true;
+    return (rx_frag_t){0, 0};
+}
+
+/* {n}, {n,} or {n,m} at ps->p; false, leaving it as a literal '{', if not */
+static bool rx_bounds(rx_parser_t *ps, int *min, int *max) {
+    const char *q = ps->p + 1;
+    int n = 0, m;
+
+    if (q == ps->end || !isdigit((unsigned char)*q)) return false;
+    while (q < ps->end && isdigit((unsigned char)*q)) {
+        n = n * 10 + (*q++ - '0');
+        if (n > REGEX_SET_MAX_REPEAT) return false;
+    }
+
+    if (q < ps->end && *q == ',') {
+        q++;
+        if (q < ps->end && isdigit((unsigned char)*q)) {
+            m = 0;
+            while (q < ps->end && isdigit((unsigned char)*q)) {
+                m = m * 10 + (*q++ - '0');
+                if (m > REGEX_SET_MAX_REPEAT) return false;
+            }
+        } else {
+            m = -1;
+        }
+    } else {
+        m = n;
+    }
+
+    if (q == ps->end || *q != '}' || (m >= 0 && m < n)) return false;
+    ps->p = q + 1;
+    *min = n;
+    *max = m;
+    return true;
+}
+
+static rx_frag_t rx_repeat(rx_parser_t *ps) {
+    const char *atom = ps->p;
+    rx_frag_t f = rx_atom(ps);
+    const char *atom_end = ps->p;
+    if (ps->failed || ps->p == ps->end) return f;
+
+    int min, max;
+    switch (*ps->p) {
+        case '*':
+            ps->p++;
+            f = rx_star(ps, f);
+            break;
+        case '+':
+            ps->p++;
+            f = rx_plus(ps, f);
+            break;
+        case '?':
+            ps->p++;
+            f = rx_quest(ps, f);
+            break;
+        case '{': {
+            if (!rx_bounds(ps, &min, &max)) return f;
+            const char *after = ps->p;
+
+            // Each further copy is parsed again from the atom's text
+            rx_frag_t r = min > 0 ? f : rx_empty(ps);
+            int copies = max < 0 ? (min > 0 ? min : 0) + 1 : max;
+            for (int i = min > 0 ? 1 : 0; i < copies && !ps->failed; i++) {
+                ps->p = atom;
+                rx_frag_t c = rx_atom(ps);
+                if (ps->p != atom_end) ps->failed = true;
+                if (i >= min) c = max < 0 ? rx_star(ps, c) : rx_quest(ps, c);
+                r = rx_concat(ps, r, c);
+            }
+            ps->p = after;
+            f = r;
+            break;
+        }
+        default:
+            return f;
+    }
+
+    if (ps->p < ps->end && *ps->p == '?') {
+        ps->p++;                        // lazy, same language
+    } else if (ps->p < ps->end && (*ps->p == '+' || *ps->p == '*' || *ps->p == '{')) {
+        ps->failed = true;              // possessive, or a quantifier twice
+    }
+    return f;
+}
+
+/* Up to '|', ')' or the end; at top level a leading ^ and a trailing $ are
+ * taken as anchors */
+static rx_frag_t rx_sequence(rx_parser_t *ps, bool top, bool *start, bool *end) {
+    rx_frag_t f = rx_empty(ps);
+
+    if (top && ps->p < ps->end && *ps->p == '^') {
+        ps->p++;
+        *start = true;
+    }
+    while (!ps->failed && ps->p < ps->end && *ps->p != '|' && *ps->p != ')') {
+        if (top && *ps->p == '$' && (ps->p + 1 == ps->end || ps->p[1] == '|')) {
+            ps->p++;
+            *end = true;
+            break;
+        }
+        f = rx_concat(ps, f, rx_repeat(ps));
+    }
+    return f;
+}
+
+static rx_frag_t rx_alternation(rx_parser_t *ps) {
+    rx_frag_t f = rx_sequence(ps, false, NULL, NULL);
+    while (!ps->failed && ps->p < ps->end && *ps->p == '|') {
+        ps->p++;
+        f = rx_alt(ps, f, rx_sequence(ps, false, NULL, NULL));
+    }
+    return f;
+}
+
+int regex_set_add(regex_set_t *set, const char *pattern, size_t len, int flags) {
+    if (!set || !pattern || set->compiled) return -1;
+    if (rx_grow((void **)&set->patterns, &set->pattern_cap, set->pattern_count + 1,
+                sizeof(rx_pattern_t)) < 0) {
+        return -1;
+    }
+
+    uint32_t id = set->pattern_count;
+    uint32_t nodes = set->node_count, sets = set->set_count;
+    rx_parser_t ps = {set, pattern, pattern + len, flags, false};
+    rx_pattern_t *pat = &set->patterns[id];
+    pat->anchored = pat->floating = RX_NONE;
+
+    // Each top-level alternative is entered at offset 0 or everywhere and
+    // accepts wherever it completes or only at the end, per its anchors
+    for (;;) {
+        bool start = false, end = false;
+        rx_frag_t f = rx_sequence(&ps, true, &start, &end);
+        if (flags & REGEX_SET_ANCHORED) start = end = true;
+
+        uint32_t accept = rx_node(&ps, RX_ACCEPT, RX_NONE, RX_NONE, id);
+        rx_patch(&ps, f.end, accept);
+        if (ps.failed) break;
+        set->nodes[accept].at_end = end;
+
+        uint32_t *root = start ? &pat->anchored : &pat->floating;
+        *root = *root == RX_NONE ? f.start : rx_node(&ps, RX_SPLIT, *root, f.start, 0);
+
+        if (ps.p == ps.end || *ps.p != '|') break;
+        ps.p++;
+    }
+
+    if (ps.failed || ps.p != ps.end) {
+        set->node_count = nodes;
+        set->set_count = sets;
+        return -1;
+    }
+    return (int)set->pattern_count++;
+}
+
+/* Compilation */
+
+typedef struct {
+    uint32_t *stamp;    /* per node: the closure it was last added to */
+    uint32_t gen;
+    uint32_t *stack;
+} rx_work_t;
+
+/* Adds the CHAR and ACCEPT nodes reachable from root to out */
+static void rx_close(const regex_set_t *set, rx_work_t *w, uint32_t root,
+                     uint32_t *out, uint32_t *count) {
+    uint32_t depth = 0;
+    if (root == RX_NONE) return;
+    w->stack[depth++] = root;
+
+    while (depth > 0) {
+        uint32_t i = w->stack[--depth];
+        if (w->stamp[i] == w->gen) continue;
+        w->stamp[i] = w->gen;
+
+        const rx_node_t *n = &set->nodes[i];
+        switch (n->type) {
+            case RX_CHAR:
+            case RX_ACCEPT:
+                out[(*count)++] = i;
+                break;
+            case RX_SPLIT:
+                w->stack[depth++] = n->out1;
+                w->stack[depth++] = n->out;
+                break;
+            default:
+                if (n->out != RX_NONE) w->stack[depth++] = n->out;
+                break;
+        }
+    }
+}
+
+static int rx_cmp(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* The closure of every byte of class k leaving state, plus floating */
+static void rx_step(const regex_set_t *set, rx_work_t *w, const uint32_t *state, uint32_t len,
+                    unsigned byte, const uint32_t *floating, uint32_t floating_len,
+                    uint32_t *out, uint32_t *count) {
+    *count = 0;
+    w->gen++;
+    for (uint32_t i = 0; i < len; i++) {
+        const rx_node_t *n = &set->nodes[state[i]];
+        if (n->type == RX_CHAR && rx_bytes_has(&set->sets[n->arg], byte)) {
+            rx_close(set, w, n->out, out, count);
+        }
+    }
+    for (uint32_t i = 0; i < floating_len; i++) {
+        if (w->stamp[floating[i]] != w->gen) {
+            w->stamp[floating[i]] = w->gen;
+            out[(*count)++] = floating[i];
+        }
+    }
+}
+
+static void rx_classes(regex_set_t *set) {
+    memset(set->byte_class, 0, sizeof(set->byte_class));
+    set->class_count = 1;
+
+    // Split classes by each set in turn; bytes no set tells apart share one
+    for (uint32_t s = 0; s < set->set_count; s++) {
+        uint16_t remap[256][2];
+        memset(remap, 0xff, sizeof(remap));
+        uint32_t count = 0;
+
+        for (unsigned c = 0; c < 256; c++) {
+            uint16_t *slot = &remap[set->byte_class[c]][rx_bytes_has(&set->sets[s], c)];
+            if (*slot == 0xffff) *slot = count++;
+            set->byte_class[c] = *slot;
+        }
+        set->class_count = count;
+    }
+
+    for (int c = 255; c >= 0; c--) set->class_byte[set->byte_class[c]] = (uint8_t)c;
+}
+
+typedef struct {
+    uint32_t *sets;             /* the states' node lists, back to back */
+    uint32_t sets_len, sets_cap;
+    uint32_t *offset;           /* per state, into sets, then the length */
+    uint32_t *length;
+    uint32_t *table;            /* open addressing on the node list, state + 1 */
+    uint32_t table_size;
+} rx_states_t;
+
+static uint64_t rx_hash_list(const uint32_t *list, uint32_t len) {
+    return hash64(list, (size_t)len * sizeof(uint32_t));
+}
+
+/* The state for list, added if new; RX_NONE past the limit */
+static uint32_t rx_state(rx_states_t *st, uint32_t *count, uint32_t *list, uint32_t len) {
+    qsort(list, len, sizeof(uint32_t), rx_cmp);
+
+    uint32_t mask = st->table_size - 1;
+    for (uint32_t h = rx_hash_list(list, len) & mask; ; h = (h + 1) & mask) {
+        uint32_t s = st->table[h];
+        if (s == 0) {
+            if (*count == REGEX_SET_MAX_STATES ||
+                rx_grow((void **)&st->sets, &st->sets_cap, st->sets_len + len, sizeof(uint32_t)) < 0) {
+                return RX_NONE;
+            }
+            memcpy(st->sets + st->sets_len, list, (size_t)len * sizeof(uint32_t));
+            st->offset[*count] = st->sets_len;
+            st->length[*count] = len;
+            st->sets_len += len;
+            st->table[h] = *count + 1;
+            return (*count)++;
+        }
+        s--;
+        if (st->length[s] == len && memcmp(st->sets + st->offset[s], list, len * sizeof(uint32_t)) == 0) {
+            return s;
+        }
+    }
+}
+
+/* Accept bits of a state as a mask offset, RX_NONE when there are none */
+static uint32_t rx_state_mask(const regex_set_t *set, rx_group_t *g, const uint32_t *list,
+                              uint32_t len, bool at_end, uint32_t *masks_len) {
+    uint64_t *mask = g->masks + *masks_len;
+    bool any = false;
+
+    memset(mask, 0, g->words * sizeof(uint64_t));
+    for (uint32_t i = 0; i < len; i++) {
+        const rx_node_t *n = &set->nodes[list[i]];
+        if (n->type == RX_ACCEPT && n->at_end == at_end) {
+            mask[n->arg / 64 - g->word_lo] |= 1ULL << (n->arg % 64);
+            any = true;
+        }
+    }
+    if (!any) return RX_NONE;
+
+    uint32_t off = *masks_len;
+    *masks_len += g->words;
+    return off;
+}
+
+static bool rx_build_dfa(const regex_set_t *set, rx_work_t *w, rx_group_t *g) {
+    uint32_t k = set->class_count;
+    rx_states_t st = {0};
+    uint32_t *list = malloc((size_t)set->node_count * sizeof(uint32_t));
+    uint32_t *floating = malloc((size_t)set->node_count * sizeof(uint32_t));
+    uint32_t floating_len = 0, count = 0, len = 0;
+    bool ok = false;
+
+    st.table_size = REGEX_SET_MAX_STATES * 2;
+    st.table = calloc(st.table_size, sizeof(uint32_t));
+    st.offset = malloc(REGEX_SET_MAX_STATES * sizeof(uint32_t));
+    st.length = malloc(REGEX_SET_MAX_STATES * sizeof(uint32_t));
+    g->trans = malloc((size_t)REGEX_SET_MAX_STATES * k * sizeof(uint16_t));
+    if (!list || !floating || !st.table || !st.offset || !st.length || !g->trans) goto out;
+
+    w->gen++;
+    for (uint32_t p = g->lo; p < g->hi; p++) {
+        rx_close(set, w, set->patterns[p].floating, floating, &floating_len);
+    }
+    qsort(floating, floating_len, sizeof(uint32_t), rx_cmp);
+
+    w->gen++;
+    for (uint32_t p = g->lo; p < g->hi; p++) {
+        rx_close(set, w, set->patterns[p].anchored, list, &len);
+        rx_close(set, w, set->patterns[p].floating, list, &len);
+    }
+    g->start = rx_state(&st, &count, list, len);
+    if (g->start == RX_NONE) goto out;
+
+    for (uint32_t s = 0; s < count; s++) {
+        for (uint32_t c = 0; c < k; c++) {
+            // The state's list moves as others are added, so step from a copy
+            uint32_t src_len = st.length[s];
+            uint32_t *src = floating + floating_len;
+            memcpy(src, st.sets + st.offset[s], (size_t)src_len * sizeof(uint32_t));
+
+            rx_step(set, w, src, src_len, set->class_byte[c], floating, floating_len, list, &len);
+            uint32_t next = rx_state(&st, &count, list, len);
+            if (next == RX_NONE) goto out;
+            g->trans[(size_t)s * k + c] = next;
+        }
+    }
+
+    g->state_count = count;
+    uint16_t *trans = realloc(g->trans, (size_t)count * k * sizeof(uint16_t));
+    if (trans) g->trans = trans;
+    g->sticky = malloc(count * sizeof(uint32_t));
+    g->at_end = malloc(count * sizeof(uint32_t));
+    g->masks = malloc((size_t)count * 2 * g->words * sizeof(uint64_t));
+    if (!g->sticky || !g->at_end || !g->masks) goto out;
+
+    uint32_t masks_len = 0;
+    g->dead = RX_NONE;
+    for (uint32_t s = 0; s < count; s++) {
+        const uint32_t *l = st.sets + st.offset[s];
+        g->sticky[s] = rx_state_mask(set, g, l, st.length[s], false, &masks_len);
+        g->at_end[s] = rx_state_mask(set, g, l, st.length[s], true, &masks_len);
+        if (st.length[s] == 0) g->dead = s;
+    }
+    ok = true;
+
+out:
+    if (!ok) {
+        free(g->trans);
+        free(g->sticky);
+        free(g->at_end);
+        free(g->masks);
+        g->trans = NULL;
+        g->sticky = g->at_end = NULL;
+        g->masks = NULL;
+        g->state_count = 0;
+    }
+    free(list);
+    free(floating);
+    free(st.sets);
+    free(st.offset);
+    free(st.length);
+    free(st.table);
+    return ok;
+}
+
+static int rx_add_groups(regex_set_t *set, rx_work_t *w, uint32_t lo, uint32_t hi) {
+    rx_group_t g = {0};
+    g.lo = lo;
+    g.hi = hi;
+    g.word_lo = lo / 64;
+    g.words = (hi - 1) / 64 - g.word_lo + 1;
+
+    // A part that blows up is halved, on word boundaries while it can be
+    if (!rx_build_dfa(set, w, &g) && hi - lo > 1) {
+        uint32_t mid = hi - lo > 64 ? lo + ((hi - lo) / 2 + 63) / 64 * 64 : lo + (hi - lo) / 2;
+        if (mid >= hi) mid = lo + (hi - lo) / 2;
+        return rx_add_groups(set, w, lo, mid) < 0 ? -1 : rx_add_groups(set, w, mid, hi);
+    }
+
+    rx_group_t *groups = realloc(set->groups, (set->group_count + 1) * sizeof(rx_group_t));
+    if (!groups) return -1;
+    set->groups = groups;
+    set->groups[set->group_count++] = g;
+    return 0;
+}
+
+int regex_set_compile(regex_set_t *set) {
+    if (!set || set->compiled) return set ? 0 : -1;
+
+    rx_classes(set);
+    set->compiled = true;
+    if (set->pattern_count == 0) return 0;
+
+    rx_work_t w = {0};
+    w.stamp = calloc(set->node_count, sizeof(uint32_t));
+    w.stack = malloc((size_t)set->node_count * 2 * sizeof(uint32_t));
+    int ret = w.stamp && w.stack ? rx_add_groups(set, &w, 0, set->pattern_count) : -1;
+
+    free(w.stamp);
+    free(w.stack);
+    return ret;
+}
+
+/* Matching */
+
+static void rx_or(uint64_t *out, const uint64_t *mask, uint32_t words) {
+    for (uint32_t i = 0; i < words; i++) out[i] |= mask[i];
+}
+
+static void rx_scan_dfa(const regex_set_t *set, const rx_group_t *g, const uint8_t *data,
+                        size_t len, uint64_t *out) {
+    const uint16_t *trans = g->trans;
+    uint32_t k = set->class_count;
+    uint32_t s = g->start;
+
+    if (g->sticky[s] != RX_NONE) rx_or(out, g->masks + g->sticky[s], g->words);
+    for (size_t i = 0; i < len && s != g->dead; i++) {
+        s = trans[(size_t)s * k + set->byte_class[data[i]]];
+        if (g->sticky[s] != RX_NONE) rx_or(out, g->masks + g->sticky[s], g->words);
+    }
+    if (g->at_end[s] != RX_NONE) rx_or(out, g->masks + g->at_end[s], g->words);
+}
+
+static void rx_accepts(const regex_set_t *set, const rx_group_t *g, const uint32_t *list,
+                       uint32_t len, bool at_end, uint64_t *out) {
+    for (uint32_t i = 0; i < len; i++) {
+        const rx_node_t *n = &set->nodes[list[i]];
+        if (n->type == RX_ACCEPT && (at_end || !n->at_end)) {
+            out[n->arg / 64 - g->word_lo] |= 1ULL << (n->arg % 64);
+        }
+    }
+}
+
+/* For a part too large for a DFA: the same steps, one byte at a time */
+static int rx_scan_nfa(const regex_set_t *set, const rx_group_t *g, const uint8_t *data,
+                       size_t len, uint64_t *out) {
+    size_t n = set->node_count;
+    rx_work_t w = {0};
+    uint32_t *buf = malloc(n * 5 * sizeof(uint32_t));
+    w.stamp = calloc(n, sizeof(uint32_t));
+    if (!buf || !w.stamp) {
+        free(buf);
+        free(w.stamp);
+        return -1;
+    }
+    w.stack = buf;
+    uint32_t *floating = buf + 2 * n, *cur = buf + 3 * n, *next = buf + 4 * n;
+    uint32_t floating_len = 0, cur_len = 0, next_len;
+
+    w.gen++;
+    for (uint32_t p = g->lo; p < g->hi; p++) {
+        rx_close(set, &w, set->patterns[p].floating, floating, &floating_len);
+    }
+    w.gen++;
+    for (uint32_t p = g->lo; p < g->hi; p++) {
+        rx_close(set, &w, set->patterns[p].anchored, cur, &cur_len);
+        rx_close(set, &w, set->patterns[p].floating, cur, &cur_len);
+    }
+
+    rx_accepts(set, g, cur, cur_len, false, out);
+    for (size_t i = 0; i < len; i++) {
+        rx_step(set, &w, cur, cur_len, data[i], floating, floating_len, next, &next_len);
+        uint32_t *t = cur;
+        cur = next;
+        next = t;
+        cur_len = next_len;
+        rx_accepts(set, g, cur, cur_len, false, out);
+    }
+    rx_accepts(set, g, cur, cur_len, true, out);
+
+    free(buf);
+    free(w.stamp);
+    return 0;
+}
+
+bool regex_set_match(const regex_set_t *set, const char *data, size_t len, uint64_t *matched) {
+    if (!set || !set->compiled || set->pattern_count == 0) return false;
+
+    uint64_t local[4];
+    size_t words = regex_set_words(set);
+    uint64_t *out = matched;
+    if (!out) {
+        out = words <= 4 ? local : malloc(words * sizeof(uint64_t));
+        if (!out) return false;
+    }
+    memset(out, 0, words * sizeof(uint64_t));
+
+    for (uint32_t i = 0; i < set->group_count; i++) {
+        const rx_group_t *g = &set->groups[i];
+        if (g->state_count) {
+            rx_scan_dfa(set, g, (const uint8_t *)data, len, out + g->word_lo);
+        } else {
+            rx_scan_nfa(set, g, (const uint8_t *)data, len, out + g->word_lo);
+        }
+    }
+
+    bool any = false;
+    for (size_t i = 0; i < words; i++) any |= out[i] != 0;
+    if (out != matched && out != local) free(out);
+    return any;
+}
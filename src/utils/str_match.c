@@ -0,0 +1,281 @@
+#include "utils/str_match.h"
+#include "utils/hash.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A transition is the row of the state it goes to, state * class_count,
+ * with SM_TERM set when a string ends there */
+#define SM_TERM     0x80000000U
+#define SM_DEAD     0x7fffffffU
+
+typedef struct {
+    size_t off, len;            /* in pool */
+} sm_str_t;
+
+typedef struct {
+    uint32_t index;             /* 1 + index in strs, 0 when free */
+    uint32_t hash;
+} sm_slot_t;
+
+struct str_match {
+    str_match_kind_t kind;
+    bool compiled;
+    bool always;                /* holds the empty string */
+
+    char *pool;
+    size_t pool_len, pool_cap;
+    sm_str_t *strs;
+    uint32_t str_count, str_cap;
+
+    sm_slot_t *slots;           /* STR_MATCH_EXACT */
+    uint32_t slot_mask;
+
+    uint8_t byte_class[256];    /* the others */
+    uint32_t class_count;
+    uint32_t *trans;
+};
+
+str_match_t *str_match_create(str_match_kind_t kind) {
+    str_match_t *set = calloc(1, sizeof(*set));
+    if (set)
+        set->kind = kind;
+    return set;
+}
+
+void str_match_destroy(str_match_t *set) {
+    if (!set)
+        return;
+    free(set->pool);
+    free(set->strs);
+    free(set->slots);
+    free(set->trans);
+    free(set);
+}
+
+int str_match_add(str_match_t *set, const char *str, size_t len) {
+    if (set->compiled)
+        return -1;
+
+    if (set->pool_len + len > set->pool_cap) {
+        size_t cap = set->pool_cap ? set->pool_cap : 256;
+        while (cap < set->pool_len + len)
+            cap *= 2;
+        char *pool = realloc(set->pool, cap);
+        if (!pool)
+            return -1;
+        set->pool = pool;
+        set->pool_cap = cap;
+    }
+    if (set->str_count == set->str_cap) {
+        uint32_t cap = set->str_cap ? set->str_cap * 2 : 16;
+        sm_str_t *strs = realloc(set->strs, cap * sizeof(*strs));
+        if (!strs)
+            return -1;
+        set->strs = strs;
+        set->str_cap = cap;
+    }
+
+    if (len)
+        memcpy(set->pool + set->pool_len, str, len);
+    set->strs[set->str_count++] = (sm_str_t){set->pool_len, len};
+    set->pool_len += len;
+    return 0;
+}
+
+static int sm_compile_exact(str_match_t *set) {
+    uint32_t size = 16;
+    while (size < set->str_count * 2)
+        size *= 2;
+
+    set->slots = calloc(size, sizeof(*set->slots));
+    if (!set->slots)
+        return -1;
+    set->slot_mask = size - 1;
+
+    for (uint32_t i = 0; i < set->str_count; i++) {
+        const sm_str_t *s = &set->strs[i];
+        uint64_t h = hash64(set->pool + s->off, s->len);
+        uint32_t at = (uint32_t)h & set->slot_mask;
+        while (set->slots[at].index)
+            at = (at + 1) & set->slot_mask;
+        set->slots[at] = (sm_slot_t){i + 1, (uint32_t)(h >> 32)};
+    }
+    return 0;
+}
+
+static int sm_compile_trie(str_match_t *set) {
+    bool used[256] = {false};
+    size_t total = 0;
+
+    for (uint32_t i = 0; i < set->str_count; i++) {
+        const uint8_t *p = (const uint8_t *)set->pool + set->strs[i].off;
+        for (size_t j = 0; j < set->strs[i].len; j++)
+            used[p[j]] = true;
+        total += set->strs[i].len;
+    }
+
+    // Bytes found in no string share class 0
+    uint32_t k = 1;
+    for (int c = 0; c < 256; c++)
+        set->byte_class[c] = used[c] ? (uint8_t)k++ : 0;
+    set->class_count = k;
+
+    if ((total + 1) * k >= SM_DEAD)
+        return -1;
+
+    size_t cap = total + 1;
+    uint32_t *trans = calloc(cap * k, sizeof(uint32_t));
+    uint8_t *term = calloc(cap, 1);
+    uint32_t *fail = NULL;
+    if (!trans || !term)
+        goto fail;
+
+    // The trie, with 0 for a missing edge: no edge leads back to the root
+    uint32_t states = 1;
+    for (uint32_t i = 0; i < set->str_count; i++) {
+        const uint8_t *p = (const uint8_t *)set->pool + set->strs[i].off;
+        size_t len = set->strs[i].len;
+        uint32_t s = 0;
+
+        for (size_t j = 0; j < len; j++) {
+            uint8_t c = set->kind == STR_MATCH_END ? p[len - 1 - j] : p[j];
+            uint32_t *e = &trans[(size_t)s * k + set->byte_class[c]];
+            if (!*e)
+                *e = states++;
+            s = *e;
+        }
+        term[s] = 1;
+    }
+    set->always = term[0];
+
+    if (set->kind == STR_MATCH_SUB) {
+        // Breadth first, each missing edge becomes the one its state's
+        // longest proper suffix in the trie takes
+        fail = calloc(states, sizeof(uint32_t));
+        uint32_t *queue = malloc(states * sizeof(uint32_t));
+        if (!fail || !queue) {
+            free(queue);
+            goto fail;
+        }
+
+        uint32_t head = 0, tail = 0;
+        for (uint32_t c = 0; c < k; c++) {
+            if (trans[c])
+                queue[tail++] = trans[c];
+        }
+        while (head < tail) {
+            uint32_t s = queue[head++];
+            term[s] |= term[fail[s]];
+            for (uint32_t c = 0; c < k; c++) {
+                uint32_t *e = &trans[(size_t)s * k + c];
+                uint32_t next = trans[(size_t)fail[s] * k + c];
+                if (*e) {
+                    fail[*e] = next;
+                    queue[tail++] = *e;
+                } else {
+                    *e = next;
+                }
+            }
+        }
+        free(queue);
+    }
+
+    for (size_t i = 0; i < (size_t)states * k; i++) {
+        uint32_t t = trans[i];
+        if (!t && set->kind != STR_MATCH_SUB)
+            trans[i] = SM_DEAD;
+        else
+            trans[i] = t * k | (term[t] ? SM_TERM : 0);
+    }
+
+    uint32_t *shrunk = realloc(trans, (size_t)states * k * sizeof(uint32_t));
+    set->trans = shrunk ? shrunk : trans;
+    free(term);
+    free(fail);
+    return 0;
+
+fail:
+    free(trans);
+    free(term);
+    free(fail);
+    return -1;
+}
+
+int str_match_compile(str_match_t *set) {
+    int ret = set->kind == STR_MATCH_EXACT ? sm_compile_exact(set) : sm_compile_trie(set);
+    if (ret < 0)
+        return -1;
+
+    set->compiled = true;
+    if (set->kind != STR_MATCH_EXACT) {
+        // The automaton holds the strings from here on
+        free(set->pool);
+        free(set->strs);
+        set->pool = NULL;
+        set->strs = NULL;
+    }
+    return 0;
+}
+
+bool str_match_exec(const str_match_t *set, const char *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    const uint32_t *trans = set->trans;
+    uint32_t row = 0, e;
+
+    if (!set->compiled || !set->str_count)
+        return false;
+
+    switch (set->kind) {
+    case STR_MATCH_EXACT: {
+        uint64_t h = hash64(data, len);
+        for (uint32_t at = (uint32_t)h & set->slot_mask;; at = (at + 1) & set->slot_mask) {
+            const sm_slot_t *slot = &set->slots[at];
+            if (!slot->index)
+                return false;
+            const sm_str_t *s = &set->strs[slot->index - 1];
+            if (slot->hash == (uint32_t)(h >> 32) && s->len == len &&
+                memcmp(set->pool + s->off, data, len) == 0)
+                return true;
+        }
+    }
+
+    case STR_MATCH_BEG:
+        if (set->always)
+            return true;
+        for (size_t i = 0; i < len; i++) {
+            e = trans[row + set->byte_class[p[i]]];
+            if (e & SM_TERM)
+                return true;
+            if (e == SM_DEAD)
+                return false;
+            row = e;
+        }
+        return false;
+
+    case STR_MATCH_END:
+        if (set->always)
+            return true;
+        for (size_t i = len; i-- > 0;) {
+            e = trans[row + set->byte_class[p[i]]];
+            if (e & SM_TERM)
+                return true;
+            if (e == SM_DEAD)
+                return false;
+            row = e;
+        }
+        return false;
+
+    case STR_MATCH_SUB:
+        if (set->always)
+            return true;
+        for (size_t i = 0; i < len; i++) {
+            e = trans[row + set->byte_class[p[i]]];
+            if (e & SM_TERM)
+                return true;
+            row = e;
+        }
+        return false;
+    }
+    return false;
+}
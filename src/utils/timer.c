@@ -0,0 +1,129 @@
+#include "core/lb_timer.h"
+#include <string.h>
+
+#define LB_TIMER_MASK   (LB_TIMER_SLOTS - 1)
+#define LB_TIMER_RANGE  ((1ull << (LB_TIMER_SLOT_BITS * LB_TIMER_LEVELS)) - 1)
+
+void lb_timer_wheel_init(lb_timer_wheel_t* wheel, uint64_t now_ms) {
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->now = now_ms;
+}
+
+static void lb_timer_link(lb_timer_wheel_t* wheel, lb_timer_t* timer) {
+    uint64_t delta = timer->expires - wheel->now;
+    lb_timer_t** slot = NULL;
+
+    for (int level = 0; level < LB_TIMER_LEVELS; level++) {
+        int shift = LB_TIMER_SLOT_BITS * level;
+        if (level == LB_TIMER_LEVELS - 1 || delta < (1ull << (shift + LB_TIMER_SLOT_BITS))) {
+            slot = &wheel->slots[level][(timer->expires >> shift) & LB_TIMER_MASK];
+            break;
+        }
+    }
+
+    timer->next = *slot;
+    if (timer->next) timer->next->pprev = &timer->next;
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+static void lb_timer_unlink(lb_timer_t* timer) {
+    *timer->pprev = timer->next;
+    if (timer->next) timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+void lb_timer_add(lb_timer_wheel_t* wheel, lb_timer_t* timer, uint64_t expires_ms) {
+    if (lb_timer_pending(timer)) lb_timer_cancel(wheel, timer);
+
+    // Already due: run on the next tick
+    if (expires_ms < wheel->now) expires_ms = wheel->now;
+    if (expires_ms - wheel->now > LB_TIMER_RANGE) expires_ms = wheel->now + LB_TIMER_RANGE;
+
+    timer->expires = expires_ms;
+    lb_timer_link(wheel, timer);
+    wheel->count++;
+}
+
+void lb_timer_cancel(lb_timer_wheel_t* wheel, lb_timer_t* timer) {
+    if (!lb_timer_pending(timer)) return;
+    lb_timer_unlink(timer);
+    wheel->count--;
+}
+
+// Re-file one outer slot now that its timers are within the inner levels'
+// range. Returns the slot index so the caller knows whether the next level
+// wrapped too.
+static uint32_t lb_timer_cascade(lb_timer_wheel_t* wheel, int level) {
+    uint32_t idx = (wheel->now >> (LB_TIMER_SLOT_BITS * level)) & LB_TIMER_MASK;
+    lb_timer_t* timer = wheel->slots[level][idx];
+    wheel->slots[level][idx] = NULL;
+
+    while (timer) {
+        lb_timer_t* next = timer->next;
+        timer->pprev = NULL;
+        lb_timer_link(wheel, timer);
+        timer = next;
+    }
+    return idx;
+}
+
+void lb_timer_advance(lb_timer_wheel_t* wheel, uint64_t now_ms, lb_timer_fn fn, void* arg) {
+    while (wheel->now <= now_ms) {
+        if (wheel->count == 0) {
+            wheel->now = now_ms + 1;
+            return;
+        }
+
+        uint32_t idx = wheel->now & LB_TIMER_MASK;
+        if (idx == 0) {
+            for (int level = 1; level < LB_TIMER_LEVELS; level++) {
+                if (lb_timer_cascade(wheel, level) != 0) break;
+            }
+        }
+
+        // Detach the slot first so timers fn re-adds are never run early;
+        // the local list stays linked, so fn may still cancel its members
+        lb_timer_t* expired = wheel->slots[0][idx];
+        wheel->slots[0][idx] = NULL;
+        if (expired) expired->pprev = &expired;
+        wheel->now++;
+
+        while (expired) {
+            lb_timer_t* timer = expired;
+            lb_timer_unlink(timer);
+            wheel->count--;
+            fn(timer, arg);
+        }
+    }
+}
+
+int lb_timer_next_timeout(const lb_timer_wheel_t* wheel, int max_ms) {
+    if (wheel->count == 0) return max_ms;
+
+    uint64_t best = (uint64_t)max_ms;
+
+    // Innermost level: the first occupied slot is the exact next expiry
+    uint32_t idx = wheel->now & LB_TIMER_MASK;
+    for (uint32_t i = 0; i < LB_TIMER_SLOTS && i < best; i++) {
+        if (wheel->slots[0][(idx + i) & LB_TIMER_MASK]) {
+            best = i + 1;
+            break;
+        }
+    }
+
+    // Outer levels: wake for the cascade of the next occupied slot
+    for (int level = 1; level < LB_TIMER_LEVELS; level++) {
+        int shift = LB_TIMER_SLOT_BITS * level;
+        uint64_t base = wheel->now >> shift;
+        for (uint32_t k = 1; k < LB_TIMER_SLOTS; k++) {
+            if (wheel->slots[level][(base + k) & LB_TIMER_MASK]) {
+                uint64_t wait = ((base + k) << shift) - wheel->now + 1;
+                if (wait < best) best = wait;
+                break;
+            }
+        }
+    }
+    return (int)best;
+}
@@ -0,0 +1,329 @@
+// Microbenchmarks for the hot-path primitives: ns/op, heap allocations/op
+// and scaling across threads, as a table or, with --json, one JSON object
+// per line for comparing releases.
+//
+//   bin/bench [--json] [--filter SUBSTR] [--threads 1,2,4] [--time-ms N]
+
+#include "bench.h"
+#include "core/request_router.hpp"
+#include "stats/metrics_aggregator.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <barrier>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+// Every heap allocation, C and C++, goes through here so that it can be
+// counted per thread; glibc keeps its own entry points under these names
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t align, size_t size);
+void __libc_free(void* ptr);
+}
+
+static thread_local uint64_t bench_allocs;
+
+extern "C" {
+void* malloc(size_t size) {
+    bench_allocs++;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size) {
+    bench_allocs++;
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    bench_allocs++;
+    return __libc_realloc(ptr, size);
+}
+
+void* aligned_alloc(size_t align, size_t size) {
+    bench_allocs++;
+    return __libc_memalign(align, size);
+}
+
+void* memalign(size_t align, size_t size) {
+    bench_allocs++;
+    return __libc_memalign(align, size);
+}
+
+int posix_memalign(void** ptr, size_t align, size_t size) {
+    bench_allocs++;
+    *ptr = __libc_memalign(align, size);
+    return *ptr ? 0 : ENOMEM;
+}
+
+void free(void* ptr) {
+    __libc_free(ptr);
+}
+}
+
+using namespace ultrabalancer;
+
+namespace {
+
+// RequestRouter::route_request over n prefix routes, every tenth also
+// keyed by a header and every twentieth carrying a regex instead
+struct RouterBench {
+    RequestRouter router;
+    std::vector<std::string> paths;
+    std::unordered_map<std::string, std::string> headers{
+        {"host", "api.example.com"}, {"user-agent", "bench"}, {"x-tenant", "t3"}};
+};
+
+void* router_setup(uint32_t n) {
+    auto* ctx = new RouterBench;
+    for (uint32_t i = 0; i < n; i++) {
+        auto route = std::make_shared<Route>("route" + std::to_string(i));
+        if (i % 20 == 19) {
+            route->add_rule(std::make_shared<RouteRule>(
+                RouteRule::MatchType::REGEX, "^/users/[0-9]+/svc" + std::to_string(i) + "$"));
+        } else {
+            route->add_rule(std::make_shared<RouteRule>(
+                RouteRule::MatchType::PREFIX, "/api/v1/svc" + std::to_string(i) + "/"));
+        }
+        if (i % 10 == 3) {
+            route->add_rule(std::make_shared<RouteRule>(
+                RouteRule::MatchType::HEADER, "x-tenant:t" + std::to_string(i % 7)));
+        }
+        route->add_target(std::make_shared<RouteTarget>("backend" + std::to_string(i % 16)));
+        ctx->router.add_route(route);
+    }
+    ctx->router.set_default_backend("fallback");
+
+    for (uint32_t i = 0; i < 64; i++) {
+        uint32_t r = (i * 7919) % n;
+        if (i % 8 == 7) {
+            ctx->paths.push_back("/static/miss/" + std::to_string(i));
+        } else if (r % 20 == 19) {
+            ctx->paths.push_back("/users/" + std::to_string(i * 13) + "/svc" + std::to_string(r));
+        } else {
+            ctx->paths.push_back("/api/v1/svc" + std::to_string(r) + "/items/" + std::to_string(i));
+        }
+    }
+    return ctx;
+}
+
+void router_run(void* arg, uint32_t thread, uint64_t iters) {
+    auto* ctx = static_cast<RouterBench*>(arg);
+    static const std::string method = "GET";
+    uintptr_t sum = 0;
+
+    for (uint64_t i = 0; i < iters; i++) {
+        auto target = ctx->router.route_request(method, ctx->paths[(i + thread) % ctx->paths.size()],
+                                                ctx->headers);
+        sum += reinterpret_cast<uintptr_t>(target.get());
+    }
+    bench_sink[thread] = sum;
+}
+
+void router_teardown(void* arg) {
+    delete static_cast<RouterBench*>(arg);
+}
+
+// MetricsAggregator: a resolved counter and timer, and the by-name call
+void* metrics_setup(uint32_t) {
+    return &MetricsAggregator::instance();
+}
+
+void metrics_counter_run(void* arg, uint32_t thread, uint64_t iters) {
+    Counter requests = static_cast<MetricsAggregator*>(arg)->counter("bench.requests");
+    for (uint64_t i = 0; i < iters; i++) requests.increment();
+    bench_sink[thread] = iters;
+}
+
+void metrics_timer_run(void* arg, uint32_t thread, uint64_t iters) {
+    Timer latency = static_cast<MetricsAggregator*>(arg)->timer("bench.latency");
+    for (uint64_t i = 0; i < iters; i++) latency.record(std::chrono::nanoseconds(1000 + (i & 0xffff) * 97));
+    bench_sink[thread] = iters;
+}
+
+void metrics_by_name_run(void* arg, uint32_t thread, uint64_t iters) {
+    auto* metrics = static_cast<MetricsAggregator*>(arg);
+    static const std::string name = "bench.by_name";
+    for (uint64_t i = 0; i < iters; i++) metrics->increment_counter(name);
+    bench_sink[thread] = iters;
+}
+
+void metrics_teardown(void*) {
+}
+
+const uint32_t route_counts[] = {10, 100, 1000, 0};
+
+const bench_case_t cxx_cases[] = {
+    {"RequestRouter::route_request", "routes", route_counts, router_setup, router_run, router_teardown},
+    {"MetricsAggregator/counter", nullptr, nullptr, metrics_setup, metrics_counter_run, metrics_teardown},
+    {"MetricsAggregator/timer", nullptr, nullptr, metrics_setup, metrics_timer_run, metrics_teardown},
+    {"MetricsAggregator/increment_counter", nullptr, nullptr, metrics_setup, metrics_by_name_run,
+     metrics_teardown},
+};
+
+struct Options {
+    bool json = false;
+    std::string filter;
+    std::vector<uint32_t> threads;
+    uint32_t time_ms = 200;
+    uint32_t repeat = 3;
+};
+
+struct Sample {
+    double ns_per_op;     // wall time over the operations of one thread
+    double mops;          // all threads together, millions per second
+    double allocs_per_op;
+};
+
+using Clock = std::chrono::steady_clock;
+
+// threads run iters each, released together; the wall time is the slowest
+Sample run_once(const bench_case_t& c, void* ctx, uint32_t threads, uint64_t iters) {
+    std::vector<uint64_t> allocs(threads);
+    std::barrier start(threads + 1);
+    std::vector<std::thread> pool;
+
+    for (uint32_t t = 0; t < threads; t++) {
+        pool.emplace_back([&, t] {
+            start.arrive_and_wait();
+            uint64_t before = bench_allocs;
+            c.run(ctx, t, iters);
+            allocs[t] = bench_allocs - before;
+        });
+    }
+    start.arrive_and_wait();
+    auto t0 = Clock::now();
+    for (auto& th : pool) th.join();
+    double ns = std::chrono::duration<double, std::nano>(Clock::now() - t0).count();
+
+    uint64_t total_allocs = 0;
+    for (uint64_t a : allocs) total_allocs += a;
+    double ops = double(iters) * threads;
+    return {ns / double(iters), ops / ns * 1e3, double(total_allocs) / ops};
+}
+
+// Doubles the count until one thread takes a tenth of the budget
+uint64_t calibrate(const bench_case_t& c, void* ctx, uint32_t time_ms) {
+    uint64_t iters = 16;
+    for (;;) {
+        auto t0 = Clock::now();
+        c.run(ctx, 0, iters);
+        double ms = std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+        if (ms * 10 >= time_ms || iters >= (1ULL << 32)) {
+            double per = ms / double(iters);
+            return std::max<uint64_t>(1, uint64_t(time_ms / std::max(per, 1e-9)));
+        }
+        iters *= 2;
+    }
+}
+
+void report(const Options& opt, const bench_case_t& c, uint32_t param, uint32_t threads, uint64_t iters,
+            const Sample& s) {
+    if (opt.json) {
+        std::printf("{\"name\":\"%s\"", c.name);
+        if (c.param) std::printf(",\"%s\":%u", c.param, param);
+        std::printf(",\"threads\":%u,\"iters\":%llu,\"ns_per_op\":%.2f,\"mops\":%.3f,\"allocs_per_op\":%.3f}\n",
+                    threads, (unsigned long long)iters, s.ns_per_op, s.mops, s.allocs_per_op);
+    } else {
+        std::string label = c.name;
+        if (c.param) label += " " + std::string(c.param) + "=" + std::to_string(param);
+        std::printf("%-52s %4u %12.2f %12.3f %10.3f\n", label.c_str(), threads, s.ns_per_op, s.mops,
+                    s.allocs_per_op);
+    }
+    std::fflush(stdout);
+}
+
+void run_case(const Options& opt, const bench_case_t& c) {
+    if (!opt.filter.empty() && !std::strstr(c.name, opt.filter.c_str())) return;
+
+    static const uint32_t no_param[] = {1, 0};
+    for (const uint32_t* p = c.params ? c.params : no_param; *p; p++) {
+        void* ctx = c.setup(*p);
+        c.run(ctx, 0, 1000);  // warm caches and lazy state
+        uint64_t iters = calibrate(c, ctx, opt.time_ms);
+
+        for (uint32_t threads : opt.threads) {
+            std::vector<Sample> samples;
+            for (uint32_t r = 0; r < opt.repeat; r++) samples.push_back(run_once(c, ctx, threads, iters));
+            // The median repetition, by time
+            std::sort(samples.begin(), samples.end(),
+                      [](const Sample& a, const Sample& b) { return a.ns_per_op < b.ns_per_op; });
+            report(opt, c, *p, threads, iters, samples[samples.size() / 2]);
+        }
+        c.teardown(ctx);
+    }
+}
+
+bool parse_threads(const char* arg, std::vector<uint32_t>& out) {
+    out.clear();
+    for (const char* p = arg; *p;) {
+        char* end;
+        unsigned long n = std::strtoul(p, &end, 10);
+        if (end == p || n == 0 || n > BENCH_MAX_THREADS) return false;
+        out.push_back(uint32_t(n));
+        p = *end == ',' ? end + 1 : end;
+        if (*end && *end != ',') return false;
+    }
+    return !out.empty();
+}
+
+void usage(const char* prog) {
+    std::fprintf(stderr,
+                 "Usage: %s [--json] [--filter SUBSTR] [--threads N,N,...] [--time-ms N] [--repeat N]\n"
+                 "  --json      One JSON object per result line\n"
+                 "  --filter    Only cases whose name contains SUBSTR\n"
+                 "  --threads   Thread counts to run each case at (default: 1, 2, 4... up to CPUs)\n"
+                 "  --time-ms   Time per repetition (default: 200)\n"
+                 "  --repeat    Repetitions, the median is reported (default: 3)\n",
+                 prog);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    Options opt;
+    uint32_t cpus = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+    for (uint32_t t = 1; t <= cpus && t <= BENCH_MAX_THREADS; t *= 2) opt.threads.push_back(t);
+    if (opt.threads.back() != cpus && cpus <= BENCH_MAX_THREADS) opt.threads.push_back(cpus);
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* val = i + 1 < argc ? argv[i + 1] : nullptr;
+        if (!std::strcmp(arg, "--json")) {
+            opt.json = true;
+        } else if (!std::strcmp(arg, "--filter") && val) {
+            opt.filter = val;
+            i++;
+        } else if (!std::strcmp(arg, "--threads") && val && parse_threads(val, opt.threads)) {
+            i++;
+        } else if (!std::strcmp(arg, "--time-ms") && val && std::atoi(val) > 0) {
+            opt.time_ms = std::atoi(val);
+            i++;
+        } else if (!std::strcmp(arg, "--repeat") && val && std::atoi(val) > 0) {
+            opt.repeat = std::atoi(val);
+            i++;
+        } else {
+            usage(argv[0]);
+            return !std::strcmp(arg, "--help") ? 0 : 1;
+        }
+    }
+
+    if (opt.json) {
+        std::printf("{\"version\":\"%s\",\"cpus\":%u,\"time_ms\":%u,\"repeat\":%u}\n", VERSION, cpus,
+                    opt.time_ms, opt.repeat);
+    } else {
+        std::printf("%-52s %4s %12s %12s %10s\n", "benchmark", "thr", "ns/op", "Mops/s", "allocs/op");
+    }
+
+    for (size_t i = 0; i < bench_c_case_count; i++) run_case(opt, bench_c_cases[i]);
+    for (const auto& c : cxx_cases) run_case(opt, c);
+    return 0;
+}
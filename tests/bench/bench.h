@@ -0,0 +1,39 @@
+#ifndef TESTS_BENCH_H
+#define TESTS_BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * One microbenchmark. setup builds the state for one parameter value
+ * (backends, entries, routes...; params is 0 terminated, NULL for a case
+ * without one) and run does iters operations on it from thread, which
+ * may run concurrently with others on the same state. Results go to a
+ * sink the compiler cannot see through.
+ */
+#define BENCH_MAX_THREADS 256
+
+typedef struct bench_case {
+    const char *name;
+    const char *param;
+    const uint32_t *params;
+    void *(*setup)(uint32_t param);
+    void (*run)(void *ctx, uint32_t thread, uint64_t iters);
+    void (*teardown)(void *ctx);
+} bench_case_t;
+
+/* The cases over the C modules, in bench_cases.c */
+extern const bench_case_t bench_c_cases[];
+extern const size_t bench_c_case_count;
+
+extern volatile uintptr_t bench_sink[BENCH_MAX_THREADS];
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,333 @@
+#include "bench.h"
+#include "core/loadbalancer.h"
+#include "core/lb_memory.h"
+#include "http/http.h"
+#include "cache/cache.h"
+#include "stick_tables.h"
+#include "database/db_protocol.h"
+#include "utils/log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+volatile uintptr_t bench_sink[BENCH_MAX_THREADS];
+
+/* Spreads the operations of a thread over the keys, differently per thread */
+static inline uint32_t bench_pick(uint64_t i, uint32_t thread, uint32_t n) {
+    return (uint32_t)(((i + thread * 0x9e3779b9ULL) * 0x9e3779b97f4a7c15ULL) >> 32) % n;
+}
+
+static const uint32_t bench_backend_counts[] = {10, 100, 1000, 4096, 0};
+static const uint32_t bench_entry_counts[] = {1000, 100000, 0};
+static const uint32_t bench_header_counts[] = {5, 20, 0};
+
+/* lb_select_backend: one case per algorithm over the same pool */
+
+typedef struct {
+    loadbalancer_t *lb;
+    backend_t *backends;
+} bench_lb_t;
+
+static void *bench_lb_setup(uint32_t n, lb_algorithm_t algorithm) {
+    bench_lb_t *ctx = calloc(1, sizeof(*ctx));
+    ctx->lb = calloc(1, sizeof(loadbalancer_t));
+    ctx->backends = calloc(n, sizeof(backend_t));
+
+    ctx->lb->algorithm = algorithm;
+    ctx->lb->backend_count = n;
+    for (uint32_t i = 0; i < n; i++) {
+        backend_t *b = &ctx->backends[i];
+        snprintf(b->host, sizeof(b->host), "10.0.%u.%u", i / 250, i % 250 + 1);
+        b->port = 8000;
+        b->id = i;
+        atomic_store(&b->weight, 1 + i % 4);
+        atomic_store(&b->state, BACKEND_UP);
+        atomic_store(&b->response_time_ns, 1000000 + (i * 7919) % 500000);
+        atomic_store(&b->active_conns, i % 16);
+        ctx->lb->backends[i] = b;
+    }
+    lb_backends_changed(ctx->lb);
+    return ctx;
+}
+
+static void bench_lb_run(void *arg, uint32_t thread, uint64_t iters) {
+    bench_lb_t *ctx = arg;
+    struct sockaddr_in client = { .sin_family = AF_INET };
+    uintptr_t sum = 0;
+
+    for (uint64_t i = 0; i < iters; i++) {
+        client.sin_addr.s_addr = (uint32_t)(i * 2654435761u) ^ thread;
+        sum += (uintptr_t)lb_select_backend(ctx->lb, &client);
+    }
+    bench_sink[thread] = sum;
+}
+
+static void bench_lb_teardown(void *arg) {
+    bench_lb_t *ctx = arg;
+    lb_snapshot_free(ctx->lb);
+    free(ctx->backends);
+    free(ctx->lb);
+    free(ctx);
+}
+
+#define BENCH_LB_ALGO(fn, algorithm) \
+    static void *fn(uint32_t n) { return bench_lb_setup(n, algorithm); }
+
+BENCH_LB_ALGO(bench_lb_rr, LB_ALGO_ROUNDROBIN)
+BENCH_LB_ALGO(bench_lb_wrr, LB_ALGO_STATIC_RR)
+BENCH_LB_ALGO(bench_lb_leastconn, LB_ALGO_LEASTCONN)
+BENCH_LB_ALGO(bench_lb_source, LB_ALGO_SOURCE)
+BENCH_LB_ALGO(bench_lb_weighted, LB_ALGO_STICKY)
+BENCH_LB_ALGO(bench_lb_response_time, LB_ALGO_RANDOM)
+BENCH_LB_ALGO(bench_lb_p2c, LB_ALGO_P2C)
+
+/* consistent_hash_get */
+
+#define BENCH_HASH_KEYS 4096
+
+typedef struct {
+    consistent_hash_t *ch;
+    backend_t *backends;
+    char keys[BENCH_HASH_KEYS][24];
+} bench_chash_t;
+
+static void *bench_chash_setup(uint32_t n) {
+    bench_chash_t *ctx = calloc(1, sizeof(*ctx));
+    ctx->ch = consistent_hash_create(0);
+    ctx->backends = calloc(n, sizeof(backend_t));
+
+    for (uint32_t i = 0; i < n; i++) {
+        backend_t *b = &ctx->backends[i];
+        snprintf(b->host, sizeof(b->host), "10.0.%u.%u", i / 250, i % 250 + 1);
+        b->port = 8000;
+        atomic_store(&b->weight, 1);
+        atomic_store(&b->state, BACKEND_UP);
+        consistent_hash_add(ctx->ch, b);
+    }
+    consistent_hash_rebuild(ctx->ch);
+
+    for (uint32_t i = 0; i < BENCH_HASH_KEYS; i++) {
+        snprintf(ctx->keys[i], sizeof(ctx->keys[i]), "session-%u", i * 7919);
+    }
+    return ctx;
+}
+
+static void bench_chash_run(void *arg, uint32_t thread, uint64_t iters) {
+    bench_chash_t *ctx = arg;
+    uintptr_t sum = 0;
+
+    for (uint64_t i = 0; i < iters; i++) {
+        sum += (uintptr_t)consistent_hash_get(ctx->ch, ctx->keys[bench_pick(i, thread, BENCH_HASH_KEYS)]);
+    }
+    bench_sink[thread] = sum;
+}
+
+static void bench_chash_teardown(void *arg) {
+    bench_chash_t *ctx = arg;
+    consistent_hash_destroy(ctx->ch);
+    free(ctx->backends);
+    free(ctx);
+}
+
+/* http_parse_headers: a request header block of n lines, parsed whole */
+
+static const char *const bench_http_known[] = {
+    "Host: www.example.com",
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36",
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9",
+    "Content-Length: 0",
+    "Connection: keep-alive",
+};
+
+typedef struct {
+    char *data;
+    size_t len;
+} bench_http_t;
+
+static void *bench_http_setup(uint32_t n) {
+    bench_http_t *ctx = calloc(1, sizeof(*ctx));
+    ctx->data = malloc(128 * (n + 1));
+
+    char *p = ctx->data;
+    for (uint32_t i = 0; i < n; i++) {
+        if (i < sizeof(bench_http_known) / sizeof(bench_http_known[0])) {
+            p += sprintf(p, "%s\r\n", bench_http_known[i]);
+        } else {
+            p += sprintf(p, "X-Forwarded-Custom-%u: value-%u-abcdefghij\r\n", i, i * 31);
+        }
+    }
+    p += sprintf(p, "\r\n");
+    ctx->len = p - ctx->data;
+    return ctx;
+}
+
+static void bench_http_run(void *arg, uint32_t thread, uint64_t iters) {
+    bench_http_t *ctx = arg;
+    struct buffer buf = { .area = ctx->data, .size = ctx->len, .data = ctx->len };
+    http_msg_t msg;
+    uintptr_t sum = 0;
+
+    for (uint64_t i = 0; i < iters; i++) {
+        msg.next = 0;
+        msg.flags = 0;
+        msg.hdr_count = 0;
+        memset(msg.hdr_idx, 0, sizeof(msg.hdr_idx));
+        sum += http_parse_headers(&msg, &buf) + msg.hdr_count;
+    }
+    bench_sink[thread] = sum;
+}
+
+static void bench_http_teardown(void *arg) {
+    bench_http_t *ctx = arg;
+    free(ctx->data);
+    free(ctx);
+}
+
+/* cache_lookup hits with their put, and cache_insert replacing entries
+ * (the caller allocates the entry, the cache frees the one it replaces) */
+
+typedef struct {
+    cache_t *cache;
+    uint32_t count;
+    char (*keys)[32];
+} bench_cache_t;
+
+static cache_entry_t *bench_cache_entry(void) {
+    cache_entry_t *entry = calloc(1, sizeof(cache_entry_t));
+    entry->size = 64;
+    return entry;
+}
+
+static void *bench_cache_setup(uint32_t n) {
+    bench_cache_t *ctx = calloc(1, sizeof(*ctx));
+    log_init("bench", LOG_WARNING);  /* keeps the creation notice out of --json output */
+    ctx->cache = cache_create("bench", 1024u * 1024 * 1024, 1024 * 1024);
+    ctx->count = n;
+    ctx->keys = calloc(n, sizeof(*ctx->keys));
+
+    for (uint32_t i = 0; i < n; i++) {
+        snprintf(ctx->keys[i], sizeof(ctx->keys[i]), "/static/asset-%u.js", i);
+        cache_insert(ctx->cache, ctx->keys[i], bench_cache_entry());
+    }
+    return ctx;
+}
+
+static void bench_cache_lookup_run(void *arg, uint32_t thread, uint64_t iters) {
+    bench_cache_t *ctx = arg;
+    uintptr_t sum = 0;
+
+    for (uint64_t i = 0; i < iters; i++) {
+        cache_entry_t *entry = cache_lookup(ctx->cache, ctx->keys[bench_pick(i, thread, ctx->count)]);
+        sum += (uintptr_t)entry;
+        if (entry) {
+            cache_entry_put(entry);
+        }
+    }
+    bench_sink[thread] = sum;
+}
+
+static void bench_cache_insert_run(void *arg, uint32_t thread, uint64_t iters) {
+    bench_cache_t *ctx = arg;
+    uintptr_t sum = 0;
+
+    for (uint64_t i = 0; i < iters; i++) {
+        sum += cache_insert(ctx->cache, ctx->keys[bench_pick(i, thread, ctx->count)], bench_cache_entry());
+    }
+    bench_sink[thread] = sum;
+}
+
+static void bench_cache_teardown(void *arg) {
+    bench_cache_t *ctx = arg;
+    cache_destroy(ctx->cache);
+    free(ctx->keys);
+    free(ctx);
+}
+
+/* stktable_lookup of tracked client addresses */
+
+typedef struct {
+    stick_table_t *table;
+    uint32_t count;
+} bench_stick_t;
+
+static void *bench_stick_setup(uint32_t n) {
+    bench_stick_t *ctx = calloc(1, sizeof(*ctx));
+    ctx->table = stktable_new("bench", STKTABLE_TYPE_IP, n * 2, 3600);
+    ctx->count = n;
+
+    for (uint32_t i = 0; i < n; i++) {
+        stick_key_t key = { .type = STKTABLE_TYPE_IP, .data.ipv4.s_addr = htonl(0x0a000000 + i) };
+        stktable_get(ctx->table, &key);
+    }
+    return ctx;
+}
+
+static void bench_stick_run(void *arg, uint32_t thread, uint64_t iters) {
+    bench_stick_t *ctx = arg;
+    stick_key_t key = { .type = STKTABLE_TYPE_IP };
+    uintptr_t sum = 0;
+
+    for (uint64_t i = 0; i < iters; i++) {
+        key.data.ipv4.s_addr = htonl(0x0a000000 + bench_pick(i, thread, ctx->count));
+        sum += (uintptr_t)stktable_lookup(ctx->table, &key);
+    }
+    bench_sink[thread] = sum;
+}
+
+static void bench_stick_teardown(void *arg) {
+    bench_stick_t *ctx = arg;
+    stktable_free(ctx->table);
+    free(ctx);
+}
+
+/* db_protocol_classify_query over a mix of statements */
+
+static const char *const bench_queries[] = {
+    "SELECT id, name, email FROM users WHERE id = 42",
+    "select * from orders where customer_id = 7 order by created_at desc limit 20",
+    "INSERT INTO events (type, payload) VALUES ('click', '{}')",
+    "UPDATE sessions SET last_seen = NOW() WHERE token = 'abc'",
+    "/* app:web */ SELECT COUNT(*) FROM items",
+    "BEGIN",
+    "SELECT * FROM accounts WHERE id = 1 FOR UPDATE",
+    "WITH recent AS (SELECT * FROM logs WHERE ts > NOW() - INTERVAL '1 hour') SELECT * FROM recent",
+};
+#define BENCH_QUERY_COUNT (sizeof(bench_queries) / sizeof(bench_queries[0]))
+
+static size_t bench_query_len[BENCH_QUERY_COUNT];
+
+static void *bench_db_setup(uint32_t unused) {
+    for (size_t i = 0; i < BENCH_QUERY_COUNT; i++) bench_query_len[i] = strlen(bench_queries[i]);
+    return (void *)bench_queries;
+}
+
+static void bench_db_run(void *arg, uint32_t thread, uint64_t iters) {
+    uintptr_t sum = 0;
+
+    for (uint64_t i = 0; i < iters; i++) {
+        size_t q = (i + thread) % BENCH_QUERY_COUNT;
+        sum += db_protocol_classify_query(bench_queries[q], bench_query_len[q]);
+    }
+    bench_sink[thread] = sum;
+}
+
+static void bench_db_teardown(void *arg) {
+}
+
+const bench_case_t bench_c_cases[] = {
+    {"lb_select_backend/round-robin", "backends", bench_backend_counts, bench_lb_rr, bench_lb_run, bench_lb_teardown},
+    {"lb_select_backend/weighted-rr", "backends", bench_backend_counts, bench_lb_wrr, bench_lb_run, bench_lb_teardown},
+    {"lb_select_backend/least-conn", "backends", bench_backend_counts, bench_lb_leastconn, bench_lb_run, bench_lb_teardown},
+    {"lb_select_backend/ip-hash", "backends", bench_backend_counts, bench_lb_source, bench_lb_run, bench_lb_teardown},
+    {"lb_select_backend/weighted", "backends", bench_backend_counts, bench_lb_weighted, bench_lb_run, bench_lb_teardown},
+    {"lb_select_backend/response-time", "backends", bench_backend_counts, bench_lb_response_time, bench_lb_run, bench_lb_teardown},
+    {"lb_select_backend/p2c", "backends", bench_backend_counts, bench_lb_p2c, bench_lb_run, bench_lb_teardown},
+    {"consistent_hash_get", "backends", bench_backend_counts, bench_chash_setup, bench_chash_run, bench_chash_teardown},
+    {"http_parse_headers", "headers", bench_header_counts, bench_http_setup, bench_http_run, bench_http_teardown},
+    {"cache_lookup", "entries", bench_entry_counts, bench_cache_setup, bench_cache_lookup_run, bench_cache_teardown},
+    {"cache_insert", "entries", bench_entry_counts, bench_cache_setup, bench_cache_insert_run, bench_cache_teardown},
+    {"stktable_lookup", "entries", bench_entry_counts, bench_stick_setup, bench_stick_run, bench_stick_teardown},
+    {"db_protocol_classify_query", NULL, NULL, bench_db_setup, bench_db_run, bench_db_teardown},
+};
+const size_t bench_c_case_count = sizeof(bench_c_cases) / sizeof(bench_c_cases[0]);
@@ -0,0 +1,125 @@
+#!/bin/bash
+#
+# Repeatable load scenarios with the native tools (make loadgen).
+#
+#   tests/loadgen/scenarios.sh [direct|closed|open|tls|all]
+#
+# direct  ub_load straight at one ub_backend: the ceiling of the harness itself
+# closed  fixed concurrency through ultrabalancer over BACKENDS backends
+# open    a rate sweep through ultrabalancer, latency from intended send time
+# tls     TLS keep-alive straight at a TLS ub_backend, self-signed certificate
+#
+# Knobs, from the environment: DURATION WARMUP CONNECTIONS THREADS BACKENDS
+# BACKEND_THREADS LB_WORKERS ALGORITHM RATES ("10000 50000 ...") OUT (a
+# directory for one JSON line per run and the .hdr distributions).
+
+set -euo pipefail
+
+ROOT="$(cd "$(dirname "$0")/../.." && pwd)"
+BIN="$ROOT/bin"
+DURATION=${DURATION:-10}
+WARMUP=${WARMUP:-2}
+CONNECTIONS=${CONNECTIONS:-64}
+THREADS=${THREADS:-$(( $(nproc) > 1 ? $(nproc) / 2 : 1 ))}
+BACKENDS=${BACKENDS:-4}
+BACKEND_THREADS=${BACKEND_THREADS:-1}
+LB_WORKERS=${LB_WORKERS:-$THREADS}
+ALGORITHM=${ALGORITHM:-round-robin}
+RATES=${RATES:-"10000 50000 100000 200000"}
+export OUT=${OUT:-"$ROOT/loadgen-results/$(date +%Y%m%d-%H%M%S)"}
+LB_PORT=${LB_PORT:-18080}
+BACKEND_PORT=${BACKEND_PORT:-13001}
+
+PIDS=()
+cleanup() {
+    for pid in "${PIDS[@]}"; do kill "$pid" 2>/dev/null || true; done
+    wait 2>/dev/null || true
+}
+trap cleanup EXIT
+
+for tool in ub_load ub_backend; do
+    [ -x "$BIN/$tool" ] || { echo "$BIN/$tool missing, run make loadgen" >&2; exit 1; }
+done
+mkdir -p "$OUT"
+
+wait_port() {
+    for _ in $(seq 50); do
+        (exec 3<>"/dev/tcp/127.0.0.1/$1") 2>/dev/null && return 0
+        sleep 0.1
+    done
+    echo "nothing listening on $1" >&2
+    exit 1
+}
+
+start_backends() {
+    local i
+    for i in $(seq 0 $((BACKENDS - 1))); do
+        "$BIN/ub_backend" -p $((BACKEND_PORT + i)) -t "$BACKEND_THREADS" "$@" >/dev/null &
+        PIDS+=($!)
+    done
+    for i in $(seq 0 $((BACKENDS - 1))); do wait_port $((BACKEND_PORT + i)); done
+}
+
+start_lb() {
+    [ -x "$BIN/ultrabalancer" ] || { echo "$BIN/ultrabalancer missing, run make" >&2; exit 1; }
+    local args=() i
+    for i in $(seq 0 $((BACKENDS - 1))); do args+=(-b "127.0.0.1:$((BACKEND_PORT + i))"); done
+    "$BIN/ultrabalancer" -p "$LB_PORT" -w "$LB_WORKERS" -a "$ALGORITHM" --no-health-check "${args[@]}" \
+        >"$OUT/ultrabalancer.log" 2>&1 &
+    PIDS+=($!)
+    wait_port "$LB_PORT"
+}
+
+# name, then ub_load arguments: one JSON line, to the terminal and to
+# OUT/results.jsonl, and the HDR distribution to OUT/name.hdr
+run() {
+    local name=$1
+    shift
+    "$BIN/ub_load" -d "$DURATION" -w "$WARMUP" -c "$CONNECTIONS" -t "$THREADS" \
+        --hdr "$OUT/$name.hdr" --json "$@" \
+        | sed "s/^{/{\"scenario\":\"$name\",/" | tee -a "$OUT/results.jsonl"
+}
+
+scenario_direct() {
+    BACKENDS=1 start_backends
+    run direct "http://127.0.0.1:$BACKEND_PORT/"
+}
+
+scenario_closed() {
+    start_backends
+    start_lb
+    run closed "http://127.0.0.1:$LB_PORT/"
+}
+
+scenario_open() {
+    start_backends
+    start_lb
+    for rate in $RATES; do
+        run "open-$rate" -R "$rate" "http://127.0.0.1:$LB_PORT/"
+    done
+}
+
+scenario_tls() {
+    openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost \
+        -keyout "$OUT/key.pem" -out "$OUT/cert.pem" 2>/dev/null
+    BACKENDS=1 start_backends --cert "$OUT/cert.pem" --key "$OUT/key.pem"
+    run tls "https://127.0.0.1:$BACKEND_PORT/"
+}
+
+case "${1:-all}" in
+    direct|closed|open|tls)
+        "scenario_$1"
+        ;;
+    all)
+        for s in direct closed open tls; do
+            "$0" "$s"
+        done
+        exit 0
+        ;;
+    *)
+        sed -n '3,15p' "$0" | sed 's/^# \{0,1\}//'
+        exit 1
+        ;;
+esac
+
+echo "Results in $OUT"
@@ -0,0 +1,335 @@
+/*
+ * Minimal HTTP/1.1 backend for load tests: answers every request with the
+ * same 200, keep-alive and pipelining included, so that what is measured is
+ * the path in front of it. One epoll loop per thread, each on its own
+ * SO_REUSEPORT listener; TLS when given a certificate.
+ *
+ *   ub_backend [-a ADDR] [-p PORT] [-t THREADS] [-s BODY_BYTES] [--cert PEM --key PEM]
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <openssl/ssl.h>
+
+#define BACKEND_MAX_EVENTS 512
+#define BACKEND_IN_SIZE    16384
+
+typedef struct backend_conn {
+    int fd;
+    SSL *ssl;
+    bool handshaken;
+    bool close_after;
+    size_t in_len;
+    char in[BACKEND_IN_SIZE];
+    char *out;          /* responses not written yet */
+    size_t out_len;
+    size_t out_cap;
+    size_t out_off;
+    uint64_t body_skip; /* request body bytes still to read past */
+} backend_conn_t;
+
+static const char *listen_addr = "127.0.0.1";
+static const char *listen_port = "3001";
+static size_t body_size = 13;
+static char *response;
+static size_t response_len;
+static char *response_close;
+static size_t response_close_len;
+static SSL_CTX *ssl_ctx;
+
+static int backend_listen(void) {
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE };
+    struct addrinfo *res;
+    if (getaddrinfo(listen_addr, listen_port, &hints, &res) != 0) return -1;
+
+    int fd = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int one = 1;
+    if (fd >= 0) {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+        if (bind(fd, res->ai_addr, res->ai_addrlen) < 0 || listen(fd, 4096) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+static void backend_close(int epfd, backend_conn_t *c) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    if (c->ssl) SSL_free(c->ssl);
+    close(c->fd);
+    free(c->out);
+    free(c);
+}
+
+static bool backend_queue(backend_conn_t *c, const char *data, size_t len) {
+    if (c->out_len + len > c->out_cap) {
+        size_t cap = c->out_cap ? c->out_cap * 2 : 4096;
+        while (cap < c->out_len + len) cap *= 2;
+        char *out = realloc(c->out, cap);
+        if (!out) return false;
+        c->out = out;
+        c->out_cap = cap;
+    }
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+    return true;
+}
+
+/* Returns 1 when everything queued is out, 0 when the socket is full, -1 on error */
+static int backend_flush(backend_conn_t *c) {
+    while (c->out_off < c->out_len) {
+        ssize_t n;
+        if (c->ssl) {
+            n = SSL_write(c->ssl, c->out + c->out_off, (int)(c->out_len - c->out_off));
+            if (n <= 0) {
+                int err = SSL_get_error(c->ssl, (int)n);
+                return err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ ? 0 : -1;
+            }
+        } else {
+            n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL);
+            if (n < 0) return errno == EAGAIN || errno == EINTR ? 0 : -1;
+        }
+        c->out_off += (size_t)n;
+    }
+    c->out_off = c->out_len = 0;
+    return 1;
+}
+
+/* Complete requests at the head of the buffer, each answered in order */
+static bool backend_requests(backend_conn_t *c) {
+    size_t pos = 0;
+    for (;;) {
+        if (c->body_skip) {
+            size_t n = c->in_len - pos < c->body_skip ? c->in_len - pos : (size_t)c->body_skip;
+            pos += n;
+            c->body_skip -= n;
+            if (c->body_skip) break;
+        }
+
+        char *start = c->in + pos;
+        char *end = memmem(start, c->in_len - pos, "\r\n\r\n", 4);
+        if (!end) break;
+
+        bool close_req = false;
+        char *eol = memmem(start, (size_t)(end - start) + 2, "\r\n", 2);
+        if (eol && eol - start >= 8 && memcmp(eol - 8, "HTTP/1.0", 8) == 0) close_req = true;
+
+        for (char *line = eol ? eol + 2 : end; line < end;) {
+            char *next = memmem(line, (size_t)(end - line) + 2, "\r\n", 2);
+            if (strncasecmp(line, "content-length:", 15) == 0) {
+                c->body_skip = strtoull(line + 15, NULL, 10);
+            } else if (strncasecmp(line, "connection:", 11) == 0) {
+                if (memmem(line, (size_t)(next - line), "close", 5)) close_req = true;
+                if (memmem(line, (size_t)(next - line), "keep-alive", 10)) close_req = false;
+            }
+            line = next + 2;
+        }
+        pos = (size_t)(end + 4 - c->in);
+
+        if (close_req) {
+            c->close_after = true;
+            c->body_skip = 0;
+            return backend_queue(c, response_close, response_close_len);
+        }
+        if (!backend_queue(c, response, response_len)) return false;
+    }
+
+    memmove(c->in, c->in + pos, c->in_len - pos);
+    c->in_len -= pos;
+    /* A header block that fills the whole buffer will never complete */
+    return c->in_len < sizeof(c->in);
+}
+
+static void backend_event(int epfd, backend_conn_t *c) {
+    if (c->ssl && !c->handshaken) {
+        int rc = SSL_accept(c->ssl);
+        if (rc != 1) {
+            int err = SSL_get_error(c->ssl, rc);
+            if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+                backend_close(epfd, c);
+                return;
+            }
+            struct epoll_event ev = {
+                .events = EPOLLIN | EPOLLET | (err == SSL_ERROR_WANT_WRITE ? EPOLLOUT : 0), .data.ptr = c
+            };
+            epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+            return;
+        }
+        c->handshaken = true;
+    }
+
+    while (!c->close_after) {
+        ssize_t n;
+        if (c->ssl) {
+            n = SSL_read(c->ssl, c->in + c->in_len, (int)(sizeof(c->in) - c->in_len));
+            if (n <= 0) {
+                int err = SSL_get_error(c->ssl, (int)n);
+                if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) break;
+            }
+        } else {
+            n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+            if (n < 0 && (errno == EAGAIN || errno == EINTR)) break;
+        }
+        if (n <= 0) {
+            backend_close(epfd, c);
+            return;
+        }
+        c->in_len += (size_t)n;
+        if (!backend_requests(c)) {
+            backend_close(epfd, c);
+            return;
+        }
+    }
+
+    int rc = backend_flush(c);
+    if (rc < 0 || (rc == 1 && c->close_after)) {
+        backend_close(epfd, c);
+        return;
+    }
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLET | (rc == 0 ? EPOLLOUT : 0), .data.ptr = c };
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void *backend_thread(void *arg) {
+    (void)arg;
+    int lfd = backend_listen();
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (lfd < 0 || epfd < 0) {
+        fprintf(stderr, "Cannot listen on %s:%s: %s\n", listen_addr, listen_port, strerror(errno));
+        exit(1);
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev);
+
+    struct epoll_event events[BACKEND_MAX_EVENTS];
+    for (;;) {
+        int n = epoll_wait(epfd, events, BACKEND_MAX_EVENTS, -1);
+        for (int i = 0; i < n; i++) {
+            backend_conn_t *c = events[i].data.ptr;
+            if (c) {
+                backend_event(epfd, c);
+                continue;
+            }
+
+            int fd;
+            while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                int one = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                c = calloc(1, sizeof(*c));
+                if (!c) {
+                    close(fd);
+                    continue;
+                }
+                c->fd = fd;
+                if (ssl_ctx) {
+                    c->ssl = SSL_new(ssl_ctx);
+                    SSL_set_fd(c->ssl, fd);
+                }
+                struct epoll_event cev = { .events = EPOLLIN | EPOLLET, .data.ptr = c };
+                epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &cev);
+                /* The request may already be there */
+                backend_event(epfd, c);
+            }
+        }
+    }
+    return NULL;
+}
+
+static char *backend_response(const char *connection, size_t *len) {
+    char head[256];
+    int hlen = snprintf(head, sizeof(head),
+                        "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\n"
+                        "Connection: %s\r\n\r\n", body_size, connection);
+    char *buf = malloc((size_t)hlen + body_size);
+    if (!buf) return NULL;
+    memcpy(buf, head, (size_t)hlen);
+    for (size_t i = 0; i < body_size; i++) buf[hlen + i] = "Hello, world\n"[i % 13];
+    *len = (size_t)hlen + body_size;
+    return buf;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -a, --address ADDR   Address to listen on (default: 127.0.0.1)\n"
+            "  -p, --port PORT      Port to listen on (default: 3001)\n"
+            "  -t, --threads N      Threads, each with its own listener (default: 1)\n"
+            "  -s, --size BYTES     Response body size (default: 13)\n"
+            "      --cert FILE      Serve TLS with this certificate chain (PEM)\n"
+            "      --key FILE       and this private key (PEM)\n",
+            prog);
+}
+
+int main(int argc, char **argv) {
+    static struct option options[] = {
+        {"address", required_argument, 0, 'a'},
+        {"port", required_argument, 0, 'p'},
+        {"threads", required_argument, 0, 't'},
+        {"size", required_argument, 0, 's'},
+        {"cert", required_argument, 0, 1001},
+        {"key", required_argument, 0, 1002},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+    int threads = 1;
+    const char *cert = NULL, *key = NULL;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "a:p:t:s:h", options, NULL)) != -1) {
+        switch (opt) {
+        case 'a': listen_addr = optarg; break;
+        case 'p': listen_port = optarg; break;
+        case 't': threads = atoi(optarg); break;
+        case 's': body_size = strtoull(optarg, NULL, 10); break;
+        case 1001: cert = optarg; break;
+        case 1002: key = optarg; break;
+        case 'h': usage(argv[0]); return 0;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (threads < 1 || (!cert != !key)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (cert) {
+        ssl_ctx = SSL_CTX_new(TLS_server_method());
+        if (!ssl_ctx || SSL_CTX_use_certificate_chain_file(ssl_ctx, cert) != 1 ||
+            SSL_CTX_use_PrivateKey_file(ssl_ctx, key, SSL_FILETYPE_PEM) != 1) {
+            fprintf(stderr, "Cannot load %s / %s\n", cert, key);
+            return 1;
+        }
+    }
+
+    response = backend_response("keep-alive", &response_len);
+    response_close = backend_response("close", &response_close_len);
+    if (!response || !response_close) return 1;
+
+    signal(SIGPIPE, SIG_IGN);
+    printf("Backend on %s:%s, %d threads, %zu byte responses%s\n", listen_addr, listen_port, threads,
+           body_size, ssl_ctx ? ", TLS" : "");
+    fflush(stdout);
+
+    pthread_t tids[threads];
+    for (int i = 0; i < threads; i++) pthread_create(&tids[i], NULL, backend_thread, NULL);
+    for (int i = 0; i < threads; i++) pthread_join(tids[i], NULL);
+    return 0;
+}
@@ -0,0 +1,834 @@
+// HTTP/1.1 load generator: keep-alive connections over epoll, plain or TLS,
+// driven at a fixed concurrency (closed loop) or at a fixed request rate
+// (open loop).
+//
+// In open loop every connection follows a schedule of intended send times
+// and a request's latency is counted from its intended time, not from when
+// it could actually be written. A stall then shows up in every request it
+// held back, where a closed-loop tool only sees the one that was stuck and
+// quietly sends less: the coordinated omission correction.
+//
+//   ub_load [options] http[s]://host:port/path
+
+#include "stats/histogram.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <openssl/ssl.h>
+
+using ultrabalancer::Histogram;
+using ultrabalancer::HistogramSnapshot;
+
+namespace {
+
+struct Options {
+    std::string host;
+    std::string port;
+    std::string path = "/";
+    bool tls = false;
+    std::vector<std::string> headers;
+    uint32_t threads = 1;
+    uint32_t connections = 16;
+    double rate = 0;  // requests per second over all connections, 0 for closed loop
+    double duration_s = 10;
+    double warmup_s = 0;
+    uint32_t timeout_ms = 5000;
+    bool json = false;
+    const char* hdr_file = nullptr;
+};
+
+struct Totals {
+    uint64_t requests = 0;
+    uint64_t responses = 0;
+    uint64_t status[6] = {};  // by first digit, [0] for anything else
+    uint64_t connect_errors = 0;
+    uint64_t io_errors = 0;
+    uint64_t timeouts = 0;
+    uint64_t reconnects = 0;
+    uint64_t bytes_in = 0;
+    double latency_sum = 0;  // ns, recorded samples only
+    double latency_sq = 0;
+
+    void add(const Totals& o) {
+        requests += o.requests;
+        responses += o.responses;
+        for (int i = 0; i < 6; i++) status[i] += o.status[i];
+        connect_errors += o.connect_errors;
+        io_errors += o.io_errors;
+        timeouts += o.timeouts;
+        reconnects += o.reconnects;
+        bytes_in += o.bytes_in;
+        latency_sum += o.latency_sum;
+        latency_sq += o.latency_sq;
+    }
+};
+
+std::atomic<bool> stop_flag{false};
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+enum class ConnState { CLOSED, CONNECTING, HANDSHAKE, READY };
+
+struct Conn {
+    int fd = -1;
+    SSL* ssl = nullptr;
+    ConnState state = ConnState::CLOSED;
+    uint32_t events = 0;      // epoll mask currently registered
+    uint32_t generation = 0;  // bumped per socket, so events of a closed one are dropped
+    uint64_t opened = 0;      // connect() time, for the connect timeout
+
+    // A request is due but the connection is not up yet; it goes out,
+    // latency still counted from pending_due (0: from when it goes out), once it is
+    bool pending = false;
+    uint64_t pending_due = 0;
+
+    bool in_flight = false;   // written, or being written, and not yet answered
+    size_t sent = 0;          // bytes of the request written so far
+    uint64_t intended = 0;    // when the request was due; latency counts from here
+    uint64_t started = 0;     // when it was actually written, for the timeout
+    uint64_t next_due = 0;    // open loop: the next slot of this connection's schedule
+
+    // Response parsing
+    std::string in;
+    size_t header_len = 0;    // 0 until the header block is complete
+    int64_t body_left = 0;    // Content-Length bytes still to come
+    bool chunked = false;
+    bool close_after = false;
+    int status = 0;
+};
+
+struct Target {
+    struct sockaddr_storage addr;
+    socklen_t addr_len = 0;
+    std::string request;
+};
+
+/*
+ * One client thread and its share of the connections. A connection has at
+ * most one request out at a time. In closed loop it sends the next one as
+ * soon as a response is in; in open loop it sends at its next slot, every
+ * connections/rate apart, or right away when that slot is already past, so
+ * a connection held up by a slow response catches up back to back and
+ * every request it held up is charged the wait.
+ */
+class Worker {
+public:
+    Worker(const Options& opt, const Target& target, SSL_CTX* ssl_ctx, Histogram& latency,
+           uint32_t first_conn, uint32_t conn_count)
+        : opt_(opt), target_(target), ssl_ctx_(ssl_ctx), latency_(latency),
+          first_conn_(first_conn), conns_(conn_count) {}
+
+    ~Worker() {
+        for (auto& c : conns_) close_conn(c);
+        if (session_) SSL_SESSION_free(session_);
+        if (epfd_ >= 0) close(epfd_);
+    }
+
+    void run(uint64_t start, uint64_t measure_from, uint64_t end);
+    const Totals& totals() const { return totals_; }
+
+private:
+    using Timed = std::pair<uint64_t, uint32_t>;
+    using TimedQueue = std::priority_queue<Timed, std::vector<Timed>, std::greater<Timed>>;
+
+    uint32_t index(const Conn& c) const { return (uint32_t)(&c - conns_.data()); }
+
+    void connect_conn(Conn& c, uint64_t now);
+    void close_conn(Conn& c);
+    void fail_conn(Conn& c, uint64_t& counter, uint64_t now, uint64_t backoff);
+    void set_events(Conn& c, uint32_t events);
+
+    void on_event(Conn& c, uint32_t events, uint64_t now);
+    bool handshake(Conn& c, uint64_t now);
+    void on_ready(Conn& c, uint64_t now);
+    void start_request(Conn& c, uint64_t intended, uint64_t now);
+    bool flush(Conn& c, uint64_t now);
+    void read_response(Conn& c, uint64_t now);
+    bool parse(Conn& c);
+    void finish(Conn& c, uint64_t now);
+    void next_request(Conn& c, uint64_t now);
+    void due(Conn& c, uint64_t due, uint64_t now);
+    void check_timeouts(uint64_t now);
+
+    const Options& opt_;
+    const Target& target_;
+    SSL_CTX* ssl_ctx_;
+    Histogram& latency_;
+    uint32_t first_conn_;
+    std::vector<Conn> conns_;
+    int epfd_ = -1;
+    SSL_SESSION* session_ = nullptr;  // resumed on reconnect
+    uint64_t measure_from_ = 0;
+    uint64_t interval_ = 0;           // per connection, open loop only
+    Totals totals_;
+
+    TimedQueue slots_;    // open loop: idle connections by their next slot
+    TimedQueue revive_;   // failed connections, reconnected from the loop
+};
+
+void Worker::set_events(Conn& c, uint32_t events) {
+    if (c.events == events) return;
+    struct epoll_event ev = {};
+    ev.events = events;
+    ev.data.u64 = (uint64_t)c.generation << 32 | index(c);
+    epoll_ctl(epfd_, c.events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, c.fd, &ev);
+    c.events = events;
+}
+
+void Worker::connect_conn(Conn& c, uint64_t now) {
+    c.fd = socket(target_.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c.fd < 0) {
+        fail_conn(c, totals_.connect_errors, now, 10000000ull);
+        return;
+    }
+    int one = 1;
+    setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    c.events = 0;
+    c.generation++;
+    c.opened = now;
+    c.state = ConnState::CONNECTING;
+    if (connect(c.fd, (struct sockaddr*)&target_.addr, target_.addr_len) < 0 && errno != EINPROGRESS) {
+        fail_conn(c, totals_.connect_errors, now, 10000000ull);
+        return;
+    }
+    set_events(c, EPOLLOUT);
+}
+
+void Worker::close_conn(Conn& c) {
+    if (c.ssl) {
+        SSL_free(c.ssl);
+        c.ssl = nullptr;
+    }
+    if (c.fd >= 0) {
+        close(c.fd);
+        c.fd = -1;
+    }
+    c.state = ConnState::CLOSED;
+    c.events = 0;
+    c.in.clear();
+    c.header_len = 0;
+}
+
+// The request out on it, if any, is lost. One not sent yet stays pending
+// for the new connection, which the loop opens after backoff; failing fast
+// on a refused port must not spin.
+void Worker::fail_conn(Conn& c, uint64_t& counter, uint64_t now, uint64_t backoff) {
+    if (now >= measure_from_) counter++;
+    bool lost = c.in_flight;
+    c.in_flight = false;
+    close_conn(c);
+    revive_.push({now + backoff, index(c)});
+    if (lost) next_request(c, now);
+}
+
+bool Worker::handshake(Conn& c, uint64_t now) {
+    if (!c.ssl) {
+        c.ssl = SSL_new(ssl_ctx_);
+        SSL_set_fd(c.ssl, c.fd);
+        SSL_set_tlsext_host_name(c.ssl, opt_.host.c_str());
+        if (session_) SSL_set_session(c.ssl, session_);
+    }
+
+    int rc = SSL_connect(c.ssl);
+    if (rc == 1) {
+        if (!SSL_session_reused(c.ssl)) {
+            if (session_) SSL_SESSION_free(session_);
+            session_ = SSL_get1_session(c.ssl);
+        }
+        return true;
+    }
+    switch (SSL_get_error(c.ssl, rc)) {
+    case SSL_ERROR_WANT_READ:
+        set_events(c, EPOLLIN);
+        return false;
+    case SSL_ERROR_WANT_WRITE:
+        set_events(c, EPOLLOUT);
+        return false;
+    default:
+        fail_conn(c, totals_.connect_errors, now, 10000000ull);
+        return false;
+    }
+}
+
+void Worker::on_ready(Conn& c, uint64_t now) {
+    c.state = ConnState::READY;
+    set_events(c, EPOLLIN);
+    if (c.pending) {
+        c.pending = false;
+        start_request(c, c.pending_due, now);
+    }
+}
+
+// intended 0: due now, as in closed loop. The clock is read again rather
+// than taking the loop's, which a response on loopback can beat.
+void Worker::start_request(Conn& c, uint64_t intended, uint64_t now) {
+    now = now_ns();
+    c.in_flight = true;
+    c.sent = 0;
+    c.intended = intended ? intended : now;
+    c.started = now;
+    c.in.clear();
+    c.header_len = 0;
+    if (c.intended >= measure_from_) totals_.requests++;
+    if (flush(c, now)) set_events(c, EPOLLIN);
+}
+
+// Writes what is left of the request; false until all of it is out
+bool Worker::flush(Conn& c, uint64_t now) {
+    const std::string& req = target_.request;
+    while (c.sent < req.size()) {
+        ssize_t n;
+        if (c.ssl) {
+            n = SSL_write(c.ssl, req.data() + c.sent, (int)(req.size() - c.sent));
+            if (n <= 0) {
+                int err = SSL_get_error(c.ssl, (int)n);
+                if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) {
+                    set_events(c, EPOLLIN | EPOLLOUT);
+                    return false;
+                }
+                fail_conn(c, totals_.io_errors, now, 0);
+                return false;
+            }
+        } else {
+            n = send(c.fd, req.data() + c.sent, req.size() - c.sent, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EINTR) {
+                    set_events(c, EPOLLIN | EPOLLOUT);
+                    return false;
+                }
+                fail_conn(c, totals_.io_errors, now, 0);
+                return false;
+            }
+        }
+        c.sent += (size_t)n;
+    }
+    return true;
+}
+
+// Header block: status, Content-Length, chunked, keep-alive. Then the body,
+// dropped as it comes for a Content-Length one so that big responses do
+// not pile up. True once the whole response is in.
+bool Worker::parse(Conn& c) {
+    if (c.header_len == 0) {
+        size_t end = c.in.find("\r\n\r\n");
+        if (end == std::string::npos) return false;
+        c.header_len = end + 4;
+
+        c.status = c.in.size() > 12 ? atoi(c.in.c_str() + 9) : 0;
+        c.body_left = 0;
+        c.chunked = false;
+        c.close_after = c.in.compare(0, 8, "HTTP/1.0") == 0;
+
+        size_t pos = c.in.find("\r\n") + 2;
+        while (pos < end) {
+            size_t eol = c.in.find("\r\n", pos);
+            std::string line = c.in.substr(pos, eol - pos);
+            std::transform(line.begin(), line.end(), line.begin(), ::tolower);
+            if (line.compare(0, 15, "content-length:") == 0) {
+                c.body_left = strtoll(line.c_str() + 15, nullptr, 10);
+            } else if (line.compare(0, 18, "transfer-encoding:") == 0 &&
+                       line.find("chunked") != std::string::npos) {
+                c.chunked = true;
+            } else if (line.compare(0, 11, "connection:") == 0) {
+                if (line.find("close") != std::string::npos) c.close_after = true;
+                if (line.find("keep-alive") != std::string::npos) c.close_after = false;
+            }
+            pos = eol + 2;
+        }
+        if (c.status == 204 || c.status == 304) {
+            c.body_left = 0;
+            c.chunked = false;
+        }
+        c.in.erase(0, c.header_len);
+    }
+
+    if (!c.chunked) {
+        int64_t have = (int64_t)c.in.size();
+        c.in.clear();
+        if (have >= c.body_left) return true;
+        c.body_left -= have;
+        return false;
+    }
+
+    // Chunked: walk the size lines over what is buffered
+    size_t pos = 0;
+    for (;;) {
+        size_t eol = c.in.find("\r\n", pos);
+        if (eol == std::string::npos) return false;
+        size_t size = strtoull(c.in.c_str() + pos, nullptr, 16);
+        if (size == 0) {
+            // Trailers, if any, end with an empty line
+            if (c.in.compare(eol, 4, "\r\n\r\n") != 0 && c.in.find("\r\n\r\n", eol) == std::string::npos) {
+                return false;
+            }
+            c.in.clear();
+            return true;
+        }
+        if (c.in.size() < eol + 2 + size + 2) return false;
+        pos = eol + 2 + size + 2;
+    }
+}
+
+void Worker::read_response(Conn& c, uint64_t now) {
+    char buf[65536];
+    int fd = c.fd;
+    while (c.fd == fd && c.state == ConnState::READY) {
+        ssize_t n;
+        if (c.ssl) {
+            n = SSL_read(c.ssl, buf, sizeof(buf));
+            if (n <= 0) {
+                int err = SSL_get_error(c.ssl, (int)n);
+                if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) return;
+            }
+        } else {
+            n = recv(c.fd, buf, sizeof(buf), 0);
+            if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+        }
+
+        if (n <= 0) {
+            // Closed by the server: expected between requests, an error in one
+            if (c.in_flight) {
+                fail_conn(c, totals_.io_errors, now, 0);
+            } else {
+                close_conn(c);
+                if (now >= measure_from_) totals_.reconnects++;
+                revive_.push({now, index(c)});
+            }
+            return;
+        }
+
+        if (now >= measure_from_) totals_.bytes_in += (uint64_t)n;
+        if (!c.in_flight) continue;  // nothing was asked; drop it
+        c.in.append(buf, (size_t)n);
+        if (parse(c)) finish(c, now_ns());
+    }
+}
+
+void Worker::finish(Conn& c, uint64_t now) {
+    c.in_flight = false;
+
+    // Only what was due after the warmup counts
+    if (c.intended >= measure_from_) {
+        int klass = c.status / 100;
+        totals_.status[klass >= 1 && klass <= 5 ? klass : 0]++;
+        totals_.responses++;
+
+        uint64_t ns = now - c.intended;
+        latency_.record(ns);
+        totals_.latency_sum += (double)ns;
+        totals_.latency_sq += (double)ns * (double)ns;
+    }
+
+    if (c.close_after) {
+        close_conn(c);
+        if (now >= measure_from_) totals_.reconnects++;
+        connect_conn(c, now);
+    }
+    next_request(c, now);
+}
+
+// The connection is free: its next request right away in closed loop, at
+// its next slot in open loop
+void Worker::next_request(Conn& c, uint64_t now) {
+    if (interval_ == 0) {
+        due(c, 0, now);
+        return;
+    }
+    uint64_t slot = c.next_due;
+    c.next_due += interval_;
+    if (slot <= now) {
+        due(c, slot, now);
+    } else {
+        slots_.push({slot, index(c)});
+    }
+}
+
+void Worker::due(Conn& c, uint64_t due, uint64_t now) {
+    if (c.state == ConnState::READY) {
+        start_request(c, due, now);
+    } else {
+        c.pending = true;
+        c.pending_due = due;
+    }
+}
+
+void Worker::on_event(Conn& c, uint32_t events, uint64_t now) {
+    if (c.state == ConnState::CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err || (events & (EPOLLERR | EPOLLHUP))) {
+            fail_conn(c, totals_.connect_errors, now, 10000000ull);
+            return;
+        }
+        if (!opt_.tls) {
+            on_ready(c, now);
+            return;
+        }
+        c.state = ConnState::HANDSHAKE;
+    }
+
+    if (c.state == ConnState::HANDSHAKE) {
+        if (handshake(c, now)) on_ready(c, now);
+        return;
+    }
+
+    if ((events & EPOLLOUT) && c.in_flight && c.sent < target_.request.size()) {
+        if (!flush(c, now)) return;
+        set_events(c, EPOLLIN);
+    }
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) read_response(c, now);
+}
+
+void Worker::check_timeouts(uint64_t now) {
+    uint64_t limit = (uint64_t)opt_.timeout_ms * 1000000ull;
+    for (auto& c : conns_) {
+        if (c.in_flight && c.started + limit < now) {
+            fail_conn(c, totals_.timeouts, now, 0);
+        } else if ((c.state == ConnState::CONNECTING || c.state == ConnState::HANDSHAKE) &&
+                   c.opened + limit < now) {
+            fail_conn(c, totals_.timeouts, now, 0);
+        }
+    }
+}
+
+void Worker::run(uint64_t start, uint64_t measure_from, uint64_t end) {
+    epfd_ = epoll_create1(EPOLL_CLOEXEC);
+    measure_from_ = measure_from;
+    uint64_t now = now_ns();
+
+    // Open loop: connection k of all of them sends at start + k/rate, then
+    // every connections/rate, which adds up to rate spread evenly
+    if (opt_.rate > 0) {
+        double gap = 1e9 / opt_.rate;
+        interval_ = std::max<uint64_t>(1, (uint64_t)(gap * opt_.connections));
+        for (size_t i = 0; i < conns_.size(); i++) {
+            conns_[i].next_due = start + (uint64_t)(gap * (double)(first_conn_ + i));
+        }
+    }
+    for (auto& c : conns_) {
+        connect_conn(c, now);
+        if (interval_) {
+            slots_.push({c.next_due, index(c)});
+            c.next_due += interval_;
+        } else {
+            c.pending = true;
+            c.pending_due = 0;
+        }
+    }
+
+    std::vector<struct epoll_event> events(std::max<size_t>(conns_.size(), 1));
+    uint64_t next_check = now + 100000000ull;
+
+    for (;;) {
+        now = now_ns();
+        if (now >= end || stop_flag.load(std::memory_order_relaxed)) break;
+
+        while (!revive_.empty() && revive_.top().first <= now) {
+            Conn& c = conns_[revive_.top().second];
+            revive_.pop();
+            if (c.state == ConnState::CLOSED) connect_conn(c, now);
+        }
+        while (!slots_.empty() && slots_.top().first <= now) {
+            auto [slot, i] = slots_.top();
+            slots_.pop();
+            due(conns_[i], slot, now);
+        }
+
+        uint64_t wake = std::min(end, next_check);
+        if (!slots_.empty()) wake = std::min(wake, slots_.top().first);
+        if (!revive_.empty()) wake = std::min(wake, revive_.top().first);
+        struct timespec timeout = {};
+        if (wake > now) {
+            timeout.tv_sec = (time_t)((wake - now) / 1000000000ull);
+            timeout.tv_nsec = (long)((wake - now) % 1000000000ull);
+        }
+
+        int n = epoll_pwait2(epfd_, events.data(), (int)events.size(), &timeout, nullptr);
+        if (n < 0 && errno == ENOSYS) {
+            n = epoll_wait(epfd_, events.data(), (int)events.size(),
+                           (int)(timeout.tv_sec * 1000 + (timeout.tv_nsec + 999999) / 1000000));
+        }
+        now = now_ns();
+        for (int i = 0; i < n; i++) {
+            Conn& c = conns_[(uint32_t)events[i].data.u64];
+            if (c.fd >= 0 && c.generation == (uint32_t)(events[i].data.u64 >> 32)) {
+                on_event(c, events[i].events, now);
+            }
+        }
+
+        if (now >= next_check) {
+            check_timeouts(now);
+            next_check = now + 100000000ull;
+        }
+    }
+}
+
+bool parse_url(const char* url, Options& opt) {
+    std::string s = url;
+    size_t rest;
+    if (s.compare(0, 7, "http://") == 0) {
+        rest = 7;
+    } else if (s.compare(0, 8, "https://") == 0) {
+        rest = 8;
+        opt.tls = true;
+    } else {
+        return false;
+    }
+
+    size_t slash = s.find('/', rest);
+    std::string authority = s.substr(rest, slash == std::string::npos ? std::string::npos : slash - rest);
+    opt.path = slash == std::string::npos ? "/" : s.substr(slash);
+
+    size_t colon = authority.rfind(':');
+    if (!authority.empty() && authority[0] == '[') {
+        size_t close = authority.find(']');
+        if (close == std::string::npos) return false;
+        opt.host = authority.substr(1, close - 1);
+        opt.port = close + 1 < authority.size() && authority[close + 1] == ':' ? authority.substr(close + 2) : "";
+    } else if (colon != std::string::npos) {
+        opt.host = authority.substr(0, colon);
+        opt.port = authority.substr(colon + 1);
+    } else {
+        opt.host = authority;
+    }
+    if (opt.port.empty()) opt.port = opt.tls ? "443" : "80";
+    return !opt.host.empty();
+}
+
+bool resolve(const Options& opt, Target& target) {
+    struct addrinfo hints = {};
+    struct addrinfo* res = nullptr;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(opt.host.c_str(), opt.port.c_str(), &hints, &res) != 0 || !res) return false;
+
+    memcpy(&target.addr, res->ai_addr, res->ai_addrlen);
+    target.addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    target.request = "GET " + opt.path + " HTTP/1.1\r\nHost: " + opt.host;
+    if (opt.port != (opt.tls ? "443" : "80")) target.request += ":" + opt.port;
+    target.request += "\r\n";
+    for (const auto& h : opt.headers) target.request += h + "\r\n";
+    target.request += "\r\n";
+    return true;
+}
+
+// HdrHistogram's percentile distribution text, in ms, which its plotting
+// tools read: every tick halves the distance left to 100%, five steps each
+void write_hdr(FILE* out, const HistogramSnapshot& snap, const Totals& totals) {
+    fprintf(out, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+
+    double percentile = 0;
+    for (;;) {
+        uint64_t rank = std::max<uint64_t>(1, (uint64_t)std::ceil(percentile / 100.0 * (double)snap.count()));
+        double fraction = percentile / 100.0;
+        if (fraction < 1.0) {
+            fprintf(out, "%12.3f %2.12f %10llu %14.2f\n", (double)snap.value_at(percentile) / 1e6, fraction,
+                    (unsigned long long)rank, 1.0 / (1.0 - fraction));
+        } else {
+            fprintf(out, "%12.3f %2.12f %10llu\n", (double)snap.max() / 1e6, 1.0, (unsigned long long)rank);
+            break;
+        }
+        if (rank >= snap.count()) {
+            percentile = 100.0;
+            continue;
+        }
+        double halvings = std::floor(std::log2(100.0 / (100.0 - percentile))) + 1;
+        percentile += 100.0 / (5.0 * std::pow(2.0, halvings));
+    }
+
+    double n = (double)snap.count();
+    double mean = n ? totals.latency_sum / n : 0;
+    double stddev = n ? std::sqrt(std::max(0.0, totals.latency_sq / n - mean * mean)) : 0;
+    fprintf(out, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", mean / 1e6, stddev / 1e6);
+    fprintf(out, "#[Max     = %12.3f, Total count    = %12llu]\n", (double)snap.max() / 1e6,
+            (unsigned long long)snap.count());
+}
+
+void report(const Options& opt, const Totals& t, const HistogramSnapshot& snap, double seconds) {
+    static const double points[] = {50, 75, 90, 99, 99.9, 99.99, 99.999};
+    double n = (double)snap.count();
+    double mean = n ? t.latency_sum / n : 0;
+    uint64_t errors = t.connect_errors + t.io_errors + t.timeouts;
+
+    if (opt.json) {
+        printf("{\"mode\":\"%s\",\"rate\":%.0f,\"connections\":%u,\"threads\":%u,\"seconds\":%.3f,"
+               "\"requests\":%llu,\"responses\":%llu,\"rps\":%.1f,\"non_2xx\":%llu,\"errors\":%llu,"
+               "\"timeouts\":%llu,\"latency_ns\":{\"min\":%llu,\"mean\":%.0f,\"max\":%llu",
+               opt.rate > 0 ? "open" : "closed", opt.rate, opt.connections, opt.threads, seconds,
+               (unsigned long long)t.requests, (unsigned long long)t.responses, (double)t.responses / seconds,
+               (unsigned long long)(t.responses - t.status[2]), (unsigned long long)errors,
+               (unsigned long long)t.timeouts, (unsigned long long)snap.min(), mean,
+               (unsigned long long)snap.max());
+        for (double p : points) printf(",\"p%g\":%llu", p, (unsigned long long)snap.value_at(p));
+        printf("}}\n");
+        return;
+    }
+
+    printf("%s loop, %u connections over %u threads", opt.rate > 0 ? "Open" : "Closed", opt.connections,
+           opt.threads);
+    if (opt.rate > 0) printf(", %.0f requests/s intended", opt.rate);
+    printf("\n  %llu responses in %.2fs: %.1f requests/s, %.2f MB/s in\n", (unsigned long long)t.responses,
+           seconds, (double)t.responses / seconds, (double)t.bytes_in / seconds / 1e6);
+    printf("  status 2xx %llu, 3xx %llu, 4xx %llu, 5xx %llu, other %llu\n", (unsigned long long)t.status[2],
+           (unsigned long long)t.status[3], (unsigned long long)t.status[4], (unsigned long long)t.status[5],
+           (unsigned long long)t.status[0]);
+    if (errors || t.reconnects) {
+        printf("  errors: connect %llu, i/o %llu, timeout %llu; reconnects %llu\n",
+               (unsigned long long)t.connect_errors, (unsigned long long)t.io_errors,
+               (unsigned long long)t.timeouts, (unsigned long long)t.reconnects);
+    }
+    printf("  latency%s (ms): min %.3f, mean %.3f, max %.3f\n",
+           opt.rate > 0 ? ", from intended send time" : "", (double)snap.min() / 1e6, mean / 1e6,
+           (double)snap.max() / 1e6);
+    for (double p : points) printf("    p%-7g %10.3f\n", p, (double)snap.value_at(p) / 1e6);
+}
+
+void usage(const char* prog) {
+    fprintf(stderr,
+            "Usage: %s [options] http[s]://host[:port]/path\n"
+            "  -c, --connections N   Keep-alive connections (default: 16)\n"
+            "  -t, --threads N       Client threads, connections are split over them (default: 1)\n"
+            "  -d, --duration S      Seconds to run, after the warmup (default: 10)\n"
+            "  -R, --rate N          Open loop at N requests/s in total; without it, closed loop\n"
+            "  -w, --warmup S        Seconds sent but left out of the results (default: 0)\n"
+            "  -H, --header 'K: V'   Extra request header, repeatable\n"
+            "      --timeout MS      Request timeout (default: 5000)\n"
+            "      --hdr FILE        Write the HdrHistogram percentile distribution ('-' for stdout)\n"
+            "      --json            One JSON line instead of the text summary\n",
+            prog);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    Options opt;
+    const char* url = nullptr;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        const char* val = i + 1 < argc ? argv[i + 1] : nullptr;
+        auto take = [&]() { i++; return val; };
+
+        if ((arg == "-c" || arg == "--connections") && val) {
+            opt.connections = (uint32_t)atoi(take());
+        } else if ((arg == "-t" || arg == "--threads") && val) {
+            opt.threads = (uint32_t)atoi(take());
+        } else if ((arg == "-d" || arg == "--duration") && val) {
+            opt.duration_s = atof(take());
+        } else if ((arg == "-R" || arg == "--rate") && val) {
+            opt.rate = atof(take());
+        } else if ((arg == "-w" || arg == "--warmup") && val) {
+            opt.warmup_s = atof(take());
+        } else if ((arg == "-H" || arg == "--header") && val) {
+            opt.headers.push_back(take());
+        } else if (arg == "--timeout" && val) {
+            opt.timeout_ms = (uint32_t)atoi(take());
+        } else if (arg == "--hdr" && val) {
+            opt.hdr_file = take();
+        } else if (arg == "--json") {
+            opt.json = true;
+        } else if (arg[0] != '-' && !url) {
+            url = argv[i];
+        } else {
+            usage(argv[0]);
+            return arg == "-h" || arg == "--help" ? 0 : 1;
+        }
+    }
+
+    if (!url || !parse_url(url, opt)) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (opt.threads == 0 || opt.threads > Histogram::kMaxThreads || opt.connections < opt.threads ||
+        opt.duration_s <= 0 || opt.rate < 0 || opt.warmup_s < 0) {
+        fprintf(stderr, "Need 1..%u threads, at least one connection per thread and a positive duration\n",
+                Histogram::kMaxThreads);
+        return 1;
+    }
+
+    Target target;
+    if (!resolve(opt, target)) {
+        fprintf(stderr, "Cannot resolve %s:%s\n", opt.host.c_str(), opt.port.c_str());
+        return 1;
+    }
+
+    SSL_CTX* ssl_ctx = nullptr;
+    if (opt.tls) {
+        // Load testing, not auth: the certificate is not verified
+        ssl_ctx = SSL_CTX_new(TLS_client_method());
+        SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_NONE, nullptr);
+        SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_CLIENT);
+        static const unsigned char alpn[] = {8, 'h', 't', 't', 'p', '/', '1', '.', '1'};
+        SSL_CTX_set_alpn_protos(ssl_ctx, alpn, sizeof(alpn));
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, [](int) { stop_flag.store(true); });
+
+    // 10 bits: percentiles within 0.2%, up to a minute
+    Histogram latency(60ull * 1000000000, 10);
+    std::vector<std::unique_ptr<Worker>> workers;
+    uint32_t first = 0;
+    for (uint32_t t = 0; t < opt.threads; t++) {
+        uint32_t count = opt.connections / opt.threads + (t < opt.connections % opt.threads ? 1 : 0);
+        workers.push_back(std::make_unique<Worker>(opt, target, ssl_ctx, latency, first, count));
+        first += count;
+    }
+
+    uint64_t start = now_ns() + 10000000ull;  // time for every thread to get going
+    uint64_t measure_from = start + (uint64_t)(opt.warmup_s * 1e9);
+    uint64_t end = measure_from + (uint64_t)(opt.duration_s * 1e9);
+
+    std::vector<std::thread> threads;
+    for (auto& w : workers) {
+        threads.emplace_back([&w, start, measure_from, end] { w->run(start, measure_from, end); });
+    }
+    for (auto& th : threads) th.join();
+    double seconds = (double)(std::min(now_ns(), end) - measure_from) / 1e9;
+
+    Totals totals;
+    for (auto& w : workers) totals.add(w->totals());
+    HistogramSnapshot snap = latency.current();
+
+    report(opt, totals, snap, seconds);
+    if (opt.hdr_file) {
+        FILE* out = strcmp(opt.hdr_file, "-") == 0 ? stdout : fopen(opt.hdr_file, "w");
+        if (!out) {
+            fprintf(stderr, "Cannot write %s: %s\n", opt.hdr_file, strerror(errno));
+        } else {
+            write_hdr(out, snap, totals);
+            if (out != stdout) fclose(out);
+        }
+    }
+
+    workers.clear();
+    if (ssl_ctx) SSL_CTX_free(ssl_ctx);
+    return totals.responses ? 0 : 1;
+}
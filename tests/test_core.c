@@ -2,9 +2,51 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <unistd.h>
 #include "../include/stick_tables.h"
+#include "../include/peers.h"
 #include "../include/cache/cache.h"
+#include <brotli/decode.h>
 #include "../include/health/health.h"
+#include "../include/core/lb_memory.h"
+#include "../include/core/loadbalancer.h"
+#include "../include/utils/log.h"
+#include "../include/core/lb_http1.h"
+#include "../include/core/lb_timer.h"
+#include "../include/core/lb_reload.h"
+#include "../include/http/http.h"
+#include "../include/core/lb_hpack.h"
+#include "../include/core/lb_h2.h"
+#include "../include/utils/regex_set.h"
+#include "../include/utils/ip_tree.h"
+#include "../include/utils/str_match.h"
+#include "../include/database/db_protocol.h"
+#include "../include/database/db_router.h"
+#include "../include/database/db_redis_cluster.h"
+#include "../include/database/db_health.h"
+#include "../include/database/db_cache.h"
+#include "../include/ssl/ssl.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+// tests/test_router.cpp
+void test_request_router(void);
+// tests/test_rate_limiter.cpp
+void test_rate_limiter(void);
+// tests/test_histogram.cpp
+void test_histogram(void);
+// tests/test_idle_ring.cpp
+void test_idle_ring(void);
+// tests/test_liveness.cpp
+void test_liveness_watcher(void);
+// tests/test_db_pool.cpp
+void test_db_pool_warmup(void);
+// tests/test_metrics.cpp
+void test_metrics_handles(void);
 
 void test_stick_tables() {
     printf("Testing stick tables...\n");
@@ -31,6 +73,157 @@ void test_stick_tables() {
     printf("Stick tables test passed\n");
 }
 
+void test_stick_tables_expiry() {
+    printf("Testing stick table expiry and eviction...\n");
+
+    /* expire 0: due as soon as the wheel next turns */
+    stick_table_t *table = stktable_new("expiry", STKTABLE_TYPE_INTEGER, 4, 0);
+    assert(table != NULL);
+
+    stick_key_t key = { .type = STKTABLE_TYPE_INTEGER, .data.integer = 1 };
+    stick_entry_t *tracked = stktable_get(table, &key);
+    assert(tracked != NULL);
+    atomic_store(&tracked->ref_cnt, 1);
+
+    key.data.integer = 2;
+    assert(stktable_get(table, &key) != NULL);
+    usleep(2000);
+    stktable_expire(table);
+    assert(stktable_lookup(table, &key) == NULL);
+    assert(table->stats.expires == 1);
+
+    /* A full table evicts, but never a tracked entry */
+    for (uint32_t i = 10; i < 40; i++) {
+        key.data.integer = i;
+        assert(stktable_get(table, &key) != NULL);
+        assert(table->current <= 4);
+    }
+    assert(table->stats.evictions > 0);
+    key.data.integer = 1;
+    assert(stktable_lookup(table, &key) == tracked);
+
+    stktable_free(table);
+
+    /* Variable-length keys are compared through their entries */
+    table = stktable_new("names", STKTABLE_TYPE_STRING, 100, 3600);
+    char name[16];
+    stick_key_t skey = { .type = STKTABLE_TYPE_STRING };
+    for (int i = 0; i < 100; i++) {
+        skey.data.str.len = (size_t)snprintf(name, sizeof(name), "user-%d", i);
+        skey.data.str.ptr = name;
+        assert(stktable_get(table, &skey) != NULL);
+    }
+    skey.data.str.len = (size_t)snprintf(name, sizeof(name), "user-%d", 42);
+    stick_entry_t *entry = stktable_lookup(table, &skey);
+    assert(entry != NULL && entry->key.data.str.len == skey.data.str.len);
+    assert(memcmp(entry->key.data.str.ptr, "user-42", 7) == 0);
+    assert(table->current == 100);
+
+    stktable_free(table);
+    printf("Stick table expiry and eviction test passed\n");
+}
+
+static stick_entry_t* wait_peer_entry(stick_table_t *t, stick_key_t *key, uint32_t http_req_cnt) {
+    for (int i = 0; i < 300; i++) {
+        stick_entry_t *entry = stktable_lookup(t, key);
+        if (entry && atomic_load(&entry->counters.http_req_cnt) == http_req_cnt) {
+            return entry;
+        }
+        usleep(10000);
+    }
+    return NULL;
+}
+
+void test_stick_share_count() {
+    printf("Testing shared counts...\n");
+
+    stick_table_t *table = stktable_new("limits", STKTABLE_TYPE_STRING, 100, 3);
+    assert(table != NULL);
+
+    uint64_t remote;
+    uint32_t nodes;
+    assert(stktable_share_count(table, "api", "a", 700, &remote, &nodes) == 0);
+    assert(remote == 0 && nodes == 0);
+    assert(stktable_share_count(table, "api", "b", 200, &remote, &nodes) == 0);
+    assert(remote == 700 && nodes == 1);
+    /* Other names and the node's own entry are left out */
+    assert(stktable_share_count(table, "apix", "c", 50, &remote, &nodes) == 0);
+    assert(remote == 0 && nodes == 0);
+    assert(stktable_share_count(table, "api", "a", 300, &remote, &nodes) == 0);
+    assert(remote == 200 && nodes == 1);
+
+    stick_table_t *ip = stktable_new("ip", STKTABLE_TYPE_IP, 100, 3);
+    assert(stktable_share_count(ip, "api", "a", 1, &remote, &nodes) == -1);
+
+    stktable_free(ip);
+    stktable_free(table);
+    printf("Shared counts test passed\n");
+}
+
+void test_peers() {
+    printf("Testing stick table peers...\n");
+
+    stick_table_t *ta = stktable_new("src", STKTABLE_TYPE_IP, 1000, 60);
+    stick_table_t *tb = stktable_new("src", STKTABLE_TYPE_IP, 1000, 60);
+    peers_t *a = peers_new("a", "127.0.0.1", 0);
+    peers_t *b = peers_new("b", "127.0.0.1", 0);
+    assert(ta && tb && a && b);
+    assert(peers_attach(a, ta) == 0 && peers_attach(b, tb) == 0);
+    assert(peers_add(a, "b", "127.0.0.1", ntohs(b->bind.sin_port)) == 0);
+    assert(peers_add(b, "a", "127.0.0.1", ntohs(a->bind.sin_port)) == 0);
+
+    /* Known before b joins: arrives with the full resync */
+    stick_key_t key = { .type = STKTABLE_TYPE_IP, .data.ipv4.s_addr = 0x0100007f };
+    uint32_t val = 7;
+    stktable_update_key(ta, &key, STKTABLE_DATA_HTTP_REQ_CNT, &val);
+
+    assert(peers_start(a) == 0 && peers_start(b) == 0);
+    assert(wait_peer_entry(tb, &key, 7) != NULL);
+
+    /* Updates between two flushes coalesce into one record */
+    uint64_t before = a->stats.updates_out;
+    for (val = 1; val <= 1000; val++) {
+        stktable_update_key(ta, &key, STKTABLE_DATA_HTTP_REQ_CNT, &val);
+    }
+    assert(wait_peer_entry(tb, &key, 1000) != NULL);
+    assert(a->stats.updates_out - before < 100);
+
+    /* And the other way round */
+    stick_key_t other = { .type = STKTABLE_TYPE_IP, .data.ipv4.s_addr = 0x0200007f };
+    val = 3;
+    stktable_update_key(tb, &other, STKTABLE_DATA_HTTP_REQ_CNT, &val);
+    assert(wait_peer_entry(ta, &other, 3) != NULL);
+
+    peers_free(a);
+    peers_free(b);
+    stktable_free(ta);
+    stktable_free(tb);
+    printf("Stick table peers test passed\n");
+}
+
+/* Whether a lookup finds expect (or nothing), giving the reference back */
+static bool cache_serves_key(cache_t *cache, const cache_key_t *key, cache_entry_t *expect) {
+    cache_entry_t *entry = cache_lookup_key(cache, key);
+    if (entry) {
+        cache_entry_put(entry);
+    }
+    return entry == expect;
+}
+
+static bool cache_serves(cache_t *cache, const char *key, cache_entry_t *expect) {
+    cache_key_t k;
+    cache_key_init(&k, key, strlen(key));
+    return cache_serves_key(cache, &k, expect);
+}
+
+static bool cache_serves_stale(cache_t *cache, const char *key, cache_entry_t *expect) {
+    cache_entry_t *entry = cache_lookup_stale(cache, key);
+    if (entry) {
+        cache_entry_put(entry);
+    }
+    return entry == expect;
+}
+
 void test_cache() {
     printf("Testing cache...\n");
 
@@ -49,11 +242,374 @@ void test_cache() {
     cache_entry_t *found = cache_lookup(cache, key);
     assert(found != NULL);
     assert(strcmp(found->data.ptr, "test data") == 0);
+    cache_entry_put(found);
 
     cache_destroy(cache);
     printf("Cache test passed\n");
 }
 
+void test_cache_key() {
+    printf("Testing cache keys...\n");
+
+    cache_t *cache = cache_create("keys", 1024*1024, 100*1024);
+    assert(cache != NULL);
+
+    /* Fields are length-prefixed, so moving a boundary changes the key */
+    cache_key_buf_t a = { 0 }, b = { 0 };
+    cache_key_t ka, kb;
+    assert(cache_key_append(&a, "ab", 2) == 0 && cache_key_append(&a, "c", 1) == 0);
+    assert(cache_key_append(&b, "a", 1) == 0 && cache_key_append(&b, "bc", 2) == 0);
+    cache_key_init(&ka, a.data, a.len);
+    cache_key_init(&kb, b.data, b.len);
+    assert(ka.len == kb.len && ka.hash != kb.hash);
+
+    /* Every length through the 48-byte blocks hashes apart from its prefix */
+    char data[200];
+    for (size_t i = 0; i < sizeof(data); i++) data[i] = (char)('a' + i % 26);
+    for (size_t len = 1; len < sizeof(data); len++) {
+        assert(cache_hash_key(data, len) == cache_hash_key(data, len));
+        assert(cache_hash_key(data, len) != cache_hash_key(data, len - 1));
+    }
+
+    static char big[CACHE_KEY_MAX];
+    cache_key_buf_t full = { 0 };
+    assert(cache_key_append(&full, big, CACHE_KEY_MAX - 2) == 0);
+    assert(cache_key_append(&full, "", 0) < 0);
+
+    /* Span keys may hold NUL bytes */
+    cache_entry_t *entry = calloc(1, sizeof(cache_entry_t));
+    entry->data.ptr = strdup("span");
+    entry->data.len = 4;
+    entry->size = 4;
+    assert(cache_insert_key(cache, &ka, entry) == 0);
+    assert(cache_serves_key(cache, &ka, entry));
+    assert(cache_serves_key(cache, &kb, NULL));
+    assert(cache_serves(cache, "ab", NULL));
+
+    cache_delete_key(cache, &ka);
+    assert(cache_serves_key(cache, &ka, NULL));
+
+    cache_destroy(cache);
+    printf("Cache keys test passed\n");
+}
+
+void test_cache_clock() {
+    printf("Testing cache CLOCK eviction...\n");
+
+    /* 100 bytes per shard, ten 10-byte objects each */
+    cache_t *cache = cache_create("clock", 100 * CACHE_SHARDS, 10);
+    assert(cache != NULL);
+
+    char key[32];
+    cache_entry_t *hot = calloc(1, sizeof(cache_entry_t));
+    hot->size = 10;
+    assert(cache_insert(cache, "hot", hot) == 0);
+
+    for (int i = 0; i < 2000; i++) {
+        snprintf(key, sizeof(key), "key-%d", i);
+        cache_entry_t *entry = calloc(1, sizeof(cache_entry_t));
+        entry->size = 10;
+        assert(cache_insert(cache, key, entry) == 0);
+
+        /* Referenced between every sweep, so the hand always spares it */
+        assert(cache_serves(cache, "hot", hot));
+    }
+
+    uint32_t total = 0;
+    for (uint32_t i = 0; i < CACHE_SHARDS; i++) {
+        assert(cache->shards[i].current_size <= cache->shards[i].max_size);
+        total += cache->shards[i].entry_count;
+    }
+    assert(total <= 10 * CACHE_SHARDS);
+    assert(cache->stats.evictions == 2001 - total);
+
+    /* Same key again replaces the entry instead of duplicating it */
+    cache_entry_t *again = calloc(1, sizeof(cache_entry_t));
+    again->size = 10;
+    assert(cache_insert(cache, "hot", again) == 0);
+    assert(cache_serves(cache, "hot", again));
+
+    cache_delete(cache, "hot");
+    assert(cache_serves(cache, "hot", NULL));
+
+    uint64_t hits, misses;
+    cache_read_stats(cache, &hits, &misses, NULL);
+    assert(hits == 2001 && misses == 1);
+
+    cache_purge(cache);
+    for (uint32_t i = 0; i < CACHE_SHARDS; i++) {
+        assert(cache->shards[i].entry_count == 0 && cache->shards[i].hand == NULL);
+    }
+
+    cache_destroy(cache);
+    printf("Cache CLOCK eviction test passed\n");
+}
+
+static int collapsed_wakes;
+static cache_entry_t *collapsed_entry;
+
+static void collapsed_wake(cache_waiter_t *w, cache_entry_t *entry) {
+    (void)w;
+    collapsed_wakes++;
+    collapsed_entry = entry;
+    if (entry) {
+        cache_entry_put(entry);
+    }
+}
+
+void test_cache_collapsed() {
+    printf("Testing cache request collapsing...\n");
+
+    cache_t *cache = cache_create("collapse", 1024*1024, 64*1024);
+    cache_entry_t *entry = NULL;
+    cache_waiter_t w1 = { .wake = collapsed_wake }, w2 = { .wake = collapsed_wake };
+
+    /* First miss fetches, the others queue behind it */
+    assert(cache_lookup_collapsed(cache, "/hot", &w1, &entry) == CACHE_MISS_FETCH);
+    assert(cache_lookup_collapsed(cache, "/hot", &w1, &entry) == CACHE_MISS_WAIT);
+    assert(cache_lookup_collapsed(cache, "/hot", &w2, &entry) == CACHE_MISS_WAIT);
+    assert(cache_waiter_cancel(cache, "/hot", &w2));
+    assert(cache->stats.collapsed == 2);
+
+    cache_entry_t *fetched = calloc(1, sizeof(cache_entry_t));
+    fetched->size = 10;
+    assert(cache_insert(cache, "/hot", fetched) == 0);
+    assert(collapsed_wakes == 1 && collapsed_entry == fetched);
+    assert(!cache_waiter_cancel(cache, "/hot", &w1));
+    assert(cache_lookup_collapsed(cache, "/hot", &w1, &entry) == CACHE_HIT && entry == fetched);
+    cache_entry_put(entry);
+
+    /* Nothing cacheable came back: waiters fetch on their own */
+    assert(cache_lookup_collapsed(cache, "/uncacheable", &w1, &entry) == CACHE_MISS_FETCH);
+    assert(cache_lookup_collapsed(cache, "/uncacheable", &w1, &entry) == CACHE_MISS_WAIT);
+    cache_fill_abort(cache, "/uncacheable");
+    assert(collapsed_wakes == 2 && collapsed_entry == NULL);
+
+    /* A leader past the timeout is taken over */
+    cache->fill_timeout_ms = 0;
+    assert(cache_lookup_collapsed(cache, "/stuck", &w1, &entry) == CACHE_MISS_FETCH);
+    assert(cache_lookup_collapsed(cache, "/stuck", &w1, &entry) == CACHE_MISS_FETCH);
+
+    cache_destroy(cache);
+    printf("Cache request collapsing test passed\n");
+}
+
+void test_cache_variants() {
+    printf("Testing cache encoded variants...\n");
+
+    assert(parse_accept_encoding(NULL) == COMP_TYPE_NONE);
+    assert(parse_accept_encoding("gzip, deflate, br") == COMP_TYPE_BROTLI);
+    assert(parse_accept_encoding("br;q=0.5, gzip") == COMP_TYPE_GZIP);
+    assert(parse_accept_encoding("br;q=0, *;q=0.1") == COMP_TYPE_GZIP);
+    assert(parse_accept_encoding("identity, gzip;q=0") == COMP_TYPE_NONE);
+    assert(strcmp(get_encoding_name(COMP_TYPE_BROTLI), "br") == 0);
+
+    cache_t *cache = cache_create("variants", 1024*1024, 64*1024);
+    cache_entry_t *entry = calloc(1, sizeof(cache_entry_t));
+    entry->data.len = entry->size = 8192;
+    entry->data.ptr = malloc(entry->data.len);
+    for (size_t i = 0; i < entry->data.len; i++) {
+        entry->data.ptr[i] = "cached response body "[i % 21];
+    }
+    assert(cache_insert(cache, "/text", entry) == 0);
+    uint32_t stored = cache->shards[entry->key_hash >> (64 - CACHE_SHARD_BITS)].current_size;
+
+    /* First demand encodes, later hits reuse the same copy */
+    const char *body;
+    size_t len;
+    assert(cache_entry_variant(cache, entry, COMP_TYPE_BROTLI, &body, &len) == COMP_TYPE_BROTLI);
+    assert(len < entry->data.len);
+    uint8_t plain[8192];
+    size_t plain_len = sizeof(plain);
+    assert(BrotliDecoderDecompress(len, (const uint8_t*)body, &plain_len, plain) == BROTLI_DECODER_RESULT_SUCCESS);
+    assert(plain_len == 8192 && memcmp(plain, entry->data.ptr, plain_len) == 0);
+
+    const char *again;
+    assert(cache_entry_variant(cache, entry, COMP_TYPE_BROTLI, &again, &len) == COMP_TYPE_BROTLI);
+    assert(again == body);
+
+    assert(cache_entry_variant(cache, entry, COMP_TYPE_GZIP, &body, &len) == COMP_TYPE_GZIP);
+    assert((uint8_t)body[0] == 0x1f && (uint8_t)body[1] == 0x8b);
+    assert(cache->shards[entry->key_hash >> (64 - CACHE_SHARD_BITS)].current_size > stored);
+
+    assert(cache_entry_variant(cache, entry, COMP_TYPE_NONE, &body, &len) == COMP_TYPE_NONE);
+    assert(body == entry->data.ptr && len == 8192);
+
+    /* no-transform and tiny bodies stay as they are */
+    entry->flags |= CACHE_F_NO_TRANSFORM;
+    assert(cache_entry_variant(cache, entry, COMP_TYPE_BROTLI, &body, &len) == COMP_TYPE_NONE);
+
+    cache_destroy(cache);
+    printf("Cache encoded variants test passed\n");
+}
+
+static int refresh_status;
+static char refresh_cond[256];
+
+static int refresh_fetch(void *arg, const cache_key_t *key, const char *cond, size_t cond_len,
+                         cache_entry_t **fresh) {
+    (void)arg;
+    (void)key;
+    memcpy(refresh_cond, cond, cond_len + 1);
+    if (refresh_status == 200) {
+        *fresh = calloc(1, sizeof(cache_entry_t));
+        (*fresh)->size = 5;
+        (*fresh)->data.ptr = strdup("fresh");
+        (*fresh)->data.len = 5;
+    }
+    return refresh_status;
+}
+
+static void wait_refreshes(cache_t *cache, uint64_t n) {
+    for (int i = 0; i < 2000 && cache->stats.refreshes + cache->stats.refresh_errors < n; i++) {
+        usleep(1000);
+    }
+    /* The outcome is applied just after the counters move */
+    usleep(10000);
+}
+
+void test_cache_stale() {
+    printf("Testing cache stale-while-revalidate...\n");
+
+    cache_t *cache = cache_create("stale", 1024*1024, 64*1024);
+    cache_entry_t *entry = calloc(1, sizeof(cache_entry_t));
+    entry->size = 5;
+    entry->data.ptr = strdup("stale");
+    entry->data.len = 5;
+    entry->etag = strdup("\"v1\"");
+    entry->flags = CACHE_F_MAX_AGE;
+    entry->expires = time(NULL) - 5;
+    entry->stale_while_revalidate = 60;
+    entry->stale_if_error = 600;
+    assert(cache_insert(cache, "/page", entry) == 0);
+
+    /* Without a refresh path an expired entry is a miss */
+    assert(cache_serves(cache, "/page", NULL));
+    assert(cache_serves_stale(cache, "/page", entry));
+
+    /* 304: served stale right away, fresh again once revalidated */
+    assert(cache_start_refresh(cache, refresh_fetch, NULL) == 0);
+    refresh_status = 304;
+    assert(cache_serves(cache, "/page", entry));
+    wait_refreshes(cache, 1);
+    assert(strstr(refresh_cond, "If-None-Match: \"v1\"\r\n") != NULL);
+    assert(entry->expires > time(NULL) && !entry->refreshing);
+
+    /* Origin failing: stale-if-error keeps the entry in service */
+    entry->expires = time(NULL) - 120;
+    refresh_status = 503;
+    assert(cache_serves(cache, "/page", NULL));
+    entry->expires = time(NULL) - 5;
+    assert(cache_serves(cache, "/page", entry));
+    wait_refreshes(cache, 2);
+    assert(entry->origin_error);
+    entry->expires = time(NULL) - 120;
+    assert(cache_serves(cache, "/page", entry));
+    wait_refreshes(cache, 3);
+
+    /* A changed object replaces the entry; one still being served stays
+     * intact until its holder puts it */
+    refresh_status = 200;
+    cache_entry_t *held = cache_lookup(cache, "/page");
+    assert(held == entry);
+    wait_refreshes(cache, 4);
+    cache_entry_t *fresh = cache_lookup(cache, "/page");
+    assert(fresh && fresh != entry && strcmp(fresh->data.ptr, "fresh") == 0);
+    assert(held->refs == 1 && strcmp(held->data.ptr, "stale") == 0);
+    cache_entry_put(held);
+    cache_entry_put(fresh);
+    assert(cache->stats.stale_hits == 5);
+
+    cache_destroy(cache);
+    printf("Cache stale-while-revalidate test passed\n");
+}
+
+static cache_entry_t* disk_test_entry(uint32_t size, char fill) {
+    cache_entry_t *entry = calloc(1, sizeof(cache_entry_t));
+    entry->data.ptr = malloc(size);
+    memset(entry->data.ptr, fill, size);
+    entry->data.len = entry->size = size;
+    return entry;
+}
+
+void test_cache_disk() {
+    printf("Testing cache disk tier...\n");
+
+    char path[] = "/tmp/ub-cache-XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+
+    /* 1KB of RAM per shard, large objects up to 8KB on a 4MB ring */
+    cache_t *cache = cache_create("disk", 1024 * CACHE_SHARDS, 1024);
+    assert(cache_attach_disk(cache, path, 4 << 20, 8192) == 0);
+
+    char key[32];
+    for (int i = 0; i < 200; i++) {
+        snprintf(key, sizeof(key), "obj-%d", i);
+        assert(cache_insert(cache, key, disk_test_entry(512, 'a' + i % 26)) == 0);
+    }
+    assert(cache_insert(cache, "large", disk_test_entry(6000, 'L')) == 0);
+    assert(cache->disk->stats.stores > 0);
+
+    /* Demoted entries come back from disk into RAM */
+    cache_entry_t *found = cache_lookup(cache, "obj-0");
+    assert(found && (found->flags & CACHE_F_ON_DISK));
+    assert(found->data.len == 512 && found->data.ptr[511] == 'a');
+    cache_entry_put(found);
+
+    cache_disk_obj_t obj;
+    assert(cache_serves(cache, "large", NULL));
+    assert(cache_lookup_disk(cache, "large", &obj) == 0);
+    assert(obj.len == 6000 && obj.body[0] == 'L');
+
+    int pipes[2];
+    assert(pipe(pipes) == 0);
+    uint64_t sent = 0;
+    assert(cache_disk_sendfile(cache->disk, &obj, pipes[1], &sent) == 1);
+    char buf[6000];
+    assert(read(pipes[0], buf, sizeof(buf)) == 6000 && buf[5999] == 'L');
+    close(pipes[0]);
+    close(pipes[1]);
+
+    cache_delete(cache, "obj-1");
+    cache_destroy(cache);
+
+    /* A restart rebuilds the index from the slab file */
+    cache = cache_create("disk", 1024 * CACHE_SHARDS, 1024);
+    assert(cache_attach_disk(cache, path, 4 << 20, 8192) == 0);
+    assert(cache_lookup_disk(cache, "large", &obj) == 0 && obj.len == 6000);
+    assert(cache_lookup_disk(cache, "obj-1", &obj) < 0);
+    found = cache_lookup(cache, "obj-150");
+    assert(found && found->data.ptr[0] == 'a' + 150 % 26);
+    cache_entry_put(found);
+    /* Still in RAM at shutdown, written out by cache_destroy */
+    found = cache_lookup(cache, "obj-199");
+    assert(found && found->data.ptr[0] == 'a' + 199 % 26);
+    cache_entry_put(found);
+
+    /* Going round the ring forgets exactly what was overwritten */
+    for (int i = 0; i < 2000; i++) {
+        snprintf(key, sizeof(key), "big-%d", i);
+        assert(cache_insert(cache, key, disk_test_entry(4000, 'b')) == 0);
+    }
+    assert(cache->disk->head > cache->disk->size);
+    assert(cache_lookup_disk(cache, "large", &obj) < 0);
+    assert(cache_lookup_disk(cache, "big-1999", &obj) == 0 && obj.body[3999] == 'b');
+    assert(cache_lookup_disk(cache, "big-0", &obj) < 0);
+
+    cache_purge(cache);
+    cache_destroy(cache);
+
+    cache = cache_create("disk", 1024 * CACHE_SHARDS, 1024);
+    assert(cache_attach_disk(cache, path, 4 << 20, 8192) == 0);
+    assert(cache->disk->count == 0);
+    cache_destroy(cache);
+
+    unlink(path);
+    printf("Cache disk tier test passed\n");
+}
+
 void test_health_checks() {
     printf("Testing health checks...\n");
 
@@ -70,6 +626,62 @@ void test_health_checks() {
     printf("Health check test passed\n");
 }
 
+void test_check_probes() {
+    printf("Testing health check probes...\n");
+
+    char buf[256];
+    check_t *check = check_new(HCHK_TYPE_HTTP);
+    check->interval.rise = 1;
+    check->interval.fall = 2;
+    check->http.method = "HEAD";
+    int len = check_probe_request(check, buf, sizeof(buf));
+    assert(len > 0 && strncmp(buf, "HEAD / HTTP/1.1\r\n", 17) == 0);
+    assert(check_probe_request(check, buf, 8) == -1);
+
+    // The verdict waits for the whole status line
+    const char *ok = "HTTP/1.1 204 No Content\r\n";
+    assert(check_probe_response(check, ok, 10, false) == 0);
+    assert(check_probe_response(check, ok, strlen(ok), false) == 1);
+    assert(check_passed(check) && check->consecutive_success == 1);
+    assert(check_next_interval(check, true) == check->interval.inter);
+
+    const char *bad = "HTTP/1.1 503 Unavailable\r\n";
+    assert(check_probe_response(check, bad, strlen(bad), false) == 1);
+    assert(!check_passed(check) && check->status == HCHK_STATUS_L7STS);
+    assert(check->consecutive_errors == 1 && check->consecutive_success == 0);
+    assert(check_next_interval(check, true) == check->interval.fastinter);
+    assert(check_probe_response(check, NULL, 0, true) == 1);
+    assert(check_next_interval(check, false) == check->interval.downinter);
+    check_free(check);
+
+    check = check_new(HCHK_TYPE_REDIS);
+    assert(check_probe_request(check, buf, sizeof(buf)) == 14);
+    assert(check_probe_response(check, "+PO", 3, false) == 0);
+    assert(check_probe_response(check, "+PONG\r\n", 7, false) == 1 && check_passed(check));
+    assert(check_probe_response(check, "-ERR", 4, false) == 1 && !check_passed(check));
+    check_free(check);
+
+    check = check_new(HCHK_TYPE_MYSQL);
+    const char handshake[] = { 0x4a, 0x00, 0x00, 0x00, 0x0a, '8', '.', '0' };
+    assert(check_probe_request(check, buf, sizeof(buf)) == 0);
+    assert(check_probe_response(check, handshake, 4, false) == 0);
+    assert(check_probe_response(check, handshake, sizeof(handshake), false) == 1);
+    assert(check_passed(check));
+    check_free(check);
+
+    // Plain TCP passes once connected, expectations wait for their bytes
+    check = check_new(HCHK_TYPE_TCP);
+    assert(check_probe_response(check, NULL, 0, false) == 1 && check->status == HCHK_STATUS_L4OK);
+    check->tcp.expect_string = "ready";
+    assert(check_probe_response(check, "not ", 4, false) == 0);
+    assert(check_probe_response(check, "not ready", 9, false) == 1 && check_passed(check));
+    assert(check_probe_response(check, "busy", 4, true) == 1 && !check_passed(check));
+    check->tcp.expect_string = NULL;
+    check_free(check);
+
+    printf("Health check probe test passed\n");
+}
+
 void test_compression() {
     printf("Testing compression...\n");
 
@@ -90,13 +702,2240 @@ void test_compression() {
     printf("Compression test passed\n");
 }
 
+void test_slab_cache() {
+    printf("Testing slab cache...\n");
+
+    slab_cache_t *slab = slab_cache_create(100, 4);
+    assert(slab != NULL);
+    assert(slab->obj_size % CACHE_LINE_SIZE == 0);
+
+    void *objs[6];
+    for (int i = 0; i < 6; i++) {
+        objs[i] = slab_alloc(slab);
+        assert(objs[i] != NULL);
+        assert(((uintptr_t)objs[i] % CACHE_LINE_SIZE) == 0);
+    }
+    assert(slab->chunk_count == 2);
+
+    // Local frees are reused LIFO, remote frees once the local list is empty
+    slab_free(slab, objs[0]);
+    slab_free_remote(slab, objs[1]);
+    assert(slab_alloc(slab) == objs[0]);
+    assert(slab_alloc(slab) != objs[1]);  // chunk 2 still has spare objects
+    assert(slab_alloc(slab) != objs[1]);
+    assert(slab_alloc(slab) == objs[1]);
+    assert(slab->chunk_count == 2);
+
+    slab_cache_destroy(slab);
+    printf("Slab cache test passed\n");
+}
+
+void test_consistent_hash() {
+    printf("Testing consistent hashing...\n");
+
+    consistent_hash_t *ch = consistent_hash_create(1000);
+    assert(ch != NULL && ch->size == 1009);
+    assert(consistent_hash_get(ch, "empty") == NULL);
+
+    static backend_t backends[5];
+    for (int i = 0; i < 5; i++) {
+        snprintf(backends[i].host, sizeof(backends[i].host), "10.0.0.%d", i + 1);
+        backends[i].port = 8080;
+        atomic_store(&backends[i].state, BACKEND_UP);
+        atomic_store(&backends[i].weight, 1);
+        assert(consistent_hash_add(ch, &backends[i]) == 0);
+    }
+
+    // Equal weights own an equal share of the slots, give or take one
+    hash_table_t *table = atomic_load(&ch->lookup);
+    int owned[5] = {0};
+    for (uint32_t i = 0; i < table->size; i++) {
+        owned[table->slot[i] - backends]++;
+    }
+    for (int i = 0; i < 5; i++) {
+        assert(owned[i] >= 201 && owned[i] <= 202);
+    }
+
+    enum { KEYS = 4000 };
+    backend_t *before[KEYS];
+    char key[32];
+    for (int i = 0; i < KEYS; i++) {
+        snprintf(key, sizeof(key), "client-%d", i);
+        before[i] = consistent_hash_get(ch, key);
+        assert(before[i] != NULL);
+    }
+
+    // A backend going down moves its own keys and very few others
+    atomic_store(&backends[2].state, BACKEND_DOWN);
+    for (int i = 0; i < KEYS; i++) {
+        snprintf(key, sizeof(key), "client-%d", i);
+        assert(consistent_hash_get(ch, key) != &backends[2]);
+    }
+    assert(consistent_hash_rebuild(ch) == 0);
+    int moved = 0;
+    for (int i = 0; i < KEYS; i++) {
+        snprintf(key, sizeof(key), "client-%d", i);
+        backend_t *b = consistent_hash_get(ch, key);
+        assert(b != &backends[2]);
+        if (before[i] != &backends[2] && b != before[i]) moved++;
+    }
+    assert(moved < KEYS / 20);
+
+    // Coming back restores the original mapping exactly
+    atomic_store(&backends[2].state, BACKEND_UP);
+    assert(consistent_hash_rebuild(ch) == 0);
+    for (int i = 0; i < KEYS; i++) {
+        snprintf(key, sizeof(key), "client-%d", i);
+        assert(consistent_hash_get(ch, key) == before[i]);
+    }
+
+    // Weight scales the share
+    atomic_store(&backends[0].weight, 3);
+    assert(consistent_hash_rebuild(ch) == 0);
+    table = atomic_load(&ch->lookup);
+    memset(owned, 0, sizeof(owned));
+    for (uint32_t i = 0; i < table->size; i++) {
+        owned[table->slot[i] - backends]++;
+    }
+    assert(owned[0] > 2 * owned[1] && owned[0] < 4 * owned[1]);
+
+    // Bounded loads: the owner keeps its keys until it holds 125% of the
+    // average, then they spill to the following slots' owners
+    atomic_store(&backends[0].weight, 1);
+    assert(consistent_hash_rebuild(ch) == 0);
+    uint64_t h = murmur3_64("hot", 3, 0);
+    backend_t *owner = consistent_hash_get_hash(ch, h);
+    atomic_store(&owner->active_conns, 5);
+    assert(consistent_hash_get_bounded(ch, h, 25, 125) == owner);
+    atomic_store(&owner->active_conns, 7);
+    backend_t *spill = consistent_hash_get_bounded(ch, h, 25, 125);
+    assert(spill != NULL && spill != owner);
+    assert(consistent_hash_get_bounded(ch, h, 25, 0) == owner);
+    atomic_store(&owner->active_conns, 0);
+
+    assert(consistent_hash_remove(ch, &backends[0]) == 0);
+    assert(consistent_hash_remove(ch, &backends[0]) == -1);
+    consistent_hash_destroy(ch);
+    printf("Consistent hashing test passed\n");
+}
+
+void test_p2c_ewma() {
+    printf("Testing P2C-EWMA selection...\n");
+
+    static backend_t backends[4];
+    static loadbalancer_t lb;
+    lb.algorithm = LB_ALGO_P2C;
+    lb.backend_count = 4;
+    for (int i = 0; i < 4; i++) {
+        lb.backends[i] = &backends[i];
+        atomic_store(&backends[i].weight, 1);
+        atomic_store(&backends[i].state, BACKEND_UP);
+    }
+    lb_backends_changed(&lb);
+
+    // A slow sample is taken at once, faster ones only pull the average down
+    lb_backend_observe(&backends[0], 50000000);
+    assert(atomic_load(&backends[0].ewma_ns) == 50000000);
+    lb_backend_observe(&backends[0], 1000);
+    assert(atomic_load(&backends[0].ewma_ns) > 1000);
+    for (int i = 1; i < 4; i++) lb_backend_observe(&backends[i], 200000);
+
+    // The slow backend loses every draw
+    int picked[4] = {0};
+    for (int i = 0; i < 10000; i++) {
+        backend_t *b = lb_select_backend(&lb, NULL);
+        assert(b != NULL);
+        picked[b - backends]++;
+    }
+    assert(picked[0] == 0);
+    assert(picked[1] > 2000 && picked[2] > 2000 && picked[3] > 2000);
+
+    // In-flight requests count against a backend
+    atomic_store(&backends[1].active_conns, 1000);
+    memset(picked, 0, sizeof(picked));
+    for (int i = 0; i < 10000; i++) picked[lb_select_backend(&lb, NULL) - backends]++;
+    assert(picked[1] < picked[2] / 10);
+
+    // Down backends are never picked, one left means it is the choice
+    atomic_store(&backends[1].state, BACKEND_DOWN);
+    atomic_store(&backends[2].state, BACKEND_DOWN);
+    atomic_store(&backends[3].state, BACKEND_DOWN);
+    lb_backends_changed(&lb);
+    for (int i = 0; i < 100; i++) assert(lb_select_backend(&lb, NULL) == &backends[0]);
+    atomic_store(&backends[0].state, BACKEND_DOWN);
+    lb_backends_changed(&lb);
+    assert(lb_select_backend(&lb, NULL) == NULL);
+
+    lb_snapshot_free(&lb);
+    printf("P2C-EWMA selection test passed\n");
+}
+
+void test_outlier_ejection() {
+    printf("Testing outlier ejection...\n");
+
+    static backend_t backends[4];
+    static loadbalancer_t lb;
+    lb.algorithm = LB_ALGO_ROUNDROBIN;
+    lb.backend_count = 4;
+    lb.config.outlier_consecutive_failures = 3;
+    lb.config.outlier_base_eject_ms = 1000;
+    lb.config.outlier_max_eject_percent = 50;
+    for (int i = 0; i < 4; i++) {
+        lb.backends[i] = &backends[i];
+        atomic_store(&backends[i].weight, 1);
+        atomic_store(&backends[i].state, BACKEND_UP);
+    }
+    lb_backends_changed(&lb);
+
+    // A success breaks the streak, three failures in a row eject
+    lb_backend_report(&lb, &backends[0], LB_OUTCOME_5XX);
+    lb_backend_report(&lb, &backends[0], LB_OUTCOME_5XX);
+    lb_backend_report(&lb, &backends[0], LB_OUTCOME_OK);
+    lb_backend_report(&lb, &backends[0], LB_OUTCOME_CONNECT_FAIL);
+    lb_backend_report(&lb, &backends[0], LB_OUTCOME_RESET);
+    assert(!atomic_load(&backends[0].ejected));
+    lb_backend_report(&lb, &backends[0], LB_OUTCOME_CONNECT_FAIL);
+    assert(atomic_load(&backends[0].ejected));
+    for (int i = 0; i < 100; i++) assert(lb_select_backend(&lb, NULL) != &backends[0]);
+
+    // Half the fleet at most
+    for (int i = 0; i < 3; i++) {
+        lb_backend_report(&lb, &backends[1], LB_OUTCOME_RESET);
+        lb_backend_report(&lb, &backends[2], LB_OUTCOME_RESET);
+    }
+    assert(atomic_load(&backends[1].ejected) && !atomic_load(&backends[2].ejected));
+    assert(atomic_load(&lb.ejected_count) == 2);
+
+    // Back in once the ejection ran out, and the next one lasts twice as long
+    uint64_t now = get_time_ns();
+    atomic_store(&backends[0].ejected_until_ns, now - 1);
+    lb_outlier_sweep(&lb);
+    assert(!atomic_load(&backends[0].ejected) && atomic_load(&lb.ejected_count) == 1);
+    for (int i = 0; i < 3; i++) lb_backend_report(&lb, &backends[0], LB_OUTCOME_5XX);
+    uint64_t until = atomic_load(&backends[0].ejected_until_ns);
+    assert(until >= now + 2000000000ULL && until < now + 3000000000ULL);
+
+    // Latency: an average far above the median ejects on the sweep
+    atomic_store(&backends[0].ejected_until_ns, 0);
+    atomic_store(&backends[1].ejected_until_ns, 0);
+    lb_outlier_sweep(&lb);
+    assert(atomic_load(&lb.ejected_count) == 0);
+    for (int i = 0; i < 4; i++) lb_backend_observe(&backends[i], i == 3 ? 200000000 : 5000000);
+    lb_outlier_sweep(&lb);
+    assert(atomic_load(&backends[3].ejected));
+    assert(!atomic_load(&backends[0].ejected) && !atomic_load(&backends[2].ejected));
+
+    lb_snapshot_free(&lb);
+    printf("Outlier ejection test passed\n");
+}
+
+void test_slow_start() {
+    printf("Testing slow start...\n");
+
+    static backend_t backends[2];
+    static loadbalancer_t lb;
+    lb.algorithm = LB_ALGO_ROUNDROBIN;
+    lb.backend_count = 2;
+    lb.config.slow_start_ms = 10000;
+    for (int i = 0; i < 2; i++) {
+        lb.backends[i] = &backends[i];
+        atomic_store(&backends[i].weight, 100);
+        atomic_store(&backends[i].state, BACKEND_UP);
+    }
+    lb_backend_slow_start(&lb, &backends[1]);
+    lb_backends_changed(&lb);
+
+    // Just back: a sixteenth of its share, whatever the algorithm
+    int picked[2] = {0};
+    for (int i = 0; i < 10000; i++) picked[lb_select_backend(&lb, NULL) - backends]++;
+    assert(picked[1] > 100 && picked[1] < 1000);
+
+    lb.algorithm = LB_ALGO_STICKY;
+    memset(picked, 0, sizeof(picked));
+    for (int i = 0; i < 10000; i++) picked[lb_select_backend(&lb, NULL) - backends]++;
+    assert(picked[1] > 200 && picked[1] < 1000);
+
+    // No burst towards the idle newcomer
+    lb.algorithm = LB_ALGO_LEASTCONN;
+    atomic_store(&backends[0].active_conns, 5);
+    assert(lb_select_backend(&lb, NULL) == &backends[0]);
+    atomic_store(&backends[0].active_conns, 20);
+    assert(lb_select_backend(&lb, NULL) == &backends[1]);
+
+    // Halfway through a geometric ramp: a quarter of the weight
+    lb.config.slow_start_exponential = true;
+    atomic_store(&backends[1].up_since_ns, get_time_ns() - 5000000000ULL);
+    lb_slow_start_sweep(&lb);
+    uint32_t r = atomic_load(&backends[1].ramp);
+    assert(r > 240 && r < 270);
+
+    // Ramp over: full weight and the snapshot no longer scales anything
+    atomic_store(&backends[1].up_since_ns, get_time_ns() - 10000000000ULL);
+    lb_slow_start_sweep(&lb);
+    assert(atomic_load(&backends[1].up_since_ns) == 0);
+    assert(atomic_load(&backends[1].ramp) == LB_RAMP_FULL);
+    assert(atomic_load(&lb.snapshot)->ramping == 0);
+
+    lb_snapshot_free(&lb);
+    printf("Slow start test passed\n");
+}
+
+void test_backend_drain() {
+    printf("Testing backend drain...\n");
+
+    static backend_t backends[2];
+    static loadbalancer_t lb;
+    lb.algorithm = LB_ALGO_LEASTCONN;
+    lb.backend_count = 2;
+    for (int i = 0; i < 2; i++) {
+        lb.backends[i] = &backends[i];
+        snprintf(backends[i].host, sizeof(backends[i].host), "10.0.0.%d", i + 1);
+        backends[i].port = 80;
+        backends[i].id = i;
+        atomic_store(&backends[i].weight, 1);
+        atomic_store(&backends[i].state, BACKEND_UP);
+    }
+    lb_backends_changed(&lb);
+
+    // No new selections, even for the idlest backend
+    atomic_store(&backends[0].active_conns, 2);
+    atomic_store(&backends[1].active_conns, 5);
+    assert(lb_remove_backend(&lb, "10.0.0.1", 80) == 0);
+    assert(atomic_load(&backends[0].state) == BACKEND_DRAIN);
+    for (int i = 0; i < 10; i++) assert(lb_select_backend(&lb, NULL) == &backends[1]);
+
+    // Drained only once the in-flight connections are gone
+    lb_drain_sweep(&lb);
+    assert(!atomic_load(&backends[0].drained));
+    atomic_store(&backends[0].active_conns, 0);
+    lb_drain_sweep(&lb);
+    assert(atomic_load(&backends[0].drained));
+
+    // Only the last reason to let go of the drain puts it back
+    assert(lb_backend_drain(&lb, &backends[0], LB_DRAIN_FILE) == 0);
+    assert(lb_backend_undrain(&lb, &backends[0], LB_DRAIN_FILE) == -1);
+    assert(atomic_load(&backends[0].state) == BACKEND_DRAIN);
+    assert(lb_backend_undrain(&lb, &backends[0], LB_DRAIN_REMOVED) == 0);
+    assert(lb_select_backend(&lb, NULL) == &backends[0]);
+    assert(lb_backend_undrain(&lb, &backends[0], LB_DRAIN_REMOVED) == -1);
+
+    // The drain file brings back what it drained, and nothing else
+    char path[] = "/tmp/ub-drain-XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0 && write(fd, "10.0.0.2:80\n", 12) == 12);
+    close(fd);
+    lb.config.drain_file = path;
+    lb_drain_sweep(&lb);
+    assert(atomic_load(&backends[1].state) == BACKEND_DRAIN);
+    assert(lb_remove_backend(&lb, "10.0.0.1", 80) == 0);
+    unlink(path);
+    lb_drain_sweep(&lb);
+    assert(atomic_load(&backends[1].state) == BACKEND_UP);
+    assert(atomic_load(&backends[0].state) == BACKEND_DRAIN);
+    lb.config.drain_file = NULL;
+
+    atomic_store(&backends[1].state, BACKEND_MAINT);
+    assert(lb_backend_drain(&lb, &backends[1], LB_DRAIN_REMOVED) == -1);
+    assert(atomic_load(&backends[1].drain_reasons) == 0);
+    assert(lb_remove_backend(&lb, "10.0.0.9", 80) == -1);
+
+    lb_snapshot_free(&lb);
+    printf("Backend drain test passed\n");
+}
+
+void test_backend_admission() {
+    printf("Testing backend admission...\n");
+
+    static backend_t backends[2];
+    static loadbalancer_t lb;
+    lb.algorithm = LB_ALGO_ROUNDROBIN;
+    lb.backend_count = 2;
+    for (int i = 0; i < 2; i++) {
+        lb.backends[i] = &backends[i];
+        backends[i].id = i;
+        atomic_store(&backends[i].weight, 1);
+        atomic_store(&backends[i].state, BACKEND_UP);
+    }
+    lb_backends_changed(&lb);
+
+    // Two slots on the first, one of its own on the second
+    lb.config.server_maxconn = 2;
+    atomic_store(&backends[1].max_conns, 1);
+    bool full;
+    for (int i = 0; i < 3; i++) {
+        assert(lb_backend_admit(&lb, NULL, &full) != NULL && !full);
+    }
+    assert(atomic_load(&backends[0].active_conns) == 2);
+    assert(atomic_load(&backends[1].active_conns) == 1);
+    assert(lb_backend_admit(&lb, NULL, &full) == NULL && full);
+
+    // A freed slot goes to whoever asks next, wherever the pick landed
+    lb_backend_release(&lb, &backends[1]);
+    assert(lb_backend_admit(&lb, NULL, &full) == &backends[1]);
+    assert(atomic_load(&lb.active_conns) == 3);
+
+    // The pool's limit holds even with room on the backends
+    lb_backend_release(&lb, &backends[0]);
+    lb_backend_release(&lb, &backends[0]);
+    lb_backend_release(&lb, &backends[1]);
+    lb.config.group_maxconn = 1;
+    assert(lb_backend_admit(&lb, NULL, &full) != NULL);
+    assert(lb_backend_admit(&lb, NULL, &full) == NULL && full);
+    assert(atomic_load(&lb.active_conns) == 1);
+
+    lb_snapshot_free(&lb);
+    printf("Backend admission test passed\n");
+}
+
+static int reload_from(loadbalancer_t* lb, const char* text) {
+    char path[] = "/tmp/ub-reload-XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0 && write(fd, text, strlen(text)) == (ssize_t)strlen(text));
+    close(fd);
+    int ret = lb_reload_backends(lb, path);
+    unlink(path);
+    return ret;
+}
+
+void test_backend_reload() {
+    printf("Testing backend reload...\n");
+
+    static loadbalancer_t lb;
+    lb.algorithm = LB_ALGO_ROUNDROBIN;
+    lb.running = true;
+
+    // One bad line and nothing in the file is applied
+    const char* bad[] = {
+        "127.0.0.1:8001\nhost\n",
+        "127.0.0.1:8001\nh:0\n",
+        "127.0.0.1:8001\nh:\n",
+        "127.0.0.1:8001\nh:70000\n",
+        "127.0.0.1:8001\nh:80x\n",
+        "127.0.0.1:8001\nh:80@0\n",
+        "127.0.0.1:8001\nh:80@2x\n",
+        "127.0.0.1:8001\nh:80/0\n",
+        "127.0.0.1:8001\nh:80/5x\n",
+        "127.0.0.1:8001\n[::1]80\n",
+        "127.0.0.1:8001\n[::1:80\n",
+        "127.0.0.1:8001\n:80\n",
+    };
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        assert(reload_from(&lb, bad[i]) == -1);
+        assert(lb.backend_count == 0);
+    }
+    assert(lb_reload_backends(&lb, "/tmp/ub-reload-missing") == -1);
+
+    // Comments, blank lines and IPv6 brackets; weight and limit optional
+    assert(reload_from(&lb, "# pool\n127.0.0.1:8001@3\n\n  127.0.0.2:8002/5  # small\n"
+                            "[::1]:8003@2/7\n") == 0);
+    assert(lb.backend_count == 3);
+    backend_t* a = lb_find_backend(&lb, "127.0.0.1", 8001);
+    backend_t* b = lb_find_backend(&lb, "127.0.0.2", 8002);
+    backend_t* c = lb_find_backend(&lb, "::1", 8003);
+    assert(a && b && c);
+    assert(atomic_load(&a->weight) == 3 && atomic_load(&a->max_conns) == 0);
+    assert(atomic_load(&b->weight) == 1 && atomic_load(&b->max_conns) == 5);
+    assert(atomic_load(&c->weight) == 2 && atomic_load(&c->max_conns) == 7);
+    assert(atomic_load(&b->state) == BACKEND_UP);
+    assert(atomic_load(&lb.snapshot)->count == 3);
+
+    // Left out drains, reweighted in place, nothing freed or renumbered
+    assert(reload_from(&lb, "127.0.0.1:8001@7\n[::1]:8003@2/7\n") == 0);
+    assert(lb.backend_count == 3);
+    assert(atomic_load(&a->weight) == 7);
+    assert(atomic_load(&b->state) == BACKEND_DRAIN);
+    assert(atomic_load(&b->drain_reasons) == LB_DRAIN_RELOAD);
+    assert(atomic_load(&lb.snapshot)->count == 2);
+    for (int i = 0; i < 10; i++) assert(lb_select_backend(&lb, NULL) != b);
+
+    // Listed again, it comes back as the same backend with its new limit
+    assert(reload_from(&lb, "127.0.0.1:8001@7\n127.0.0.2:8002/9\n[::1]:8003@2/7\n") == 0);
+    assert(lb.backend_count == 3);
+    assert(lb_find_backend(&lb, "127.0.0.2", 8002) == b);
+    assert(atomic_load(&b->state) == BACKEND_UP);
+    assert(atomic_load(&b->drain_reasons) == 0);
+    assert(atomic_load(&b->max_conns) == 9);
+    assert(atomic_load(&lb.snapshot)->count == 3);
+
+    // Drained by hand too, a reload alone does not bring it back
+    assert(reload_from(&lb, "127.0.0.1:8001@7\n") == 0);
+    assert(lb_backend_drain(&lb, c, LB_DRAIN_REMOVED) == 0);
+    assert(reload_from(&lb, "127.0.0.1:8001@7\n127.0.0.2:8002\n[::1]:8003\n") == 0);
+    assert(atomic_load(&b->state) == BACKEND_UP);
+    assert(atomic_load(&c->state) == BACKEND_DRAIN);
+    assert(atomic_load(&c->drain_reasons) == LB_DRAIN_REMOVED);
+
+    lb_snapshot_free(&lb);
+    for (uint32_t i = 0; i < lb.backend_count; i++) free(lb.backends[i]);
+    printf("Backend reload test passed\n");
+}
+
+static uint16_t handover_port(int fd) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    assert(getsockname(fd, (struct sockaddr*)&addr, &len) == 0);
+    return ntohs(addr.sin_port);
+}
+
+void test_listener_handover() {
+    printf("Testing listener handover...\n");
+
+    // What main_lb_setup_workers gives two reuseport workers: the first
+    // accepts on lb->listen_fd, the second on one of its own
+    static loadbalancer_t lb;
+    static lb_worker_t workers[2];
+    lb.listen_fd = create_listen_socket(0, true);
+    assert(lb.listen_fd >= 0);
+    uint16_t port = handover_port(lb.listen_fd);
+    workers[0].listen_fd = lb.listen_fd;
+    workers[0].epfd = -1;
+    workers[1].listen_fd = create_listen_socket(port, true);
+    workers[1].epfd = -1;
+    workers[1].owns_fds = true;
+    assert(workers[1].listen_fd >= 0);
+    lb.worker_ctx = workers;
+    lb.worker_threads = 2;
+    lb.epfd = -1;
+    lb.running = true;
+    atomic_store(&lb.accepting, true);
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/ub-handover-%d", getpid());
+    int fds[LB_HANDOVER_MAX_FDS];
+    int conn = -1;
+    unlink(path);
+    assert(lb_handover_take(path, fds, LB_HANDOVER_MAX_FDS, &conn) == 0);
+    assert(lb_handover_serve(&lb, path) == 0);
+
+    // Both sockets arrive, each still the listener it was
+    assert(lb_handover_take(path, fds, LB_HANDOVER_MAX_FDS, &conn) == 2);
+    assert(conn >= 0);
+    for (int i = 0; i < 2; i++) {
+        assert(fds[i] != lb.listen_fd && fds[i] != workers[1].listen_fd);
+        assert(handover_port(fds[i]) == port);
+        assert(lb_handover_match(fds[i], port, true));
+        assert(!lb_handover_match(fds[i], port, false));
+        assert(!lb_handover_match(fds[i], port + 1, true));
+    }
+    int pair[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+    assert(!lb_handover_match(pair[0], port, true));
+    close(pair[0]);
+    close(pair[1]);
+    int unbound = socket(AF_INET, SOCK_STREAM, 0);
+    assert(!lb_handover_match(unbound, 0, false));
+    close(unbound);
+
+    // A connection made to the port is there for the new process
+    int client = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port),
+                                .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    assert(connect(client, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    assert(write(client, "x", 1) == 1);
+    close(lb.listen_fd);
+    close(workers[1].listen_fd);
+    struct pollfd pfd[2] = { { .fd = fds[0], .events = POLLIN }, { .fd = fds[1], .events = POLLIN } };
+    assert(poll(pfd, 2, 2000) == 1);
+    int taken = accept(pfd[0].revents ? fds[0] : fds[1], NULL, NULL);
+    assert(taken >= 0);
+    close(taken);
+    close(client);
+
+    // Only the ack makes the old process stop accepting
+    assert(atomic_load(&lb.accepting));
+    assert(lb_handover_ack(conn) == 0);
+    for (int i = 0; i < 200 && atomic_load(&lb.accepting); i++) usleep(10000);
+    assert(!atomic_load(&lb.accepting));
+
+    lb.running = false;
+    close(fds[0]);
+    close(fds[1]);
+    unlink(path);
+    printf("Listener handover test passed\n");
+}
+
+void test_smooth_wrr() {
+    printf("Testing smooth weighted round robin...\n");
+
+    static backend_t backends[3];
+    static loadbalancer_t lb;
+    lb.algorithm = LB_ALGO_STATIC_RR;
+    lb.backend_count = 3;
+    uint32_t weights[3] = {10, 2, 2};
+    for (int i = 0; i < 3; i++) {
+        lb.backends[i] = &backends[i];
+        atomic_store(&backends[i].weight, weights[i]);
+        atomic_store(&backends[i].state, BACKEND_UP);
+    }
+    lb_backends_changed(&lb);
+
+    // Reduced to 5:1:1 and interleaved the way nginx does it
+    lb_snapshot_t *snap = atomic_load(&lb.snapshot);
+    assert(snap != NULL && snap->count == 3 && snap->wrr_len == 7);
+    const int order[7] = {0, 0, 1, 0, 2, 0, 0};
+    for (int i = 0; i < 7; i++) assert(snap->wrr[i] == &backends[order[i]]);
+
+    int picked[3] = {0};
+    for (int i = 0; i < 7000; i++) picked[lb_select_backend(&lb, NULL) - backends]++;
+    assert(picked[0] == 5000 && picked[1] == 1000 && picked[2] == 1000);
+
+    // A backend that goes down leaves the next snapshot
+    atomic_store(&backends[0].state, BACKEND_DOWN);
+    lb_backends_changed(&lb);
+    assert(atomic_load(&lb.snapshot)->wrr_len == 2);
+    for (int i = 0; i < 10; i++) assert(lb_select_backend(&lb, NULL) != &backends[0]);
+
+    // Weighted random and least-conn read the same snapshot
+    lb.algorithm = LB_ALGO_STICKY;
+    memset(picked, 0, sizeof(picked));
+    for (int i = 0; i < 10000; i++) picked[lb_select_backend(&lb, NULL) - backends]++;
+    assert(picked[0] == 0 && picked[1] > 4000 && picked[2] > 4000);
+    lb.algorithm = LB_ALGO_LEASTCONN;
+    atomic_store(&backends[1].active_conns, 3);
+    assert(lb_select_backend(&lb, NULL) == &backends[2]);
+
+    atomic_store(&backends[1].state, BACKEND_DOWN);
+    atomic_store(&backends[2].state, BACKEND_DOWN);
+    lb_backends_changed(&lb);
+    assert(lb_select_backend(&lb, NULL) == NULL);
+
+    // Replaced snapshots outlive their grace only until the next reclaim,
+    // changes or not
+    assert(lb.snapshot_retired && lb.snapshot_retired->retired_next);
+    lb_snapshot_reclaim(&lb);
+    assert(lb.snapshot_retired && lb.snapshot_retired->retired_next);
+    sleep(LB_SNAPSHOT_GRACE + 1);
+    lb_snapshot_reclaim(&lb);
+    assert(lb.snapshot_retired == NULL);
+
+    lb_snapshot_free(&lb);
+    printf("Smooth weighted round robin test passed\n");
+}
+
+void test_memory_pool_buffers() {
+    printf("Testing pooled buffers...\n");
+
+    size_t size = 4 * 16384;
+    char *arena = malloc(size + sizeof(memory_pool_t));
+    memory_pool_t *pool = (memory_pool_t *)arena;
+    memory_pool_init(pool, arena + sizeof(memory_pool_t), size);
+
+    void *a = memory_pool_alloc(pool, 16384);
+    void *b = memory_pool_alloc(pool, 16384);
+    assert(a && b && a != b);
+    assert(memory_pool_owns(pool, a) && memory_pool_owns(pool, b));
+    assert(!memory_pool_owns(pool, arena));
+
+    memory_pool_free(pool, a, 16384);
+    assert(memory_pool_alloc(pool, 16384) == a);
+
+    memory_pool_destroy(pool);
+    free(arena);
+    printf("Pooled buffers test passed\n");
+}
+
+void test_memory_pool_classes() {
+    printf("Testing size-class pool...\n");
+
+    memory_pool_t *pool = memory_pool_create(16 * 1024 * 1024);
+    assert(pool);
+
+    // Sizes in one class share blocks
+    void *p = memory_pool_alloc(pool, 24);
+    memory_pool_free(pool, p, 24);
+    assert(memory_pool_alloc(pool, 30) == p);
+
+    void *lines = memory_pool_alloc(pool, 192);
+    void *large = memory_pool_alloc(pool, 100000);
+    assert(((uintptr_t)lines % CACHE_LINE_SIZE) == 0);
+    assert(((uintptr_t)large % CACHE_LINE_SIZE) == 0);
+    memory_pool_free(pool, large, 100000);
+    assert(memory_pool_alloc(pool, 200000) != large);
+    assert(memory_pool_alloc(pool, 100000) == large);
+
+    // Past a magazine's worth, blocks go through the depot and come back
+    void *objs[300];
+    for (int i = 0; i < 300; i++) {
+        objs[i] = memory_pool_alloc(pool, 64);
+        assert(objs[i] && memory_pool_owns(pool, objs[i]));
+        memset(objs[i], i, 64);
+    }
+    for (int i = 0; i < 300; i++) memory_pool_free(pool, objs[i], 64);
+    size_t used = pool->used;
+    for (int i = 0; i < 300; i++) objs[i] = memory_pool_alloc(pool, 64);
+    assert(pool->used == used);
+    for (int i = 1; i < 300; i++) assert(objs[i] != objs[i - 1]);
+
+    memory_pool_destroy(pool);
+    printf("Size-class pool test passed\n");
+}
+
+static void *memory_pool_thread(void *arg) {
+    memory_pool_t *pool = arg;
+    void *objs[32];
+    for (int i = 0; i < 32; i++) objs[i] = memory_pool_alloc(pool, 4096);
+    for (int i = 0; i < 32; i++) memory_pool_free(pool, objs[i], 4096);
+    return NULL;
+}
+
+void test_memory_pool_thread_exit() {
+    printf("Testing pool magazines at thread exit...\n");
+
+    memory_pool_t *pool = memory_pool_create(16 * 1024 * 1024);
+    assert(pool);
+
+    // The exited thread's magazine is back in the depot, its slot freed
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, memory_pool_thread, pool) == 0);
+    pthread_join(thread, NULL);
+    for (uint32_t i = 0; i < MEMORY_POOL_THREADS; i++) assert(!pool->tcache[i]);
+
+    size_t used = pool->used;
+    void *objs[32];
+    for (int i = 0; i < 32; i++) objs[i] = memory_pool_alloc(pool, 4096);
+    assert(pool->used == used);
+    for (int i = 0; i < 32; i++) memory_pool_free(pool, objs[i], 4096);
+
+    memory_pool_destroy(pool);
+    printf("Pool magazines at thread exit test passed\n");
+}
+
+void test_log_ratelimit() {
+    printf("Testing log rate limiting...\n");
+
+    log_ratelimit_t rl = {0};
+    assert(log_ratelimit_check(&rl, 3, 60000) == 0);
+    assert(log_ratelimit_check(&rl, 3, 60000) == 0);
+    assert(log_ratelimit_check(&rl, 3, 60000) == 0);
+    assert(log_ratelimit_check(&rl, 3, 60000) == UINT32_MAX);
+    assert(log_ratelimit_check(&rl, 3, 60000) == UINT32_MAX);
+
+    // A new window reports what the previous one dropped
+    atomic_store(&rl.window_start_ms, 0);
+    assert(log_ratelimit_check(&rl, 3, 60000) == 2);
+    assert(log_ratelimit_check(&rl, 3, 60000) == 0);
+
+    printf("Log rate limiting test passed\n");
+}
+
+static void feed_all(lb_http1_t *h, const char *s) {
+    // One byte at a time to exercise every split point
+    for (size_t i = 0; s[i]; i++) {
+        lb_http1_feed(h, (const uint8_t *)s + i, 1);
+    }
+}
+
+void test_http1_framer() {
+    printf("Testing HTTP/1 framer...\n");
+
+    lb_http1_t req;
+    lb_http1_init(&req, false);
+    feed_all(&req, "GET / HTTP/1.1\r\nHost: a\r\n\r\n");
+    assert(req.messages == 1 && lb_http1_idle(&req));
+    feed_all(&req, "POST /x HTTP/1.1\r\nContent-Length: 5\r\n\r\nab");
+    assert(req.messages == 1 && !lb_http1_idle(&req));
+    feed_all(&req, "cde");
+    assert(req.messages == 2 && lb_http1_idle(&req));
+
+    lb_http1_t rsp;
+    lb_http1_init(&rsp, true);
+    feed_all(&rsp, "HTTP/1.1 100 Continue\r\n\r\n");
+    assert(rsp.messages == 0);
+    feed_all(&rsp, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+                   "5;ext=1\r\nhello\r\n0\r\nX-Trailer: 1\r\n\r\n");
+    assert(rsp.messages == 1 && lb_http1_idle(&rsp) && rsp.keepalive);
+    feed_all(&rsp, "HTTP/1.1 204 No Content\r\nConnection: close\r\n\r\n");
+    assert(rsp.messages == 2 && !rsp.keepalive);
+
+    // Responses delimited by close cannot be pooled
+    lb_http1_init(&rsp, true);
+    feed_all(&rsp, "HTTP/1.0 200 OK\r\n\r\nbody");
+    assert(rsp.noreuse && !lb_http1_idle(&rsp));
+
+    lb_http1_init(&req, false);
+    feed_all(&req, "HEAD / HTTP/1.1\r\n\r\n");
+    assert(req.noreuse);
+
+    // Pipelined requests are cut at the message boundary
+    const char *two = "GET /a HTTP/1.1\r\n\r\nGET /b HTTP/1.1\r\n\r\n";
+    lb_http1_init(&req, false);
+    assert(lb_http1_feed_message(&req, (const uint8_t *)two, strlen(two)) == 19);
+    assert(req.messages == 1);
+    assert(lb_http1_feed_message(&req, (const uint8_t *)two + 19, strlen(two) - 19) == 19);
+    assert(req.messages == 2 && lb_http1_idle(&req));
+
+    // Framing a peer could read differently is never pooled
+    static const char *const ambiguous[] = {
+        "POST / HTTP/1.1\r\nContent-Length: 5\r\nContent-Length: 6\r\n\r\n",
+        "POST / HTTP/1.1\r\nContent-Length: 5\r\nContent-Length: 5\r\n\r\n",
+        "POST / HTTP/1.1\r\nContent-Length: 5\r\nTransfer-Encoding: chunked\r\n\r\n",
+        "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\nContent-Length: 5\r\n\r\n",
+        "POST / HTTP/1.1\r\nTransfer-Encoding: xchunked\r\n\r\n",
+        "POST / HTTP/1.1\r\nTransfer-Encoding: chunked, gzip\r\n\r\n",
+        "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\nTransfer-Encoding: gzip\r\n\r\n",
+    };
+    for (size_t i = 0; i < sizeof(ambiguous) / sizeof(ambiguous[0]); i++) {
+        lb_http1_init(&req, false);
+        feed_all(&req, ambiguous[i]);
+        assert(req.noreuse && !lb_http1_idle(&req));
+    }
+
+    lb_http1_init(&rsp, true);
+    feed_all(&rsp, "HTTP/1.1 200 OK\r\nTransfer-Encoding: gzip\r\n\r\nbody");
+    assert(rsp.noreuse);
+
+    // chunked as the final coding frames as before, however it is spelled
+    lb_http1_init(&req, false);
+    feed_all(&req, "POST / HTTP/1.1\r\nTransfer-Encoding: gzip\r\nTransfer-Encoding:  CHUNKED\r\n\r\n"
+                   "3\r\nabc\r\n0\r\n\r\n");
+    assert(req.messages == 1 && lb_http1_idle(&req));
+
+    printf("HTTP/1 framer test passed\n");
+}
+
+static db_query_type_t classify(const char *sql, db_route_hint_t *hint) {
+    return db_protocol_classify_query_hint(sql, strlen(sql), hint);
+}
+
+void test_sql_classify() {
+    printf("Testing SQL classifier...\n");
+
+    db_route_hint_t hint;
+    assert(classify("SELECT 1", &hint) == DB_QUERY_READ && hint == DB_HINT_NONE);
+    assert(classify("  /* note */ -- line\n# mysql\nselect * from t", NULL) == DB_QUERY_READ);
+    assert(classify("INSERT INTO t VALUES (1)", NULL) == DB_QUERY_WRITE);
+    assert(classify("SELECT * FROM t FOR UPDATE", NULL) == DB_QUERY_WRITE);
+    assert(classify("SELECT 'DELETE', \"INTO\" FROM t", NULL) == DB_QUERY_READ);
+    assert(classify("EXPLAIN DELETE FROM t", NULL) == DB_QUERY_READ);
+    assert(classify("EXPLAIN ANALYZE DELETE FROM t", NULL) == DB_QUERY_WRITE);
+
+    // CTEs are reads unless one of them modifies data
+    assert(classify("WITH x AS (SELECT 1) SELECT * FROM x", NULL) == DB_QUERY_READ);
+    assert(classify("WITH x AS (DELETE FROM t RETURNING *) SELECT * FROM x", NULL) == DB_QUERY_WRITE);
+
+    // Routing hints in comments
+    assert(classify("/* ub:replica */ SELECT now()", &hint) == DB_QUERY_READ && hint == DB_HINT_REPLICA);
+    assert(classify("/*+ ub:primary */ SELECT 1", &hint) == DB_QUERY_READ && hint == DB_HINT_PRIMARY);
+
+    // Transaction control and session state
+    assert(classify("BEGIN", NULL) == DB_QUERY_TRANSACTION_BEGIN);
+    assert(classify("START TRANSACTION READ ONLY", NULL) == DB_QUERY_TRANSACTION_BEGIN);
+    assert(classify("START REPLICA", NULL) == DB_QUERY_UNKNOWN);
+    assert(classify("COMMIT", NULL) == DB_QUERY_TRANSACTION_END);
+    assert(classify("ROLLBACK", NULL) == DB_QUERY_TRANSACTION_END);
+    assert(classify("ROLLBACK TO SAVEPOINT a", NULL) == DB_QUERY_UNKNOWN);
+    assert(classify("SET search_path = app", NULL) == DB_QUERY_SESSION_VAR);
+    assert(classify("SET LOCAL statement_timeout = 0", NULL) == DB_QUERY_UNKNOWN);
+
+    // Several statements: the strongest verdict wins
+    assert(classify("SELECT 1; DELETE FROM t", NULL) == DB_QUERY_WRITE);
+    assert(classify("SELECT 1;;  SELECT 2;", NULL) == DB_QUERY_READ);
+    assert(classify("SELECT ';DELETE FROM t' -- ; DROP TABLE t\n", NULL) == DB_QUERY_READ);
+    assert(classify("SELECT 1; SET x = 1", NULL) == DB_QUERY_SESSION_VAR);
+    assert(classify("COMMIT; BEGIN", NULL) == DB_QUERY_TRANSACTION_BEGIN);
+    assert(classify("INSERT INTO t VALUES (1); COMMIT", NULL) == DB_QUERY_WRITE);
+    assert(classify(";", NULL) == DB_QUERY_UNKNOWN);
+
+    // Long statements go through the per-thread verdict cache, twice
+    const char *longer = "SELECT id, name, email FROM users WHERE id = 42; UPDATE users SET seen = now()";
+    assert(strlen(longer) >= DB_CLASSIFY_CACHE_MIN);
+    assert(classify(longer, NULL) == DB_QUERY_WRITE);
+    assert(classify(longer, NULL) == DB_QUERY_WRITE);
+
+    printf("SQL classifier test passed\n");
+}
+
+// The tables of sql as "schema.name name ...", or "-1"
+static const char *query_tables(const char *sql) {
+    static char out[256];
+    db_table_ref_t tables[8];
+    int n = db_protocol_query_tables(sql, strlen(sql), tables, 8);
+    if (n < 0) return "-1";
+
+    size_t len = 0;
+    out[0] = '\0';
+    for (int i = 0; i < n; i++) {
+        len += (size_t)snprintf(out + len, sizeof(out) - len, "%s%.*s%s%.*s", i ? " " : "",
+                                (int)tables[i].schema_length, tables[i].schema ? tables[i].schema : "",
+                                tables[i].schema ? "." : "",
+                                (int)tables[i].name_length, tables[i].name);
+    }
+    return out;
+}
+
+void test_sql_tables() {
+    printf("Testing SQL table extraction...\n");
+
+    assert(strcmp(query_tables("SELECT * FROM t"), "t") == 0);
+    assert(strcmp(query_tables("SELECT * FROM app.users u JOIN \"Orders\" o ON o.uid = u.id"),
+                  "app.users Orders") == 0);
+    assert(strcmp(query_tables("SELECT * FROM a, b AS x, db.s.c WHERE a.id = 1"), "a b s.c") == 0);
+    assert(strcmp(query_tables("SELECT * FROM a LEFT OUTER JOIN b ON true CROSS JOIN c"), "a b c") == 0);
+    assert(strcmp(query_tables("SELECT * FROM ONLY t"), "t") == 0);
+    assert(strcmp(query_tables("INSERT INTO t (a) VALUES (1)"), "t") == 0);
+    assert(strcmp(query_tables("UPDATE t SET a = 1 WHERE b IN (SELECT b FROM u)"), "t u") == 0);
+    assert(strcmp(query_tables("DROP TABLE IF EXISTS t"), "t") == 0);
+    assert(strcmp(query_tables("SELECT 'FROM x' FROM `my tbl`"), "my tbl") == 0);
+    assert(strcmp(query_tables("SELECT 1"), "") == 0);
+
+    // Nested joins, subqueries in FROM and one-word joins can hide tables
+    assert(strcmp(query_tables("SELECT * FROM (t1 JOIN t2 ON true)"), "-1") == 0);
+    assert(strcmp(query_tables("SELECT * FROM t1, (t2 CROSS JOIN t3)"), "-1") == 0);
+    assert(strcmp(query_tables("SELECT * FROM t1 JOIN (SELECT * FROM t2) x ON true"), "-1") == 0);
+    assert(strcmp(query_tables("SELECT * FROM t1, LATERAL (SELECT * FROM t2) x"), "-1") == 0);
+    assert(strcmp(query_tables("SELECT * FROM t1 STRAIGHT_JOIN t2 ON t1.id = t2.id"), "-1") == 0);
+
+    // More tables than the caller has room for
+    assert(strcmp(query_tables("SELECT * FROM a, b, c, d, e, f, g, h, i"), "-1") == 0);
+
+    // Formatting and comments do not change the normalized text
+    char out[128];
+    const char *messy = "  SELECT  *\n\tFROM t /* note */ WHERE a = 'x  y' -- tail\n;";
+    size_t n = db_protocol_normalize_query(DB_PROTOCOL_POSTGRESQL, messy, strlen(messy), out, sizeof(out));
+    assert(n == strlen("SELECT * FROM t WHERE a = 'x  y'") &&
+           memcmp(out, "SELECT * FROM t WHERE a = 'x  y'", n) == 0);
+    const char *hinted = "SELECT /*! STRAIGHT_JOIN */ 1";
+    n = db_protocol_normalize_query(DB_PROTOCOL_MYSQL, hinted, strlen(hinted), out, sizeof(out));
+    assert(n == strlen(hinted) && memcmp(out, hinted, n) == 0);
+    const char *escaped = "SELECT 'a\\' /* x */' b'";
+    n = db_protocol_normalize_query(DB_PROTOCOL_MYSQL, escaped, strlen(escaped), out, sizeof(out));
+    assert(n == strlen(escaped) && memcmp(out, escaped, n) == 0);
+    assert(db_protocol_normalize_query(DB_PROTOCOL_MYSQL, messy, strlen(messy), out, 8) == (size_t)-1);
+
+    printf("SQL table extraction test passed\n");
+}
+
+static db_query_info_t sql_info(db_protocol_type_t protocol, const char *sql) {
+    db_query_info_t info = {.protocol = protocol, .query_text = sql, .query_length = strlen(sql)};
+    info.query_type = db_protocol_classify_query_hint(sql, info.query_length, &info.hint);
+    return info;
+}
+
+static int cache_read(db_cache_t *cache, const char *sql, const char *params,
+                      db_cache_key_t *key, cache_entry_t **entry) {
+    db_query_info_t info = sql_info(DB_PROTOCOL_POSTGRESQL, sql);
+    return db_cache_lookup(cache, &info, params, params ? strlen(params) : 0, key, entry);
+}
+
+// Field n of a key built of length-prefixed fields
+static const char *cache_key_field(const db_cache_key_t *key, int n, size_t *len) {
+    uint32_t off = 0;
+    for (int i = 0; off + 2 <= key->buf.len; i++) {
+        uint16_t flen;
+        memcpy(&flen, key->buf.data + off, 2);
+        assert(off + 2 + flen <= key->buf.len);
+        if (i == n) {
+            *len = flen;
+            return key->buf.data + off + 2;
+        }
+        off += 2 + flen;
+    }
+    return NULL;
+}
+
+static uint64_t cache_write(db_cache_t *cache, const char *sql) {
+    db_query_info_t info = sql_info(DB_PROTOCOL_POSTGRESQL, sql);
+    uint64_t rules = db_cache_written_rules(cache, &info);
+    db_cache_invalidate(cache, rules);
+    return rules;
+}
+
+void test_db_cache() {
+    printf("Testing SQL result cache...\n");
+
+    db_cache_t *cache = db_cache_create("sql", 1024 * 1024, 64 * 1024);
+    assert(cache);
+    db_cache_key_t key;
+    cache_entry_t *entry;
+
+    // Nothing is cached before a rule covers it
+    assert(cache_read(cache, "SELECT * FROM users", NULL, &key, &entry) == DB_CACHE_BYPASS);
+
+    assert(db_cache_add_rule(cache, "users", 60) == 0);
+    assert(db_cache_add_rule(cache, "app.orders", 10) == 0);
+    assert(db_cache_add_rule(cache, "log_*", 0) == 0);
+    assert(db_cache_add_rule(cache, "", 5) == -1);
+    assert(db_cache_add_rule(cache, "app.", 5) == -1);
+    char long_name[DB_CACHE_NAME_MAX + 8];
+    memset(long_name, 'x', sizeof(long_name) - 1);
+    long_name[sizeof(long_name) - 1] = '\0';
+    assert(db_cache_add_rule(cache, long_name, 5) == -1);
+
+    // The key: protocol, normalized text, the bound values, then each
+    // table's rule generation
+    const char *sql = "SELECT  name FROM users -- by id\n WHERE id = $1";
+    assert(cache_read(cache, sql, "42", &key, &entry) == DB_CACHE_MISS && !entry);
+    char text[CACHE_KEY_MAX];
+    size_t text_len = db_protocol_normalize_query(DB_PROTOCOL_POSTGRESQL, sql, strlen(sql),
+                                                  text, sizeof(text));
+    size_t len;
+    const char *field = cache_key_field(&key, 0, &len);
+    assert(field && len == 1 && (uint8_t)field[0] == DB_PROTOCOL_POSTGRESQL);
+    field = cache_key_field(&key, 1, &len);
+    assert(field && len == text_len && memcmp(field, text, len) == 0);
+    assert(memcmp(text, "SELECT name FROM users WHERE id = $1", len) == 0);
+    field = cache_key_field(&key, 2, &len);
+    assert(field && len == 2 && memcmp(field, "42", 2) == 0);
+    field = cache_key_field(&key, 3, &len);
+    uint64_t generation;
+    assert(field && len == sizeof(generation));
+    memcpy(&generation, field, sizeof(generation));
+    assert(generation == 0);
+    assert(!cache_key_field(&key, 4, &len));
+    assert(key.ttl == 60);
+    assert(db_cache_store(cache, &key, "rows:42", 7) == 0);
+
+    // Formatting does not matter, the values and the protocol do
+    assert(cache_read(cache, "SELECT name FROM users WHERE id = $1", "42", &key, &entry) ==
+           DB_CACHE_HIT);
+    assert(entry && entry->data.len == 7 && memcmp(entry->data.ptr, "rows:42", 7) == 0);
+    cache_entry_put(entry);
+    assert(cache_read(cache, "SELECT name FROM users WHERE id = $1", "43", &key, &entry) ==
+           DB_CACHE_MISS);
+    db_query_info_t mysql = sql_info(DB_PROTOCOL_MYSQL, "SELECT name FROM users WHERE id = $1");
+    assert(db_cache_lookup(cache, &mysql, "42", 2, &key, &entry) == DB_CACHE_MISS);
+
+    // The shortest TTL of the tables read; a schema rule wants the schema
+    assert(cache_read(cache, "SELECT * FROM users u JOIN app.orders o ON o.uid = u.id", NULL,
+                      &key, &entry) == DB_CACHE_MISS);
+    assert(key.ttl == 10);
+    assert(cache_key_field(&key, 3, &len) && len == 2 * sizeof(uint64_t));
+    assert(cache_read(cache, "SELECT * FROM orders", NULL, &key, &entry) == DB_CACHE_BYPASS);
+    assert(cache_read(cache, "SELECT * FROM shop.orders", NULL, &key, &entry) == DB_CACHE_BYPASS);
+
+    // A trailing '*' covers any rest of the name, in any case, and no less
+    assert(cache_read(cache, "SELECT * FROM log_2024", NULL, &key, &entry) == DB_CACHE_MISS);
+    assert(key.ttl == cache->store->max_age);
+    assert(cache_read(cache, "SELECT * FROM LOG_Errors", NULL, &key, &entry) == DB_CACHE_MISS);
+    assert(cache_read(cache, "SELECT * FROM log_", NULL, &key, &entry) == DB_CACHE_MISS);
+    assert(cache_read(cache, "SELECT * FROM log", NULL, &key, &entry) == DB_CACHE_BYPASS);
+    assert(cache_read(cache, "SELECT * FROM logs", NULL, &key, &entry) == DB_CACHE_BYPASS);
+
+    // One uncovered table and the read is not cached; nor are writes,
+    // reads sent to the primary, or anything not SQL
+    uint64_t bypassed = atomic_load(&cache->stats.bypassed);
+    assert(cache_read(cache, "SELECT * FROM users JOIN sessions ON sessions.uid = users.id",
+                      NULL, &key, &entry) == DB_CACHE_BYPASS);
+    assert(cache_read(cache, "SELECT /* ub:primary */ name FROM users", NULL, &key, &entry) ==
+           DB_CACHE_BYPASS);
+    assert(cache_read(cache, "UPDATE users SET name = 'x'", NULL, &key, &entry) ==
+           DB_CACHE_BYPASS);
+    db_query_info_t redis = {.protocol = DB_PROTOCOL_REDIS, .query_type = DB_QUERY_READ,
+                             .query_text = "GET users", .query_length = 9};
+    assert(db_cache_lookup(cache, &redis, NULL, 0, &key, &entry) == DB_CACHE_BYPASS);
+    assert(atomic_load(&cache->stats.bypassed) == bypassed + 4);
+
+    // A write to a covered table bumps its rule: the same read misses next
+    assert(cache_read(cache, sql, "42", &key, &entry) == DB_CACHE_HIT);
+    cache_entry_put(entry);
+    assert(cache_write(cache, "UPDATE users SET name = 'y' WHERE id = 42") == 1ULL << 0);
+    assert(cache_read(cache, sql, "42", &key, &entry) == DB_CACHE_MISS);
+    memcpy(&generation, cache_key_field(&key, 3, &len), sizeof(generation));
+    assert(generation == 1);
+    assert(db_cache_store(cache, &key, "rows:y", 6) == 0);
+
+    // Writes elsewhere leave it alone; every rule a table matches is bumped
+    assert(cache_write(cache, "INSERT INTO sessions (uid) VALUES (42)") == 0);
+    assert(cache_write(cache, "SELECT 1") == 0);
+    assert(cache_read(cache, sql, "42", &key, &entry) == DB_CACHE_HIT);
+    assert(entry->data.len == 6);
+    cache_entry_put(entry);
+    assert(cache_write(cache, "DELETE FROM log_2024") == 1ULL << 2);
+    assert(cache_write(cache, "UPDATE app.orders SET paid = true") == 1ULL << 1);
+    assert(cache_write(cache, "INSERT INTO users SELECT * FROM log_import") == 0x5);
+
+    // A statement the classifier cannot place may write anything
+    assert(cache_write(cache, "VACUUM") == 0x7);
+    assert(cache_read(cache, sql, "42", &key, &entry) == DB_CACHE_MISS);
+
+    db_cache_destroy(cache);
+    printf("SQL result cache test passed\n");
+}
+
+// A listener nothing accepts on: the kernel completes the pool's
+// connects, which is all routing needs
+static int db_test_listener(uint16_t *port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(fd >= 0);
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t len = sizeof(addr);
+    assert(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    assert(listen(fd, 128) == 0);
+    assert(getsockname(fd, (struct sockaddr *)&addr, &len) == 0);
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+static db_connection_t *route_pg(db_router_t *router, const char *sql, uint64_t session_id) {
+    uint8_t buf[256];
+    size_t n = strlen(sql) + 1;
+    buf[0] = 'Q';
+    buf[1] = 0;
+    buf[2] = 0;
+    buf[3] = (uint8_t)((n + 4) >> 8);
+    buf[4] = (uint8_t)(n + 4);
+    memcpy(buf + 5, sql, n);
+    return db_router_route_query(router, buf, n + 5, session_id);
+}
+
+static db_session_t *router_session(db_router_t *router, uint64_t session_id) {
+    for (uint32_t i = 0; i < router->max_sessions; i++) {
+        if (router->sessions[i].used && router->sessions[i].session_id == session_id) {
+            return &router->sessions[i];
+        }
+    }
+    return NULL;
+}
+
+// Sticky statement for the session, connection handed straight back
+static void touch_session(db_router_t *router, uint64_t session_id) {
+    db_connection_t *conn = route_pg(router, "SET search_path TO app", session_id);
+    assert(conn);
+    db_router_query_done(router, session_id, conn);
+}
+
+void test_db_router_sessions() {
+    printf("Testing router session table...\n");
+
+    uint16_t port;
+    int listener = db_test_listener(&port);
+    db_pool_t *pool = db_pool_create(64, 0, 64);
+    assert(db_pool_add_backend(pool, "127.0.0.1", port, DB_BACKEND_PRIMARY,
+                               DB_PROTOCOL_POSTGRESQL) == 0);
+
+    // Every session is found by its id, through chains that share buckets
+    db_router_t *router = db_router_create(pool, 64);
+    for (uint64_t id = 1; id <= 64; id++) touch_session(router, id << 20);
+    assert(router->session_count == 64);
+    for (uint64_t id = 1; id <= 64; id += 2) db_router_end_session(router, id << 20);
+    assert(router->session_count == 32);
+    for (uint64_t id = 1; id <= 64; id++) {
+        db_router_set_write_position(router, id << 20, id);
+        db_session_t *session = router_session(router, id << 20);
+        assert((session != NULL) == (id % 2 == 0));
+        if (session) assert(session->write_position == id);
+    }
+    // Freed slots are reused before anything is evicted
+    for (uint64_t id = 1; id <= 64; id += 2) touch_session(router, id << 20);
+    assert(router->session_count == 64);
+    for (uint64_t id = 1; id <= 64; id++) assert(router_session(router, id << 20));
+    db_router_destroy(router);
+
+    // Full: the least recently used idle session makes room
+    router = db_router_create(pool, 3);
+    touch_session(router, 1);
+    touch_session(router, 2);
+    touch_session(router, 3);
+    assert(router->lru_head->session_id == 3 && router->lru_tail->session_id == 1);
+    touch_session(router, 1);
+    assert(router->lru_head->session_id == 1 && router->lru_tail->session_id == 2);
+    touch_session(router, 4);
+    assert(router->session_count == 3);
+    assert(!router_session(router, 2));
+    assert(router_session(router, 1) && router_session(router, 3) && router_session(router, 4));
+
+    // One in a transaction is off the list and outlives idler ones
+    db_connection_t *tx = route_pg(router, "BEGIN", 3);
+    assert(tx && !router_session(router, 3)->in_lru);
+    touch_session(router, 5);
+    assert(!router_session(router, 1));
+    touch_session(router, 6);
+    assert(!router_session(router, 4));
+    assert(router_session(router, 3) && router_session(router, 5) && router_session(router, 6));
+
+    // Back on the list once it commits, at the head
+    db_router_query_done(router, 3, tx);
+    tx = route_pg(router, "COMMIT", 3);
+    assert(tx);
+    db_router_query_done(router, 3, tx);
+    assert(router_session(router, 3)->in_lru && router->lru_head->session_id == 3);
+    touch_session(router, 7);
+    assert(!router_session(router, 5) && router_session(router, 3));
+
+    db_router_destroy(router);
+    db_pool_destroy(pool);
+    close(listener);
+    printf("Router session table test passed\n");
+}
+
+static uint64_t monotonic_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+void test_db_replica_routing() {
+    printf("Testing replica weighting and causal reads...\n");
+
+    uint16_t port;
+    int listener = db_test_listener(&port);
+    db_pool_t *pool = db_pool_create(64, 0, 64);
+    assert(db_pool_add_backend(pool, "127.0.0.1", port, DB_BACKEND_PRIMARY,
+                               DB_PROTOCOL_POSTGRESQL) == 0);
+    assert(db_pool_add_backend(pool, "127.0.0.1", port, DB_BACKEND_REPLICA,
+                               DB_PROTOCOL_POSTGRESQL) == 0);
+    assert(db_pool_add_backend(pool, "127.0.0.1", port, DB_BACKEND_REPLICA,
+                               DB_PROTOCOL_POSTGRESQL) == 0);
+
+    // Past the hard lag a replica keeps DB_REPLICA_WEIGHT_MIN: one read for
+    // every FULL / MIN the caught-up one takes, ties to the lower lag
+    db_pool_set_replica_state(pool, 2, 0, 0);
+    db_pool_set_replica_state(pool, 3, DB_REPLICA_LAG_HARD_MS * 2, 0);
+    db_connection_t *held[32];
+    int n = 0;
+    for (; n < DB_REPLICA_WEIGHT_FULL / DB_REPLICA_WEIGHT_MIN; n++) {
+        held[n] = db_pool_acquire(pool, DB_QUERY_READ, false, 0);
+        assert(held[n] && held[n]->backend_id == 2);
+    }
+    held[n] = db_pool_acquire(pool, DB_QUERY_READ, false, 0);
+    assert(held[n] && held[n]->backend_id == 3);
+    for (int i = 0; i <= n; i++) db_pool_release(pool, held[i]);
+
+    // Between the thresholds the weight falls linearly, 544 of 1024 at 3 s:
+    // the lagging replica gets its first read once the other holds one
+    db_pool_set_replica_state(pool, 3, 3000, 0);
+    held[0] = db_pool_acquire(pool, DB_QUERY_READ, false, 0);
+    held[1] = db_pool_acquire(pool, DB_QUERY_READ, false, 0);
+    assert(held[0]->backend_id == 2 && held[1]->backend_id == 3);
+    db_pool_release(pool, held[0]);
+    db_pool_release(pool, held[1]);
+
+    // A known position: only replicas that replayed up to it qualify
+    db_pool_set_replica_state(pool, 2, 0, 50);
+    db_pool_set_replica_state(pool, 3, 3000, 150);
+    db_causal_t causal = {.position = 100};
+    db_connection_t *conn = db_pool_acquire_causal(pool, DB_QUERY_READ, false, 0, &causal);
+    assert(conn && conn->backend_id == 3);
+    db_pool_release(pool, conn);
+    causal.position = 200;
+    conn = db_pool_acquire_causal(pool, DB_QUERY_READ, false, 0, &causal);
+    assert(conn && conn->backend_id == 1 && conn->backend_role == DB_BACKEND_PRIMARY);
+    db_pool_release(pool, conn);
+
+    // No position: a replica has what was written up to now minus its lag
+    causal = (db_causal_t){.written_ms = monotonic_now_ms() - 1000};
+    conn = db_pool_acquire_causal(pool, DB_QUERY_READ, false, 0, &causal);
+    assert(conn && conn->backend_id == 2);
+    db_pool_release(pool, conn);
+    causal.written_ms = monotonic_now_ms() + 60000;
+    conn = db_pool_acquire_causal(pool, DB_QUERY_READ, false, 0, &causal);
+    assert(conn && conn->backend_id == 1);
+    db_pool_release(pool, conn);
+
+    // Without one the lag ordering applies again, down replicas never
+    db_pool_set_backend_health(pool, 2, false);
+    conn = db_pool_acquire(pool, DB_QUERY_READ, false, 0);
+    assert(conn && conn->backend_id == 3);
+    db_pool_release(pool, conn);
+
+    db_pool_destroy(pool);
+    close(listener);
+    printf("Replica weighting and causal reads test passed\n");
+}
+
+// Two fake cluster nodes on one thread: A owns every slot but sends
+// "moved" to B for good and "asked" to B for one command, which B only
+// serves after ASKING
+typedef struct {
+    int listeners[2];
+    uint16_t ports[2];
+    atomic_bool stop;
+} redis_fake_t;
+
+static char redis_fake_reply[256];
+
+static const char *redis_fake_answer(redis_fake_t *fake, int node, bool *asking,
+                                     const char *name, const char *key) {
+    char *r = redis_fake_reply;
+    if (!strcmp(name, "CLUSTER")) {
+        snprintf(r, sizeof(redis_fake_reply),
+                 "*1\r\n*3\r\n:0\r\n:16383\r\n*2\r\n$9\r\n127.0.0.1\r\n:%u\r\n", fake->ports[0]);
+    } else if (!strcmp(name, "ASKING")) {
+        *asking = true;
+        return "+OK\r\n";
+    } else if (node == 0 && (!strcmp(key, "moved") || !strcmp(key, "asked"))) {
+        snprintf(r, sizeof(redis_fake_reply), "-%s %u 127.0.0.1:%u\r\n",
+                 key[0] == 'm' ? "MOVED" : "ASK",
+                 db_redis_key_slot((const uint8_t *)key, strlen(key)), fake->ports[1]);
+    } else if (node == 1 && !strcmp(key, "asked") && !*asking) {
+        snprintf(r, sizeof(redis_fake_reply), "-MOVED %u 127.0.0.1:%u\r\n",
+                 db_redis_key_slot((const uint8_t *)key, strlen(key)), fake->ports[0]);
+    } else {
+        return node == 0 ? "$1\r\nA\r\n" : "$1\r\nB\r\n";
+    }
+    if (strcmp(name, "ASKING")) *asking = false;
+    return r;
+}
+
+// One "*N $len arg..." command; its first two arguments, NUL terminated
+static size_t redis_fake_command(char *p, size_t len, char **name, char **key) {
+    char *end = p + len, *q = p;
+    if (q >= end || *q != '*') return 0;
+    long argc = strtol(q + 1, &q, 10);
+    *name = *key = "";
+    for (long i = 0; i < argc; i++) {
+        if (end - q < 3 || (q += 2, *q != '$')) return 0;
+        long n = strtol(q + 1, &q, 10);
+        if (end - q < n + 4) return 0;
+        q += 2;
+        if (i == 0) *name = q;
+        if (i == 1) *key = q;
+        q[n] = '\0';
+        q += n;
+    }
+    return end - q >= 2 ? (size_t)(q + 2 - p) : 0;
+}
+
+static void *redis_fake_run(void *arg) {
+    redis_fake_t *fake = arg;
+    struct pollfd fds[10];
+    int node[10];
+    bool asking[10] = {false};
+    char buf[10][4096];
+    size_t have[10] = {0};
+    int n = 2;
+    for (int i = 0; i < 2; i++) {
+        fds[i] = (struct pollfd){.fd = fake->listeners[i], .events = POLLIN};
+        node[i] = i;
+    }
+
+    while (!atomic_load(&fake->stop)) {
+        if (poll(fds, n, 20) <= 0) continue;
+        for (int i = 0; i < n; i++) {
+            if (!(fds[i].revents & POLLIN)) continue;
+            if (i < 2) {
+                int fd = accept(fds[i].fd, NULL, NULL);
+                if (fd >= 0 && n < 10) {
+                    fds[n] = (struct pollfd){.fd = fd, .events = POLLIN};
+                    node[n] = i;
+                    asking[n] = false;
+                    have[n++] = 0;
+                }
+                continue;
+            }
+            ssize_t r = read(fds[i].fd, buf[i] + have[i], sizeof(buf[i]) - 1 - have[i]);
+            if (r <= 0) {
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                continue;
+            }
+            have[i] += (size_t)r;
+            size_t used;
+            char *name, *key;
+            while ((used = redis_fake_command(buf[i], have[i], &name, &key))) {
+                const char *reply = redis_fake_answer(fake, node[i], &asking[i], name, key);
+                assert(write(fds[i].fd, reply, strlen(reply)) == (ssize_t)strlen(reply));
+                memmove(buf[i], buf[i] + used, have[i] - used);
+                have[i] -= used;
+            }
+        }
+    }
+    for (int i = 2; i < n; i++) {
+        if (fds[i].fd >= 0) close(fds[i].fd);
+    }
+    return NULL;
+}
+
+#define REDIS_GET(key) "*2\r\n$3\r\nGET\r\n$" #key "\r\n"
+
+void test_redis_cluster() {
+    printf("Testing Redis Cluster routing...\n");
+
+    // CRC16/XMODEM over the key, or over the first non-empty {tag}
+    assert(db_redis_key_slot((const uint8_t *)"123456789", 9) == 12739);
+    assert(db_redis_key_slot((const uint8_t *)"foo", 3) == 12182);
+    assert(db_redis_key_slot((const uint8_t *)"{user1000}.following", 20) == 3443);
+    assert(db_redis_key_slot((const uint8_t *)"{user1000}.followers", 20) == 3443);
+    assert(db_redis_key_slot((const uint8_t *)"foo{}{bar}", 10) == 8363);
+    assert(db_redis_key_slot((const uint8_t *)"foo{{bar}}zap", 13) == 4015);
+    assert(db_redis_key_slot((const uint8_t *)"foo{bar}{zap}", 13) == 5061);
+
+    redis_fake_t fake;
+    atomic_init(&fake.stop, false);
+    for (int i = 0; i < 2; i++) fake.listeners[i] = db_test_listener(&fake.ports[i]);
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, redis_fake_run, &fake) == 0);
+
+    db_redis_cluster_t *cluster = db_redis_cluster_create("127.0.0.1", fake.ports[0]);
+    db_redis_client_t *client = db_redis_client_create(cluster);
+    db_redis_buf_t out = {0};
+
+    // Half a command waits for the rest
+    const char *partial = "*2\r\n$3\r\nGET\r\n$5\r\nmov";
+    assert(db_redis_execute(client, (const uint8_t *)partial, strlen(partial), &out) == 0);
+    assert(out.len == 0);
+
+    // Replies come back in command order, redirects followed; MOVED
+    // rewrites the slot, ASK does not, MULTI is refused locally
+    const char *batch = REDIS_GET(5) "plain\r\n" REDIS_GET(5) "moved\r\n"
+                        REDIS_GET(5) "asked\r\n" "*1\r\n$5\r\nMULTI\r\n";
+    out.len = 0;
+    assert(db_redis_execute(client, (const uint8_t *)batch, strlen(batch), &out) ==
+           (ssize_t)strlen(batch));
+    const char *want = "$1\r\nA\r\n$1\r\nB\r\n$1\r\nB\r\n-ERR command not supported by the cluster proxy\r\n";
+    assert(out.len == strlen(want) && !memcmp(out.data, want, out.len));
+    assert(atomic_load(&cluster->stats.refreshes) == 1);
+    assert(atomic_load(&cluster->stats.moved) == 1 && atomic_load(&cluster->stats.asked) == 1);
+    assert(atomic_load(&cluster->node_count) == 2);
+    assert(atomic_load(&cluster->slots[1999]) == 1);   // "moved"
+    assert(atomic_load(&cluster->slots[6467]) == 0);   // "asked"
+    assert(atomic_load(&cluster->slots[7143]) == 0);   // "plain"
+
+    // The MOVED marked the map stale: the next batch reloads it first
+    out.len = 0;
+    const char *again = REDIS_GET(5) "plain\r\n";
+    assert(db_redis_execute(client, (const uint8_t *)again, strlen(again), &out) ==
+           (ssize_t)strlen(again));
+    assert(out.len == 7 && !memcmp(out.data, "$1\r\nA\r\n", 7));
+    assert(atomic_load(&cluster->stats.refreshes) == 2);
+    assert(atomic_load(&cluster->slots[1999]) == 0);
+
+    db_redis_client_destroy(client);
+    db_redis_cluster_destroy(cluster);
+    free(out.data);
+    atomic_store(&fake.stop, true);
+    pthread_join(thread, NULL);
+    close(fake.listeners[0]);
+    close(fake.listeners[1]);
+    printf("Redis Cluster routing test passed\n");
+}
+
+static void count_fired(lb_timer_t *timer, void *arg) {
+    (void)timer;
+    (*(int *)arg)++;
+}
+
+// One side of a monitoring connection played from a script: a step waits
+// for the next request if asked to, then sends its bytes. What the client
+// sent is kept to check which statements it chose.
+typedef struct {
+    bool read_first;
+    const uint8_t *data;
+    size_t len;
+} health_fake_step_t;
+
+typedef struct {
+    int listener;
+    const health_fake_step_t *steps;
+    int step_count;
+    char seen[2048];
+    size_t seen_len;
+} health_fake_t;
+
+static bool health_fake_recv(health_fake_t *fake, int fd) {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    if (poll(&pfd, 1, 2000) != 1) return false;
+    ssize_t n = recv(fd, fake->seen + fake->seen_len, sizeof(fake->seen) - fake->seen_len, 0);
+    if (n <= 0) return false;
+    fake->seen_len += (size_t)n;
+    return true;
+}
+
+static void *health_fake_run(void *arg) {
+    health_fake_t *fake = arg;
+    struct pollfd pfd = {.fd = fake->listener, .events = POLLIN};
+    if (poll(&pfd, 1, 2000) != 1) return NULL;
+    int fd = accept(fake->listener, NULL, NULL);
+    if (fd < 0) return NULL;
+
+    for (int i = 0; i < fake->step_count; i++) {
+        const health_fake_step_t *step = &fake->steps[i];
+        if (step->read_first && !health_fake_recv(fake, fd)) break;
+        if (send(fd, step->data, step->len, MSG_NOSIGNAL) != (ssize_t)step->len) break;
+        // Steps without a request in between arrive as separate reads
+        usleep(5000);
+    }
+    while (health_fake_recv(fake, fd)) {}
+    close(fd);
+    return NULL;
+}
+
+static bool health_fake_saw(const health_fake_t *fake, const uint8_t *bytes, size_t len) {
+    return memmem(fake->seen, fake->seen_len, bytes, len) != NULL;
+}
+
+// The lag a one-off check of a replica reads from the script
+static uint64_t health_fake_lag(health_fake_t *fake, db_protocol_type_t protocol,
+                                const health_fake_step_t *steps, int step_count) {
+    uint16_t port;
+    memset(fake, 0, sizeof(*fake));
+    fake->listener = db_test_listener(&port);
+    fake->steps = steps;
+    fake->step_count = step_count;
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, health_fake_run, fake) == 0);
+
+    db_backend_t backend = {.port = port, .role = DB_BACKEND_REPLICA, .protocol = protocol};
+    strcpy(backend.host, "127.0.0.1");
+    uint64_t lag = db_health_check_replication_lag(&backend);
+
+    pthread_join(thread, NULL);
+    close(fake->listener);
+    return lag;
+}
+
+#define HEALTH_BYTES(s) (const uint8_t *)(s), sizeof(s) - 1
+
+void test_db_health_pg() {
+    printf("Testing PostgreSQL monitor replies...\n");
+    health_fake_t fake;
+
+    // AuthenticationOk, a ParameterStatus, ReadyForQuery
+    static const char login[] =
+        "R\0\0\0\x08\0\0\0\0"
+        "S\0\0\0\x18" "server_version\0" "16.1\0"
+        "Z\0\0\0\x05I";
+    // RowDescription (skipped unread), then the DataRow cut in two
+    static const char row_head[] =
+        "T\0\0\0\x06\0\x02"
+        "D\0\0\0\x1b\0\x02\0\0\0\x04" "15";
+    static const char row_tail[] =
+        "00\0\0\0\x09" "123456789"
+        "C\0\0\0\x0d" "SELECT 1\0"
+        "Z\0\0\0\x05I";
+    health_fake_step_t steps[] = {
+        {true, HEALTH_BYTES(login)},
+        {true, HEALTH_BYTES(row_head)},
+        {false, HEALTH_BYTES(row_tail)},
+    };
+    assert(health_fake_lag(&fake, DB_PROTOCOL_POSTGRESQL, steps, 3) == 1500);
+    // StartupMessage for the monitor user, then the one probe query
+    assert(health_fake_saw(&fake, HEALTH_BYTES("user\0monitor\0database\0postgres")));
+    assert(health_fake_saw(&fake, HEALTH_BYTES("pg_last_wal_replay_lsn")));
+
+    // A replica clock slightly ahead shows as no lag
+    static const char ahead[] =
+        "D\0\0\0\x0f\0\x01\0\0\0\x05" "-3.25"
+        "Z\0\0\0\x05I";
+    health_fake_step_t ahead_steps[] = {{true, HEALTH_BYTES(login)}, {true, HEALTH_BYTES(ahead)}};
+    assert(health_fake_lag(&fake, DB_PROTOCOL_POSTGRESQL, ahead_steps, 2) == 0);
+
+    // A NULL lag leaves it unknown, and so does an error
+    static const char null_lag[] =
+        "D\0\0\0\x0a\0\x01\xff\xff\xff\xff"
+        "Z\0\0\0\x05I";
+    health_fake_step_t null_steps[] = {{true, HEALTH_BYTES(login)}, {true, HEALTH_BYTES(null_lag)}};
+    assert(health_fake_lag(&fake, DB_PROTOCOL_POSTGRESQL, null_steps, 2) == UINT64_MAX);
+    static const char error[] = "E\0\0\0\x0cSERROR\0\0";
+    health_fake_step_t error_steps[] = {{true, HEALTH_BYTES(login)}, {true, HEALTH_BYTES(error)}};
+    assert(health_fake_lag(&fake, DB_PROTOCOL_POSTGRESQL, error_steps, 2) == UINT64_MAX);
+
+    // A password request: the monitor user has none to give
+    static const char md5[] = "R\0\0\0\x0c\0\0\0\x05salt";
+    health_fake_step_t md5_steps[] = {{true, HEALTH_BYTES(md5)}};
+    assert(health_fake_lag(&fake, DB_PROTOCOL_POSTGRESQL, md5_steps, 1) == UINT64_MAX);
+    assert(!health_fake_saw(&fake, HEALTH_BYTES("pg_last_wal_replay_lsn")));
+
+    printf("PostgreSQL monitor replies test passed\n");
+}
+
+static size_t mysql_packet(uint8_t *out, uint8_t seq, const void *payload, size_t len) {
+    out[0] = (uint8_t)len;
+    out[1] = (uint8_t)(len >> 8);
+    out[2] = (uint8_t)(len >> 16);
+    out[3] = seq;
+    memcpy(out + 4, payload, len);
+    return len + 4;
+}
+
+// Lengths here stay under 251, so each is one byte
+static size_t mysql_lenenc_str(uint8_t *out, const char *s) {
+    size_t n = strlen(s);
+    out[0] = (uint8_t)n;
+    memcpy(out + 1, s, n);
+    return n + 1;
+}
+
+static size_t mysql_handshake(uint8_t *out, const char *version) {
+    uint8_t p[96] = {10};
+    size_t n = 1;
+    memcpy(p + n, version, strlen(version) + 1);
+    n += strlen(version) + 1 + 4 + 8 + 1 + 2 + 1 + 2 + 2 + 1 + 10 + 13;
+    return mysql_packet(out, 0, p, n);
+}
+
+// Column count, one definition per name, EOF, a row of values, EOF
+static size_t mysql_result(uint8_t *out, const char **names, const char **values, int columns) {
+    uint8_t p[256];
+    size_t n = 0;
+    uint8_t seq = 1;
+    uint8_t count = (uint8_t)columns;
+    n += mysql_packet(out + n, seq++, &count, 1);
+    for (int i = 0; i < columns; i++) {
+        size_t len = mysql_lenenc_str(p, "def");
+        p[len++] = 0;       // schema
+        p[len++] = 0;       // table
+        p[len++] = 0;       // org_table
+        len += mysql_lenenc_str(p + len, names[i]);
+        len += mysql_lenenc_str(p + len, names[i]);
+        p[len++] = 0x0c;
+        memset(p + len, 0, 12);
+        len += 12;
+        n += mysql_packet(out + n, seq++, p, len);
+    }
+    static const uint8_t eof[] = {0xfe, 0, 0, 2, 0};
+    n += mysql_packet(out + n, seq++, eof, sizeof(eof));
+    size_t len = 0;
+    for (int i = 0; i < columns; i++) {
+        if (values[i]) len += mysql_lenenc_str(p + len, values[i]);
+        else p[len++] = 0xfb;
+    }
+    n += mysql_packet(out + n, seq++, p, len);
+    n += mysql_packet(out + n, seq++, eof, sizeof(eof));
+    return n;
+}
+
+typedef struct {
+    uint8_t handshake[128];
+    uint8_t ok[16];
+    uint8_t result[512];
+    health_fake_step_t steps[3];
+} mysql_script_t;
+
+static void mysql_script(mysql_script_t *s, const char *version, const char *lag_name,
+                         const char *lag) {
+    static const uint8_t ok[] = {0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00};
+    const char *names[] = {"Replica_IO_State", lag_name};
+    const char *values[] = {"Waiting for source to send event", lag};
+    s->steps[0] = (health_fake_step_t){false, s->handshake, mysql_handshake(s->handshake, version)};
+    s->steps[1] = (health_fake_step_t){true, s->ok, mysql_packet(s->ok, 2, ok, sizeof(ok))};
+    s->steps[2] = (health_fake_step_t){true, s->result, mysql_result(s->result, names, values, 2)};
+}
+
+void test_db_health_mysql() {
+    printf("Testing MySQL monitor replies...\n");
+    health_fake_t fake;
+    mysql_script_t s;
+
+    // A current server is asked by the new name
+    mysql_script(&s, "8.0.35", "Seconds_Behind_Source", "7");
+    assert(health_fake_lag(&fake, DB_PROTOCOL_MYSQL, s.steps, 3) == 7000);
+    assert(health_fake_saw(&fake, HEALTH_BYTES("monitor\0\0mysql_native_password")));
+    assert(health_fake_saw(&fake, HEALTH_BYTES("SHOW REPLICA STATUS")) &&
+           !health_fake_saw(&fake, HEALTH_BYTES("SLAVE")));
+
+    // Older ones by the old, from the version in the handshake
+    mysql_script(&s, "8.0.21", "Seconds_Behind_Master", "3");
+    assert(health_fake_lag(&fake, DB_PROTOCOL_MYSQL, s.steps, 3) == 3000);
+    assert(health_fake_saw(&fake, HEALTH_BYTES("SHOW SLAVE STATUS")) &&
+           !health_fake_saw(&fake, HEALTH_BYTES("REPLICA")));
+    mysql_script(&s, "5.7.44-log", "Seconds_Behind_Master", "0");
+    assert(health_fake_lag(&fake, DB_PROTOCOL_MYSQL, s.steps, 3) == 0);
+    assert(health_fake_saw(&fake, HEALTH_BYTES("SHOW SLAVE STATUS")));
+    mysql_script(&s, "5.5.5-10.4.12-MariaDB-1:10.4.12+maria~focal", "Seconds_Behind_Master", "2");
+    assert(health_fake_lag(&fake, DB_PROTOCOL_MYSQL, s.steps, 3) == 2000);
+    assert(health_fake_saw(&fake, HEALTH_BYTES("SHOW SLAVE STATUS")) &&
+           !health_fake_saw(&fake, HEALTH_BYTES("REPLICA")));
+    mysql_script(&s, "10.6.16-MariaDB", "Seconds_Behind_Master", "2");
+    assert(health_fake_lag(&fake, DB_PROTOCOL_MYSQL, s.steps, 3) == 2000);
+    assert(health_fake_saw(&fake, HEALTH_BYTES("SHOW REPLICA STATUS")));
+
+    // A version that claims it and a parser that does not: the old name
+    // once ER_PARSE_ERROR comes back
+    static const uint8_t parse_error[] = "\xff\x28\x04#42000You have an error in your SQL syntax";
+    uint8_t refused[64];
+    mysql_script(&s, "8.0.35-fork", "Seconds_Behind_Master", "4");
+    health_fake_step_t fallback[] = {
+        s.steps[0], s.steps[1],
+        {true, refused, mysql_packet(refused, 1, parse_error, sizeof(parse_error) - 1)},
+        s.steps[2],
+    };
+    assert(health_fake_lag(&fake, DB_PROTOCOL_MYSQL, fallback, 4) == 4000);
+    assert(health_fake_saw(&fake, HEALTH_BYTES("SHOW REPLICA STATUS")) &&
+           health_fake_saw(&fake, HEALTH_BYTES("SHOW SLAVE STATUS")));
+
+    // Any other error, or the same one again, takes the monitor down
+    static const uint8_t denied[] = "\xff\x27\x04#42000Access denied; you need REPLICATION CLIENT";
+    mysql_script(&s, "8.0.35", "Seconds_Behind_Source", "1");
+    health_fake_step_t no_privilege[] = {
+        s.steps[0], s.steps[1],
+        {true, refused, mysql_packet(refused, 1, denied, sizeof(denied) - 1)},
+    };
+    assert(health_fake_lag(&fake, DB_PROTOCOL_MYSQL, no_privilege, 3) == UINT64_MAX);
+    assert(!health_fake_saw(&fake, HEALTH_BYTES("SLAVE")));
+    mysql_script(&s, "8.0.21", "Seconds_Behind_Master", "1");
+    health_fake_step_t twice[] = {
+        s.steps[0], s.steps[1],
+        {true, refused, mysql_packet(refused, 1, parse_error, sizeof(parse_error) - 1)},
+    };
+    assert(health_fake_lag(&fake, DB_PROTOCOL_MYSQL, twice, 3) == UINT64_MAX);
+
+    // The SQL thread stopped: no lag to report
+    mysql_script(&s, "8.0.35", "Seconds_Behind_Source", NULL);
+    assert(health_fake_lag(&fake, DB_PROTOCOL_MYSQL, s.steps, 3) == UINT64_MAX);
+
+    printf("MySQL monitor replies test passed\n");
+}
+
+void test_db_health_redis() {
+    printf("Testing Redis monitor replies...\n");
+
+    // The PONG in two reads counts once it is whole
+    health_fake_step_t steps[] = {
+        {true, HEALTH_BYTES("+PO")},
+        {false, HEALTH_BYTES("NG\r\n")},
+    };
+    health_fake_t fake = {0};
+    uint16_t port;
+    fake.listener = db_test_listener(&port);
+    fake.steps = steps;
+    fake.step_count = 2;
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, health_fake_run, &fake) == 0);
+
+    db_pool_t *pool = db_pool_create(4, 0, 4);
+    assert(db_pool_add_backend(pool, "127.0.0.1", port, DB_BACKEND_PRIMARY, DB_PROTOCOL_REDIS) == 0);
+    db_pool_set_backend_health(pool, 1, false);
+    db_health_checker_t *checker = db_health_checker_create(pool, 50, 300, 1000);
+    assert(db_health_checker_start(checker) == 0);
+
+    db_backend_t backend;
+    for (int i = 0; i < 200 && atomic_load(&checker->stats.probes) == 0; i++) usleep(5000);
+    assert(atomic_load(&checker->stats.probes) == 1);
+    assert(db_pool_get_backend(pool, 1, &backend) == 0 && backend.is_healthy);
+
+    // The next PING goes unanswered and the backend goes down with it
+    for (int i = 0; i < 200 && atomic_load(&checker->stats.failures) == 0; i++) usleep(5000);
+    assert(atomic_load(&checker->stats.failures) >= 1);
+    assert(db_pool_get_backend(pool, 1, &backend) == 0 && !backend.is_healthy);
+
+    db_health_checker_stop(checker);
+    db_health_checker_destroy(checker);
+    pthread_join(thread, NULL);
+    assert(health_fake_saw(&fake, HEALTH_BYTES("*1\r\n$4\r\nPING\r\n")));
+    db_pool_destroy(pool);
+    close(fake.listener);
+    printf("Redis monitor replies test passed\n");
+}
+
+void test_timer_wheel() {
+    printf("Testing timer wheel...\n");
+
+    lb_timer_wheel_t wheel;
+    lb_timer_t near = {0}, far = {0}, cancelled = {0};
+    int fired = 0;
+
+    lb_timer_wheel_init(&wheel, 1000);
+    lb_timer_add(&wheel, &near, 1010);
+    lb_timer_add(&wheel, &far, 1000 + 30000);  // third level, must cascade
+    lb_timer_add(&wheel, &cancelled, 1500);
+    lb_timer_cancel(&wheel, &cancelled);
+    assert(lb_timer_next_timeout(&wheel, 1000) == 11);
+
+    lb_timer_advance(&wheel, 1009, count_fired, &fired);
+    assert(fired == 0);
+    lb_timer_advance(&wheel, 1010, count_fired, &fired);
+    assert(fired == 1 && !lb_timer_pending(&near));
+
+    lb_timer_advance(&wheel, 30999, count_fired, &fired);
+    assert(fired == 1 && lb_timer_pending(&far));
+    lb_timer_advance(&wheel, 31000, count_fired, &fired);
+    assert(fired == 2 && wheel.count == 0);
+    assert(lb_timer_next_timeout(&wheel, 1000) == 1000);
+
+    printf("Timer wheel test passed\n");
+}
+
+void test_http_parser() {
+    printf("Testing HTTP header parser...\n");
+
+    static http_msg_t msg;
+    char data[] = "Host: example.com\r\n"
+                  "Content: 1\r\n"
+                  "X-Long-Header-Name-Past-One-Vector: a:b:c\r\n"
+                  "content-length:  12 \r\n"
+                  "Connection: close\r\n"
+                  "\r\n";
+    struct buffer buf = { .area = data, .size = sizeof(data), .data = 40 };
+
+    // Cut mid-header: nothing is consumed until the line is complete
+    assert(http_parse_headers(&msg, &buf) == 0);
+    assert(msg.hdr_count == 2 && msg.next == 31);
+    buf.data = strlen(data);
+    assert(http_parse_headers(&msg, &buf) == 1 && msg.msg_state == HTTP_MSG_BODY);
+
+    assert(msg.hdr_count == 5);
+    assert((msg.flags & HTTP_MSGF_CNT_LEN) && msg.body_len == 12);
+    assert(msg.flags & HTTP_MSGF_CONN_CLO);
+    // Prefixes of known names stay unknown
+    assert(msg.hdrs[1].id == HTTP_HDR_OTHER);
+    assert(msg.hdrs[2].v.len == 5 && memcmp(msg.hdrs[2].v.ptr, "a:b:c", 5) == 0);
+
+    http_hdr_t *host = http_header_find(&msg, HTTP_HDR_HOST);
+    assert(host && host->v.len == 11 && memcmp(host->v.ptr, "example.com", 11) == 0);
+    assert(http_header_find(&msg, HTTP_HDR_COOKIE) == NULL);
+    assert(http_header_id("X-FORWARDED-FOR", 15) == HTTP_HDR_X_FORWARDED_FOR);
+    assert(http_header_id("x-forwarded-fox", 15) == HTTP_HDR_OTHER);
+
+    printf("HTTP header parser test passed\n");
+}
+
+static int hpack_collect(void *arg, const char *name, size_t name_len,
+                         const char *value, size_t value_len) {
+    char *out = arg;
+    size_t n = strlen(out);
+    snprintf(out + n, 512 - n, "%.*s=%.*s;", (int)name_len, name, (int)value_len, value);
+    return 0;
+}
+
+void test_hpack() {
+    printf("Testing HPACK...\n");
+
+    // RFC 7541 C.3: three requests sharing one dynamic table
+    static const uint8_t r1[] = {0x82, 0x86, 0x84, 0x41, 0x0f, 'w', 'w', 'w', '.', 'e', 'x', 'a',
+                                 'm', 'p', 'l', 'e', '.', 'c', 'o', 'm'};
+    static const uint8_t r2[] = {0x82, 0x86, 0x84, 0xbe, 0x58, 0x08, 'n', 'o', '-', 'c', 'a', 'c',
+                                 'h', 'e'};
+    // C.4.3: custom-key: custom-value, Huffman coded
+    static const uint8_t r3[] = {0x82, 0x87, 0x85, 0xbf, 0x40, 0x88, 0x25, 0xa8, 0x49, 0xe9, 0x5b,
+                                 0xa9, 0x7d, 0x7f, 0x89, 0x25, 0xa8, 0x49, 0xe9, 0x5b, 0xb8, 0xe8,
+                                 0xb4, 0xbf};
+    char out[512];
+    lb_hpack_t hp;
+    lb_hpack_init(&hp);
+
+    out[0] = '\0';
+    assert(lb_hpack_decode(&hp, r1, sizeof(r1), hpack_collect, out) == 0);
+    assert(strcmp(out, ":method=GET;:scheme=http;:path=/;:authority=www.example.com;") == 0);
+    assert(hp.count == 1 && hp.size == 57);
+
+    out[0] = '\0';
+    assert(lb_hpack_decode(&hp, r2, sizeof(r2), hpack_collect, out) == 0);
+    assert(strcmp(out, ":method=GET;:scheme=http;:path=/;:authority=www.example.com;"
+                       "cache-control=no-cache;") == 0);
+
+    out[0] = '\0';
+    assert(lb_hpack_decode(&hp, r3, sizeof(r3), hpack_collect, out) == 0);
+    assert(strcmp(out, ":method=GET;:scheme=https;:path=/index.html;:authority=www.example.com;"
+                       "custom-key=custom-value;") == 0);
+    assert(hp.count == 3 && hp.size == 164);
+
+    // Index past the dynamic table
+    static const uint8_t bad[] = {0xc5};
+    assert(lb_hpack_decode(&hp, bad, sizeof(bad), hpack_collect, out) == -1);
+
+    // What the encoder writes decodes back
+    uint8_t block[64];
+    ssize_t n = lb_hpack_encode_status(block, sizeof(block), 200);
+    assert(n == 1 && block[0] == 0x88);
+    ssize_t m = lb_hpack_encode(block + n, sizeof(block) - n, "x-id", 4, "42", 2);
+    assert(m > 0);
+    out[0] = '\0';
+    assert(lb_hpack_decode(&hp, block, n + m, hpack_collect, out) == 0);
+    assert(strcmp(out, ":status=200;x-id=42;") == 0);
+
+    printf("HPACK test passed\n");
+}
+
+static int h2_request_ret;
+static char h2_head[512];
+
+static int h2_test_request(void *ctx, lb_h2_stream_t *st, const char *head, size_t len) {
+    (void)ctx;
+    (void)st;
+    snprintf(h2_head, sizeof(h2_head), "%.*s", (int)len, head);
+    return h2_request_ret;
+}
+
+static int h2_test_body(void *ctx, lb_h2_stream_t *st, const uint8_t *data, size_t len) {
+    (void)ctx;
+    (void)st;
+    (void)data;
+    (void)len;
+    return 0;
+}
+
+static int h2_test_send(void *ctx, const uint8_t *data, size_t len) {
+    (void)ctx;
+    (void)data;
+    (void)len;
+    return 0;
+}
+
+static void h2_test_release(void *ctx, lb_h2_stream_t *st, bool reusable) {
+    (void)ctx;
+    (void)st;
+    (void)reusable;
+}
+
+static int h2_feed_headers(lb_h2_t *h2, uint32_t id, uint8_t flags, const uint8_t *block, size_t len) {
+    uint8_t frame[64] = {0, 0, (uint8_t)len, 0x1, (uint8_t)(0x4 | flags),
+                         (uint8_t)(id >> 24), (uint8_t)(id >> 16), (uint8_t)(id >> 8), (uint8_t)id};
+    memcpy(frame + 9, block, len);
+    return lb_h2_feed(h2, frame, 9 + len);
+}
+
+void test_h2_late_headers() {
+    printf("Testing HTTP/2 HEADERS on reset streams...\n");
+
+    static const lb_h2_ops_t ops = {h2_test_request, h2_test_body, h2_test_send, h2_test_release};
+    lb_h2_t *h2 = lb_h2_create(&ops, NULL);
+    static const uint8_t settings[9] = {0, 0, 0, 0x4, 0, 0, 0, 0, 0};
+    assert(lb_h2_feed(h2, (const uint8_t *)"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n", LB_H2_PREFACE_LEN) == 0);
+    assert(lb_h2_feed(h2, settings, sizeof(settings)) == 0);
+
+    // GET / with a body to come, answered 503 and reset while it is sent
+    static const uint8_t get[] = {0x82, 0x86, 0x84, 0x41, 0x01, 'a'};
+    h2_request_ret = -1;
+    assert(h2_feed_headers(h2, 1, 0, get, sizeof(get)) == 0);
+    assert(h2->active == 0);
+
+    // Its trailers were already on the way: dropped, but their x: y still
+    // enters the dynamic table the next request refers to
+    static const uint8_t trailers[] = {0x40, 0x01, 'x', 0x01, 'y'};
+    assert(h2_feed_headers(h2, 1, 0x1, trailers, sizeof(trailers)) == 0);
+    static const uint8_t indexed[] = {0x82, 0x86, 0x84, 0xbe};
+    h2_request_ret = 0;
+    assert(h2_feed_headers(h2, 7, 0x1, indexed, sizeof(indexed)) == 0);
+    assert(strstr(h2_head, "GET / HTTP/1.1\r\n") && strstr(h2_head, "x: y\r\n"));
+
+    // Stream 5 was skipped, never opened: still a connection error
+    assert(h2_feed_headers(h2, 5, 0x1, indexed, sizeof(indexed)) < 0);
+
+    lb_h2_destroy(h2);
+    printf("HTTP/2 HEADERS on reset streams test passed\n");
+}
+
+void test_regex_set() {
+    printf("Testing regex set...\n");
+
+    static const char *patterns[] = {"^/api/v[0-9]+/", "\\.(png|jpe?g)$", "user-[a-f0-9]{4,8}", "^/$"};
+    regex_set_t *set = regex_set_create();
+    for (int i = 0; i < 4; i++) {
+        assert(regex_set_add(set, patterns[i], strlen(patterns[i]), 0) == i);
+    }
+    // Refused rather than matched wrongly
+    assert(regex_set_add(set, "(a)\\1", 5, 0) == -1);
+    assert(regex_set_add(set, "a\\b", 3, 0) == -1);
+    assert(regex_set_add(set, "[a", 2, 0) == -1);
+    assert(regex_set_compile(set) == 0);
+    assert(regex_set_count(set) == 4);
+
+    uint64_t matched;
+    assert(regex_set_match(set, "/api/v2/user-beef12.png", 23, &matched));
+    assert(matched == 0x7);
+    assert(regex_set_match(set, "/", 1, &matched) && matched == 0x8);
+    assert(regex_set_match(set, "/x/API/v2/a.JPG", 15, &matched) == false && matched == 0);
+    assert(regex_set_match(set, "/user-ab", 8, NULL) == false);
+    regex_set_destroy(set);
+
+    // Anchored and caseless, and enough patterns to split into several sets
+    set = regex_set_create();
+    char buf[32];
+    for (int i = 0; i < 200; i++) {
+        int len = snprintf(buf, sizeof(buf), "/item/%d/.*x", i);
+        assert(regex_set_add(set, buf, len, REGEX_SET_ANCHORED | REGEX_SET_CASELESS) == i);
+    }
+    assert(regex_set_compile(set) == 0);
+    uint64_t words[4];
+    assert(regex_set_words(set) == 4);
+    assert(regex_set_match(set, "/ITEM/137/abcX", 14, words));
+    assert(words[2] == 1ULL << (137 - 128) && words[0] == 0 && words[1] == 0 && words[3] == 0);
+    assert(!regex_set_match(set, "/item/137/abcxy", 15, words));
+    regex_set_destroy(set);
+
+    printf("Regex set test passed\n");
+}
+
+void test_acl_matchers() {
+    printf("Testing compiled ACL matchers...\n");
+
+    ip_tree_t *tree = ip_tree_create();
+    struct in_addr a4;
+    struct in6_addr a6;
+    inet_pton(AF_INET, "10.0.0.0", &a4);
+    assert(ip_tree_add4(tree, a4, 8) == 0);
+    inet_pton(AF_INET, "10.1.2.3", &a4);
+    assert(ip_tree_add4(tree, a4, 32) == 0);
+    inet_pton(AF_INET, "192.168.1.77", &a4);
+    assert(ip_tree_add4(tree, a4, 26) == 0);
+    inet_pton(AF_INET6, "2001:db8::", &a6);
+    assert(ip_tree_add6(tree, &a6, 32) == 0);
+    assert(ip_tree_add4(tree, a4, 33) == -1);
+    assert(ip_tree_compile(tree) == 0);
+
+    inet_pton(AF_INET, "10.200.0.1", &a4);
+    assert(ip_tree_lookup4(tree, a4));
+    inet_pton(AF_INET, "192.168.1.127", &a4);
+    assert(ip_tree_lookup4(tree, a4));
+    inet_pton(AF_INET, "192.168.1.128", &a4);
+    assert(!ip_tree_lookup4(tree, a4));
+    inet_pton(AF_INET6, "2001:db8:1::1", &a6);
+    assert(ip_tree_lookup6(tree, &a6));
+    inet_pton(AF_INET6, "2001:db9::1", &a6);
+    assert(!ip_tree_lookup6(tree, &a6));
+    ip_tree_destroy(tree);
+
+    static const char *paths[] = {"/api/", "/static/", "/admin"};
+    str_match_t *beg = str_match_create(STR_MATCH_BEG);
+    str_match_t *end = str_match_create(STR_MATCH_END);
+    str_match_t *sub = str_match_create(STR_MATCH_SUB);
+    str_match_t *exact = str_match_create(STR_MATCH_EXACT);
+    for (int i = 0; i < 3; i++) {
+        size_t len = strlen(paths[i]);
+        assert(str_match_add(beg, paths[i], len) == 0);
+        assert(str_match_add(end, paths[i], len) == 0);
+        assert(str_match_add(sub, paths[i], len) == 0);
+        assert(str_match_add(exact, paths[i], len) == 0);
+    }
+    assert(str_match_compile(beg) == 0 && str_match_compile(end) == 0);
+    assert(str_match_compile(sub) == 0 && str_match_compile(exact) == 0);
+
+    assert(str_match_exec(beg, "/static/app.js", 14));
+    assert(!str_match_exec(beg, "/v1/api/", 8));
+    assert(str_match_exec(end, "/v1/admin", 9));
+    assert(!str_match_exec(end, "/admin/x", 8));
+    assert(str_match_exec(sub, "/v1/api/users", 13));
+    assert(!str_match_exec(sub, "/v1/ap/i/", 9));
+    assert(str_match_exec(exact, "/admin", 6));
+    assert(!str_match_exec(exact, "/admi", 5));
+    str_match_destroy(beg);
+    str_match_destroy(end);
+    str_match_destroy(sub);
+    str_match_destroy(exact);
+
+    printf("Compiled ACL matchers test passed\n");
+}
+
+// The cache's FNV-1a, for ids that share a shard: at the minimum size a
+// shard has 8 slots, all of them one set
+static uint64_t sess_hash(const unsigned char *id, unsigned int len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (unsigned int i = 0; i < len; i++) {
+        h ^= id[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// The n-th 32-byte id hashing to shard 0
+static void sess_id(unsigned int n, unsigned char id[32]) {
+    memset(id, 0xab, 32);
+    for (uint32_t seq = 0;; seq++) {
+        memcpy(id, &seq, sizeof(seq));
+        if (sess_hash(id, 32) % 64 == 0 && n-- == 0)
+            return;
+    }
+}
+
+// Without a cipher a session does not serialize
+static const SSL_CIPHER *sess_cipher;
+
+static SSL_SESSION *sess_new(unsigned int n, long time, long timeout) {
+    unsigned char id[32], key[48];
+    sess_id(n, id);
+    memset(key, (int)n, sizeof(key));
+    SSL_SESSION *sess = SSL_SESSION_new();
+    assert(sess);
+    assert(SSL_SESSION_set1_id(sess, id, sizeof(id)) == 1);
+    assert(SSL_SESSION_set1_master_key(sess, key, sizeof(key)) == 1);
+    assert(SSL_SESSION_set_protocol_version(sess, TLS1_2_VERSION) == 1);
+    assert(SSL_SESSION_set_cipher(sess, sess_cipher) == 1);
+    SSL_SESSION_set_time(sess, time);
+    SSL_SESSION_set_timeout(sess, timeout);
+    return sess;
+}
+
+static void sess_put(unsigned int n, long time, long timeout) {
+    SSL_SESSION *sess = sess_new(n, time, timeout);
+    assert(ssl_sock_sess_new_cbk(NULL, sess) == 0);
+    SSL_SESSION_free(sess);
+}
+
+// The timeout the cached copy of session n carries, 0 if not cached
+static long sess_cached(unsigned int n) {
+    unsigned char id[32];
+    int copy = 1;
+    sess_id(n, id);
+    SSL_SESSION *sess = ssl_sock_sess_get_cbk(NULL, id, sizeof(id), &copy);
+    assert(copy == 0);
+    if (!sess)
+        return 0;
+    unsigned int len;
+    assert(memcmp(SSL_SESSION_get_id(sess, &len), id, 32) == 0 && len == 32);
+    long timeout = SSL_SESSION_get_timeout(sess);
+    SSL_SESSION_free(sess);
+    return timeout;
+}
+
+static int tkt_key_file(char *path, const char *comment, int key_len, int keys) {
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    FILE *f = fdopen(fd, "w");
+    fputs(comment, f);
+    for (int k = 0; k < keys; k++) {
+        unsigned char raw[64], b64[96];
+        memset(raw, 'a' + k, sizeof(raw));
+        EVP_EncodeBlock(b64, raw, key_len);
+        fprintf(f, "%s\n", b64);
+    }
+    fclose(f);
+    int ret = ssl_ticket_keys_init(path, 0);
+    unlink(path);
+    return ret;
+}
+
+void test_ssl_sess_cache() {
+    printf("Testing SSL session cache...\n");
+
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    SSL *ssl = SSL_new(ctx);
+    sess_cipher = SSL_CIPHER_find(ssl, (const unsigned char *)"\xc0\x2f");
+    assert(sess_cipher);
+
+    long now = (long)time(NULL);
+    assert(ssl_sess_cache_init(0, NULL) == 0);
+
+    // Stored and found again; unknown, wrongly sized and expired ids are not
+    sess_put(0, now, 300);
+    assert(sess_cached(0) == 300);
+    assert(sess_cached(1) == 0);
+    unsigned char id[32];
+    int copy;
+    sess_id(0, id);
+    assert(ssl_sock_sess_get_cbk(NULL, id, 0, &copy) == NULL);
+    assert(ssl_sock_sess_get_cbk(NULL, id, SSL_MAX_SSL_SESSION_ID_LENGTH + 1, &copy) == NULL);
+    sess_put(1, now - 1000, 10);
+    assert(sess_cached(1) == 0);
+
+    // The same id takes its own slot again
+    sess_put(0, now, 400);
+    assert(sess_cached(0) == 400);
+
+    // Fill the set: 0, then the expired 1's slot and six more
+    static const long timeouts[] = {0, 900, 600, 200, 800, 700, 500, 1000};
+    for (unsigned int n = 1; n < 8; n++)
+        sess_put(n, now, timeouts[n]);
+    for (unsigned int n = 1; n < 8; n++)
+        assert(sess_cached(n) == timeouts[n]);
+
+    // Once full, each new session takes the slot closest to expiry
+    sess_put(8, now, 2000);
+    assert(sess_cached(3) == 0 && sess_cached(8) == 2000);
+    sess_put(9, now, 2000);
+    assert(sess_cached(0) == 0 && sess_cached(9) == 2000);
+    sess_put(10, now, 2000);
+    assert(sess_cached(6) == 0 && sess_cached(10) == 2000);
+    assert(sess_cached(2) == 600 && sess_cached(5) == 700 && sess_cached(7) == 1000);
+
+    // Removed sessions are gone, the rest of the set stays
+    SSL_SESSION *sess = sess_new(2, now, 600);
+    ssl_sock_sess_remove_cbk(NULL, sess);
+    SSL_SESSION_free(sess);
+    assert(sess_cached(2) == 0 && sess_cached(5) == 700);
+    ssl_sess_cache_deinit();
+
+    // Processes starting together on a new segment format it once: none
+    // wipes what another already stored
+    char name[64];
+    snprintf(name, sizeof(name), "/ub-sess-test-%d", (int)getpid());
+    shm_unlink(name);
+    int go[2];
+    assert(pipe(go) == 0);
+    pid_t children[4];
+    for (unsigned int c = 0; c < 4; c++) {
+        children[c] = fork();
+        assert(children[c] >= 0);
+        if (children[c] == 0) {
+            char b;
+            close(go[1]);
+            if (read(go[0], &b, 1) != 0 || ssl_sess_cache_init(0, name) < 0)
+                _exit(1);
+            sess_put(20 + c, now, 300);
+            _exit(0);
+        }
+    }
+    close(go[0]);
+    close(go[1]);
+    for (unsigned int c = 0; c < 4; c++) {
+        int status;
+        assert(waitpid(children[c], &status, 0) == children[c]);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+    assert(ssl_sess_cache_init(0, name) == 0);
+    for (unsigned int c = 0; c < 4; c++)
+        assert(sess_cached(20 + c) == 300);
+    ssl_sess_cache_deinit();
+
+    // A segment of another size is replaced
+    assert(ssl_sess_cache_init(4096, name) == 0);
+    assert(sess_cached(20) == 0);
+    sess_put(20, now, 300);
+    ssl_sess_cache_deinit();
+    assert(ssl_sess_cache_init(4096, name) == 0);
+    assert(sess_cached(20) == 300);
+    ssl_sess_cache_deinit();
+    shm_unlink(name);
+
+    // Ticket key files: a key of 47 bytes or no key at all is refused
+    char path[] = "/tmp/ub-tkt-XXXXXX";
+    assert(tkt_key_file(path, "# fleet keys\n\n", 47, 1) == -1);
+    strcpy(path, "/tmp/ub-tkt-XXXXXX");
+    assert(tkt_key_file(path, "# fleet keys\n\n", 48, 0) == -1);
+    strcpy(path, "/tmp/ub-tkt-XXXXXX");
+    assert(tkt_key_file(path, "# fleet keys\n\n", 48, 2) == 0);
+
+    SSL_free(ssl);
+    SSL_CTX_free(ctx);
+
+    printf("SSL session cache test passed\n");
+}
+
 int main() {
     printf("Running UltraBalancer unit tests...\n\n");
 
     test_stick_tables();
+    test_stick_tables_expiry();
+    test_stick_share_count();
+    test_peers();
     test_cache();
+    test_cache_key();
+    test_cache_clock();
+    test_cache_disk();
+    test_cache_collapsed();
+    test_cache_variants();
+    test_cache_stale();
     test_health_checks();
+    test_check_probes();
     test_compression();
+    test_slab_cache();
+    test_consistent_hash();
+    test_p2c_ewma();
+    test_smooth_wrr();
+    test_outlier_ejection();
+    test_slow_start();
+    test_backend_drain();
+    test_backend_admission();
+    test_backend_reload();
+    test_listener_handover();
+    test_memory_pool_buffers();
+    test_memory_pool_classes();
+    test_memory_pool_thread_exit();
+    test_log_ratelimit();
+    test_http1_framer();
+    test_sql_classify();
+    test_sql_tables();
+    test_db_cache();
+    test_db_router_sessions();
+    test_db_replica_routing();
+    test_redis_cluster();
+    test_db_health_pg();
+    test_db_health_mysql();
+    test_db_health_redis();
+    test_request_router();
+    test_rate_limiter();
+    test_histogram();
+    test_idle_ring();
+    test_liveness_watcher();
+    test_db_pool_warmup();
+    test_metrics_handles();
+    test_timer_wheel();
+    test_http_parser();
+    test_hpack();
+    test_h2_late_headers();
+    test_regex_set();
+    test_acl_matchers();
+    test_ssl_sess_cache();
 
     printf("\nAll tests passed!\n");
     return 0;
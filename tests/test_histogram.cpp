@@ -0,0 +1,91 @@
+// Histogram's log-linear buckets, percentiles and tumbling windows,
+// called from test_core.c
+
+#include "stats/histogram.hpp"
+
+#include <cassert>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+using namespace ultrabalancer;
+
+extern "C" void test_histogram(void) {
+    printf("Testing log-linear histogram...\n");
+
+    // 7 bits: a bucket per value under 128, then 64 a power of two
+    Histogram h(60ull * 1000000000, 7);
+    for (uint64_t v = 0; v < 128; v++) assert(h.bucket(v) == v);
+    assert(h.bucket(128) == 128 && h.bucket(129) == 128 && h.bucket(130) == 129);
+    assert(h.bucket(255) == 191 && h.bucket(256) == 192 && h.bucket(259) == 192);
+    assert(Histogram::lowest_value(7, 128) == 128 && Histogram::highest_value(7, 128) == 129);
+    assert(Histogram::lowest_value(7, 191) == 254 && Histogram::highest_value(7, 191) == 255);
+    assert(Histogram::lowest_value(7, 192) == 256 && Histogram::highest_value(7, 192) == 259);
+
+    // Every value lies in its bucket's range, the buckets follow one another
+    // and none is wider than 1/64 of what it holds
+    size_t last = 0;
+    for (uint64_t v = 1; v < (1ull << 40); v += v / 7 + 1) {
+        size_t b = h.bucket(v);
+        uint64_t lo = Histogram::lowest_value(7, b);
+        uint64_t hi = Histogram::highest_value(7, b);
+        assert(lo <= v && v <= hi);
+        assert(b >= last);
+        assert(hi - lo <= lo / 64);
+        assert(Histogram::lowest_value(7, b + 1) == hi + 1);
+        last = b;
+    }
+
+    // Percentiles of 1..100000 us: never under the true one, over it by
+    // less than a bucket
+    for (uint64_t us = 1; us <= 100000; us++) h.record(us * 1000);
+    HistogramSnapshot s = h.current();
+    assert(s.count() == 100000);
+    const double percentiles[] = {1, 50, 90, 99, 99.9, 100};
+    for (double p : percentiles) {
+        uint64_t exact = (uint64_t)(p * 1000) * 1000;
+        uint64_t v = s.value_at(p);
+        assert(v >= exact);
+        assert(v - exact <= exact / 64);
+    }
+    assert(s.min() <= 1000 && s.min() >= 1000 - 1000 / 64);
+    assert(s.max() >= 100000000 && s.max() - 100000000 <= 100000000 / 64);
+    assert(s.value_at(0) == s.value_at(0.0001));
+
+    // Other threads count into their own shards, merged in the window
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&h] {
+            for (int i = 0; i < 25000; i++) h.record(500);
+        });
+    }
+    for (auto& t : threads) t.join();
+    s = h.rotate();
+    assert(s.count() == 200000);
+    // Half the samples are now the 500s, under all the others
+    assert(s.value_at(50) == Histogram::highest_value(7, h.bucket(500)));
+    assert(s.value_at(51) >= 1000 && s.min() == 500);
+
+    // The closed window is cleared: the next one holds only what came after
+    h.record(7);
+    h.record(9);
+    s = h.current();
+    assert(s.count() == 2 && s.min() == 7 && s.max() == 9);
+    s = h.rotate();
+    assert(s.count() == 2 && s.value_at(50) == 7 && s.value_at(100) == 9);
+    s = h.rotate();
+    assert(s.count() == 0 && s.value_at(50) == 0 && s.min() == 0 && s.max() == 0);
+    assert(h.current().count() == 0);
+
+    // Over highest lands in the last bucket
+    Histogram small(1000, 7);
+    small.record(5000);
+    small.record(1000);
+    s = small.rotate();
+    assert(s.count() == 2);
+    assert(s.min() <= 1000 && s.max() >= 1000);
+    assert(s.value_at(50) == s.value_at(100));
+    assert(s.value_at(100) == Histogram::highest_value(7, small.bucket(1000)));
+
+    printf("Log-linear histogram test passed\n");
+}
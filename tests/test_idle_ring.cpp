@@ -0,0 +1,92 @@
+// The database pool's IdleRing, single and multi threaded, called from
+// test_core.c
+
+#include "database/db_pool.hpp"
+
+#include <cassert>
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace ultrabalancer::database;
+
+namespace {
+
+// The ring only moves the pointers around, never follows them
+Connection* item(uintptr_t n) {
+    return reinterpret_cast<Connection*>((n + 1) * 8);
+}
+
+uintptr_t index_of(Connection* conn) {
+    return reinterpret_cast<uintptr_t>(conn) / 8 - 1;
+}
+
+}
+
+extern "C" void test_idle_ring(void) {
+    printf("Testing idle connection ring...\n");
+
+    // 5 rounds up to 8; first in, first out, over many laps of the cells
+    IdleRing ring(5);
+    assert(ring.pop() == nullptr);
+    for (uintptr_t lap = 0; lap < 4; lap++) {
+        for (uintptr_t i = 0; i < 8; i++) assert(ring.push(item(lap * 8 + i)));
+        assert(!ring.push(item(99)));
+        for (uintptr_t i = 0; i < 8; i++) assert(ring.pop() == item(lap * 8 + i));
+        assert(ring.pop() == nullptr);
+    }
+
+    // Two in, one out: still in order, and full once 8 are left in it
+    uintptr_t next_in = 0, next_out = 0;
+    while (ring.push(item(next_in))) {
+        next_in++;
+        if (next_in % 2 == 0) assert(ring.pop() == item(next_out++));
+    }
+    assert(next_in - next_out == 8);
+    while (Connection* conn = ring.pop()) assert(conn == item(next_out++));
+    assert(next_out == next_in);
+
+    // A single cell would take a second push over the first
+    IdleRing small(1);
+    assert(small.push(item(1)) && small.push(item(2)) && !small.push(item(3)));
+    assert(small.pop() == item(1) && small.pop() == item(2) && small.pop() == nullptr);
+
+    // Producers and consumers at once on a small ring: everything pushed
+    // comes out exactly once
+    constexpr uintptr_t kThreads = 4;
+    constexpr uintptr_t kPerThread = 50000;
+    constexpr uintptr_t kTotal = kThreads * kPerThread;
+    IdleRing shared(16);
+    auto seen = std::make_unique<std::atomic<uint32_t>[]>(kTotal);
+    std::atomic<uintptr_t> popped{0};
+
+    std::vector<std::thread> threads;
+    for (uintptr_t t = 0; t < kThreads; t++) {
+        threads.emplace_back([&, t] {
+            for (uintptr_t i = 0; i < kPerThread; i++) {
+                while (!shared.push(item(t * kPerThread + i))) std::this_thread::yield();
+            }
+        });
+        threads.emplace_back([&] {
+            while (popped.load(std::memory_order_relaxed) < kTotal) {
+                Connection* conn = shared.pop();
+                if (!conn) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                uintptr_t n = index_of(conn);
+                assert(n < kTotal);
+                seen[n].fetch_add(1, std::memory_order_relaxed);
+                popped.fetch_add(1, std::memory_order_relaxed);
+            }
+        });
+    }
+    for (auto& t : threads) t.join();
+
+    assert(popped.load() == kTotal);
+    for (uintptr_t i = 0; i < kTotal; i++) assert(seen[i].load() == 1);
+    assert(shared.pop() == nullptr);
+
+    printf("Idle connection ring test passed\n");
+}
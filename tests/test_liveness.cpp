@@ -0,0 +1,82 @@
+// LivenessWatcher on socketpairs, called from test_core.c
+
+#include "core/liveness.hpp"
+
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+using namespace ultrabalancer;
+
+namespace {
+
+bool wait_dead(const LivenessWatcher& watcher, uint32_t slot) {
+    for (int i = 0; i < 200; i++) {
+        if (!watcher.alive(slot)) return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    return false;
+}
+
+}
+
+extern "C" void test_liveness_watcher(void) {
+    printf("Testing liveness watcher...\n");
+
+    std::atomic<int> evictions{0};
+    LivenessWatcher watcher([&] { evictions.fetch_add(1); });
+    assert(watcher.watch(-1) == LivenessWatcher::kNoSlot);
+
+    // Traffic on a parked socket does not wake the watcher, the peer
+    // closing it does
+    int pair[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+    uint32_t slot = watcher.watch(pair[0]);
+    assert(slot != LivenessWatcher::kNoSlot && watcher.alive(slot));
+    assert(write(pair[1], "x", 1) == 1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    assert(watcher.alive(slot) && watcher.hangups() == 0 && evictions.load() == 0);
+
+    close(pair[1]);
+    assert(wait_dead(watcher, slot));
+    for (int i = 0; i < 200 && evictions.load() == 0; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    assert(watcher.hangups() == 1 && evictions.load() == 1);
+    watcher.unwatch(slot);
+    close(pair[0]);
+
+    // A slot given up while its socket is still registered goes to the
+    // next socket; the old one's hangup carries the old generation
+    int old_pair[2], new_pair[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, old_pair) == 0);
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, new_pair) == 0);
+    uint32_t stale = watcher.watch(old_pair[0]);
+    watcher.unwatch(stale);
+    uint32_t reused = watcher.watch(new_pair[0]);
+    assert(reused == stale && watcher.alive(reused));
+
+    close(old_pair[1]);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    assert(watcher.alive(reused));
+    assert(watcher.hangups() == 1 && evictions.load() == 1);
+
+    close(new_pair[1]);
+    assert(wait_dead(watcher, reused));
+    assert(watcher.hangups() == 2);
+    watcher.unwatch(reused);
+    close(old_pair[0]);
+    close(new_pair[0]);
+
+    // Stopped, it takes no more sockets and calls nothing
+    watcher.stop();
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+    assert(watcher.watch(pair[0]) == LivenessWatcher::kNoSlot);
+    close(pair[0]);
+    close(pair[1]);
+
+    printf("Liveness watcher test passed\n");
+}
@@ -0,0 +1,101 @@
+// MetricsAggregator's handles and Metric::reset, called from test_core.c
+
+#include "stats/metrics_aggregator.hpp"
+
+#include <cassert>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+using namespace ultrabalancer;
+
+namespace {
+
+template <typename F>
+void on_threads(int n, F body) {
+    std::vector<std::thread> threads;
+    for (int t = 0; t < n; t++) threads.emplace_back(body, t);
+    for (auto& t : threads) t.join();
+}
+
+}
+
+extern "C" void test_metrics_handles(void) {
+    printf("Testing metrics handles...\n");
+
+    MetricsAggregator& metrics = MetricsAggregator::instance();
+
+    // One metric per name, whoever asks and however: handles and the by-name
+    // calls all land in it
+    Counter counter = metrics.counter("test.handles.counter");
+    assert(counter);
+    std::shared_ptr<Metric> metric = metrics.get_metric("test.handles.counter");
+    assert(metric && metric->type() == Metric::COUNTER);
+    metrics.increment_counter("test.handles.counter", 2.0);
+    metrics.counter("test.handles.counter").increment(4.0);
+    assert(metric->get_count() == 2 && metric->get_mean() == 3.0);
+
+    // More threads than slots add up: every increment counted once, the sums
+    // of all the slots making the mean
+    constexpr int kThreads = Metric::kSlots + 4;
+    constexpr int kPerThread = 20000;
+    on_threads(kThreads, [&](int t) {
+        for (int i = 0; i < kPerThread; i++) counter.increment(t % 2 ? 1.5 : 0.5);
+    });
+    uint64_t count = 2 + (uint64_t)kThreads * kPerThread;
+    assert(metric->get_count() == count);
+    double sum = 6.0 + (double)kThreads / 2 * kPerThread * (1.5 + 0.5);
+    assert(metric->get_mean() == sum / count);
+
+    // Timers from many threads: 1 to 100 ms, 40 times each
+    Timer timer = metrics.timer("test.handles.timer");
+    std::shared_ptr<Metric> timed = metrics.get_metric("test.handles.timer");
+    on_threads(4, [&](int) {
+        for (int round = 0; round < 10; round++) {
+            for (int ms = 1; ms <= 100; ms++) timer.record(std::chrono::milliseconds(ms));
+        }
+    });
+    assert(timed->type() == Metric::TIMER && timed->get_count() == 4000);
+    assert(timed->get_mean() == 50.5);
+    std::vector<double> p = timed->get_percentiles({50, 99});
+    assert(p[0] >= 50 && p[0] <= 50 + 50.0 / 64);
+    assert(p[1] >= 99 && p[1] <= 99 + 99.0 / 64);
+    {
+        ScopedTimer scoped(timer);
+    }
+    assert(timed->get_count() == 4001);
+
+    Gauge gauge = metrics.gauge("test.handles.gauge");
+    gauge.set(42.0);
+    assert(metrics.get_metric("test.handles.gauge")->get_gauge() == 42.0);
+
+    // A default constructed handle goes nowhere
+    Counter none;
+    assert(!none && !Gauge() && !Timer());
+    none.increment();
+    Gauge().set(1.0);
+    Timer().record(std::chrono::milliseconds(1));
+
+    // Reset zeroes every slot, the gauge and the samples; the handles still
+    // update the same metric afterwards
+    metric->reset();
+    assert(metric->get_count() == 0 && metric->get_mean() == 0.0);
+    counter.increment(8.0);
+    assert(metric->get_count() == 1 && metric->get_mean() == 8.0);
+
+    metrics.reset_stats();
+    assert(metric->get_count() == 0);
+    assert(timed->get_count() == 0 && timed->get_mean() == 0.0);
+    p = timed->get_percentiles({50, 99});
+    assert(p[0] == 0.0 && p[1] == 0.0);
+    assert(metrics.get_metric("test.handles.gauge")->get_gauge() == 0.0);
+
+    timer.record(std::chrono::milliseconds(7));
+    assert(timed->get_count() == 1 && timed->get_mean() == 7.0);
+    p = timed->get_percentiles({50});
+    assert(p[0] >= 7 && p[0] <= 7 + 7.0 / 64);
+    gauge.set(3.0);
+    assert(metrics.get_metric("test.handles.gauge")->get_gauge() == 3.0);
+
+    printf("Metrics handles test passed\n");
+}
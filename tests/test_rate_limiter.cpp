@@ -0,0 +1,91 @@
+// RateLimiter's GCRA bucket and its per-shard leases, called from
+// test_core.c
+
+#include "core/rate_limiter.hpp"
+
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+using namespace ultrabalancer;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+uint64_t drain(RateLimiter& limiter, uint64_t max) {
+    uint64_t n = 0;
+    while (n < max && limiter.try_acquire()) n++;
+    return n;
+}
+
+}
+
+extern "C" void test_rate_limiter(void) {
+    printf("Testing GCRA rate limiter...\n");
+
+    // Under 1000 a second every lease is one token: the bucket itself
+    // answers, the burst and no more, however fast the calls come
+    RateLimiter slow(10, 5);
+    assert(slow.rate() == 10 && slow.local_rate() == 10);
+    assert(drain(slow, 100) == 5);
+    assert(!slow.try_acquire());
+    assert(slow.allowed() == 5 && slow.refused() == 2);
+
+    // One emission interval later, exactly one more
+    std::this_thread::sleep_for(std::chrono::milliseconds(110));
+    assert(slow.try_acquire());
+    assert(!slow.try_acquire());
+
+    // Idle for longer than the burst takes to refill, it caps at the burst
+    std::this_thread::sleep_for(std::chrono::milliseconds(700));
+    assert(drain(slow, 100) == 5);
+
+    // A burst of 0 is a second of the rate; a rate of 0 refuses everything
+    RateLimiter second(20);
+    assert(drain(second, 100) == 20);
+    RateLimiter none(0);
+    assert(!none.try_acquire());
+    assert(none.allowed() == 0 && none.refused() == 1);
+
+    // 8000 a second leases 8 tokens a shard, the whole burst: the first
+    // call takes all of it from the bucket and the next 7 never touch it
+    RateLimiter fast(8000, 8);
+    assert(fast.try_acquire());
+    assert(fast.allowed() == 8);
+    for (int i = 0; i < 7; i++) assert(fast.try_acquire());
+    assert(fast.allowed() == 8);
+
+    // Another thread draws on its own shard, so what this one leased is
+    // not its to spend: it gets only what the bucket refilled since
+    auto start = Clock::now();
+    uint64_t other = 0;
+    std::thread([&] { other = drain(fast, 1000); }).join();
+    double elapsed_ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    assert(other <= (uint64_t)(elapsed_ms * 8) + 8);
+    assert(fast.allowed() >= 8 + other);
+
+    // Two shards spending at once stay within the rate: the burst, what
+    // the elapsed time refilled and a lease left unspent per shard
+    RateLimiter shared(8000, 8);
+    std::atomic<uint64_t> spent{0};
+    start = Clock::now();
+    auto spend = [&] {
+        while (Clock::now() - start < std::chrono::milliseconds(100)) {
+            if (shared.try_acquire()) spent.fetch_add(1, std::memory_order_relaxed);
+        }
+    };
+    std::thread a(spend), b(spend);
+    a.join();
+    b.join();
+    elapsed_ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    uint64_t ceiling = (uint64_t)(elapsed_ms * 8) + 8;
+    assert(spent.load() <= ceiling);
+    assert(shared.allowed() <= ceiling + 2 * RateLimiter::kMaxLease);
+    assert(shared.allowed() >= spent.load());
+    assert(spent.load() >= 400);
+    assert(shared.refused() > 0);
+
+    printf("GCRA rate limiter test passed\n");
+}
@@ -0,0 +1,114 @@
+// RequestRouter behaviour through its compiled index, called from
+// test_core.c
+
+#include "core/request_router.hpp"
+
+#include <cassert>
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+
+using namespace ultrabalancer;
+
+namespace {
+
+using Headers = std::unordered_map<std::string, std::string>;
+
+void add(RequestRouter& router, const std::string& name, int priority,
+         std::initializer_list<std::pair<RouteRule::MatchType, std::string>> rules) {
+    auto route = std::make_shared<Route>(name);
+    route->set_priority(priority);
+    for (const auto& [type, pattern] : rules) {
+        route->add_rule(std::make_shared<RouteRule>(type, pattern));
+    }
+    route->add_target(std::make_shared<RouteTarget>(name));
+    router.add_route(route);
+}
+
+std::string routed(RequestRouter& router, const std::string& method, const std::string& path,
+                   const Headers& headers = {}) {
+    auto target = router.route_request(method, path, headers);
+    return target ? target->get_backend() : "";
+}
+
+}
+
+extern "C" void test_request_router(void) {
+    printf("Testing compiled request router...\n");
+
+    using T = RouteRule::MatchType;
+    RequestRouter router;
+    router.set_default_backend("fallback");
+
+    // Paths sharing "/ap" split the trie edge; the walk collects every
+    // prefix along the path and the exact match at its end
+    add(router, "api", 30, {{T::EXACT, "/api"}});
+    add(router, "api-any", 10, {{T::PREFIX, "/api/"}});
+    add(router, "api-v1", 20, {{T::PREFIX, "/api/v1/"}});
+    add(router, "apx", 0, {{T::PREFIX, "/apx"}});
+    add(router, "root", 0, {{T::EXACT, "/"}});
+
+    assert(routed(router, "GET", "/api") == "api");
+    assert(routed(router, "GET", "/api/") == "api-any");
+    assert(routed(router, "GET", "/api/v1/items") == "api-v1");
+    assert(routed(router, "GET", "/api/v2/items") == "api-any");
+    assert(routed(router, "GET", "/apx/1") == "apx");
+    assert(routed(router, "GET", "/") == "root");
+    assert(routed(router, "GET", "/ap") == "fallback");
+    assert(routed(router, "GET", "/api/v1") == "api-any");
+
+    // One perfect hash probe per method; a higher priority method route
+    // wins over the path routes that also match
+    const char* methods[] = {"DELETE", "PUT", "PATCH", "OPTIONS", "TRACE", "CONNECT", "PROPFIND"};
+    for (const char* method : methods) {
+        add(router, std::string("m-") + method, 100, {{T::METHOD, method}});
+    }
+    for (const char* method : methods) {
+        assert(routed(router, method, "/api/v1/items") == std::string("m-") + method);
+    }
+    assert(routed(router, "GET", "/api/v1/items") == "api-v1");
+    assert(routed(router, "BREW", "/elsewhere") == "fallback");
+
+    // Header routes are keyed by name and value together, never by the
+    // two run into one another
+    for (int i = 0; i < 16; i++) {
+        add(router, "tenant" + std::to_string(i), 5, {{T::HEADER, "x-tenant:t" + std::to_string(i)}});
+    }
+    add(router, "x-a", 5, {{T::HEADER, "x-a:bc"}});
+    add(router, "x-ab", 5, {{T::HEADER, "x-ab:c"}});
+    assert(routed(router, "GET", "/other", {{"x-tenant", "t7"}}) == "tenant7");
+    assert(routed(router, "GET", "/other", {{"x-tenant", "t15"}}) == "tenant15");
+    assert(routed(router, "GET", "/other", {{"x-tenant", "t16"}}) == "fallback");
+    assert(routed(router, "GET", "/other", {{"x-ab", "c"}}) == "x-ab");
+    assert(routed(router, "GET", "/other", {{"x-a", "b"}}) == "fallback");
+
+    // Indexed by its path, narrowed by the header it also requires
+    add(router, "shop-beta", 50, {{T::PREFIX, "/shop/"}, {T::HEADER, "x-beta:1"}});
+    add(router, "shop", 0, {{T::PREFIX, "/shop/"}});
+    assert(routed(router, "GET", "/shop/cart") == "shop");
+    assert(routed(router, "GET", "/shop/cart", {{"x-beta", "1"}}) == "shop-beta");
+    assert(routed(router, "GET", "/shop/cart", {{"x-beta", "0"}}) == "shop");
+
+    // Regex routes come from one scan of the set, anchored at both ends
+    add(router, "users", 0, {{T::REGEX, "^/users/[0-9]+$"}});
+    assert(routed(router, "GET", "/users/12") == "users");
+    assert(routed(router, "GET", "/users/12/posts") == "fallback");
+    assert(routed(router, "GET", "/users/x") == "fallback");
+
+    // A change recompiles the table for the next request
+    router.remove_route("api-v1");
+    assert(routed(router, "GET", "/api/v1/items") == "api-any");
+    router.remove_route("m-DELETE");
+    assert(routed(router, "DELETE", "/api") == "api");
+    router.remove_route("tenant7");
+    assert(routed(router, "GET", "/other", {{"x-tenant", "t7"}}) == "fallback");
+    assert(routed(router, "GET", "/other", {{"x-tenant", "t8"}}) == "tenant8");
+
+    // An empty router has only the default
+    RequestRouter empty;
+    assert(routed(empty, "GET", "/") == "");
+    empty.set_default_backend("fallback");
+    assert(routed(empty, "GET", "/") == "fallback");
+
+    printf("Compiled request router test passed\n");
+}